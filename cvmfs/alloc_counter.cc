@@ -0,0 +1,90 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Replaces the global operator new and delete if CVMFS_ALLOC_COUNTER is
+ * defined.  The counter is thread-local, which costs an increment per
+ * allocation and no locking.
+ */
+
+#include "cvmfs_config.h"
+#include "alloc_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace alloc_counter {
+
+#ifdef CVMFS_ALLOC_COUNTER
+
+__thread uint64_t num_allocations_ = 0;
+
+bool IsEnabled() {
+  return true;
+}
+
+uint64_t GetThreadAllocations() {
+  return num_allocations_;
+}
+
+static inline void *Allocate(const size_t size) {
+  num_allocations_++;
+  return malloc(size ? size : 1);
+}
+
+#else
+
+bool IsEnabled() {
+  return false;
+}
+
+uint64_t GetThreadAllocations() {
+  return 0;
+}
+
+#endif
+
+}  // namespace alloc_counter
+
+
+#ifdef CVMFS_ALLOC_COUNTER
+
+// The module is built without exceptions, out of memory aborts like smalloc
+void *operator new(size_t size) {
+  void *result = alloc_counter::Allocate(size);
+  if (result == NULL)
+    abort();
+  return result;
+}
+
+void *operator new[](size_t size) {
+  void *result = alloc_counter::Allocate(size);
+  if (result == NULL)
+    abort();
+  return result;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) throw() {
+  return alloc_counter::Allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) throw() {
+  return alloc_counter::Allocate(size);
+}
+
+void operator delete(void *ptr) throw() {
+  free(ptr);
+}
+
+void operator delete[](void *ptr) throw() {
+  free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) throw() {
+  free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) throw() {
+  free(ptr);
+}
+
+#endif  // CVMFS_ALLOC_COUNTER
@@ -0,0 +1,24 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Counts the heap allocations through operator new per thread, so that the
+ * allocations of a file system call can be attributed to it.  Allocations
+ * by malloc(), e.g. of SQlite, are not counted.  Only linked into the Fuse
+ * module.  The counter replaces the global operator new, it is compiled in
+ * for debug builds and with the ALLOC_COUNTER build option only
+ * (CVMFS_ALLOC_COUNTER).  Otherwise nothing is counted.
+ */
+
+#ifndef CVMFS_ALLOC_COUNTER_H_
+#define CVMFS_ALLOC_COUNTER_H_
+
+#include <stdint.h>
+
+namespace alloc_counter {
+
+bool IsEnabled();
+uint64_t GetThreadAllocations();
+
+}  // namespace alloc_counter
+
+#endif  // CVMFS_ALLOC_COUNTER_H_
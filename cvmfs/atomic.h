@@ -73,4 +73,26 @@ static int32_t inline __attribute__((used)) atomic_cas32(atomic_int32 *a,
   return __sync_bool_compare_and_swap(a, cmp, newval);
 }
 
+
+static int64_t inline __attribute__((used)) atomic_cas64(atomic_int64 *a,
+                                                         int64_t cmp,
+                                                         int64_t newval)
+{
+  return __sync_bool_compare_and_swap(a, cmp, newval);
+}
+
+
+static void inline __attribute__((used)) atomic_write32(atomic_int32 *a,
+                                                        int32_t value)
+{
+  while (!atomic_cas32(a, atomic_read32(a), value)) { }
+}
+
+
+static void inline __attribute__((used)) atomic_write64(atomic_int64 *a,
+                                                        int64_t value)
+{
+  while (!atomic_cas64(a, atomic_read64(a), value)) { }
+}
+
 #endif  // CVMFS_ATOMIC_H_
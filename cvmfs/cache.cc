@@ -10,7 +10,11 @@
  *   -# If it is in local cache: return file descriptor
  *   -# Otherwise download, store in cache and return fd
  *
- * Each running CVMFS instance has to have a separate cache directory.
+ * Each running CVMFS instance has to have a separate cache directory, unless
+ * the cache is shared.  In a shared cache, all repositories store their
+ * objects in the same content-addressed directory, so an object that several
+ * repositories refer to is stored once.  A per-object lock file in the txn
+ * directory makes sure that it is downloaded by only one instance, too.
  * The local cache directory (directories 00..ff) can be accessed
  * in parallel to a running CVMFS, i.e. files can be deleted for instance
  * anytime.  However, this will confuse the cache database managed by the lru
@@ -20,8 +24,13 @@
  * point they are renamed into their "real" content hash names atomically by
  * rename().  This concept is taken over from GROW-FS.
  *
+ * Small objects can additionally be held in memory, see InitMemoryTier().
+ * Data objects can be stored compressed, see InitCompression().
+ *
  * Identical URLs won't be concurrently downloaded.  The first thread performs
- * the download and informs the other, waiting threads on pipes.
+ * the download and hands out duplicates of its file descriptor to the other,
+ * waiting threads.  The table of running downloads is sharded by content hash,
+ * so that unrelated downloads don't contend for the same lock.
  */
 
 #define __STDC_FORMAT_MACROS
@@ -29,19 +38,26 @@
 #include "cvmfs_config.h"
 #include "cache.h"
 
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <dirent.h>
 #include <inttypes.h>
 
+#include <alloca.h>
+
 #include <cassert>
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 
+#include <algorithm>
+#include <list>
 #include <map>
+#include <set>
 #include <vector>
 
 #include "platform.h"
@@ -58,6 +74,9 @@
 #include "shortstring.h"
 #include "manifest.h"
 #include "manifest_fetch.h"
+#include "peers.h"
+#include "prefix_accounting.h"
+#include "catalog_delta.h"
 
 using namespace std;  // NOLINT
 
@@ -67,38 +86,350 @@ namespace cache {
  * Everything that should be reused per thread
  */
 struct ThreadLocalStorage {
-  int pipe_wait[2];
-  vector<int> other_pipes_waiting;
   download::JobInfo download_job;
 };
 
-typedef map< hash::Any, vector<int> * > ThreadQueues;
+/**
+ * A download in flight.  Threads asking for the same chunk wait on cond until
+ * the downloading thread has set done.  The downloading thread leaves one
+ * duplicate of the resulting file descriptor (or the error code) per waiter
+ * in results.  The last one to let go deletes the object.
+ */
+struct InflightDownload {
+  InflightDownload() : done(false), num_refs(1) {
+    int retval = pthread_cond_init(&cond, NULL);
+    assert(retval == 0);
+  }
+  ~InflightDownload() {
+    pthread_cond_destroy(&cond);
+  }
+  pthread_cond_t cond;
+  bool done;
+  unsigned num_refs;  /**< downloading thread plus waiters */
+  vector<int> results;
+  /**
+   * Set while the downloaded object waits in its transaction for
+   * CommitTransactions(), see FetchDeferred()
+   */
+  string deferred_path;
+};
+
+typedef map<hash::Any, InflightDownload *> InflightMap;
+
+/**
+ * A download that is read while it is in progress.  The worker thread
+ * downloads into the transaction file as usual; reads are served by pread()
+ * on a second descriptor of the transaction file once enough bytes have
+ * landed.  The hash is still verified before the file is committed.  If the
+ * download fails, all further reads fail with EIO.  The open file and the
+ * worker hold a reference each.
+ */
+struct StreamingFetch {
+  StreamingFetch(const hash::Any &c, const uint64_t s, const string &p) :
+    checksum(c), size(s), cvmfs_path(p), fd(-1), written(0), done(false),
+    result(0), num_refs(2)
+  {
+    int retval = pthread_mutex_init(&lock, NULL);
+    retval |= pthread_cond_init(&cond, NULL);
+    assert(retval == 0);
+  }
+  ~StreamingFetch() {
+    if (fd >= 0)
+      close(fd);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+  hash::Any checksum;
+  uint64_t size;
+  string cvmfs_path;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;  /**< read-only, set once */
+  int64_t written;  /**< bytes readable from fd */
+  bool done;
+  int result;  /**< 0 or negative error code once done */
+  unsigned num_refs;
+};
+
+/**
+ * Part of the in-flight table, selected by the first byte of the content hash
+ */
+struct DownloadShard {
+  pthread_mutex_t lock;
+  InflightMap inflight;
+};
 
+const unsigned kNumDownloadShards = 32;
 string *cache_path_ = NULL;
-ThreadQueues *queues_download_ = NULL;  /**< maps currently
-  downloaded chunks to an array of writer's ends of a pipe to signal the waiting
-  threads when the download has finished */
-pthread_mutex_t lock_queues_download_ = PTHREAD_MUTEX_INITIALIZER;
+bool shared_ = false;  /**< other cvmfs instances use the cache directory */
+bool compressed_reads_ = false;  /**< open objects with kCompressedSuffix */
+atomic_int64 num_shared_;  /**< Fetches satisfied by another instance */
+DownloadShard *download_shards_ = NULL;
 pthread_key_t thread_local_storage_;
 atomic_int64 num_download_;
+atomic_int64 num_coalesced_;  /**< Fetches satisfied by another's download */
+atomic_int64 num_peer_;  /**< Fetches satisfied by a LAN peer */
+atomic_int64 num_contended_;  /**< Shard lock was taken by another thread */
+const unsigned kMaxStreaming = 64;  /**< concurrently streamed downloads */
+unsigned num_streaming_ = 0;  /**< running streaming workers */
+pthread_mutex_t lock_streaming_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_streaming_ = PTHREAD_COND_INITIALIZER;
+atomic_int64 num_streamed_;
+atomic_int64 num_batches_;  /**< CommitTransactions() calls */
+atomic_int64 num_batched_;  /**< objects committed in batches */
+std::set<hash::Any> *bundles_inflight_ = NULL;
+pthread_mutex_t lock_bundles_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_bundles_ = PTHREAD_COND_INITIALIZER;
+atomic_int64 num_bundles_;  /**< downloaded bundles */
+atomic_int64 num_bundled_;  /**< objects cached from bundles */
+atomic_int64 num_bundles_failed_;
+
+
+/**
+ * Counting bloom filter over the content hashes in the cache directory, so
+ * that misses are detected without touching the file system.  A negative
+ * answer is definite as long as every file that enters the cache directory
+ * is inserted.  That holds if the cache is not shared and the quota manager
+ * knows all cached files, see quota::Init().  A wrong negative answer just
+ * results in downloading the file again.
+ * While the quota manager rebuilds its index, the filter is pending: it passes
+ * all lookups and remembers the inserted objects until Complete().
+ * The content hashes are uniformly distributed, so the digest bytes are used
+ * as indexes directly.  Saturated counters are never decremented.
+ */
+class CacheFilter {
+ public:
+  CacheFilter(const uint64_t num_objects, const bool pending) {
+    num_counters_ = GetNumCounters(num_objects);
+    counters_ = static_cast<uint8_t *>(smalloc(num_counters_));
+    memset(counters_, 0, num_counters_);
+    num_objects_ = 0;
+    pending_ = pending;
+    atomic_init64(&num_filtered_);
+    atomic_init64(&num_passed_);
+    int retval = pthread_mutex_init(&lock_, NULL);
+    assert(retval == 0);
+  }
+  ~CacheFilter() {
+    free(counters_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  void Insert(const hash::Any &id) {
+    pthread_mutex_lock(&lock_);
+    if (pending_) {
+      recent_.insert(id);
+    } else {
+      IncrementCounters(counters_, num_counters_, id);
+      num_objects_++;
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void Remove(const hash::Any &id) {
+    pthread_mutex_lock(&lock_);
+    if (pending_) {
+      recent_.erase(id);
+      pthread_mutex_unlock(&lock_);
+      return;
+    }
+    bool present = true;
+    for (unsigned i = 0; i < kNumIndexes; ++i)
+      present = present && (counters_[Index(id, i)] > 0);
+    if (present) {
+      for (unsigned i = 0; i < kNumIndexes; ++i) {
+        uint8_t *counter = &counters_[Index(id, i)];
+        if (*counter < kSaturated)
+          (*counter)--;
+      }
+      num_objects_--;
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  /**
+   * False if id is certainly not in the cache directory.
+   */
+  bool MaybeContains(const hash::Any &id) {
+    bool result = true;
+    pthread_mutex_lock(&lock_);
+    if (pending_) {
+      pthread_mutex_unlock(&lock_);
+      return true;
+    }
+    for (unsigned i = 0; (i < kNumIndexes) && result; ++i)
+      result = counters_[Index(id, i)] > 0;
+    pthread_mutex_unlock(&lock_);
+    if (result)
+      atomic_inc64(&num_passed_);
+    else
+      atomic_inc64(&num_filtered_);
+    return result;
+  }
+
+  /**
+   * Makes a pending filter authoritative.  The counters for the objects known
+   * to the quota manager are built outside the lock; objects inserted in the
+   * meantime are still collected in recent_.
+   */
+  void Complete(const vector<hash::Any> &objects) {
+    const uint64_t num_counters =
+      GetNumCounters(objects.size() + kMinRecentObjects);
+    uint8_t *counters = static_cast<uint8_t *>(smalloc(num_counters));
+    memset(counters, 0, num_counters);
+    for (unsigned i = 0; i < objects.size(); ++i)
+      IncrementCounters(counters, num_counters, objects[i]);
+
+    pthread_mutex_lock(&lock_);
+    uint64_t num_objects = objects.size();
+    for (set<hash::Any>::const_iterator i = recent_.begin(),
+         iEnd = recent_.end(); i != iEnd; ++i)
+    {
+      IncrementCounters(counters, num_counters, *i);
+      num_objects++;
+    }
+    recent_.clear();
+    free(counters_);
+    counters_ = counters;
+    num_counters_ = num_counters;
+    num_objects_ = num_objects;
+    pending_ = false;
+    pthread_mutex_unlock(&lock_);
+  }
+
+  string PrintStatistics() {
+    pthread_mutex_lock(&lock_);
+    const uint64_t num_objects = num_objects_;
+    const bool pending = pending_;
+    pthread_mutex_unlock(&lock_);
+    if (pending)
+      return "pending until the cache database is rebuilt\n";
+    return "objects: " + StringifyInt(num_objects) + "  " +
+      "counters: " + StringifyInt(num_counters_) + "  " +
+      "filtered misses: " + StringifyInt(atomic_read64(&num_filtered_)) + "  " +
+      "passed: " + StringifyInt(atomic_read64(&num_passed_)) + "\n";
+  }
+
+ private:
+  static const unsigned kNumIndexes = 4;
+  static const unsigned kCountersPerObject = 8;
+  static const uint8_t kSaturated = 255;
+  /**
+   * Room for the objects that are downloaded while a pending filter is
+   * completed
+   */
+  static const unsigned kMinRecentObjects = 16*1024;
+
+  static uint64_t GetNumCounters(const uint64_t num_objects) {
+    uint64_t num_counters = 1 << 20;
+    while ((num_counters < kCountersPerObject * 2 * num_objects) &&
+           (num_counters < (uint64_t(1) << 31)))
+    {
+      num_counters <<= 1;
+    }
+    return num_counters;
+  }
+
+  static inline uint64_t Index(const hash::Any &id, const unsigned i,
+                               const uint64_t num_counters)
+  {
+    uint32_t value;
+    memcpy(&value, id.digest + 4*i, sizeof(value));
+    return value & (num_counters - 1);
+  }
+
+  inline uint64_t Index(const hash::Any &id, const unsigned i) const {
+    return Index(id, i, num_counters_);
+  }
+
+  static void IncrementCounters(uint8_t *counters, const uint64_t num_counters,
+                                const hash::Any &id)
+  {
+    for (unsigned i = 0; i < kNumIndexes; ++i) {
+      uint8_t *counter = &counters[Index(id, i, num_counters)];
+      if (*counter < kSaturated)
+        (*counter)++;
+    }
+  }
+
+  uint8_t *counters_;
+  uint64_t num_counters_;  /**< power of 2 */
+  uint64_t num_objects_;
+  bool pending_;
+  set<hash::Any> recent_;  /**< Inserted while pending */
+  pthread_mutex_t lock_;
+  atomic_int64 num_filtered_;
+  atomic_int64 num_passed_;
+};
+CacheFilter *cache_filter_ = NULL;  /**< NULL if not authoritative */
 
 
 static void CleanupTLS(void *data) {
   ThreadLocalStorage *tls = static_cast<ThreadLocalStorage *>(data);
-  close(tls->pipe_wait[0]);
-  close(tls->pipe_wait[1]);
   delete tls;
 }
 
+
+static ThreadLocalStorage *GetThreadLocalStorage() {
+  ThreadLocalStorage *tls = static_cast<ThreadLocalStorage *>(
+                            pthread_getspecific(thread_local_storage_));
+  if (tls == NULL) {
+    tls = new ThreadLocalStorage();
+    tls->download_job.destination = download::kDestinationFile;
+    tls->download_job.compressed = true;
+    tls->download_job.probe_hosts = true;
+    int retval = pthread_setspecific(thread_local_storage_, tls);
+    assert(retval == 0);
+  }
+  return tls;
+}
+
+
+static inline DownloadShard *LockShard(const hash::Any &id) {
+  DownloadShard *shard = &download_shards_[id.digest[0] % kNumDownloadShards];
+  if (pthread_mutex_trylock(&shard->lock) != 0) {
+    atomic_inc64(&num_contended_);
+    pthread_mutex_lock(&shard->lock);
+  }
+  return shard;
+}
+
+
+/**
+ * Drops a reference to an in-flight download.  Shard lock must be held.
+ */
+static inline void ReleaseInflight(InflightDownload *inflight) {
+  if (--inflight->num_refs == 0)
+    delete inflight;
+}
+
 /**
  * Initializes the cache directory with the 256 subdirectories and /txn.
  *
+ * @param[in] shared True if other cvmfs instances use the same directory
+ *
  * \return True on success, false otherwise
  */
-bool Init(const string &cache_path) {
+bool Init(const string &cache_path, const bool shared) {
   cache_path_ = new string(cache_path);
-  queues_download_ = new ThreadQueues();
+  shared_ = shared;
+  download_shards_ = new DownloadShard[kNumDownloadShards];
+  for (unsigned i = 0; i < kNumDownloadShards; ++i) {
+    int retval = pthread_mutex_init(&download_shards_[i].lock, NULL);
+    assert(retval == 0);
+  }
   atomic_init64(&num_download_);
+  atomic_init64(&num_coalesced_);
+  atomic_init64(&num_peer_);
+  atomic_init64(&num_contended_);
+  atomic_init64(&num_streamed_);
+  atomic_init64(&num_shared_);
+  atomic_init64(&num_batches_);
+  atomic_init64(&num_batched_);
+  bundles_inflight_ = new set<hash::Any>();
+  atomic_init64(&num_bundles_);
+  atomic_init64(&num_bundled_);
+  atomic_init64(&num_bundles_failed_);
 
   if (!MakeCacheDirectories(cache_path, 0700))
     return false;
@@ -114,10 +445,16 @@ void Fini() {
   // TODO: wait for file transfers to finish
   // (they are canceled by finilizing the download thread)
   pthread_key_delete(thread_local_storage_);
+  for (unsigned i = 0; i < kNumDownloadShards; ++i)
+    pthread_mutex_destroy(&download_shards_[i].lock);
   delete cache_path_;
-  delete queues_download_;
+  delete[] download_shards_;
+  delete cache_filter_;
+  delete bundles_inflight_;
   cache_path_ = NULL;
-  queues_download_ = NULL;
+  download_shards_ = NULL;
+  cache_filter_ = NULL;
+  bundles_inflight_ = NULL;
 }
 
 
@@ -132,6 +469,37 @@ static inline string GetPathInCache(const hash::Any &id) {
 }
 
 
+/**
+ * Size of the buffer for GetPathInCache(id, path), including room for the
+ * kCompressedSuffix.
+ */
+static inline unsigned GetPathInCacheSize() {
+  return cache_path_->length() + 2*hash::kMaxDigestSize + 4;
+}
+
+
+/**
+ * Turns a path written by GetPathInCache(id, path) into the path of the
+ * compressed object.
+ */
+static inline void AppendCompressedSuffix(char *path) {
+  const unsigned length = strlen(path);
+  path[length] = kCompressedSuffix;
+  path[length + 1] = '\0';
+}
+
+
+/**
+ * Writes the absolute path in local cache into path, which has to hold
+ * GetPathInCacheSize() bytes.  Used by the cache hit paths, which should not
+ * allocate from the heap.
+ */
+static inline void GetPathInCache(const hash::Any &id, char *path) {
+  memcpy(path, cache_path_->data(), cache_path_->length());
+  id.MakePathCStr(1, 2, path + cache_path_->length());
+}
+
+
 /**
  * Transform a catalog entry into a temporary name in txn-directory.
  *
@@ -151,15 +519,22 @@ static inline string GetTempName()
  * \return A file descriptor if file is in cache.  Error code of open() else.
  */
 int Open(const hash::Any &id) {
-  const string path = GetPathInCache(id);
-  int result = ::open(path.c_str(), O_RDONLY);
+  if (cache_filter_ && !cache_filter_->MaybeContains(id))
+    return -ENOENT;
+  char *path = static_cast<char *>(alloca(GetPathInCacheSize()));
+  GetPathInCache(id, path);
+  int result = ::open(path, O_RDONLY);
+  if ((result < 0) && (errno == ENOENT) && compressed_reads_) {
+    AppendCompressedSuffix(path);
+    result = ::open(path, O_RDONLY);
+  }
 
   if (result >= 0) {
-    LogCvmfs(kLogCache, kLogDebug, "hit %s", path.c_str());
+    LogCvmfs(kLogCache, kLogDebug, "hit %s", path);
     platform_disable_kcache(result);
   } else {
     result = -errno;
-    LogCvmfs(kLogCache, kLogDebug, "miss %s (%d)", path.c_str(), result);
+    LogCvmfs(kLogCache, kLogDebug, "miss %s (%d)", path, result);
   }
 
   return result;
@@ -284,6 +659,7 @@ int CommitTransaction(const string &final_path,
     LogCvmfs(kLogCache, kLogDebug, "commit failed: %s", strerror(errno));
     unlink(temp_path.c_str());
   } else {
+    FilterInsert(hash);
     quota::Insert(hash, size, cvmfs_path);
   }
 
@@ -324,225 +700,1752 @@ bool CommitFromMem(const hash::Any &id, const unsigned char *buffer,
  * \return True, if file is in local cache, false otherwise.
  */
 bool Contains(const hash::Any &id) {
+  if (cache_filter_ && !cache_filter_->MaybeContains(id))
+    return false;
+  char *path = static_cast<char *>(alloca(GetPathInCacheSize()));
+  GetPathInCache(id, path);
   platform_stat64 info;
-  return platform_stat(GetPathInCache(id).c_str(), &info) == 0;
+  if (platform_stat(path, &info) == 0)
+    return true;
+  if (!compressed_reads_)
+    return false;
+  AppendCompressedSuffix(path);
+  return platform_stat(path, &info) == 0;
 }
 
 
 /**
- * Returns a read-only file descriptor for a specific catalog entry.
- * After successful call, the file resides in local cache.
- * File is downloaded via HTTP if it is not in the local cache.
- * If multiple concurrent requests arrive for a file, the requests are queued
- * and only the first one performs the download.
- *
- * @param[in] d Demanded catalog entry
- * @param[in] cvmfs_path Path of the chunk as seen in cvmfs
- * \return Read-only file descriptor for the file pointing into local cache.
- *         On failure a negative error code.
+ * In compressed mode, data objects are stored as a sequence of independently
+ * deflated blocks, preceded by a header and the offsets of the blocks, see
+ * zlib::BlockHeader.  Reads at an arbitrary offset inflate only the blocks
+ * they touch.  Recently inflated blocks are kept in a small LRU.  Compressed
+ * objects are stored under their content hash with the kCompressedSuffix, so
+ * that they can be mixed with plain objects in the same cache directory and
+ * tools that don't know the format, such as libcvmfs, never open them.
+ * Catalogs and certificates are always stored plain.
  */
-int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path)
-{
-  int fd_return;  // Read-only file descriptor that is returned
-  int retval;
+struct CompressedObject {
+  hash::Any id;
+  int fd;
+  uint32_t block_size;
+  uint64_t size;
+  vector<uint64_t> offsets;  /**< num_blocks + 1 entries, the last is EOF */
+};
 
-  if (d.size() > quota::GetMaxFileSize()) {
-    LogCvmfs(kLogCache, kLogDebug, "file too big for lru cache (%"PRIu64")",
-             d.size());
-    return -ENOSPC;
-  }
+namespace {
 
-  // Try to open from local cache
-  if ((fd_return = cache::Open(d.checksum())) >= 0) {
-    quota::Touch(d.checksum());
-    return fd_return;
-  }
+const uint32_t kBlockSize = 64*1024;
+const uint64_t kMinCompressedSize = 4096;  /**< doesn't save a disk block */
 
-  // Initialize TLS
-  ThreadLocalStorage *tls = static_cast<ThreadLocalStorage *>(
-                            pthread_getspecific(thread_local_storage_));
-  if (tls == NULL) {
-    tls = new ThreadLocalStorage();
-    retval = pipe(tls->pipe_wait);
-    assert(retval == 0);
-    tls->download_job.destination = download::kDestinationFile;
-    tls->download_job.compressed = true;
-    tls->download_job.probe_hosts = true;
-    retval = pthread_setspecific(thread_local_storage_, tls);
-    assert(retval == 0);
+struct BlockKey {
+  BlockKey(const hash::Any &i, const uint64_t b) : id(i), block(b) { }
+  bool operator <(const BlockKey &other) const {
+    if (block != other.block)
+      return block < other.block;
+    return id < other.id;
   }
+  hash::Any id;
+  uint64_t block;
+};
 
-  // Lock queue and start downloading or enqueue
-  pthread_mutex_lock(&lock_queues_download_);
-  ThreadQueues::iterator iDownloadQueue = queues_download_->find(d.checksum());
-  if (iDownloadQueue != queues_download_->end()) {
-    LogCvmfs(kLogCache, kLogDebug, "waiting for download of %s",
-             cvmfs_path.c_str());
-
-    iDownloadQueue->second->push_back(tls->pipe_wait[1]);
-    pthread_mutex_unlock(&lock_queues_download_);
-    retval = read(tls->pipe_wait[0], &fd_return, sizeof(int));
-    assert(retval = sizeof(int));
-
-    LogCvmfs(kLogCache, kLogDebug, "received from another thread fd %d for %s",
-             fd_return, cvmfs_path.c_str());
-    return fd_return;
-  } else {
-    // Seems we are the first one, check again in the cache (race condition)
-    fd_return = cache::Open(d.checksum());
-    if (fd_return >= 0) {
-      pthread_mutex_unlock(&lock_queues_download_);
-      quota::Touch(d.checksum());
-      return fd_return;
-    }
+struct BlockEntry {
+  explicit BlockEntry(const BlockKey &k) : key(k) { }
+  BlockKey key;
+  unsigned char *buffer;
+  uint32_t size;
+  list<BlockEntry *>::iterator lru_position;
+};
 
-    // Create a new queue for this chunk
-    (*queues_download_)[d.checksum()] = &tls->other_pipes_waiting;
-    pthread_mutex_unlock(&lock_queues_download_);
-  }
+typedef map<BlockKey, BlockEntry *> BlockMap;
 
-  // The download path starts here
-  LogCvmfs(kLogCache, kLogDebug, "downloading %s", cvmfs_path.c_str());
-  atomic_inc64(&num_download_);
+bool compress_ = false;  /**< store new data objects compressed */
+uint64_t block_max_size_ = 0;
+uint64_t block_limit_ = 0;  /**< block_max_size_ or less under pressure */
+uint64_t block_size_ = 0;
+BlockMap *blocks_ = NULL;
+list<BlockEntry *> *block_lru_ = NULL;  /**< Least recently used first */
+pthread_mutex_t lock_blocks_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t block_num_hit_ = 0;
+uint64_t block_num_miss_ = 0;
+atomic_int64 num_compressed_;  /**< objects stored compressed */
+atomic_int64 compressed_bytes_in_;
+atomic_int64 compressed_bytes_out_;
 
-  const string url = "/data" + d.checksum().MakePath(1, 2);
-  string final_path;
-  string temp_path;
-  int fd;  // Used to write the downloaded file
-  FILE *f = NULL;
-  int result = -EIO;
 
-  fd = StartTransaction(d.checksum(), &final_path, &temp_path);
-  if (fd < 0) {
-    LogCvmfs(kLogCache, kLogDebug, "could not start transaction on %s",
-             final_path.c_str());
-    result = fd;
-    goto fetch_finalize;
+/**
+ * Throws out least recently used blocks until needed bytes fit.  Caller holds
+ * lock_blocks_.
+ */
+void EvictBlocks(const uint64_t needed) {
+  while (!block_lru_->empty() && (block_size_ + needed > block_limit_)) {
+    BlockEntry *entry = block_lru_->front();
+    block_lru_->pop_front();
+    blocks_->erase(entry->key);
+    block_size_ -= entry->size;
+    free(entry->buffer);
+    delete entry;
   }
+}
 
-  f = fdopen(fd, "w");
-  if (!f) {
-    result = -errno;
-    LogCvmfs(kLogCache, kLogDebug, "could not fdopen %s", final_path.c_str());
-    goto fetch_finalize;
-  }
+}  // anonymous namespace
 
-  tls->download_job.url = &url;
-  tls->download_job.destination_file = f;
-  tls->download_job.expected_hash = d.checksum_ptr();
-  download::Fetch(&tls->download_job);
 
-  if (tls->download_job.error_code == download::kFailOk) {
-    LogCvmfs(kLogCache, kLogDebug, "finished downloading of %s", url.c_str());
+/**
+ * Rewrites a verified, plain file in the txn directory in the block format.
+ * The file stays plain if that does not save space.
+ *
+ * \return True if temp_path was replaced by its compressed version
+ */
+static bool CompressTransaction(const hash::Any &id, const string &temp_path,
+                                const uint64_t size, uint64_t *disk_size)
+{
+  const int fd_src = ::open(temp_path.c_str(), O_RDONLY);
+  if (fd_src < 0)
+    return false;
+  string dummy;
+  string compressed_path;
+  const int fd_dst = StartTransaction(id, &dummy, &compressed_path);
+  if (fd_dst < 0) {
+    close(fd_src);
+    return false;
+  }
 
-    // Check decompressed size (a cross check just in case)
-    platform_stat64 stat_info;
-    stat_info.st_size = -1;
-    if ((platform_fstat(fileno(f), &stat_info) != 0) ||
-        (stat_info.st_size != (int64_t)d.size()))
+  zlib::BlockHeader header;
+  memcpy(header.magic, zlib::kBlockMagic, sizeof(header.magic));
+  header.block_size = kBlockSize;
+  header.num_blocks = (size + kBlockSize - 1) / kBlockSize;
+  header.size = size;
+  vector<uint64_t> offsets(header.num_blocks + 1);
+  offsets[0] = sizeof(header) + offsets.size() * sizeof(uint64_t);
+
+  unsigned char *block = static_cast<unsigned char *>(smalloc(kBlockSize));
+  bool result = true;
+  for (unsigned i = 0; result && (i < header.num_blocks); ++i) {
+    const uint64_t length = std::min(uint64_t(kBlockSize), size - i*kBlockSize);
+    void *zblock;
+    int64_t zsize;
+    if ((read(fd_src, block, length) != int64_t(length)) ||
+        !zlib::CompressMem2Mem(block, length, &zblock, &zsize))
     {
-      LogCvmfs(kLogCache, kLogSyslog,
-               "size check failure for %s, expected %lu, got %ld",
-               url.c_str(), d.size(), stat_info.st_size);
-      if (CopyPath2Path(temp_path, *cache_path_ + "/quarantaine/" +
-                        d.checksum().ToString()) != 0)
-      {
-        LogCvmfs(kLogCache, kLogSyslog,
-                 "failed to move %s to quarantaine", temp_path.c_str());
-      }
-      result = -EIO;
-      goto fetch_finalize;
-    }
-
-    LogCvmfs(kLogCache, kLogDebug, "trying to commit %s", final_path.c_str());
-    fclose(f);
-    fd = -1;
-    fd_return = ::open(temp_path.c_str(), O_RDONLY);
-    if (fd_return < 0) {
-      result = -errno;
-      goto fetch_finalize;
-    }
-    result = cache::CommitTransaction(final_path, temp_path, cvmfs_path,
-                                      d.checksum(), d.size());
-    if (result == 0) {
-      platform_disable_kcache(fd_return);
-      result = fd_return;
-    } else {
-      close(fd_return);
+      result = false;
+      break;
     }
+    result = (pwrite(fd_dst, zblock, zsize, offsets[i]) == zsize);
+    offsets[i+1] = offsets[i] + zsize;
+    free(zblock);
+    // Incompressible data is kept as it is
+    if (offsets[i+1] >= size)
+      result = false;
   }
-
- fetch_finalize:
-  // Cleanup
-  LogCvmfs(kLogCache, kLogDebug, "finalizing download of %s",
-           cvmfs_path.c_str());
-  if (result < 0) {
-    LogCvmfs(kLogCache, kLogDebug | kLogSyslog, "failed to fetch %s (hash: %s, "
-             "error %d)", cvmfs_path.c_str(), d.checksum().ToString().c_str(),
-             tls->download_job.error_code);
+  free(block);
+  close(fd_src);
+
+  if (result) {
+    result =
+      (pwrite(fd_dst, &header, sizeof(header), 0) == sizeof(header)) &&
+      (pwrite(fd_dst, &offsets[0], offsets.size() * sizeof(uint64_t),
+              sizeof(header)) == int64_t(offsets.size() * sizeof(uint64_t)));
   }
-  if (fd >= 0) {
-    if (f) fclose(f);
-    else close(fd);
-    AbortTransaction(temp_path);
+  close(fd_dst);
+  if (!result || (rename(compressed_path.c_str(), temp_path.c_str()) != 0)) {
+    AbortTransaction(compressed_path);
+    return false;
   }
 
-  // Signal the waiting threads and remove the queue
-  pthread_mutex_lock(&lock_queues_download_);
-  for (unsigned i = 0, s = tls->other_pipes_waiting.size(); i < s; ++i) {
-    int fd_dup = dup(result);
-    int retval = write(tls->other_pipes_waiting[i], &fd_dup, sizeof(int));
-    assert(retval == sizeof(int));
-  }
-  tls->other_pipes_waiting.clear();
-  queues_download_->erase(d.checksum());
-  pthread_mutex_unlock(&lock_queues_download_);
+  *disk_size = offsets[header.num_blocks];
+  atomic_inc64(&num_compressed_);
+  atomic_xadd64(&compressed_bytes_in_, size);
+  atomic_xadd64(&compressed_bytes_out_, *disk_size);
+  LogCvmfs(kLogCache, kLogDebug, "compressed %s from %"PRIu64" to %"PRIu64
+           " bytes", temp_path.c_str(), size, *disk_size);
+  return true;
+}
 
-  return result;
+
+/**
+ * Opens objects in the block format, too, see OpenCompressed().  Compressed
+ * objects that remain from an earlier mount stay readable.
+ */
+void EnableCompressedReads() {
+  compressed_reads_ = true;
 }
 
 
-int64_t GetNumDownloads() {
-  return atomic_read64(&num_download_);
+/**
+ * Stores newly downloaded data objects compressed.  Inflated blocks occupy at
+ * most lru_size bytes of memory.
+ */
+void InitCompression(const uint64_t lru_size) {
+  atomic_init64(&num_compressed_);
+  atomic_init64(&compressed_bytes_in_);
+  atomic_init64(&compressed_bytes_out_);
+  compress_ = true;
+  compressed_reads_ = true;
+  block_max_size_ = lru_size;
+  block_limit_ = lru_size;
+  block_size_ = 0;
+  blocks_ = new BlockMap();
+  block_lru_ = new list<BlockEntry *>();
 }
 
 
-CatalogManager::CatalogManager(const string &repo_name,
-                               const bool ignore_signature)
-{
-  LogCvmfs(kLogCache, kLogDebug, "constructing cache catalog manager");
-  repo_name_ = repo_name;
-  ignore_signature_ = ignore_signature;
-  offline_mode_ = false;
-  loaded_inodes_ = all_inodes_ = 0;
-  atomic_init32(&certificate_hits_);
-  atomic_init32(&certificate_misses_);
+void FiniCompression() {
+  if (!blocks_)
+    return;
+  pthread_mutex_lock(&lock_blocks_);
+  block_max_size_ = 0;
+  block_limit_ = 0;
+  EvictBlocks(0);
+  pthread_mutex_unlock(&lock_blocks_);
+  delete blocks_;
+  delete block_lru_;
+  blocks_ = NULL;
+  block_lru_ = NULL;
+  compress_ = false;
 }
 
 
 /**
- * Specialized initialization that uses a fixed root hash.
+ * Reads the block index of a cache file.  The file descriptor stays owned by
+ * the caller and has to stay open until the object is closed.  Whether fd
+ * refers to an object in the block format is decided by its name, i.e. by
+ * comparing it to the file stored with the kCompressedSuffix.
+ *
+ * \return The object or NULL if fd refers to a plain file
  */
-bool CatalogManager::InitFixed(const hash::Any &root_hash) {
-  LogCvmfs(kLogCatalog, kLogDebug, "Initialize catalog with root hash %s",
-           root_hash.ToString().c_str());
-  WriteLock();
-  bool attached = MountCatalog(PathString("", 0), root_hash, NULL);
-  Unlock();
-
-  if (!attached) {
-    LogCvmfs(kLogCatalog, kLogDebug, "failed to initialize root catalog");
+CompressedObject *OpenCompressed(const hash::Any &id, const int fd) {
+  if (!compressed_reads_)
+    return NULL;
+  platform_stat64 info_fd;
+  platform_stat64 info_compressed;
+  if ((platform_fstat(fd, &info_fd) != 0) ||
+      (platform_stat((GetPathInCache(id) + kCompressedSuffix).c_str(),
+                     &info_compressed) != 0) ||
+      (info_fd.st_dev != info_compressed.st_dev) ||
+      (info_fd.st_ino != info_compressed.st_ino))
+  {
+    return NULL;
   }
 
-  return attached;
+  zlib::BlockHeader header;
+  CompressedObject *object = new CompressedObject();
+  if (!zlib::ReadBlockIndex(fd, &header, &object->offsets)) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+             "corrupted block index in %s", id.ToString().c_str());
+    delete object;
+    return NULL;
+  }
+  object->id = id;
+  object->fd = fd;
+  object->block_size = header.block_size;
+  object->size = header.size;
+  return object;
 }
 
 
-catalog::Catalog *CatalogManager::CreateCatalog(const PathString &mountpoint,
-  catalog::Catalog *parent_catalog)
+/**
+ * Copies part of a block into buffer, inflating the block if it is not in the
+ * LRU.
+ */
+static bool ReadBlock(CompressedObject *object, const uint64_t block,
+                      const uint64_t offset, const uint64_t size,
+                      unsigned char *buffer)
 {
-  mounted_catalogs_[mountpoint] = loaded_catalogs_[mountpoint];
-  loaded_catalogs_.erase(mountpoint);
+  const BlockKey key(object->id, block);
+  pthread_mutex_lock(&lock_blocks_);
+  if (blocks_) {
+    BlockMap::iterator iter = blocks_->find(key);
+    if (iter != blocks_->end()) {
+      BlockEntry *entry = iter->second;
+      memcpy(buffer, entry->buffer + offset, size);
+      block_lru_->splice(block_lru_->end(), *block_lru_, entry->lru_position);
+      block_num_hit_++;
+      pthread_mutex_unlock(&lock_blocks_);
+      return true;
+    }
+  }
+  block_num_miss_++;
+  pthread_mutex_unlock(&lock_blocks_);
+
+  const uint64_t zsize = object->offsets[block+1] - object->offsets[block];
+  const uint64_t length = std::min(uint64_t(object->block_size),
+                                   object->size - block*object->block_size);
+  unsigned char *zblock = static_cast<unsigned char *>(smalloc(zsize));
+  void *plain = NULL;
+  int64_t plain_size = 0;
+  const bool result =
+    (pread(object->fd, zblock, zsize, object->offsets[block]) ==
+     int64_t(zsize)) &&
+    zlib::DecompressMem2Mem(zblock, zsize, &plain, &plain_size) &&
+    (uint64_t(plain_size) == length);
+  free(zblock);
+  if (!result) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+             "failed to inflate block %"PRIu64" of %s", block,
+             object->id.ToString().c_str());
+    free(plain);
+    return false;
+  }
+  memcpy(buffer, static_cast<unsigned char *>(plain) + offset, size);
+
+  pthread_mutex_lock(&lock_blocks_);
+  if (blocks_ && (length <= block_limit_) &&
+      (blocks_->find(key) == blocks_->end()))
+  {
+    EvictBlocks(length);
+    BlockEntry *entry = new BlockEntry(key);
+    entry->buffer = static_cast<unsigned char *>(plain);
+    entry->size = length;
+    entry->lru_position = block_lru_->insert(block_lru_->end(), entry);
+    (*blocks_)[key] = entry;
+    block_size_ += length;
+    plain = NULL;
+  }
+  pthread_mutex_unlock(&lock_blocks_);
+  free(plain);
+  return true;
+}
+
+
+/**
+ * Reads the uncompressed bytes [offset, offset+size) of object.
+ *
+ * \return Number of bytes read or -EIO
+ */
+int64_t ReadCompressed(CompressedObject *object, void *buffer,
+                       const size_t size, const off_t offset)
+{
+  if (uint64_t(offset) >= object->size)
+    return 0;
+  const uint64_t nbytes = std::min(uint64_t(size), object->size - offset);
+  uint64_t pos = 0;
+  while (pos < nbytes) {
+    const uint64_t block = (offset + pos) / object->block_size;
+    const uint64_t in_block = (offset + pos) % object->block_size;
+    const uint64_t length =
+      std::min(nbytes - pos, uint64_t(object->block_size) - in_block);
+    if (!ReadBlock(object, block, in_block, length,
+                   static_cast<unsigned char *>(buffer) + pos))
+    {
+      return -EIO;
+    }
+    pos += length;
+  }
+  return nbytes;
+}
+
+
+/**
+ * \return The file descriptor the object was opened with, which stays open
+ */
+int CloseCompressed(CompressedObject *object) {
+  const int fd = object->fd;
+  delete object;
+  return fd;
+}
+
+
+/**
+ * Lowers the memory for inflated blocks below the configured size, or raises
+ * it back up to the configured size.  Used by the memory budget.
+ */
+void SetCompressionLimit(const uint64_t limit) {
+  pthread_mutex_lock(&lock_blocks_);
+  if (blocks_) {
+    block_limit_ = (limit < block_max_size_) ? limit : block_max_size_;
+    EvictBlocks(0);
+  }
+  pthread_mutex_unlock(&lock_blocks_);
+}
+
+
+uint64_t GetCompressionSize() {
+  pthread_mutex_lock(&lock_blocks_);
+  const uint64_t result = block_size_;
+  pthread_mutex_unlock(&lock_blocks_);
+  return result;
+}
+
+
+string GetCompressionStatistics() {
+  if (!compress_)
+    return "disabled\n";
+  const int64_t bytes_in = atomic_read64(&compressed_bytes_in_);
+  pthread_mutex_lock(&lock_blocks_);
+  const uint64_t num_lookups = block_num_hit_ + block_num_miss_;
+  const string result =
+    "objects: " + StringifyInt(atomic_read64(&num_compressed_)) + "  " +
+    "ratio: " + (bytes_in ? StringifyInt(
+      atomic_read64(&compressed_bytes_out_) * 100 / bytes_in) + "%" : "n/a") +
+    "  block cache: " + StringifyInt(block_size_ / 1024) + "/" +
+      StringifyInt(block_limit_ / 1024) + " kB  " +
+    "hit rate: " + (num_lookups ?
+      StringifyInt(block_num_hit_ * 100 / num_lookups) + "%" : "n/a") + "\n";
+  pthread_mutex_unlock(&lock_blocks_);
+  return result;
+}
+
+
+/**
+ * Serializes the downloads of an object among the cvmfs instances of a shared
+ * cache.  The lock file is removed by its owner, so a waiting process has to
+ * check that it didn't lock a file that was removed in the meantime.
+ *
+ * \return File descriptor of the locked file or -1
+ */
+static int LockSharedDownload(const hash::Any &id) {
+  const string path = *cache_path_ + "/txn/lock." + id.ToString();
+  while (true) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CREAT, 0600);
+    if (fd < 0)
+      return -1;
+    if (flock(fd, LOCK_EX) != 0) {
+      close(fd);
+      return -1;
+    }
+    platform_stat64 info_fd;
+    platform_stat64 info_path;
+    if ((platform_fstat(fd, &info_fd) == 0) &&
+        (platform_stat(path.c_str(), &info_path) == 0) &&
+        (info_fd.st_ino == info_path.st_ino))
+    {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+
+static void UnlockSharedDownload(const hash::Any &id, const int fd) {
+  unlink((*cache_path_ + "/txn/lock." + id.ToString()).c_str());
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+
+static void ReportProgress(void *progress_ctx, const int64_t written) {
+  StreamingFetch *stream = static_cast<StreamingFetch *>(progress_ctx);
+  pthread_mutex_lock(&stream->lock);
+  stream->written = written;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+
+/**
+ * Verifies a plain object against its content hash by compressing it again,
+ * in parallel blocks first for large objects, see zlib::IsParallelSize().
+ */
+static bool VerifyPlain(const string &path, const hash::Any &checksum) {
+  FILE *fsrc = fopen(path.c_str(), "r");
+  if (!fsrc)
+    return false;
+  hash::Any plain_hash(checksum.algorithm);
+  bool result = false;
+  platform_stat64 info;
+  if ((platform_fstat(fileno(fsrc), &info) == 0) &&
+      zlib::IsParallelSize(info.st_size))
+  {
+    result = zlib::CompressFile2NullParallel(fsrc, &plain_hash) &&
+             (plain_hash == checksum);
+    rewind(fsrc);
+  }
+  if (!result) {
+    result = zlib::CompressFile2Null(fsrc, &plain_hash) &&
+             (plain_hash == checksum);
+  }
+  fclose(fsrc);
+  return result;
+}
+
+
+/**
+ * Tries to get a data object from the LAN peer that is responsible for it.
+ * Peers store plain objects, so they are verified by compressing them again,
+ * like cvmfs_fsck does.  On failure, f is emptied for the regular download.
+ */
+static bool FetchFromPeer(const hash::Any &checksum, const string &temp_path,
+                          FILE *f)
+{
+  if (!peers::IsConnected())
+    return false;
+
+  bool result = peers::Fetch(checksum, f);
+  if (result) {
+    result = (fflush(f) == 0) && VerifyPlain(temp_path, checksum);
+    if (!result) {
+      LogCvmfs(kLogCache, kLogDebug, "peer data of %s failed verification",
+               checksum.ToString().c_str());
+    }
+  }
+
+  if (!result) {
+    if ((fflush(f) != 0) || (ftruncate(fileno(f), 0) != 0))
+      return false;
+    rewind(f);
+    return false;
+  }
+  atomic_inc64(&num_peer_);
+  return true;
+}
+
+
+/**
+ * Returns a read-only file descriptor for a content-addressed object.
+ * After successful call, the object resides in local cache.
+ * The object is downloaded via HTTP if it is not in the local cache, from a
+ * LAN peer if possible and through the proxies otherwise.
+ * If multiple concurrent requests arrive for an object, the requests are
+ * queued and only the first one performs the download.
+ *
+ * @param[in] checksum Content hash of the object
+ * @param[in] size Uncompressed size of the object
+ * @param[in] url_suffix Appended to the object's URL, e.g. C for file chunks
+ * @param[in] cvmfs_path Path of the chunk as seen in cvmfs
+ * @param[in] stream If not NULL, receives the download progress
+ * @param[out] txn If not NULL, a downloaded object is not committed but
+ *             described in txn, see CommitTransactions()
+ * \return Read-only file descriptor for the file pointing into local cache.
+ *         On failure a negative error code.
+ */
+static uint64_t GetTimeUs() {
+  struct timeval tv_now;
+  gettimeofday(&tv_now, NULL);
+  return uint64_t(tv_now.tv_sec)*1000000 + tv_now.tv_usec;
+}
+
+
+/**
+ * Opens an object from the local cache and marks it as recently used.
+ */
+static inline int OpenCached(const hash::Any &checksum) {
+  const int fd = cache::Open(checksum);
+  if (fd >= 0)
+    quota::Touch(checksum);
+  return fd;
+}
+
+
+static int FetchObject(const hash::Any &checksum, const uint64_t size,
+                       const string &url_suffix, const string &cvmfs_path,
+                       StreamingFetch *stream, Transaction *txn)
+{
+  int fd_return;  // Read-only file descriptor that is returned
+
+  if (size > quota::GetMaxFileSize()) {
+    LogCvmfs(kLogCache, kLogDebug, "file too big for lru cache (%"PRIu64")",
+             size);
+    return -ENOSPC;
+  }
+
+  // Try to open from local cache
+  if ((fd_return = OpenCached(checksum)) >= 0) {
+    prefix_accounting::RecordHit(cvmfs_path);
+    return fd_return;
+  }
+
+  ThreadLocalStorage *tls = GetThreadLocalStorage();
+
+  // Lock shard and start downloading or wait for the running download
+  DownloadShard *shard = LockShard(checksum);
+  InflightDownload *inflight;
+  InflightMap::iterator iInflight = shard->inflight.find(checksum);
+  if (iInflight != shard->inflight.end()) {
+    inflight = iInflight->second;
+    if (!inflight->deferred_path.empty()) {
+      // Downloaded but not yet committed, the transaction file is complete
+      fd_return = ::open(inflight->deferred_path.c_str(), O_RDONLY);
+      pthread_mutex_unlock(&shard->lock);
+      if (fd_return < 0)
+        return -errno;
+      platform_disable_kcache(fd_return);
+      prefix_accounting::RecordHit(cvmfs_path);
+      return fd_return;
+    }
+
+    LogCvmfs(kLogCache, kLogDebug, "waiting for download of %s",
+             cvmfs_path.c_str());
+    atomic_inc64(&num_coalesced_);
+
+    inflight->num_refs++;
+    while (!inflight->done)
+      pthread_cond_wait(&inflight->cond, &shard->lock);
+    assert(!inflight->results.empty());
+    fd_return = inflight->results.back();
+    inflight->results.pop_back();
+    ReleaseInflight(inflight);
+    pthread_mutex_unlock(&shard->lock);
+
+    LogCvmfs(kLogCache, kLogDebug, "received from another thread fd %d for %s",
+             fd_return, cvmfs_path.c_str());
+    if (fd_return >= 0)
+      prefix_accounting::RecordHit(cvmfs_path);
+    return fd_return;
+  } else {
+    // Seems we are the first one, check again in the cache (race condition)
+    fd_return = cache::Open(checksum);
+    if (fd_return >= 0) {
+      pthread_mutex_unlock(&shard->lock);
+      quota::Touch(checksum);
+      prefix_accounting::RecordHit(cvmfs_path);
+      return fd_return;
+    }
+
+    // Register the download of this chunk
+    inflight = new InflightDownload();
+    shard->inflight[checksum] = inflight;
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  // The download path starts here
+  const string url = "/data" + checksum.MakePath(1, 2) + url_suffix;
+  string final_path;
+  string temp_path;
+  int fd = -1;  // Used to write the downloaded file
+  FILE *f = NULL;
+  int result = -EIO;
+  int fd_lock = -1;  // Held while downloading into a shared cache
+  uint64_t download_start = 0;
+  uint64_t transferred_bytes = 0;
+
+  if (shared_) {
+    fd_lock = LockSharedDownload(checksum);
+    fd_return = cache::Open(checksum);
+    if (fd_return >= 0) {
+      LogCvmfs(kLogCache, kLogDebug, "%s was downloaded by another instance",
+               cvmfs_path.c_str());
+      atomic_inc64(&num_shared_);
+      quota::Touch(checksum);
+      prefix_accounting::RecordHit(cvmfs_path);
+      result = fd_return;
+      goto fetch_finalize;
+    }
+  }
+  LogCvmfs(kLogCache, kLogDebug, "downloading %s", cvmfs_path.c_str());
+  atomic_inc64(&num_download_);
+
+  fd = StartTransaction(checksum, &final_path, &temp_path);
+  if (fd < 0) {
+    LogCvmfs(kLogCache, kLogDebug, "could not start transaction on %s",
+             final_path.c_str());
+    result = fd;
+    goto fetch_finalize;
+  }
+
+  f = fdopen(fd, "w");
+  if (!f) {
+    result = -errno;
+    LogCvmfs(kLogCache, kLogDebug, "could not fdopen %s", final_path.c_str());
+    goto fetch_finalize;
+  }
+
+  tls->download_job.url = &url;
+  tls->download_job.destination_file = f;
+  tls->download_job.expected_hash = &checksum;
+  tls->download_job.progress_callback = NULL;
+  if (stream) {
+    const int fd_stream = ::open(temp_path.c_str(), O_RDONLY);
+    if (fd_stream >= 0) {
+      pthread_mutex_lock(&stream->lock);
+      stream->fd = fd_stream;
+      pthread_mutex_unlock(&stream->lock);
+      tls->download_job.progress_callback = ReportProgress;
+      tls->download_job.progress_ctx = stream;
+    }
+  }
+  if (prefix_accounting::IsEnabled())
+    download_start = GetTimeUs();
+  if (FetchFromPeer(checksum, temp_path, f)) {
+    tls->download_job.error_code = download::kFailOk;
+    transferred_bytes = size;
+  } else {
+    download::Fetch(&tls->download_job);
+    transferred_bytes = tls->download_job.transferred_bytes;
+  }
+  if (prefix_accounting::IsEnabled()) {
+    prefix_accounting::RecordMiss(cvmfs_path, transferred_bytes,
+                                  GetTimeUs() - download_start);
+  }
+  tls->download_job.progress_callback = NULL;
+
+  if (tls->download_job.error_code == download::kFailOk) {
+    LogCvmfs(kLogCache, kLogDebug, "finished downloading of %s", url.c_str());
+
+    // Check decompressed size (a cross check just in case)
+    platform_stat64 stat_info;
+    stat_info.st_size = -1;
+    if ((platform_fstat(fileno(f), &stat_info) != 0) ||
+        (stat_info.st_size != (int64_t)size))
+    {
+      LogCvmfs(kLogCache, kLogSyslog,
+               "size check failure for %s, expected %lu, got %ld",
+               url.c_str(), size, stat_info.st_size);
+      if (CopyPath2Path(temp_path, *cache_path_ + "/quarantaine/" +
+                        checksum.ToString()) != 0)
+      {
+        LogCvmfs(kLogCache, kLogSyslog,
+                 "failed to move %s to quarantaine", temp_path.c_str());
+      }
+      result = -EIO;
+      goto fetch_finalize;
+    }
+
+    LogCvmfs(kLogCache, kLogDebug, "trying to commit %s", final_path.c_str());
+    fclose(f);
+    fd = -1;
+    // A streamed download without its own descriptor reads the committed file
+    uint64_t disk_size = size;
+    if (compress_ && (size >= kMinCompressedSize) &&
+        (!stream || (stream->fd >= 0)) &&
+        CompressTransaction(checksum, temp_path, size, &disk_size))
+    {
+      final_path += kCompressedSuffix;
+    }
+    fd_return = ::open(temp_path.c_str(), O_RDONLY);
+    if (fd_return < 0) {
+      result = -errno;
+      goto fetch_finalize;
+    }
+    if (txn) {
+      txn->id = checksum;
+      txn->size = disk_size;
+      txn->final_path = final_path;
+      txn->temp_path = temp_path;
+      txn->cvmfs_path = cvmfs_path;
+      result = 0;
+    } else {
+      result = cache::CommitTransaction(final_path, temp_path, cvmfs_path,
+                                        checksum, disk_size);
+    }
+    if (result == 0) {
+      platform_disable_kcache(fd_return);
+      result = fd_return;
+    } else {
+      close(fd_return);
+    }
+  }
+
+ fetch_finalize:
+  // Cleanup
+  LogCvmfs(kLogCache, kLogDebug, "finalizing download of %s",
+           cvmfs_path.c_str());
+  if (result < 0) {
+    LogCvmfs(kLogCache, kLogDebug | kLogSyslog, "failed to fetch %s (hash: %s, "
+             "error %d)", cvmfs_path.c_str(), checksum.ToString().c_str(),
+             tls->download_job.error_code);
+  }
+  if (fd >= 0) {
+    if (f) fclose(f);
+    else close(fd);
+    AbortTransaction(temp_path);
+  }
+  if (fd_lock >= 0)
+    UnlockSharedDownload(checksum, fd_lock);
+
+  // Hand out the result to the waiting threads and unregister the download.
+  // A deferred object stays registered until it is committed, so that it is
+  // not downloaded again in the meantime.
+  shard = LockShard(checksum);
+  for (unsigned i = 1; i < inflight->num_refs; ++i)
+    inflight->results.push_back((result >= 0) ? dup(result) : result);
+  inflight->done = true;
+  pthread_cond_broadcast(&inflight->cond);
+  if (txn && (result >= 0) && !txn->temp_path.empty()) {
+    inflight->deferred_path = txn->temp_path;
+  } else {
+    shard->inflight.erase(checksum);
+    ReleaseInflight(inflight);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return result;
+}
+
+
+/**
+ * Returns a read-only file descriptor for a specific catalog entry, see
+ * FetchObject().
+ *
+ * @param[in] d Demanded catalog entry
+ * @param[in] cvmfs_path Path of the file as seen in cvmfs
+ */
+int Fetch(const catalog::DirectoryEntry &d, const string &cvmfs_path) {
+  return FetchObject(d.checksum(), d.size(), "", cvmfs_path, NULL, NULL);
+}
+
+
+/**
+ * Like Fetch() but the path string is only built if the object needs to be
+ * downloaded, so that cache hits do not allocate from the heap.
+ */
+int Fetch(const catalog::DirectoryEntry &d, const PathString &cvmfs_path) {
+  if (d.size() <= quota::GetMaxFileSize()) {
+    const int fd = OpenCached(d.checksum());
+    if (fd >= 0)
+      return fd;
+  }
+  return Fetch(d, cvmfs_path.ToString());
+}
+
+
+/**
+ * Sets the download priority class of the fetches of the calling thread.
+ * Background threads use download::kPriorityBulk.
+ */
+void SetDownloadPriority(const download::Priority priority) {
+  GetThreadLocalStorage()->download_job.priority = priority;
+}
+
+
+/**
+ * Sets the repository of the fetches of the calling thread, see
+ * download::JobInfo::repository_name.  The string has to outlive the fetches.
+ */
+void SetDownloadRepository(const std::string *repository_name) {
+  GetThreadLocalStorage()->download_job.repository_name = repository_name;
+}
+
+
+/**
+ * Returns a read-only file descriptor for a piece of a chunked file.  Pieces
+ * are cached and accounted for by the quota manager like regular files.
+ *
+ * @param[in] chunk Demanded piece
+ * @param[in] cvmfs_path Path of the chunked file as seen in cvmfs
+ */
+int FetchChunk(const catalog::FileChunk &chunk, const string &cvmfs_path) {
+  return FetchObject(chunk.content_hash, chunk.size, "C", cvmfs_path, NULL,
+                     NULL);
+}
+
+
+/**
+ * Like FetchChunk() but without heap allocations for cached chunks.
+ */
+int FetchChunk(const catalog::FileChunk &chunk, const PathString &cvmfs_path) {
+  if (chunk.size <= quota::GetMaxFileSize()) {
+    const int fd = OpenCached(chunk.content_hash);
+    if (fd >= 0)
+      return fd;
+  }
+  return FetchChunk(chunk, cvmfs_path.ToString());
+}
+
+
+/**
+ * Downloads a bundle and caches its members that verify.  The members are
+ * accounted for under the path of the file that triggered the download.
+ */
+static bool LoadBundle(const hash::Any &bundle_hash,
+                       const catalog::BundleMemberList &members,
+                       const string &cvmfs_path)
+{
+  ThreadLocalStorage *tls = GetThreadLocalStorage();
+  const string url = "/data" + bundle_hash.MakePath(1, 2) + "B";
+  download::JobInfo download_bundle(&url, false, true, &bundle_hash);
+  download_bundle.priority = tls->download_job.priority;
+  download_bundle.repository_name = tls->download_job.repository_name;
+  download::Failures retval = download::Fetch(&download_bundle);
+  if (retval != download::kFailOk) {
+    LogCvmfs(kLogCache, kLogDebug, "failed to download bundle %s (%d)",
+             bundle_hash.ToString().c_str(), retval);
+    atomic_inc64(&num_bundles_failed_);
+    return false;
+  }
+  atomic_inc64(&num_bundles_);
+
+  const unsigned char *bundle = reinterpret_cast<const unsigned char *>(
+    download_bundle.destination_mem.data);
+  const uint64_t bundle_size = download_bundle.destination_mem.size;
+  unsigned num_cached = 0;
+  for (unsigned i = 0; i < members.size(); ++i) {
+    const catalog::BundleMember &member = members[i];
+    if ((member.offset > bundle_size) ||
+        (member.size > bundle_size - member.offset))
+    {
+      break;
+    }
+    if (Contains(member.content_hash))
+      continue;
+    hash::Any member_hash(member.content_hash.algorithm);
+    hash::HashMem(bundle + member.offset, member.size, &member_hash);
+    if (member_hash != member.content_hash) {
+      LogCvmfs(kLogCache, kLogDebug, "member %s of bundle %s is corrupted",
+               member.content_hash.ToString().c_str(),
+               bundle_hash.ToString().c_str());
+      continue;
+    }
+    void *buffer;
+    int64_t size;
+    if (!zlib::DecompressMem2Mem(bundle + member.offset, member.size,
+                                 &buffer, &size))
+    {
+      continue;
+    }
+    if ((static_cast<uint64_t>(size) <= quota::GetMaxFileSize()) &&
+        CommitFromMem(member.content_hash,
+                      static_cast<const unsigned char *>(buffer), size,
+                      cvmfs_path))
+    {
+      num_cached++;
+    }
+    free(buffer);
+  }
+  download::ReleaseMemBuffer(&download_bundle);
+  atomic_xadd64(&num_bundled_, num_cached);
+  LogCvmfs(kLogCache, kLogDebug, "cached %u of %u members of bundle %s",
+           num_cached, members.size(), bundle_hash.ToString().c_str());
+  return true;
+}
+
+
+/**
+ * Like Fetch() but a miss downloads the bundle that contains d, so that the
+ * siblings of d are found in the cache later on.  Concurrent misses on the
+ * same bundle wait for a single download.  Falls back to Fetch() if the
+ * bundle does not help.
+ *
+ * @param[in] members All members of the bundle, see Catalog::LookupBundle()
+ */
+int FetchBundle(const catalog::DirectoryEntry &d, const hash::Any &bundle_hash,
+                const catalog::BundleMemberList &members,
+                const string &cvmfs_path)
+{
+  int fd = cache::Open(d.checksum());
+  if (fd >= 0) {
+    quota::Touch(d.checksum());
+    return fd;
+  }
+
+  bool download = false;
+  pthread_mutex_lock(&lock_bundles_);
+  if (bundles_inflight_->find(bundle_hash) == bundles_inflight_->end()) {
+    bundles_inflight_->insert(bundle_hash);
+    download = true;
+  } else {
+    while (bundles_inflight_->find(bundle_hash) != bundles_inflight_->end())
+      pthread_cond_wait(&cond_bundles_, &lock_bundles_);
+  }
+  pthread_mutex_unlock(&lock_bundles_);
+
+  if (download) {
+    LoadBundle(bundle_hash, members, cvmfs_path);
+    pthread_mutex_lock(&lock_bundles_);
+    bundles_inflight_->erase(bundle_hash);
+    pthread_cond_broadcast(&cond_bundles_);
+    pthread_mutex_unlock(&lock_bundles_);
+  }
+  return Fetch(d, cvmfs_path);
+}
+
+
+string GetBundleStatistics() {
+  return "downloads: " + StringifyInt(atomic_read64(&num_bundles_)) + "  " +
+    "cached objects: " + StringifyInt(atomic_read64(&num_bundled_)) + "  " +
+    "failed: " + StringifyInt(atomic_read64(&num_bundles_failed_)) + "\n";
+}
+
+
+int64_t GetNumBundleDownloads() {
+  return atomic_read64(&num_bundles_);
+}
+
+
+int64_t GetNumBundledObjects() {
+  return atomic_read64(&num_bundled_);
+}
+
+
+/**
+ * Unregisters the download of a deferred object after its transaction is
+ * committed or aborted.  Caller holds the shard lock.
+ */
+static void EraseDeferred(DownloadShard *shard, const Transaction &txn) {
+  InflightMap::iterator iInflight = shard->inflight.find(txn.id);
+  if ((iInflight == shard->inflight.end()) ||
+      (iInflight->second->deferred_path != txn.temp_path))
+  {
+    return;
+  }
+  InflightDownload *inflight = iInflight->second;
+  shard->inflight.erase(iInflight);
+  ReleaseInflight(inflight);
+}
+
+
+/**
+ * Like Fetch() but leaves a downloaded file in its transaction, so that many
+ * small objects can be committed by a single CommitTransactions().  If d is
+ * found in the cache or downloaded by another thread, txn->temp_path stays
+ * empty.  The returned descriptor stays valid after the commit.  Until the
+ * commit, concurrent fetches of the object open the transaction file.
+ */
+int FetchDeferred(const catalog::DirectoryEntry &d, const string &cvmfs_path,
+                  Transaction *txn)
+{
+  txn->temp_path.clear();
+  return FetchObject(d.checksum(), d.size(), "", cvmfs_path, NULL, txn);
+}
+
+
+/**
+ * Commits a batch of transactions with one quota manager update.  Returns
+ * the number of successfully committed objects.
+ */
+unsigned CommitTransactions(const vector<Transaction> &txns) {
+  vector<hash::Any> hashes;
+  vector<uint64_t> sizes;
+  vector<string> cvmfs_paths;
+  for (unsigned i = 0; i < txns.size(); ++i) {
+    // The object is unregistered once it is visible under its final path
+    DownloadShard *shard = LockShard(txns[i].id);
+    const bool committed =
+      (rename(txns[i].temp_path.c_str(), txns[i].final_path.c_str()) == 0);
+    if (!committed) {
+      LogCvmfs(kLogCache, kLogDebug, "commit failed: %s", strerror(errno));
+      unlink(txns[i].temp_path.c_str());
+    }
+    EraseDeferred(shard, txns[i]);
+    pthread_mutex_unlock(&shard->lock);
+    if (!committed)
+      continue;
+    FilterInsert(txns[i].id);
+    hashes.push_back(txns[i].id);
+    sizes.push_back(txns[i].size);
+    cvmfs_paths.push_back(txns[i].cvmfs_path);
+  }
+  quota::InsertBatch(hashes, sizes, cvmfs_paths);
+  atomic_inc64(&num_batches_);
+  atomic_xadd64(&num_batched_, hashes.size());
+  LogCvmfs(kLogCache, kLogDebug, "committed %"PRIu64" of %"PRIu64
+           " transactions", uint64_t(hashes.size()), uint64_t(txns.size()));
+  return hashes.size();
+}
+
+
+/**
+ * Drops transactions that are not going to be committed.
+ */
+void AbortTransactions(const vector<Transaction> &txns) {
+  for (unsigned i = 0; i < txns.size(); ++i) {
+    DownloadShard *shard = LockShard(txns[i].id);
+    AbortTransaction(txns[i].temp_path);
+    EraseDeferred(shard, txns[i]);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+
+string GetBatchStatistics() {
+  return "batches: " + StringifyInt(atomic_read64(&num_batches_)) + "  " +
+    "objects: " + StringifyInt(atomic_read64(&num_batched_)) + "\n";
+}
+
+
+static void *MainStreaming(void *data) {
+  StreamingFetch *stream = static_cast<StreamingFetch *>(data);
+  const int fd = FetchObject(stream->checksum, stream->size, "",
+                             stream->cvmfs_path, stream, NULL);
+
+  pthread_mutex_lock(&stream->lock);
+  if (fd >= 0) {
+    // The committed file is the same inode as the transaction file
+    if (stream->fd < 0)
+      stream->fd = fd;
+    else
+      close(fd);
+    stream->written = stream->size;
+  } else {
+    stream->result = (fd == -ENOSPC) ? -ENOSPC : -EIO;
+  }
+  stream->done = true;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+  ReleaseStreaming(stream);
+
+  pthread_mutex_lock(&lock_streaming_);
+  num_streaming_--;
+  pthread_cond_broadcast(&cond_streaming_);
+  pthread_mutex_unlock(&lock_streaming_);
+  return NULL;
+}
+
+
+/**
+ * Starts downloading d in a separate thread and returns a handle that can be
+ * read from before the download is complete.  Returns NULL if too many
+ * downloads are streamed already; the caller falls back to Fetch() then.
+ */
+StreamingFetch *StartStreaming(const catalog::DirectoryEntry &d,
+                               const string &cvmfs_path)
+{
+  pthread_mutex_lock(&lock_streaming_);
+  if (num_streaming_ >= kMaxStreaming) {
+    pthread_mutex_unlock(&lock_streaming_);
+    return NULL;
+  }
+  num_streaming_++;
+  pthread_mutex_unlock(&lock_streaming_);
+
+  StreamingFetch *stream = new StreamingFetch(d.checksum(), d.size(),
+                                              cvmfs_path);
+  pthread_t thread_streaming;
+  pthread_attr_t attr;
+  int retval = pthread_attr_init(&attr);
+  retval |= pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  retval |= pthread_create(&thread_streaming, &attr, MainStreaming, stream);
+  pthread_attr_destroy(&attr);
+  if (retval != 0) {
+    delete stream;
+    pthread_mutex_lock(&lock_streaming_);
+    num_streaming_--;
+    pthread_mutex_unlock(&lock_streaming_);
+    return NULL;
+  }
+  atomic_inc64(&num_streamed_);
+  LogCvmfs(kLogCache, kLogDebug, "streaming download of %s",
+           cvmfs_path.c_str());
+  return stream;
+}
+
+
+/**
+ * Reads from a streamed download, waits until the requested range has been
+ * received.  Returns the number of bytes read or a negative error code.
+ */
+int64_t ReadStreaming(StreamingFetch *stream, void *buffer, const size_t size,
+                      const off_t offset)
+{
+  if (uint64_t(offset) >= stream->size)
+    return 0;
+  const int64_t end = std::min(uint64_t(offset + size), stream->size);
+
+  while (true) {
+    pthread_mutex_lock(&stream->lock);
+    while (!stream->done && (stream->written < end))
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    const int result = stream->result;
+    const bool done = stream->done;
+    const int fd = stream->fd;
+    pthread_mutex_unlock(&stream->lock);
+    if (result < 0)
+      return result;
+
+    const int64_t nbytes = pread(fd, buffer, end - offset, offset);
+    if (nbytes < 0)
+      return -errno;
+    // A short read happens if a retried download truncated the file
+    if ((nbytes == end - offset) || done)
+      return nbytes;
+  }
+}
+
+
+/**
+ * Drops a reference to a streamed download.  The download continues in the
+ * background if the file is closed before it is complete.
+ */
+void ReleaseStreaming(StreamingFetch *stream) {
+  pthread_mutex_lock(&stream->lock);
+  const bool last = (--stream->num_refs == 0);
+  pthread_mutex_unlock(&stream->lock);
+  if (last)
+    delete stream;
+}
+
+
+/**
+ * Waits for the streaming workers to finish, has to run before the download
+ * manager is stopped.
+ */
+void WaitForStreaming() {
+  pthread_mutex_lock(&lock_streaming_);
+  while (num_streaming_ > 0)
+    pthread_cond_wait(&cond_streaming_, &lock_streaming_);
+  pthread_mutex_unlock(&lock_streaming_);
+}
+
+
+int64_t GetNumStreamingFetches() {
+  return atomic_read64(&num_streamed_);
+}
+
+
+/**
+ * Makes cache misses short-circuit through a bloom filter of the cached
+ * objects.  The caller inserts all objects currently in the cache directory.
+ * Has to run before any other thread uses the cache.
+ */
+void InitFilter(const uint64_t num_objects) {
+  delete cache_filter_;
+  cache_filter_ = new CacheFilter(num_objects, false);
+}
+
+
+/**
+ * Like InitFilter() but for a cache whose objects are not yet known.  The
+ * filter filters nothing until CompleteFilter() provides the objects.
+ */
+void InitPendingFilter() {
+  delete cache_filter_;
+  cache_filter_ = new CacheFilter(0, true);
+}
+
+
+void CompleteFilter(const vector<hash::Any> &objects) {
+  if (cache_filter_)
+    cache_filter_->Complete(objects);
+}
+
+
+void FilterInsert(const hash::Any &id) {
+  if (cache_filter_)
+    cache_filter_->Insert(id);
+}
+
+
+void FilterRemove(const hash::Any &id) {
+  if (cache_filter_)
+    cache_filter_->Remove(id);
+}
+
+
+string GetFilterStatistics() {
+  if (!cache_filter_)
+    return "disabled\n";
+  return cache_filter_->PrintStatistics();
+}
+
+
+int64_t GetNumDownloads() {
+  return atomic_read64(&num_download_);
+}
+
+
+int64_t GetNumCoalescedDownloads() {
+  return atomic_read64(&num_coalesced_);
+}
+
+
+int64_t GetNumSharedDownloads() {
+  return atomic_read64(&num_shared_);
+}
+
+
+int64_t GetNumPeerDownloads() {
+  return atomic_read64(&num_peer_);
+}
+
+
+int64_t GetNumContendedDownloads() {
+  return atomic_read64(&num_contended_);
+}
+
+
+/**
+ * The memory tier keeps small, frequently opened objects in memory, so that
+ * they can be served without touching the disk cache.  An object is only
+ * loaded on its second open, single opens would just push out the hot set.
+ * Memory is limited by its own size, independent of the cache quota.
+ */
+namespace {
+
+struct MemoryEntry : public MemoryObject {
+  hash::Any id;
+  unsigned num_refs;  /**< open handles plus one while in the tier */
+  list<MemoryEntry *>::iterator lru_position;
+};
+
+typedef map<hash::Any, MemoryEntry *> MemoryMap;
+
+const unsigned kMaxSeenOnce = 16384;
+uint64_t memory_max_size_ = 0;  /**< 0 disables the memory tier */
+uint64_t memory_limit_ = 0;  /**< memory_max_size_ or less under pressure */
+uint64_t memory_max_object_size_ = 0;
+uint64_t memory_size_ = 0;
+MemoryMap *memory_objects_ = NULL;
+list<MemoryEntry *> *memory_lru_ = NULL;  /**< Least recently used first */
+set<hash::Any> *memory_seen_once_ = NULL;
+pthread_mutex_t lock_memory_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t memory_num_hit_ = 0;
+uint64_t memory_num_miss_ = 0;
+uint64_t memory_num_insert_ = 0;
+uint64_t memory_num_evict_ = 0;
+
+
+/**
+ * Drops a reference, caller holds lock_memory_.
+ */
+void UnrefMemoryEntry(MemoryEntry *entry) {
+  if (--entry->num_refs > 0)
+    return;
+  memory_size_ -= entry->size;
+  free(entry->buffer);
+  delete entry;
+}
+
+
+/**
+ * Throws out least recently used objects until needed bytes fit.  Objects
+ * that are still open are freed when they are released.
+ */
+void EvictMemory(const uint64_t needed) {
+  while (!memory_lru_->empty() && (memory_size_ + needed > memory_limit_)) {
+    MemoryEntry *entry = memory_lru_->front();
+    memory_lru_->pop_front();
+    memory_objects_->erase(entry->id);
+    memory_num_evict_++;
+    UnrefMemoryEntry(entry);
+  }
+}
+
+}  // anonymous namespace
+
+
+/**
+ * Enables the memory tier.  Objects up to max_object_size bytes are
+ * candidates, in total they occupy at most max_size bytes.
+ */
+void InitMemoryTier(const uint64_t max_size, const uint64_t max_object_size) {
+  memory_max_size_ = max_size;
+  memory_limit_ = max_size;
+  memory_max_object_size_ = max_object_size;
+  memory_size_ = 0;
+  memory_objects_ = new MemoryMap();
+  memory_lru_ = new list<MemoryEntry *>();
+  memory_seen_once_ = new set<hash::Any>();
+}
+
+
+void FiniMemoryTier() {
+  if (!memory_objects_)
+    return;
+  for (list<MemoryEntry *>::iterator i = memory_lru_->begin(),
+       iEnd = memory_lru_->end(); i != iEnd; ++i)
+  {
+    UnrefMemoryEntry(*i);
+  }
+  delete memory_objects_;
+  delete memory_lru_;
+  delete memory_seen_once_;
+  memory_objects_ = NULL;
+  memory_lru_ = NULL;
+  memory_seen_once_ = NULL;
+  memory_max_size_ = 0;
+  memory_limit_ = 0;
+}
+
+
+bool IsMemoryTierCandidate(const uint64_t size) {
+  return (memory_max_size_ > 0) && (size > 0) &&
+         (size <= memory_max_object_size_);
+}
+
+
+/**
+ * Looks up an object in the memory tier.  The result has to be handed back
+ * by ReleaseMemory().
+ *
+ * \return The object or NULL if it is not in memory
+ */
+const MemoryObject *AcquireFromMemory(const hash::Any &id) {
+  pthread_mutex_lock(&lock_memory_);
+  MemoryMap::iterator iter = memory_objects_->find(id);
+  if (iter == memory_objects_->end()) {
+    memory_num_miss_++;
+    pthread_mutex_unlock(&lock_memory_);
+    return NULL;
+  }
+  MemoryEntry *entry = iter->second;
+  entry->num_refs++;
+  memory_lru_->splice(memory_lru_->end(), *memory_lru_, entry->lru_position);
+  memory_num_hit_++;
+  pthread_mutex_unlock(&lock_memory_);
+  return entry;
+}
+
+
+/**
+ * Copies an object from an open cache file into memory, if it was asked for
+ * before.  The file descriptor stays open.
+ *
+ * \return The object (to be released by ReleaseMemory()) or NULL
+ */
+const MemoryObject *LoadIntoMemory(const hash::Any &id, const int fd,
+                                   const uint64_t size)
+{
+  if (!IsMemoryTierCandidate(size))
+    return NULL;
+
+  pthread_mutex_lock(&lock_memory_);
+  if (memory_seen_once_->find(id) == memory_seen_once_->end()) {
+    if (memory_seen_once_->size() >= kMaxSeenOnce)
+      memory_seen_once_->clear();
+    memory_seen_once_->insert(id);
+    pthread_mutex_unlock(&lock_memory_);
+    return NULL;
+  }
+  memory_seen_once_->erase(id);
+  pthread_mutex_unlock(&lock_memory_);
+
+  unsigned char *buffer = static_cast<unsigned char *>(smalloc(size));
+  int64_t nbytes;
+  CompressedObject *compressed = OpenCompressed(id, fd);
+  if (compressed) {
+    nbytes = ReadCompressed(compressed, buffer, size, 0);
+    CloseCompressed(compressed);
+  } else {
+    nbytes = pread(fd, buffer, size, 0);
+  }
+  if ((nbytes < 0) || (static_cast<uint64_t>(nbytes) != size)) {
+    free(buffer);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&lock_memory_);
+  MemoryMap::iterator iter = memory_objects_->find(id);
+  if (iter != memory_objects_->end()) {
+    // Another thread was faster
+    free(buffer);
+    iter->second->num_refs++;
+    pthread_mutex_unlock(&lock_memory_);
+    return iter->second;
+  }
+  if (size > memory_limit_) {
+    // Shrunk by the memory budget
+    free(buffer);
+    pthread_mutex_unlock(&lock_memory_);
+    return NULL;
+  }
+  EvictMemory(size);
+  MemoryEntry *entry = new MemoryEntry();
+  entry->buffer = buffer;
+  entry->size = size;
+  entry->id = id;
+  entry->num_refs = 2;
+  entry->lru_position = memory_lru_->insert(memory_lru_->end(), entry);
+  (*memory_objects_)[id] = entry;
+  memory_size_ += size;
+  memory_num_insert_++;
+  pthread_mutex_unlock(&lock_memory_);
+  return entry;
+}
+
+
+void ReleaseMemory(const MemoryObject *object) {
+  pthread_mutex_lock(&lock_memory_);
+  UnrefMemoryEntry(
+    static_cast<MemoryEntry *>(const_cast<MemoryObject *>(object)));
+  pthread_mutex_unlock(&lock_memory_);
+}
+
+
+/**
+ * Lowers the memory tier below its configured size, or raises it back up to
+ * the configured size.  Used by the memory budget.
+ */
+void SetMemoryTierLimit(const uint64_t limit) {
+  pthread_mutex_lock(&lock_memory_);
+  if (memory_objects_) {
+    memory_limit_ = (limit < memory_max_size_) ? limit : memory_max_size_;
+    EvictMemory(0);
+  }
+  pthread_mutex_unlock(&lock_memory_);
+}
+
+
+uint64_t GetMemoryTierSize() {
+  pthread_mutex_lock(&lock_memory_);
+  const uint64_t result = memory_size_;
+  pthread_mutex_unlock(&lock_memory_);
+  return result;
+}
+
+
+string GetMemoryTierStatistics() {
+  if (memory_max_size_ == 0)
+    return "disabled\n";
+  pthread_mutex_lock(&lock_memory_);
+  const uint64_t num_lookups = memory_num_hit_ + memory_num_miss_;
+  const string result =
+    StringifyInt(memory_objects_->size()) + " objects, " +
+    StringifyInt(memory_size_ / 1024) + "/" +
+    StringifyInt(memory_limit_ / 1024) + " kB  " +
+    "hits: " + StringifyInt(memory_num_hit_) + "  " +
+    "misses: " + StringifyInt(memory_num_miss_) + "  " +
+    "hit rate: " + (num_lookups ?
+      StringifyInt(memory_num_hit_ * 100 / num_lookups) + "%" : "n/a") +
+    "  inserts: " + StringifyInt(memory_num_insert_) + "  " +
+    "evictions: " + StringifyInt(memory_num_evict_) + "\n";
+  pthread_mutex_unlock(&lock_memory_);
+  return result;
+}
+
+
+CatalogManager::CatalogManager(const string &repo_name,
+                               const bool ignore_signature)
+{
+  LogCvmfs(kLogCache, kLogDebug, "constructing cache catalog manager");
+  repo_name_ = repo_name;
+  ignore_signature_ = ignore_signature;
+  offline_mode_ = false;
+  loaded_inodes_ = all_inodes_ = 0;
+  atomic_init32(&certificate_hits_);
+  atomic_init32(&certificate_misses_);
+  deltas_enabled_ = false;
+  atomic_init64(&num_deltas_applied_);
+  atomic_init64(&num_deltas_failed_);
+  prefetch_max_parallel_ = 0;
+  prefetch_threads_ = NULL;
+  prefetch_spawned_ = false;
+  prefetch_stop_ = false;
+  num_prefetched_ = num_prefetch_cached_ = num_prefetch_failed_ = 0;
+  int retval = pthread_mutex_init(&lock_prefetch_, NULL);
+  retval |= pthread_cond_init(&cond_prefetch_, NULL);
+  retval |= pthread_mutex_init(&lock_loaded_, NULL);
+  assert(retval == 0);
+}
+
+
+/**
+ * Stops the prefetch threads.  Running downloads are finished first.
+ */
+CatalogManager::~CatalogManager() {
+  if (prefetch_spawned_) {
+    pthread_mutex_lock(&lock_prefetch_);
+    prefetch_stop_ = true;
+    pthread_cond_broadcast(&cond_prefetch_);
+    pthread_mutex_unlock(&lock_prefetch_);
+    for (unsigned i = 0; i < prefetch_max_parallel_; ++i)
+      pthread_join(prefetch_threads_[i], NULL);
+  }
+  delete[] prefetch_threads_;
+  pthread_cond_destroy(&cond_prefetch_);
+  pthread_mutex_destroy(&lock_prefetch_);
+  pthread_mutex_destroy(&lock_loaded_);
+}
+
+
+/**
+ * Attached catalogs queue their nested catalogs for download by up to
+ * max_parallel threads.  Has to be called before Init().
+ */
+void CatalogManager::EnableNestedPrefetch(const unsigned max_parallel) {
+  prefetch_max_parallel_ = max_parallel;
+}
+
+
+/**
+ * Starts the prefetch threads, has to run after fork().
+ */
+void CatalogManager::SpawnNestedPrefetch() {
+  if (prefetch_max_parallel_ == 0)
+    return;
+  prefetch_threads_ = new pthread_t[prefetch_max_parallel_];
+  for (unsigned i = 0; i < prefetch_max_parallel_; ++i) {
+    int retval = pthread_create(&prefetch_threads_[i], NULL,
+                                MainNestedPrefetch, this);
+    assert(retval == 0);
+  }
+  prefetch_spawned_ = true;
+}
+
+
+string CatalogManager::GetNestedPrefetchStats() {
+  if (prefetch_max_parallel_ == 0)
+    return "disabled\n";
+  pthread_mutex_lock(&lock_prefetch_);
+  const string result =
+    "queued: " + StringifyInt(prefetch_queue_.size()) + "  " +
+    "fetched: " + StringifyInt(num_prefetched_) + "  " +
+    "already cached: " + StringifyInt(num_prefetch_cached_) + "  " +
+    "failed: " + StringifyInt(num_prefetch_failed_) + "\n";
+  pthread_mutex_unlock(&lock_prefetch_);
+  return result;
+}
+
+
+string CatalogManager::GetDeltaStats() {
+  if (!deltas_enabled_)
+    return "disabled\n";
+  return "applied: " + StringifyInt(atomic_read64(&num_deltas_applied_)) +
+    "  failed or missing: " + StringifyInt(atomic_read64(&num_deltas_failed_)) +
+    "\n";
+}
+
+
+/**
+ * Queues the nested catalogs of a freshly attached catalog.  Called with the
+ * catalog manager's write lock held, so it only touches the queue.
+ */
+void CatalogManager::PrefetchNested(const catalog::Catalog *catalog) {
+  if (prefetch_max_parallel_ == 0)
+    return;
+
+  const catalog::Catalog::NestedCatalogList *nested_catalogs =
+    catalog->ListNestedCatalogs();
+  pthread_mutex_lock(&lock_prefetch_);
+  for (unsigned i = 0; i < nested_catalogs->size(); ++i) {
+    const catalog::Catalog::NestedCatalog &nested = (*nested_catalogs)[i];
+    if (nested.hash.IsNull() ||
+        (prefetch_queued_.find(nested.hash) != prefetch_queued_.end()) ||
+        (prefetch_queue_.size() >= kMaxPrefetchQueue))
+    {
+      continue;
+    }
+    prefetch_queue_.push_back(nested);
+    prefetch_queued_.insert(nested.hash);
+  }
+  pthread_cond_broadcast(&cond_prefetch_);
+  pthread_mutex_unlock(&lock_prefetch_);
+}
+
+
+void *CatalogManager::MainNestedPrefetch(void *data) {
+  CatalogManager *catalog_mgr = static_cast<CatalogManager *>(data);
+  LogCvmfs(kLogCache, kLogDebug, "starting nested catalog prefetch thread");
+
+  while (true) {
+    pthread_mutex_lock(&catalog_mgr->lock_prefetch_);
+    while (catalog_mgr->prefetch_queue_.empty() && !catalog_mgr->prefetch_stop_)
+      pthread_cond_wait(&catalog_mgr->cond_prefetch_,
+                        &catalog_mgr->lock_prefetch_);
+    if (catalog_mgr->prefetch_stop_) {
+      pthread_mutex_unlock(&catalog_mgr->lock_prefetch_);
+      break;
+    }
+    const catalog::Catalog::NestedCatalog nested =
+      catalog_mgr->prefetch_queue_.front();
+    catalog_mgr->prefetch_queue_.erase(catalog_mgr->prefetch_queue_.begin());
+    pthread_mutex_unlock(&catalog_mgr->lock_prefetch_);
+
+    catalog_mgr->FetchNested(nested);
+
+    pthread_mutex_lock(&catalog_mgr->lock_prefetch_);
+    catalog_mgr->prefetch_queued_.erase(nested.hash);
+    pthread_mutex_unlock(&catalog_mgr->lock_prefetch_);
+  }
+
+  LogCvmfs(kLogCache, kLogDebug, "stopping nested catalog prefetch thread");
+  return NULL;
+}
+
+
+/**
+ * Background prefetch of a nested catalog that is likely attached soon.
+ */
+void CatalogManager::FetchNested(const catalog::Catalog::NestedCatalog &nested)
+{
+  if (Contains(nested.hash)) {
+    pthread_mutex_lock(&lock_prefetch_);
+    num_prefetch_cached_++;
+    pthread_mutex_unlock(&lock_prefetch_);
+    return;
+  }
+
+  const bool success = DownloadNested(nested, download::kPriorityBulk);
+  pthread_mutex_lock(&lock_prefetch_);
+  if (success)
+    num_prefetched_++;
+  else
+    num_prefetch_failed_++;
+  pthread_mutex_unlock(&lock_prefetch_);
+}
+
+
+/**
+ * Nested catalogs of the next revision are put into the cache before the
+ * remount switches the trees.  They are not pinned until they are attached.
+ */
+bool CatalogManager::FetchCatalog(
+  const catalog::Catalog::NestedCatalog &nested,
+  string *catalog_path)
+{
+  *catalog_path = *cache_path_ + nested.hash.MakePath(1, 2);
+  return Contains(nested.hash) ||
+         DownloadNested(nested, download::kPriorityMetadata);
+}
+
+
+/**
+ * Downloads and verifies a nested catalog and commits it to the cache as a
+ * regular file.  It gets pinned by LoadCatalogCas() when it is attached.
+ */
+bool CatalogManager::DownloadNested(
+  const catalog::Catalog::NestedCatalog &nested,
+  const download::Priority priority)
+{
+  const string cvmfs_path = "file catalog at " + repo_name_ + ":" +
+    string(nested.path.GetChars(), nested.path.GetLength()) +
+    " (" + nested.hash.ToString() + ")";
+  LogCvmfs(kLogCache, kLogDebug, "prefetching %s", cvmfs_path.c_str());
+  bool success = false;
+  string final_path;
+  string temp_path;
+  const int fd = StartTransaction(nested.hash, &final_path, &temp_path);
+  if ((fd >= 0) &&
+      FetchDelta(nested.hash, GetPreviousHash(nested.path), temp_path))
+  {
+    close(fd);
+    const int64_t size = GetFileSize(temp_path.c_str());
+    if ((size <= 0) || (uint64_t(size) > quota::GetMaxFileSize())) {
+      AbortTransaction(temp_path);
+    } else {
+      success = (CommitTransaction(final_path, temp_path, cvmfs_path,
+                                   nested.hash, size) == 0);
+    }
+  } else if (fd >= 0) {
+    FILE *f = (ftruncate(fd, 0) == 0) ? fdopen(fd, "w") : NULL;
+    if (!f) {
+      close(fd);
+      AbortTransaction(temp_path);
+    } else {
+      const string url = "/data" + nested.hash.MakePath(1, 2) + "C";
+      download::JobInfo download_catalog(&url, true, true, f, &nested.hash);
+      download_catalog.priority = priority;
+      download_catalog.repository_name = &repo_name_;
+      download::Fetch(&download_catalog);
+      fclose(f);
+      const int64_t size = GetFileSize(temp_path.c_str());
+      if ((download_catalog.error_code != download::kFailOk) || (size <= 0) ||
+          (uint64_t(size) > quota::GetMaxFileSize()))
+      {
+        AbortTransaction(temp_path);
+      } else {
+        success = (CommitTransaction(final_path, temp_path, cvmfs_path,
+                                     nested.hash, size) == 0);
+      }
+    }
+  }
+  return success;
+}
+
+
+/**
+ * Specialized initialization that uses a fixed root hash.
+ */
+bool CatalogManager::InitFixed(const hash::Any &root_hash) {
+  LogCvmfs(kLogCatalog, kLogDebug, "Initialize catalog with root hash %s",
+           root_hash.ToString().c_str());
+  WriteLock();
+  bool attached = MountCatalog(PathString("", 0), root_hash, NULL);
+  Unlock();
+
+  if (!attached) {
+    LogCvmfs(kLogCatalog, kLogDebug, "failed to initialize root catalog");
+  }
+
+  return attached;
+}
+
+
+catalog::Catalog *CatalogManager::CreateCatalog(const PathString &mountpoint,
+  catalog::Catalog *parent_catalog)
+{
+  pthread_mutex_lock(&lock_loaded_);
+  mounted_catalogs_[mountpoint] = loaded_catalogs_[mountpoint];
+  loaded_catalogs_.erase(mountpoint);
+  pthread_mutex_unlock(&lock_loaded_);
   return new catalog::Catalog(mountpoint, parent_catalog);
 }
 
@@ -560,7 +2463,69 @@ void CatalogManager::ActivateCatalog(const catalog::Catalog *catalog) {
 }
 
 
+/**
+ * Patches the cached previous revision of a catalog with the delta that the
+ * publisher stored next to the new revision.  The caller downloads the full
+ * catalog if there is no delta or if it doesn't apply.
+ * @param[in] dest_path the catalog's transaction file
+ */
+bool CatalogManager::FetchDelta(const hash::Any &hash,
+                                const hash::Any &base_hash,
+                                const string &dest_path)
+{
+  if (!deltas_enabled_ || base_hash.IsNull() || (base_hash == hash))
+    return false;
+  const string base_path = *cache_path_ + base_hash.MakePath(1, 2);
+  if (!FileExists(base_path))
+    return false;
+
+  string delta_path;
+  FILE *fdelta = CreateTempFile(*cache_path_ + "/txn/delta", 0600, "w",
+                                &delta_path);
+  if (!fdelta)
+    return false;
+  const string url = "/data" + hash.MakePath(1, 2) + catalog::kDeltaSuffix;
+  download::JobInfo download_delta(&url, true, true, fdelta, NULL);
+  download_delta.priority = download::kPriorityMetadata;
+  download_delta.repository_name = &repo_name_;
+  download::Fetch(&download_delta);
+  fclose(fdelta);
+  const bool result = (download_delta.error_code == download::kFailOk) &&
+    catalog::ApplyDelta(base_path, base_hash, delta_path, dest_path, hash);
+  unlink(delta_path.c_str());
+
+  if (result) {
+    atomic_inc64(&num_deltas_applied_);
+    LogCvmfs(kLogCache, kLogDebug, "patched catalog %s from %s",
+             hash.ToString().c_str(), base_hash.ToString().c_str());
+  } else {
+    atomic_inc64(&num_deltas_failed_);
+    LogCvmfs(kLogCache, kLogDebug, "no delta from %s to catalog %s (%d)",
+             base_hash.ToString().c_str(), hash.ToString().c_str(),
+             download_delta.error_code);
+  }
+  return result;
+}
+
+
+/**
+ * The revision of the catalog that was last mounted at mountpoint, the null
+ * hash if there was none.
+ */
+hash::Any CatalogManager::GetPreviousHash(const PathString &mountpoint) {
+  hash::Any result;
+  pthread_mutex_lock(&lock_loaded_);
+  map<PathString, hash::Any>::const_iterator iter =
+    unloaded_catalogs_.find(mountpoint);
+  if (iter != unloaded_catalogs_.end())
+    result = iter->second;
+  pthread_mutex_unlock(&lock_loaded_);
+  return result;
+}
+
+
 catalog::LoadError CatalogManager::LoadCatalogCas(const hash::Any &hash,
+                                                  const hash::Any &base_hash,
                                                   const string &cvmfs_path,
                                                   std::string *catalog_path)
 {
@@ -571,7 +2536,9 @@ catalog::LoadError CatalogManager::LoadCatalogCas(const hash::Any &hash,
   // Try from cache
   const string cache_path = *cache_path_ + hash.MakePath(1, 2);
   *catalog_path = cache_path + "T";
-  retval = rename(cache_path.c_str(), catalog_path->c_str());
+  retval = -1;
+  if (!cache_filter_ || cache_filter_->MaybeContains(hash))
+    retval = rename(cache_path.c_str(), catalog_path->c_str());
   if (retval == 0) {
     LogCvmfs(kLogCache, kLogDebug, "found catalog %s in cache",
              hash.ToString().c_str());
@@ -599,22 +2566,31 @@ catalog::LoadError CatalogManager::LoadCatalogCas(const hash::Any &hash,
   if (catalog_fd < 0)
     return catalog::kLoadFail;
 
-  FILE *catalog_file = fdopen(catalog_fd, "w");
-  if (!catalog_file) {
-    AbortTransaction(temp_path);
-    return catalog::kLoadFail;
-  }
+  if (FetchDelta(hash, base_hash, temp_path)) {
+    close(catalog_fd);
+  } else {
+    FILE *catalog_file = NULL;
+    if (ftruncate(catalog_fd, 0) == 0)
+      catalog_file = fdopen(catalog_fd, "w");
+    if (!catalog_file) {
+      close(catalog_fd);
+      AbortTransaction(temp_path);
+      return catalog::kLoadFail;
+    }
 
-  const string url = "/data" + hash.MakePath(1, 2) + "C";
-  download::JobInfo download_catalog(&url, true, true, catalog_file, &hash);
-  download::Fetch(&download_catalog);
-  fclose(catalog_file);
-  if (download_catalog.error_code != download::kFailOk) {
-    LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
-             "unable to load catalog with key %s (%d)",
-             hash.ToString().c_str(), download_catalog.error_code);
-    AbortTransaction(temp_path);
-    return catalog::kLoadFail;
+    const string url = "/data" + hash.MakePath(1, 2) + "C";
+    download::JobInfo download_catalog(&url, true, true, catalog_file, &hash);
+    download_catalog.priority = download::kPriorityMetadata;
+    download_catalog.repository_name = &repo_name_;
+    download::Fetch(&download_catalog);
+    fclose(catalog_file);
+    if (download_catalog.error_code != download::kFailOk) {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "unable to load catalog with key %s (%d)",
+               hash.ToString().c_str(), download_catalog.error_code);
+      AbortTransaction(temp_path);
+      return catalog::kLoadFail;
+    }
   }
 
   size = GetFileSize(temp_path.c_str());
@@ -636,10 +2612,24 @@ catalog::LoadError CatalogManager::LoadCatalogCas(const hash::Any &hash,
     quota::Remove(hash);
     return catalog::kLoadFail;
   }
+  FilterInsert(hash);
   return catalog::kLoadNew;
 }
 
 
+/**
+ * Nested catalogs are loaded outside of the catalog manager's write lock,
+ * so concurrent loads access loaded_catalogs_.
+ */
+void CatalogManager::SetLoaded(const PathString &mountpoint,
+                               const hash::Any &hash)
+{
+  pthread_mutex_lock(&lock_loaded_);
+  loaded_catalogs_[mountpoint] = hash;
+  pthread_mutex_unlock(&lock_loaded_);
+}
+
+
 catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
                                                const hash::Any &hash,
                                                std::string *catalog_path)
@@ -652,10 +2642,11 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
   // Load a particular catalog
   if (!hash.IsNull()) {
     cvmfs_path += " (" + hash.ToString() + ")";
-    catalog::LoadError load_error = LoadCatalogCas(hash, cvmfs_path,
-                                                   catalog_path);
+    catalog::LoadError load_error =
+      LoadCatalogCas(hash, GetPreviousHash(mountpoint), cvmfs_path,
+                     catalog_path);
     if (load_error == catalog::kLoadNew)
-      loaded_catalogs_[mountpoint] = hash;
+      SetLoaded(mountpoint, hash);
     return load_error;
   }
 
@@ -712,7 +2703,7 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
                    "failed to pin cached root catalog");
           return catalog::kLoadFail;
         }
-        loaded_catalogs_[mountpoint] = cache_hash;
+        SetLoaded(mountpoint, cache_hash);
         offline_mode_ = true;
         return catalog::kLoadUp2Date;
       }
@@ -721,6 +2712,14 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
   }
 
   offline_mode_ = false;
+  // Objects of any codec are decompressed, the announced codec is used where
+  // the client compresses itself, e.g. for the user.lhash attribute
+  zlib::Algorithms compression_algorithm;
+  if (zlib::ParseAlgorithm(ensemble.manifest->compression_algorithm(),
+                           &compression_algorithm))
+  {
+    zlib::SetCompressAlgorithm(compression_algorithm);
+  }
   cvmfs_path += " (" + ensemble.manifest->catalog_hash().ToString() + ")";
   LogCvmfs(kLogCache, kLogDebug, "remote checksum is %s",
            ensemble.manifest->catalog_hash().ToString().c_str());
@@ -739,10 +2738,10 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
                  "failed to pin cached root catalog");
         return catalog::kLoadFail;
       }
-      loaded_catalogs_[mountpoint] = cache_hash;
+      SetLoaded(mountpoint, cache_hash);
       return catalog::kLoadUp2Date;
     } else {
-      loaded_catalogs_[mountpoint] = cache_hash;
+      SetLoaded(mountpoint, cache_hash);
       return catalog::kLoadUp2Date;
     }
   }
@@ -751,10 +2750,11 @@ catalog::LoadError CatalogManager::LoadCatalog(const PathString &mountpoint,
 
   // Load new catalog
   catalog::LoadError load_retval =
-    LoadCatalogCas(ensemble.manifest->catalog_hash(), cvmfs_path, catalog_path);
+    LoadCatalogCas(ensemble.manifest->catalog_hash(), cache_hash, cvmfs_path,
+                   catalog_path);
   if (load_retval != catalog::kLoadNew)
     return load_retval;
-  loaded_catalogs_[mountpoint] = ensemble.manifest->catalog_hash();
+  SetLoaded(mountpoint, ensemble.manifest->catalog_hash());
 
   // Store new manifest and certificate
   CommitFromMem(ensemble.manifest->certificate(),
@@ -794,6 +2794,9 @@ void CatalogManager::UnloadCatalog(const catalog::Catalog *catalog) {
   assert(iter != mounted_catalogs_.end());
 
   quota::Unpin(iter->second);
+  pthread_mutex_lock(&lock_loaded_);
+  unloaded_catalogs_[iter->first] = iter->second;
+  pthread_mutex_unlock(&lock_loaded_);
   mounted_catalogs_.erase(iter);
   catalog::Counters counters;
   catalog->GetCounters(&counters);
@@ -801,6 +2804,30 @@ void CatalogManager::UnloadCatalog(const catalog::Catalog *catalog) {
 }
 
 
+/**
+ * The pin is shared with a mounted catalog of the same content, if any.
+ */
+void CatalogManager::DiscardCatalog(const PathString &mountpoint,
+                                    const hash::Any &hash)
+{
+  LogCvmfs(kLogCache, kLogDebug, "discarding loaded catalog %s",
+           mountpoint.c_str());
+  pthread_mutex_lock(&lock_loaded_);
+  map<PathString, hash::Any>::iterator iter = loaded_catalogs_.find(mountpoint);
+  if ((iter != loaded_catalogs_.end()) && (iter->second == hash))
+    loaded_catalogs_.erase(iter);
+  pthread_mutex_unlock(&lock_loaded_);
+
+  for (map<PathString, hash::Any>::const_iterator i = mounted_catalogs_.begin(),
+       iEnd = mounted_catalogs_.end(); i != iEnd; ++i)
+  {
+    if (i->second == hash)
+      return;
+  }
+  quota::Unpin(hash);
+}
+
+
 void ManifestEnsemble::FetchCertificate(const hash::Any &hash) {
   uint64_t size;
   Open2Mem(hash, &cert_buf, &size);
@@ -5,19 +5,23 @@
 #ifndef CVMFS_CACHE_H_
 #define CVMFS_CACHE_H_
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
 
 #include "catalog_mgr.h"
+#include "download.h"
 #include "shortstring.h"
 #include "atomic.h"
 #include "manifest_fetch.h"
 
 namespace catalog {
 class DirectoryEntry;
+struct FileChunk;
 class Catalog;
 }
 
@@ -27,7 +31,7 @@ struct Any;
 
 namespace cache {
 
-bool Init(const std::string &cache_path);
+bool Init(const std::string &cache_path, const bool shared);
 void Fini();
 
 int Open(const hash::Any &id);
@@ -44,7 +48,87 @@ bool CommitFromMem(const hash::Any &id, const unsigned char *buffer,
                    const uint64_t size, const std::string &cvmfs_path);
 bool Contains(const hash::Any &id);
 int Fetch(const catalog::DirectoryEntry &d, const std::string &cvmfs_path);
+int Fetch(const catalog::DirectoryEntry &d, const PathString &cvmfs_path);
+int FetchChunk(const catalog::FileChunk &chunk, const std::string &cvmfs_path);
+int FetchChunk(const catalog::FileChunk &chunk, const PathString &cvmfs_path);
+int FetchBundle(const catalog::DirectoryEntry &d, const hash::Any &bundle_hash,
+                const catalog::BundleMemberList &members,
+                const std::string &cvmfs_path);
+std::string GetBundleStatistics();
+int64_t GetNumBundleDownloads();
+int64_t GetNumBundledObjects();
+void SetDownloadPriority(const download::Priority priority);
+void SetDownloadRepository(const std::string *repository_name);
+
+/**
+ * A downloaded and verified object that is not yet visible in the cache.
+ */
+struct Transaction {
+  hash::Any id;
+  uint64_t size;  /**< on disk */
+  std::string final_path;
+  std::string temp_path;
+  std::string cvmfs_path;
+};
+int FetchDeferred(const catalog::DirectoryEntry &d,
+                  const std::string &cvmfs_path, Transaction *txn);
+unsigned CommitTransactions(const std::vector<Transaction> &txns);
+void AbortTransactions(const std::vector<Transaction> &txns);
+std::string GetBatchStatistics();
 int64_t GetNumDownloads();
+int64_t GetNumCoalescedDownloads();
+int64_t GetNumContendedDownloads();
+int64_t GetNumSharedDownloads();
+int64_t GetNumPeerDownloads();
+
+struct StreamingFetch;
+StreamingFetch *StartStreaming(const catalog::DirectoryEntry &d,
+                               const std::string &cvmfs_path);
+int64_t ReadStreaming(StreamingFetch *stream, void *buffer, const size_t size,
+                      const off_t offset);
+void ReleaseStreaming(StreamingFetch *stream);
+void WaitForStreaming();
+int64_t GetNumStreamingFetches();
+
+void InitFilter(const uint64_t num_objects);
+void InitPendingFilter();
+void CompleteFilter(const std::vector<hash::Any> &objects);
+void FilterInsert(const hash::Any &id);
+void FilterRemove(const hash::Any &id);
+std::string GetFilterStatistics();
+
+/**
+ * A small object held by the memory tier.  Buffer and size don't change until
+ * the object is released.
+ */
+struct MemoryObject {
+  unsigned char *buffer;
+  uint64_t size;
+};
+
+void InitMemoryTier(const uint64_t max_size, const uint64_t max_object_size);
+void FiniMemoryTier();
+bool IsMemoryTierCandidate(const uint64_t size);
+const MemoryObject *AcquireFromMemory(const hash::Any &id);
+const MemoryObject *LoadIntoMemory(const hash::Any &id, const int fd,
+                                   const uint64_t size);
+void ReleaseMemory(const MemoryObject *object);
+void SetMemoryTierLimit(const uint64_t limit);
+uint64_t GetMemoryTierSize();
+std::string GetMemoryTierStatistics();
+
+const char kCompressedSuffix = 'Z';  /**< Cache file name of block format */
+struct CompressedObject;
+void EnableCompressedReads();
+void InitCompression(const uint64_t lru_size);
+void FiniCompression();
+CompressedObject *OpenCompressed(const hash::Any &id, const int fd);
+int64_t ReadCompressed(CompressedObject *object, void *buffer,
+                       const size_t size, const off_t offset);
+int CloseCompressed(CompressedObject *object);
+void SetCompressionLimit(const uint64_t limit);
+uint64_t GetCompressionSize();
+std::string GetCompressionStatistics();
 
 
 /**
@@ -55,7 +139,7 @@ class CatalogManager : public catalog::AbstractCatalogManager {
  public:
   CatalogManager(const std::string &repo_name,
                  const bool ignore_signature);
-  virtual ~CatalogManager() { };
+  virtual ~CatalogManager();
 
   bool InitFixed(const hash::Any &root_hash);
 
@@ -73,25 +157,56 @@ class CatalogManager : public catalog::AbstractCatalogManager {
   uint64_t all_inodes() const { return all_inodes_; }
   uint64_t loaded_inodes() const { return loaded_inodes_; }
 
+  void EnableNestedPrefetch(const unsigned max_parallel);
+  void SpawnNestedPrefetch();
+  std::string GetNestedPrefetchStats();
+
+  /**
+   * Changed catalogs are patched from the previous revision in the cache if
+   * the publisher stored a delta, see catalog_delta.h.
+   */
+  void EnableDeltas() { deltas_enabled_ = true; }
+  std::string GetDeltaStats();
+
  protected:
   catalog::LoadError LoadCatalog(const PathString &mountpoint,
                                  const hash::Any &hash,
                                  std::string *catalog_path);
   void UnloadCatalog(const catalog::Catalog *catalog);
+  void DiscardCatalog(const PathString &mountpoint, const hash::Any &hash);
   catalog::Catalog* CreateCatalog(const PathString &mountpoint,
                                   catalog::Catalog *parent_catalog);
   void ActivateCatalog(const catalog::Catalog *catalog);
+  void PrefetchNested(const catalog::Catalog *catalog);
+  bool FetchCatalog(const catalog::Catalog::NestedCatalog &nested,
+                    std::string *catalog_path);
 
  private:
+  static const unsigned kMaxPrefetchQueue = 4096;
+
   catalog::LoadError LoadCatalogCas(const hash::Any &hash,
+                                    const hash::Any &base_hash,
                                     const std::string &cvmfs_path,
                                     std::string *catalog_path);
+  bool FetchDelta(const hash::Any &hash, const hash::Any &base_hash,
+                  const std::string &dest_path);
+  hash::Any GetPreviousHash(const PathString &mountpoint);
+  void SetLoaded(const PathString &mountpoint, const hash::Any &hash);
+  static void *MainNestedPrefetch(void *data);
+  void FetchNested(const catalog::Catalog::NestedCatalog &nested);
+  bool DownloadNested(const catalog::Catalog::NestedCatalog &nested,
+                      const download::Priority priority);
 
   /**
    * required for unpinning
    */
   std::map<PathString, hash::Any> loaded_catalogs_;
   std::map<PathString, hash::Any> mounted_catalogs_;
+  /**
+   * Last revision of the catalogs that were unloaded, base for the deltas
+   */
+  std::map<PathString, hash::Any> unloaded_catalogs_;
+  pthread_mutex_t lock_loaded_;  /**< protects loaded_ and unloaded_catalogs_ */
 
   std::string repo_name_;
   bool ignore_signature_;
@@ -100,6 +215,25 @@ class CatalogManager : public catalog::AbstractCatalogManager {
   atomic_int32 certificate_misses_;
   uint64_t all_inodes_;
   uint64_t loaded_inodes_;
+  bool deltas_enabled_;
+  atomic_int64 num_deltas_applied_;
+  atomic_int64 num_deltas_failed_;  /**< Includes catalogs without delta */
+
+  /**
+   * Nested catalogs of attached catalogs are downloaded into the cache by
+   * max_parallel threads, so that they are attached without a round trip.
+   */
+  unsigned prefetch_max_parallel_;  /**< 0 means off */
+  pthread_t *prefetch_threads_;
+  bool prefetch_spawned_;
+  bool prefetch_stop_;
+  std::vector<catalog::Catalog::NestedCatalog> prefetch_queue_;
+  std::set<hash::Any> prefetch_queued_;
+  pthread_mutex_t lock_prefetch_;
+  pthread_cond_t cond_prefetch_;
+  uint64_t num_prefetched_;
+  uint64_t num_prefetch_cached_;
+  uint64_t num_prefetch_failed_;
 };
 
 
@@ -113,30 +113,56 @@ Catalog *AttachFreely(const string &root_path, const string &file) {
 }
 
 
+unsigned Catalog::max_readers_ = 1;
+bool Catalog::use_index_ = false;
+unsigned Catalog::bloom_bits_ = 0;
+
+
 Catalog::Catalog(const PathString &path, Catalog *parent) {
   read_only_ = true;
   path_ = path;
+  md5path_ = hash::Md5(path_.GetChars(), path_.GetLength());
+  atomic_init64(&mountpoint_inode_);
   parent_ = parent;
   max_row_id_ = 0;
   lock_ = reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
   int retval = pthread_mutex_init(lock_, NULL);
   assert(retval == 0);
+  lock_readers_ =
+    reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
+  retval = pthread_mutex_init(lock_readers_, NULL);
+  assert(retval == 0);
+  num_readers_ = 0;
+  atomic_init64(&num_queries_);
+  atomic_init32(&cache_pages_);
+  governor_queries_ = 0;
+  governor_rate_ = 0;
 
   database_ = NULL;
+  index_ = NULL;
+  bloom_filter_ = NULL;
+  statistics_ = NULL;
   nested_catalog_cache_ = NULL;
   sql_listing_ = NULL;
+  sql_listing_blob_ = NULL;
   sql_lookup_md5path_ = NULL;
   sql_lookup_inode_ = NULL;
   sql_lookup_nested_ = NULL;
   sql_list_nested_ = NULL;
   sql_all_chunks_ = NULL;
+  sql_chunks_listing_ = NULL;
+  sql_lookup_bundle_ = NULL;
 }
 
 
 Catalog::~Catalog() {
   pthread_mutex_destroy(lock_);
   free(lock_);
+  pthread_mutex_destroy(lock_readers_);
+  free(lock_readers_);
   FinalizePreparedStatements();
+  delete index_;
+  delete bloom_filter_;
   delete database_;
   delete nested_catalog_cache_;
 }
@@ -149,17 +175,35 @@ Catalog::~Catalog() {
  */
 void Catalog::InitPreparedStatements() {
   sql_listing_ = new SqlListing(database());
+  sql_listing_blob_ = new SqlListingBlob(database());
   sql_lookup_md5path_ = new SqlLookupPathHash(database());
   sql_lookup_inode_ = new SqlLookupInode(database());
   sql_lookup_nested_ = new SqlNestedCatalogLookup(database());
   sql_list_nested_ = new SqlNestedCatalogListing(database());
   sql_all_chunks_ = new SqlAllChunks(database());
+  sql_chunks_listing_ = new SqlChunksListing(database());
+  sql_lookup_bundle_ = new SqlBundleLookup(database());
+
+  main_reader_.listing = sql_listing_;
+  main_reader_.listing_blob = sql_listing_blob_;
+  main_reader_.lookup_md5path = sql_lookup_md5path_;
+  main_reader_.lookup_inode = sql_lookup_inode_;
+  main_reader_.chunks_listing = sql_chunks_listing_;
+  main_reader_.lookup_bundle = sql_lookup_bundle_;
 }
 
 
 void Catalog::FinalizePreparedStatements() {
+  for (unsigned i = 0; i < readers_.size(); ++i)
+    CloseReader(readers_[i]);
+  readers_.clear();
+  readers_free_.clear();
+  num_readers_ = 0;
   delete sql_all_chunks_;
+  delete sql_chunks_listing_;
+  delete sql_lookup_bundle_;
   delete sql_listing_;
+  delete sql_listing_blob_;
   delete sql_lookup_md5path_;
   delete sql_lookup_inode_;
   delete sql_lookup_nested_;
@@ -193,6 +237,30 @@ bool Catalog::OpenDatabase(const string &db_path) {
   }
   max_row_id_ = sql_max_row_id.RetrieveInt64(0);
 
+  // Without an index, lookups silently fall back to SQlite
+  if (read_only_ && use_index_) {
+    index_ = CatalogIndex::Create(database(), max_row_id_);
+    if (index_ == NULL) {
+      LogCvmfs(kLogCatalog, kLogDebug, "no index for database file %s",
+               db_path.c_str());
+    }
+  }
+
+  // Row ids are close to the number of entries, good enough to size the filter
+  if (read_only_ && (bloom_bits_ > 0)) {
+    bloom_filter_ = new BloomFilter(max_row_id_, bloom_bits_);
+    Sql sql_hashes(database(), "SELECT md5path_1, md5path_2 FROM catalog;");
+    while (sql_hashes.FetchRow())
+      bloom_filter_->Add(sql_hashes.RetrieveMd5(0, 1));
+    if (sql_hashes.GetLastError() != SQLITE_DONE) {
+      LogCvmfs(kLogCatalog, kLogDebug,
+               "failed to build bloom filter for database file %s (%d)",
+               db_path.c_str(), sql_hashes.GetLastError());
+      delete bloom_filter_;
+      bloom_filter_ = NULL;
+    }
+  }
+
   // Get root prefix
   if (IsRoot()) {
     Sql sql_root_prefix(database(), "SELECT value FROM properties "
@@ -222,7 +290,9 @@ bool Catalog::OpenDatabase(const string &db_path) {
  * Performs a lookup on this Catalog for a given inode
  * @param inode the inode to perform the lookup for
  * @param dirent this will be set to the found entry
- * @param parent_md5path this will be set to the hash of the parent path
+ * @param parent_md5path this will be set to the hash of the parent path.  If
+ *        requested, the parent inode of dirent is set as well unless the
+ *        parent is in another catalog.
  * @return true if lookup was successful, false otherwise
  */
 bool Catalog::LookupInode(const inode_t inode, DirectoryEntry *dirent,
@@ -230,20 +300,34 @@ bool Catalog::LookupInode(const inode_t inode, DirectoryEntry *dirent,
 {
   assert(IsInitialized());
 
-  pthread_mutex_lock(lock_);
-  sql_lookup_inode_->BindRowId(GetRowIdFromInode(inode));
-  const bool found = sql_lookup_inode_->FetchRow();
+  Reader *reader = AcquireReader();
+  SqlLookupInode *sql_lookup_inode = reader->lookup_inode;
+  sql_lookup_inode->BindRowId(GetRowIdFromInode(inode));
+  const bool found = sql_lookup_inode->FetchRow();
 
   // Retrieve the DirectoryEntry if needed
   if (found && (dirent != NULL))
-      *dirent = sql_lookup_inode_->GetDirent(this);
+      *dirent = sql_lookup_inode->GetDirent(this);
 
   // Retrieve the path_hash of the parent path if needed
-  if (parent_md5path != NULL)
-      *parent_md5path = sql_lookup_inode_->GetParentPathHash();
+  uint64_t parent_row_id = 0;
+  bool has_parent = false;
+  if (parent_md5path != NULL) {
+    *parent_md5path = sql_lookup_inode->GetParentPathHash();
+    has_parent = found && sql_lookup_inode->GetParentRowId(&parent_row_id);
+  }
 
-  sql_lookup_inode_->Reset();
-  pthread_mutex_unlock(lock_);
+  sql_lookup_inode->Reset();
+  ReleaseReader(reader);
+
+  // Parents are directories, they have no hardlink group.  The root entry of
+  // a nested catalog has the inode of the mountpoint, see FixTransitionPoint.
+  if (has_parent && (dirent != NULL)) {
+    const inode_t parent_inode = (!IsRoot() && (*parent_md5path == md5path_)) ?
+      GetMountpointInode() : parent_row_id + inode_range_.offset;
+    if (parent_inode != 0)
+      dirent->set_parent_inode(parent_inode);
+  }
 
   return found;
 }
@@ -260,16 +344,34 @@ bool Catalog::LookupMd5Path(const hash::Md5 &md5path,
 {
   assert(IsInitialized());
 
-  pthread_mutex_lock(lock_);
-  sql_lookup_md5path_->BindPathHash(md5path);
-  bool found = sql_lookup_md5path_->FetchRow();
-  if (found && (dirent != NULL)) {
-    *dirent = sql_lookup_md5path_->GetDirent(this);
-    FixTransitionPoint(md5path, dirent);
+  if (bloom_filter_ != NULL) {
+    if (!bloom_filter_->MayContain(md5path)) {
+      if (statistics_ != NULL)
+        statistics_->num_bloom_negative.Inc();
+      return false;
+    }
+  }
+
+  bool found;
+  if (index_ != NULL) {
+    found = index_->Lookup(md5path, this, dirent);
+    if (found && (dirent != NULL))
+      FixTransitionPoint(md5path, dirent);
+  } else {
+    Reader *reader = AcquireReader();
+    SqlLookupPathHash *sql_lookup_md5path = reader->lookup_md5path;
+    sql_lookup_md5path->BindPathHash(md5path);
+    found = sql_lookup_md5path->FetchRow();
+    if (found && (dirent != NULL)) {
+      *dirent = sql_lookup_md5path->GetDirent(this);
+      FixTransitionPoint(md5path, dirent);
+    }
+    sql_lookup_md5path->Reset();
+    ReleaseReader(reader);
   }
-  sql_lookup_md5path_->Reset();
-  pthread_mutex_unlock(lock_);
 
+  if (!found && (bloom_filter_ != NULL) && (statistics_ != NULL))
+    statistics_->num_bloom_false_positive.Inc();
   return found;
 }
 
@@ -288,17 +390,52 @@ bool Catalog::ListingMd5PathStat(const hash::Md5 &md5path,
   DirectoryEntry dirent;
   StatEntry entry;
 
-  pthread_mutex_lock(lock_);
-  sql_listing_->BindPathHash(md5path);
-  while (sql_listing_->FetchRow()) {
-    dirent = sql_listing_->GetDirent(this);
+  if (index_ != NULL) {
+    uint32_t begin, end;
+    index_->FindListing(md5path, &begin, &end);
+    for (uint32_t i = begin; i < end; ++i) {
+      dirent = index_->GetListingDirent(i, this);
+      FixTransitionPoint(md5path, &dirent);
+      entry.name = dirent.name();
+      entry.info = dirent.GetStatStructure();
+      listing->push_back(entry);
+    }
+    return true;
+  }
+
+  Reader *reader = AcquireReader();
+  if (read_only_ && database().has_listings()) {
+    // Large directories come precalculated in a single row
+    SqlListingBlob *sql_listing_blob = reader->listing_blob;
+    DirectoryEntryList dirents;
+    bool found = false;
+    sql_listing_blob->BindPathHash(md5path);
+    if (sql_listing_blob->FetchRow())
+      found = sql_listing_blob->GetListing(this, &dirents);
+    sql_listing_blob->Reset();
+    if (found) {
+      ReleaseReader(reader);
+      for (unsigned i = 0; i < dirents.size(); ++i) {
+        FixTransitionPoint(md5path, &dirents[i]);
+        entry.name = dirents[i].name();
+        entry.info = dirents[i].GetStatStructure();
+        listing->push_back(entry);
+      }
+      return true;
+    }
+  }
+
+  SqlListing *sql_listing = reader->listing;
+  sql_listing->BindPathHash(md5path);
+  while (sql_listing->FetchRow()) {
+    dirent = sql_listing->GetDirent(this);
     FixTransitionPoint(md5path, &dirent);
     entry.name = dirent.name();
     entry.info = dirent.GetStatStructure();
     listing->push_back(entry);
   }
-  sql_listing_->Reset();
-  pthread_mutex_unlock(lock_);
+  sql_listing->Reset();
+  ReleaseReader(reader);
 
   return true;
 }
@@ -316,20 +453,83 @@ bool Catalog::ListingMd5Path(const hash::Md5 &md5path,
 {
   assert(IsInitialized());
 
-  pthread_mutex_lock(lock_);
-  sql_listing_->BindPathHash(md5path);
-  while (sql_listing_->FetchRow()) {
-    DirectoryEntry dirent = sql_listing_->GetDirent(this);
+  if (index_ != NULL) {
+    uint32_t begin, end;
+    index_->FindListing(md5path, &begin, &end);
+    for (uint32_t i = begin; i < end; ++i) {
+      DirectoryEntry dirent = index_->GetListingDirent(i, this);
+      FixTransitionPoint(md5path, &dirent);
+      listing->push_back(dirent);
+    }
+    return true;
+  }
+
+  Reader *reader = AcquireReader();
+  SqlListing *sql_listing = reader->listing;
+  sql_listing->BindPathHash(md5path);
+  while (sql_listing->FetchRow()) {
+    DirectoryEntry dirent = sql_listing->GetDirent(this);
     FixTransitionPoint(md5path, &dirent);
     listing->push_back(dirent);
   }
-  sql_listing_->Reset();
-  pthread_mutex_unlock(lock_);
+  sql_listing->Reset();
+  ReleaseReader(reader);
 
   return true;
 }
 
 
+/**
+ * Lists the pieces of a chunked file, ordered by offset.
+ * @param md5path the MD5 hash of the path of the file
+ * @param chunks will be filled with the file chunks
+ * @return true on success, false otherwise
+ */
+bool Catalog::ListMd5PathChunks(const hash::Md5 &md5path,
+                                FileChunkList *chunks) const
+{
+  assert(IsInitialized());
+
+  Reader *reader = AcquireReader();
+  SqlChunksListing *sql_chunks_listing = reader->chunks_listing;
+  sql_chunks_listing->BindPathHash(md5path);
+  while (sql_chunks_listing->FetchRow()) {
+    chunks->push_back(sql_chunks_listing->GetFileChunk());
+  }
+  sql_chunks_listing->Reset();
+  ReleaseReader(reader);
+
+  return true;
+}
+
+
+/**
+ * Finds the bundle that contains the object with the given content hash,
+ * together with all of its members ordered by offset.
+ * @return false if the object is not bundled in this catalog
+ */
+bool Catalog::LookupBundle(const hash::Any &content_hash,
+                           hash::Any *bundle_hash,
+                           BundleMemberList *members) const
+{
+  assert(IsInitialized());
+  if (!database().has_bundles())
+    return false;
+
+  Reader *reader = AcquireReader();
+  SqlBundleLookup *sql_lookup_bundle = reader->lookup_bundle;
+  sql_lookup_bundle->BindContentHash(content_hash);
+  while (sql_lookup_bundle->FetchRow()) {
+    *bundle_hash = sql_lookup_bundle->GetBundleHash();
+    members->push_back(sql_lookup_bundle->GetMember());
+  }
+  sql_lookup_bundle->Reset();
+  ReleaseReader(reader);
+
+  return !members->empty();
+}
+
+
 bool Catalog::AllChunksBegin() {
   return sql_all_chunks_->Open();
 }
@@ -466,6 +666,7 @@ inode_t Catalog::GetMangledInode(const uint64_t row_id,
   // Hardlinks are encoded in catalog-wide unique hard link group ids.
   // These ids must be resolved to actual inode relationships at runtime.
   if (hardlink_group > 0) {
+    pthread_mutex_lock(lock_readers_);
     HardlinkGroupMap::const_iterator inode_iter =
       hardlink_groups_.find(hardlink_group);
 
@@ -475,6 +676,7 @@ inode_t Catalog::GetMangledInode(const uint64_t row_id,
     } else {
       inode = inode_iter->second;
     }
+    pthread_mutex_unlock(lock_readers_);
   }
 
   return inode;
@@ -637,6 +839,127 @@ Catalog* Catalog::FindChild(const PathString &mountpoint) const {
  * @param md5path the MD5 hash of the entry to check
  * @param dirent the DirectoryEntry to perform coherence fixes on
  */
+/**
+ * Returns the statements of a free additional connection, opens a new one if
+ * there are less than max_readers_, or waits for the main connection.
+ */
+Catalog::Reader *Catalog::AcquireReader() const {
+  atomic_inc64(&num_queries_);
+  if (read_only_ && (max_readers_ > 1)) {
+    pthread_mutex_lock(lock_readers_);
+    if (!readers_free_.empty()) {
+      Reader *reader = readers_free_.back();
+      readers_free_.pop_back();
+      pthread_mutex_unlock(lock_readers_);
+      ApplyCacheBudget(reader);
+      return reader;
+    }
+    const bool may_open = num_readers_ + 1 < max_readers_;
+    if (may_open)
+      num_readers_++;
+    pthread_mutex_unlock(lock_readers_);
+
+    if (may_open) {
+      Reader *reader = OpenReader();
+      pthread_mutex_lock(lock_readers_);
+      if (reader != NULL)
+        readers_.push_back(reader);
+      else
+        num_readers_--;
+      pthread_mutex_unlock(lock_readers_);
+      if (reader != NULL) {
+        ApplyCacheBudget(reader);
+        return reader;
+      }
+    }
+  }
+
+  pthread_mutex_lock(lock_);
+  ApplyCacheBudget(&main_reader_);
+  return &main_reader_;
+}
+
+
+/**
+ * Adjusts the page cache of a connection held by the caller to the budget
+ * given by the memory governor.
+ */
+void Catalog::ApplyCacheBudget(Reader *reader) const {
+  const int pages = atomic_read32(&cache_pages_);
+  if ((pages == 0) || (pages == reader->cache_pages))
+    return;
+  const Database &db = (reader->database != NULL) ?
+                       *reader->database : database();
+  Sql sql_cache(db, "PRAGMA cache_size=" + StringifyInt(pages) + ";");
+  if (sql_cache.Execute())
+    reader->cache_pages = pages;
+}
+
+
+void Catalog::ReleaseReader(Reader *reader) const {
+  if (reader == &main_reader_) {
+    pthread_mutex_unlock(lock_);
+    return;
+  }
+  pthread_mutex_lock(lock_readers_);
+  readers_free_.push_back(reader);
+  pthread_mutex_unlock(lock_readers_);
+}
+
+
+Catalog::Reader *Catalog::OpenReader() const {
+  Database *database = new Database(database_->filename(),
+                                    Database::kOpenReadOnly);
+  if (!database->ready()) {
+    LogCvmfs(kLogCatalog, kLogDebug, "failed to open another connection to %s",
+             database_->filename().c_str());
+    delete database;
+    return NULL;
+  }
+
+  Reader *reader = new Reader();
+  reader->database = database;
+  reader->listing = new SqlListing(*database);
+  reader->listing_blob = new SqlListingBlob(*database);
+  reader->lookup_md5path = new SqlLookupPathHash(*database);
+  reader->lookup_inode = new SqlLookupInode(*database);
+  reader->chunks_listing = new SqlChunksListing(*database);
+  reader->lookup_bundle = new SqlBundleLookup(*database);
+  return reader;
+}
+
+
+void Catalog::CloseReader(Reader *reader) const {
+  delete reader->listing;
+  delete reader->listing_blob;
+  delete reader->lookup_md5path;
+  delete reader->lookup_inode;
+  delete reader->chunks_listing;
+  delete reader->lookup_bundle;
+  delete reader->database;
+  delete reader;
+}
+
+
+/**
+ * Looks up the mountpoint in the parent catalog once.  Both catalogs stay
+ * attached together.
+ *
+ * @return 0 if the mountpoint is not found
+ */
+inode_t Catalog::GetMountpointInode() const {
+  const inode_t known = atomic_read64(&mountpoint_inode_);
+  if (known != 0)
+    return known;
+
+  DirectoryEntry mountpoint;
+  if (!parent_->LookupMd5Path(md5path_, &mountpoint))
+    return 0;
+  atomic_cas64(&mountpoint_inode_, 0, mountpoint.inode());
+  return mountpoint.inode();
+}
+
+
 void Catalog::FixTransitionPoint(const hash::Md5 &md5path,
                                  DirectoryEntry *dirent) const
 {
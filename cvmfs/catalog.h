@@ -14,6 +14,8 @@
 #include <map>
 #include <vector>
 
+#include "catalog_bloom.h"
+#include "catalog_index.h"
 #include "catalog_sql.h"
 #include "dirent.h"
 #include "hash.h"
@@ -24,6 +26,7 @@ namespace catalog {
 
 class AbstractCatalogManager;
 class Catalog;
+struct Statistics;
 
 typedef std::vector<Catalog *> CatalogList;
 
@@ -101,9 +104,31 @@ struct Counters {
 class Catalog {
   friend class AbstractCatalogManager;
   friend class SqlLookup;  // for mangled inode
+  friend class SqlListingBlob;  // for mangled inode
+  friend class CatalogIndex;  // for mangled inode
  public:
   static const uint64_t kDefaultTTL = 3600;  /**< 1 hour default TTL */
 
+  /**
+   * Number of database connections per read-only catalog, the main connection
+   * included.  Lookups on the same catalog run in parallel on separate
+   * connections, which are opened on demand.
+   */
+  static void SetMaxReaders(const unsigned value) {
+    max_readers_ = (value > 0) ? value : 1;
+  }
+  /**
+   * Build a CatalogIndex for read-only catalogs on load.  Path lookups and
+   * listings are then served from the index instead of SQlite.
+   */
+  static void SetUseIndex(const bool value) { use_index_ = value; }
+  /**
+   * Bits per entry of the bloom filter over the path hashes of read-only
+   * catalogs.  The filter answers definite misses without a database query.
+   * 0 disables the filter.
+   */
+  static void SetBloomBits(const unsigned value) { bloom_bits_ = value; }
+
   Catalog(const PathString &path, Catalog *parent);
   virtual ~Catalog();
 
@@ -133,6 +158,16 @@ class Catalog {
     return ListingMd5PathStat(hash::Md5(path.GetChars(), path.GetLength()),
                               listing);
   }
+  bool ListMd5PathChunks(const hash::Md5 &md5path,
+                         FileChunkList *chunks) const;
+  inline bool ListPathChunks(const PathString &path,
+                             FileChunkList *chunks) const
+  {
+    return ListMd5PathChunks(hash::Md5(path.GetChars(), path.GetLength()),
+                             chunks);
+  }
+  bool LookupBundle(const hash::Any &content_hash, hash::Any *bundle_hash,
+                    BundleMemberList *members) const;
   bool AllChunksBegin();
   bool AllChunksNext(hash::Any *hash, ChunkTypes *type);
   bool AllChunksEnd();
@@ -151,6 +186,15 @@ class Catalog {
   inline InodeRange inode_range() const { return inode_range_; }
   inline void set_inode_range(const InodeRange value) { inode_range_ = value; }
   inline std::string database_path() const { return database_->filename(); }
+  inline uint64_t num_queries() const { return atomic_read64(&num_queries_); }
+  inline int cache_pages() const { return atomic_read32(&cache_pages_); }
+  /**
+   * SQlite page cache size of the catalog's connections, applied the next
+   * time a connection is used.  0 keeps the SQlite default.
+   */
+  inline void set_cache_pages(const int pages) {
+    atomic_write32(&cache_pages_, pages);
+  }
   inline PathString root_prefix() const { return root_prefix_; }
 
   inline bool IsInitialized() const {
@@ -195,6 +239,34 @@ class Catalog {
  private:
   typedef std::map<PathString, Catalog*> NestedCatalogMap;
 
+  /**
+   * The lookup statements of a database connection.  The statements of the
+   * main connection are guarded by lock_, the ones of additional connections
+   * are used by one thread at a time through the free list.
+   */
+  struct Reader {
+    Reader() : database(NULL), listing(NULL), listing_blob(NULL),
+               lookup_md5path(NULL), lookup_inode(NULL), chunks_listing(NULL),
+               lookup_bundle(NULL), cache_pages(0) { }
+    Database *database;  /**< NULL for the main connection */
+    SqlListing *listing;
+    SqlListingBlob *listing_blob;
+    SqlLookupPathHash *lookup_md5path;
+    SqlLookupInode *lookup_inode;
+    SqlChunksListing *chunks_listing;
+    SqlBundleLookup *lookup_bundle;
+    int cache_pages;  /**< page cache size applied to the connection */
+  };
+  static unsigned max_readers_;
+  static bool use_index_;
+  static unsigned bloom_bits_;
+
+  Reader *AcquireReader() const;
+  void ReleaseReader(Reader *reader) const;
+  Reader *OpenReader() const;
+  void ApplyCacheBudget(Reader *reader) const;
+  void CloseReader(Reader *reader) const;
+
   inline uint64_t GetRowIdFromInode(const inode_t inode) const {
     return inode - inode_range_.offset;
   }
@@ -203,12 +275,22 @@ class Catalog {
 
   void FixTransitionPoint(const hash::Md5 &md5path,
                           DirectoryEntry *dirent) const;
+  inode_t GetMountpointInode() const;
 
   Database *database_;
+  CatalogIndex *index_;  /**< NULL if lookups go to the database */
+  BloomFilter *bloom_filter_;  /**< NULL if disabled */
+  Statistics *statistics_;  /**< Set by the catalog manager, may be NULL */
   pthread_mutex_t *lock_;
 
   PathString root_prefix_;
   PathString path_;
+  hash::Md5 md5path_;  /**< of path_ */
+  /**
+   * Inode of the mountpoint in the parent catalog, which is the inode of the
+   * root entry as seen from outside.  0 if not yet known.
+   */
+  mutable atomic_int64 mountpoint_inode_;
 
   Catalog *parent_;
   NestedCatalogMap children_;
@@ -218,11 +300,32 @@ class Catalog {
   uint64_t max_row_id_;
 
   SqlListing *sql_listing_;
+  SqlListingBlob *sql_listing_blob_;
   SqlLookupPathHash *sql_lookup_md5path_;
   SqlLookupInode *sql_lookup_inode_;
   SqlNestedCatalogLookup *sql_lookup_nested_;
   SqlNestedCatalogListing *sql_list_nested_;
   SqlAllChunks *sql_all_chunks_;
+  SqlChunksListing *sql_chunks_listing_;
+  SqlBundleLookup *sql_lookup_bundle_;
+
+  mutable Reader main_reader_;
+  mutable std::vector<Reader *> readers_;  /**< additional connections */
+  mutable std::vector<Reader *> readers_free_;
+  mutable unsigned num_readers_;  /**< opened or being opened */
+  /**
+   * Protects readers_, readers_free_, num_readers_ and hardlink_groups_
+   */
+  pthread_mutex_t *lock_readers_;
+
+  mutable atomic_int64 num_queries_;  /**< SQlite lookups and listings */
+  mutable atomic_int32 cache_pages_;
+  /**
+   * Bookkeeping of the catalog manager's memory governor, protected by the
+   * governor's lock
+   */
+  int64_t governor_queries_;
+  int64_t governor_rate_;
 };  // class Catalog
 
 Catalog *AttachFreely(const std::string &root_path, const std::string &file);
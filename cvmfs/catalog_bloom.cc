@@ -0,0 +1,64 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include "catalog_bloom.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "smalloc.h"
+
+namespace catalog {
+
+/**
+ * Sizes the filter for num_items entries.  The number of probes that
+ * minimizes the false positive rate is bits_per_item * ln(2).
+ */
+BloomFilter::BloomFilter(const uint64_t num_items,
+                         const unsigned bits_per_item)
+{
+  const uint64_t min_bits = 64;
+  num_bits_ = num_items * bits_per_item;
+  if (num_bits_ < min_bits)
+    num_bits_ = min_bits;
+  num_bits_ = (num_bits_ + 63) & ~uint64_t(63);
+  num_hashes_ = (bits_per_item * 693 + 500) / 1000;
+  if (num_hashes_ < 1)
+    num_hashes_ = 1;
+  if (num_hashes_ > 16)
+    num_hashes_ = 16;
+  bits_ = static_cast<uint64_t *>(smalloc(num_bits_ / 8));
+  memset(bits_, 0, num_bits_ / 8);
+}
+
+
+BloomFilter::~BloomFilter() {
+  free(bits_);
+}
+
+
+void BloomFilter::Add(const hash::Md5 &md5) {
+  uint64_t h1, h2;
+  md5.ToIntPair(&h1, &h2);
+  h2 |= 1;
+  for (unsigned i = 0; i < num_hashes_; ++i) {
+    const uint64_t bit = (h1 + i * h2) % num_bits_;
+    bits_[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+}
+
+
+bool BloomFilter::MayContain(const hash::Md5 &md5) const {
+  uint64_t h1, h2;
+  md5.ToIntPair(&h1, &h2);
+  h2 |= 1;
+  for (unsigned i = 0; i < num_hashes_; ++i) {
+    const uint64_t bit = (h1 + i * h2) % num_bits_;
+    if ((bits_[bit / 64] & (uint64_t(1) << (bit % 64))) == 0)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace catalog
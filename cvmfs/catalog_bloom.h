@@ -0,0 +1,42 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A bloom filter over the MD5 path hashes of a catalog.  Paths that are
+ * definitely not in the catalog are rejected without a database query.
+ */
+
+#ifndef CVMFS_CATALOG_BLOOM_H_
+#define CVMFS_CATALOG_BLOOM_H_
+
+#include <stdint.h>
+
+#include "hash.h"
+
+namespace catalog {
+
+/**
+ * The filter is filled once when the catalog is loaded and only read
+ * afterwards, so it needs no locking.  Path hashes are uniformly distributed,
+ * the probe positions are derived from the two halves of the MD5 digest by
+ * double hashing.
+ */
+class BloomFilter {
+ public:
+  BloomFilter(const uint64_t num_items, const unsigned bits_per_item);
+  ~BloomFilter();
+
+  void Add(const hash::Md5 &md5);
+  bool MayContain(const hash::Md5 &md5) const;
+
+  uint64_t num_bits() const { return num_bits_; }
+  unsigned num_hashes() const { return num_hashes_; }
+
+ private:
+  uint64_t num_bits_;
+  unsigned num_hashes_;
+  uint64_t *bits_;
+};
+
+}  // namespace catalog
+
+#endif  // CVMFS_CATALOG_BLOOM_H_
@@ -0,0 +1,255 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "catalog_delta.h"
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "compression.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace catalog {
+
+/**
+ * The delta starts with a header of little-endian integers: magic, version,
+ * block size, the codec and the parallel flag of the catalog compression, the
+ * sizes of the base and of the new catalog database and the SHA-1 of the
+ * base.  It is followed by the changed blocks in ascending order, each
+ * preceded by its 32 bit index.  The last block of a file can be shorter.
+ */
+const uint32_t kDeltaMagic = 0x544c4443;  // "CDLT"
+const uint32_t kDeltaVersion = 1;
+const unsigned kDeltaBlockSize = 1024;  ///< Smallest SQlite page size in use
+const unsigned kDeltaHeaderSize = 6*4 + 2*8;
+/**
+ * Deltas larger than half of the new catalog are not worth the extra request
+ */
+const unsigned kMaxDeltaRatio = 2;
+
+
+static void PutInt(const uint64_t value, const unsigned bytes, string *buf) {
+  for (unsigned i = 0; i < bytes; ++i)
+    buf->push_back(static_cast<char>((value >> (8*i)) & 0xFF));
+}
+
+static uint64_t GetInt(const unsigned char *buf, const unsigned bytes) {
+  uint64_t result = 0;
+  for (unsigned i = 0; i < bytes; ++i)
+    result |= static_cast<uint64_t>(buf[i]) << (8*i);
+  return result;
+}
+
+
+/**
+ * Writes the delta from the base catalog database to the new one.  Fails if
+ * the delta would not be much smaller than the new catalog.
+ */
+bool CreateDelta(const string &base_path, const hash::Any &base_hash,
+                 const string &new_path, const string &delta_path)
+{
+  const unsigned digest_size = hash::kDigestSizes[hash::kSha1];
+  const int64_t base_size = GetFileSize(base_path);
+  const int64_t new_size = GetFileSize(new_path);
+  if ((base_size < 0) || (new_size <= 0) ||
+      (base_hash.algorithm != hash::kSha1))
+  {
+    return false;
+  }
+
+  FILE *fbase = fopen(base_path.c_str(), "r");
+  FILE *fnew = fopen(new_path.c_str(), "r");
+  FILE *fdelta = fopen(delta_path.c_str(), "w");
+  bool result = false;
+  uint64_t delta_size = 0;
+  uint32_t num_blocks = 0;
+  uint32_t num_changed = 0;
+  unsigned char block_base[kDeltaBlockSize];
+  unsigned char block_new[kDeltaBlockSize];
+  string header;
+  if (!fbase || !fnew || !fdelta)
+    goto create_delta_final;
+
+  PutInt(kDeltaMagic, 4, &header);
+  PutInt(kDeltaVersion, 4, &header);
+  PutInt(kDeltaBlockSize, 4, &header);
+  PutInt(zlib::GetCompressAlgorithm(), 4, &header);
+  PutInt(1, 4, &header);  // large catalogs are compressed in parallel blocks
+  PutInt(base_size, 8, &header);
+  PutInt(new_size, 8, &header);
+  PutInt(0, 4, &header);  // reserved
+  header.append(reinterpret_cast<const char *>(base_hash.digest), digest_size);
+  if (fwrite(header.data(), 1, header.length(), fdelta) != header.length())
+    goto create_delta_final;
+  delta_size = header.length();
+
+  while (true) {
+    const size_t have_new = fread(block_new, 1, kDeltaBlockSize, fnew);
+    if (have_new == 0)
+      break;
+    const size_t have_base = fread(block_base, 1, kDeltaBlockSize, fbase);
+    if ((have_new != have_base) || memcmp(block_new, block_base, have_new)) {
+      string index;
+      PutInt(num_blocks, 4, &index);
+      if ((fwrite(index.data(), 1, 4, fdelta) != 4) ||
+          (fwrite(block_new, 1, have_new, fdelta) != have_new))
+      {
+        goto create_delta_final;
+      }
+      delta_size += 4 + have_new;
+      num_changed++;
+      if (delta_size * kMaxDeltaRatio > static_cast<uint64_t>(new_size)) {
+        LogCvmfs(kLogCatalog, kLogVerboseMsg, "skipping delta for %s, "
+                 "too many changed blocks", new_path.c_str());
+        goto create_delta_final;
+      }
+    }
+    num_blocks++;
+  }
+  if (ferror(fnew) || ferror(fbase))
+    goto create_delta_final;
+
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "delta for %s: %u out of %u blocks "
+           "(%"PRIu64" bytes)", new_path.c_str(), num_changed, num_blocks,
+           delta_size);
+  result = true;
+
+ create_delta_final:
+  if (fbase) fclose(fbase);
+  if (fnew) fclose(fnew);
+  if (fdelta) {
+    if (fclose(fdelta) != 0)
+      result = false;
+    if (!result)
+      unlink(delta_path.c_str());
+  }
+  return result;
+}
+
+
+/**
+ * Patches the base catalog database into new_path.  Succeeds only if the
+ * delta refers to the given base and if the compressed result has the
+ * content hash of the new catalog.  Otherwise new_path is in an undefined
+ * state.
+ */
+bool ApplyDelta(const string &base_path, const hash::Any &base_hash,
+                const string &delta_path, const string &new_path,
+                const hash::Any &new_hash)
+{
+  const unsigned digest_size = hash::kDigestSizes[hash::kSha1];
+  FILE *fbase = NULL;
+  FILE *fdelta = NULL;
+  FILE *fnew = NULL;
+  bool result = false;
+  unsigned char header[kDeltaHeaderSize + hash::kMaxDigestSize];
+  unsigned char block[65536];
+  uint32_t block_size = 0;
+  uint64_t new_size = 0;
+  uint32_t num_blocks = 0;
+  uint32_t next_block = 0;
+  zlib::Algorithms algorithm;
+  bool parallel;
+  hash::Any result_hash(new_hash.algorithm);
+
+  if (base_hash.algorithm != hash::kSha1)
+    return false;
+  fdelta = fopen(delta_path.c_str(), "r");
+  if (!fdelta)
+    goto apply_delta_final;
+  if (fread(header, 1, kDeltaHeaderSize + digest_size, fdelta) !=
+      kDeltaHeaderSize + digest_size)
+  {
+    goto apply_delta_final;
+  }
+  block_size = GetInt(header + 8, 4);
+  algorithm = static_cast<zlib::Algorithms>(GetInt(header + 12, 4));
+  parallel = GetInt(header + 16, 4) != 0;
+  new_size = GetInt(header + 28, 8);
+  if ((GetInt(header, 4) != kDeltaMagic) ||
+      (GetInt(header + 4, 4) != kDeltaVersion) ||
+      (block_size == 0) || (block_size > sizeof(block)) ||
+      (memcmp(header + kDeltaHeaderSize, base_hash.digest, digest_size) != 0) ||
+      (GetInt(header + 20, 8) != static_cast<uint64_t>(GetFileSize(base_path))))
+  {
+    LogCvmfs(kLogCatalog, kLogDebug, "delta %s does not apply to %s",
+             delta_path.c_str(), base_hash.ToString().c_str());
+    goto apply_delta_final;
+  }
+  num_blocks = (new_size + block_size - 1) / block_size;
+
+  fbase = fopen(base_path.c_str(), "r");
+  fnew = fopen(new_path.c_str(), "w");
+  if (!fbase || !fnew)
+    goto apply_delta_final;
+
+  // Unchanged blocks are copied from the base up to the next changed block
+  while (next_block < num_blocks) {
+    unsigned char index[4];
+    uint32_t changed_block = num_blocks;
+    const size_t have_index = fread(index, 1, 4, fdelta);
+    if (have_index == 4) {
+      changed_block = GetInt(index, 4);
+      if ((changed_block < next_block) || (changed_block >= num_blocks))
+        goto apply_delta_final;
+    } else if (have_index != 0) {
+      goto apply_delta_final;
+    }
+
+    if (fseek(fbase, static_cast<long>(next_block) * block_size, SEEK_SET) != 0)
+      goto apply_delta_final;
+    for (; next_block < changed_block; ++next_block) {
+      const uint64_t offset = static_cast<uint64_t>(next_block) * block_size;
+      const size_t size = (new_size - offset < block_size) ?
+                          new_size - offset : block_size;
+      if ((fread(block, 1, size, fbase) != size) ||
+          (fwrite(block, 1, size, fnew) != size))
+      {
+        goto apply_delta_final;
+      }
+    }
+    if (changed_block == num_blocks)
+      break;
+
+    const uint64_t offset = static_cast<uint64_t>(changed_block) * block_size;
+    const size_t size = (new_size - offset < block_size) ?
+                        new_size - offset : block_size;
+    if ((fread(block, 1, size, fdelta) != size) ||
+        (fwrite(block, 1, size, fnew) != size))
+    {
+      goto apply_delta_final;
+    }
+    next_block++;
+  }
+  if (fclose(fnew) != 0) {
+    fnew = NULL;
+    goto apply_delta_final;
+  }
+  fnew = NULL;
+
+  if (!zlib::CompressPath2Null(new_path, algorithm, parallel, &result_hash) ||
+      (result_hash != new_hash))
+  {
+    LogCvmfs(kLogCatalog, kLogDebug, "patched catalog does not match %s",
+             new_hash.ToString().c_str());
+    goto apply_delta_final;
+  }
+  result = true;
+
+ apply_delta_final:
+  if (fbase) fclose(fbase);
+  if (fdelta) fclose(fdelta);
+  if (fnew) fclose(fnew);
+  return result;
+}
+
+}  // namespace catalog
@@ -0,0 +1,36 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A catalog delta carries the blocks of a catalog database that differ from
+ * the previous revision.  SQlite changes its pages in place, so that a publish
+ * touching a few entries touches a few pages.  The publisher stores the delta
+ * next to the new catalog, clients that hold the previous revision patch it
+ * and verify the result by the content hash of the new catalog.
+ */
+
+#ifndef CVMFS_CATALOG_DELTA_H_
+#define CVMFS_CATALOG_DELTA_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "hash.h"
+
+namespace catalog {
+
+/**
+ * The delta of the catalog with the given content hash is stored with this
+ * suffix, e.g. data/ab/cdef...D
+ */
+const char kDeltaSuffix = 'D';
+
+bool CreateDelta(const std::string &base_path, const hash::Any &base_hash,
+                 const std::string &new_path, const std::string &delta_path);
+bool ApplyDelta(const std::string &base_path, const hash::Any &base_hash,
+                const std::string &delta_path, const std::string &new_path,
+                const hash::Any &new_hash);
+
+}  // namespace catalog
+
+#endif  // CVMFS_CATALOG_DELTA_H_
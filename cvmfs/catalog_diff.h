@@ -0,0 +1,365 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Computes the difference between two revisions of a catalog tree.
+ */
+
+#ifndef CVMFS_CATALOG_DIFF_H_
+#define CVMFS_CATALOG_DIFF_H_
+
+#include <cassert>
+
+#include <algorithm>
+
+#include "catalog.h"
+#include "dirent.h"
+#include "hash.h"
+#include "logging.h"
+#include "shortstring.h"
+
+namespace catalog {
+
+/**
+ * A diff engine for two catalog trees, e.g. two revisions of a repository.
+ * Both trees are walked directory by directory, added, removed and modified
+ * entries are reported through the callbacks on the delegate of type T.
+ * Nested catalogs that have the same hash in both revisions are skipped
+ * without loading them.  The entries of a removed or an added subtree are
+ * reported individually, parents before their children.
+ *
+ * Catalogs are loaded on demand by fn_load_catalog, the delegate decides
+ * where they come from (local cache, HTTP, backend storage).  Loaded catalogs
+ * are owned and deleted by the diff engine.
+ *
+ * Usage:
+ *   CatalogDiff<Delegate> diff(delegate);
+ *   diff.fn_load_catalog = &Delegate::LoadCatalog;
+ *   diff.fn_add = &Delegate::Add;
+ *   ...
+ *   diff.Diff(old_root_hash, new_root_hash);
+ */
+template <class T>
+class CatalogDiff {
+ public:
+  typedef void (T::*EntryCallback)(const PathString &path,
+                                   const DirectoryEntry &entry);
+  typedef void (T::*ModifyCallback)(const PathString &path,
+                                    const DirectoryEntry &old_entry,
+                                    const DirectoryEntry &new_entry);
+  /**
+   * Has to return an opened catalog, for instance by AttachFreely(), or NULL
+   * on failure.
+   */
+  typedef Catalog *(T::*LoadCallback)(const PathString &mountpoint,
+                                      const hash::Any &catalog_hash);
+
+  EntryCallback fn_add;
+  EntryCallback fn_remove;
+  ModifyCallback fn_modify;
+  LoadCallback fn_load_catalog;
+
+  explicit CatalogDiff(T *delegate) {
+    delegate_ = delegate;
+    fn_add = NULL;
+    fn_remove = NULL;
+    fn_modify = NULL;
+    fn_load_catalog = NULL;
+    num_catalogs_loaded_ = 0;
+    num_catalogs_skipped_ = 0;
+  }
+
+  /**
+   * Compares two repository revisions given by their root catalogs.
+   * @return false if a catalog could not be loaded or listed; the callbacks
+   *         up to that point have been called
+   */
+  bool Diff(const hash::Any &old_root_hash, const hash::Any &new_root_hash) {
+    return Diff(PathString("", 0), old_root_hash, new_root_hash);
+  }
+
+  /**
+   * Compares two revisions of the catalog subtree mounted at mountpoint.
+   */
+  bool Diff(const PathString &mountpoint,
+            const hash::Any &old_hash, const hash::Any &new_hash)
+  {
+    assert(fn_load_catalog != NULL);
+    if (old_hash == new_hash) {
+      num_catalogs_skipped_++;
+      return true;
+    }
+
+    Catalog *old_catalog = Load(mountpoint, old_hash);
+    if (old_catalog == NULL)
+      return false;
+    Catalog *new_catalog = Load(mountpoint, new_hash);
+    if (new_catalog == NULL) {
+      delete old_catalog;
+      return false;
+    }
+
+    bool retval = true;
+    DirectoryEntry old_root;
+    DirectoryEntry new_root;
+    if (!old_catalog->LookupPath(mountpoint, &old_root) ||
+        !new_catalog->LookupPath(mountpoint, &new_root))
+    {
+      LogCvmfs(kLogCatalog, kLogDebug, "failed to look up root of %s",
+               mountpoint.c_str());
+      retval = false;
+    } else {
+      if (!IsEqual(old_root, new_root))
+        NotifyModify(mountpoint, old_root, new_root);
+      retval = DiffDirectory(mountpoint, old_catalog, new_catalog);
+    }
+
+    delete old_catalog;
+    delete new_catalog;
+    return retval;
+  }
+
+  uint64_t num_catalogs_loaded() const { return num_catalogs_loaded_; }
+  uint64_t num_catalogs_skipped() const { return num_catalogs_skipped_; }
+
+  /**
+   * Entries are equal if they are unchanged from the user's point of view.
+   * Inodes and hardlink group numbers are assigned per revision and ignored.
+   */
+  static bool IsEqual(const DirectoryEntry &a, const DirectoryEntry &b) {
+    return (a.name() == b.name()) &&
+           (a.mode() == b.mode()) &&
+           (a.size() == b.size()) &&
+           (a.mtime() == b.mtime()) &&
+           (a.uid() == b.uid()) &&
+           (a.gid() == b.gid()) &&
+           (a.linkcount() == b.linkcount()) &&
+           (a.checksum() == b.checksum()) &&
+           (a.symlink() == b.symlink()) &&
+           (a.IsChunkedFile() == b.IsChunkedFile()) &&
+           (a.IsNestedCatalogMountpoint() == b.IsNestedCatalogMountpoint());
+  }
+
+ private:
+  struct NameOrder {
+    bool operator() (const DirectoryEntry &a, const DirectoryEntry &b) const {
+      return a.name() < b.name();
+    }
+  };
+
+  T *delegate_;
+  uint64_t num_catalogs_loaded_;
+  uint64_t num_catalogs_skipped_;
+
+  Catalog *Load(const PathString &mountpoint, const hash::Any &catalog_hash) {
+    LogCvmfs(kLogCatalog, kLogDebug, "diff: loading catalog %s at %s",
+             catalog_hash.ToString().c_str(), mountpoint.c_str());
+    Catalog *catalog = (delegate_->*fn_load_catalog)(mountpoint, catalog_hash);
+    if (catalog == NULL) {
+      LogCvmfs(kLogCatalog, kLogDebug, "diff: failed to load catalog %s",
+               catalog_hash.ToString().c_str());
+      return NULL;
+    }
+    num_catalogs_loaded_++;
+    return catalog;
+  }
+
+  static PathString JoinPath(const PathString &parent,
+                             const NameString &name)
+  {
+    PathString result(parent);
+    result.Append("/", 1);
+    result.Append(name.GetChars(), name.GetLength());
+    return result;
+  }
+
+  bool List(const Catalog *catalog, const PathString &path,
+            DirectoryEntryList *listing) const
+  {
+    if (!catalog->ListingPath(path, listing)) {
+      LogCvmfs(kLogCatalog, kLogDebug, "diff: failed to list %s",
+               path.c_str());
+      return false;
+    }
+    std::sort(listing->begin(), listing->end(), NameOrder());
+    return true;
+  }
+
+  /**
+   * Merges the sorted listings of the same directory of both revisions.
+   */
+  bool DiffDirectory(const PathString &path,
+                     const Catalog *old_catalog, const Catalog *new_catalog)
+  {
+    DirectoryEntryList old_listing;
+    DirectoryEntryList new_listing;
+    if (!List(old_catalog, path, &old_listing) ||
+        !List(new_catalog, path, &new_listing))
+    {
+      return false;
+    }
+
+    bool retval = true;
+    unsigned i = 0;
+    unsigned j = 0;
+    while ((i < old_listing.size()) || (j < new_listing.size())) {
+      if ((j == new_listing.size()) ||
+          ((i < old_listing.size()) &&
+           (old_listing[i].name() < new_listing[j].name())))
+      {
+        const PathString child = JoinPath(path, old_listing[i].name());
+        retval = ReportSubtree(child, old_listing[i], old_catalog, fn_remove)
+                 && retval;
+        ++i;
+      } else if ((i == old_listing.size()) ||
+                 (new_listing[j].name() < old_listing[i].name()))
+      {
+        const PathString child = JoinPath(path, new_listing[j].name());
+        retval = ReportSubtree(child, new_listing[j], new_catalog, fn_add)
+                 && retval;
+        ++j;
+      } else {
+        const PathString child = JoinPath(path, old_listing[i].name());
+        retval = DiffEntry(child, old_listing[i], new_listing[j],
+                           old_catalog, new_catalog) && retval;
+        ++i;
+        ++j;
+      }
+    }
+    return retval;
+  }
+
+  bool DiffEntry(const PathString &path,
+                 const DirectoryEntry &old_entry,
+                 const DirectoryEntry &new_entry,
+                 const Catalog *old_catalog, const Catalog *new_catalog)
+  {
+    const bool old_is_dir = old_entry.IsDirectory();
+    const bool new_is_dir = new_entry.IsDirectory();
+    if (!IsEqual(old_entry, new_entry))
+      NotifyModify(path, old_entry, new_entry);
+
+    // A directory replaced by a file or vice versa
+    if (old_is_dir != new_is_dir) {
+      if (old_is_dir)
+        return ReportChildren(path, old_entry, old_catalog, fn_remove);
+      return ReportChildren(path, new_entry, new_catalog, fn_add);
+    }
+    if (!old_is_dir)
+      return true;
+
+    const bool old_is_nested = old_entry.IsNestedCatalogMountpoint();
+    const bool new_is_nested = new_entry.IsNestedCatalogMountpoint();
+    if (!old_is_nested && !new_is_nested)
+      return DiffDirectory(path, old_catalog, new_catalog);
+
+    if (old_is_nested && new_is_nested) {
+      hash::Any old_hash;
+      hash::Any new_hash;
+      if (!old_catalog->FindNested(path, &old_hash) ||
+          !new_catalog->FindNested(path, &new_hash))
+      {
+        LogCvmfs(kLogCatalog, kLogDebug, "diff: nested catalog %s missing",
+                 path.c_str());
+        return false;
+      }
+      if (old_hash == new_hash) {
+        num_catalogs_skipped_++;
+        return true;
+      }
+      Catalog *old_nested = Load(path, old_hash);
+      if (old_nested == NULL)
+        return false;
+      Catalog *new_nested = Load(path, new_hash);
+      if (new_nested == NULL) {
+        delete old_nested;
+        return false;
+      }
+      const bool retval = DiffDirectory(path, old_nested, new_nested);
+      delete old_nested;
+      delete new_nested;
+      return retval;
+    }
+
+    // A nested catalog was created or merged into its parent
+    const Catalog *old_subtree = old_catalog;
+    const Catalog *new_subtree = new_catalog;
+    Catalog *nested = NULL;
+    hash::Any nested_hash;
+    const Catalog *owner = old_is_nested ? old_catalog : new_catalog;
+    if (!owner->FindNested(path, &nested_hash)) {
+      LogCvmfs(kLogCatalog, kLogDebug, "diff: nested catalog %s missing",
+               path.c_str());
+      return false;
+    }
+    nested = Load(path, nested_hash);
+    if (nested == NULL)
+      return false;
+    if (old_is_nested)
+      old_subtree = nested;
+    else
+      new_subtree = nested;
+    const bool retval = DiffDirectory(path, old_subtree, new_subtree);
+    delete nested;
+    return retval;
+  }
+
+  /**
+   * Reports entry and, for directories, everything below it.
+   */
+  bool ReportSubtree(const PathString &path, const DirectoryEntry &entry,
+                     const Catalog *catalog, EntryCallback callback)
+  {
+    Notify(callback, path, entry);
+    if (!entry.IsDirectory())
+      return true;
+    return ReportChildren(path, entry, catalog, callback);
+  }
+
+  bool ReportChildren(const PathString &path, const DirectoryEntry &entry,
+                      const Catalog *catalog, EntryCallback callback)
+  {
+    if (callback == NULL)
+      return true;
+
+    Catalog *nested = NULL;
+    if (entry.IsNestedCatalogMountpoint()) {
+      hash::Any nested_hash;
+      if (!catalog->FindNested(path, &nested_hash)) {
+        LogCvmfs(kLogCatalog, kLogDebug, "diff: nested catalog %s missing",
+                 path.c_str());
+        return false;
+      }
+      nested = Load(path, nested_hash);
+      if (nested == NULL)
+        return false;
+      catalog = nested;
+    }
+
+    DirectoryEntryList listing;
+    bool retval = List(catalog, path, &listing);
+    for (unsigned i = 0; retval && (i < listing.size()); ++i) {
+      retval = ReportSubtree(JoinPath(path, listing[i].name()), listing[i],
+                             catalog, callback);
+    }
+    delete nested;
+    return retval;
+  }
+
+  void Notify(EntryCallback callback, const PathString &path,
+              const DirectoryEntry &entry) const
+  {
+    if (callback != NULL)
+      (delegate_->*callback)(path, entry);
+  }
+
+  void NotifyModify(const PathString &path, const DirectoryEntry &old_entry,
+                    const DirectoryEntry &new_entry) const
+  {
+    if (fn_modify != NULL)
+      (delegate_->*fn_modify)(path, old_entry, new_entry);
+  }
+};
+
+}  // namespace catalog
+
+#endif  // CVMFS_CATALOG_DIFF_H_
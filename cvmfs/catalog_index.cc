@@ -0,0 +1,308 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "catalog_index.h"
+
+#include <inttypes.h>
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+#include "catalog.h"
+#include "catalog_sql.h"
+#include "logging.h"
+#include "smalloc.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace catalog {
+
+uint64_t CatalogIndex::memory_limit_ = 256*1024*1024;
+atomic_int64 CatalogIndex::memory_used_ = 0;
+
+
+struct CatalogIndex::PathOrder {
+  bool operator() (const Entry &a, const Entry &b) const {
+    if (a.md5path_1 != b.md5path_1)
+      return a.md5path_1 < b.md5path_1;
+    return a.md5path_2 < b.md5path_2;
+  }
+};
+
+
+/**
+ * Entries of the same directory stay in row id order, like the listing of
+ * the catalog table.
+ */
+struct CatalogIndex::ParentOrder {
+  explicit ParentOrder(const vector<Entry> *e) : entries(e) { }
+  bool operator() (const uint32_t a, const uint32_t b) const {
+    const Entry &x = (*entries)[a];
+    const Entry &y = (*entries)[b];
+    if (x.parent_1 != y.parent_1)
+      return x.parent_1 < y.parent_1;
+    if (x.parent_2 != y.parent_2)
+      return x.parent_2 < y.parent_2;
+    return x.row_id < y.row_id;
+  }
+  const vector<Entry> *entries;
+};
+
+
+static void Md5ToKey(const hash::Md5 &md5, int64_t *key_1, int64_t *key_2) {
+  uint64_t high, low;
+  md5.ToIntPair(&high, &low);
+  *key_1 = static_cast<int64_t>(high);
+  *key_2 = static_cast<int64_t>(low);
+}
+
+
+/**
+ * Reads all directory entries of the database and lays out the index in a
+ * single memory block.  Nothing is written to the cache directory.  Catalogs
+ * whose index doesn't fit into the remaining memory limit are not read at
+ * all, num_entries_hint (e.g. the maximum row id) sizes the estimate.
+ * @return the index or NULL on failure or if the memory limit is exhausted
+ */
+CatalogIndex *CatalogIndex::Create(const Database &database,
+                                   const uint64_t num_entries_hint)
+{
+  const uint64_t estimate =
+    sizeof(Header) + num_entries_hint * (sizeof(Entry) + sizeof(uint32_t));
+  if ((memory_limit_ > 0) && (memory_used() + estimate > memory_limit_)) {
+    LogCvmfs(kLogCatalog, kLogDebug,
+             "index memory exhausted, no index for %s (%"PRIu64" bytes)",
+             database.filename().c_str(), estimate);
+    return NULL;
+  }
+
+  vector<Entry> entries;
+  string heap;
+  SqlAllDirents sql_all(database);
+  while (sql_all.FetchRow()) {
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    Md5ToKey(sql_all.GetPathHash(), &entry.md5path_1, &entry.md5path_2);
+    Md5ToKey(sql_all.GetParentPathHash(), &entry.parent_1, &entry.parent_2);
+    // Column layout of SqlLookup::GetFieldsToSelect()
+    entry.row_id = sql_all.RetrieveInt64(12);
+    entry.hardlinks = sql_all.RetrieveInt64(1);
+    entry.size = sql_all.RetrieveInt64(2);
+    entry.mtime = sql_all.RetrieveInt64(4);
+    entry.mode = sql_all.RetrieveInt(3);
+    entry.flags = sql_all.RetrieveInt(5);
+    if (database.schema_version() >= 2.1-Database::kSchemaEpsilon) {
+      entry.uid = sql_all.RetrieveInt64(13);
+      entry.gid = sql_all.RetrieveInt64(14);
+    }
+    const hash::Any checksum = sql_all.RetrieveSha1Blob(0);
+    memcpy(entry.checksum, checksum.digest, sizeof(entry.checksum));
+
+    const char *name = reinterpret_cast<const char *>(sql_all.RetrieveText(6));
+    const LinkString symlink = sql_all.GetSymlink();
+    entry.name_offset = heap.length();
+    entry.name_length = strlen(name);
+    heap.append(name, entry.name_length);
+    entry.symlink_offset = heap.length();
+    entry.symlink_length = symlink.GetLength();
+    heap.append(symlink.GetChars(), symlink.GetLength());
+    if (heap.length() > 0xFFFFFFFFU) {
+      LogCvmfs(kLogCatalog, kLogDebug, "string heap too large for index of %s",
+               database.filename().c_str());
+      return NULL;
+    }
+    entries.push_back(entry);
+  }
+  if (sql_all.GetLastError() != SQLITE_DONE) {
+    LogCvmfs(kLogCatalog, kLogDebug, "failed to read entries of %s (%d)",
+             database.filename().c_str(), sql_all.GetLastError());
+    return NULL;
+  }
+
+  if (entries.size() > 0xFFFFFFFFU)
+    return NULL;
+  sort(entries.begin(), entries.end(), PathOrder());
+  vector<uint32_t> listing(entries.size());
+  for (unsigned i = 0; i < listing.size(); ++i)
+    listing[i] = i;
+  sort(listing.begin(), listing.end(), ParentOrder(&entries));
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kMagic;
+  header.version = kVersion;
+  header.num_entries = entries.size();
+  header.heap_size = heap.length();
+  const uint64_t size = sizeof(Header) + entries.size() * sizeof(Entry) +
+    listing.size() * sizeof(uint32_t) + heap.length();
+
+  // Concurrent loads may have taken the memory meanwhile
+  const uint64_t used = atomic_xadd64(&memory_used_, size) + size;
+  if ((memory_limit_ > 0) && (used > memory_limit_)) {
+    atomic_xadd64(&memory_used_, -static_cast<int64_t>(size));
+    LogCvmfs(kLogCatalog, kLogDebug,
+             "index memory exhausted, no index for %s (%"PRIu64" bytes)",
+             database.filename().c_str(), size);
+    return NULL;
+  }
+
+  char *data = static_cast<char *>(smalloc(size));
+  char *pos = data;
+  memcpy(pos, &header, sizeof(header));
+  pos += sizeof(header);
+  if (!entries.empty()) {
+    memcpy(pos, &entries[0], entries.size() * sizeof(Entry));
+    pos += entries.size() * sizeof(Entry);
+    memcpy(pos, &listing[0], listing.size() * sizeof(uint32_t));
+    pos += listing.size() * sizeof(uint32_t);
+  }
+  if (!heap.empty())
+    memcpy(pos, heap.data(), heap.length());
+
+  LogCvmfs(kLogCatalog, kLogDebug,
+           "created index of %s (%"PRIu64" entries, %"PRIu64" bytes)",
+           database.filename().c_str(), header.num_entries, size);
+  return new CatalogIndex(data, size);
+}
+
+
+CatalogIndex::CatalogIndex(const char *data, const uint64_t size) {
+  data_ = data;
+  size_ = size;
+  header_ = reinterpret_cast<const Header *>(data_);
+  assert((header_->magic == kMagic) && (header_->version == kVersion));
+  entries_ = reinterpret_cast<const Entry *>(data_ + sizeof(Header));
+  listing_ = reinterpret_cast<const uint32_t *>(
+    entries_ + header_->num_entries);
+  heap_ = reinterpret_cast<const char *>(listing_ + header_->num_entries);
+}
+
+
+CatalogIndex::~CatalogIndex() {
+  free(const_cast<char *>(data_));
+  atomic_xadd64(&memory_used_, -static_cast<int64_t>(size_));
+}
+
+
+bool CatalogIndex::Lookup(const hash::Md5 &md5path, const Catalog *catalog,
+                          DirectoryEntry *dirent) const
+{
+  int64_t key_1, key_2;
+  Md5ToKey(md5path, &key_1, &key_2);
+
+  uint64_t low = 0;
+  uint64_t high = header_->num_entries;
+  while (low < high) {
+    const uint64_t mid = low + (high - low) / 2;
+    const Entry &entry = entries_[mid];
+    if ((entry.md5path_1 < key_1) ||
+        ((entry.md5path_1 == key_1) && (entry.md5path_2 < key_2)))
+    {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if ((low == header_->num_entries) || (entries_[low].md5path_1 != key_1) ||
+      (entries_[low].md5path_2 != key_2))
+  {
+    return false;
+  }
+
+  if (dirent != NULL)
+    *dirent = GetDirent(entries_[low], catalog);
+  return true;
+}
+
+
+/**
+ * Finds the range [begin, end) of listing positions of a directory's entries.
+ */
+void CatalogIndex::FindListing(const hash::Md5 &md5path,
+                               uint32_t *begin, uint32_t *end) const
+{
+  int64_t key_1, key_2;
+  Md5ToKey(md5path, &key_1, &key_2);
+
+  uint64_t low = 0;
+  uint64_t high = header_->num_entries;
+  while (low < high) {
+    const uint64_t mid = low + (high - low) / 2;
+    const Entry &entry = entries_[listing_[mid]];
+    if ((entry.parent_1 < key_1) ||
+        ((entry.parent_1 == key_1) && (entry.parent_2 < key_2)))
+    {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  *begin = low;
+  while ((low < header_->num_entries) &&
+         (entries_[listing_[low]].parent_1 == key_1) &&
+         (entries_[listing_[low]].parent_2 == key_2))
+  {
+    ++low;
+  }
+  *end = low;
+}
+
+
+DirectoryEntry CatalogIndex::GetListingDirent(const uint32_t position,
+                                              const Catalog *catalog) const
+{
+  assert(position < header_->num_entries);
+  return GetDirent(entries_[listing_[position]], catalog);
+}
+
+
+/**
+ * Mirrors SqlLookup::GetDirent().  This method is a friend of DirectoryEntry.
+ */
+DirectoryEntry CatalogIndex::GetDirent(const Entry &entry,
+                                       const Catalog *catalog) const
+{
+  DirectoryEntry result;
+
+  result.catalog_ = (Catalog*)catalog;
+  result.is_nested_catalog_root_ =
+    (entry.flags & SqlDirent::kFlagDirNestedRoot);
+  result.is_nested_catalog_mountpoint_ =
+    (entry.flags & SqlDirent::kFlagDirNestedMountpoint);
+  result.is_chunked_file_ = (entry.flags & SqlDirent::kFlagFileChunk);
+
+  // must be set later by a second catalog lookup
+  result.parent_inode_ = DirectoryEntry::kInvalidInode;
+  result.hardlinks_ = entry.hardlinks;
+  if (catalog->schema() < 2.1-Database::kSchemaEpsilon) {
+    result.inode_ = ((Catalog*)catalog)->GetMangledInode(entry.row_id, 0);
+    result.uid_ = g_uid;
+    result.gid_ = g_gid;
+  } else {
+    const uint32_t hardlink_group =
+      DirectoryEntry::Hardlinks2HardlinkGroup(result.hardlinks_);
+    result.inode_ = ((Catalog*)catalog)->GetMangledInode(entry.row_id,
+                                                         hardlink_group);
+    result.uid_ = entry.uid;
+    result.gid_ = entry.gid;
+  }
+  result.mode_ = entry.mode;
+  result.size_ = entry.size;
+  result.mtime_ = entry.mtime;
+  result.checksum_ = hash::Any(hash::kSha1, entry.checksum,
+                               sizeof(entry.checksum));
+  result.name_.Assign(heap_ + entry.name_offset, entry.name_length);
+  result.symlink_.Assign(heap_ + entry.symlink_offset, entry.symlink_length);
+
+  return result;
+}
+
+}  // namespace catalog
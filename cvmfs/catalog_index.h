@@ -0,0 +1,109 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A compact, immutable index of a read-only catalog.  It is generated from
+ * the catalog database on load and kept in memory, so that path lookups and
+ * listings turn into binary searches without going through SQlite.  The
+ * memory of all indexes is bounded, catalogs beyond the bound are served by
+ * SQlite.
+ */
+
+#ifndef CVMFS_CATALOG_INDEX_H_
+#define CVMFS_CATALOG_INDEX_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "atomic.h"
+#include "dirent.h"
+#include "hash.h"
+
+namespace catalog {
+
+class Catalog;
+class Database;
+
+/**
+ * The index consists of a header, the fixed-size entries sorted by path
+ * hash, the entry positions sorted by parent path hash (so that a directory
+ * listing is a consecutive range) and a heap for names and symlinks.  It is
+ * one memory block that lives only as long as the catalog.
+ */
+class CatalogIndex {
+ public:
+  static const uint32_t kMagic = 0x58495643;  // "CVIX"
+  static const uint32_t kVersion = 1;
+
+  static CatalogIndex *Create(const Database &database,
+                              const uint64_t num_entries_hint);
+  ~CatalogIndex();
+
+  static void SetMemoryLimit(const uint64_t limit) { memory_limit_ = limit; }
+  static uint64_t memory_used() { return atomic_read64(&memory_used_); }
+
+  bool Lookup(const hash::Md5 &md5path, const Catalog *catalog,
+              DirectoryEntry *dirent) const;
+  void FindListing(const hash::Md5 &md5path,
+                   uint32_t *begin, uint32_t *end) const;
+  DirectoryEntry GetListingDirent(const uint32_t position,
+                                  const Catalog *catalog) const;
+
+  uint64_t num_entries() const { return header_->num_entries; }
+  uint64_t size() const { return size_; }
+
+ private:
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_entries;
+    uint64_t heap_size;
+  };
+
+  /**
+   * Raw row of the catalog table, decoded like in SqlLookup::GetDirent().
+   */
+  struct Entry {
+    int64_t md5path_1;
+    int64_t md5path_2;
+    int64_t parent_1;
+    int64_t parent_2;
+    uint64_t row_id;
+    uint64_t hardlinks;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t flags;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t symlink_offset;
+    uint32_t symlink_length;
+    unsigned char checksum[20];
+    uint32_t padding;
+  };
+
+  struct PathOrder;
+  struct ParentOrder;
+
+  /**
+   * Upper bound for the sum of all index blocks, 0 means no bound
+   */
+  static uint64_t memory_limit_;
+  static atomic_int64 memory_used_;
+
+  CatalogIndex(const char *data, const uint64_t size);
+  DirectoryEntry GetDirent(const Entry &entry, const Catalog *catalog) const;
+
+  const char *data_;
+  uint64_t size_;
+  const Header *header_;
+  const Entry *entries_;  ///< sorted by path hash
+  const uint32_t *listing_;  ///< positions in entries_ sorted by parent hash
+  const char *heap_;
+};
+
+}  // namespace catalog
+
+#endif  // CVMFS_CATALOG_INDEX_H_
@@ -4,8 +4,12 @@
 
 #include "catalog_mgr.h"
 
+#include <sys/time.h>
+
 #include <cassert>
 
+#include <algorithm>
+
 #include "logging.h"
 #include "smalloc.h"
 #include "shortstring.h"
@@ -14,6 +18,36 @@ using namespace std;  // NOLINT
 
 namespace catalog {
 
+static bool LessInodeOffset(const Catalog *a, const Catalog *b) {
+  return a->inode_range().offset < b->inode_range().offset;
+}
+
+
+/**
+ * Finds the catalog whose inode range contains inode in a list sorted by
+ * inode offset.  Returns NULL if no range contains the inode.
+ */
+static Catalog *FindInodeCatalog(const CatalogList &inode_index,
+                                 const inode_t inode)
+{
+  // Inode ranges start after their offset, so the candidate is the last
+  // catalog with an offset below the inode
+  unsigned lower = 0;
+  unsigned upper = inode_index.size();
+  while (lower < upper) {
+    const unsigned middle = (lower + upper) / 2;
+    if (inode_index[middle]->inode_range().offset < inode)
+      lower = middle + 1;
+    else
+      upper = middle;
+  }
+  if (lower == 0)
+    return NULL;
+  Catalog *candidate = inode_index[lower - 1];
+  return candidate->inode_range().ContainsInode(inode) ? candidate : NULL;
+}
+
+
 AbstractCatalogManager::AbstractCatalogManager() {
   inode_gauge_ = AbstractCatalogManager::kInodeOffset;
   rwlock_ =
@@ -22,6 +56,36 @@ AbstractCatalogManager::AbstractCatalogManager() {
   assert(retval == 0);
   retval = pthread_key_create(&pkey_sqlitemem_, NULL);
   assert(retval == 0);
+
+  snapshot_ = new Snapshot();
+  atomic_init64(&epoch_);
+  atomic_inc64(&epoch_);
+  reader_slots_ = NULL;
+  has_retired_ = false;
+  defer_publish_ = false;
+  remount_prepared_ = false;
+  remount_load_error_ = kLoadFail;
+  retval = pthread_key_create(&pkey_reader_, ReleaseReaderSlot);
+  assert(retval == 0);
+  lock_reclaim_ =
+    reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
+  retval = pthread_mutex_init(lock_reclaim_, NULL);
+  assert(retval == 0);
+
+  lock_loading_ =
+    reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
+  cond_loading_ =
+    reinterpret_cast<pthread_cond_t *>(smalloc(sizeof(pthread_cond_t)));
+  retval = pthread_mutex_init(lock_loading_, NULL);
+  retval |= pthread_cond_init(cond_loading_, NULL);
+  assert(retval == 0);
+
+  sqlite_cache_budget_ = 0;
+  atomic_init64(&num_governor_ticks_);
+  lock_governor_ =
+    reinterpret_cast<pthread_mutex_t *>(smalloc(sizeof(pthread_mutex_t)));
+  retval = pthread_mutex_init(lock_governor_, NULL);
+  assert(retval == 0);
 }
 
 
@@ -30,6 +94,29 @@ AbstractCatalogManager::~AbstractCatalogManager() {
   pthread_key_delete(pkey_sqlitemem_);
   pthread_rwlock_destroy(rwlock_);
   free(rwlock_);
+
+  // No more readers at this point
+  pthread_key_delete(pkey_reader_);
+  for (unsigned i = 0; i < retired_.size(); ++i) {
+    delete retired_[i].snapshot;
+    delete retired_[i].catalog;
+  }
+  for (unsigned i = 0; i < detached_.size(); ++i)
+    delete detached_[i];
+  delete snapshot_;
+  while (reader_slots_) {
+    ReaderSlot *slot = reader_slots_;
+    reader_slots_ = slot->next;
+    delete slot;
+  }
+  pthread_mutex_destroy(lock_reclaim_);
+  free(lock_reclaim_);
+  pthread_cond_destroy(cond_loading_);
+  pthread_mutex_destroy(lock_loading_);
+  free(cond_loading_);
+  free(lock_loading_);
+  pthread_mutex_destroy(lock_governor_);
+  free(lock_governor_);
 }
 
 
@@ -51,10 +138,134 @@ bool AbstractCatalogManager::Init() {
 }
 
 
+/**
+ * Opens the catalogs of the new revision along the attached nested catalogs
+ * and puts the nested catalogs into the local storage, so that the remount
+ * attaches them without a download.  Runs without the write lock, the old
+ * tree keeps serving.  The catalogs are opened stand-alone and closed again.
+ * Attached nested catalogs that keep their content hash and don't collide
+ * with the inodes of the new root catalog are collected in preserved.
+ */
+void AbstractCatalogManager::PrefetchRevision(
+  const string &root_path,
+  set<hash::Any> *ready,
+  map<PathString, PreservedCatalog> *preserved)
+{
+  // Mountpoints of the attached nested catalogs with their parents' ones,
+  // sorted such that parents come first
+  map<PathString, pair<PathString, hash::Any> > attached;
+  map<PathString, InodeRange> ranges;
+  set<PathString> parents;
+  ReadLock();
+  for (CatalogList::const_iterator i = catalogs_.begin(),
+       iEnd = catalogs_.end(); i != iEnd; ++i)
+  {
+    hash::Any hash;
+    if (!(*i)->IsRoot() && (*i)->parent()->FindNested((*i)->path(), &hash)) {
+      attached[(*i)->path()] = make_pair((*i)->parent()->path(), hash);
+      ranges[(*i)->path()] = (*i)->inode_range();
+      parents.insert((*i)->parent()->path());
+    }
+  }
+  Unlock();
+
+  map<PathString, Catalog *> revision;
+  Catalog *new_root = new Catalog(PathString("", 0), NULL);
+  if (!new_root->OpenDatabase(root_path)) {
+    delete new_root;
+    return;
+  }
+  revision[PathString("", 0)] = new_root;
+  // The new root catalog gets the first inodes, see Remount()
+  const uint64_t root_inode_gauge = AbstractCatalogManager::kInodeOffset +
+                                    new_root->max_row_id();
+
+  for (map<PathString, pair<PathString, hash::Any> >::const_iterator
+       i = attached.begin(), iEnd = attached.end(); i != iEnd; ++i)
+  {
+    // Removed with the new revision, or below a removed catalog
+    map<PathString, Catalog *>::const_iterator parent =
+      revision.find(i->second.first);
+    Catalog::NestedCatalog nested;
+    nested.path = i->first;
+    if ((parent == revision.end()) ||
+        !parent->second->FindNested(nested.path, &nested.hash))
+    {
+      continue;
+    }
+
+    string catalog_path;
+    if (!FetchCatalog(nested, &catalog_path)) {
+      LogCvmfs(kLogCatalog, kLogDebug, "failed to prefetch catalog %s",
+               nested.path.c_str());
+      atomic_inc64(&remount_statistics_.num_prefetch_failed);
+      continue;
+    }
+    if (nested.hash != i->second.second) {
+      atomic_inc64(&remount_statistics_.num_prefetched);
+    } else if (ranges[nested.path].offset >= root_inode_gauge) {
+      PreservedCatalog unchanged;
+      unchanged.hash = nested.hash;
+      unchanged.inode_range = ranges[nested.path];
+      (*preserved)[nested.path] = unchanged;
+    }
+    ready->insert(nested.hash);
+
+    // The new revision is only needed to find the nested catalogs' hashes
+    if (parents.find(nested.path) == parents.end())
+      continue;
+    Catalog *catalog = new Catalog(nested.path, NULL);
+    if (catalog->OpenDatabase(catalog_path))
+      revision[nested.path] = catalog;
+    else
+      delete catalog;
+  }
+
+  for (map<PathString, Catalog *>::iterator i = revision.begin(),
+       iEnd = revision.end(); i != iEnd; ++i)
+  {
+    delete i->second;
+  }
+}
+
+
+/**
+ * First half of a remount: loads the new root catalog and prefetches the
+ * changed nested catalogs while the old tree keeps serving lookups.  The
+ * following Remount() only switches the trees.
+ */
+LoadError AbstractCatalogManager::PrepareRemount() {
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  remount_ready_.clear();
+  remount_preserved_.clear();
+  remount_load_error_ = LoadCatalog(PathString("", 0), hash::Any(),
+                                    &remount_root_path_);
+  if (remount_load_error_ == kLoadNew) {
+    PrefetchRevision(remount_root_path_, &remount_ready_,
+                     &remount_preserved_);
+  }
+  remount_prepared_ = true;
+  gettimeofday(&end, NULL);
+  atomic_write64(&remount_statistics_.prefetch_ms,
+                 int64_t(DiffTimeSeconds(start, end) * 1000));
+  LogCvmfs(kLogCatalog, kLogDebug, "prepared remount, %u nested catalogs "
+           "ready", remount_ready_.size());
+  return remount_load_error_;
+}
+
+
 /**
  * Remounts the root catalog if necessary.  If a newer root catalog exists,
  * it is mounted and replaces the currently mounted tree (all existing catalogs
- * are detached)
+ * are detached).  Nested catalogs that don't change keep their inodes when
+ * they are attached again, unless their inodes collide with the new root
+ * catalog.
+ *
+ * The new tree is double-buffered: the attached nested catalogs of the new
+ * revision are downloaded before the switch, see PrepareRemount().  The new
+ * tree is built with these catalogs under the write lock and published at
+ * once, lookups use the old tree until then.
  */
 LoadError AbstractCatalogManager::Remount(const bool dry_run) {
   LogCvmfs(kLogCatalog, kLogDebug,
@@ -62,25 +273,138 @@ LoadError AbstractCatalogManager::Remount(const bool dry_run) {
   if (dry_run)
     return LoadCatalog(PathString("", 0), hash::Any(), NULL);
 
+  if (!remount_prepared_)
+    PrepareRemount();
+  remount_prepared_ = false;
+  const LoadError load_error = remount_load_error_;
+  const string catalog_path = remount_root_path_;
+  set<hash::Any> ready;
+  ready.swap(remount_ready_);
+  map<PathString, PreservedCatalog> may_preserve;
+  may_preserve.swap(remount_preserved_);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
   WriteLock();
-  string catalog_path;
-  const LoadError load_error = LoadCatalog(PathString("", 0), hash::Any(),
-                                           &catalog_path);
   if (load_error == kLoadNew) {
+    map<PathString, PreservedCatalog> attached_catalogs;
+    for (CatalogList::const_iterator i = catalogs_.begin(),
+         iEnd = catalogs_.end(); i != iEnd; ++i)
+    {
+      PreservedCatalog preserved;
+      if (!(*i)->IsRoot() &&
+          (*i)->parent()->FindNested((*i)->path(), &preserved.hash))
+      {
+        preserved.inode_range = (*i)->inode_range();
+        attached_catalogs[(*i)->path()] = preserved;
+      }
+    }
+    // Readers keep using the old tree until the new one is published
+    defer_publish_ = true;
     DetachAll();
+    const uint64_t previous_inode_gauge = inode_gauge_;
     inode_gauge_ = AbstractCatalogManager::kInodeOffset;
+    preserved_catalogs_.clear();
 
     Catalog *new_root = CreateCatalog(PathString("", 0), NULL);
     assert(new_root);
     bool retval = AttachCatalog(catalog_path, new_root);
     assert(retval);
+
+    const uint64_t root_inode_gauge = inode_gauge_;
+    inode_gauge_ = std::max(inode_gauge_, previous_inode_gauge);
+
+    // Parents come first in the map.  A nested catalog keeps its inodes only
+    // if its parent of the new tree lists it with the same content hash.
+    // Below a parent that is not attached, the hash cannot be verified and
+    // the inodes are not preserved.  Only catalogs announced by
+    // WillPreserveInode() qualify, so that callers that invalidated the
+    // other ones before the switch don't miss any.
+    unsigned num_reattached = 0;
+    for (map<PathString, PreservedCatalog>::const_iterator
+         i = attached_catalogs.begin(), iEnd = attached_catalogs.end();
+         i != iEnd; ++i)
+    {
+      Catalog *parent = FindCatalog(i->first);
+      hash::Any hash;
+      if ((parent->path() == i->first) ||
+          !parent->FindNested(i->first, &hash))
+      {
+        continue;
+      }
+      if ((hash == i->second.hash) &&
+          (i->second.inode_range.offset >= root_inode_gauge) &&
+          (may_preserve.find(i->first) != may_preserve.end()))
+      {
+        preserved_catalogs_.insert(*i);
+      }
+      if ((ready.find(hash) != ready.end()) &&
+          MountCatalog(i->first, hash, parent))
+      {
+        num_reattached++;
+      }
+    }
+    atomic_xadd64(&remount_statistics_.num_reattached, num_reattached);
+
+    defer_publish_ = false;
+    Publish();
+    LogCvmfs(kLogCatalog, kLogDebug, "preserving inodes of %u out of %u "
+             "nested catalogs, attached %u before the switch",
+             preserved_catalogs_.size(), attached_catalogs.size(),
+             num_reattached);
   }
   Unlock();
 
+  if (load_error == kLoadNew) {
+    gettimeofday(&end, NULL);
+    const int64_t switch_ms = int64_t(DiffTimeSeconds(start, end) * 1000);
+    atomic_inc64(&remount_statistics_.num_remounts);
+    atomic_write64(&remount_statistics_.switch_ms, switch_ms);
+    if (switch_ms > atomic_read64(&remount_statistics_.max_switch_ms))
+      atomic_write64(&remount_statistics_.max_switch_ms, switch_ms);
+  }
   return load_error;
 }
 
 
+/**
+ * Checks if an inode issued before the last remount is still valid, i.e. if it
+ * belongs to a nested catalog that didn't change.
+ */
+bool AbstractCatalogManager::IsPreservedInode(const inode_t inode) const {
+  ReadLock();
+  bool result = false;
+  for (map<PathString, PreservedCatalog>::const_iterator
+       i = preserved_catalogs_.begin(), iEnd = preserved_catalogs_.end();
+       i != iEnd; ++i)
+  {
+    if (i->second.inode_range.ContainsInode(inode)) {
+      result = true;
+      break;
+    }
+  }
+  Unlock();
+  return result;
+}
+
+
+/**
+ * Like IsPreservedInode() for the remount prepared by PrepareRemount(), before
+ * the switch.  Inodes for which this is false are certainly replaced by the
+ * following Remount().
+ */
+bool AbstractCatalogManager::WillPreserveInode(const inode_t inode) const {
+  for (map<PathString, PreservedCatalog>::const_iterator
+       i = remount_preserved_.begin(), iEnd = remount_preserved_.end();
+       i != iEnd; ++i)
+  {
+    if (i->second.inode_range.ContainsInode(inode))
+      return true;
+  }
+  return false;
+}
+
+
 /**
  * Perform a lookup for a specific DirectoryEntry in the catalogs.
  * @param inode the inode to find in the catalogs
@@ -93,30 +417,22 @@ bool AbstractCatalogManager::LookupInode(const inode_t inode,
                                          DirectoryEntry *dirent)
 {
   EnforceSqliteMemLimit();
-  ReadLock();
+  const Snapshot *snapshot = EnterSnapshot();
   bool found = false;
 
   // Get corresponding catalog
-  Catalog *catalog = NULL;
-  for (CatalogList::const_iterator i = catalogs_.begin(),
-       iEnd = catalogs_.end(); i != iEnd; ++i)
-  {
-    if ((*i)->inode_range().ContainsInode(inode)) {
-      catalog = *i;
-      break;
-    }
-  }
+  Catalog *catalog = FindInodeCatalog(snapshot->inode_index, inode);
   if (catalog == NULL) {
     LogCvmfs(kLogCatalog, kLogDebug, "cannot find catalog for inode %d", inode);
     goto lookup_inode_fini;
   }
 
   if ((options == kLookupSole) || (inode == GetRootInode())) {
-    atomic_inc64(&statistics_.num_lookup_inode);
+    statistics_.num_lookup_inode.Inc();
     found = catalog->LookupInode(inode, dirent, NULL);
     goto lookup_inode_fini;
   } else {
-    atomic_inc64(&statistics_.num_lookup_inode);
+    statistics_.num_lookup_inode.Inc();
     // Lookup including parent entry
     hash::Md5 parent_md5path;
     DirectoryEntry parent;
@@ -125,11 +441,15 @@ bool AbstractCatalogManager::LookupInode(const inode_t inode,
     found = catalog->LookupInode(inode, dirent, &parent_md5path);
     if (!found)
       goto lookup_inode_fini;
+    // Usually, the same query resolved the parent
+    if (dirent->parent_inode() != DirectoryEntry::kInvalidInode)
+      goto lookup_inode_fini;
 
-    // Parent is possibly in the parent catalog
-    atomic_inc64(&statistics_.num_lookup_path);
-    if (dirent->IsNestedCatalogRoot() && !catalog->IsRoot()) {
-      Catalog *parent_catalog = catalog->parent();
+    // Parent is possibly in the parent catalog.  The parent pointer is
+    // reset if the catalog is detached meanwhile.
+    statistics_.num_lookup_path.Inc();
+    Catalog *parent_catalog = catalog->parent();
+    if (dirent->IsNestedCatalogRoot() && (parent_catalog != NULL)) {
       found_parent = parent_catalog->LookupMd5Path(parent_md5path, &parent);
     } else {
       found_parent = catalog->LookupMd5Path(parent_md5path, &parent);
@@ -148,7 +468,7 @@ bool AbstractCatalogManager::LookupInode(const inode_t inode,
   }
 
  lookup_inode_fini:
-  Unlock();
+  LeaveSnapshot();
   return found;
 }
 
@@ -163,39 +483,52 @@ bool AbstractCatalogManager::LookupInode(const inode_t inode,
 bool AbstractCatalogManager::LookupPath(const PathString &path,
                                         const LookupOptions options,
                                         DirectoryEntry *dirent)
+{
+  return LookupPath(path, hash::Md5(path.GetChars(), path.GetLength()),
+                    options, dirent);
+}
+
+
+/**
+ * Like LookupPath() for callers that already have the path hash, e.g. from
+ * a cache lookup.  The hash is calculated only once for all the catalogs the
+ * lookup has to visit.
+ */
+bool AbstractCatalogManager::LookupPath(const PathString &path,
+                                        const hash::Md5 &md5path,
+                                        const LookupOptions options,
+                                        DirectoryEntry *dirent)
 {
   EnforceSqliteMemLimit();
-  ReadLock();
+  const Snapshot *snapshot = EnterSnapshot();
 
-  Catalog *best_fit = FindCatalog(path);
+  Catalog *best_fit = FindCatalog(path, snapshot->catalogs.front());
   assert(best_fit != NULL);
 
-  atomic_inc64(&statistics_.num_lookup_path);
+  statistics_.num_lookup_path.Inc();
   LogCvmfs(kLogCatalog, kLogDebug, "looking up '%s' in catalog: '%s'",
            path.c_str(), best_fit->path().c_str());
-  bool found = best_fit->LookupPath(path, dirent);
+  bool found = best_fit->LookupMd5Path(md5path, dirent);
 
   // Possibly in a nested catalog
   if (!found && MountSubtree(path, best_fit, NULL)) {
     LogCvmfs(kLogCatalog, kLogDebug, "looking up '%s' in a nested catalog",
              path.c_str());
-    Unlock();
-    WriteLock();
     // Check again to avoid race
+    ReadLock();
     best_fit = FindCatalog(path);
+    Unlock();
     assert(best_fit != NULL);
-    atomic_inc64(&statistics_.num_lookup_path);
-    found = best_fit->LookupPath(path, dirent);
+    statistics_.num_lookup_path.Inc();
+    found = best_fit->LookupMd5Path(md5path, dirent);
 
-    if (found) {
-      // DowngradeLock(); TODO
-    } else {
+    if (!found) {
       LogCvmfs(kLogCatalog, kLogDebug,
                "entry not found, we may have to load nested catalogs");
 
+      // Catalogs stay alive after unlocking until we leave the snapshot
       Catalog *nested_catalog;
-      found = MountSubtree(path, best_fit, &nested_catalog);
-      // DowngradeLock(); TODO
+      found = LoadSubtree(path, &nested_catalog);
 
       if (!found) {
         LogCvmfs(kLogCatalog, kLogDebug,
@@ -204,8 +537,8 @@ bool AbstractCatalogManager::LookupPath(const PathString &path,
       }
 
       if (nested_catalog != best_fit) {
-        atomic_inc64(&statistics_.num_lookup_path);
-        found = nested_catalog->LookupPath(path, dirent);
+        statistics_.num_lookup_path.Inc();
+        found = nested_catalog->LookupMd5Path(md5path, dirent);
         if (!found) {
           LogCvmfs(kLogCatalog, kLogDebug,
                    "nested catalogs loaded but entry '%s' was still not found",
@@ -234,13 +567,16 @@ bool AbstractCatalogManager::LookupPath(const PathString &path,
   if (options == kLookupFull) {
     DirectoryEntry parent;
     PathString parent_path = GetParentPath(path);
+    const hash::Md5 parent_md5path(parent_path.GetChars(),
+                                   parent_path.GetLength());
     if (dirent->IsNestedCatalogRoot()) {
-      if (best_fit->parent())
-        found = best_fit->parent()->LookupPath(parent_path, &parent);
+      Catalog *parent_catalog = best_fit->parent();
+      if (parent_catalog)
+        found = parent_catalog->LookupMd5Path(parent_md5path, &parent);
       else
         found = false;
     } else {
-      found = best_fit->LookupPath(parent_path, &parent);
+      found = best_fit->LookupMd5Path(parent_md5path, &parent);
     }
     if (!found) {
       LogCvmfs(kLogCatalog, kLogDebug | kLogSyslog,
@@ -251,12 +587,12 @@ bool AbstractCatalogManager::LookupPath(const PathString &path,
     dirent->set_parent_inode(parent.inode());
   }
 
-  Unlock();
+  LeaveSnapshot();
   return true;
 
  lookup_path_notfound:
-  Unlock();
-  atomic_inc64(&statistics_.num_lookup_path_negative);
+  LeaveSnapshot();
+  statistics_.num_lookup_path_negative.Inc();
   return false;
 }
 
@@ -272,28 +608,23 @@ bool AbstractCatalogManager::Listing(const PathString &path,
 {
   EnforceSqliteMemLimit();
   bool result;
-  ReadLock();
+  const Snapshot *snapshot = EnterSnapshot();
 
   // Find catalog, possibly load nested
-  Catalog *best_fit = FindCatalog(path);
+  Catalog *best_fit = FindCatalog(path, snapshot->catalogs.front());
   Catalog *catalog = best_fit;
   if (MountSubtree(path, best_fit, NULL)) {
-    Unlock();
-    WriteLock();
-    // Check again to avoid race
-    best_fit = FindCatalog(path);
-    result = MountSubtree(path, best_fit, &catalog);
-    // DowngradeLock(); TODO
+    result = LoadSubtree(path, &catalog);
     if (!result) {
-      Unlock();
+      LeaveSnapshot();
       return false;
     }
   }
 
-  atomic_inc64(&statistics_.num_listing);
+  statistics_.num_listing.Inc();
   result = catalog->ListingPath(path, listing);
 
-  Unlock();
+  LeaveSnapshot();
   return result;
 }
 
@@ -309,28 +640,84 @@ bool AbstractCatalogManager::ListingStat(const PathString &path,
 {
   EnforceSqliteMemLimit();
   bool result;
-  ReadLock();
+  const Snapshot *snapshot = EnterSnapshot();
 
   // Find catalog, possibly load nested
-  Catalog *best_fit = FindCatalog(path);
+  Catalog *best_fit = FindCatalog(path, snapshot->catalogs.front());
   Catalog *catalog = best_fit;
   if (MountSubtree(path, best_fit, NULL)) {
-    Unlock();
-    WriteLock();
-    // Check again to avoid race
-    best_fit = FindCatalog(path);
-    result = MountSubtree(path, best_fit, &catalog);
-    // DowngradeLock(); TODO
+    result = LoadSubtree(path, &catalog);
     if (!result) {
-      Unlock();
+      LeaveSnapshot();
       return false;
     }
   }
 
-  atomic_inc64(&statistics_.num_listing);
+  statistics_.num_listing.Inc();
   result = catalog->ListingPathStat(path, listing);
 
-  Unlock();
+  LeaveSnapshot();
+  return result;
+}
+
+
+/**
+ * Collects the pieces of a chunked file.
+ * @param path the path of the file
+ * @param chunks the resulting FileChunkList, ordered by offset
+ * @return true if the catalog for path was found, false otherwise
+ */
+bool AbstractCatalogManager::ListFileChunks(const PathString &path,
+                                            FileChunkList *chunks)
+{
+  EnforceSqliteMemLimit();
+  bool result;
+  const Snapshot *snapshot = EnterSnapshot();
+
+  // Find catalog, possibly load nested
+  Catalog *best_fit = FindCatalog(path, snapshot->catalogs.front());
+  Catalog *catalog = best_fit;
+  if (MountSubtree(path, best_fit, NULL)) {
+    result = LoadSubtree(path, &catalog);
+    if (!result) {
+      LeaveSnapshot();
+      return false;
+    }
+  }
+
+  result = catalog->ListPathChunks(path, chunks);
+
+  LeaveSnapshot();
+  return result;
+}
+
+
+/**
+ * Finds the bundle of a small file in the catalog of the given path, see
+ * Catalog::LookupBundle().
+ */
+bool AbstractCatalogManager::LookupBundle(const PathString &path,
+                                          const hash::Any &content_hash,
+                                          hash::Any *bundle_hash,
+                                          BundleMemberList *members)
+{
+  EnforceSqliteMemLimit();
+  bool result;
+  const Snapshot *snapshot = EnterSnapshot();
+
+  Catalog *best_fit = FindCatalog(path, snapshot->catalogs.front());
+  Catalog *catalog = best_fit;
+  if (MountSubtree(path, best_fit, NULL)) {
+    result = LoadSubtree(path, &catalog);
+    if (!result) {
+      LeaveSnapshot();
+      return false;
+    }
+  }
+
+  result = catalog->LookupBundle(content_hash, bundle_hash, members);
+
+  LeaveSnapshot();
   return result;
 }
 
@@ -359,6 +746,68 @@ int AbstractCatalogManager::GetNumCatalogs() const {
 }
 
 
+/**
+ * The currently attached catalogs and their inode ranges.
+ */
+void AbstractCatalogManager::GetInodeLayout(
+  map<PathString, PreservedCatalog> *layout) const
+{
+  layout->clear();
+  ReadLock();
+  for (CatalogList::const_iterator i = catalogs_.begin(),
+       iEnd = catalogs_.end(); i != iEnd; ++i)
+  {
+    PreservedCatalog preserved;
+    preserved.inode_range = (*i)->inode_range();
+    if ((*i)->IsRoot() ||
+        (*i)->parent()->FindNested((*i)->path(), &preserved.hash))
+    {
+      (*layout)[(*i)->path()] = preserved;
+    }
+  }
+  Unlock();
+}
+
+
+/**
+ * Nested catalogs of the layout that are attached later with the same content
+ * hash get the inode ranges of the layout.  Used to restore the inodes of a
+ * previous run, the ranges must not collide with the issued inodes.
+ */
+void AbstractCatalogManager::PreserveInodes(
+  const map<PathString, PreservedCatalog> &layout)
+{
+  WriteLock();
+  const uint64_t issued_inodes = inode_gauge_;
+  for (map<PathString, PreservedCatalog>::const_iterator i = layout.begin(),
+       iEnd = layout.end(); i != iEnd; ++i)
+  {
+    if ((i->first.GetLength() == 0) ||
+        (i->second.inode_range.offset < issued_inodes))
+    {
+      continue;
+    }
+    preserved_catalogs_.insert(*i);
+    inode_gauge_ = std::max(inode_gauge_, i->second.inode_range.offset +
+                                          i->second.inode_range.size);
+  }
+  Unlock();
+}
+
+
+/**
+ * Attaches the nested catalogs down to the one that serves path.
+ */
+bool AbstractCatalogManager::MountNested(const PathString &path) {
+  EnforceSqliteMemLimit();
+  EnterSnapshot();
+  Catalog *catalog;
+  const bool result = LoadSubtree(path, &catalog);
+  LeaveSnapshot();
+  return result;
+}
+
+
 /**
  * Gets a formatted tree of the currently attached catalogs
  */
@@ -401,13 +850,19 @@ void AbstractCatalogManager::ReleaseInodes(const InodeRange chunk) {
  * Find the catalog leaf in the tree that fits the path.
  * The path might be served by a not yet loaded nested catalog.
  * @param path the path a catalog is searched for
+ * @param root the root of the tree, the attached root catalog if NULL
  * @return the catalog which is best fitting at the given path
  */
-Catalog* AbstractCatalogManager::FindCatalog(const PathString &path) const {
-  assert (catalogs_.size() > 0);
+Catalog* AbstractCatalogManager::FindCatalog(const PathString &path,
+                                             Catalog *root) const
+{
+  if (root == NULL) {
+    assert(catalogs_.size() > 0);
+    root = GetRootCatalog();
+  }
 
   // Start at the root catalog and successive go down the catalog tree
-  Catalog *best_fit = GetRootCatalog();
+  Catalog *best_fit = root;
   Catalog *next_fit = NULL;
   while (best_fit->path() != path) {
     next_fit = best_fit->FindSubtree(path);
@@ -454,12 +909,47 @@ bool AbstractCatalogManager::MountSubtree(const PathString &path,
   bool result = true;
   Catalog *parent = (entry_point == NULL) ?
                     GetRootCatalog() : const_cast<Catalog *>(entry_point);
+
+  Catalog::NestedCatalog nested;
+  if (FindNestedMountpoint(path, parent, &nested)) {
+    if (leaf_catalog == NULL)
+      return true;
+    Catalog *new_nested;
+    LogCvmfs(kLogCatalog, kLogDebug, "load nested catalog at %s",
+             nested.path.c_str());
+    // prevent endless recursion with corrupted catalogs
+    // (due to reloading root)
+    if (nested.hash.IsNull())
+      return false;
+    new_nested = MountCatalog(nested.path, nested.hash, parent);
+    if (!new_nested)
+      return false;
+
+    result = MountSubtree(path, new_nested, &parent);
+  }
+
+  if (leaf_catalog == NULL)
+    return false;
+  *leaf_catalog = parent;
+  return result;
+}
+
+
+/**
+ * Finds the nested catalog of parent whose mount point is a prefix of path.
+ * @return false if path is served by parent itself
+ */
+bool AbstractCatalogManager::FindNestedMountpoint(
+  const PathString &path,
+  const Catalog *parent,
+  Catalog::NestedCatalog *nested)
+{
   assert(path.StartsWith(parent->path()));
 
   // Try to find path as a super string of nested catalog mount points
   PathString path_slash(path);
   path_slash.Append("/", 1);
-  atomic_inc64(&statistics_.num_nested_listing);
+  statistics_.num_nested_listing.Inc();
   const Catalog::NestedCatalogList *nested_catalogs =
     parent->ListNestedCatalogs();
   for (Catalog::NestedCatalogList::const_iterator i = nested_catalogs->begin(),
@@ -469,28 +959,96 @@ bool AbstractCatalogManager::MountSubtree(const PathString &path,
     PathString nested_path_slash(i->path);
     nested_path_slash.Append("/", 1);
     if (path_slash.StartsWith(nested_path_slash)) {
-      if (leaf_catalog == NULL)
-        return true;
-      Catalog *new_nested;
-      LogCvmfs(kLogCatalog, kLogDebug, "load nested catalog at %s",
-               i->path.c_str());
-      // prevent endless recursion with corrupted catalogs
-      // (due to reloading root)
-      if (i->hash.IsNull())
-        return false;
-      new_nested = MountCatalog(i->path, i->hash, parent);
-      if (!new_nested)
-        return false;
-
-      result = MountSubtree(path, new_nested, &parent);
-      break;
+      *nested = *i;
+      return true;
     }
   }
+  return false;
+}
 
-  if (leaf_catalog == NULL)
-    return false;
-  *leaf_catalog = parent;
-  return result;
+
+/**
+ * Like MountSubtree but the nested catalogs are downloaded and verified
+ * without holding the write lock.  The write lock only guards attaching a
+ * loaded catalog.  If another thread is already loading a nested catalog,
+ * waits for it instead of loading it again.  Called without any lock, the
+ * returned catalog remains valid until the caller leaves its snapshot.
+ */
+bool AbstractCatalogManager::LoadSubtree(const PathString &path,
+                                         Catalog **leaf_catalog)
+{
+  while (true) {
+    ReadLock();
+    Catalog *parent = FindCatalog(path);
+    Catalog::NestedCatalog nested;
+    if (!FindNestedMountpoint(path, parent, &nested)) {
+      Unlock();
+      *leaf_catalog = parent;
+      return true;
+    }
+    const PathString parent_path = parent->path();
+    Unlock();
+    LogCvmfs(kLogCatalog, kLogDebug, "load nested catalog at %s",
+             nested.path.c_str());
+    // prevent endless recursion with corrupted catalogs
+    // (due to reloading root)
+    if (nested.hash.IsNull())
+      return false;
+
+    pthread_mutex_lock(lock_loading_);
+    if (loading_.find(nested.path) != loading_.end()) {
+      while (loading_.find(nested.path) != loading_.end())
+        pthread_cond_wait(cond_loading_, lock_loading_);
+      pthread_mutex_unlock(lock_loading_);
+      continue;
+    }
+    loading_.insert(nested.path);
+    pthread_mutex_unlock(lock_loading_);
+
+    bool attached = false;
+    bool retry = false;
+    string catalog_path;
+    const LoadError retval = LoadCatalog(nested.path, nested.hash,
+                                         &catalog_path);
+    if ((retval == kLoadFail) || (retval == kLoadNoSpace)) {
+      LogCvmfs(kLogCatalog, kLogDebug, "failed to load catalog '%s' (%d)",
+               nested.path.c_str(), retval);
+    } else {
+      WriteLock();
+      Catalog *new_nested = NULL;
+      hash::Any hash;
+      if (IsAttached(nested.path, &new_nested)) {
+        attached = true;
+        DiscardCatalog(nested.path, nested.hash);
+      } else if (!IsAttached(parent_path, &parent) ||
+                 !parent->FindNested(nested.path, &hash) ||
+                 (hash != nested.hash))
+      {
+        // Remounted meanwhile
+        retry = true;
+        DiscardCatalog(nested.path, nested.hash);
+      } else {
+        new_nested = CreateCatalog(nested.path, parent);
+        if (AttachCatalog(catalog_path, new_nested)) {
+          attached = true;
+          if (!new_nested->ListNestedCatalogs()->empty())
+            PrefetchNested(new_nested);
+        } else {
+          LogCvmfs(kLogCatalog, kLogDebug, "failed to attach catalog '%s'",
+                   nested.path.c_str());
+          UnloadCatalog(new_nested);
+        }
+      }
+      Unlock();
+    }
+
+    pthread_mutex_lock(lock_loading_);
+    loading_.erase(nested.path);
+    pthread_cond_broadcast(cond_loading_);
+    pthread_mutex_unlock(lock_loading_);
+    if (!attached && !retry)
+      return false;
+  }
 }
 
 
@@ -524,6 +1082,8 @@ Catalog *AbstractCatalogManager::MountCatalog(const PathString &mountpoint,
     return NULL;
   }
 
+  if (!attached_catalog->ListNestedCatalogs()->empty())
+    PrefetchNested(attached_catalog);
   return attached_catalog;
 }
 
@@ -546,29 +1106,54 @@ bool AbstractCatalogManager::AttachCatalog(const string &db_path,
              db_path.c_str());
     return false;
   }
+  new_catalog->statistics_ = &statistics_;
 
-  // Determine the inode offset of this catalog
+  // Determine the inode offset of this catalog.  Unchanged nested catalogs
+  // get their inodes from before the last remount.
   uint64_t inode_chunk_size = new_catalog->max_row_id();
-  InodeRange range = AcquireInodes(inode_chunk_size);
+  bool preserved = false;
+  InodeRange range;
+  if (!new_catalog->IsRoot()) {
+    map<PathString, PreservedCatalog>::const_iterator iter_preserved =
+      preserved_catalogs_.find(new_catalog->path());
+    hash::Any hash;
+    if ((iter_preserved != preserved_catalogs_.end()) &&
+        new_catalog->parent()->FindNested(new_catalog->path(), &hash) &&
+        (hash == iter_preserved->second.hash) &&
+        (iter_preserved->second.inode_range.size == inode_chunk_size))
+    {
+      LogCvmfs(kLogCatalog, kLogDebug, "reusing inodes of %s",
+               new_catalog->path().c_str());
+      range = iter_preserved->second.inode_range;
+      preserved = true;
+    }
+  }
+  if (!preserved)
+    range = AcquireInodes(inode_chunk_size);
   new_catalog->set_inode_range(range);
 
   // Add catalog to the manager
   if (!new_catalog->IsInitialized()) {
     LogCvmfs(kLogCatalog, kLogDebug,
              "catalog initialization failed (obscure data)");
-    inode_gauge_ -= inode_chunk_size;
+    if (!preserved)
+      inode_gauge_ -= inode_chunk_size;
     return false;
   }
 
   catalogs_.push_back(new_catalog);
+  inode_index_.insert(upper_bound(inode_index_.begin(), inode_index_.end(),
+                                  new_catalog, LessInodeOffset),
+                      new_catalog);
   ActivateCatalog(new_catalog);
+  Publish();
   return true;
 }
 
 
 /**
  * Removes a catalog from this CatalogManager, the catalog pointer is
- * freed if the call succeeds.
+ * freed once no lookup uses it anymore.
  * This method can create dangling children if a catalog in the middle of
  * a tree is removed.
  * @param catalog the catalog to detach
@@ -582,12 +1167,21 @@ void AbstractCatalogManager::DetachCatalog(Catalog *catalog) {
   UnloadCatalog(catalog);
 
   // Delete catalog from internal lists
+  CatalogList::iterator j = lower_bound(inode_index_.begin(),
+                                        inode_index_.end(), catalog,
+                                        LessInodeOffset);
+  while ((j != inode_index_.end()) && (*j != catalog))
+    ++j;
+  assert(j != inode_index_.end());
+  inode_index_.erase(j);
+
   CatalogList::iterator i;
   CatalogList::const_iterator iend;
   for (i = catalogs_.begin(), iend = catalogs_.end(); i != iend; ++i) {
     if (*i == catalog) {
       catalogs_.erase(i);
-      delete catalog;
+      detached_.push_back(catalog);
+      Publish();
       return;
     }
   }
@@ -630,7 +1224,12 @@ string AbstractCatalogManager::PrintHierarchyRecursively(const Catalog *catalog,
     output += "    ";
 
   output += "-> " +
-    string(catalog->path().GetChars(), catalog->path().GetLength()) + "\n";
+    string(catalog->path().GetChars(), catalog->path().GetLength());
+  if (sqlite_cache_budget_ > 0) {
+    output += " (cache: " + StringifyInt(catalog->cache_pages()) +
+      " pages, queries: " + StringifyInt(catalog->num_queries()) + ")";
+  }
+  output += "\n";
 
   CatalogList children = catalog->GetChildren();
   CatalogList::const_iterator i,iend;
@@ -644,13 +1243,181 @@ string AbstractCatalogManager::PrintHierarchyRecursively(const Catalog *catalog,
 }
 
 
+/**
+ * Marks the calling thread as reader and returns the current snapshot.  The
+ * snapshot and its catalogs remain valid until LeaveSnapshot().  Calls can
+ * be nested.
+ */
+const AbstractCatalogManager::Snapshot *AbstractCatalogManager::EnterSnapshot()
+{
+  ReaderSlot *slot =
+    static_cast<ReaderSlot *>(pthread_getspecific(pkey_reader_));
+  if (slot == NULL) {
+    pthread_mutex_lock(lock_reclaim_);
+    for (slot = reader_slots_; slot != NULL; slot = slot->next) {
+      if (atomic_cas32(&slot->in_use, 0, 1))
+        break;
+    }
+    if (slot == NULL) {
+      slot = new ReaderSlot();
+      atomic_inc32(&slot->in_use);
+      slot->next = reader_slots_;
+      reader_slots_ = slot;
+    }
+    pthread_mutex_unlock(lock_reclaim_);
+    pthread_setspecific(pkey_reader_, slot);
+  }
+
+  if (slot->depth++ == 0) {
+    // Plain read of the global epoch, the write to the thread's own slot is
+    // the memory barrier before the snapshot pointer is read
+    const int64_t epoch = *const_cast<volatile atomic_int64 *>(&epoch_);
+    atomic_write64(&slot->epoch, epoch);
+  }
+  return snapshot_;
+}
+
+
+void AbstractCatalogManager::LeaveSnapshot() {
+  ReaderSlot *slot =
+    static_cast<ReaderSlot *>(pthread_getspecific(pkey_reader_));
+  assert(slot && (slot->depth > 0));
+  if (--slot->depth == 0) {
+    atomic_write64(&slot->epoch, 0);
+    if (has_retired_)
+      Reclaim();
+  }
+}
+
+
+/**
+ * Called on thread exit, the slot can be reused by another thread.
+ */
+void AbstractCatalogManager::ReleaseReaderSlot(void *data) {
+  ReaderSlot *slot = static_cast<ReaderSlot *>(data);
+  slot->depth = 0;
+  atomic_write64(&slot->epoch, 0);
+  atomic_write32(&slot->in_use, 0);
+}
+
+
+/**
+ * Makes the current catalog list visible to lookups and retires the previous
+ * snapshot together with the catalogs detached since.  Caller holds the write
+ * lock.
+ */
+void AbstractCatalogManager::Publish() {
+  if (defer_publish_)
+    return;
+
+  Snapshot *new_snapshot = new Snapshot();
+  new_snapshot->catalogs = catalogs_;
+  new_snapshot->inode_index = inode_index_;
+  Snapshot *old_snapshot = snapshot_;
+  snapshot_ = new_snapshot;
+
+  pthread_mutex_lock(lock_reclaim_);
+  // Readers entering from now on see the new snapshot
+  RetiredItem item;
+  item.epoch = atomic_xadd64(&epoch_, 1);
+  item.snapshot = old_snapshot;
+  retired_.push_back(item);
+  item.snapshot = NULL;
+  for (unsigned i = 0; i < detached_.size(); ++i) {
+    item.catalog = detached_[i];
+    retired_.push_back(item);
+  }
+  detached_.clear();
+  has_retired_ = true;
+  pthread_mutex_unlock(lock_reclaim_);
+
+  Reclaim();
+}
+
+
+/**
+ * Deletes the retired snapshots and catalogs that were retired before the
+ * oldest running lookup started.  Skipped if another thread reclaims.
+ */
+void AbstractCatalogManager::Reclaim() {
+  if (pthread_mutex_trylock(lock_reclaim_) != 0)
+    return;
+
+  int64_t min_epoch = atomic_read64(&epoch_);
+  for (ReaderSlot *slot = reader_slots_; slot != NULL; slot = slot->next) {
+    const int64_t epoch = atomic_read64(&slot->epoch);
+    if ((epoch != 0) && (epoch < min_epoch))
+      min_epoch = epoch;
+  }
+
+  vector<RetiredItem> remaining;
+  for (unsigned i = 0; i < retired_.size(); ++i) {
+    if (retired_[i].epoch < min_epoch) {
+      delete retired_[i].snapshot;
+      delete retired_[i].catalog;
+    } else {
+      remaining.push_back(retired_[i]);
+    }
+  }
+  retired_.swap(remaining);
+  has_retired_ = !retired_.empty();
+  pthread_mutex_unlock(lock_reclaim_);
+}
+
+
 void AbstractCatalogManager::EnforceSqliteMemLimit() {
   char *mem_enforced =
     static_cast<char *>(pthread_getspecific(pkey_sqlitemem_));
   if (mem_enforced == NULL) {
-    sqlite3_soft_heap_limit(kSqliteMemPerThread);
+    sqlite3_soft_heap_limit(Database::mmap_enabled() ?
+                            kSqliteMemPerThreadMmap : kSqliteMemPerThread);
     pthread_setspecific(pkey_sqlitemem_, (char *)(1));
   }
+
+  if ((sqlite_cache_budget_ > 0) &&
+      ((atomic_xadd64(&num_governor_ticks_, 1) % kSqliteGovernorInterval) == 0))
+  {
+    RebalanceSqliteCache();
+  }
+}
+
+
+/**
+ * Memory governor: the query rate of a catalog is the number of its queries
+ * since the last round plus half of its previous rate, so that catalogs
+ * that turn cold shrink over a few rounds.  The budget beyond the minimum
+ * per catalog is handed out in proportion to the rates.
+ */
+void AbstractCatalogManager::RebalanceSqliteCache() {
+  if (pthread_mutex_trylock(lock_governor_) != 0)
+    return;
+  const Snapshot *snapshot = EnterSnapshot();
+  const CatalogList &catalogs = snapshot->catalogs;
+
+  int64_t total_rate = 0;
+  for (unsigned i = 0; i < catalogs.size(); ++i) {
+    Catalog *catalog = catalogs[i];
+    const int64_t num_queries = catalog->num_queries();
+    catalog->governor_rate_ = catalog->governor_rate_ / 2 +
+                              (num_queries - catalog->governor_queries_);
+    catalog->governor_queries_ = num_queries;
+    total_rate += catalog->governor_rate_;
+  }
+
+  const int64_t num_catalogs = catalogs.size();
+  int64_t spare = static_cast<int64_t>(sqlite_cache_budget_) -
+                  num_catalogs * kSqliteMinCachePages;
+  if (spare < 0)
+    spare = 0;
+  for (unsigned i = 0; i < catalogs.size(); ++i) {
+    Catalog *catalog = catalogs[i];
+    const int64_t share = (total_rate > 0) ?
+      (spare * catalog->governor_rate_) / total_rate : spare / num_catalogs;
+    catalog->set_cache_pages(kSqliteMinCachePages + share);
+  }
+
+  LeaveSnapshot();
+  pthread_mutex_unlock(lock_governor_);
 }
 
 }
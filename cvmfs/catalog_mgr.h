@@ -10,16 +10,30 @@
 
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
 
 #include "catalog.h"
 #include "dirent.h"
 #include "hash.h"
 #include "atomic.h"
+#include "sharded_counter.h"
 #include "util.h"
 
 namespace catalog {
 
 const unsigned kSqliteMemPerThread = 1*1024*1024;
+/**
+ * With memory-mapped catalogs, evicted pages are re-read by a memcpy from the
+ * mapping, so SQlite can live with a smaller heap.
+ */
+const unsigned kSqliteMemPerThreadMmap = 256*1024;
+/**
+ * The memory governor redistributes the page cache budget every so many
+ * lookups.  Every catalog keeps at least kSqliteMinCachePages.
+ */
+const unsigned kSqliteGovernorInterval = 1024;
+const unsigned kSqliteMinCachePages = 16;
 
 /**
  * Lookup a directory entry including its parent entry or not.
@@ -42,33 +56,74 @@ enum LoadError {
 
 
 struct Statistics {
-  atomic_int64 num_lookup_inode;
-  atomic_int64 num_lookup_path;
-  atomic_int64 num_lookup_path_negative;
-  atomic_int64 num_listing;
-  atomic_int64 num_nested_listing;
-
-  Statistics() {
-    atomic_init64(&num_lookup_inode);
-    atomic_init64(&num_lookup_path);
-    atomic_init64(&num_lookup_path_negative);
-    atomic_init64(&num_listing);
-    atomic_init64(&num_nested_listing);
-  }
+  ShardedCounter num_lookup_inode;
+  ShardedCounter num_lookup_path;
+  ShardedCounter num_lookup_path_negative;
+  ShardedCounter num_listing;
+  ShardedCounter num_nested_listing;
+  ShardedCounter num_bloom_negative;  /**< misses answered by bloom filters */
+  ShardedCounter num_bloom_false_positive;
 
   std::string Print() {
+    const int64_t bloom_negative = num_bloom_negative.Get();
+    const int64_t bloom_false_positive = num_bloom_false_positive.Get();
+    // Share of the misses that the filters did not recognize
+    const int64_t bloom_misses = bloom_negative + bloom_false_positive;
+    const int64_t bloom_fp_permille = (bloom_misses == 0) ? 0 :
+      (bloom_false_positive * 1000) / bloom_misses;
     return
-      "lookup(inode): " + StringifyInt(atomic_read64(&num_lookup_inode)) +
+      "lookup(inode): " + StringifyInt(num_lookup_inode.Get()) +
       "    " +
-      "lookup(path-all): " + StringifyInt(atomic_read64(&num_lookup_path)) +
+      "lookup(path-all): " + StringifyInt(num_lookup_path.Get()) +
       "    " +
       "lookup(path-negative): " +
-        StringifyInt(atomic_read64(&num_lookup_path_negative)) +
+        StringifyInt(num_lookup_path_negative.Get()) +
       "    " +
-      "listing: " + StringifyInt(atomic_read64(&num_listing)) +
+      "listing: " + StringifyInt(num_listing.Get()) +
       "    " +
       "listing nested catalogs: " +
-        StringifyInt(atomic_read64(&num_nested_listing)) + "\n";
+        StringifyInt(num_nested_listing.Get()) + "\n" +
+      "bloom filter negatives: " + StringifyInt(bloom_negative) +
+      "    " +
+      "bloom filter false positives: " + StringifyInt(bloom_false_positive) +
+      " (" + StringifyInt(bloom_fp_permille) + " per mille)\n";
+  }
+};
+
+/**
+ * Remounts prefetch the changed nested catalogs of the new revision before
+ * the tree is switched.  The switch time is spent under the write lock.
+ */
+struct RemountStatistics {
+  RemountStatistics() {
+    atomic_init64(&num_remounts);
+    atomic_init64(&num_prefetched);
+    atomic_init64(&num_prefetch_failed);
+    atomic_init64(&num_reattached);
+    atomic_init64(&prefetch_ms);
+    atomic_init64(&switch_ms);
+    atomic_init64(&max_switch_ms);
+  }
+  atomic_int64 num_remounts;
+  atomic_int64 num_prefetched;  /**< changed nested catalogs */
+  atomic_int64 num_prefetch_failed;
+  atomic_int64 num_reattached;  /**< attached before the switch */
+  atomic_int64 prefetch_ms;  /**< of the last remount */
+  atomic_int64 switch_ms;  /**< of the last remount */
+  atomic_int64 max_switch_ms;
+
+  std::string Print() {
+    return
+      "remounts: " + StringifyInt(atomic_read64(&num_remounts)) + "  " +
+      "prefetched catalogs: " + StringifyInt(atomic_read64(&num_prefetched)) +
+      "  " +
+      "failed: " + StringifyInt(atomic_read64(&num_prefetch_failed)) + "  " +
+      "attached before switch: " +
+        StringifyInt(atomic_read64(&num_reattached)) + "\n" +
+      "  last prefetch: " + StringifyInt(atomic_read64(&prefetch_ms)) +
+      " ms  last switch: " + StringifyInt(atomic_read64(&switch_ms)) +
+      " ms  max switch: " + StringifyInt(atomic_read64(&max_switch_ms)) +
+      " ms\n";
   }
 };
 
@@ -93,12 +148,15 @@ class AbstractCatalogManager {
 
   virtual bool Init();
   LoadError Remount(const bool dry_run);
+  LoadError PrepareRemount();
   void DetachAll() { DetachSubtree(GetRootCatalog()); }
 
   bool LookupInode(const inode_t inode, const LookupOptions options,
                    DirectoryEntry *entry);
   bool LookupPath(const PathString &path, const LookupOptions options,
                   DirectoryEntry *entry);
+  bool LookupPath(const PathString &path, const hash::Md5 &md5path,
+                  const LookupOptions options, DirectoryEntry *entry);
   bool LookupPath(const std::string &path, const LookupOptions options,
                   DirectoryEntry *entry)
   {
@@ -113,12 +171,24 @@ class AbstractCatalogManager {
     return Listing(p, listing);
   }
   bool ListingStat(const PathString &path, StatEntryList *listing);
+  bool ListFileChunks(const PathString &path, FileChunkList *chunks);
+  bool LookupBundle(const PathString &path, const hash::Any &content_hash,
+                    hash::Any *bundle_hash, BundleMemberList *members);
 
   Statistics statistics() const { return statistics_; }
+  RemountStatistics remount_statistics() const { return remount_statistics_; }
   uint64_t GetRevision() const;
   uint64_t GetTTL() const;
   int GetNumCatalogs() const;
   std::string PrintHierarchy() const;
+  /**
+   * Spreads a total of pages SQlite page cache pages across the open
+   * catalogs, in proportion to their recent query rate.  0 leaves every
+   * connection with the SQlite default.
+   */
+  void SetSqliteCacheBudget(const unsigned pages) {
+    sqlite_cache_budget_ = pages;
+  }
 
   /**
    * Get the inode number of the root DirectoryEntry
@@ -135,6 +205,20 @@ class AbstractCatalogManager {
   inline inode_t MangleInode(const inode_t inode) const {
     return (inode <= kInodeOffset) ? GetRootInode() : inode;
   }
+  bool IsPreservedInode(const inode_t inode) const;
+  bool WillPreserveInode(const inode_t inode) const;
+
+  /**
+   * A catalog with its content hash and inode range.  The root catalog has
+   * the empty path and no hash.
+   */
+  struct PreservedCatalog {
+    hash::Any hash;
+    InodeRange inode_range;
+  };
+  void GetInodeLayout(std::map<PathString, PreservedCatalog> *layout) const;
+  void PreserveInodes(const std::map<PathString, PreservedCatalog> &layout);
+  bool MountNested(const PathString &path);
 
  protected:
   /**
@@ -145,7 +229,28 @@ class AbstractCatalogManager {
                                 const hash::Any &hash,
                                 std::string *catalog_path) = 0;
   virtual void UnloadCatalog(const Catalog *catalog) { };
+  /**
+   * Releases a catalog that was loaded but not attached because another
+   * thread got there first.  Called under the write lock.
+   */
+  virtual void DiscardCatalog(const PathString &mountpoint,
+                              const hash::Any &hash) { };
   virtual void ActivateCatalog(const Catalog *catalog) { };
+  /**
+   * Triggered when a catalog with nested catalogs is attached.  Derived
+   * classes can start loading the nested catalogs in the background.
+   */
+  virtual void PrefetchNested(const Catalog *catalog) { };
+  /**
+   * Puts a nested catalog into the local storage without attaching it, for
+   * the remount.  Sets catalog_path to the file.  Managers without this
+   * don't prefetch catalogs on remount.
+   */
+  virtual bool FetchCatalog(const Catalog::NestedCatalog &nested,
+                            std::string *catalog_path)
+  {
+    return false;
+  }
 
   /**
    * Create a new Catalog object.
@@ -162,6 +267,7 @@ class AbstractCatalogManager {
                         Catalog *parent_catalog);
   bool MountSubtree(const PathString &path, const Catalog *entry_point,
                     Catalog **leaf_catalog);
+  bool LoadSubtree(const PathString &path, Catalog **leaf_catalog);
 
   bool AttachCatalog(const std::string &db_path, Catalog *new_catalog);
   void DetachCatalog(Catalog *catalog);
@@ -170,7 +276,7 @@ class AbstractCatalogManager {
                   Catalog **attached_catalog) const;
 
   inline Catalog* GetRootCatalog() const { return catalogs_.front(); }
-  Catalog *FindCatalog(const PathString &path) const;
+  Catalog *FindCatalog(const PathString &path, Catalog *root = NULL) const;
 
   inline void ReadLock() const {
     int retval = pthread_rwlock_rdlock(rwlock_);
@@ -184,22 +290,111 @@ class AbstractCatalogManager {
     int retval = pthread_rwlock_unlock(rwlock_);
     assert(retval == 0);
   }
-  // inline void DowngradeLock() const {  } TODO
   virtual void EnforceSqliteMemLimit();
 
  private:
   const static inode_t kInodeOffset = 255;
+  /**
+   * The catalogs as seen by lookups.  Lookups don't take rwlock_, they work
+   * on the published snapshot.  Writers change the catalog tree under the
+   * write lock and publish a new snapshot.  Replaced snapshots and detached
+   * catalogs are retired and deleted only once no reader can still use them
+   * (epoch based reclamation).
+   */
+  struct Snapshot {
+    CatalogList catalogs;  /**< the root catalog comes first */
+    CatalogList inode_index;
+  };
+  /**
+   * Records the epoch in which a thread entered a lookup.
+   */
+  struct ReaderSlot {
+    ReaderSlot() : depth(0), next(NULL) {
+      atomic_init64(&epoch);
+      atomic_init32(&in_use);
+    }
+    atomic_int64 epoch;    /**< 0 outside of lookups */
+    atomic_int32 in_use;   /**< owned by a running thread */
+    unsigned depth;        /**< only touched by the owning thread */
+    ReaderSlot *next;
+  };
+  struct RetiredItem {
+    RetiredItem() : epoch(0), snapshot(NULL), catalog(NULL) { }
+    int64_t epoch;
+    Snapshot *snapshot;
+    Catalog *catalog;
+  };
+
+  Snapshot * volatile snapshot_;
+  atomic_int64 epoch_;
+  ReaderSlot *reader_slots_;
+  pthread_key_t pkey_reader_;
+  std::vector<RetiredItem> retired_;
+  volatile bool has_retired_;
+  pthread_mutex_t *lock_reclaim_;  /**< protects retired_ and reader_slots_ */
+  CatalogList detached_;  /**< retired with the next snapshot */
+  bool defer_publish_;    /**< set while the tree is rebuilt in Remount */
+
+  const Snapshot *EnterSnapshot();
+  void LeaveSnapshot();
+  static void ReleaseReaderSlot(void *data);
+  void Publish();
+  void Reclaim();
+
+  /**
+   * Mountpoints of nested catalogs that are being loaded without the write
+   * lock.  Lookups of the same subtree wait for the running load.
+   */
+  std::set<PathString> loading_;
+  pthread_mutex_t *lock_loading_;
+  pthread_cond_t *cond_loading_;
+
+  bool FindNestedMountpoint(const PathString &path, const Catalog *parent,
+                            Catalog::NestedCatalog *nested);
   /**
    * This list is only needed to find a catalog given an inode.
    * This might possibly be done by walking the catalog tree, similar to
    * finding a catalog given the path.
    */
   CatalogList catalogs_;
+  /**
+   * The catalogs of catalogs_ sorted by the offset of their inode ranges.
+   * Inode ranges don't overlap, so the catalog of an inode is found by
+   * binary search.
+   */
+  CatalogList inode_index_;
   uint64_t inode_gauge_;  /**< highest issued inode */
+  /**
+   * Nested catalogs that were attached before the last remount, together with
+   * their inode ranges.  If they are attached again with the same content
+   * hash, they reuse their inodes.
+   */
+  std::map<PathString, PreservedCatalog> preserved_catalogs_;
   pthread_rwlock_t *rwlock_;
   Statistics statistics_;
+  RemountStatistics remount_statistics_;
+
+  /**
+   * Result of PrepareRemount() for the following Remount(): the new root
+   * catalog, the content hashes of the nested catalogs that are ready in
+   * the local storage and the attached nested catalogs that can keep their
+   * inodes.
+   */
+  bool remount_prepared_;
+  LoadError remount_load_error_;
+  std::string remount_root_path_;
+  std::set<hash::Any> remount_ready_;
+  std::map<PathString, PreservedCatalog> remount_preserved_;
+  void PrefetchRevision(const std::string &root_path,
+                        std::set<hash::Any> *ready,
+                        std::map<PathString, PreservedCatalog> *preserved);
   pthread_key_t pkey_sqlitemem_;
 
+  unsigned sqlite_cache_budget_;  /**< in pages, 0 means off */
+  atomic_int64 num_governor_ticks_;
+  pthread_mutex_t *lock_governor_;
+  void RebalanceSqliteCache();
+
   std::string PrintHierarchyRecursively(const Catalog *catalog,
                                         const int level) const;
 
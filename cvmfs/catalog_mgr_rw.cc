@@ -13,9 +13,13 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <algorithm>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "compression.h"
+#include "catalog_delta.h"
 #include "catalog_rw.h"
 #include "util.h"
 #include "logging.h"
@@ -41,6 +45,8 @@ WritableCatalogManager::WritableCatalogManager(const hash::Any &base_hash,
   stratum0_ = stratum0;
   dir_temp_ = dir_temp;
   spooler_ = spooler;
+  num_snapshot_workers_ = 1;
+  emit_deltas_ = false;
   Init();
 }
 
@@ -74,6 +80,7 @@ LoadError WritableCatalogManager::LoadCatalog(const PathString &mountpoint,
                                   catalog_path);
   download::JobInfo download_catalog(&url, true, false, fcatalog,
                                      &effective_hash);
+  download_catalog.priority = download::kPriorityMetadata;
 
   download::Failures retval = download::Fetch(&download_catalog);
   fclose(fcatalog);
@@ -231,6 +238,14 @@ void WritableCatalogManager::RemoveDirectory(const std::string &path) {
   const string directory_path = MakeRelativePath(path);
 	const string parent_path = GetParentPath(directory_path);
 
+  // Automatic nested catalogs have no marker file whose removal would merge
+  // them, the emptied catalog goes together with its mountpoint
+  if (IsAutoCatalogMountpoint(directory_path)) {
+    LogCvmfs(kLogCatalog, kLogVerboseMsg, "removing automatic catalog %s",
+             directory_path.c_str());
+    RemoveNestedCatalog(path);
+  }
+
   SyncLock();
   WritableCatalog *catalog;
   if (!FindCatalog(parent_path, &catalog)) {
@@ -344,6 +359,41 @@ void WritableCatalogManager::AddFile(const DirectoryEntry &entry,
 }
 
 
+/**
+ * Add a file that is stored in pieces to the catalogs.
+ * @param entry the DirectoryEntry of the file, checksum of the whole file if it
+ *        is also stored as a whole, null otherwise
+ * @param parent_directory the path of the directory containing the file
+ * @param file_chunks the pieces of the file
+ */
+void WritableCatalogManager::AddChunkedFile(const DirectoryEntry &entry,
+                                            const std::string &parent_directory,
+                                            const FileChunkList &file_chunks)
+{
+  assert(entry.IsRegular() && !file_chunks.empty());
+  const string parent_path = MakeRelativePath(parent_directory);
+  string file_path = parent_path + "/";
+  file_path.append(entry.name().GetChars(), entry.name().GetLength());
+
+  SyncLock();
+  WritableCatalog *catalog;
+  if (!FindCatalog(parent_path, &catalog)) {
+    LogCvmfs(kLogCatalog, kLogStderr, "catalog for file '%s' cannot be found",
+             file_path.c_str());
+    assert(false);
+  }
+
+  DirectoryEntry chunked_entry(entry);
+  chunked_entry.set_is_chunked_file(true);
+  catalog->AddEntry(chunked_entry, file_path, parent_path);
+  for (unsigned i = 0; i < file_chunks.size(); ++i) {
+    assert(!file_chunks[i].content_hash.IsNull());
+    catalog->AddFileChunk(file_path, file_chunks[i]);
+  }
+  SyncUnlock();
+}
+
+
 /**
  * Add a hardlink group to the catalogs.
  * @param entries a list of DirectoryEntries describing the new files
@@ -354,12 +404,26 @@ void WritableCatalogManager::AddFile(const DirectoryEntry &entry,
 void WritableCatalogManager::AddHardlinkGroup(DirectoryEntryList &entries,
                                           const std::string &parent_directory)
 {
-  assert(entries.size() >= 1);
-  if (entries.size() == 1)
-    return AddFile(entries[0], parent_directory);
+  vector<DirectoryEntryList> groups(1);
+  groups[0].swap(entries);
+  AddHardlinkGroups(&groups, parent_directory);
+  entries.swap(groups[0]);
+}
 
-  LogCvmfs(kLogCatalog, kLogVerboseMsg, "adding hardlink group %s/%s",
-           parent_directory.c_str(), entries[0].name().c_str());
+
+/**
+ * Adds all hardlink groups of a directory with a single catalog lookup.
+ * Group ids are issued by the catalog without querying its database again.
+ * @param groups lists of DirectoryEntries, one list per hardlink group
+ * @param parent_directory the absolute path of the directory containing the
+ *                         files to be created
+ */
+void WritableCatalogManager::AddHardlinkGroups(
+  vector<DirectoryEntryList> *groups,
+  const std::string &parent_directory)
+{
+  if (groups->empty())
+    return;
 
 	// Hardlink groups have to reside in the same directory.
 	// Therefore we only have one parent directory here
@@ -374,22 +438,38 @@ void WritableCatalogManager::AddHardlinkGroup(DirectoryEntryList &entries,
     assert(false);
   }
 
-	// Get a valid hardlink group id for the catalog the group will end up in
-  // TODO: Compaction
-	uint32_t new_group_id = catalog->GetMaxLinkId() + 1;
-  LogCvmfs(kLogCatalog, kLogVerboseMsg, "hardlink group id %u issued",
-           new_group_id);
-	assert(new_group_id > 0);
+  for (unsigned g = 0; g < groups->size(); ++g) {
+    DirectoryEntryList &entries = (*groups)[g];
+    assert(entries.size() >= 1);
+    if (entries.size() == 1) {
+      string file_path = parent_path + "/";
+      file_path.append(entries[0].name().GetChars(),
+                       entries[0].name().GetLength());
+      assert(!entries[0].IsRegular() || !entries[0].checksum().IsNull());
+      catalog->AddEntry(entries[0], file_path, parent_path);
+      continue;
+    }
 
-	// Add the file entries to the catalog
-	for (DirectoryEntryList::iterator i = entries.begin(), iEnd = entries.end();
-       i != iEnd; ++i)
-  {
-	  string file_path = parent_path + "/";
-    file_path.append(i->name().GetChars(), i->name().GetLength());
-    i->set_hardlinks(new_group_id, entries.size());
-	  catalog->AddEntry(*i, file_path, parent_path);
-	}
+    LogCvmfs(kLogCatalog, kLogVerboseMsg, "adding hardlink group %s/%s",
+             parent_directory.c_str(), entries[0].name().c_str());
+
+    // Get a valid hardlink group id for the catalog the group will end up in
+    // TODO: Compaction
+    uint32_t new_group_id = catalog->IssueLinkId();
+    LogCvmfs(kLogCatalog, kLogVerboseMsg, "hardlink group id %u issued",
+             new_group_id);
+    assert(new_group_id > 0);
+
+    // Add the file entries to the catalog
+    for (DirectoryEntryList::iterator i = entries.begin(),
+         iEnd = entries.end(); i != iEnd; ++i)
+    {
+      string file_path = parent_path + "/";
+      file_path.append(i->name().GetChars(), i->name().GetLength());
+      i->set_hardlinks(new_group_id, entries.size());
+      catalog->AddEntry(*i, file_path, parent_path);
+    }
+  }
   SyncUnlock();
 }
 
@@ -475,6 +555,19 @@ void WritableCatalogManager::CreateNestedCatalog(const std::string &mountpoint)
     assert(false);
   }
 
+  // A .cvmfscatalog marker for an automatically created nested catalog makes
+  // it a regular one
+  if (!old_catalog->IsRoot() &&
+      (old_catalog->path().ToString() == nested_root_path) &&
+      old_catalog->IsAutoCatalog())
+  {
+    LogCvmfs(kLogCatalog, kLogVerboseMsg, "keeping automatic catalog %s",
+             nested_root_path.c_str());
+    old_catalog->SetAutoCatalog(false);
+    SyncUnlock();
+    return;
+  }
+
   // Get the DirectoryEntry for the given path, this will serve as root
   // entry for the nested catalog we are about to create
   DirectoryEntry new_root_entry;
@@ -577,8 +670,423 @@ void WritableCatalogManager::RemoveNestedCatalog(const string &mountpoint) {
 }
 
 
+/**
+ * A directory of a catalog to be split.  The weight is the number of entries
+ * of the subtree that remain in the catalog, nested catalogs count as one.
+ */
+struct WritableCatalogManager::BalanceNode {
+  BalanceNode() : weight(1), split(false) { }
+  ~BalanceNode() {
+    for (unsigned i = 0; i < children.size(); ++i)
+      delete children[i];
+  }
+  string path;
+  uint64_t weight;
+  bool split;
+  vector<BalanceNode *> children;
+};
+
+
+bool WritableCatalogManager::IsAutoCatalogMountpoint(const string &path) {
+  WritableCatalog *catalog;
+  SyncLock();
+  const bool result = FindCatalog(path, &catalog) && !catalog->IsRoot() &&
+                      (catalog->path().ToString() == path) &&
+                      catalog->IsAutoCatalog();
+  SyncUnlock();
+  return result;
+}
+
+
+void WritableCatalogManager::BuildBalanceTree(const WritableCatalog *catalog,
+                                              BalanceNode *node)
+{
+  DirectoryEntryList listing;
+  bool retval = catalog->ListingPath(PathString(node->path.data(),
+                                                node->path.length()),
+                                     &listing);
+  assert(retval);
+  for (DirectoryEntryList::const_iterator i = listing.begin(),
+       iEnd = listing.end(); i != iEnd; ++i)
+  {
+    if (!i->IsDirectory() || i->IsNestedCatalogMountpoint()) {
+      node->weight++;
+      continue;
+    }
+    BalanceNode *child = new BalanceNode();
+    child->path = node->path + "/" + i->name().ToString();
+    BuildBalanceTree(catalog, child);
+    node->weight += child->weight;
+    node->children.push_back(child);
+  }
+}
+
+
+/**
+ * Bottom-up, every directory heavier than max_weight gives away its heaviest
+ * subdirectories as nested catalogs until it is light enough.  Subdirectories
+ * lighter than min_weight are not worth a catalog of their own.
+ */
+void WritableCatalogManager::SplitBalanceTree(BalanceNode *node,
+                                              const uint64_t max_weight,
+                                              const uint64_t min_weight,
+                                              vector<string> *mountpoints)
+{
+  for (unsigned i = 0; i < node->children.size(); ++i) {
+    const uint64_t weight = node->children[i]->weight;
+    SplitBalanceTree(node->children[i], max_weight, min_weight, mountpoints);
+    node->weight -= weight - node->children[i]->weight;
+  }
+
+  while (node->weight > max_weight) {
+    BalanceNode *heaviest = NULL;
+    for (unsigned i = 0; i < node->children.size(); ++i) {
+      BalanceNode *child = node->children[i];
+      if (!child->split && (child->weight >= min_weight) &&
+          ((heaviest == NULL) || (child->weight > heaviest->weight)))
+      {
+        heaviest = child;
+      }
+    }
+    if (heaviest == NULL)
+      break;
+    heaviest->split = true;
+    mountpoints->push_back(heaviest->path);
+    node->weight -= heaviest->weight - 1;
+  }
+}
+
+
+/**
+ * Publish-time partitioning policy for the modified catalogs.  Automatic
+ * nested catalogs with less than min_entries entries are merged into their
+ * parents.  Catalogs with more than max_entries entries or whose database is
+ * larger than max_bytes are split into automatic nested catalogs.  Zero
+ * disables a limit.  The byte limit is turned into an entry limit by the
+ * average size of an entry in the catalog.
+ */
+void WritableCatalogManager::BalanceCatalogs(const uint64_t max_entries,
+                                             const uint64_t min_entries,
+                                             const uint64_t max_bytes)
+{
+  // Children come before their parents
+  WritableCatalogList catalogs;
+  GetModifiedCatalogs(&catalogs);
+  for (WritableCatalogList::const_iterator i = catalogs.begin(),
+       iEnd = catalogs.end(); i != iEnd; ++i)
+  {
+    WritableCatalog *catalog = *i;
+    if (catalog->IsRoot() || !catalog->IsAutoCatalog())
+      continue;
+    const uint64_t num_entries = catalog->GetNumEntries();
+    if (num_entries >= min_entries)
+      continue;
+    const string mountpoint = catalog->path().ToString();
+    LogCvmfs(kLogCatalog, kLogStdout, "Merging automatic catalog %s into its "
+             "parent (%"PRIu64" entries, minimum %"PRIu64")",
+             mountpoint.c_str(), num_entries, min_entries);
+    RemoveNestedCatalog(mountpoint.substr(1));
+  }
+
+  catalogs.clear();
+  GetModifiedCatalogs(&catalogs);
+  for (WritableCatalogList::const_iterator i = catalogs.begin(),
+       iEnd = catalogs.end(); i != iEnd; ++i)
+  {
+    WritableCatalog *catalog = *i;
+    const uint64_t num_entries = catalog->GetNumEntries();
+    const uint64_t size = catalog->GetDatabaseSize();
+    uint64_t max_weight = (max_entries > 0) ? max_entries : uint64_t(-1);
+    string reason = "entries";
+    if ((max_bytes > 0) && (size > max_bytes)) {
+      const uint64_t max_weight_bytes = static_cast<uint64_t>(
+        static_cast<double>(max_bytes) / size * num_entries);
+      if (max_weight_bytes < max_weight) {
+        max_weight = max_weight_bytes;
+        reason = "bytes";
+      }
+    }
+    if (num_entries <= max_weight)
+      continue;
+
+    BalanceNode root;
+    root.path = catalog->path().ToString();
+    BuildBalanceTree(catalog, &root);
+    vector<string> mountpoints;
+    SplitBalanceTree(&root, max_weight, min_entries, &mountpoints);
+    LogCvmfs(kLogCatalog, kLogStdout, "Splitting catalog %s (%"PRIu64
+             " entries, %"PRIu64" bytes, too many %s) into %u automatic "
+             "nested catalogs", root.path.c_str(), num_entries, size,
+             reason.c_str(), unsigned(mountpoints.size()));
+    if (root.weight > max_weight) {
+      LogCvmfs(kLogCatalog, kLogStdout, "Catalog %s keeps %"PRIu64" entries, "
+               "no subdirectories with at least %"PRIu64" entries left",
+               root.path.c_str(), root.weight, min_entries);
+    }
+
+    // Parents before children, then nothing needs to move between the new
+    // catalogs
+    sort(mountpoints.begin(), mountpoints.end());
+    for (unsigned j = 0; j < mountpoints.size(); ++j) {
+      CreateNestedCatalog(mountpoints[j].substr(1));
+      WritableCatalog *nested;
+      SyncLock();
+      bool retval = FindCatalog(mountpoints[j], &nested);
+      assert(retval && (nested->path().ToString() == mountpoints[j]));
+      nested->SetAutoCatalog(true);
+      SyncUnlock();
+      LogCvmfs(kLogCatalog, kLogVerboseMsg, "created automatic catalog %s",
+               mountpoints[j].c_str());
+    }
+  }
+}
+
+
 void WritableCatalogManager::PrecalculateListings() {
-  // TODO
+  WritableCatalogList catalogs;
+  GetModifiedCatalogs(&catalogs);
+  unsigned num_listings = 0;
+  for (WritableCatalogList::const_iterator i = catalogs.begin(),
+       iEnd = catalogs.end(); i != iEnd; ++i)
+  {
+    if ((*i)->IsDirty())
+      num_listings += (*i)->PrecalculateListings(kMinPrecalculatedListing);
+  }
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "precalculated %u directory listings",
+           num_listings);
+}
+
+
+static bool HasMembers(const BundleMemberList &bundle_members,
+                       const vector<hash::Any> &members)
+{
+  if (bundle_members.size() != members.size())
+    return false;
+  for (unsigned i = 0; i < members.size(); ++i) {
+    if (bundle_members[i].content_hash != members[i])
+      return false;
+  }
+  return true;
+}
+
+
+/**
+ * Packs the compressed objects of the small files of every directory of the
+ * modified catalogs into bundles, see WritableCatalog::GetBundleCandidates().
+ * Bundles whose members did not change are kept.  Has to run after the
+ * upload of the files, the members are read back from the Stratum 0.
+ */
+void WritableCatalogManager::BundleSmallFiles() {
+  WritableCatalogList catalogs;
+  GetModifiedCatalogs(&catalogs);
+  unsigned num_new = 0;
+  unsigned num_kept = 0;
+  for (WritableCatalogList::const_iterator i = catalogs.begin(),
+       iEnd = catalogs.end(); i != iEnd; ++i)
+  {
+    WritableCatalog *catalog = *i;
+    if (!catalog->IsDirty())
+      continue;
+    vector<vector<hash::Any> > candidates;
+    catalog->GetBundleCandidates(kMaxBundledFileSize, kMinBundleMembers,
+                                 kMaxBundleSize, &candidates);
+    BundleMap previous;
+    catalog->ListBundles(&previous);
+    if (candidates.empty() && previous.empty())
+      continue;
+
+    // Every object is in at most one bundle, the first member identifies it
+    map<hash::Any, BundleMap::const_iterator> previous_by_member;
+    for (BundleMap::const_iterator j = previous.begin(),
+         jEnd = previous.end(); j != jEnd; ++j)
+    {
+      previous_by_member[j->second[0].content_hash] = j;
+    }
+
+    BundleMap bundles;
+    for (unsigned j = 0; j < candidates.size(); ++j) {
+      map<hash::Any, BundleMap::const_iterator>::const_iterator prev =
+        previous_by_member.find(candidates[j][0]);
+      if ((prev != previous_by_member.end()) &&
+          HasMembers(prev->second->second, candidates[j]))
+      {
+        bundles.insert(*prev->second);
+        num_kept++;
+        continue;
+      }
+
+      hash::Any bundle_hash(hash::kSha1);
+      BundleMemberList bundle_members;
+      if (SpoolBundle(candidates[j], &bundle_hash, &bundle_members)) {
+        bundles[bundle_hash] = bundle_members;
+        num_new++;
+      }
+    }
+    catalog->StoreBundles(bundles);
+  }
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "bundled small files: %u new and %u "
+           "unchanged bundles", num_new, num_kept);
+}
+
+
+/**
+ * Downloads the compressed members from the Stratum 0 and uploads them back
+ * to back as a bundle object (ending B).
+ */
+bool WritableCatalogManager::SpoolBundle(
+  const vector<hash::Any> &members,
+  hash::Any *bundle_hash,
+  BundleMemberList *bundle_members) const
+{
+  vector<string> urls(members.size());
+  vector<download::JobInfo *> jobs;
+  for (unsigned i = 0; i < members.size(); ++i) {
+    urls[i] = stratum0_ + "/data" + members[i].MakePath(1, 2);
+    download::JobInfo *job =
+      new download::JobInfo(&urls[i], false, false, &members[i]);
+    job->priority = download::kPriorityBulk;
+    jobs.push_back(job);
+  }
+  const unsigned num_failed =
+    download::FetchBatch(jobs, kBundleFetchParallel, NULL, NULL);
+
+  string bundle;
+  for (unsigned i = 0; i < jobs.size(); ++i) {
+    if (num_failed == 0) {
+      bundle_members->push_back(BundleMember(members[i], bundle.length(),
+                                             jobs[i]->destination_mem.size));
+      bundle.append(jobs[i]->destination_mem.data,
+                    jobs[i]->destination_mem.size);
+    }
+    if (jobs[i]->destination_mem.data)
+      download::ReleaseMemBuffer(jobs[i]);
+    delete jobs[i];
+  }
+  if (num_failed > 0) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to load %u bundle members from "
+             "Stratum 0, not bundled", num_failed);
+    return false;
+  }
+
+  hash::HashMem(reinterpret_cast<const unsigned char *>(bundle.data()),
+                bundle.length(), bundle_hash);
+  string bundle_path;
+  FILE *fbundle = CreateTempFile(dir_temp_ + "/bundle", 0666, "w",
+                                 &bundle_path);
+  if (!fbundle) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to create temporary file");
+    return false;
+  }
+  const bool written =
+    (fwrite(bundle.data(), 1, bundle.length(), fbundle) == bundle.length());
+  if ((fclose(fbundle) != 0) || !written) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to write bundle %s",
+             bundle_path.c_str());
+    unlink(bundle_path.c_str());
+    return false;
+  }
+
+  pthread_mutex_lock(sync_lock_);
+  spooler_->SpoolCopy(bundle_path,
+                      "data" + bundle_hash->MakePath(1, 2) + "B");
+  pthread_mutex_unlock(sync_lock_);
+  return true;
+}
+
+
+/**
+ * Compares the new catalog to its previous revision from the Stratum 0 and
+ * uploads the delta, unless the catalog changed too much.  Clients without
+ * the previous revision download the full catalog, so failures are not fatal.
+ */
+void WritableCatalogManager::SpoolDelta(const WritableCatalog *catalog,
+                                        const hash::Any &hash_previous,
+                                        const hash::Any &hash_catalog) const
+{
+  string base_path;
+  FILE *fbase = CreateTempFile(dir_temp_ + "/catalog", 0666, "w", &base_path);
+  if (!fbase) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to create temporary file");
+    return;
+  }
+  const string url = stratum0_ + "/data" + hash_previous.MakePath(1, 2) + "C";
+  download::JobInfo download_base(&url, true, false, fbase, &hash_previous);
+  download_base.priority = download::kPriorityBulk;
+  download::Failures retval = download::Fetch(&download_base);
+  fclose(fbase);
+  if (retval != download::kFailOk) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to load %s from Stratum 0 (%d), "
+             "no delta for catalog %s", url.c_str(), retval,
+             catalog->path().c_str());
+    unlink(base_path.c_str());
+    return;
+  }
+
+  const string delta_path = catalog->database_path() + ".delta";
+  const bool created = CreateDelta(base_path, hash_previous,
+                                   catalog->database_path(), delta_path);
+  unlink(base_path.c_str());
+  if (!created)
+    return;
+  const bool compressed = zlib::CompressPath2Path(delta_path,
+                                                  delta_path + ".compressed");
+  unlink(delta_path.c_str());
+  if (!compressed) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to compress delta of %s",
+             catalog->path().c_str());
+    return;
+  }
+
+  pthread_mutex_lock(sync_lock_);
+  spooler_->SpoolCopy(delta_path + ".compressed",
+                      "data" + hash_catalog.MakePath(1, 2) + kDeltaSuffix);
+  pthread_mutex_unlock(sync_lock_);
+}
+
+
+/**
+ * The modified catalogs form a tree.  A catalog is ready to be snapshot when
+ * all of its modified children are processed, since the snapshot of a child
+ * changes the nested catalog link and the counters of its parent.
+ */
+struct WritableCatalogManager::SnapshotQueue {
+  WritableCatalogManager *manager;
+  std::vector<WritableCatalog *> ready;
+  std::map<Catalog *, unsigned> num_pending_children;
+  unsigned num_remaining;
+  hash::Any root_hash;
+  pthread_mutex_t lock;
+  pthread_cond_t cond_ready;
+};
+
+
+void *WritableCatalogManager::MainSnapshot(void *data) {
+  SnapshotQueue *queue = reinterpret_cast<SnapshotQueue *>(data);
+
+  pthread_mutex_lock(&queue->lock);
+  while (true) {
+    while (queue->ready.empty() && (queue->num_remaining > 0))
+      pthread_cond_wait(&queue->cond_ready, &queue->lock);
+    if (queue->num_remaining == 0)
+      break;
+    WritableCatalog *catalog = queue->ready.back();
+    queue->ready.pop_back();
+    pthread_mutex_unlock(&queue->lock);
+
+    catalog->Commit();
+    const hash::Any hash = queue->manager->SnapshotCatalog(catalog);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->num_remaining--;
+    if (catalog->IsRoot()) {
+      queue->root_hash = hash;
+    } else if (--queue->num_pending_children[catalog->parent()] == 0) {
+      queue->ready.push_back(catalog->GetWritableParent());
+    }
+    pthread_cond_broadcast(&queue->cond_ready);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
 }
 
 
@@ -587,29 +1095,62 @@ manifest::Manifest *WritableCatalogManager::Commit() {
   WritableCatalogList catalogs_to_snapshot;
   GetModifiedCatalogs(&catalogs_to_snapshot);
 
-  manifest::Manifest *result = NULL;
+  // Only the leafs of the tree of modified catalogs are ready at first
+  SnapshotQueue queue;
+  queue.manager = this;
+  queue.num_remaining = catalogs_to_snapshot.size();
   for (WritableCatalogList::iterator i = catalogs_to_snapshot.begin(),
        iEnd = catalogs_to_snapshot.end(); i != iEnd; ++i)
   {
-    (*i)->Commit();
-    hash::Any hash = SnapshotCatalog(*i);
-    if ((*i)->IsRoot()) {
-      base_hash_ = hash;
-      LogCvmfs(kLogCatalog, kLogVerboseMsg, "waiting for upload of catalogs");
-      spooler_->WaitFor();
-      if (spooler_->num_errors() > 0) {
-        LogCvmfs(kLogCatalog, kLogStderr, "failed to commit catalogs");
-        return NULL;
-      }
+    if (!(*i)->IsRoot())
+      queue.num_pending_children[(*i)->parent()]++;
+  }
+  for (WritableCatalogList::iterator i = catalogs_to_snapshot.begin(),
+       iEnd = catalogs_to_snapshot.end(); i != iEnd; ++i)
+  {
+    if (queue.num_pending_children.find(*i) ==
+        queue.num_pending_children.end())
+    {
+      queue.ready.push_back(*i);
+    }
+  }
+  int retval = pthread_mutex_init(&queue.lock, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&queue.cond_ready, NULL);
+  assert(retval == 0);
 
-      // .cvmfspublished
-      LogCvmfs(kLogCatalog, kLogVerboseMsg, "Committing repository manifest");
-      result = new manifest::Manifest(hash, "");
-      result->set_ttl((*i)->GetTTL());
-      result->set_revision((*i)->GetRevision());
+  LogCvmfs(kLogCatalog, kLogVerboseMsg,
+           "snapshotting %u catalogs with %u workers",
+           queue.num_remaining, num_snapshot_workers_);
+  if (num_snapshot_workers_ > 1) {
+    vector<pthread_t> workers(num_snapshot_workers_);
+    for (unsigned i = 0; i < workers.size(); ++i) {
+      retval = pthread_create(&workers[i], NULL, MainSnapshot, &queue);
+      assert(retval == 0);
     }
+    for (unsigned i = 0; i < workers.size(); ++i)
+      pthread_join(workers[i], NULL);
+  } else {
+    MainSnapshot(&queue);
+  }
+  pthread_cond_destroy(&queue.cond_ready);
+  pthread_mutex_destroy(&queue.lock);
+
+  WritableCatalog *root = static_cast<WritableCatalog *>(GetRootCatalog());
+  base_hash_ = queue.root_hash;
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "waiting for upload of catalogs");
+  spooler_->WaitFor();
+  if (spooler_->num_errors() > 0) {
+    LogCvmfs(kLogCatalog, kLogStderr, "failed to commit catalogs");
+    return NULL;
   }
 
+  // .cvmfspublished
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "Committing repository manifest");
+  manifest::Manifest *result = new manifest::Manifest(base_hash_, "");
+  result->set_ttl(root->GetTTL());
+  result->set_revision(root->GetRevision());
+
   return result;
 }
 
@@ -648,7 +1189,8 @@ int WritableCatalogManager::GetModifiedCatalogsRecursively(
 
 /**
  * Makes a new catalog revision.  Compresses and uploads catalog.  Returns
- * content hash.
+ * content hash.  Runs in parallel for siblings, the parent catalog is only
+ * touched under the sync lock.
  */
 hash::Any WritableCatalogManager::SnapshotCatalog(WritableCatalog *catalog)
   const
@@ -657,23 +1199,22 @@ hash::Any WritableCatalogManager::SnapshotCatalog(WritableCatalog *catalog)
            catalog->path().c_str());
 
   catalog->UpdateCounters();
+  pthread_mutex_lock(sync_lock_);
   if (catalog->parent()) {
     catalog->delta_counters_.PopulateToParent(
       &catalog->GetWritableParent()->delta_counters_);
   }
+  hash::Any hash_previous = base_hash_;
+  if (!catalog->IsRoot())
+    catalog->parent()->FindNested(catalog->path(), &hash_previous);
+  pthread_mutex_unlock(sync_lock_);
   catalog->delta_counters_.SetZero();
 
   catalog->UpdateLastModified();
   catalog->IncrementRevision();
 
 	// Previous revision
-  if (catalog->IsRoot()) {
-    catalog->SetPreviousRevision(base_hash_);
-  } else {
-    hash::Any hash_previous;
-    catalog->parent()->FindNested(catalog->path(), &hash_previous);
-    catalog->SetPreviousRevision(hash_previous);
-  }
+  catalog->SetPreviousRevision(hash_previous);
 
 	// Compress catalog
   hash::Any hash_catalog(hash::kSha1);
@@ -684,8 +1225,11 @@ hash::Any WritableCatalogManager::SnapshotCatalog(WritableCatalog *catalog)
 		PrintError("could not compress catalog " + catalog->path().ToString());
     assert(false);
 	}
+  if (emit_deltas_ && !hash_previous.IsNull())
+    SpoolDelta(catalog, hash_previous, hash_catalog);
 
   // Upload catalog
+  pthread_mutex_lock(sync_lock_);
   spooler_->SpoolCopy(catalog->database_path() + ".compressed",
                       "data" + hash_catalog.MakePath(1, 2) + "C");
 
@@ -695,6 +1239,7 @@ hash::Any WritableCatalogManager::SnapshotCatalog(WritableCatalog *catalog)
     WritableCatalog *parent = static_cast<WritableCatalog *>(catalog->parent());
 		parent->UpdateNestedCatalog(catalog->path().ToString(), hash_catalog);
 	}
+  pthread_mutex_unlock(sync_lock_);
 
   return hash_catalog;
 }
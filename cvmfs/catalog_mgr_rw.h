@@ -53,6 +53,9 @@ class WritableCatalogManager : public AbstractCatalogManager {
 
   void AddFile(const DirectoryEntry &entry,
                const std::string &parent_directory);
+  void AddChunkedFile(const DirectoryEntry &entry,
+                      const std::string &parent_directory,
+                      const FileChunkList &file_chunks);
   void RemoveFile(const std::string &file_path);
   void AddDirectory(const DirectoryEntry &entry,
                     const std::string &parent_directory);
@@ -71,18 +74,38 @@ class WritableCatalogManager : public AbstractCatalogManager {
 
 	void AddHardlinkGroup(DirectoryEntryList &entries,
                         const std::string &parent_directory);
+  void AddHardlinkGroups(std::vector<DirectoryEntryList> *groups,
+                         const std::string &parent_directory);
   void ShrinkHardlinkGroup(const std::string &remove_path);
 
   void CreateNestedCatalog(const std::string &mountpoint);
   void RemoveNestedCatalog(const std::string &mountpoint);
 
-	/**
-	 * TODO
-	 */
+  void BalanceCatalogs(const uint64_t max_entries, const uint64_t min_entries,
+                       const uint64_t max_bytes);
+
+  /**
+   * Stores the listings of large directories of modified catalogs, see
+   * WritableCatalog::PrecalculateListings().  Runs right before Commit().
+   */
   void PrecalculateListings();
+  void BundleSmallFiles();
 
   manifest::Manifest *Commit();
 
+  /**
+   * Number of threads that snapshot modified catalogs on Commit().  Sibling
+   * catalogs are processed in parallel, parents after their children.
+   */
+  void set_num_snapshot_workers(const unsigned value) {
+    num_snapshot_workers_ = (value > 0) ? value : 1;
+  }
+  /**
+   * Store a delta against the previous revision next to every new catalog,
+   * see catalog_delta.h
+   */
+  void set_emit_deltas(const bool value) { emit_deltas_ = value; }
+
  protected:
   void EnforceSqliteMemLimit() { }
 
@@ -91,6 +114,23 @@ class WritableCatalogManager : public AbstractCatalogManager {
   Catalog* CreateCatalog(const PathString &mountpoint, Catalog *parent_catalog);
 
  private:
+  /**
+   * Smaller directories are listed quickly enough from the catalog table
+   */
+  static const unsigned kMinPrecalculatedListing = 64;
+  /**
+   * Files up to kMaxBundledFileSize bytes are bundled if there are at least
+   * kMinBundleMembers of them in a directory.  Bundles hold up to
+   * kMaxBundleSize bytes of files.
+   */
+  static const uint64_t kMaxBundledFileSize = 16 * 1024;
+  static const unsigned kMinBundleMembers = 4;
+  static const uint64_t kMaxBundleSize = 1024 * 1024;
+  /**
+   * Parallel downloads of the members of a bundle from the Stratum 0
+   */
+  static const unsigned kBundleFetchParallel = 8;
+
   bool FindCatalog(const std::string &path, WritableCatalog **result);
 
   /**
@@ -117,6 +157,22 @@ class WritableCatalogManager : public AbstractCatalogManager {
                                      WritableCatalogList *result) const;
 
   hash::Any SnapshotCatalog(WritableCatalog *catalog) const;
+  void SpoolDelta(const WritableCatalog *catalog,
+                  const hash::Any &hash_previous,
+                  const hash::Any &hash_catalog) const;
+  bool SpoolBundle(const std::vector<hash::Any> &members,
+                   hash::Any *bundle_hash,
+                   BundleMemberList *bundle_members) const;
+
+  bool IsAutoCatalogMountpoint(const std::string &path);
+  struct BalanceNode;
+  void BuildBalanceTree(const WritableCatalog *catalog, BalanceNode *node);
+  void SplitBalanceTree(BalanceNode *node, const uint64_t max_weight,
+                        const uint64_t min_weight,
+                        std::vector<std::string> *mountpoints);
+
+  struct SnapshotQueue;
+  static void *MainSnapshot(void *data);
 
  private:
   inline void SyncLock() { pthread_mutex_lock(sync_lock_); }
@@ -130,6 +186,8 @@ class WritableCatalogManager : public AbstractCatalogManager {
   std::string stratum0_;
   std::string dir_temp_;
   upload::Spooler *spooler_;
+  unsigned num_snapshot_workers_;
+  bool emit_deltas_;
 };  // class WritableCatalogManager
 
 }  // namespace catalog
@@ -10,6 +10,9 @@
 #include <cstdio>
 #include <cstdlib>
 
+#include <algorithm>
+#include <set>
+
 #include "logging.h"
 #include "util.h"
 
@@ -22,6 +25,9 @@ WritableCatalog::WritableCatalog(const string &path, Catalog *parent) :
 {
   read_only_ = false;
   dirty_ = false;
+  bulk_insert_ = false;
+  max_link_id_stored_ = -1;
+  max_link_id_added_ = 0;
 }
 
 
@@ -40,6 +46,8 @@ void WritableCatalog::Transaction() {
 
 
 void WritableCatalog::Commit() {
+  if (bulk_insert_)
+    EndBulkInsert();
   Sql commit(database(), "COMMIT;");
   bool retval = commit.Execute();
   assert(retval == true);
@@ -47,6 +55,93 @@ void WritableCatalog::Commit() {
 }
 
 
+/**
+ * Used to fill a fresh catalog with many entries.  The caller must not rely
+ * on lookups of added entries until EndBulkInsert().
+ */
+void WritableCatalog::BeginBulkInsert() {
+  if (bulk_insert_)
+    return;
+  SetDirty();
+  bool retval =
+    Sql(database(), "DROP INDEX IF EXISTS idx_catalog_parent;").Execute();
+  assert(retval);
+  bulk_insert_ = true;
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "bulk insert mode for '%s'",
+           path().c_str());
+}
+
+
+void WritableCatalog::EndBulkInsert() {
+  if (!bulk_insert_)
+    return;
+  FlushPendingInserts();
+  bulk_insert_ = false;
+  bool retval = Sql(database(), "CREATE INDEX IF NOT EXISTS idx_catalog_parent "
+                                "ON catalog (parent_1, parent_2);").Execute();
+  assert(retval);
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "end of bulk insert mode for '%s'",
+           path().c_str());
+}
+
+
+/**
+ * Order of the primary key (md5path_1, md5path_2), i.e. signed integers.
+ */
+struct WritableCatalog::PathHashOrder {
+  bool operator() (const PendingInsert &a, const PendingInsert &b) const {
+    uint64_t a_1, a_2, b_1, b_2;
+    a.path_hash.ToIntPair(&a_1, &a_2);
+    b.path_hash.ToIntPair(&b_1, &b_2);
+    if (a_1 != b_1)
+      return static_cast<int64_t>(a_1) < static_cast<int64_t>(b_1);
+    return static_cast<int64_t>(a_2) < static_cast<int64_t>(b_2);
+  }
+};
+
+
+/**
+ * Inserts the queued rows in the order of the primary key, so that the
+ * B-tree is filled from left to right.  The counters are updated in one go.
+ */
+void WritableCatalog::FlushPendingInserts() {
+  if (pending_inserts_.empty() && pending_chunks_.empty())
+    return;
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "flushing %u entries and %u chunks",
+           static_cast<unsigned>(pending_inserts_.size()),
+           static_cast<unsigned>(pending_chunks_.size()));
+
+  sort(pending_inserts_.begin(), pending_inserts_.end(), PathHashOrder());
+  DeltaCounters delta;
+  for (unsigned i = 0; i < pending_inserts_.size(); ++i) {
+    const PendingInsert &insert = pending_inserts_[i];
+    bool retval =
+      sql_insert_->BindPathHash(insert.path_hash) &&
+      sql_insert_->BindParentPathHash(insert.parent_hash) &&
+      sql_insert_->BindDirent(insert.entry) &&
+      sql_insert_->Execute();
+    assert(retval);
+    sql_insert_->Reset();
+    delta.DeltaDirent(insert.entry, 1);
+  }
+  delta_counters_.d_self_regular += delta.d_self_regular;
+  delta_counters_.d_self_symlink += delta.d_self_symlink;
+  delta_counters_.d_self_dir += delta.d_self_dir;
+  pending_inserts_.clear();
+
+  // Chunks reference their file entry, so they come second
+  for (unsigned i = 0; i < pending_chunks_.size(); ++i) {
+    bool retval =
+      sql_chunk_insert_->BindPathHash(pending_chunks_[i].path_hash) &&
+      sql_chunk_insert_->BindFileChunk(pending_chunks_[i].chunk) &&
+      sql_chunk_insert_->Execute();
+    assert(retval);
+    sql_chunk_insert_->Reset();
+  }
+  pending_chunks_.clear();
+}
+
+
 void WritableCatalog::InitPreparedStatements() {
   Catalog::InitPreparedStatements(); // polymorphism: up call
 
@@ -58,6 +153,8 @@ void WritableCatalog::InitPreparedStatements() {
   sql_update_ = new SqlDirentUpdate(database());
   sql_max_link_id_ = new SqlMaxHardlinkGroup(database());
   sql_inc_linkcount_ = new SqlIncLinkcount(database());
+  sql_chunk_insert_ = new SqlChunkInsert(database());
+  sql_chunks_remove_ = new SqlChunksRemove(database());
 }
 
 
@@ -70,21 +167,34 @@ void WritableCatalog::FinalizePreparedStatements() {
   delete sql_update_;
   delete sql_max_link_id_;
   delete sql_inc_linkcount_;
+  delete sql_chunk_insert_;
+  delete sql_chunks_remove_;
 }
 
 
 /**
- * Find out the maximal hardlink group id in this catalog.
+ * Find out the maximal hardlink group id in this catalog.  The database is
+ * only queried the first time, later additions are tracked by AddEntry().
  */
 uint32_t WritableCatalog::GetMaxLinkId() const {
-  int result = -1;
-
-  if (sql_max_link_id_->FetchRow()) {
-    result = sql_max_link_id_->GetMaxGroupId();
+  if (max_link_id_stored_ < 0) {
+    max_link_id_stored_ = 0;
+    if (sql_max_link_id_->FetchRow())
+      max_link_id_stored_ = sql_max_link_id_->GetMaxGroupId();
+    sql_max_link_id_->Reset();
   }
-  sql_max_link_id_->Reset();
 
-  return result;
+  return std::max(static_cast<uint32_t>(max_link_id_stored_),
+                  max_link_id_added_);
+}
+
+
+/**
+ * Reserves a new hardlink group id.
+ */
+uint32_t WritableCatalog::IssueLinkId() {
+  max_link_id_added_ = GetMaxLinkId() + 1;
+  return max_link_id_added_;
 }
 
 
@@ -105,6 +215,14 @@ void WritableCatalog::AddEntry(const DirectoryEntry &entry,
   hash::Md5 parent_hash((hash::AsciiPtr(parent_path)));
 
   LogCvmfs(kLogCatalog, kLogVerboseMsg, "add entry %s", entry_path.c_str());
+  max_link_id_added_ = std::max(max_link_id_added_, entry.hardlink_group());
+
+  if (bulk_insert_) {
+    pending_inserts_.push_back(PendingInsert(path_hash, parent_hash, entry));
+    if (pending_inserts_.size() >= kMaxPendingInserts)
+      FlushPendingInserts();
+    return;
+  }
 
   bool retval =
     sql_insert_->BindPathHash(path_hash) &&
@@ -128,6 +246,7 @@ void WritableCatalog::AddEntry(const DirectoryEntry &entry,
 void WritableCatalog::TouchEntry(const DirectoryEntry &entry,
                                  const std::string &entry_path) {
   SetDirty();
+  FlushPendingInserts();
 
   // perform a touch operation for the given path
   hash::Md5 path_hash = hash::Md5(hash::AsciiPtr(entry_path));
@@ -149,6 +268,7 @@ void WritableCatalog::TouchEntry(const DirectoryEntry &entry,
  */
 void WritableCatalog::RemoveEntry(const string &file_path) {
   hash::Md5 path_hash = hash::Md5(hash::AsciiPtr(file_path));
+  FlushPendingInserts();
 
   DirectoryEntry entry;
   bool retval = LookupMd5Path(path_hash, &entry);
@@ -156,6 +276,15 @@ void WritableCatalog::RemoveEntry(const string &file_path) {
 
   SetDirty();
 
+  // The pieces of a chunked file reference the catalog entry
+  if (entry.IsChunkedFile()) {
+    retval =
+      sql_chunks_remove_->BindPathHash(path_hash) &&
+      sql_chunks_remove_->Execute();
+    assert(retval);
+    sql_chunks_remove_->Reset();
+  }
+
   retval =
     sql_unlink_->BindPathHash(path_hash) &&
     sql_unlink_->Execute();
@@ -166,10 +295,40 @@ void WritableCatalog::RemoveEntry(const string &file_path) {
 }
 
 
+/**
+ * Adds a piece of a chunked file.  The file entry has to exist already.
+ * @param entry_path the full path of the chunked file
+ * @param chunk the piece's offset, size, and content hash
+ */
+void WritableCatalog::AddFileChunk(const string &entry_path,
+                                   const FileChunk &chunk)
+{
+  SetDirty();
+
+  hash::Md5 path_hash((hash::AsciiPtr(entry_path)));
+
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "add chunk %s at offset %"PRId64,
+           entry_path.c_str(), int64_t(chunk.offset));
+
+  if (bulk_insert_) {
+    pending_chunks_.push_back(PendingChunk(path_hash, chunk));
+    return;
+  }
+
+  bool retval =
+    sql_chunk_insert_->BindPathHash(path_hash) &&
+    sql_chunk_insert_->BindFileChunk(chunk) &&
+    sql_chunk_insert_->Execute();
+  assert(retval);
+  sql_chunk_insert_->Reset();
+}
+
+
 void WritableCatalog::IncLinkcount(const string &path_within_group,
                                    const int delta)
 {
   SetDirty();
+  FlushPendingInserts();
 
   hash::Md5 path_hash = hash::Md5(hash::AsciiPtr(path_within_group));
 
@@ -185,6 +344,7 @@ void WritableCatalog::IncLinkcount(const string &path_within_group,
 void WritableCatalog::UpdateEntry(const DirectoryEntry &entry,
                                   const hash::Md5 &path_hash) {
   SetDirty();
+  FlushPendingInserts();
 
   bool retval =
     sql_update_->BindPathHash(path_hash) &&
@@ -232,6 +392,190 @@ void WritableCatalog::SetPreviousRevision(const hash::Any &hash) {
 }
 
 
+/**
+ * Automatic catalogs are created and merged again by the publisher according
+ * to their size, they have no .cvmfscatalog marker.  The flag is a catalog
+ * property, clients ignore it.
+ */
+bool WritableCatalog::IsAutoCatalog() const {
+  Sql stmt(database(), "SELECT value FROM properties WHERE key='autocatalog';");
+  return stmt.FetchRow() && (stmt.RetrieveInt64(0) != 0);
+}
+
+
+void WritableCatalog::SetAutoCatalog(const bool value) {
+  SetDirty();
+  const string sql = value ?
+    "INSERT OR REPLACE INTO properties (key, value) "
+    "VALUES ('autocatalog', 1);" :
+    "DELETE FROM properties WHERE key='autocatalog';";
+  bool retval = Sql(database(), sql).Execute();
+  assert(retval);
+}
+
+
+/**
+ * Stores the listings of all directories with at least min_entries entries in
+ * the listings table, so that clients can list them with a single lookup.
+ * Has to run after the last change of directory entries, the listings refer
+ * to the row ids.  Older clients don't know the table and ignore it.
+ * @return the number of precalculated listings
+ */
+unsigned WritableCatalog::PrecalculateListings(const unsigned min_entries) {
+  if (bulk_insert_)
+    EndBulkInsert();
+  bool retval = Sql(database(),
+    "CREATE TABLE IF NOT EXISTS listings "
+    "(md5path_1 INTEGER, md5path_2 INTEGER, listing BLOB, "
+    " CONSTRAINT pk_listings PRIMARY KEY (md5path_1, md5path_2));").Execute();
+  assert(retval);
+  retval = Sql(database(), "DELETE FROM listings;").Execute();
+  assert(retval);
+
+  unsigned num_listings = 0;
+  SqlListingRows sql_rows(database());
+  SqlListingBlobInsert sql_insert(database());
+  vector<ListingRow> rows;
+  hash::Md5 parent_hash;
+  bool more = sql_rows.FetchRow();
+  while (more) {
+    parent_hash = sql_rows.GetParentPathHash();
+    rows.clear();
+    do {
+      rows.push_back(sql_rows.GetRow());
+      more = sql_rows.FetchRow();
+    } while (more && (sql_rows.GetParentPathHash() == parent_hash));
+
+    if (rows.size() < min_entries)
+      continue;
+    retval = sql_insert.BindPathHash(parent_hash) &&
+             sql_insert.BindListing(rows) &&
+             sql_insert.Execute();
+    assert(retval);
+    sql_insert.Reset();
+    num_listings++;
+  }
+  SetDirty();
+
+  LogCvmfs(kLogCatalog, kLogVerboseMsg, "precalculated %u listings in '%s'",
+           num_listings, path().c_str());
+  return num_listings;
+}
+
+
+/**
+ * Groups the small files of every directory into bundles of at most
+ * max_bundle_size bytes.  Every object is in at most one bundle, groups of
+ * less than min_members objects are not worth a bundle.  The order is stable
+ * between publishes, so that unchanged directories result in the same
+ * bundles.
+ * @param[out] bundles the content hashes of the members of every bundle
+ */
+void WritableCatalog::GetBundleCandidates(
+  const uint64_t max_file_size,
+  const unsigned min_members,
+  const uint64_t max_bundle_size,
+  vector<vector<hash::Any> > *bundles)
+{
+  if (bulk_insert_)
+    EndBulkInsert();
+  SqlBundleCandidates sql_candidates(database());
+  bool retval = sql_candidates.BindMaxSize(max_file_size);
+  assert(retval);
+
+  set<hash::Any> bundled;
+  vector<hash::Any> members;
+  uint64_t bundle_size = 0;
+  hash::Md5 parent_hash;
+  bool more = sql_candidates.FetchRow();
+  while (more) {
+    parent_hash = sql_candidates.GetParentPathHash();
+    members.clear();
+    bundle_size = 0;
+    do {
+      const hash::Any content_hash = sql_candidates.GetContentHash();
+      const uint64_t size = sql_candidates.GetSize();
+      if (bundled.insert(content_hash).second) {
+        if (bundle_size + size > max_bundle_size) {
+          if (members.size() >= min_members)
+            bundles->push_back(members);
+          members.clear();
+          bundle_size = 0;
+        }
+        members.push_back(content_hash);
+        bundle_size += size;
+      }
+      more = sql_candidates.FetchRow();
+    } while (more && (sql_candidates.GetParentPathHash() == parent_hash));
+
+    if (members.size() >= min_members)
+      bundles->push_back(members);
+  }
+}
+
+
+/**
+ * Reads the bundles table, if any.
+ */
+void WritableCatalog::ListBundles(BundleMap *bundles) const {
+  if (!database().has_bundles())
+    return;
+  SqlBundleRows sql_rows(database());
+  while (sql_rows.FetchRow())
+    (*bundles)[sql_rows.GetBundleHash()].push_back(sql_rows.GetMember());
+}
+
+
+/**
+ * Replaces the bundles table.  Older clients don't know the table and ignore
+ * it.
+ */
+void WritableCatalog::StoreBundles(const BundleMap &bundles) {
+  if (bulk_insert_)
+    EndBulkInsert();
+  bool retval = Sql(database(),
+    "CREATE TABLE IF NOT EXISTS bundles "
+    "(hash BLOB, bundle BLOB, offset INTEGER, size INTEGER, "
+    " CONSTRAINT pk_bundles PRIMARY KEY (hash));").Execute();
+  assert(retval);
+  retval = Sql(database(),
+    "CREATE INDEX IF NOT EXISTS idx_bundles ON bundles (bundle);").Execute();
+  assert(retval);
+  retval = Sql(database(), "DELETE FROM bundles;").Execute();
+  assert(retval);
+
+  SqlBundleInsert sql_insert(database());
+  for (BundleMap::const_iterator i = bundles.begin(), iEnd = bundles.end();
+       i != iEnd; ++i)
+  {
+    for (unsigned j = 0; j < i->second.size(); ++j) {
+      retval = sql_insert.BindBundle(i->first, i->second[j]) &&
+               sql_insert.Execute();
+      assert(retval);
+      sql_insert.Reset();
+    }
+  }
+  SetDirty();
+}
+
+
+/**
+ * Size of the used database pages, including the open transaction.
+ */
+uint64_t WritableCatalog::GetDatabaseSize() const {
+  Sql page_count(database(), "PRAGMA page_count;");
+  Sql freelist_count(database(), "PRAGMA freelist_count;");
+  Sql page_size(database(), "PRAGMA page_size;");
+  if (!page_count.FetchRow() || !freelist_count.FetchRow() ||
+      !page_size.FetchRow())
+  {
+    return 0;
+  }
+  return (page_count.RetrieveInt64(0) - freelist_count.RetrieveInt64(0)) *
+         page_size.RetrieveInt64(0);
+}
+
+
 /**
  * Moves a subtree from this catalog into a just created nested catalog.
  */
@@ -245,8 +589,10 @@ void WritableCatalog::Partition(WritableCatalog *new_nested_catalog) {
   // if we hit nested catalog mountpoints on the way, we return them through
   // the passed list
   vector<string> GrandChildMountpoints;
+  new_nested_catalog->BeginBulkInsert();
   MoveToNested(new_nested_catalog->path().ToString(), new_nested_catalog,
                &GrandChildMountpoints);
+  new_nested_catalog->EndBulkInsert();
 
   // Nested catalog mountpoints found in the moved directory structure are now
   // links to nested catalogs of the newly created nested catalog.
@@ -304,6 +650,13 @@ void WritableCatalog::MoveToNestedRecursively(
 
     // The entries are first inserted into the new catalog
     new_nested_catalog->AddEntry(*i, full_path);
+    if (i->IsChunkedFile()) {
+      FileChunkList chunks;
+      ListPathChunks(PathString(full_path.data(), full_path.length()),
+                     &chunks);
+      for (unsigned j = 0; j < chunks.size(); ++j)
+        new_nested_catalog->AddFileChunk(full_path, chunks[j]);
+    }
 
     // Then we check if we have some special cases:
     if (i->IsNestedCatalogMountpoint()) {
@@ -521,9 +874,13 @@ void WritableCatalog::CopyToParent() {
   retval = Sql(database(), "INSERT INTO other.catalog "
                            "SELECT * FROM main.catalog;").Execute();
   assert(retval);
+  retval = Sql(database(), "INSERT INTO other.chunks "
+                           "SELECT * FROM main.chunks;").Execute();
+  assert(retval);
   retval = Sql(database(), "DETACH other;").Execute();
   assert(retval);
   parent->SetDirty();
+  parent->max_link_id_stored_ = -1;
 
   // Change the just copied nested catalog root to an ordinary directory
   // (the nested catalog is merged into it's parent)
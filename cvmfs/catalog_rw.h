@@ -10,6 +10,12 @@
  *  - AddEntry
  *  - TouchEntry
  *  - RemoveEntry
+ *
+ * In bulk insert mode, AddEntry and AddFileChunk only queue their rows.  The
+ * queued rows are inserted sorted by path hash when the queue is full, when
+ * any other modification is made, and at the end of the bulk mode.  Lookups
+ * do not see queued rows.  The parent index is dropped for the bulk mode and
+ * re-created at its end.
  */
 
 #ifndef CVMFS_CATALOG_RW_H_
@@ -17,6 +23,7 @@
 
 #include <stdint.h>
 
+#include <map>
 #include <vector>
 #include <string>
 
@@ -26,6 +33,11 @@ namespace catalog {
 
 class WritableCatalogManager;
 
+/**
+ * Maps the content hash of a bundle to its members
+ */
+typedef std::map<hash::Any, BundleMemberList> BundleMap;
+
 class WritableCatalog : public Catalog {
   friend class WritableCatalogManager;
 
@@ -36,14 +48,20 @@ class WritableCatalog : public Catalog {
   void Transaction();
   void Commit();
 
+  void BeginBulkInsert();
+  void EndBulkInsert();
+  inline bool IsBulkInsert() const { return bulk_insert_; }
+
   inline bool IsDirty() const { return dirty_; }
   inline bool IsWritable() const { return true; }
   uint32_t GetMaxLinkId() const;
+  uint32_t IssueLinkId();
 
   void AddEntry(const DirectoryEntry &entry, const std::string &entry_path,
                 const std::string &parent_path);
   void TouchEntry(const DirectoryEntry &entry, const std::string &entry_path);
   void RemoveEntry(const std::string &entry_path);
+  void AddFileChunk(const std::string &entry_path, const FileChunk &chunk);
   void IncLinkcount(const std::string &path_within_group, const int delta);
 
   // Creation and removal of catalogs
@@ -62,6 +80,19 @@ class WritableCatalog : public Catalog {
   void IncrementRevision();
   void SetPreviousRevision(const hash::Any &hash);
 
+  // Nested catalogs created by the publisher's partitioning policy
+  bool IsAutoCatalog() const;
+  void SetAutoCatalog(const bool value);
+  uint64_t GetDatabaseSize() const;
+
+  unsigned PrecalculateListings(const unsigned min_entries);
+  void GetBundleCandidates(const uint64_t max_file_size,
+                           const unsigned min_members,
+                           const uint64_t max_bundle_size,
+                           std::vector<std::vector<hash::Any> > *bundles);
+  void ListBundles(BundleMap *bundles) const;
+  void StoreBundles(const BundleMap &bundles);
+
  protected:
   Database::OpenMode DatabaseOpenMode() const {
     return Database::kOpenReadWrite;
@@ -87,14 +118,46 @@ class WritableCatalog : public Catalog {
   }
 
  private:
+  /**
+   * Flush the queue of the bulk insert mode when it has that many rows
+   */
+  static const unsigned kMaxPendingInserts = 100000;
+
+  struct PendingInsert {
+    PendingInsert(const hash::Md5 &p, const hash::Md5 &pp,
+                  const DirectoryEntry &e) :
+      path_hash(p), parent_hash(pp), entry(e) { }
+    hash::Md5 path_hash;
+    hash::Md5 parent_hash;
+    DirectoryEntry entry;
+  };
+  struct PendingChunk {
+    PendingChunk(const hash::Md5 &p, const FileChunk &c) :
+      path_hash(p), chunk(c) { }
+    hash::Md5 path_hash;
+    FileChunk chunk;
+  };
+  struct PathHashOrder;
+
   SqlDirentInsert     *sql_insert_;
   SqlDirentTouch      *sql_touch_;
   SqlDirentUnlink     *sql_unlink_;
   SqlDirentUpdate     *sql_update_;
   SqlMaxHardlinkGroup *sql_max_link_id_;
   SqlIncLinkcount     *sql_inc_linkcount_;
+  SqlChunkInsert      *sql_chunk_insert_;
+  SqlChunksRemove     *sql_chunks_remove_;
 
   bool dirty_;  /**< Indicates if the catalog has been changed */
+  bool bulk_insert_;
+  /**
+   * Hardlink group ids: the maximum in the database, queried once, and the
+   * maximum of entries added since, some of which might still be pending
+   */
+  mutable int64_t max_link_id_stored_;
+  uint32_t max_link_id_added_;
+  std::vector<PendingInsert> pending_inserts_;
+  std::vector<PendingChunk> pending_chunks_;
 
   const WritableCatalogManager *catalog_mgr_;
   DeltaCounters delta_counters_;
@@ -125,6 +188,7 @@ class WritableCatalog : public Catalog {
   void CopyCatalogsToParent();
 
   void UpdateCounters();
+  void FlushPendingInserts();
 };  // class WritableCatalog
 
 typedef std::vector<WritableCatalog *> WritableCatalogList;
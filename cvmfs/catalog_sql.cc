@@ -6,11 +6,19 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <cassert>
 #include <cstdlib>
 #include <cstring>
 #include <cstdlib>
 
+#include <map>
+#include <utility>
+
 #include "platform.h"
 #include "catalog.h"
 #include "logging.h"
@@ -23,6 +31,250 @@ namespace catalog {
 const float Database::kLatestSchema = 2.4;
 const float Database::kLatestSupportedSchema = 2.4;  // + 1.X catalogs (r/o)
 const float Database::kSchemaEpsilon = 0.0005;  // floats get imprecise in SQlite
+uint64_t Database::mmap_limit_ = 0;
+
+
+/**
+ * The bundled SQlite predates memory-mapped I/O, so read-only catalogs get a
+ * thin VFS shim instead.  It wraps the default VFS and serves xRead from a
+ * read-only mapping of the file, every other call is passed through.  With
+ * the reads being a memcpy from the kernel page cache, the SQlite page cache
+ * of these connections is kept small (kMmapCachePages).  The pooled
+ * connections of a catalog share one mapping of its file, which is counted
+ * once against Database::mmap_limit_.
+ */
+const char *kMmapVfsName = "cvmfs-mmap";
+const int kMmapCachePages = 32;
+const int kFcntlIsMapped = 0x636d6d70;  // private file control opcode
+
+typedef pair<dev_t, ino_t> FileId;
+
+struct SharedMapping {
+  const char *mapping;
+  sqlite3_int64 size;
+  unsigned refcount;  ///< Number of open MmapFiles using the mapping
+};
+
+struct MmapFile {
+  sqlite3_file base;
+  sqlite3_file *real;  ///< File of the default VFS, allocated behind MmapFile
+  const char *mapping;  ///< NULL if the file is not mapped
+  sqlite3_int64 size;
+  FileId file_id;  ///< Key into mappings_
+};
+
+static sqlite3_vfs mmap_vfs_;
+static sqlite3_io_methods mmap_io_methods_;
+static pthread_once_t mmap_vfs_once_ = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock_mappings_ = PTHREAD_MUTEX_INITIALIZER;
+static map<FileId, SharedMapping> *mappings_ = NULL;  ///< lock_mappings_
+static int64_t mmap_used_ = 0;  ///< Protected by lock_mappings_
+
+
+static int MmapClose(sqlite3_file *file) {
+  MmapFile *p = reinterpret_cast<MmapFile *>(file);
+  if (p->mapping) {
+    pthread_mutex_lock(&lock_mappings_);
+    map<FileId, SharedMapping>::iterator iter = mappings_->find(p->file_id);
+    assert(iter != mappings_->end());
+    if (--iter->second.refcount == 0) {
+      munmap(const_cast<char *>(iter->second.mapping), iter->second.size);
+      mmap_used_ -= iter->second.size;
+      mappings_->erase(iter);
+    }
+    pthread_mutex_unlock(&lock_mappings_);
+    p->mapping = NULL;
+  }
+  return p->real->pMethods->xClose(p->real);
+}
+
+static int MmapRead(sqlite3_file *file, void *buf, int amt,
+                    sqlite3_int64 offset)
+{
+  MmapFile *p = reinterpret_cast<MmapFile *>(file);
+  if (p->mapping == NULL)
+    return p->real->pMethods->xRead(p->real, buf, amt, offset);
+  if (offset + amt <= p->size) {
+    memcpy(buf, p->mapping + offset, amt);
+    return SQLITE_OK;
+  }
+  // Short read, SQlite requires the remainder to be zeroed
+  const sqlite3_int64 avail = (offset < p->size) ? p->size - offset : 0;
+  if (avail > 0)
+    memcpy(buf, p->mapping + offset, avail);
+  memset(static_cast<char *>(buf) + avail, 0, amt - avail);
+  return SQLITE_IOERR_SHORT_READ;
+}
+
+static int MmapWrite(sqlite3_file *file, const void *buf, int amt,
+                     sqlite3_int64 offset)
+{
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xWrite(real, buf, amt, offset);
+}
+
+static int MmapTruncate(sqlite3_file *file, sqlite3_int64 size) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xTruncate(real, size);
+}
+
+static int MmapSync(sqlite3_file *file, int flags) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xSync(real, flags);
+}
+
+static int MmapFileSize(sqlite3_file *file, sqlite3_int64 *size) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xFileSize(real, size);
+}
+
+static int MmapLock(sqlite3_file *file, int lock) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xLock(real, lock);
+}
+
+static int MmapUnlock(sqlite3_file *file, int lock) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xUnlock(real, lock);
+}
+
+static int MmapCheckReservedLock(sqlite3_file *file, int *result) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xCheckReservedLock(real, result);
+}
+
+static int MmapFileControl(sqlite3_file *file, int op, void *arg) {
+  MmapFile *p = reinterpret_cast<MmapFile *>(file);
+  if (op == kFcntlIsMapped) {
+    *static_cast<int *>(arg) = (p->mapping != NULL);
+    return SQLITE_OK;
+  }
+  return p->real->pMethods->xFileControl(p->real, op, arg);
+}
+
+static int MmapSectorSize(sqlite3_file *file) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xSectorSize(real);
+}
+
+static int MmapDeviceCharacteristics(sqlite3_file *file) {
+  sqlite3_file *real = reinterpret_cast<MmapFile *>(file)->real;
+  return real->pMethods->xDeviceCharacteristics(real);
+}
+
+
+/**
+ * Opens the file through the default VFS and, for read-only main databases,
+ * maps it as long as the mapping fits into Database::mmap_limit_.  If the
+ * file is already mapped by another connection, that mapping is reused.
+ */
+static int MmapOpen(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+                    int flags, int *out_flags)
+{
+  sqlite3_vfs *default_vfs = static_cast<sqlite3_vfs *>(vfs->pAppData);
+  MmapFile *p = reinterpret_cast<MmapFile *>(file);
+  p->real = reinterpret_cast<sqlite3_file *>(p + 1);
+  p->mapping = NULL;
+  p->size = 0;
+  int retval = default_vfs->xOpen(default_vfs, name, p->real, flags, out_flags);
+  if (retval != SQLITE_OK) {
+    p->base.pMethods = NULL;
+    return retval;
+  }
+  p->base.pMethods = &mmap_io_methods_;
+
+  if ((name == NULL) || !(flags & SQLITE_OPEN_MAIN_DB) ||
+      !(flags & SQLITE_OPEN_READONLY))
+  {
+    return SQLITE_OK;
+  }
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return SQLITE_OK;
+  platform_stat64 info;
+  if ((platform_fstat(fd, &info) != 0) || (info.st_size == 0)) {
+    close(fd);
+    return SQLITE_OK;
+  }
+  const int64_t size = info.st_size;
+  const FileId file_id(info.st_dev, info.st_ino);
+
+  pthread_mutex_lock(&lock_mappings_);
+  map<FileId, SharedMapping>::iterator iter = mappings_->find(file_id);
+  if (iter != mappings_->end()) {
+    close(fd);
+    if (iter->second.size != size) {
+      // Catalogs are immutable, don't mix differently sized views of the file
+      pthread_mutex_unlock(&lock_mappings_);
+      return SQLITE_OK;
+    }
+    iter->second.refcount++;
+    pthread_mutex_unlock(&lock_mappings_);
+    p->mapping = iter->second.mapping;
+    p->size = size;
+    p->file_id = file_id;
+    return SQLITE_OK;
+  }
+  if (mmap_used_ + size > static_cast<int64_t>(Database::mmap_limit())) {
+    pthread_mutex_unlock(&lock_mappings_);
+    close(fd);
+    LogCvmfs(kLogCatalog, kLogDebug, "mmap size exhausted, not mapping %s",
+             name);
+    return SQLITE_OK;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    pthread_mutex_unlock(&lock_mappings_);
+    LogCvmfs(kLogCatalog, kLogDebug, "failed to map %s (%d)", name, errno);
+    return SQLITE_OK;
+  }
+  SharedMapping shared;
+  shared.mapping = static_cast<const char *>(mapping);
+  shared.size = size;
+  shared.refcount = 1;
+  (*mappings_)[file_id] = shared;
+  mmap_used_ += size;
+  pthread_mutex_unlock(&lock_mappings_);
+
+  p->mapping = shared.mapping;
+  p->size = size;
+  p->file_id = file_id;
+  return SQLITE_OK;
+}
+
+
+static void RegisterMmapVfs() {
+  mappings_ = new map<FileId, SharedMapping>();
+  sqlite3_vfs *default_vfs = sqlite3_vfs_find(NULL);
+  assert(default_vfs != NULL);
+  mmap_vfs_ = *default_vfs;
+  mmap_vfs_.iVersion = 1;
+  mmap_vfs_.szOsFile = sizeof(MmapFile) + default_vfs->szOsFile;
+  mmap_vfs_.pNext = NULL;
+  mmap_vfs_.zName = kMmapVfsName;
+  mmap_vfs_.pAppData = default_vfs;
+  mmap_vfs_.xOpen = MmapOpen;
+
+  memset(&mmap_io_methods_, 0, sizeof(mmap_io_methods_));
+  // Version 1: read-only catalogs never use WAL and the shared memory calls
+  mmap_io_methods_.iVersion = 1;
+  mmap_io_methods_.xClose = MmapClose;
+  mmap_io_methods_.xRead = MmapRead;
+  mmap_io_methods_.xWrite = MmapWrite;
+  mmap_io_methods_.xTruncate = MmapTruncate;
+  mmap_io_methods_.xSync = MmapSync;
+  mmap_io_methods_.xFileSize = MmapFileSize;
+  mmap_io_methods_.xLock = MmapLock;
+  mmap_io_methods_.xUnlock = MmapUnlock;
+  mmap_io_methods_.xCheckReservedLock = MmapCheckReservedLock;
+  mmap_io_methods_.xFileControl = MmapFileControl;
+  mmap_io_methods_.xSectorSize = MmapSectorSize;
+  mmap_io_methods_.xDeviceCharacteristics = MmapDeviceCharacteristics;
+
+  int retval = sqlite3_vfs_register(&mmap_vfs_, 0);
+  assert(retval == SQLITE_OK);
+}
 
 
 Database::Database(const std::string filename, const OpenMode open_mode) {
@@ -32,12 +284,22 @@ Database::Database(const std::string filename, const OpenMode open_mode) {
   ready_ = false;
   schema_version_ = 0.0;
   sqlite_db_ = NULL;
+  mmapped_ = false;
+  has_listings_ = false;
+  has_bundles_ = false;
+  const char *vfs = NULL;
 
   int flags = SQLITE_OPEN_NOMUTEX;
   switch (open_mode) {
     case kOpenReadOnly:
       flags |= SQLITE_OPEN_READONLY;
       read_write_ = false;
+      if (mmap_enabled()) {
+        // Registering initializes SQlite, so it can't happen before the
+        // memory configuration in main()
+        pthread_once(&mmap_vfs_once_, RegisterMmapVfs);
+        vfs = kMmapVfsName;
+      }
       break;
     case kOpenReadWrite:
       flags |= SQLITE_OPEN_READWRITE;
@@ -50,7 +312,7 @@ Database::Database(const std::string filename, const OpenMode open_mode) {
   // Open database file (depending on the flags read-only or read-write)
   LogCvmfs(kLogCatalog, kLogDebug, "opening database file %s",
            filename_.c_str());
-  if (SQLITE_OK != sqlite3_open_v2(filename_.c_str(), &sqlite_db_, flags, NULL))
+  if (SQLITE_OK != sqlite3_open_v2(filename_.c_str(), &sqlite_db_, flags, vfs))
   {
     LogCvmfs(kLogCatalog, kLogDebug, "cannot open catalog database file %s",
              filename_.c_str());
@@ -58,6 +320,18 @@ Database::Database(const std::string filename, const OpenMode open_mode) {
   }
   sqlite3_extended_result_codes(sqlite_db_, 1);
 
+  if (vfs != NULL) {
+    int is_mapped = 0;
+    retval = sqlite3_file_control(sqlite_db_, "main", kFcntlIsMapped,
+                                  &is_mapped);
+    mmapped_ = (retval == SQLITE_OK) && is_mapped;
+    if (mmapped_) {
+      Sql sql_cache(*this, "PRAGMA cache_size=" +
+                    StringifyInt(kMmapCachePages) + ";");
+      sql_cache.Execute();
+    }
+  }
+
   // Read-ahead into file system buffers
   int fd_readahead = open(filename_.c_str(), O_RDONLY);
   if (fd_readahead < 0) {
@@ -93,6 +367,15 @@ Database::Database(const std::string filename, const OpenMode open_mode) {
     goto database_failure;
   }
 
+  {
+    Sql sql_listings(*this, "SELECT 1 FROM sqlite_master "
+                     "WHERE type='table' AND name='listings';");
+    has_listings_ = sql_listings.FetchRow();
+    Sql sql_bundles(*this, "SELECT 1 FROM sqlite_master "
+                    "WHERE type='table' AND name='bundles';");
+    has_bundles_ = sql_bundles.FetchRow();
+  }
+
   ready_ = true;
   return;
 
@@ -111,6 +394,9 @@ Database::Database(sqlite3 *sqlite_db, const float schema, const bool rw) {
   schema_version_ = schema;
   read_write_ = rw;
   ready_ = false;  // Don't close on delete
+  mmapped_ = false;
+  has_listings_ = false;
+  has_bundles_ = false;
 }
 
 
@@ -339,6 +625,9 @@ unsigned SqlDirent::CreateDatabaseFlags(const DirectoryEntry &entry) const {
   else
     database_flags |= kFlagFile;
 
+  if (entry.IsRegular() && entry.IsChunkedFile())
+    database_flags |= kFlagFileChunk;
+
   return database_flags;
 }
 
@@ -458,6 +747,7 @@ DirectoryEntry SqlLookup::GetDirent(const Catalog *catalog) const {
   result.is_nested_catalog_root_ = (database_flags & kFlagDirNestedRoot);
   result.is_nested_catalog_mountpoint_ =
     (database_flags & kFlagDirNestedMountpoint);
+  result.is_chunked_file_ = (database_flags & kFlagFileChunk);
   const char *name = reinterpret_cast<const char *>(RetrieveText(6));
   const char *symlink = reinterpret_cast<const char *>(RetrieveText(7));
 
@@ -523,9 +813,14 @@ bool SqlLookupPathHash::BindPathHash(const struct hash::Md5 &hash) {
 
 
 SqlLookupInode::SqlLookupInode(const Database &database) {
+  parent_row_column_ =
+    (database.schema_version() < 2.1-Database::kSchemaEpsilon) ? 13 : 15;
   const string statement =
-    "SELECT " + GetFieldsToSelect(database) + " FROM catalog "
-    "WHERE rowid = :rowid;";
+    "SELECT " + GetFieldsToSelect(database) + ", "
+    "  (SELECT parent.rowid FROM catalog AS parent "
+    "   WHERE (parent.md5path_1 = catalog.parent_1) AND "
+    "         (parent.md5path_2 = catalog.parent_2)) "
+    "FROM catalog WHERE rowid = :rowid;";
   Init(database.sqlite_db(), statement);
 }
 
@@ -535,6 +830,311 @@ bool SqlLookupInode::BindRowId(const uint64_t inode) {
 }
 
 
+bool SqlLookupInode::GetParentRowId(uint64_t *row_id) const {
+  if (RetrieveType(parent_row_column_) == SQLITE_NULL)
+    return false;
+  *row_id = RetrieveInt64(parent_row_column_);
+  return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlAllDirents::SqlAllDirents(const Database &database) {
+  const string statement =
+    "SELECT " + GetFieldsToSelect(database) + " FROM catalog;";
+  Init(database.sqlite_db(), statement);
+}
+
+
+LinkString SqlAllDirents::GetSymlink() const {
+  const char *symlink = reinterpret_cast<const char *>(RetrieveText(7));
+  LinkString result;
+  result.Assign(symlink, strlen(symlink));
+  ExpandSymlink(&result);
+  return result;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Precalculated listings are stored as a blob of little-endian integers: the
+ * format version and the number of entries, followed by the fixed-size fields
+ * of the entries, each trailed by its name and symlink.
+ */
+const uint32_t kListingVersion = 1;
+const unsigned kListingHeaderSize = 2*4;
+const unsigned kListingEntrySize = 4*8 + 6*4;
+
+static void PutListingInt(const uint64_t value, const unsigned bytes,
+                          string *blob)
+{
+  for (unsigned i = 0; i < bytes; ++i)
+    blob->push_back(static_cast<char>((value >> (8*i)) & 0xFF));
+}
+
+static uint64_t GetListingInt(const unsigned char *buf, const unsigned bytes) {
+  uint64_t result = 0;
+  for (unsigned i = 0; i < bytes; ++i)
+    result |= static_cast<uint64_t>(buf[i]) << (8*i);
+  return result;
+}
+
+
+SqlListingRows::SqlListingRows(const Database &database) {
+  Init(database.sqlite_db(),
+       "SELECT parent_1, parent_2, rowid, hardlinks, size, mode, mtime, flags, "
+       "name, symlink, uid, gid FROM catalog ORDER BY parent_1, parent_2;");
+}
+
+
+hash::Md5 SqlListingRows::GetParentPathHash() const {
+  return RetrieveMd5(0, 1);
+}
+
+
+ListingRow SqlListingRows::GetRow() const {
+  ListingRow row;
+  row.row_id = RetrieveInt64(2);
+  row.hardlinks = RetrieveInt64(3);
+  row.size = RetrieveInt64(4);
+  row.mode = RetrieveInt(5);
+  row.mtime = RetrieveInt64(6);
+  row.flags = RetrieveInt(7);
+  row.name = string(reinterpret_cast<const char *>(RetrieveText(8)));
+  row.symlink = string(reinterpret_cast<const char *>(RetrieveText(9)));
+  row.uid = RetrieveInt64(10);
+  row.gid = RetrieveInt64(11);
+  return row;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlListingBlob::SqlListingBlob(const Database &database) {
+  if (database.has_listings()) {
+    Init(database.sqlite_db(),
+         "SELECT listing FROM listings "
+         "WHERE (md5path_1 = :md5_1) AND (md5path_2 = :md5_2);");
+  } else {
+    Init(database.sqlite_db(), "SELECT NULL WHERE 0;");
+  }
+}
+
+
+bool SqlListingBlob::BindPathHash(const hash::Md5 &hash) {
+  return BindMd5(1, 2, hash);
+}
+
+
+/**
+ * Decodes a freshly fetched listing.  This method is a friend of
+ * DirectoryEntry.
+ * @return false if the blob is malformed
+ */
+bool SqlListingBlob::GetListing(const Catalog *catalog,
+                                DirectoryEntryList *listing) const
+{
+  const unsigned char *blob =
+    static_cast<const unsigned char *>(RetrieveBlob(0));
+  const unsigned size = RetrieveBytes(0);
+  if ((blob == NULL) || (size < kListingHeaderSize) ||
+      (GetListingInt(blob, 4) != kListingVersion))
+  {
+    return false;
+  }
+  const uint32_t num_entries = GetListingInt(blob + 4, 4);
+  unsigned pos = kListingHeaderSize;
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    if (size - pos < kListingEntrySize)
+      return false;
+    const unsigned char *p = blob + pos;
+    DirectoryEntry dirent;
+    const uint64_t row_id = GetListingInt(p, 8);
+    dirent.hardlinks_ = GetListingInt(p + 8, 8);
+    dirent.size_ = GetListingInt(p + 16, 8);
+    dirent.mtime_ = static_cast<int64_t>(GetListingInt(p + 24, 8));
+    dirent.mode_ = GetListingInt(p + 32, 4);
+    const unsigned database_flags = GetListingInt(p + 36, 4);
+    dirent.uid_ = GetListingInt(p + 40, 4);
+    dirent.gid_ = GetListingInt(p + 44, 4);
+    const uint32_t name_length = GetListingInt(p + 48, 4);
+    const uint32_t symlink_length = GetListingInt(p + 52, 4);
+    pos += kListingEntrySize;
+    if ((size - pos < name_length) ||
+        (size - pos - name_length < symlink_length))
+    {
+      return false;
+    }
+
+    dirent.catalog_ = const_cast<Catalog *>(catalog);
+    dirent.is_nested_catalog_root_ = (database_flags & kFlagDirNestedRoot);
+    dirent.is_nested_catalog_mountpoint_ =
+      (database_flags & kFlagDirNestedMountpoint);
+    dirent.is_chunked_file_ = (database_flags & kFlagFileChunk);
+    dirent.parent_inode_ = DirectoryEntry::kInvalidInode;
+    dirent.inode_ = const_cast<Catalog *>(catalog)->GetMangledInode(row_id,
+      DirectoryEntry::Hardlinks2HardlinkGroup(dirent.hardlinks_));
+    dirent.name_.Assign(reinterpret_cast<const char *>(blob + pos),
+                        name_length);
+    pos += name_length;
+    dirent.symlink_.Assign(reinterpret_cast<const char *>(blob + pos),
+                           symlink_length);
+    pos += symlink_length;
+    ExpandSymlink(&dirent.symlink_);
+    listing->push_back(dirent);
+  }
+  return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlListingBlobInsert::SqlListingBlobInsert(const Database &database) {
+  Init(database.sqlite_db(),
+       "INSERT INTO listings (md5path_1, md5path_2, listing) "
+       "VALUES (:md5_1, :md5_2, :listing);");
+}
+
+
+bool SqlListingBlobInsert::BindPathHash(const hash::Md5 &hash) {
+  return BindMd5(1, 2, hash);
+}
+
+
+bool SqlListingBlobInsert::BindListing(const vector<ListingRow> &rows) {
+  blob_.clear();
+  PutListingInt(kListingVersion, 4, &blob_);
+  PutListingInt(rows.size(), 4, &blob_);
+  for (unsigned i = 0; i < rows.size(); ++i) {
+    const ListingRow &row = rows[i];
+    PutListingInt(row.row_id, 8, &blob_);
+    PutListingInt(row.hardlinks, 8, &blob_);
+    PutListingInt(row.size, 8, &blob_);
+    PutListingInt(row.mtime, 8, &blob_);
+    PutListingInt(row.mode, 4, &blob_);
+    PutListingInt(row.flags, 4, &blob_);
+    PutListingInt(row.uid, 4, &blob_);
+    PutListingInt(row.gid, 4, &blob_);
+    PutListingInt(row.name.length(), 4, &blob_);
+    PutListingInt(row.symlink.length(), 4, &blob_);
+    blob_.append(row.name);
+    blob_.append(row.symlink);
+  }
+  return BindBlob(3, blob_.data(), blob_.length());
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlBundleCandidates::SqlBundleCandidates(const Database &database) {
+  Init(database.sqlite_db(),
+       "SELECT parent_1, parent_2, hash, size FROM catalog "
+       "WHERE (flags & " + StringifyInt(SqlDirent::kFlagFile) + ") AND "
+       "NOT (flags & " + StringifyInt(SqlDirent::kFlagFileChunk) + ") AND "
+       "(size > 0) AND (size <= :max_size) AND (hash IS NOT NULL) "
+       "ORDER BY parent_1, parent_2, name;");
+}
+
+
+bool SqlBundleCandidates::BindMaxSize(const uint64_t max_size) {
+  return BindInt64(1, max_size);
+}
+
+
+hash::Md5 SqlBundleCandidates::GetParentPathHash() const {
+  return RetrieveMd5(0, 1);
+}
+
+
+hash::Any SqlBundleCandidates::GetContentHash() const {
+  return RetrieveSha1Blob(2);
+}
+
+
+uint64_t SqlBundleCandidates::GetSize() const {
+  return RetrieveInt64(3);
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlBundleLookup::SqlBundleLookup(const Database &database) {
+  if (database.has_bundles()) {
+    Init(database.sqlite_db(),
+         "SELECT b.bundle, b.hash, b.offset, b.size "
+         "FROM bundles AS a JOIN bundles AS b ON a.bundle = b.bundle "
+         "WHERE a.hash = :hash ORDER BY b.offset;");
+  } else {
+    Init(database.sqlite_db(), "SELECT NULL, NULL, 0, 0 WHERE 0;");
+  }
+}
+
+
+bool SqlBundleLookup::BindContentHash(const hash::Any &hash) {
+  return BindSha1Blob(1, hash);
+}
+
+
+hash::Any SqlBundleLookup::GetBundleHash() const {
+  return RetrieveSha1Blob(0);
+}
+
+
+BundleMember SqlBundleLookup::GetMember() const {
+  return BundleMember(RetrieveSha1Blob(1), RetrieveInt64(2),
+                      RetrieveInt64(3));
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlBundleRows::SqlBundleRows(const Database &database) {
+  Init(database.sqlite_db(),
+       "SELECT bundle, hash, offset, size FROM bundles "
+       "ORDER BY bundle, offset;");
+}
+
+
+hash::Any SqlBundleRows::GetBundleHash() const {
+  return RetrieveSha1Blob(0);
+}
+
+
+BundleMember SqlBundleRows::GetMember() const {
+  return BundleMember(RetrieveSha1Blob(1), RetrieveInt64(2),
+                      RetrieveInt64(3));
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlBundleInsert::SqlBundleInsert(const Database &database) {
+  Init(database.sqlite_db(),
+       "INSERT INTO bundles (hash, bundle, offset, size) "
+       "VALUES (:hash, :bundle, :offset, :size);");
+}
+
+
+bool SqlBundleInsert::BindBundle(const hash::Any &bundle_hash,
+                                 const BundleMember &member)
+{
+  return BindSha1Blob(1, member.content_hash) &&
+         BindSha1Blob(2, bundle_hash) &&
+         BindInt64(3, member.offset) &&
+         BindInt64(4, member.size);
+}
+
+
 //------------------------------------------------------------------------------
 
 
@@ -753,6 +1353,72 @@ bool SqlUpdateCounter::BindDelta(const int64_t delta) {
 //------------------------------------------------------------------------------
 
 
+SqlChunksListing::SqlChunksListing(const Database &database) {
+  if (database.schema_version() >= 2.4-Database::kSchemaEpsilon) {
+    compat_ = false;
+    Init(database.sqlite_db(),
+         "SELECT offset, size, hash FROM chunks "
+         "WHERE (md5path_1 = :md5_1) AND (md5path_2 = :md5_2) "
+         "ORDER BY offset ASC;");
+  } else {
+    Init(database.sqlite_db(), "SELECT 0, 0, NULL WHERE 0;");
+    compat_ = true;
+  }
+}
+
+
+bool SqlChunksListing::BindPathHash(const hash::Md5 &hash) {
+  if (compat_) return true;
+  return BindMd5(1, 2, hash);
+}
+
+
+FileChunk SqlChunksListing::GetFileChunk() const {
+  return FileChunk(RetrieveSha1Blob(2), RetrieveInt64(0), RetrieveInt64(1));
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlChunkInsert::SqlChunkInsert(const Database &database) {
+  Init(database.sqlite_db(),
+       "INSERT INTO chunks (md5path_1, md5path_2, offset, size, hash) "
+       "VALUES (:md5_1, :md5_2, :offset, :size, :hash);");
+}
+
+
+bool SqlChunkInsert::BindPathHash(const hash::Md5 &hash) {
+  return BindMd5(1, 2, hash);
+}
+
+
+bool SqlChunkInsert::BindFileChunk(const FileChunk &chunk) {
+  return
+    BindInt64(3, chunk.offset) &&
+    BindInt64(4, chunk.size) &&
+    BindSha1Blob(5, chunk.content_hash);
+}
+
+
+//------------------------------------------------------------------------------
+
+
+SqlChunksRemove::SqlChunksRemove(const Database &database) {
+  Init(database.sqlite_db(),
+       "DELETE FROM chunks "
+       "WHERE (md5path_1 = :md5_1) AND (md5path_2 = :md5_2);");
+}
+
+
+bool SqlChunksRemove::BindPathHash(const hash::Md5 &hash) {
+  return BindMd5(1, 2, hash);
+}
+
+
+//------------------------------------------------------------------------------
+
+
 SqlAllChunks::SqlAllChunks(const Database &database) {
   string sql = "SELECT DISTINCT hash, "
   "CASE WHEN flags & " + StringifyInt(SqlDirent::kFlagFile) + " THEN " +
@@ -764,6 +1430,10 @@ SqlAllChunks::SqlAllChunks(const Database &database) {
     sql += " UNION SELECT DISTINCT hash, " + StringifyInt(kChunkPiece) + " " +
       "FROM chunks";
   }
+  if (database.has_bundles()) {
+    sql += " UNION SELECT DISTINCT bundle, " + StringifyInt(kChunkBundle) +
+      " FROM bundles";
+  }
   sql += ";";
   Init(database.sqlite_db(), sql);
 }
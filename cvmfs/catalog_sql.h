@@ -20,6 +20,7 @@
 
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include "hash.h"
 #include "dirent.h"
@@ -31,13 +32,14 @@ namespace catalog {
 class Catalog;
 
 /**
- * Content-addressable chunks can be entire files, micro catalogs (ending L) or
- * pieces of large files (ending C)
+ * Content-addressable chunks can be entire files, micro catalogs (ending L),
+ * pieces of large files (ending C) or bundles of small files (ending B)
  */
 enum ChunkTypes {
   kChunkFile = 0,
   kChunkMicroCatalog,
   kChunkPiece,
+  kChunkBundle,
 };
 
 
@@ -64,14 +66,37 @@ class Database {
   std::string filename() const { return filename_; }
   float schema_version() const { return schema_version_; }
   bool ready() const { return ready_; }
+  bool mmapped() const { return mmapped_; }
+  /**
+   * Catalogs of newer publishers carry the precalculated listings of large
+   * directories.  The table is optional and doesn't change the schema.
+   */
+  bool has_listings() const { return has_listings_; }
+  /**
+   * Likewise optional, the index of the bundles of small files
+   */
+  bool has_bundles() const { return has_bundles_; }
+
+  static void SetMmapLimit(const uint64_t limit) { mmap_limit_ = limit; }
+  static uint64_t mmap_limit() { return mmap_limit_; }
+  static bool mmap_enabled() { return mmap_limit_ > 0; }
  private:
   Database(sqlite3 *sqlite_db, const float schema, const bool rw);
 
+  /**
+   * Upper bound for the sum of all mapped read-only catalog files.  Catalogs
+   * beyond the bound are read through the default VFS.  0 disables mapping.
+   */
+  static uint64_t mmap_limit_;
+
   sqlite3 *sqlite_db_;
   std::string filename_;
   float schema_version_;
   bool read_write_;
   bool ready_;
+  bool mmapped_;
+  bool has_listings_;
+  bool has_bundles_;
 };
 
 
@@ -252,7 +277,7 @@ class SqlDirent : public Sql {
   const static int kFlagFile                = 4;
   const static int kFlagLink                = 8;
   const static int kFlagFileStat            = 16;  // currently unused
-  const static int kFlagFileChunk           = 64;  // currently unused
+  const static int kFlagFileChunk           = 64;
 
  protected:
   /**
@@ -359,10 +384,156 @@ class SqlLookupPathHash : public SqlLookup {
 //------------------------------------------------------------------------------
 
 
+/**
+ * Next to the entry, the statement returns the row id of its parent from the
+ * same catalog, so that inode lookups don't need a second query for the
+ * parent inode.
+ */
 class SqlLookupInode : public SqlLookup {
  public:
   SqlLookupInode(const Database &database);
   bool BindRowId(const uint64_t inode);
+  /**
+   * @return false if the parent is not in this catalog, i.e. for the root
+   *         entry of a catalog
+   */
+  bool GetParentRowId(uint64_t *row_id) const;
+
+ private:
+  int parent_row_column_;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Iterates over all directory entries of a catalog, in order to build a
+ * CatalogIndex.
+ */
+class SqlAllDirents : public SqlLookup {
+ public:
+  SqlAllDirents(const Database &database);
+  LinkString GetSymlink() const;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * A directory entry as it is stored in a precalculated listing
+ */
+struct ListingRow {
+  ListingRow() : row_id(0), hardlinks(0), size(0), mtime(0), mode(0),
+                 flags(0), uid(0), gid(0) { }
+  uint64_t row_id;
+  uint64_t hardlinks;
+  uint64_t size;
+  int64_t mtime;
+  uint32_t mode;
+  uint32_t flags;
+  uint32_t uid;
+  uint32_t gid;
+  std::string name;
+  std::string symlink;
+};
+
+
+/**
+ * Iterates over all directory entries of a catalog grouped by their parent,
+ * in order to precalculate the listings.
+ */
+class SqlListingRows : public Sql {
+ public:
+  SqlListingRows(const Database &database);
+  hash::Md5 GetParentPathHash() const;
+  ListingRow GetRow() const;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Fetches the precalculated listing of a directory.  Catalogs without the
+ * listings table never find a listing.
+ */
+class SqlListingBlob : public SqlDirent {
+ public:
+  SqlListingBlob(const Database &database);
+  bool BindPathHash(const hash::Md5 &hash);
+  bool GetListing(const Catalog *catalog, DirectoryEntryList *listing) const;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+class SqlListingBlobInsert : public Sql {
+ public:
+  SqlListingBlobInsert(const Database &database);
+  bool BindPathHash(const hash::Md5 &hash);
+  bool BindListing(const std::vector<ListingRow> &rows);
+ private:
+  std::string blob_;  ///< Bound as static blob, kept until the next bind
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Iterates over the regular, unchunked files up to a given size grouped by
+ * their parent, in order to bundle them.
+ */
+class SqlBundleCandidates : public Sql {
+ public:
+  SqlBundleCandidates(const Database &database);
+  bool BindMaxSize(const uint64_t max_size);
+  hash::Md5 GetParentPathHash() const;
+  hash::Any GetContentHash() const;
+  uint64_t GetSize() const;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Finds all members of the bundle that contains the given object.  Catalogs
+ * without the bundles table never find a bundle.
+ */
+class SqlBundleLookup : public Sql {
+ public:
+  SqlBundleLookup(const Database &database);
+  bool BindContentHash(const hash::Any &hash);
+  hash::Any GetBundleHash() const;
+  BundleMember GetMember() const;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/**
+ * Iterates over the bundles table ordered by bundle and offset
+ */
+class SqlBundleRows : public Sql {
+ public:
+  SqlBundleRows(const Database &database);
+  hash::Any GetBundleHash() const;
+  BundleMember GetMember() const;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+class SqlBundleInsert : public Sql {
+ public:
+  SqlBundleInsert(const Database &database);
+  bool BindBundle(const hash::Any &bundle_hash, const BundleMember &member);
 };
 
 
@@ -483,6 +654,44 @@ class SqlUpdateCounter : public Sql {
 //------------------------------------------------------------------------------
 
 
+/**
+ * Lists the pieces of a chunked file ordered by offset.  Catalogs before
+ * schema 2.4 have no chunks.
+ */
+class SqlChunksListing : public Sql {
+ public:
+  SqlChunksListing(const Database &database);
+  bool BindPathHash(const hash::Md5 &hash);
+  FileChunk GetFileChunk() const;
+ private:
+  bool compat_;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+class SqlChunkInsert : public Sql {
+ public:
+  SqlChunkInsert(const Database &database);
+  bool BindPathHash(const hash::Md5 &hash);
+  bool BindFileChunk(const FileChunk &chunk);
+};
+
+
+//------------------------------------------------------------------------------
+
+
+class SqlChunksRemove : public Sql {
+ public:
+  SqlChunksRemove(const Database &database);
+  bool BindPathHash(const hash::Md5 &hash);
+};
+
+
+//------------------------------------------------------------------------------
+
+
 class SqlAllChunks : public Sql {
  public:
   SqlAllChunks(const Database &database);
@@ -5,19 +5,37 @@
  * a set of functions to conveniently compress and decompress stuff.
  * Allmost all of the functions return true on success, otherwise false.
  *
+ * Instead of zlib, new objects can be compressed as LZ4 frames, which
+ * decompress several times faster.  Decompression looks at the first byte of
+ * an object to tell the codecs apart.
+ *
+ * Data objects that do not compress, such as images or archives, are stored
+ * as zlib streams of uncompressed blocks.  Any zlib decoder reads them, so
+ * that they need no marker, and inflating them is a plain copy.
+ *
  * TODO: think about code deduplication
  */
 
 #include "cvmfs_config.h"
 #include "compression.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <alloca.h>
+#include <unistd.h>
 
 #include <cstring>
 #include <cassert>
 
+#include <algorithm>
+#include <vector>
+
+#ifdef HAVE_LZ4FRAME_H
+#include <lz4frame.h>
+#endif
+
+#include "platform.h"
 #include "logging.h"
 #include "hash.h"
 #include "util.h"
@@ -26,10 +44,18 @@
 using namespace std;  // NOLINT
 
 
+/**
+ * Tries an in-kernel copy first, objects copied by the spooler and by
+ * replication are already compressed.
+ */
 static bool CopyFile2File(FILE *fsrc, FILE *fdest) {
   unsigned char buf[1024];
   rewind(fsrc);
   rewind(fdest);
+  if (platform_copy_file(fileno(fsrc), fileno(fdest)))
+    return true;
+  rewind(fsrc);
+  rewind(fdest);
 
   size_t have;
   do {
@@ -124,6 +150,112 @@ namespace zlib {
 const unsigned kZChunk = 16384;
 const unsigned kBufferSize = 32768;
 
+/**
+ * Files of at least kParallelMinSize bytes are always compressed in blocks
+ * of that size, on as many threads as configured.  Every block uses the last
+ * kParallelDictSize bytes of its predecessor as dictionary, so the
+ * compression ratio is close to the one of the serial stream.  The output
+ * depends on the block size only, not on the number of threads, so that
+ * the content hash of a file does not depend on the publisher's settings.
+ * Objects published before are serial zlib streams, verification accepts
+ * both encodings.
+ */
+const unsigned kParallelBlockSize = 1024*1024;
+const unsigned kParallelDictSize = 32768;
+const uint64_t kParallelMinSize = 8*1024*1024;
+
+static unsigned num_compress_threads_ = 1;
+
+/**
+ * Codec of newly compressed objects.
+ */
+static Algorithms compress_algorithm_ = kZlibDefault;
+
+/**
+ * LZ4 frames start with the magic number 0x184D2204 in little endian.  The
+ * first byte of a zlib stream carries the compression method 8 in its lower
+ * four bits, so that the first byte tells the codecs apart.
+ */
+const unsigned char kLz4MagicByte = 0x04;
+
+/**
+ * The first kSampleSize bytes of a data object are deflated to tell whether
+ * the object compresses.  It is stored if the sample shrinks to no less than
+ * kStoredRatio percent.  Objects smaller than kMinSampleSize are always
+ * compressed, they cost little either way.
+ */
+const unsigned kSampleSize = 65536;
+const unsigned kMinSampleSize = 4096;
+const unsigned kStoredRatio = 95;
+const unsigned kStoredBlockSize = 65535;  /**< largest stored deflate block */
+
+
+bool ParseAlgorithm(const string &name, Algorithms *algorithm) {
+  if ((name == "") || (name == "default") || (name == "zlib")) {
+    *algorithm = kZlibDefault;
+    return true;
+  }
+  if (name == "lz4") {
+    *algorithm = kLz4;
+    return true;
+  }
+  return false;
+}
+
+
+string AlgorithmName(const Algorithms algorithm) {
+  switch (algorithm) {
+    case kLz4:
+      return "lz4";
+    case kZlibStored:
+      return "zlib (stored)";
+    default:
+      return "zlib";
+  }
+}
+
+
+bool IsAvailable(const Algorithms algorithm) {
+  if (algorithm == kLz4) {
+#ifdef HAVE_LZ4FRAME_H
+    return true;
+#else
+    return false;
+#endif
+  }
+  return true;
+}
+
+
+/**
+ * Sets the codec for all following compressions.  Fails if cvmfs was built
+ * without support for the codec.
+ */
+bool SetCompressAlgorithm(const Algorithms algorithm) {
+  if (!IsAvailable(algorithm))
+    return false;
+  compress_algorithm_ = algorithm;
+  return true;
+}
+
+
+Algorithms GetCompressAlgorithm() {
+  return compress_algorithm_;
+}
+
+
+/**
+ * Sets the number of threads used to compress a single large file.  Values
+ * smaller than 2 turn parallel compression off.
+ */
+void SetCompressThreads(const unsigned num_threads) {
+  num_compress_threads_ = num_threads;
+}
+
+unsigned GetCompressThreads() {
+  return num_compress_threads_;
+}
+
 void CompressInit(z_stream *strm) {
   strm->zalloc = Z_NULL;
   strm->zfree = Z_NULL;
@@ -156,6 +288,116 @@ void DecompressFini(z_stream *strm) {
 }
 
 
+/**
+ * Setting up a stream is expensive compared to compressing a small object,
+ * deflate allocates some 256kB of state.  Therefore released streams are kept
+ * per thread and reset for the next object.  Streams can be released on
+ * another thread than the one that acquired them.
+ */
+const unsigned kMaxPooledStreams = 32;
+
+struct StreamPool {
+  vector<z_stream *> deflate_streams;
+  vector<z_stream *> inflate_streams;
+};
+
+static pthread_once_t stream_pool_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t stream_pool_key_;
+
+
+static void FreeStreamPool(void *data) {
+  StreamPool *pool = static_cast<StreamPool *>(data);
+  for (unsigned i = 0; i < pool->deflate_streams.size(); ++i) {
+    CompressFini(pool->deflate_streams[i]);
+    delete pool->deflate_streams[i];
+  }
+  for (unsigned i = 0; i < pool->inflate_streams.size(); ++i) {
+    DecompressFini(pool->inflate_streams[i]);
+    delete pool->inflate_streams[i];
+  }
+  delete pool;
+}
+
+
+static void InitStreamPoolKey() {
+  int retval = pthread_key_create(&stream_pool_key_, FreeStreamPool);
+  assert(retval == 0);
+}
+
+
+static StreamPool *GetStreamPool() {
+  pthread_once(&stream_pool_once_, InitStreamPoolKey);
+  StreamPool *pool =
+    static_cast<StreamPool *>(pthread_getspecific(stream_pool_key_));
+  if (pool == NULL) {
+    pool = new StreamPool();
+    int retval = pthread_setspecific(stream_pool_key_, pool);
+    assert(retval == 0);
+  }
+  return pool;
+}
+
+
+/**
+ * Returns a deflate stream ready for a new object, taken from the pool of the
+ * calling thread if possible.
+ */
+z_stream *CompressAcquire() {
+  StreamPool *pool = GetStreamPool();
+  if (!pool->deflate_streams.empty()) {
+    z_stream *strm = pool->deflate_streams.back();
+    pool->deflate_streams.pop_back();
+    return strm;
+  }
+  z_stream *strm = new z_stream;
+  CompressInit(strm);
+  return strm;
+}
+
+
+void CompressRelease(z_stream *strm) {
+  StreamPool *pool = GetStreamPool();
+  if ((pool->deflate_streams.size() < kMaxPooledStreams) &&
+      (deflateReset(strm) == Z_OK))
+  {
+    strm->next_in = Z_NULL;
+    strm->avail_in = 0;
+    pool->deflate_streams.push_back(strm);
+    return;
+  }
+  CompressFini(strm);
+  delete strm;
+}
+
+
+z_stream *DecompressAcquire() {
+  StreamPool *pool = GetStreamPool();
+  if (!pool->inflate_streams.empty()) {
+    z_stream *strm = pool->inflate_streams.back();
+    pool->inflate_streams.pop_back();
+    return strm;
+  }
+  z_stream *strm = new z_stream;
+  DecompressInit(strm);
+  return strm;
+}
+
+
+void DecompressRelease(z_stream *strm) {
+  StreamPool *pool = GetStreamPool();
+  if ((pool->inflate_streams.size() < kMaxPooledStreams) &&
+      (inflateReset(strm) == Z_OK))
+  {
+    strm->next_in = Z_NULL;
+    strm->avail_in = 0;
+    pool->inflate_streams.push_back(strm);
+    return;
+  }
+  DecompressFini(strm);
+  delete strm;
+}
+
+
 StreamStates DecompressZStream2File(z_stream *strm, FILE *f, const void *buf,
                                     const int64_t size)
 {
@@ -192,6 +434,464 @@ StreamStates DecompressZStream2File(z_stream *strm, FILE *f, const void *buf,
 }
 
 
+/**
+ * Destination of a compressed or decompressed stream: a file, a growing
+ * memory block, and / or a hash context.
+ */
+struct StreamSink {
+  StreamSink() : fdest(NULL), out_buf(NULL), out_size(NULL), alloc_size(0),
+                 hash_context(NULL) { }
+  FILE *fdest;
+  void **out_buf;
+  int64_t *out_size;
+  uint64_t alloc_size;
+  hash::ContextPtr *hash_context;
+};
+
+
+static bool WriteStreamSink(const void *buf, const size_t size, void *ctx) {
+  StreamSink *sink = reinterpret_cast<StreamSink *>(ctx);
+  if (size == 0)
+    return true;
+  if (sink->fdest) {
+    if ((fwrite(buf, 1, size, sink->fdest) != size) || ferror(sink->fdest))
+      return false;
+  }
+  if (sink->out_buf) {
+    if (*sink->out_buf == NULL) {
+      sink->alloc_size = kZChunk;
+      *sink->out_buf = smalloc(sink->alloc_size);
+      *sink->out_size = 0;
+    }
+    if (*sink->out_size + size > sink->alloc_size) {
+      while (*sink->out_size + size > sink->alloc_size)
+        sink->alloc_size *= 2;
+      *sink->out_buf = srealloc(*sink->out_buf, sink->alloc_size);
+    }
+    memcpy(static_cast<unsigned char *>(*sink->out_buf) + *sink->out_size,
+           buf, size);
+    *sink->out_size += size;
+  }
+  if (sink->hash_context) {
+    hash::Update(static_cast<const unsigned char *>(buf), size,
+                 *sink->hash_context);
+  }
+  return true;
+}
+
+
+void DecompressInit(DecompressStream *stream) {
+  stream->algorithm = kZlibDefault;
+  stream->detected = false;
+  stream->finished = false;
+  stream->zstream = NULL;
+  stream->lz4_context = NULL;
+}
+
+
+void DecompressFini(DecompressStream *stream) {
+  if (!stream->detected)
+    return;
+  if (stream->algorithm == kZlibDefault) {
+    DecompressRelease(stream->zstream);
+    stream->zstream = NULL;
+  } else {
+#ifdef HAVE_LZ4FRAME_H
+    (void)LZ4F_freeDecompressionContext(
+      reinterpret_cast<LZ4F_decompressionContext_t>(stream->lz4_context));
+#endif
+    stream->lz4_context = NULL;
+  }
+  stream->detected = false;
+}
+
+
+/**
+ * Sets up the codec of the stream according to its first bytes.  Does nothing
+ * if the codec is already known.
+ */
+void DecompressDetect(DecompressStream *stream, const void *buf,
+                      const int64_t size)
+{
+  if (stream->detected || (size <= 0))
+    return;
+
+  stream->detected = true;
+  stream->finished = false;
+  if (*static_cast<const unsigned char *>(buf) != kLz4MagicByte) {
+    stream->algorithm = kZlibDefault;
+    stream->zstream = DecompressAcquire();
+    return;
+  }
+
+  stream->algorithm = kLz4;
+#ifdef HAVE_LZ4FRAME_H
+  LZ4F_decompressionContext_t context;
+  size_t retval = LZ4F_createDecompressionContext(&context, LZ4F_VERSION);
+  assert(!LZ4F_isError(retval));
+  stream->lz4_context = context;
+#endif
+}
+
+
+#ifdef HAVE_LZ4FRAME_H
+static StreamStates DecompressLz4(DecompressStream *stream, const void *buf,
+                                  const int64_t size,
+                                  DecompressSink sink, void *ctx)
+{
+  LZ4F_decompressionContext_t context =
+    reinterpret_cast<LZ4F_decompressionContext_t>(stream->lz4_context);
+  unsigned char out[kZChunk];
+  const unsigned char *in = static_cast<const unsigned char *>(buf);
+  int64_t pos = 0;
+  size_t out_size;
+
+  // Continue without further input as long as the output buffer fills up
+  do {
+    size_t in_size = size - pos;
+    out_size = kZChunk;
+    const size_t hint =
+      LZ4F_decompress(context, out, &out_size, in + pos, &in_size, NULL);
+    if (LZ4F_isError(hint))
+      return kStreamError;
+    pos += in_size;
+    if ((out_size > 0) && !sink(out, out_size, ctx))
+      return kStreamError;
+    if (hint == 0)
+      stream->finished = true;
+  } while (!stream->finished && ((pos < size) || (out_size == kZChunk)));
+
+  return stream->finished ? kStreamEnd : kStreamContinue;
+}
+#endif
+
+
+/**
+ * Decompresses the next piece of an object of any codec into sink.  Data
+ * after the end of the compressed stream is ignored.
+ */
+StreamStates DecompressStream2Sink(DecompressStream *stream, const void *buf,
+                                   const int64_t size,
+                                   DecompressSink sink, void *ctx)
+{
+  DecompressDetect(stream, buf, size);
+  if (!stream->detected)
+    return kStreamContinue;
+  if (stream->finished)
+    return kStreamEnd;
+
+  if (stream->algorithm != kZlibDefault) {
+#ifdef HAVE_LZ4FRAME_H
+    return DecompressLz4(stream, buf, size, sink, ctx);
+#else
+    LogCvmfs(kLogCompress, kLogDebug, "no support for LZ4 compressed data");
+    return kStreamError;
+#endif
+  }
+
+  z_stream *strm = stream->zstream;
+  unsigned char out[kZChunk];
+  int z_ret;
+  int64_t pos = 0;
+
+  do {
+    strm->avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
+    strm->next_in = ((unsigned char *)buf)+pos;
+
+    // Run inflate() on input until output buffer not full
+    do {
+      strm->avail_out = kZChunk;
+      strm->next_out = out;
+      z_ret = inflate(strm, Z_NO_FLUSH);
+      switch (z_ret) {
+        case Z_NEED_DICT:
+          z_ret = Z_DATA_ERROR;  // and fall through
+        case Z_STREAM_ERROR:
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+          return kStreamError;
+      }
+      if (!sink(out, kZChunk - strm->avail_out, ctx))
+        return kStreamError;
+    } while (strm->avail_out == 0);
+
+    pos += kZChunk;
+  } while ((pos < size) && (z_ret != Z_STREAM_END));
+
+  if (z_ret != Z_STREAM_END)
+    return kStreamContinue;
+  stream->finished = true;
+  return kStreamEnd;
+}
+
+
+StreamStates DecompressStream2File(DecompressStream *stream, FILE *f,
+                                   const void *buf, const int64_t size)
+{
+  StreamSink sink;
+  sink.fdest = f;
+  return DecompressStream2Sink(stream, buf, size, WriteStreamSink, &sink);
+}
+
+
+#ifdef HAVE_LZ4FRAME_H
+/**
+ * Frames use blocks of 64kB that get only written once they are full.  Thus
+ * the output depends on the input data alone and not on how it is read.  As
+ * with the adler32 sum of zlib, a checksum detects corrupted frames.
+ */
+static void InitLz4Preferences(LZ4F_preferences_t *prefs) {
+  memset(prefs, 0, sizeof(*prefs));
+  prefs->frameInfo.blockSizeID = LZ4F_max64KB;
+  prefs->frameInfo.blockMode = LZ4F_blockLinked;
+  prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+  prefs->autoFlush = 0;
+}
+
+
+/**
+ * Compresses either the file fsrc or size bytes of buf into an LZ4 frame.
+ */
+static bool CompressLz4(FILE *fsrc, const void *buf, const int64_t size,
+                        StreamSink *sink)
+{
+  LZ4F_preferences_t prefs;
+  InitLz4Preferences(&prefs);
+  LZ4F_compressionContext_t context;
+  if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION)))
+    return false;
+
+  const size_t out_capacity = LZ4F_compressBound(kZChunk, &prefs);
+  unsigned char *out = static_cast<unsigned char *>(smalloc(out_capacity));
+  unsigned char in[kZChunk];
+  const unsigned char *next_in;
+  size_t have_in;
+  int64_t pos = 0;
+  bool result = false;
+
+  size_t have = LZ4F_compressBegin(context, out, out_capacity, &prefs);
+  if (LZ4F_isError(have) || !WriteStreamSink(out, have, sink))
+    goto compress_lz4_final;
+
+  while (true) {
+    if (fsrc) {
+      have_in = fread(in, 1, kZChunk, fsrc);
+      if (ferror(fsrc)) goto compress_lz4_final;
+      next_in = in;
+    } else {
+      have_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
+      next_in = static_cast<const unsigned char *>(buf) + pos;
+      pos += have_in;
+    }
+    if (have_in == 0)
+      break;
+
+    have = LZ4F_compressUpdate(context, out, out_capacity, next_in, have_in,
+                               NULL);
+    if (LZ4F_isError(have) || !WriteStreamSink(out, have, sink))
+      goto compress_lz4_final;
+  }
+
+  have = LZ4F_compressEnd(context, out, out_capacity, NULL);
+  if (LZ4F_isError(have) || !WriteStreamSink(out, have, sink))
+    goto compress_lz4_final;
+  result = true;
+
+ compress_lz4_final:
+  (void)LZ4F_freeCompressionContext(context);
+  free(out);
+  return result;
+}
+#endif
+
+
+/**
+ * Writes either the file fsrc or size bytes of buf as a zlib stream of
+ * stored blocks.  The blocks have a fixed size, so that the output depends on
+ * the input data alone.
+ */
+static bool CompressStored(FILE *fsrc, const void *buf, const int64_t size,
+                           StreamSink *sink)
+{
+  // zlib header for the compression level 0 and a 32kB window
+  const unsigned char header[2] = {0x78, 0x01};
+  if (!WriteStreamSink(header, 2, sink))
+    return false;
+
+  unsigned char *in = NULL;
+  if (fsrc)
+    in = static_cast<unsigned char *>(smalloc(kStoredBlockSize));
+  uLong adler = adler32(0L, Z_NULL, 0);
+  int64_t pos = 0;
+  bool last = false;
+  bool result = false;
+  while (!last) {
+    const unsigned char *next_in;
+    size_t have;
+    if (fsrc) {
+      have = fread(in, 1, kStoredBlockSize, fsrc);
+      if (ferror(fsrc)) goto compress_stored_final;
+      if (have < kStoredBlockSize) {
+        last = true;
+      } else {
+        const int c = getc(fsrc);
+        if (c == EOF)
+          last = true;
+        else
+          ungetc(c, fsrc);
+      }
+      next_in = in;
+    } else {
+      have = (kStoredBlockSize > (size-pos)) ? size-pos : kStoredBlockSize;
+      next_in = static_cast<const unsigned char *>(buf) + pos;
+      pos += have;
+      last = (pos == size);
+    }
+
+    const unsigned char block_header[5] = {
+      static_cast<unsigned char>(last ? 1 : 0),
+      static_cast<unsigned char>(have),
+      static_cast<unsigned char>(have >> 8),
+      static_cast<unsigned char>(~have),
+      static_cast<unsigned char>(~have >> 8)
+    };
+    if (!WriteStreamSink(block_header, 5, sink) ||
+        !WriteStreamSink(next_in, have, sink))
+    {
+      goto compress_stored_final;
+    }
+    adler = adler32(adler, next_in, have);
+  }
+
+  {
+    const unsigned char trailer[4] = {
+      static_cast<unsigned char>(adler >> 24),
+      static_cast<unsigned char>(adler >> 16),
+      static_cast<unsigned char>(adler >> 8),
+      static_cast<unsigned char>(adler)
+    };
+    result = WriteStreamSink(trailer, 4, sink);
+  }
+
+ compress_stored_final:
+  free(in);
+  return result;
+}
+
+
+/**
+ * Deflates the first kSampleSize bytes of either the file fsrc or buf.  The
+ * file is rewound to where the sample started.  Returns false if the file
+ * cannot be read.
+ */
+static bool SampleCompressible(FILE *fsrc, const void *buf,
+                               const int64_t size, bool *compressible)
+{
+  *compressible = true;
+  unsigned char *sample = NULL;
+  const unsigned char *in;
+  size_t have;
+  if (fsrc) {
+    const long start = ftell(fsrc);
+    if (start < 0)
+      return false;
+    sample = static_cast<unsigned char *>(smalloc(kSampleSize));
+    have = fread(sample, 1, kSampleSize, fsrc);
+    const bool failed = ferror(fsrc);
+    if (failed || (fseek(fsrc, start, SEEK_SET) != 0)) {
+      free(sample);
+      return false;
+    }
+    in = sample;
+  } else {
+    have = (size > kSampleSize) ? kSampleSize : size;
+    in = static_cast<const unsigned char *>(buf);
+  }
+
+  if (have >= kMinSampleSize) {
+    z_stream *strm = CompressAcquire();
+    const uLong capacity = deflateBound(strm, have);
+    unsigned char *out = static_cast<unsigned char *>(smalloc(capacity));
+    strm->next_in = const_cast<unsigned char *>(in);
+    strm->avail_in = have;
+    strm->next_out = out;
+    strm->avail_out = capacity;
+    if (deflate(strm, Z_FINISH) == Z_STREAM_END)
+      *compressible = (strm->total_out * 100 < have * kStoredRatio);
+    CompressRelease(strm);
+    free(out);
+  }
+  free(sample);
+  return true;
+}
+
+
+/**
+ * The codec for a new data object, the configured one unless zlib objects do
+ * not compress.
+ */
+static bool SelectAlgorithm(FILE *fsrc, const void *buf, const int64_t size,
+                            Algorithms *algorithm)
+{
+  *algorithm = compress_algorithm_;
+  if (compress_algorithm_ != kZlibDefault)
+    return true;
+  bool compressible;
+  if (!SampleCompressible(fsrc, buf, size, &compressible))
+    return false;
+  if (!compressible)
+    *algorithm = kZlibStored;
+  return true;
+}
+
+
+/**
+ * Compresses with a codec other than zlib into any combination of a file, a
+ * memory block and a hash.  The input is either the file fsrc or buf.
+ */
+static bool CompressAlternative(const Algorithms algorithm,
+                                FILE *fsrc, const void *buf,
+                                const int64_t size, FILE *fdest,
+                                void **out_buf, int64_t *out_size,
+                                hash::Any *compressed_hash)
+{
+  StreamSink sink;
+  sink.fdest = fdest;
+  if (out_buf) {
+    *out_buf = NULL;
+    *out_size = 0;
+    sink.out_buf = out_buf;
+    sink.out_size = out_size;
+  }
+  hash::ContextPtr hash_context(compressed_hash ? compressed_hash->algorithm :
+                                hash::kSha1);
+  if (compressed_hash) {
+    hash_context.buffer = alloca(hash_context.size);
+    hash::Init(hash_context);
+    sink.hash_context = &hash_context;
+  }
+
+  bool result = false;
+  if (algorithm == kZlibStored)
+    result = CompressStored(fsrc, buf, size, &sink);
+#ifdef HAVE_LZ4FRAME_H
+  if (algorithm == kLz4)
+    result = CompressLz4(fsrc, buf, size, &sink);
+#endif
+  LogCvmfs(kLogCompress, kLogDebug, "%s compression finished with result %d",
+           AlgorithmName(algorithm).c_str(), result);
+
+  if (out_buf && (!result || (*out_buf == NULL))) {
+    free(*out_buf);
+    *out_buf = result ? smalloc(1) : NULL;
+    *out_size = 0;
+  }
+  if (result && compressed_hash)
+    hash::Final(hash_context, compressed_hash);
+  return result;
+}
+
+
 bool CompressPath2Path(const string &src, const string &dest) {
   FILE *fsrc = fopen(src.c_str(), "r");
   if (!fsrc) {
@@ -275,38 +975,42 @@ bool DecompressPath2Path(const string &src, const string &dest) {
 }
 
 
-bool CompressFile2Null(FILE *fsrc, hash::Any *compressed_hash) {
+static bool CompressParallel(FILE *fsrc, const unsigned char *src_buf,
+                             const uint64_t src_size, FILE *fdest,
+                             const unsigned num_threads,
+                             hash::Any *compressed_hash);
+
+static bool CompressZlibFile2Null(FILE *fsrc, hash::Any *compressed_hash) {
   int z_ret, flush;
-  bool result = -1;
+  bool result = false;
   unsigned have;
-  z_stream strm;
+  z_stream *strm = CompressAcquire();
   unsigned char in[kZChunk];
   unsigned char out[kZChunk];
   hash::ContextPtr hash_context(compressed_hash->algorithm);
 
-  CompressInit(&strm);
   hash_context.buffer = alloca(hash_context.size);
   hash::Init(hash_context);
 
   // Compress until end of file
   do {
-    strm.avail_in = fread(in, 1, kZChunk, fsrc);
+    strm->avail_in = fread(in, 1, kZChunk, fsrc);
     if (ferror(fsrc)) goto compress_file2null_final;
 
     flush = feof(fsrc) ? Z_FINISH : Z_NO_FLUSH;
-    strm.next_in = in;
+    strm->next_in = in;
 
     // Run deflate() on input until output buffer not full, finish
     // compression if all of source has been read in
     do {
-      strm.avail_out = kZChunk;
-      strm.next_out = out;
-      z_ret = deflate(&strm, flush);  // no bad return value
+      strm->avail_out = kZChunk;
+      strm->next_out = out;
+      z_ret = deflate(strm, flush);  // no bad return value
       if (z_ret == Z_STREAM_ERROR)
         goto compress_file2null_final;  // state not clobbered
-      have = kZChunk - strm.avail_out;
+      have = kZChunk - strm->avail_out;
       hash::Update(out, have, hash_context);
-    } while (strm.avail_out == 0);
+    } while (strm->avail_out == 0);
 
     // Done when last data in file processed
   } while (flush != Z_FINISH);
@@ -319,43 +1023,184 @@ bool CompressFile2Null(FILE *fsrc, hash::Any *compressed_hash) {
 
   // Clean up and return
  compress_file2null_final:
-  CompressFini(&strm);
+  CompressRelease(strm);
   LogCvmfs(kLogCompress, kLogDebug, "file compression finished with result %d",
            result);
   return result;
 }
 
 
+/**
+ * Reproduces the content hash of a data object from CompressPath2File().
+ */
+bool CompressFile2Null(FILE *fsrc, hash::Any *compressed_hash) {
+  Algorithms algorithm;
+  if (!SelectAlgorithm(fsrc, NULL, 0, &algorithm))
+    return false;
+  if (algorithm != kZlibDefault) {
+    return CompressAlternative(algorithm, fsrc, NULL, 0, NULL,
+                               NULL, NULL, compressed_hash);
+  }
+  return CompressZlibFile2Null(fsrc, compressed_hash);
+}
+
+
+/**
+ * Reproduces the content hash of a file that was compressed by
+ * CompressFile2File() with the given codec, in parallel blocks if the
+ * compression used them (older catalog deltas record serial streams).  The
+ * parallel output depends on the block size only, so that the blocks are
+ * compressed one after another here.
+ */
+bool CompressPath2Null(const string &src, const Algorithms algorithm,
+                       const bool parallel, hash::Any *compressed_hash)
+{
+  FILE *fsrc = fopen(src.c_str(), "r");
+  if (!fsrc)
+    return false;
+
+  bool result;
+  platform_stat64 info;
+  if (algorithm != kZlibDefault) {
+    result = IsAvailable(algorithm) &&
+             CompressAlternative(algorithm, fsrc, NULL, 0, NULL, NULL, NULL,
+                                 compressed_hash);
+  } else if (parallel && (platform_fstat(fileno(fsrc), &info) == 0) &&
+             (static_cast<uint64_t>(info.st_size) >= kParallelMinSize))
+  {
+    result = CompressParallel(fsrc, NULL, 0, NULL, 1, compressed_hash);
+  } else {
+    result = CompressZlibFile2Null(fsrc, compressed_hash);
+  }
+  fclose(fsrc);
+  return result;
+}
+
+
+/**
+ * Objects of that size are compressed in parallel blocks by
+ * CompressFile2File().
+ */
+bool IsParallelSize(const uint64_t size) {
+  return size >= kParallelMinSize;
+}
+
+
+/**
+ * Calculates the content hash of a file in the parallel block encoding,
+ * regardless of its size.  Used to verify objects that might have been
+ * published either way, see IsParallelSize().
+ */
+bool CompressFile2NullParallel(FILE *fsrc, hash::Any *compressed_hash) {
+  return CompressParallel(fsrc, NULL, 0, NULL, 1, compressed_hash);
+}
+
+
+bool CompressMem2NullParallel(const void *buf, const int64_t size,
+                              hash::Any *compressed_hash)
+{
+  return CompressParallel(NULL, static_cast<const unsigned char *>(buf), size,
+                          NULL, 1, compressed_hash);
+}
+
+
+/**
+ * Calculates the hash of the compressed buffer, e.g. of a memory mapped file.
+ */
+bool CompressMem2Null(const void *buf, const int64_t size,
+                      hash::Any *compressed_hash)
+{
+  Algorithms algorithm;
+  SelectAlgorithm(NULL, buf, size, &algorithm);
+  return CompressMem2Null(buf, size, algorithm, compressed_hash);
+}
+
+
+/**
+ * Calculates the hash of the buffer compressed with a specific codec.
+ */
+bool CompressMem2Null(const void *buf, const int64_t size,
+                      const Algorithms algorithm, hash::Any *compressed_hash)
+{
+  if (algorithm != kZlibDefault) {
+    if (!IsAvailable(algorithm))
+      return false;
+    return CompressAlternative(algorithm, NULL, buf, size, NULL, NULL, NULL,
+                               compressed_hash);
+  }
+
+  unsigned char out[kBufferSize];
+  int z_ret;
+  int flush;
+  z_stream *strm = CompressAcquire();
+  int64_t pos = 0;
+  hash::ContextPtr hash_context(compressed_hash->algorithm);
+
+  hash_context.buffer = alloca(hash_context.size);
+  hash::Init(hash_context);
+
+  do {
+    strm->avail_in = (kBufferSize > (size-pos)) ? size-pos : kBufferSize;
+    flush = (pos + kBufferSize) >= size ? Z_FINISH : Z_NO_FLUSH;
+    strm->next_in = ((unsigned char *)buf) + pos;
+
+    // Run deflate() on input until output buffer not full
+    do {
+      strm->avail_out = kBufferSize;
+      strm->next_out = out;
+      z_ret = deflate(strm, flush);
+      if (z_ret == Z_STREAM_ERROR) {
+        CompressRelease(strm);
+        return false;
+      }
+      hash::Update(out, kBufferSize - strm->avail_out, hash_context);
+    } while (strm->avail_out == 0);
+
+    pos += kBufferSize;
+  } while (flush != Z_FINISH);
+
+  CompressRelease(strm);
+  if (z_ret != Z_STREAM_END)
+    return false;
+  hash::Final(hash_context, compressed_hash);
+  return true;
+}
+
+
 bool CompressFile2File(FILE *fsrc, FILE *fdest) {
+  if (compress_algorithm_ != kZlibDefault) {
+    return CompressAlternative(compress_algorithm_, fsrc, NULL, 0, fdest,
+                               NULL, NULL, NULL);
+  }
+
   int z_ret, flush;
   bool result = false;
   unsigned have;
-  z_stream strm;
+  z_stream *strm = CompressAcquire();
   unsigned char in[kZChunk];
   unsigned char out[kZChunk];
 
-  CompressInit(&strm);
 
   // Compress until end of file
   do {
-    strm.avail_in = fread(in, 1, kZChunk, fsrc);
+    strm->avail_in = fread(in, 1, kZChunk, fsrc);
     if (ferror(fsrc)) goto compress_file2file_final;
 
     flush = feof(fsrc) ? Z_FINISH : Z_NO_FLUSH;
-    strm.next_in = in;
+    strm->next_in = in;
 
     // Run deflate() on input until output buffer not full, finish
     // compression if all of source has been read in
     do {
-      strm.avail_out = kZChunk;
-      strm.next_out = out;
-      z_ret = deflate(&strm, flush);  // no bad return value
+      strm->avail_out = kZChunk;
+      strm->next_out = out;
+      z_ret = deflate(strm, flush);  // no bad return value
       if (z_ret == Z_STREAM_ERROR)
         goto compress_file2file_final;  // state not clobbered
-      have = kZChunk - strm.avail_out;
+      have = kZChunk - strm->avail_out;
       if (fwrite(out, 1, have, fdest) != have || ferror(fdest))
         goto compress_file2file_final;
-    } while (strm.avail_out == 0);
+    } while (strm->avail_out == 0);
 
     // Done when last data in file processed
   } while (flush != Z_FINISH);
@@ -367,7 +1212,7 @@ bool CompressFile2File(FILE *fsrc, FILE *fdest) {
 
   // Clean up and return
  compress_file2file_final:
-  CompressFini(&strm);
+  CompressRelease(strm);
   LogCvmfs(kLogCompress, kLogDebug, "file compression finished with result %d",
            result);
   return result;
@@ -375,51 +1220,290 @@ bool CompressFile2File(FILE *fsrc, FILE *fdest) {
 
 bool CompressPath2File(const string &src, FILE *fdest,
                        hash::Any *compressed_hash)
+{
+  Algorithms algorithm;
+  return CompressPath2File(src, fdest, compressed_hash, &algorithm);
+}
+
+
+/**
+ * Compresses a data object, incompressible objects are stored.  Returns the
+ * codec that was used in algorithm.
+ */
+bool CompressPath2File(const string &src, FILE *fdest,
+                       hash::Any *compressed_hash, Algorithms *algorithm)
 {
   FILE *fsrc = fopen(src.c_str(), "r");
   if (!fsrc)
     return false;
 
-  bool retval = CompressFile2File(fsrc, fdest, compressed_hash);
+  bool retval = SelectAlgorithm(fsrc, NULL, 0, algorithm);
+  if (retval) {
+    if (*algorithm == kZlibDefault) {
+      retval = CompressFile2File(fsrc, fdest, compressed_hash);
+    } else {
+      retval = CompressAlternative(*algorithm, fsrc, NULL, 0, fdest,
+                                   NULL, NULL, compressed_hash);
+    }
+  }
   fclose(fsrc);
   return retval;
 }
 
 
+/**
+ * One block of a parallel compression.  The block is compressed as raw
+ * deflate data that ends on a byte boundary (or with the final block).
+ */
+struct ParallelBlock {
+  const unsigned char *in;
+  unsigned in_size;
+  const unsigned char *dict;
+  unsigned dict_size;
+  bool last;
+  unsigned char *out;
+  unsigned out_size;
+  uLong adler;
+  bool result;
+};
+
+
+static void *MainCompressBlock(void *data) {
+  ParallelBlock *block = reinterpret_cast<ParallelBlock *>(data);
+  block->result = false;
+  block->out = NULL;
+  block->out_size = 0;
+  block->adler = adler32(adler32(0L, Z_NULL, 0), block->in, block->in_size);
+
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    return NULL;
+  }
+  if ((block->dict_size > 0) &&
+      (deflateSetDictionary(&strm, block->dict, block->dict_size) != Z_OK))
+  {
+    goto compress_block_final;
+  }
+
+  {
+    // Room for the empty stored block of the sync flush
+    unsigned capacity = deflateBound(&strm, block->in_size) + 16;
+    block->out = reinterpret_cast<unsigned char *>(smalloc(capacity));
+    strm.next_in = const_cast<unsigned char *>(block->in);
+    strm.avail_in = block->in_size;
+    const int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int z_ret;
+    do {
+      if (block->out_size == capacity) {
+        capacity *= 2;
+        block->out =
+          reinterpret_cast<unsigned char *>(srealloc(block->out, capacity));
+      }
+      strm.next_out = block->out + block->out_size;
+      strm.avail_out = capacity - block->out_size;
+      z_ret = deflate(&strm, flush);
+      if (z_ret == Z_STREAM_ERROR)
+        goto compress_block_final;
+      block->out_size = capacity - strm.avail_out;
+    } while (strm.avail_out == 0);
+    if (block->last && (z_ret != Z_STREAM_END))
+      goto compress_block_final;
+  }
+  block->result = true;
+
+ compress_block_final:
+  deflateEnd(&strm);
+  return NULL;
+}
+
+
+/**
+ * Compresses in the pigz style: the input is cut into blocks that are
+ * deflated in parallel and concatenated.  The result is a standard zlib
+ * stream, the checksum of the trailer is combined from the blocks' checksums.
+ * The content hash is computed over the compressed bytes as they are written.
+ * The input is either the file fsrc or src_buf.  Without fdest, only the
+ * content hash is computed.  With a single thread, the blocks are compressed
+ * by the calling thread.
+ */
+static bool CompressParallel(FILE *fsrc, const unsigned char *src_buf,
+                             const uint64_t src_size, FILE *fdest,
+                             const unsigned num_threads,
+                             hash::Any *compressed_hash)
+{
+  bool result = false;
+  hash::ContextPtr hash_context(compressed_hash->algorithm);
+  hash_context.buffer = alloca(hash_context.size);
+  hash::Init(hash_context);
+
+  // Dictionary of the first block followed by the blocks of one round.  A
+  // memory source is used in place.
+  const unsigned buf_size = kParallelDictSize + num_threads*kParallelBlockSize;
+  unsigned char *buf = fsrc ?
+    reinterpret_cast<unsigned char *>(smalloc(buf_size)) : NULL;
+  uint64_t src_pos = 0;
+  std::vector<ParallelBlock> blocks(num_threads);
+  std::vector<pthread_t> threads(num_threads);
+  unsigned dict_size = 0;
+  uLong adler = adler32(0L, Z_NULL, 0);
+  bool last = false;
+
+  // zlib header for the default compression level and a 32kB window
+  const unsigned char header[2] = {0x78, 0x9c};
+  if (fdest && (fwrite(header, 1, 2, fdest) != 2))
+    goto compress_parallel_final;
+  hash::Update(header, 2, hash_context);
+
+  while (!last) {
+    const unsigned char *in;
+    size_t have;
+    if (fsrc) {
+      in = buf + kParallelDictSize;
+      have = fread(buf + kParallelDictSize, 1,
+                   num_threads*kParallelBlockSize, fsrc);
+      if (ferror(fsrc))
+        goto compress_parallel_final;
+      if (have < num_threads*kParallelBlockSize) {
+        last = true;
+      } else {
+        const int c = getc(fsrc);
+        if (c == EOF)
+          last = true;
+        else
+          ungetc(c, fsrc);
+      }
+    } else {
+      in = src_buf + src_pos;
+      have = (src_size - src_pos < num_threads*kParallelBlockSize) ?
+             src_size - src_pos : num_threads*kParallelBlockSize;
+      src_pos += have;
+      last = (src_pos == src_size);
+    }
+
+    unsigned num_blocks = 0;
+    for (size_t pos = 0; (pos < have) || (num_blocks == 0);
+         pos += kParallelBlockSize)
+    {
+      ParallelBlock *block = &blocks[num_blocks];
+      block->in = in + pos;
+      block->in_size = (have - pos < kParallelBlockSize) ?
+                       have - pos : kParallelBlockSize;
+      block->dict = block->in - dict_size;
+      block->dict_size = dict_size;
+      block->last = last && (pos + block->in_size == have);
+      dict_size = (block->in_size < kParallelDictSize) ?
+                  block->in_size : kParallelDictSize;
+      if (num_threads == 1) {
+        MainCompressBlock(block);
+      } else {
+        int retval = pthread_create(&threads[num_blocks], NULL,
+                                    MainCompressBlock, block);
+        assert(retval == 0);
+      }
+      num_blocks++;
+    }
+    for (unsigned i = 0; (num_threads > 1) && (i < num_blocks); ++i)
+      pthread_join(threads[i], NULL);
+
+    bool round_ok = true;
+    for (unsigned i = 0; i < num_blocks; ++i) {
+      ParallelBlock *block = &blocks[i];
+      if (round_ok && block->result &&
+          (!fdest ||
+           (fwrite(block->out, 1, block->out_size, fdest) == block->out_size)))
+      {
+        hash::Update(block->out, block->out_size, hash_context);
+        adler = adler32_combine(adler, block->adler, block->in_size);
+      } else {
+        round_ok = false;
+      }
+      free(block->out);
+    }
+    if (!round_ok || (fdest && ferror(fdest)))
+      goto compress_parallel_final;
+
+    // Keep the tail of the last block as dictionary for the next round
+    if (fsrc && !last)
+      memmove(buf + kParallelDictSize - dict_size, in + have - dict_size,
+              dict_size);
+  }
+
+  {
+    const unsigned char trailer[4] = {
+      static_cast<unsigned char>(adler >> 24),
+      static_cast<unsigned char>(adler >> 16),
+      static_cast<unsigned char>(adler >> 8),
+      static_cast<unsigned char>(adler)
+    };
+    if (fdest && (fwrite(trailer, 1, 4, fdest) != 4))
+      goto compress_parallel_final;
+    hash::Update(trailer, 4, hash_context);
+  }
+
+  hash::Final(hash_context, compressed_hash);
+  result = true;
+
+ compress_parallel_final:
+  free(buf);
+  LogCvmfs(kLogCompress, kLogDebug,
+           "parallel file compression finished with result %d", result);
+  return result;
+}
+
+
 bool CompressFile2File(FILE *fsrc, FILE *fdest, hash::Any *compressed_hash) {
+  if (compress_algorithm_ != kZlibDefault) {
+    return CompressAlternative(compress_algorithm_, fsrc, NULL, 0, fdest,
+                               NULL, NULL, compressed_hash);
+  }
+
+  platform_stat64 info;
+  if ((platform_fstat(fileno(fsrc), &info) == 0) && S_ISREG(info.st_mode) &&
+      (static_cast<uint64_t>(info.st_size) >= kParallelMinSize))
+  {
+    const unsigned num_threads =
+      (num_compress_threads_ > 0) ? num_compress_threads_ : 1;
+    return CompressParallel(fsrc, NULL, 0, fdest, num_threads,
+                            compressed_hash);
+  }
+
   int z_ret, flush;
   bool result = false;
   unsigned have;
-  z_stream strm;
+  z_stream *strm = CompressAcquire();
   unsigned char in[kZChunk];
   unsigned char out[kZChunk];
   hash::ContextPtr hash_context(compressed_hash->algorithm);
 
-  CompressInit(&strm);
   hash_context.buffer = alloca(hash_context.size);
   hash::Init(hash_context);
 
   // Compress until end of file
   do {
-    strm.avail_in = fread(in, 1, kZChunk, fsrc);
+    strm->avail_in = fread(in, 1, kZChunk, fsrc);
     if (ferror(fsrc)) goto compress_file2file_hashed_final;
 
     flush = feof(fsrc) ? Z_FINISH : Z_NO_FLUSH;
-    strm.next_in = in;
+    strm->next_in = in;
 
     // Run deflate() on input until output buffer not full, finish
     // compression if all of source has been read in
     do {
-      strm.avail_out = kZChunk;
-      strm.next_out = out;
-      z_ret = deflate(&strm, flush);  // no bad return value
+      strm->avail_out = kZChunk;
+      strm->next_out = out;
+      z_ret = deflate(strm, flush);  // no bad return value
       if (z_ret == Z_STREAM_ERROR)
         goto compress_file2file_hashed_final;  // state not clobbered
-      have = kZChunk - strm.avail_out;
+      have = kZChunk - strm->avail_out;
       if (fwrite(out, 1, have, fdest) != have || ferror(fdest))
         goto compress_file2file_hashed_final;
       hash::Update(out, have, hash_context);
-    } while (strm.avail_out == 0);
+    } while (strm->avail_out == 0);
 
     // Done when last data in file processed
   } while (flush != Z_FINISH);
@@ -432,7 +1516,7 @@ bool CompressFile2File(FILE *fsrc, FILE *fdest, hash::Any *compressed_hash) {
 
   // Clean up and return
  compress_file2file_hashed_final:
-  CompressFini(&strm);
+  CompressRelease(strm);
   LogCvmfs(kLogCompress, kLogDebug, "file compression finished with result %d",
            result);
   return result;
@@ -442,14 +1526,14 @@ bool CompressFile2File(FILE *fsrc, FILE *fdest, hash::Any *compressed_hash) {
 bool DecompressFile2File(FILE *fsrc, FILE *fdest) {
   bool result = false;
   StreamStates stream_state = kStreamError;
-  z_stream strm;
+  DecompressStream strm;
   size_t have;
   unsigned char buf[kBufferSize];
 
   DecompressInit(&strm);
 
   while ((have = fread(buf, 1, kBufferSize, fsrc)) > 0) {
-    stream_state = DecompressZStream2File(&strm, fdest, buf, have);
+    stream_state = DecompressStream2File(&strm, fdest, buf, have);
     if (stream_state == kStreamError)
       goto decompress_file2file_final;
   }
@@ -472,47 +1556,51 @@ bool DecompressFile2File(FILE *fsrc, FILE *fdest) {
 bool CompressMem2Mem(const void *buf, const int64_t size,
                     void **out_buf, int64_t *out_size)
 {
+  if (compress_algorithm_ != kZlibDefault) {
+    return CompressAlternative(compress_algorithm_, NULL, buf, size, NULL,
+                               out_buf, out_size, NULL);
+  }
+
   unsigned char out[kZChunk];
   int z_ret;
   int flush;
-  z_stream strm;
+  z_stream *strm = CompressAcquire();
   int64_t pos = 0;
   uint64_t alloc_size = kZChunk;
 
-  CompressInit(&strm);
   *out_buf = smalloc(alloc_size);
   *out_size = 0;
 
   do {
-    strm.avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
+    strm->avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
     flush = (pos + kZChunk) >= size ? Z_FINISH : Z_NO_FLUSH;
-    strm.next_in = ((unsigned char *)buf) + pos;
+    strm->next_in = ((unsigned char *)buf) + pos;
 
     // Run deflate() on input until output buffer not full
     do {
-      strm.avail_out = kZChunk;
-      strm.next_out = out;
-      z_ret = deflate(&strm, flush);
+      strm->avail_out = kZChunk;
+      strm->next_out = out;
+      z_ret = deflate(strm, flush);
       if (z_ret == Z_STREAM_ERROR) {
-        CompressFini(&strm);
+        CompressRelease(strm);
         free(*out_buf);
         *out_buf = NULL;
         *out_size = 0;
         return false;
       }
-      size_t have = kZChunk - strm.avail_out;
+      size_t have = kZChunk - strm->avail_out;
       if (*out_size+have > alloc_size) {
         alloc_size *= 2;
         *out_buf = srealloc(*out_buf, alloc_size);
       }
       memcpy(static_cast<unsigned char *>(*out_buf) + *out_size, out, have);
       *out_size += have;
-    } while (strm.avail_out == 0);
+    } while (strm->avail_out == 0);
 
     pos += kZChunk;
   } while (flush != Z_FINISH);
 
-  CompressFini(&strm);
+  CompressRelease(strm);
   if (z_ret != Z_STREAM_END) {
     free(*out_buf);
     *out_buf = NULL;
@@ -530,50 +1618,72 @@ bool CompressMem2Mem(const void *buf, const int64_t size,
 bool DecompressMem2Mem(const void *buf, const int64_t size,
                        void **out_buf, int64_t *out_size)
 {
+  const unsigned char *in = static_cast<const unsigned char *>(buf);
+  if ((size > 0) && (in[0] == kLz4MagicByte)) {
+    StreamSink sink;
+    *out_buf = NULL;
+    *out_size = 0;
+    sink.out_buf = out_buf;
+    sink.out_size = out_size;
+    DecompressStream stream;
+    DecompressInit(&stream);
+    const StreamStates state =
+      DecompressStream2Sink(&stream, buf, size, WriteStreamSink, &sink);
+    DecompressFini(&stream);
+    if ((state == kStreamEnd) && (*out_buf == NULL))
+      *out_buf = smalloc(1);
+    if (state != kStreamEnd) {
+      free(*out_buf);
+      *out_buf = NULL;
+      *out_size = 0;
+      return false;
+    }
+    return true;
+  }
+
   unsigned char out[kZChunk];
   int z_ret;
-  z_stream strm;
+  z_stream *strm = DecompressAcquire();
   int64_t pos = 0;
   uint64_t alloc_size = kZChunk;
 
-  DecompressInit(&strm);
   *out_buf = smalloc(alloc_size);
   *out_size = 0;
 
   do {
-    strm.avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
-    strm.next_in = ((unsigned char *)buf)+pos;
+    strm->avail_in = (kZChunk > (size-pos)) ? size-pos : kZChunk;
+    strm->next_in = ((unsigned char *)buf)+pos;
 
     // Run inflate() on input until output buffer not full
     do {
-      strm.avail_out = kZChunk;
-      strm.next_out = out;
-      z_ret = inflate(&strm, Z_NO_FLUSH);
+      strm->avail_out = kZChunk;
+      strm->next_out = out;
+      z_ret = inflate(strm, Z_NO_FLUSH);
       switch (z_ret) {
         case Z_NEED_DICT:
           z_ret = Z_DATA_ERROR;  // and fall through
         case Z_STREAM_ERROR:
         case Z_DATA_ERROR:
         case Z_MEM_ERROR:
-          DecompressFini(&strm);
+          DecompressRelease(strm);
           free(*out_buf);
           *out_buf = NULL;
           *out_size = 0;
           return false;
       }
-      size_t have = kZChunk - strm.avail_out;
+      size_t have = kZChunk - strm->avail_out;
       if (*out_size+have > alloc_size) {
         alloc_size *= 2;
         *out_buf = srealloc(*out_buf, alloc_size);
       }
       memcpy(static_cast<unsigned char *>(*out_buf) + *out_size, out, have);
       *out_size += have;
-    } while (strm.avail_out == 0);
+    } while (strm->avail_out == 0);
 
     pos += kZChunk;
   } while (pos < size);
 
-  DecompressFini(&strm);
+  DecompressRelease(strm);
   if (z_ret != Z_STREAM_END) {
     free(*out_buf);
     *out_buf = NULL;
@@ -584,4 +1694,82 @@ bool DecompressMem2Mem(const void *buf, const int64_t size,
   return true;
 }
 
+
+
+const char kBlockMagic[8] = { 'C', 'V', 'M', 'F', 'S', 'Z', 'B', '1' };
+
+/**
+ * Reads and checks the header and the block offsets of a file in the block
+ * format.  The caller knows the format from the file name, the header only
+ * guards against corruption.
+ */
+bool ReadBlockIndex(const int fd, BlockHeader *header,
+                    vector<uint64_t> *offsets)
+{
+  if ((pread(fd, header, sizeof(*header), 0) != sizeof(*header)) ||
+      (memcmp(header->magic, kBlockMagic, sizeof(header->magic)) != 0) ||
+      (header->block_size == 0) ||
+      (header->num_blocks !=
+       (header->size + header->block_size - 1) / header->block_size))
+  {
+    return false;
+  }
+
+  offsets->resize(header->num_blocks + 1);
+  const int64_t index_size = offsets->size() * sizeof(uint64_t);
+  if ((pread(fd, &(*offsets)[0], index_size, sizeof(*header)) != index_size) ||
+      ((*offsets)[0] != sizeof(*header) + index_size))
+  {
+    return false;
+  }
+  for (unsigned i = 0; i < header->num_blocks; ++i) {
+    if ((*offsets)[i] >= (*offsets)[i+1])
+      return false;
+  }
+  return true;
+}
+
+
+/**
+ * Inflates a whole file in the block format.  User of the function has to
+ * free out_buf, if successful.
+ */
+bool DecompressBlocks2Mem(const int fd, void **out_buf, int64_t *out_size) {
+  *out_buf = NULL;
+  *out_size = 0;
+  BlockHeader header;
+  vector<uint64_t> offsets;
+  if (!ReadBlockIndex(fd, &header, &offsets))
+    return false;
+
+  unsigned char *buffer =
+    static_cast<unsigned char *>(smalloc(header.size > 0 ? header.size : 1));
+  uint64_t pos = 0;
+  for (unsigned i = 0; i < header.num_blocks; ++i) {
+    const uint64_t zsize = offsets[i+1] - offsets[i];
+    const uint64_t length =
+      std::min(uint64_t(header.block_size), header.size - pos);
+    unsigned char *zblock = static_cast<unsigned char *>(smalloc(zsize));
+    void *plain = NULL;
+    int64_t plain_size = 0;
+    const bool result =
+      (pread(fd, zblock, zsize, offsets[i]) == int64_t(zsize)) &&
+      DecompressMem2Mem(zblock, zsize, &plain, &plain_size) &&
+      (uint64_t(plain_size) == length);
+    free(zblock);
+    if (!result) {
+      free(plain);
+      free(buffer);
+      return false;
+    }
+    memcpy(buffer + pos, plain, length);
+    free(plain);
+    pos += length;
+  }
+
+  *out_buf = buffer;
+  *out_size = header.size;
+  return true;
+}
+
 }  // namespace zlib
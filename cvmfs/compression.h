@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include <string>
+#include <vector>
 
 #include "duplex_zlib.h"
 
@@ -32,24 +33,89 @@ enum StreamStates {
   kStreamEnd,
 };
 
+/**
+ * Codecs for the objects of a repository.  Zlib is always available, LZ4 only
+ * if cvmfs was built with liblz4.  Decompression detects the codec of every
+ * object, so that zlib objects remain readable in any case.
+ */
+enum Algorithms {
+  kZlibDefault = 0,
+  kLz4,
+  kZlibStored,  /**< zlib stream of uncompressed blocks */
+};
+
+bool ParseAlgorithm(const std::string &name, Algorithms *algorithm);
+std::string AlgorithmName(const Algorithms algorithm);
+bool IsAvailable(const Algorithms algorithm);
+bool SetCompressAlgorithm(const Algorithms algorithm);
+Algorithms GetCompressAlgorithm();
+
+void SetCompressThreads(const unsigned num_threads);
+unsigned GetCompressThreads();
+
 void CompressInit(z_stream *strm);
 void DecompressInit(z_stream *strm);
 void CompressFini(z_stream *strm);
 void DecompressFini(z_stream *strm);
 
+// Reset streams from a thread-local pool, cheaper than Init / Fini
+z_stream *CompressAcquire();
+void CompressRelease(z_stream *strm);
+z_stream *DecompressAcquire();
+void DecompressRelease(z_stream *strm);
+
 StreamStates DecompressZStream2File(z_stream *strm, FILE *f, const void *buf,
                                     const int64_t size);
 
+/**
+ * Decompression state of a single object of any codec.  The codec is taken
+ * from the first received bytes.
+ */
+struct DecompressStream {
+  Algorithms algorithm;
+  bool detected;
+  bool finished;
+  z_stream *zstream;  /**< From the thread-local pool */
+  void *lz4_context;
+};
+
+/**
+ * Receives decompressed data, returns false to abort the decompression.
+ */
+typedef bool (*DecompressSink)(const void *buf, const size_t size, void *ctx);
+
+void DecompressInit(DecompressStream *stream);
+void DecompressFini(DecompressStream *stream);
+void DecompressDetect(DecompressStream *stream, const void *buf,
+                      const int64_t size);
+StreamStates DecompressStream2Sink(DecompressStream *stream, const void *buf,
+                                   const int64_t size,
+                                   DecompressSink sink, void *ctx);
+StreamStates DecompressStream2File(DecompressStream *stream, FILE *f,
+                                   const void *buf, const int64_t size);
+
 bool CompressPath2Path(const std::string &src, const std::string &dest);
 bool CompressPath2Path(const std::string &src, const std::string &dest,
                        hash::Any *compressed_hash);
 bool DecompressPath2Path(const std::string &src, const std::string &dest);
 
 bool CompressFile2Null(FILE *fsrc, hash::Any *compressed_hash);
+bool CompressPath2Null(const std::string &src, const Algorithms algorithm,
+                       const bool parallel, hash::Any *compressed_hash);
+bool CompressMem2Null(const void *buf, const int64_t size,
+                      hash::Any *compressed_hash);
+bool CompressMem2Null(const void *buf, const int64_t size,
+                      const Algorithms algorithm, hash::Any *compressed_hash);
+bool IsParallelSize(const uint64_t size);
+bool CompressFile2NullParallel(FILE *fsrc, hash::Any *compressed_hash);
+bool CompressMem2NullParallel(const void *buf, const int64_t size,
+                              hash::Any *compressed_hash);
 bool CompressFile2File(FILE *fsrc, FILE *fdest);
 bool CompressFile2File(FILE *fsrc, FILE *fdest, hash::Any *compressed_hash);
 bool CompressPath2File(const std::string &src, FILE *fdest,
                        hash::Any *compressed_hash);
+bool CompressPath2File(const std::string &src, FILE *fdest,
+                       hash::Any *compressed_hash, Algorithms *algorithm);
 bool DecompressFile2File(FILE *fsrc, FILE *fdest);
 
 // User of these functions has to free out_buf, if successful
@@ -58,6 +124,23 @@ bool CompressMem2Mem(const void *buf, const int64_t size,
 bool DecompressMem2Mem(const void *buf, const int64_t size,
                        void **out_buf, int64_t *out_size);
 
+/**
+ * Random-access format of compressed cache objects: the header, the offsets
+ * of the independently deflated blocks plus the end offset, the blocks.
+ */
+struct BlockHeader {
+  char magic[8];
+  uint32_t block_size;
+  uint32_t num_blocks;
+  uint64_t size;  /**< uncompressed size */
+};
+
+extern const char kBlockMagic[8];
+
+bool ReadBlockIndex(const int fd, BlockHeader *header,
+                    std::vector<uint64_t> *offsets);
+bool DecompressBlocks2Mem(const int fd, void **out_buf, int64_t *out_size);
+
 }  // namespace zlib
 
 #endif  // CVMFS_COMPRESSION_H_
@@ -19,6 +19,7 @@
 
 #define ENOATTR ENODATA  /**< instead of including attr/xattr.h */
 #define FUSE_USE_VERSION 26
+#define __STDC_FORMAT_MACROS
 
 #include "cvmfs_config.h"
 
@@ -35,6 +36,7 @@
 #include <sys/mount.h>
 #include <sys/file.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
@@ -45,8 +47,6 @@
 #include <openssl/crypto.h>
 #include <fuse/fuse_lowlevel.h>
 #include <fuse/fuse_opt.h>
-#include <google/dense_hash_map>
-#include "MurmurHash2.h"
 
 #include <cstdlib>
 #include <cstring>
@@ -58,6 +58,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
 #include <algorithm>
 #include <functional>
 
@@ -67,6 +68,16 @@
 #include "download.h"
 #include "cache.h"
 #include "nfs_maps.h"
+#include "prefetch.h"
+#include "alloc_counter.h"
+#include "page_cache.h"
+#include "prefix_accounting.h"
+#include "fuse_workers.h"
+#include "read_ahead.h"
+#include "warmup.h"
+#include "notification.h"
+#include "memory_budget.h"
+#include "memcache_snapshot.h"
 #include "hash.h"
 #include "talk.h"
 #include "monitor.h"
@@ -77,11 +88,15 @@
 #include "lru.h"
 #include "peers.h"
 #include "dirent.h"
+#include "catalog_index.h"
 #include "compression.h"
 #include "duplex_sqlite3.h"
 #include "shortstring.h"
 #include "smalloc.h"
 #include "globals.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "sharded_counter.h"
 
 #ifdef FUSE_CAP_EXPORT_SUPPORT
 #define CVMFS_NFS_SUPPORT
@@ -89,26 +104,179 @@
 #warning "No NFS support, Fuse too old"
 #endif
 
+#if defined(FUSE_CAP_SPLICE_WRITE) && (FUSE_VERSION >= 29)
+#define CVMFS_SPLICE_SUPPORT
+#endif
+
+#if FUSE_VERSION >= 28
+#define CVMFS_NOTIFY_SUPPORT
+#endif
+
 using namespace std;  // NOLINT
 
 namespace cvmfs {
 
 const uint64_t kDefaultMemcache = 16*1024*1024;  // 16M RAM for meta-data caches
+const uint64_t kDefaultListingCache = 4*1024*1024;  // 4M for directory listings
+const uint64_t kMemoryTierMaxObject = 16*1024;  // Larger files are not in RAM
+/**
+ * File handles with this bit set point to a cache::MemoryObject instead of a
+ * file descriptor
+ */
+const uint64_t kMemoryHandle = uint64_t(1) << 63;
+/**
+ * File handles with this bit set point to a ChunkedFile, whose pieces are
+ * fetched on demand
+ */
+const uint64_t kChunkedHandle = uint64_t(1) << 62;
+/**
+ * File handles with this bit set point to a download in progress, see
+ * cache::StartStreaming()
+ */
+const uint64_t kStreamingHandle = uint64_t(1) << 61;
+const uint64_t kMinStreamingSize = 1024*1024;  // Smaller files are fetched
+/**
+ * File handles with this bit set point to a cache::CompressedObject, whose
+ * blocks are inflated on read
+ */
+const uint64_t kCompressedHandle = uint64_t(1) << 60;
 const unsigned int kShortTermTTL = 180;  /**< If catalog reload fails, try again
                                               in 3 minutes */
+const unsigned kNotifiedTTL = 4*3600;  /**< Catalog TTL while revision
+                                          notifications arrive */
 const time_t kIndefiniteDeadline = time_t(-1);
 
 const int kMaxInitIoDelay = 32; /**< Maximum start value for exponential
                                      backoff */
 const int kMaxIoDelay = 2000; /**< Maximum 2 seconds */
 const int kForgetDos = 10000; /**< Clear DoS memory after 10 seconds */
+
 /**
- * Prevent DoS attacks on the Squid server
+ * Prevent DoS attacks on the Squid server: failing opens are answered after
+ * an exponentially growing delay.  The replies are queued and sent by a timer
+ * thread, so that the Fuse worker threads remain free to serve cached
+ * meta-data while the network is down.
  */
-static struct {
-  time_t timestamp;
-  int delay;
-} previous_io_error_;
+class DeferredErrorReplies {
+ public:
+  DeferredErrorReplies() {
+    timestamp_ = 0;
+    delay_ = 0;
+    spawned_ = false;
+    terminate_ = false;
+    int retval = pthread_mutex_init(&lock_, NULL);
+    retval |= pthread_cond_init(&cond_, NULL);
+    assert(retval == 0);
+  }
+
+  ~DeferredErrorReplies() {
+    Fini();
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  /**
+   * Starts the timer thread.  Has to be called after daemonizing.
+   */
+  void Spawn() {
+    int retval = pthread_create(&thread_timer_, NULL, MainTimer, this);
+    assert(retval == 0);
+    spawned_ = true;
+  }
+
+  /**
+   * Stops the timer thread and sends all outstanding replies immediately.
+   */
+  void Fini() {
+    if (!spawned_)
+      return;
+    pthread_mutex_lock(&lock_);
+    terminate_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_timer_, NULL);
+    spawned_ = false;
+  }
+
+  void Reply(fuse_req_t req, const int error) {
+    const uint64_t now = GetTimeMs();
+    pthread_mutex_lock(&lock_);
+    if (now - timestamp_ < uint64_t(kForgetDos)) {
+      if (delay_ < kMaxIoDelay)
+        delay_ *= 2;
+    } else {
+      // Initial delay
+      delay_ = (random() % (kMaxInitIoDelay-1)) + 2;
+    }
+    timestamp_ = now;
+    if (!spawned_) {
+      pthread_mutex_unlock(&lock_);
+      fuse_reply_err(req, error);
+      return;
+    }
+    const uint64_t deadline = now + delay_;
+    const bool is_first = queue_.empty() || (deadline < queue_.begin()->first);
+    queue_.insert(std::make_pair(deadline, PendingReply(req, error)));
+    if (is_first)
+      pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+ private:
+  typedef std::pair<fuse_req_t, int> PendingReply;  // request, error code
+  typedef std::multimap<uint64_t, PendingReply> Queue;  // deadline in ms
+
+  static uint64_t GetTimeMs() {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    return uint64_t(tv_now.tv_sec)*1000 + tv_now.tv_usec/1000;
+  }
+
+  static void *MainTimer(void *data) {
+    DeferredErrorReplies *replies = static_cast<DeferredErrorReplies *>(data);
+    LogCvmfs(kLogCvmfs, kLogDebug, "starting deferred error reply thread");
+
+    pthread_mutex_lock(&replies->lock_);
+    while (true) {
+      const uint64_t now = GetTimeMs();
+      Queue *queue = &replies->queue_;
+      while (!queue->empty() &&
+             ((queue->begin()->first <= now) || replies->terminate_))
+      {
+        const PendingReply reply = queue->begin()->second;
+        queue->erase(queue->begin());
+        fuse_reply_err(reply.first, reply.second);
+      }
+      if (replies->terminate_)
+        break;
+
+      if (queue->empty()) {
+        pthread_cond_wait(&replies->cond_, &replies->lock_);
+      } else {
+        const uint64_t deadline = queue->begin()->first;
+        struct timespec abstime;
+        abstime.tv_sec = deadline/1000;
+        abstime.tv_nsec = (deadline % 1000) * 1000 * 1000;
+        pthread_cond_timedwait(&replies->cond_, &replies->lock_, &abstime);
+      }
+    }
+    pthread_mutex_unlock(&replies->lock_);
+
+    LogCvmfs(kLogCvmfs, kLogDebug, "stopping deferred error reply thread");
+    return NULL;
+  }
+
+  Queue queue_;
+  uint64_t timestamp_;  /**< time of the last I/O error in ms */
+  int delay_;  /**< current delay in ms */
+  bool spawned_;
+  bool terminate_;
+  pthread_t thread_timer_;
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+};
+DeferredErrorReplies *deferred_error_replies_ = NULL;
+
 
 /**
  * For cvmfs_opendir / cvmfs_readdir
@@ -121,8 +289,194 @@ struct DirectoryListing {
   DirectoryListing() : buffer(NULL), size(0), capacity(0) { }
 };
 
+/**
+ * Keeps the ready-made fuse_add_direntry buffers of recently opened
+ * directories.  Listings don't change within a catalog revision, so the
+ * revision is part of the key.  The cache is bounded by the sum of the buffer
+ * sizes and evicts least recently used listings.
+ */
+class ListingCache {
+ public:
+  explicit ListingCache(const uint64_t max_size) {
+    max_size_ = max_size;
+    limit_ = max_size;
+    size_ = 0;
+    atomic_init64(&num_hit_);
+    atomic_init64(&num_miss_);
+    atomic_init64(&num_insert_);
+    atomic_init64(&num_evict_);
+    int retval = pthread_mutex_init(&lock_, NULL);
+    assert(retval == 0);
+  }
+
+  ~ListingCache() {
+    Drop();
+    pthread_mutex_destroy(&lock_);
+  }
+
+  /**
+   * On a hit, listing receives a private copy of the cached buffer.
+   */
+  bool Lookup(const fuse_ino_t inode, const uint64_t revision,
+              DirectoryListing *listing)
+  {
+    pthread_mutex_lock(&lock_);
+    Entries::iterator iter = entries_.find(Key(inode, revision));
+    if (iter == entries_.end()) {
+      pthread_mutex_unlock(&lock_);
+      atomic_inc64(&num_miss_);
+      return false;
+    }
+    lru_list_.splice(lru_list_.end(), lru_list_, iter->second.lru_position);
+    listing->size = listing->capacity = iter->second.size;
+    listing->buffer = static_cast<char *>(smalloc(listing->size));
+    memcpy(listing->buffer, iter->second.buffer, listing->size);
+    pthread_mutex_unlock(&lock_);
+    atomic_inc64(&num_hit_);
+    return true;
+  }
+
+  void Insert(const fuse_ino_t inode, const uint64_t revision,
+              const DirectoryListing &listing)
+  {
+    // Don't let a single huge directory flush the cache
+    if (listing.size > max_size_/4)
+      return;
+
+    const Key key(inode, revision);
+    pthread_mutex_lock(&lock_);
+    if ((listing.size > limit_) || (entries_.find(key) != entries_.end())) {
+      pthread_mutex_unlock(&lock_);
+      return;
+    }
+    Evict(listing.size);
+    Entry entry;
+    entry.size = listing.size;
+    entry.buffer = static_cast<char *>(smalloc(listing.size));
+    memcpy(entry.buffer, listing.buffer, listing.size);
+    entry.lru_position = lru_list_.insert(lru_list_.end(), key);
+    entries_[key] = entry;
+    size_ += listing.size;
+    pthread_mutex_unlock(&lock_);
+    atomic_inc64(&num_insert_);
+  }
+
+  /**
+   * Shrinks the cache below its configured size or lets it grow back, used by
+   * the memory budget.
+   */
+  void SetLimit(const uint64_t limit) {
+    pthread_mutex_lock(&lock_);
+    limit_ = (limit < max_size_) ? limit : max_size_;
+    Evict(0);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  uint64_t size() {
+    pthread_mutex_lock(&lock_);
+    const uint64_t result = size_;
+    pthread_mutex_unlock(&lock_);
+    return result;
+  }
+
+  void Drop() {
+    pthread_mutex_lock(&lock_);
+    for (Entries::iterator i = entries_.begin(), iEnd = entries_.end();
+         i != iEnd; ++i)
+    {
+      free(i->second.buffer);
+    }
+    entries_.clear();
+    lru_list_.clear();
+    size_ = 0;
+    pthread_mutex_unlock(&lock_);
+  }
+
+  std::string PrintStatistics() {
+    pthread_mutex_lock(&lock_);
+    const uint64_t size = size_;
+    const uint64_t num_entries = entries_.size();
+    const uint64_t limit = limit_;
+    pthread_mutex_unlock(&lock_);
+    return "hits: " + StringifyInt(atomic_read64(&num_hit_)) + "  " +
+      "misses: " + StringifyInt(atomic_read64(&num_miss_)) + "  " +
+      "inserts: " + StringifyInt(atomic_read64(&num_insert_)) + "  " +
+      "evictions: " + StringifyInt(atomic_read64(&num_evict_)) + "  " +
+      "entries: " + StringifyInt(num_entries) + "  " +
+      "size: " + StringifyInt(size / 1024) + " KB / " +
+      StringifyInt(limit / 1024) + " KB\n";
+  }
+
+ private:
+  typedef std::pair<fuse_ino_t, uint64_t> Key;  // inode, catalog revision
+  struct Entry {
+    char *buffer;
+    size_t size;
+    std::list<Key>::iterator lru_position;
+  };
+  typedef std::map<Key, Entry> Entries;
+
+  /**
+   * Throws out least recently used listings until needed bytes fit, caller
+   * holds lock_.
+   */
+  void Evict(const uint64_t needed) {
+    while (!lru_list_.empty() && (size_ + needed > limit_)) {
+      Entries::iterator oldest = entries_.find(lru_list_.front());
+      size_ -= oldest->second.size;
+      free(oldest->second.buffer);
+      entries_.erase(oldest);
+      lru_list_.pop_front();
+      atomic_inc64(&num_evict_);
+    }
+  }
+
+  Entries entries_;
+  std::list<Key> lru_list_;  /**< front is the least recently used listing */
+  uint64_t size_;
+  uint64_t max_size_;
+  uint64_t limit_;  /**< max_size_ or less under memory pressure */
+  pthread_mutex_t lock_;
+  atomic_int64 num_hit_;
+  atomic_int64 num_miss_;
+  atomic_int64 num_insert_;
+  atomic_int64 num_evict_;
+};
+
 bool foreground_ = false;
 bool nfs_maps_ = false;
+bool splice_read_ = false;  /**< Reply to reads with the cache file descriptor,
+                                 set to false in cvmfs_init if unsupported */
+bool kernel_notify_ = false;  /**< Invalidate changed kernel cache entries on
+                                   remount instead of draining out */
+bool prefetch_ = false;  /**< Download likely followers of opened files */
+bool readahead_ = false;  /**< Fetch chunks ahead of sequential readers */
+bool pagecache_hints_ = false;  /**< Advise the kernel on cache file access */
+unsigned fuse_workers_ = 0;  /**< 0: libfuse's multi-threaded loop */
+bool stream_read_ = false;  /**< Open large files before they are downloaded */
+bool file_bundles_ = false;  /**< Misses on small files load their bundle */
+bool log_async_ = false;  /**< Debug and syslog messages by a log thread */
+bool notification_ = false;  /**< Subscribed to revision notifications */
+/**
+ * Durations of the startup phases in milliseconds, in the order in which they
+ * finished.  The cache manager starts in parallel to other phases and the
+ * peer server is connected after the mount, so that phases can overlap.
+ */
+vector< pair<string, uint64_t> > *startup_phases_ = NULL;
+pthread_mutex_t lock_startup_phases_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t startup_mount_ms_ = 0;  /**< from process start to the mount */
+/**
+ * Parameters of the peer server connection that is made after the mount
+ */
+struct DeferredPeers {
+  string cachedir;
+  string exe_path;
+  string interface;
+};
+DeferredPeers *deferred_peers_ = NULL;
+pthread_t thread_deferred_;
+bool deferred_spawned_ = false;
+struct fuse_chan *fuse_channel_ = NULL;
 string *mountpoint_ = NULL;
 string *cachedir_ = NULL;
 string *tracefile_ = NULL;
@@ -131,47 +485,750 @@ string *repository_name_ = NULL;  /**< Expected repository name,
 pid_t pid_ = 0;  /**< will be set after deamon() */
 time_t boot_time_;
 uint64_t mem_cache_size_;
+uint64_t listing_cache_size_ = kDefaultListingCache;
+/**
+ * Listings of up to this many entries fill the memory caches for the lookups
+ * that usually follow, 0 is off
+ */
+unsigned readdir_prime_ = 0;
+uint64_t memory_tier_size_ = 0;  /**< RAM for small cache objects, 0 is off */
+/**
+ * RAM for inflated blocks of compressed cache files, 0 stores files plain
+ */
+uint64_t compressed_cache_size_ = 0;
+unsigned catalog_prefetch_ = 0;  /**< Parallel nested catalog downloads */
 unsigned max_ttl_ = 0;
 pthread_mutex_t lock_max_ttl_ = PTHREAD_MUTEX_INITIALIZER;
 cache::CatalogManager *catalog_manager_;
 lru::InodeCache *inode_cache_ = NULL;
 lru::PathCache *path_cache_ = NULL;
 lru::Md5PathCache *md5path_cache_ = NULL;
+ListingCache *listing_cache_ = NULL;  /**< NULL if disabled */
+/**
+ * Hash state of the parent directory path of the last lookup, per thread.
+ * Lookups come in bursts for the names of the same directory, which then only
+ * hash the name instead of the full path.
+ */
+struct LookupPrefix {
+  PathString parent_path;
+  hash::Md5Prefix prefix;
+};
+pthread_key_t pkey_lookup_prefix_;
 double kcache_timeout_ = 60.0;  /**< TTL (s) of meta data in the kernel cache */
+const double kNegativeKcacheTimeout = 60.0;  /**< Upper bound for negative
+                                                  entries in notify mode */
 atomic_int32 catalogs_expired_;
 atomic_int32 drainout_mode_;
 atomic_int32 reload_critical_section_;
 time_t drainout_deadline_;
+bool drainout_invalidating_ = false;  /**< notify mode: changed kernel entries
+                                           are being invalidated */
 time_t catalogs_valid_until_;
 
-struct hash_dirhandle {
-  size_t operator() (const uint64_t handle) const {
-#ifdef __x86_64__
-    return MurmurHash64A(&handle, sizeof(handle), 0x9ce603115bba659bLLU);
-#else
-    return MurmurHash2(&handle, sizeof(handle), 0x07387a4f);
-#endif
+/**
+ * Maps the file handles handed out by cvmfs_opendir to directory listings.
+ * Handles are composed of a slot index (lower 32 bits) and the generation of
+ * the slot (upper 32 bits).  A slot is in use if its generation is odd, so a
+ * stale handle never matches a recycled slot.  Lookups (cvmfs_readdir) don't
+ * take any lock.  Fuse guarantees that releasedir is not concurrent to readdir
+ * on the same handle.  Only slot allocation and recycling is serialized.
+ * Slots are organized in chunks that are allocated on demand and never freed
+ * before the table is destructed, so a lookup never races with a reallocation.
+ */
+class DirectoryHandles {
+ public:
+  static const unsigned kSlotsPerChunk = 1024;
+  static const unsigned kMaxChunks = 1024;
+
+  DirectoryHandles() {
+    memset(chunks_, 0, sizeof(chunks_));
+    num_slots_ = 0;
+    atomic_init32(&num_handles_);
+    int retval = pthread_mutex_init(&lock_slots_, NULL);
+    assert(retval == 0);
+  }
+
+  ~DirectoryHandles() {
+    for (unsigned i = 0; i < kMaxChunks; ++i) {
+      if (chunks_[i] == NULL)
+        continue;
+      for (unsigned j = 0; j < kSlotsPerChunk; ++j) {
+        if (chunks_[i][j].generation & 1)
+          free(chunks_[i][j].listing.buffer);
+      }
+      delete[] chunks_[i];
+    }
+    pthread_mutex_destroy(&lock_slots_);
+  }
+
+  /**
+   * Takes ownership of the listing buffer.
+   * \return false if the maximum number of handles is reached
+   */
+  bool Add(const DirectoryListing &listing, uint64_t *handle) {
+    pthread_mutex_lock(&lock_slots_);
+    uint32_t index;
+    if (!free_slots_.empty()) {
+      index = free_slots_.back();
+      free_slots_.pop_back();
+    } else {
+      if (num_slots_ == kSlotsPerChunk*kMaxChunks) {
+        pthread_mutex_unlock(&lock_slots_);
+        return false;
+      }
+      index = num_slots_;
+      if ((index % kSlotsPerChunk) == 0) {
+        Slot *chunk = new Slot[kSlotsPerChunk];
+        __sync_synchronize();
+        chunks_[index / kSlotsPerChunk] = chunk;
+      }
+      num_slots_++;
+    }
+    pthread_mutex_unlock(&lock_slots_);
+
+    Slot *slot = GetSlot(index);
+    slot->listing = listing;
+    // Makes the listing visible before the slot becomes valid
+    const uint32_t generation = __sync_add_and_fetch(&slot->generation, 1);
+    atomic_inc32(&num_handles_);
+    *handle = (uint64_t(generation) << 32) | index;
+    return true;
+  }
+
+  bool Lookup(const uint64_t handle, DirectoryListing *listing) {
+    Slot *slot = GetValidSlot(handle);
+    if (slot == NULL)
+      return false;
+    *listing = slot->listing;
+    return true;
+  }
+
+  /**
+   * Frees the listing buffer and recycles the slot.
+   */
+  bool Remove(const uint64_t handle) {
+    Slot *slot = GetValidSlot(handle);
+    if (slot == NULL)
+      return false;
+    const uint32_t generation = handle >> 32;
+    const DirectoryListing listing = slot->listing;
+    if (!__sync_bool_compare_and_swap(&slot->generation, generation,
+                                      generation + 1))
+    {
+      return false;
+    }
+    free(listing.buffer);
+    atomic_dec32(&num_handles_);
+
+    pthread_mutex_lock(&lock_slots_);
+    free_slots_.push_back(handle & 0xFFFFFFFF);
+    pthread_mutex_unlock(&lock_slots_);
+    return true;
+  }
+
+  int32_t num_handles() { return atomic_read32(&num_handles_); }
+  uint32_t num_slots() {
+    pthread_mutex_lock(&lock_slots_);
+    const uint32_t result = num_slots_;
+    pthread_mutex_unlock(&lock_slots_);
+    return result;
   }
+
+ private:
+  struct Slot {
+    Slot() : generation(0) { }
+    DirectoryListing listing;
+    uint32_t generation;  /**< odd if the slot is in use */
+  };
+
+  inline Slot *GetSlot(const uint32_t index) {
+    Slot *chunk = *static_cast<Slot * volatile *>(
+      &chunks_[index / kSlotsPerChunk]);
+    if (chunk == NULL)
+      return NULL;
+    return &chunk[index % kSlotsPerChunk];
+  }
+
+  inline Slot *GetValidSlot(const uint64_t handle) {
+    const uint32_t index = handle & 0xFFFFFFFF;
+    const uint32_t generation = handle >> 32;
+    if (((generation & 1) == 0) ||
+        (index >= kSlotsPerChunk*kMaxChunks))
+    {
+      return NULL;
+    }
+    Slot *slot = GetSlot(index);
+    if ((slot == NULL) ||
+        (__sync_fetch_and_add(&slot->generation, 0) != generation))
+    {
+      return NULL;
+    }
+    return slot;
+  }
+
+  Slot *chunks_[kMaxChunks];
+  uint32_t num_slots_;  /**< slots handed out so far, including free ones */
+  std::vector<uint32_t> free_slots_;
+  pthread_mutex_t lock_slots_;  /**< protects num_slots_ and free_slots_ */
+  atomic_int32 num_handles_;
 };
-typedef google::dense_hash_map<uint64_t, DirectoryListing, hash_dirhandle>
-  DirectoryHandles;
 DirectoryHandles *directory_handles_ = NULL;
-pthread_mutex_t lock_directory_handles_ = PTHREAD_MUTEX_INITIALIZER;
-uint64_t next_directory_handle_ = 0;
-
-atomic_int64 num_fs_open_;
-atomic_int64 num_fs_dir_open_;
-atomic_int64 num_fs_lookup_;
-atomic_int64 num_fs_lookup_negative_;
-atomic_int64 num_fs_stat_;
-atomic_int64 num_fs_read_;
-atomic_int64 num_fs_readlink_;
+
+ShardedCounter num_fs_open_;
+ShardedCounter num_fs_dir_open_;
+ShardedCounter num_fs_lookup_;
+ShardedCounter num_fs_lookup_negative_;
+ShardedCounter num_fs_primed_;  /**< cache entries filled by listings */
+ShardedCounter num_fs_stat_;
+ShardedCounter num_fs_read_;
+ShardedCounter num_fs_readlink_;
+ShardedCounter num_read_bytes_buffer_;  /**< pread into a buffer, then copied */
+ShardedCounter num_read_bytes_splice_;  /**< handed to the kernel as fd */
+ShardedCounter num_read_bytes_memory_;  /**< served by the memory tier */
+ShardedCounter num_fs_open_chunked_;  /**< opens of chunked files */
+ShardedCounter num_chunk_loads_;  /**< chunk switches of open chunked files */
 atomic_int32 num_io_error_;
 atomic_int32 open_files_; /**< number of currently open files by Fuse calls */
 atomic_int32 open_dirs_; /**< number of currently open directories */
 unsigned max_open_files_; /**< maximum allowed number of open files */
+unsigned max_usable_fds_; /**< open files left after the reserved ones */
+const unsigned kIdleFdQuotaShare = 20;  /**< idle descriptors of the open file
+                                          cache pin at most 1/20 of the quota */
 const int kNumReservedFd = 512;  /**< Number of reserved file descriptors for
                                       internal use */
+const time_t kOpenFileTouchInterval = 60;  /**< a shared descriptor marks its
+                                             object as recently used in the
+                                             quota manager at most once per
+                                             minute */
+
+
+/**
+ * Shares read-only file descriptors of cache objects among all open files
+ * with the same content hash.  We only use pread() and splice with explicit
+ * offsets on these descriptors, so the file position doesn't matter.
+ * Descriptors without references are kept open for reuse (least recently
+ * released first out) until the limit of file descriptors or of idle bytes is
+ * reached.  The disk space of a file that the quota manager removes is only
+ * returned once its last descriptor is closed.  So idle descriptors of
+ * removed files are closed, and the idle bytes are bounded to a share of the
+ * cache quota.
+ * Opening a file through a cached descriptor bypasses the cache manager, so
+ * hits touch the object in the quota manager themselves, rate-limited per
+ * descriptor.
+ * open_files_ counts the descriptors held by this cache.
+ */
+class OpenFileCache {
+ public:
+  OpenFileCache(const unsigned max_fds, const uint64_t max_idle_bytes) {
+    max_fds_ = max_fds;
+    max_idle_bytes_ = max_idle_bytes;
+    idle_bytes_ = 0;
+    atomic_init64(&num_hit_);
+    atomic_init64(&num_miss_);
+    int retval = pthread_mutex_init(&lock_, NULL);
+    assert(retval == 0);
+  }
+
+  ~OpenFileCache() {
+    for (ByHash::iterator i = by_hash_.begin(), iEnd = by_hash_.end();
+         i != iEnd; ++i)
+    {
+      if (close(i->second.fd) == 0) atomic_dec32(&open_files_);
+    }
+    pthread_mutex_destroy(&lock_);
+  }
+
+  /**
+   * Returns a shared descriptor for id and takes a reference, or -1.
+   */
+  int Acquire(const hash::Any &id) {
+    pthread_mutex_lock(&lock_);
+    ByHash::iterator iter = by_hash_.find(id);
+    if (iter == by_hash_.end()) {
+      pthread_mutex_unlock(&lock_);
+      atomic_inc64(&num_miss_);
+      return -1;
+    }
+    if (iter->second.references == 0)
+      SpareIdle(&iter->second);
+    iter->second.references++;
+    const int fd = iter->second.fd;
+    const time_t now = time(NULL);
+    const bool touch =
+      (now >= iter->second.last_touch + kOpenFileTouchInterval);
+    if (touch)
+      iter->second.last_touch = now;
+    pthread_mutex_unlock(&lock_);
+    atomic_inc64(&num_hit_);
+    if (touch)
+      quota::Touch(id);
+    return fd;
+  }
+
+  /**
+   * Takes over a freshly opened descriptor for id and returns the descriptor
+   * to use, which differs from fd if another thread was faster.  Returns
+   * -EMFILE (and closes fd) if all descriptors are referenced.
+   */
+  int Insert(const hash::Any &id, const int fd) {
+    pthread_mutex_lock(&lock_);
+    ByHash::iterator iter = by_hash_.find(id);
+    if (iter != by_hash_.end()) {
+      if (iter->second.references == 0)
+        SpareIdle(&iter->second);
+      iter->second.references++;
+      const int shared_fd = iter->second.fd;
+      pthread_mutex_unlock(&lock_);
+      close(fd);
+      return shared_fd;
+    }
+
+    if (by_hash_.size() >= max_fds_) {
+      if (idle_list_.empty()) {
+        pthread_mutex_unlock(&lock_);
+        close(fd);
+        return -EMFILE;
+      }
+      EvictIdle();
+    }
+    Entry entry;
+    entry.fd = fd;
+    entry.references = 1;
+    entry.size = 0;
+    entry.last_touch = time(NULL);
+    by_hash_[id] = entry;
+    by_fd_[fd] = id;
+    atomic_inc32(&open_files_);
+    pthread_mutex_unlock(&lock_);
+    return fd;
+  }
+
+  /**
+   * Drops a reference.  Returns false if fd is not owned by the cache.
+   */
+  bool Release(const int fd) {
+    pthread_mutex_lock(&lock_);
+    ByFd::const_iterator iter_fd = by_fd_.find(fd);
+    if (iter_fd == by_fd_.end()) {
+      pthread_mutex_unlock(&lock_);
+      return false;
+    }
+    ByHash::iterator iter = by_hash_.find(iter_fd->second);
+    Entry *entry = &iter->second;
+    assert(entry->references > 0);
+    entry->references--;
+    if (entry->references == 0) {
+      // Files removed by the quota manager in the meantime are not kept
+      platform_stat64 info;
+      if ((platform_fstat(fd, &info) != 0) || (info.st_nlink == 0)) {
+        Close(iter);
+        pthread_mutex_unlock(&lock_);
+        return true;
+      }
+      entry->size = info.st_size;
+      if (spare_list_.empty()) {
+        entry->idle_position =
+          idle_list_.insert(idle_list_.end(), iter_fd->second);
+      } else {
+        entry->idle_position = spare_list_.begin();
+        *entry->idle_position = iter_fd->second;
+        idle_list_.splice(idle_list_.end(), spare_list_,
+                          entry->idle_position);
+      }
+      idle_bytes_ += entry->size;
+      while (idle_bytes_ > max_idle_bytes_)
+        EvictIdle();
+    }
+    pthread_mutex_unlock(&lock_);
+    return true;
+  }
+
+  std::string PrintStatistics() {
+    pthread_mutex_lock(&lock_);
+    const uint64_t num_fds = by_hash_.size();
+    const uint64_t num_idle = idle_list_.size();
+    const uint64_t idle_bytes = idle_bytes_;
+    pthread_mutex_unlock(&lock_);
+    return "hits: " + StringifyInt(atomic_read64(&num_hit_)) + "  " +
+      "misses: " + StringifyInt(atomic_read64(&num_miss_)) + "  " +
+      "descriptors: " + StringifyInt(num_fds) + "  " +
+      "idle: " + StringifyInt(num_idle) + "  " +
+      "idle bytes: " + StringifyInt(idle_bytes) + "\n";
+  }
+
+ private:
+  struct Entry {
+    int fd;
+    unsigned references;
+    uint64_t size;  /**< file size, set when the entry becomes idle */
+    time_t last_touch;  /**< last time the object was touched in the quota */
+    std::list<hash::Any>::iterator idle_position;  /**< if references == 0 */
+  };
+  typedef std::map<hash::Any, Entry> ByHash;
+  typedef std::map<int, hash::Any> ByFd;
+
+  /**
+   * Moves an entry of the idle list to the spare list instead of freeing it,
+   * so that acquiring and releasing a cached descriptor does not allocate.
+   * Caller holds the lock.
+   */
+  void SpareIdle(Entry *entry) {
+    idle_bytes_ -= entry->size;
+    spare_list_.splice(spare_list_.end(), idle_list_, entry->idle_position);
+  }
+
+  /**
+   * Closes the least recently released descriptor.  Caller holds the lock.
+   */
+  void EvictIdle() {
+    const hash::Any id = idle_list_.front();
+    idle_list_.pop_front();
+    ByHash::iterator iter = by_hash_.find(id);
+    idle_bytes_ -= iter->second.size;
+    Close(iter);
+  }
+
+  /**
+   * Closes the descriptor of an entry that is not in the idle list.  Caller
+   * holds the lock.
+   */
+  void Close(const ByHash::iterator &iter) {
+    by_fd_.erase(iter->second.fd);
+    if (close(iter->second.fd) == 0) atomic_dec32(&open_files_);
+    by_hash_.erase(iter);
+  }
+
+  ByHash by_hash_;
+  ByFd by_fd_;
+  std::list<hash::Any> idle_list_;  /**< front is the least recently released */
+  std::list<hash::Any> spare_list_;  /**< unused nodes for idle_list_ */
+  unsigned max_fds_;
+  uint64_t max_idle_bytes_;
+  uint64_t idle_bytes_;  /**< sum of the file sizes in idle_list_ */
+  pthread_mutex_t lock_;
+  atomic_int64 num_hit_;
+  atomic_int64 num_miss_;
+};
+OpenFileCache *open_file_cache_ = NULL;
+
+
+/**
+ * State of an open chunked file.  The descriptor of the most recently read
+ * chunk is kept, so that sequential reads don't fetch the chunk again for
+ * every Fuse read.  Chunk descriptors are shared via the open file cache.
+ */
+struct ChunkedFile {
+  ChunkedFile(const catalog::FileChunkList &c, const PathString &p) :
+    chunks(c), path(p), chunk_idx(-1), chunk_fd(-1), chunk_compressed(NULL),
+    readahead_idx(-1)
+  {
+    int retval = pthread_mutex_init(&lock, NULL);
+    assert(retval == 0);
+  }
+  ~ChunkedFile() {
+    ReleaseChunk();
+    pthread_mutex_destroy(&lock);
+  }
+
+  void ReleaseChunk() {
+    if (chunk_compressed)
+      cache::CloseCompressed(chunk_compressed);
+    if (chunk_fd >= 0)
+      open_file_cache_->Release(chunk_fd);
+    chunk_compressed = NULL;
+    chunk_fd = -1;
+    chunk_idx = -1;
+  }
+
+  /**
+   * Index of the chunk containing off, or -1 beyond the end of file.
+   */
+  int FindChunk(const off_t off) const {
+    int lower = 0;
+    int upper = int(chunks.size()) - 1;
+    while (lower <= upper) {
+      const int middle = (lower + upper) / 2;
+      if (off < chunks[middle].offset)
+        upper = middle - 1;
+      else if (off >= chunks[middle].offset + off_t(chunks[middle].size))
+        lower = middle + 1;
+      else
+        return middle;
+    }
+    return -1;
+  }
+
+  catalog::FileChunkList chunks;  /**< sorted by offset */
+  PathString path;
+  int chunk_idx;
+  int chunk_fd;
+  cache::CompressedObject *chunk_compressed;  /**< NULL for plain chunks */
+  read_ahead::AccessPattern access_pattern;
+  int readahead_idx;  /**< last chunk that was queued for read-ahead */
+  pthread_mutex_t lock;
+};
+
+
+/**
+ * Keeps track of the inodes and dentries the kernel knows about (positive
+ * lookups minus forgets).  On remount, the entries that belong to changed
+ * catalogs are invalidated through the Fuse notify interface.  The notify
+ * calls must not happen in the context of a Fuse request, so they are issued
+ * by a separate thread.
+ */
+class KernelInvalidator {
+ public:
+  KernelInvalidator() {
+    spawned_ = false;
+    terminate_ = false;
+    atomic_init64(&num_queued_);
+    atomic_init64(&num_invalidated_);
+    int retval = pthread_mutex_init(&lock_entries_, NULL);
+    retval |= pthread_mutex_init(&lock_queue_, NULL);
+    retval |= pthread_cond_init(&cond_queue_, NULL);
+    assert(retval == 0);
+  }
+
+  ~KernelInvalidator() {
+    Fini();
+    pthread_cond_destroy(&cond_queue_);
+    pthread_mutex_destroy(&lock_queue_);
+    pthread_mutex_destroy(&lock_entries_);
+  }
+
+  void Spawn() {
+    int retval = pthread_create(&thread_invalidate_, NULL, MainInvalidate,
+                                this);
+    assert(retval == 0);
+    spawned_ = true;
+  }
+
+  void Fini() {
+    if (!spawned_)
+      return;
+    pthread_mutex_lock(&lock_queue_);
+    terminate_ = true;
+    pthread_cond_signal(&cond_queue_);
+    pthread_mutex_unlock(&lock_queue_);
+    pthread_join(thread_invalidate_, NULL);
+    spawned_ = false;
+  }
+
+  /**
+   * Called for every positive lookup reply.  The name is empty for "." and
+   * "..", which only count the reference.
+   */
+  void Track(const fuse_ino_t parent, const char *name, const size_t name_len,
+             const fuse_ino_t inode)
+  {
+    pthread_mutex_lock(&lock_entries_);
+    KernelEntry *entry = &entries_[inode];
+    entry->nlookup++;
+    // Repeated lookups find the same name, which is not assigned again to
+    // spare the allocation
+    if ((name_len > 0) && ((entry->parent != parent) ||
+        (entry->name.compare(0, std::string::npos, name, name_len) != 0)))
+    {
+      entry->parent = parent;
+      entry->name.assign(name, name_len);
+    }
+    pthread_mutex_unlock(&lock_entries_);
+  }
+
+  void Forget(const fuse_ino_t inode, const unsigned long nlookup) {
+    pthread_mutex_lock(&lock_entries_);
+    Entries::iterator iter = entries_.find(inode);
+    if (iter != entries_.end()) {
+      if (iter->second.nlookup <= nlookup)
+        entries_.erase(iter);
+      else
+        iter->second.nlookup -= nlookup;
+    }
+    pthread_mutex_unlock(&lock_entries_);
+  }
+
+  /**
+   * Queues the invalidation of all known entries whose inodes don't survive
+   * the remount.  The root inode always changes.  Before the switch, the
+   * entries are selected by the prepared remount, afterwards by the applied
+   * one.
+   */
+  void InvalidateStale(const bool before_switch) {
+    std::vector<Invalidation> stale;
+    stale.push_back(Invalidation(FUSE_ROOT_ID, KernelEntry()));
+    pthread_mutex_lock(&lock_entries_);
+    for (Entries::const_iterator i = entries_.begin(), iEnd = entries_.end();
+         i != iEnd; ++i)
+    {
+      // The root inode is stable from the kernel's point of view
+      if (!IsPreserved(i->first, before_switch) ||
+          ((i->second.parent != FUSE_ROOT_ID) &&
+           !IsPreserved(i->second.parent, before_switch)))
+      {
+        stale.push_back(*i);
+      }
+    }
+    const uint64_t num_entries = entries_.size() + 1;
+    pthread_mutex_unlock(&lock_entries_);
+
+    LogCvmfs(kLogCvmfs, kLogDebug, "invalidating %"PRIu64" out of %"PRIu64
+             " kernel entries", uint64_t(stale.size()), num_entries);
+    pthread_mutex_lock(&lock_queue_);
+    queue_.insert(queue_.end(), stale.begin(), stale.end());
+    atomic_xadd64(&num_queued_, stale.size());
+    pthread_cond_signal(&cond_queue_);
+    pthread_mutex_unlock(&lock_queue_);
+  }
+
+  /**
+   * True if all queued invalidations reached the kernel.
+   */
+  bool IsIdle() {
+    return atomic_read64(&num_invalidated_) == atomic_read64(&num_queued_);
+  }
+
+  std::string PrintStatistics() {
+    pthread_mutex_lock(&lock_entries_);
+    const uint64_t num_entries = entries_.size();
+    pthread_mutex_unlock(&lock_entries_);
+    return "tracked: " + StringifyInt(num_entries) + "  " +
+      "invalidated: " + StringifyInt(atomic_read64(&num_invalidated_)) + "\n";
+  }
+
+ private:
+  struct KernelEntry {
+    KernelEntry() : parent(0), nlookup(0) { }
+    fuse_ino_t parent;
+    std::string name;
+    uint64_t nlookup;
+  };
+  typedef std::map<fuse_ino_t, KernelEntry> Entries;
+  typedef std::pair<fuse_ino_t, KernelEntry> Invalidation;
+
+  static bool IsPreserved(const fuse_ino_t inode, const bool before_switch) {
+    return before_switch ? catalog_manager_->WillPreserveInode(inode) :
+                           catalog_manager_->IsPreservedInode(inode);
+  }
+
+  static void *MainInvalidate(void *data) {
+    KernelInvalidator *invalidator = static_cast<KernelInvalidator *>(data);
+    LogCvmfs(kLogCvmfs, kLogDebug, "starting kernel invalidation thread");
+
+    while (true) {
+      std::vector<Invalidation> work;
+      pthread_mutex_lock(&invalidator->lock_queue_);
+      while (invalidator->queue_.empty() && !invalidator->terminate_)
+        pthread_cond_wait(&invalidator->cond_queue_, &invalidator->lock_queue_);
+      if (invalidator->terminate_) {
+        pthread_mutex_unlock(&invalidator->lock_queue_);
+        break;
+      }
+      work.swap(invalidator->queue_);
+      pthread_mutex_unlock(&invalidator->lock_queue_);
+
+      for (unsigned i = 0, s = work.size(); i < s; ++i) {
+#ifdef CVMFS_NOTIFY_SUPPORT
+        // Errors (e.g. ENOENT for entries forgotten in the meantime) don't
+        // matter
+        if (!work[i].second.name.empty()) {
+          fuse_lowlevel_notify_inval_entry(fuse_channel_,
+                                           work[i].second.parent,
+                                           work[i].second.name.data(),
+                                           work[i].second.name.length());
+        }
+        fuse_lowlevel_notify_inval_inode(fuse_channel_, work[i].first, 0, 0);
+#endif
+        atomic_inc64(&invalidator->num_invalidated_);
+      }
+    }
+
+    LogCvmfs(kLogCvmfs, kLogDebug, "stopping kernel invalidation thread");
+    return NULL;
+  }
+
+  Entries entries_;
+  std::vector<Invalidation> queue_;
+  bool spawned_;
+  bool terminate_;
+  pthread_t thread_invalidate_;
+  pthread_mutex_t lock_entries_;
+  pthread_mutex_t lock_queue_;
+  pthread_cond_t cond_queue_;
+  atomic_int64 num_queued_;
+  atomic_int64 num_invalidated_;
+};
+KernelInvalidator *kernel_invalidator_ = NULL;  /**< NULL if disabled */
+
+
+/**
+ * Latency histograms of the Fuse callbacks.  Hits are requests that could be
+ * served from the memory caches (and for open: the open file cache).
+ */
+enum LatencyHistograms {
+  kLatencyLookupHit = 0,
+  kLatencyLookupMiss,
+  kLatencyGetattrHit,
+  kLatencyGetattrMiss,
+  kLatencyOpenHit,
+  kLatencyOpenMiss,
+  kLatencyRead,
+  kLatencyOpendirHit,
+  kLatencyOpendirMiss,
+  kLatencyReadlinkHit,
+  kLatencyReadlinkMiss,
+  kNumLatencyHistograms,
+};
+const char *kLatencyNames[kNumLatencyHistograms] = {
+  "lookup(hit)", "lookup(miss)", "getattr(hit)", "getattr(miss)",
+  "open(hit)", "open(miss)", "read()", "opendir(hit)", "opendir(miss)",
+  "readlink(hit)", "readlink(miss)"
+};
+const char *kLatencyLabels[kNumLatencyHistograms] = {
+  "call=\"lookup\",result=\"hit\"", "call=\"lookup\",result=\"miss\"",
+  "call=\"getattr\",result=\"hit\"", "call=\"getattr\",result=\"miss\"",
+  "call=\"open\",result=\"hit\"", "call=\"open\",result=\"miss\"",
+  "call=\"read\"",
+  "call=\"opendir\",result=\"hit\"", "call=\"opendir\",result=\"miss\"",
+  "call=\"readlink\",result=\"hit\"", "call=\"readlink\",result=\"miss\""
+};
+Log2Histogram latencies_[kNumLatencyHistograms];
+atomic_int64 num_heap_allocations_[kNumLatencyHistograms];  /**< operator new */
+atomic_int64 num_heap_calls_[kNumLatencyHistograms];
+
+/**
+ * Records the time between construction and destruction, i.e. including the
+ * reply to Fuse, in the hit or miss histogram.  The request is visible to the
+ * stall detector in the meantime.
+ */
+class LatencyRecorder {
+ public:
+  LatencyRecorder(const char *call, const LatencyHistograms hit,
+                  const LatencyHistograms miss)
+  {
+    hit_ = hit;
+    miss_ = miss;
+    cache_miss_ = false;
+    start_ = Log2Histogram::Now();
+    allocations_start_ = alloc_counter::GetThreadAllocations();
+    monitor::RequestStarted(call, start_);
+  }
+  ~LatencyRecorder() {
+    const LatencyHistograms histogram = cache_miss_ ? miss_ : hit_;
+    latencies_[histogram].AddSince(start_);
+    atomic_xadd64(&num_heap_allocations_[histogram],
+                  alloc_counter::GetThreadAllocations() - allocations_start_);
+    atomic_inc64(&num_heap_calls_[histogram]);
+    monitor::RequestFinished();
+  }
+  bool *cache_miss() { return &cache_miss_; }
+
+ private:
+  LatencyHistograms hit_;
+  LatencyHistograms miss_;
+  bool cache_miss_;
+  uint64_t start_;
+  uint64_t allocations_start_;
+};
 
 
 unsigned GetMaxTTL() {
@@ -190,9 +1247,14 @@ void SetMaxTTL(const unsigned value) {
 }
 
 
+/**
+ * While revision notifications arrive, the TTL only serves as a safety net.
+ */
 static unsigned GetEffectiveTTL() {
   const unsigned max_ttl = GetMaxTTL()*60;
-  const unsigned catalog_ttl = catalog_manager_->GetTTL();
+  unsigned catalog_ttl = catalog_manager_->GetTTL();
+  if (notification::IsSubscribed())
+    catalog_ttl = std::max(catalog_ttl, kNotifiedTTL);
 
   return max_ttl ? std::min(max_ttl, catalog_ttl) : catalog_ttl;
 }
@@ -228,23 +1290,381 @@ void GetLruStatistics(lru::Statistics *inode_stats, lru::Statistics *path_stats,
 }
 
 
+/**
+ * Usage and limits of the caches for the memory budget
+ */
+static uint64_t GetLruUsage() {
+  lru::Statistics inode_stats;
+  lru::Statistics path_stats;
+  lru::Statistics md5path_stats;
+  GetLruStatistics(&inode_stats, &path_stats, &md5path_stats);
+  return atomic_read64(&inode_stats.allocated) +
+         atomic_read64(&path_stats.allocated) +
+         atomic_read64(&md5path_stats.allocated);
+}
+
+static uint64_t GetSqliteHeapUsage() {
+  int current;
+  int highwater;
+  sqlite3_status(SQLITE_STATUS_MEMORY_USED, &current, &highwater, 0);
+  return current;
+}
+
+/**
+ * Slots of the preallocated SQlite page cache, overflowing pages are part of
+ * the SQlite heap
+ */
+static uint64_t GetCatalogCacheUsage() {
+  int current;
+  int highwater;
+  sqlite3_status(SQLITE_STATUS_PAGECACHE_USED, &current, &highwater, 0);
+  return static_cast<uint64_t>(current) * 1280;
+}
+
+static void SetCatalogCacheLimit(const uint64_t limit) {
+  catalog_manager_->SetSqliteCacheBudget(limit / 1280);
+}
+
+static uint64_t GetListingCacheUsage() {
+  return listing_cache_->size();
+}
+
+static void SetListingCacheLimit(const uint64_t limit) {
+  listing_cache_->SetLimit(limit);
+}
+
+
 catalog::Statistics GetCatalogStatistics() {
   return catalog_manager_->statistics();
 }
 
+string GetDirectoryHandleStats() {
+  return "outstanding: " + StringifyInt(directory_handles_->num_handles()) +
+    "  slots: " + StringifyInt(directory_handles_->num_slots()) + "\n";
+}
+
+string GetLatencyStats() {
+  string result;
+  for (unsigned i = 0; i < kNumLatencyHistograms; ++i) {
+    string name = kLatencyNames[i];
+    name.resize(16, ' ');
+    result += "  " + name + latencies_[i].Print();
+  }
+  if (!alloc_counter::IsEnabled())
+    return result;
+  result += "  heap allocations per call:";
+  for (unsigned i = 0; i < kNumLatencyHistograms; ++i) {
+    const uint64_t num_calls = atomic_read64(&num_heap_calls_[i]);
+    if (num_calls == 0)
+      continue;
+    char average[32];
+    snprintf(average, sizeof(average), " %.1f",
+             double(atomic_read64(&num_heap_allocations_[i])) / num_calls);
+    result += string(" ") + kLatencyNames[i] + average;
+  }
+  return result + "\n";
+}
+
+void ResetLatencyStats() {
+  for (unsigned i = 0; i < kNumLatencyHistograms; ++i) {
+    latencies_[i].Reset();
+    atomic_init64(&num_heap_allocations_[i]);
+    atomic_init64(&num_heap_calls_[i]);
+  }
+}
+
 string GetCertificateStats() {
   return catalog_manager_->GetCertificateStats();
 }
 
+
+static uint64_t GetClockMs() {
+  struct timeval tv_now;
+  gettimeofday(&tv_now, NULL);
+  return uint64_t(tv_now.tv_sec)*1000 + tv_now.tv_usec/1000;
+}
+
+
+/**
+ * Records the duration of a startup phase that began at *start and restarts
+ * the clock for the next phase.
+ */
+static void RecordStartupPhase(const string &name, uint64_t *start) {
+  const uint64_t now = GetClockMs();
+  LogCvmfs(kLogCvmfs, kLogDebug, "startup phase %s took %lu ms",
+           name.c_str(), now - *start);
+  pthread_mutex_lock(&lock_startup_phases_);
+  startup_phases_->push_back(make_pair(name, now - *start));
+  pthread_mutex_unlock(&lock_startup_phases_);
+  *start = now;
+}
+
+
+string GetStartupStats() {
+  string result = "mounted after " + StringifyInt(startup_mount_ms_) + " ms\n";
+  pthread_mutex_lock(&lock_startup_phases_);
+  for (unsigned i = 0; i < startup_phases_->size(); ++i) {
+    result += "  " + (*startup_phases_)[i].first + ": " +
+              StringifyInt((*startup_phases_)[i].second) + " ms\n";
+  }
+  pthread_mutex_unlock(&lock_startup_phases_);
+  return result;
+}
+
+
+/**
+ * Startup steps that are not needed for the first requests.  Until the peer
+ * server is connected, objects are downloaded from the servers.
+ */
+static void *MainDeferredStartup(void *data __attribute__((unused))) {
+  LogCvmfs(kLogCvmfs, kLogDebug, "deferred startup thread started");
+  uint64_t phase_start = GetClockMs();
+  if (deferred_peers_) {
+    if (peers::Init(deferred_peers_->cachedir, deferred_peers_->exe_path,
+                    deferred_peers_->interface))
+    {
+      RecordStartupPhase("peers (after mount)", &phase_start);
+    } else {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "failed to initialize peer socket, continuing without peers");
+    }
+  }
+  LogCvmfs(kLogCvmfs, kLogDebug, "deferred startup thread stopped");
+  return NULL;
+}
+
+
+static void SpawnDeferredStartup() {
+  if (!deferred_peers_)
+    return;
+  int retval = pthread_create(&thread_deferred_, NULL, MainDeferredStartup,
+                              NULL);
+  assert(retval == 0);
+  deferred_spawned_ = true;
+}
+
+
+static void JoinDeferredStartup() {
+  if (deferred_spawned_) {
+    pthread_join(thread_deferred_, NULL);
+    deferred_spawned_ = false;
+  }
+  delete deferred_peers_;
+  deferred_peers_ = NULL;
+}
+
 string GetFsStats() {
-  return "lookup(all): " + StringifyInt(atomic_read64(&num_fs_lookup_)) + "  " +
-    "lookup(negative): " + StringifyInt(atomic_read64(&num_fs_lookup_negative_))
+  return "lookup(all): " + StringifyInt(num_fs_lookup_.Get()) + "  " +
+    "lookup(negative): " + StringifyInt(num_fs_lookup_negative_.Get())
       + "  " +
-    "stat(): " + StringifyInt(atomic_read64(&num_fs_stat_)) + "  " +
-    "open(): " + StringifyInt(atomic_read64(&num_fs_open_)) + "  " +
-    "diropen(): " + StringifyInt(atomic_read64(&num_fs_dir_open_)) + "  " +
-    "read(): " + StringifyInt(atomic_read64(&num_fs_read_)) + "  " +
-    "readlink(): " + StringifyInt(atomic_read64(&num_fs_readlink_)) + "\n";
+    "stat(): " + StringifyInt(num_fs_stat_.Get()) + "  " +
+    "open(): " + StringifyInt(num_fs_open_.Get()) + "  " +
+    "diropen(): " + StringifyInt(num_fs_dir_open_.Get()) + "  " +
+    "read(): " + StringifyInt(num_fs_read_.Get()) + "  " +
+    "readlink(): " + StringifyInt(num_fs_readlink_.Get()) + "\n" +
+    "  read bytes(buffered): " +
+      StringifyInt(num_read_bytes_buffer_.Get()) + "  " +
+    "read bytes(splice): " +
+      StringifyInt(num_read_bytes_splice_.Get()) + "  " +
+    "read bytes(memory): " +
+      StringifyInt(num_read_bytes_memory_.Get()) + "\n" +
+    "  chunked open(): " + StringifyInt(num_fs_open_chunked_.Get()) +
+      "  " +
+    "chunk loads: " + StringifyInt(num_chunk_loads_.Get()) + "\n" +
+    "  memory tier: " + cache::GetMemoryTierStatistics() +
+    "  compressed cache: " + cache::GetCompressionStatistics() +
+    "  downloads: " + StringifyInt(cache::GetNumDownloads()) + "  " +
+    "coalesced: " + StringifyInt(cache::GetNumCoalescedDownloads()) + "  " +
+    "contended: " + StringifyInt(cache::GetNumContendedDownloads()) + "  " +
+    "from other mounts: " + StringifyInt(cache::GetNumSharedDownloads()) +
+      "  " +
+    "from peers: " + StringifyInt(cache::GetNumPeerDownloads()) + "  " +
+    "streamed: " + StringifyInt(cache::GetNumStreamingFetches()) + "\n" +
+    "  hedged requests: " + StringifyInt(download::GetNumHedgesFired()) +
+      "  " +
+    "won: " + StringifyInt(download::GetNumHedgesWon()) + "  " +
+    "HTTP/2 requests: " + StringifyInt(download::GetNumHttp2Requests()) +
+      "\n" +
+    "  DNS cache hits: " + StringifyInt(download::GetNumDnsHits()) + "  " +
+    "misses: " + StringifyInt(download::GetNumDnsMisses()) + "\n" +
+    "  listing cache: " +
+      (listing_cache_ ? listing_cache_->PrintStatistics() : "disabled\n") +
+    "  entries primed by listings: " +
+      StringifyInt(num_fs_primed_.Get()) + "\n" +
+    "  open file cache: " + open_file_cache_->PrintStatistics() +
+    "  cache filter: " + cache::GetFilterStatistics() +
+    "  nested catalog prefetch: " + catalog_manager_->GetNestedPrefetchStats() +
+    "  catalog deltas: " + catalog_manager_->GetDeltaStats() +
+    "  remount: " + catalog_manager_->remount_statistics().Print() +
+    "  file bundles: " +
+      (file_bundles_ ? cache::GetBundleStatistics() : "disabled\n") +
+    "  kernel entries: " +
+      (kernel_invalidator_ ? kernel_invalidator_->PrintStatistics() :
+                             "not tracked\n");
+}
+
+
+/**
+ * Counters of the Fuse module, the memory caches, the catalogs and the cache
+ * module.  Samples of a metric have to be consecutive, therefore the memory
+ * caches are written metric by metric.
+ */
+void GetMetrics(MetricsWriter *metrics) {
+  metrics->Counter("fs_calls_total", "File system calls",
+                   num_fs_lookup_.Get(), "call=\"lookup\"");
+  metrics->Counter("fs_calls_total", "", num_fs_stat_.Get(),
+                   "call=\"getattr\"");
+  metrics->Counter("fs_calls_total", "", num_fs_open_.Get(),
+                   "call=\"open\"");
+  metrics->Counter("fs_calls_total", "", num_fs_dir_open_.Get(),
+                   "call=\"opendir\"");
+  metrics->Counter("fs_calls_total", "", num_fs_read_.Get(),
+                   "call=\"read\"");
+  metrics->Counter("fs_calls_total", "", num_fs_readlink_.Get(),
+                   "call=\"readlink\"");
+  metrics->Counter("fs_lookups_negative_total", "Lookups of missing names",
+                   num_fs_lookup_negative_.Get());
+  metrics->Counter("fs_listing_primed_total",
+                   "Memory cache entries filled by directory listings",
+                   num_fs_primed_.Get());
+  metrics->Counter("fs_open_chunked_total", "Opens of chunked files",
+                   num_fs_open_chunked_.Get());
+  metrics->Counter("fs_chunk_loads_total",
+                   "Chunk switches of open chunked files",
+                   num_chunk_loads_.Get());
+  metrics->Counter("fs_read_bytes_total", "Bytes returned by read()",
+                   num_read_bytes_buffer_.Get(),
+                   "method=\"buffer\"");
+  metrics->Counter("fs_read_bytes_total", "",
+                   num_read_bytes_splice_.Get(),
+                   "method=\"splice\"");
+  metrics->Counter("fs_read_bytes_total", "",
+                   num_read_bytes_memory_.Get(),
+                   "method=\"memory\"");
+  metrics->Counter("fs_io_errors_total", "I/O errors returned to Fuse",
+                   atomic_read32(&num_io_error_));
+  metrics->Gauge("fs_directory_handles", "Outstanding directory handles",
+                 directory_handles_->num_handles());
+  for (unsigned i = 0; i < kNumLatencyHistograms; ++i) {
+    metrics->Histogram("fs_latency_seconds",
+                       "Fuse call latencies including the reply",
+                       &latencies_[i], kLatencyLabels[i]);
+  }
+  for (unsigned i = 0; alloc_counter::IsEnabled() &&
+       (i < kNumLatencyHistograms); ++i)
+  {
+    metrics->Counter("fs_heap_allocations_total",
+                     "Heap allocations by operator new in Fuse calls",
+                     atomic_read64(&num_heap_allocations_[i]),
+                     kLatencyLabels[i]);
+  }
+
+  lru::Statistics stats[3];
+  const char *names[3] = { "inode", "path", "md5path" };
+  GetLruStatistics(&stats[0], &stats[1], &stats[2]);
+  for (unsigned i = 0; i < 3; ++i) {
+    metrics->Gauge("lru_size", "Capacity of the memory caches", stats[i].size,
+                   MetricsWriter::Label("cache", names[i]));
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    metrics->Counter("lru_hits_total", "Hits of the memory caches",
+                     stats[i].num_hit.Get(),
+                     MetricsWriter::Label("cache", names[i]));
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    metrics->Counter("lru_misses_total", "Misses of the memory caches",
+                     stats[i].num_miss.Get(),
+                     MetricsWriter::Label("cache", names[i]));
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    metrics->Counter("lru_inserts_total", "Inserts into the memory caches",
+                     stats[i].num_insert.Get(),
+                     MetricsWriter::Label("cache", names[i]));
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    metrics->Counter("lru_drops_total", "Memory cache entries dropped",
+                     stats[i].num_drop.Get(),
+                     MetricsWriter::Label("cache", names[i]));
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    metrics->Gauge("lru_allocated_bytes", "Memory of the memory caches",
+                   atomic_read64(&stats[i].allocated),
+                   MetricsWriter::Label("cache", names[i]));
+  }
+
+  catalog::Statistics catalog_stats = catalog_manager_->statistics();
+  metrics->Counter("catalog_lookups_total", "Catalog lookups",
+                   catalog_stats.num_lookup_inode.Get(),
+                   "by=\"inode\"");
+  metrics->Counter("catalog_lookups_total", "",
+                   catalog_stats.num_lookup_path.Get(),
+                   "by=\"path\"");
+  metrics->Counter("catalog_lookups_negative_total",
+                   "Catalog lookups of missing paths",
+                   catalog_stats.num_lookup_path_negative.Get());
+  metrics->Counter("catalog_listings_total", "Catalog directory listings",
+                   catalog_stats.num_listing.Get());
+  metrics->Counter("catalog_nested_listings_total",
+                   "Listings of nested catalogs",
+                   catalog_stats.num_nested_listing.Get());
+  metrics->Counter("catalog_bloom_negatives_total",
+                   "Missing paths answered by bloom filters",
+                   catalog_stats.num_bloom_negative.Get());
+  metrics->Counter("catalog_bloom_false_positives_total",
+                   "Bloom filter false positives",
+                   catalog_stats.num_bloom_false_positive.Get());
+  metrics->Gauge("catalog_revision", "Revision of the root catalog",
+                 GetRevision());
+  catalog::RemountStatistics remount_stats =
+    catalog_manager_->remount_statistics();
+  metrics->Counter("catalog_remounts_total", "Switches to a new revision",
+                   atomic_read64(&remount_stats.num_remounts));
+  metrics->Counter("catalog_remount_prefetched_total",
+                   "Changed nested catalogs downloaded before the switch",
+                   atomic_read64(&remount_stats.num_prefetched));
+  metrics->Counter("catalog_remount_prefetch_failures_total",
+                   "Nested catalogs that failed to prefetch",
+                   atomic_read64(&remount_stats.num_prefetch_failed));
+  metrics->Counter("catalog_remount_reattached_total",
+                   "Nested catalogs attached before the switch",
+                   atomic_read64(&remount_stats.num_reattached));
+  metrics->Gauge("catalog_remount_prefetch_milliseconds",
+                 "Prefetch time of the last remount",
+                 atomic_read64(&remount_stats.prefetch_ms));
+  metrics->Gauge("catalog_remount_switch_milliseconds",
+                 "Switch time of the last remount under the write lock",
+                 atomic_read64(&remount_stats.switch_ms));
+
+  metrics->Counter("cache_downloads_total", "Objects fetched into the cache",
+                   cache::GetNumDownloads());
+  metrics->Counter("cache_coalesced_total",
+                   "Fetches that waited for a concurrent download",
+                   cache::GetNumCoalescedDownloads());
+  metrics->Counter("cache_contended_total",
+                   "Fetches that had to wait for the download lock",
+                   cache::GetNumContendedDownloads());
+  metrics->Counter("cache_shared_total",
+                   "Objects found after another mount downloaded them",
+                   cache::GetNumSharedDownloads());
+  metrics->Counter("cache_peer_downloads_total", "Objects fetched from peers",
+                   cache::GetNumPeerDownloads());
+  metrics->Counter("cache_streamed_total", "Streaming fetches",
+                   cache::GetNumStreamingFetches());
+  metrics->Counter("cache_bundle_downloads_total", "Downloaded file bundles",
+                   cache::GetNumBundleDownloads());
+  metrics->Counter("cache_bundled_objects_total",
+                   "Objects cached from file bundles",
+                   cache::GetNumBundledObjects());
+
+  metrics->Gauge("startup_mount_milliseconds",
+                 "Time from the process start to the mount", startup_mount_ms_);
+  pthread_mutex_lock(&lock_startup_phases_);
+  for (unsigned i = 0; i < startup_phases_->size(); ++i) {
+    metrics->Gauge("startup_phase_milliseconds", "Duration of startup phases",
+                   (*startup_phases_)[i].second,
+                   MetricsWriter::Label("phase", (*startup_phases_)[i].first));
+  }
+  pthread_mutex_unlock(&lock_startup_phases_);
 }
 
 
@@ -256,6 +1676,22 @@ static void AlarmReload(int signal __attribute__((unused)),
 }
 
 
+/**
+ * A notified revision that differs from the mounted one is handled like an
+ * expired TTL.  So is a lost subscription, which brings back the regular TTL.
+ */
+static void OnNotification(const notification::Events event,
+                           const hash::Any &root_hash)
+{
+  if ((event == notification::kEventRevision) &&
+      (root_hash == catalog_manager_->GetRootHash()))
+  {
+    return;
+  }
+  atomic_cas32(&catalogs_expired_, 0, 1);
+}
+
+
 /**
  * If there is a new catalog version, switches to drainout mode.
  * lookup or getattr will take care of actual remounting once the caches are
@@ -266,16 +1702,50 @@ catalog::LoadError RemountStart() {
   if (retval == catalog::kLoadNew) {
     LogCvmfs(kLogCvmfs, kLogDebug,
              "new catalog revision available, draining out meta-data caches");
-    drainout_deadline_ = time(NULL) + int(kcache_timeout_);
+    // Changed kernel cache entries are invalidated explicitly before the
+    // switch, no need to wait for them to expire
+    drainout_deadline_ = kernel_invalidator_ ?
+                         time(NULL) : time(NULL) + int(kcache_timeout_);
     atomic_cas32(&drainout_mode_, 0, 1);
   }
   return retval;
 }
 
 
+/**
+ * Selects cache entries that refer to inodes of changed catalogs.  Negative
+ * entries are always stale.
+ */
+class StaleInodeFilter {
+ public:
+  bool operator()(const fuse_ino_t inode, const catalog::PackedDirent &dirent)
+  {
+    return !catalog_manager_->IsPreservedInode(inode) ||
+           !catalog_manager_->IsPreservedInode(dirent.parent_inode());
+  }
+  bool operator()(const fuse_ino_t inode, const PathString &path) {
+    return !catalog_manager_->IsPreservedInode(inode);
+  }
+  bool operator()(const hash::Md5 &md5path,
+                  const catalog::PackedDirent &dirent)
+  {
+    return (dirent.GetSpecial() == catalog::kDirentNegative) ||
+           !catalog_manager_->IsPreservedInode(dirent.inode()) ||
+           !catalog_manager_->IsPreservedInode(dirent.parent_inode());
+  }
+};
+
+
 /**
  * If the caches are drained out, a new catalog revision is applied and
- * kernel caches are activated again.
+ * kernel caches are activated again.  Only entries of changed catalogs are
+ * removed from the meta-data caches.  In NFS mode, inodes are not bound to
+ * catalogs and the caches are dropped entirely.
+ *
+ * In notify mode, the kernel entries of changed catalogs are invalidated
+ * first and the drainout lasts until the invalidations reached the kernel.
+ * The new root catalog reuses the inodes of the old one, so the kernel must
+ * not hold them anymore when the new revision is applied.
  */
 static void RemountFinish() {
   if (!atomic_cas32(&reload_critical_section_, 0, 1))
@@ -285,15 +1755,42 @@ static void RemountFinish() {
     return;
   }
 
-  if (time(NULL) > drainout_deadline_) {
+  if (kernel_invalidator_ && !drainout_invalidating_) {
+    // Downloads the changed catalogs while the caches still serve
+    catalog_manager_->PrepareRemount();
+    kernel_invalidator_->InvalidateStale(true);
+    drainout_invalidating_ = true;
+    atomic_cas32(&reload_critical_section_, 1, 0);
+    return;
+  }
+
+  if ((time(NULL) > drainout_deadline_) &&
+      (!kernel_invalidator_ || kernel_invalidator_->IsIdle()))
+  {
     LogCvmfs(kLogCvmfs, kLogDebug, "caches drained out, applying new catalog");
+    drainout_invalidating_ = false;
+    if (!kernel_invalidator_)
+      catalog_manager_->PrepareRemount();
     inode_cache_->Pause();
-    inode_cache_->Drop();
     path_cache_->Pause();
-    path_cache_->Drop();
     md5path_cache_->Pause();
-    md5path_cache_->Drop();
     catalog::LoadError retval = catalog_manager_->Remount(false);
+    if (nfs_maps_) {
+      inode_cache_->Drop();
+      path_cache_->Drop();
+      md5path_cache_->Drop();
+    } else if (retval == catalog::kLoadNew) {
+      StaleInodeFilter filter;
+      const unsigned num_inodes = inode_cache_->ForgetIf(&filter);
+      const unsigned num_paths = path_cache_->ForgetIf(&filter);
+      const unsigned num_md5paths = md5path_cache_->ForgetIf(&filter);
+      LogCvmfs(kLogCvmfs, kLogDebug, "evicted %u inode, %u path and "
+               "%u md5path cache entries", num_inodes, num_paths, num_md5paths);
+      // Catches the catalogs that could not be attached before the switch
+      if (kernel_invalidator_)
+        kernel_invalidator_->InvalidateStale(false);
+    }
+    if (listing_cache_) listing_cache_->Drop();
     inode_cache_->Resume();
     path_cache_->Resume();
     md5path_cache_->Resume();
@@ -339,12 +1836,17 @@ static void RemountCheck() {
 }
 
 
+/**
+ * The lookup functions set *cache_miss if they have to go to the catalogs.
+ */
 static bool GetDirentForInode(const fuse_ino_t ino,
-                              catalog::DirectoryEntry *dirent)
+                              catalog::DirectoryEntry *dirent,
+                              bool *cache_miss = NULL)
 {
   // Lookup inode in cache
   if (inode_cache_->Lookup(ino, dirent))
     return true;
+  if (cache_miss) *cache_miss = true;
 
   // Lookup inode in catalog
   if (nfs_maps_) {
@@ -383,15 +1885,19 @@ static bool GetDirentForInode(const fuse_ino_t ino,
 
 
 static bool GetDirentForPath(const PathString &path,
+                             const hash::Md5 &md5path,
                              const fuse_ino_t parent_inode,
-                             catalog::DirectoryEntry *dirent)
+                             catalog::DirectoryEntry *dirent,
+                             bool *cache_miss = NULL)
 {
-  hash::Md5 md5path(path.GetChars(), path.GetLength());
   if (md5path_cache_->Lookup(md5path, dirent))
     return dirent->GetSpecial() != catalog::kDirentNegative;
+  if (cache_miss) *cache_miss = true;
 
-  // Lookup inode in catalog TODO: not twice md5 calculation
-  if (catalog_manager_->LookupPath(path, catalog::kLookupSole, dirent)) {
+  // Lookup inode in catalog
+  if (catalog_manager_->LookupPath(path, md5path, catalog::kLookupSole,
+                                   dirent))
+  {
     if (nfs_maps_) {
       // Fix inode
       dirent->set_inode(nfs_maps::GetInode(path));
@@ -407,11 +1913,44 @@ static bool GetDirentForPath(const PathString &path,
 }
 
 
-static bool GetPathForInode(const fuse_ino_t ino, PathString *path) {
+static void FreeLookupPrefix(void *data) {
+  delete static_cast<LookupPrefix *>(data);
+}
+
+
+/**
+ * Hashes parent_path/name, continuing from the hash state of the parent path
+ * if the calling thread looked up in the same directory before.
+ */
+static hash::Md5 HashLookupPath(const PathString &parent_path,
+                                const char *name, const unsigned name_length)
+{
+  LookupPrefix *lookup_prefix =
+    static_cast<LookupPrefix *>(pthread_getspecific(pkey_lookup_prefix_));
+  if ((lookup_prefix == NULL) || (lookup_prefix->parent_path != parent_path)) {
+    if (lookup_prefix == NULL) {
+      lookup_prefix = new LookupPrefix();
+      int retval = pthread_setspecific(pkey_lookup_prefix_, lookup_prefix);
+      assert(retval == 0);
+    }
+    PathString prefix_path(parent_path);
+    prefix_path.Append("/", 1);
+    lookup_prefix->parent_path.Assign(parent_path);
+    lookup_prefix->prefix =
+      hash::Md5Prefix(prefix_path.GetChars(), prefix_path.GetLength());
+  }
+  return hash::Md5(lookup_prefix->prefix, name, name_length);
+}
+
+
+static bool GetPathForInode(const fuse_ino_t ino, PathString *path,
+                            bool *cache_miss = NULL)
+{
   // Check the path cache first
   if (path_cache_->Lookup(ino, path)) {
     return true;
   }
+  if (cache_miss) *cache_miss = true;
 
   if (nfs_maps_) {
     // NFS mode, just a lookup
@@ -427,7 +1966,7 @@ static bool GetPathForInode(const fuse_ino_t ino, PathString *path) {
 
   // Find out the parent path recursively and rebuild the absolute path
   catalog::DirectoryEntry dirent;
-  if (!GetDirentForInode(ino, &dirent))
+  if (!GetDirentForInode(ino, &dirent, cache_miss))
     return false;
 
   // Check if we reached the root node
@@ -436,7 +1975,7 @@ static bool GetPathForInode(const fuse_ino_t ino, PathString *path) {
   } else {
     // Retrieve the parent path recursively
     PathString parent_path;
-    if (!GetPathForInode(dirent.parent_inode(), &parent_path))
+    if (!GetPathForInode(dirent.parent_inode(), &parent_path, cache_miss))
       return false;
 
     path->Assign(parent_path);
@@ -457,9 +1996,11 @@ static bool GetPathForInode(const fuse_ino_t ino, PathString *path) {
 static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
                          const char *name)
 {
-  atomic_inc64(&num_fs_lookup_);
+  LatencyRecorder latency("lookup", kLatencyLookupHit, kLatencyLookupMiss);
+  num_fs_lookup_.Inc();
   RemountCheck();
 
+  const fuse_ino_t kernel_parent = parent;
   parent = catalog_manager_->MangleInode(parent);
   LogCvmfs(kLogCvmfs, kLogDebug,
            "cvmfs_lookup in parent inode: %d for name: %s", parent, name);
@@ -476,7 +2017,7 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
 
   // Special NFS lookups
   if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
-    if (GetDirentForInode(parent, &dirent)) {
+    if (GetDirentForInode(parent, &dirent, latency.cache_miss())) {
       if (strcmp(name, ".") == 0) {
         goto reply_positive;
       } else {
@@ -484,17 +2025,19 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
           dirent.set_inode(1);
           goto reply_positive;
         }
-        if (GetDirentForInode(dirent.parent_inode(), &dirent))
+        if (GetDirentForInode(dirent.parent_inode(), &dirent,
+                              latency.cache_miss()))
+        {
           goto reply_positive;
-        else
-          goto reply_negative;
+        }
+        goto reply_negative;
       }
     } else {
       goto reply_negative;
     }
   }
 
-  if (!GetPathForInode(parent, &parent_path)) {
+  if (!GetPathForInode(parent, &parent_path, latency.cache_miss())) {
     LogCvmfs(kLogCvmfs, kLogDebug, "no path for parent inode found");
     goto reply_negative;
   }
@@ -503,37 +2046,59 @@ static void cvmfs_lookup(fuse_req_t req, fuse_ino_t parent,
   path.Append("/", 1);
   path.Append(name, strlen(name));
   tracer::Trace(tracer::kFuseLookup, path, "lookup()");
-  if (!GetDirentForPath(path, parent, &dirent)) {
+  if (!GetDirentForPath(path, HashLookupPath(parent_path, name, strlen(name)),
+                        parent, &dirent, latency.cache_miss()))
+  {
     goto reply_negative;
   }
 
  reply_positive:
   result.ino = dirent.inode();
   result.attr = dirent.GetStatStructure();
+  if (kernel_invalidator_) {
+    const bool is_dot = (path.GetLength() == 0);
+    kernel_invalidator_->Track(kernel_parent, name, is_dot ? 0 : strlen(name),
+                               result.ino);
+  }
   fuse_reply_entry(req, &result);
   return;
 
  reply_negative:
-  atomic_inc64(&num_fs_lookup_negative_);
+  num_fs_lookup_negative_.Inc();
   result.ino = 0;
+  // Negative entries are not tracked, they must expire by themselves
+  if (kernel_invalidator_)
+    result.entry_timeout = std::min(timeout, kNegativeKcacheTimeout);
   fuse_reply_entry(req, &result);
 }
 
 
+/**
+ * Only registered if kernel cache entries are tracked.
+ */
+static void cvmfs_forget(fuse_req_t req, fuse_ino_t ino,
+                         unsigned long nlookup)
+{
+  kernel_invalidator_->Forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+
 /**
  * Transform a cvmfs dirent into a struct stat.
  */
 static void cvmfs_getattr(fuse_req_t req, fuse_ino_t ino,
                           struct fuse_file_info *fi)
 {
-  atomic_inc64(&num_fs_stat_);
+  LatencyRecorder latency("getattr", kLatencyGetattrHit, kLatencyGetattrMiss);
+  num_fs_stat_.Inc();
   RemountCheck();
 
   ino = catalog_manager_->MangleInode(ino);
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_getattr (stat) for inode: %d", ino);
 
   catalog::DirectoryEntry dirent;
-  const bool found = GetDirentForInode(ino, &dirent);
+  const bool found = GetDirentForInode(ino, &dirent, latency.cache_miss());
 
   if (!found) {
     fuse_reply_err(req, ENOENT);
@@ -550,13 +2115,15 @@ static void cvmfs_getattr(fuse_req_t req, fuse_ino_t ino,
  * Reads a symlink from the catalog.  Environment variables are expanded.
  */
 static void cvmfs_readlink(fuse_req_t req, fuse_ino_t ino) {
-  atomic_inc64(&num_fs_readlink_);
+  LatencyRecorder latency("readlink", kLatencyReadlinkHit,
+                          kLatencyReadlinkMiss);
+  num_fs_readlink_.Inc();
 
   ino = catalog_manager_->MangleInode(ino);
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_readlink on inode: %d", ino);
 
   catalog::DirectoryEntry dirent;
-  const bool found = GetDirentForInode(ino, &dirent);
+  const bool found = GetDirentForInode(ino, &dirent, latency.cache_miss());
 
   if (!found) {
     fuse_reply_err(req, ENOENT);
@@ -596,82 +2163,166 @@ static void AddToDirListing(const fuse_req_t req,
 /**
  * Open a directory for listing.
  */
+/**
+ * Lists the directory with the stat information only.  With NFS maps, the
+ * inodes are fixed by a path lookup of every entry.
+ */
+static bool ListStat(fuse_req_t req, const fuse_ino_t ino,
+                     const PathString &path, DirectoryListing *listing)
+{
+  catalog::StatEntryList listing_from_catalog;
+  if (!catalog_manager_->ListingStat(path, &listing_from_catalog))
+    return false;
+  hash::Md5Prefix entry_prefix;
+  if (nfs_maps_) {
+    PathString prefix_path(path);
+    prefix_path.Append("/", 1);
+    entry_prefix =
+      hash::Md5Prefix(prefix_path.GetChars(), prefix_path.GetLength());
+  }
+  for (catalog::StatEntryList::const_iterator
+       i = listing_from_catalog.begin(), iEnd = listing_from_catalog.end();
+       i != iEnd; ++i)
+  {
+    if (nfs_maps_) {
+      // Fix inodes
+      PathString entry_path;
+      entry_path.Assign(path);
+      entry_path.Append("/", 1);
+      entry_path.Append(i->name.GetChars(), i->name.GetLength());
+
+      catalog::DirectoryEntry entry_dirent;
+      const hash::Md5 entry_md5path(entry_prefix, i->name.GetChars(),
+                                    i->name.GetLength());
+      if (!GetDirentForPath(entry_path, entry_md5path, ino, &entry_dirent)) {
+        LogCvmfs(kLogCvmfs, kLogDebug, "listing entry %s vanished, skipping",
+                 entry_path.c_str());
+        continue;
+      }
+
+      struct stat fixed_info = i->info;
+      fixed_info.st_ino = entry_dirent.inode();
+      AddToDirListing(req, i->name.c_str(), &fixed_info, listing);
+      // The path lookup above filled the md5path cache
+      if (listing_from_catalog.size() <= readdir_prime_) {
+        inode_cache_->Insert(entry_dirent.inode(), entry_dirent);
+        num_fs_primed_.Inc();
+      }
+    } else {
+      AddToDirListing(req, i->name.c_str(), &(i->info), listing);
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Fuse 2 has no readdirplus, so the kernel looks up the entries of a listing
+ * one by one, e.g. for ls -l.  Lists the directory with the full entries and
+ * puts small listings into the memory caches, so that these lookups and the
+ * following getattr calls don't query the catalogs again.  Not used with NFS
+ * maps, where the path lookups of the listing fill the caches anyway.
+ * Nested catalog mountpoints are skipped, their lookups return the root entry
+ * of the nested catalog.
+ */
+static bool ListAndPrime(fuse_req_t req, const fuse_ino_t ino,
+                         const PathString &path, DirectoryListing *listing)
+{
+  catalog::DirectoryEntryList dirents;
+  if (!catalog_manager_->Listing(path, &dirents))
+    return false;
+
+  const bool prime = (dirents.size() <= readdir_prime_);
+  hash::Md5Prefix entry_prefix;
+  if (prime) {
+    PathString prefix_path(path);
+    prefix_path.Append("/", 1);
+    entry_prefix =
+      hash::Md5Prefix(prefix_path.GetChars(), prefix_path.GetLength());
+  }
+  for (catalog::DirectoryEntryList::iterator i = dirents.begin(),
+       iEnd = dirents.end(); i != iEnd; ++i)
+  {
+    const struct stat info = i->GetStatStructure();
+    AddToDirListing(req, i->name().c_str(), &info, listing);
+    if (!prime || i->IsNestedCatalogMountpoint())
+      continue;
+
+    i->set_parent_inode(ino);
+    md5path_cache_->Insert(hash::Md5(entry_prefix, i->name().GetChars(),
+                                     i->name().GetLength()), *i);
+    inode_cache_->Insert(i->inode(), *i);
+    num_fs_primed_.Inc();
+  }
+  return true;
+}
+
+
 static void cvmfs_opendir(fuse_req_t req, fuse_ino_t ino,
                           struct fuse_file_info *fi) {
+  LatencyRecorder latency("opendir", kLatencyOpendirHit, kLatencyOpendirMiss);
   RemountCheck();
   ino = catalog_manager_->MangleInode(ino);
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_opendir on inode: %d", ino);
 
   PathString path;
   catalog::DirectoryEntry d;
-  const bool found = GetPathForInode(ino, &path) && GetDirentForInode(ino, &d);
+  const bool found = GetPathForInode(ino, &path, latency.cache_miss()) &&
+                     GetDirentForInode(ino, &d, latency.cache_miss());
 
   if (!found) {
     fuse_reply_err(req, ENOENT);
     return;
   }
 
-  if (!d.IsDirectory()) {
-    fuse_reply_err(req, ENOTDIR);
-    return;
-  }
-
-  // Build listing
-  DirectoryListing listing;
-
-  // Add current directory link
-  struct stat info;
-  info = d.GetStatStructure();
-  AddToDirListing(req, ".", &info, &listing);
-
-  // Add parent directory link
-  catalog::DirectoryEntry p;
-  if (d.inode() != catalog_manager_->GetRootInode() &&
-      GetDirentForInode(d.parent_inode(), &p))
-  {
-    info = p.GetStatStructure();
-    AddToDirListing(req, "..", &info, &listing);
-  }
-
-  // Add all names
-  catalog::StatEntryList listing_from_catalog;
-  if (!catalog_manager_->ListingStat(path, &listing_from_catalog)) {
-    free(listing.buffer);
-    fuse_reply_err(req, EIO);
-    return;
-  }
-  for (catalog::StatEntryList::const_iterator i = listing_from_catalog.begin(),
-       iEnd = listing_from_catalog.end(); i != iEnd; ++i)
-  {
-    if (nfs_maps_) {
-      // Fix inodes
-      PathString entry_path;
-      entry_path.Assign(path);
-      entry_path.Append("/", 1);
-      entry_path.Append(i->name.GetChars(), i->name.GetLength());
-
-      catalog::DirectoryEntry entry_dirent;
-      if (!GetDirentForPath(entry_path, ino, &entry_dirent)) {
-        LogCvmfs(kLogCvmfs, kLogDebug, "listing entry %s vanished, skipping",
-                 entry_path.c_str());
-        continue;
-      }
+  if (!d.IsDirectory()) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
 
-      struct stat fixed_info = i->info;
-      fixed_info.st_ino = entry_dirent.inode();
-      AddToDirListing(req, i->name.c_str(), &fixed_info, &listing);
-    } else {
-      AddToDirListing(req, i->name.c_str(), &(i->info), &listing);
+  // Build listing
+  DirectoryListing listing;
+  const uint64_t revision = catalog_manager_->GetRevision();
+  if (!listing_cache_ || !listing_cache_->Lookup(ino, revision, &listing)) {
+    *latency.cache_miss() = true;
+
+    // Add current directory link
+    struct stat info;
+    info = d.GetStatStructure();
+    AddToDirListing(req, ".", &info, &listing);
+
+    // Add parent directory link
+    catalog::DirectoryEntry p;
+    if (d.inode() != catalog_manager_->GetRootInode() &&
+        GetDirentForInode(d.parent_inode(), &p))
+    {
+      info = p.GetStatStructure();
+      AddToDirListing(req, "..", &info, &listing);
+    }
+
+    // Add all names
+    const bool listed = ((readdir_prime_ > 0) && !nfs_maps_) ?
+                        ListAndPrime(req, ino, path, &listing) :
+                        ListStat(req, ino, path, &listing);
+    if (!listed) {
+      free(listing.buffer);
+      fuse_reply_err(req, EIO);
+      return;
     }
+    if (listing_cache_)
+      listing_cache_->Insert(ino, revision, listing);
   }
 
   // Save the directory listing and return a handle to the listing
-  pthread_mutex_lock(&lock_directory_handles_);
-  (*directory_handles_)[next_directory_handle_] = listing;
-  fi->fh = next_directory_handle_;
-  ++next_directory_handle_;
-  pthread_mutex_unlock(&lock_directory_handles_);
-  atomic_inc64(&num_fs_dir_open_);
+  uint64_t handle;
+  if (!directory_handles_->Add(listing, &handle)) {
+    LogCvmfs(kLogCvmfs, kLogSyslog, "directory handle limit exceeded");
+    free(listing.buffer);
+    fuse_reply_err(req, EMFILE);
+    return;
+  }
+  fi->fh = handle;
+  num_fs_dir_open_.Inc();
   atomic_inc32(&open_dirs_);
 
   fuse_reply_open(req, fi);
@@ -687,19 +2338,10 @@ static void cvmfs_releasedir(fuse_req_t req, fuse_ino_t ino,
            catalog_manager_->MangleInode(ino));
 
   int reply = 0;
-
-  pthread_mutex_lock(&lock_directory_handles_);
-  DirectoryHandles::iterator iter_handle =
-    directory_handles_->find(fi->fh);
-  if (iter_handle != directory_handles_->end()) {
-    free(iter_handle->second.buffer);
-    directory_handles_->erase(iter_handle);
-    pthread_mutex_unlock(&lock_directory_handles_);
+  if (directory_handles_->Remove(fi->fh))
     atomic_dec32(&open_dirs_);
-  } else {
-    pthread_mutex_unlock(&lock_directory_handles_);
+  else
     reply = EINVAL;
-  }
 
   fuse_reply_err(req, reply);
 }
@@ -732,19 +2374,11 @@ static void cvmfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
            catalog_manager_->MangleInode(ino), size, off);
 
   DirectoryListing listing;
-
-  pthread_mutex_lock(&lock_directory_handles_);
-  DirectoryHandles::const_iterator iter_handle =
-    directory_handles_->find(fi->fh);
-  if (iter_handle != directory_handles_->end()) {
-    listing = iter_handle->second;
-    pthread_mutex_unlock(&lock_directory_handles_);
-
+  if (directory_handles_->Lookup(fi->fh, &listing)) {
     ReplyBufferSlice(req, listing.buffer, listing.size, off, size);
     return;
   }
 
-  pthread_mutex_unlock(&lock_directory_handles_);
   fuse_reply_err(req, EINVAL);
 }
 
@@ -757,6 +2391,7 @@ static void cvmfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
                        struct fuse_file_info *fi)
 {
+  LatencyRecorder latency("open", kLatencyOpenHit, kLatencyOpenMiss);
   ino = catalog_manager_->MangleInode(ino);
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_open on inode: %d", ino);
 
@@ -764,8 +2399,8 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
   catalog::DirectoryEntry dirent;
   PathString path;
 
-  const bool found = GetDirentForInode(ino, &dirent) &&
-                     GetPathForInode(ino, &path);
+  const bool found = GetDirentForInode(ino, &dirent, latency.cache_miss()) &&
+                     GetPathForInode(ino, &path, latency.cache_miss());
 
   if (!found) {
     if (fi->flags & O_CREAT)
@@ -774,6 +2409,7 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
       fuse_reply_err(req, ENOENT);
     return;
   }
+  tracer::Trace(tracer::kFuseOpen, path, "open()");
 
   if ((fi->flags & 3) != O_RDONLY) {
     fuse_reply_err(req, EROFS);
@@ -790,40 +2426,129 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
     return;
   }
 
-  fd = cache::Fetch(dirent, string(path.GetChars(), path.GetLength()));  // TODO
-  atomic_inc64(&num_fs_open_);
-
-  if (fd >= 0) {
-    if (atomic_xadd32(&open_files_, 1) <
-        (static_cast<int>(max_open_files_))-kNumReservedFd) {
-      LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened (fd %d)",
-               path.c_str(), fd);
-      // If file has changed with a new catalog, the kernel data cache needs
-      // to be invalidated.  Special case: 0s metadata timeout includes no page
-      // cache
+  num_fs_open_.Inc();
+  if (dirent.IsChunkedFile()) {
+    catalog::FileChunkList chunks;
+    if (catalog_manager_->ListFileChunks(path, &chunks) && !chunks.empty()) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened as %u chunks",
+               path.c_str(), chunks.size());
+      num_fs_open_chunked_.Inc();
+      ChunkedFile *chunked_file = new ChunkedFile(chunks, path);
       fi->keep_cache = kcache_timeout_ == 0.0 ? 0 : 1;
       if (dirent.cached_mtime() != dirent.mtime()) {
-        LogCvmfs(kLogCvmfs, kLogDebug,
-                 "file might be new or changed, invalidating cache (%d %d)",
-                 dirent.mtime(), dirent.cached_mtime());
         fi->keep_cache = 0;
         dirent.set_cached_mtime(dirent.mtime());
         inode_cache_->Insert(ino, dirent);
       }
-      fi->fh = fd;
+      fi->fh = kChunkedHandle | reinterpret_cast<uintptr_t>(chunked_file);
       fuse_reply_open(req, fi);
+      if (prefetch_)
+        prefetch::Observe(fuse_req_ctx(req)->pid, path);
       return;
-    } else {
-      if (close(fd) == 0) atomic_dec32(&open_files_);
-      LogCvmfs(kLogCvmfs, kLogSyslog, "open file descriptor limit exceeded");
-      fuse_reply_err(req, EMFILE);
+    }
+    // Use the bulk version of the file instead, if it is published
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "no chunks found for chunked file %s", path.c_str());
+    if (dirent.checksum().IsNull()) {
+      fuse_reply_err(req, EIO);
+      return;
+    }
+  }
+
+  if (stream_read_ && (dirent.size() >= kMinStreamingSize) &&
+      !cache::Contains(dirent.checksum()))
+  {
+    cache::StreamingFetch *stream =
+      cache::StartStreaming(dirent, path.ToString());
+    if (stream) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened while downloading",
+               path.c_str());
+      *latency.cache_miss() = true;
+      // A failed download must not leave pages behind in the kernel cache
+      fi->keep_cache = 0;
+      if (dirent.cached_mtime() != dirent.mtime()) {
+        dirent.set_cached_mtime(dirent.mtime());
+        inode_cache_->Insert(ino, dirent);
+      }
+      fi->fh = kStreamingHandle | reinterpret_cast<uintptr_t>(stream);
+      fuse_reply_open(req, fi);
+      if (prefetch_)
+        prefetch::Observe(fuse_req_ctx(req)->pid, path);
       return;
     }
+  }
+
+  const cache::MemoryObject *memory_object = NULL;
+  const bool memory_candidate = cache::IsMemoryTierCandidate(dirent.size());
+  if (memory_candidate)
+    memory_object = cache::AcquireFromMemory(dirent.checksum());
+  if (!memory_object) {
+    fd = open_file_cache_->Acquire(dirent.checksum());
+    if (fd < 0) {
+      *latency.cache_miss() = true;
+      hash::Any bundle_hash;
+      catalog::BundleMemberList bundle_members;
+      if (file_bundles_ && !cache::Contains(dirent.checksum()) &&
+          catalog_manager_->LookupBundle(path, dirent.checksum(),
+                                         &bundle_hash, &bundle_members))
+      {
+        fd = cache::FetchBundle(dirent, bundle_hash, bundle_members,
+                                path.ToString());
+      } else {
+        fd = cache::Fetch(dirent, path);
+      }
+      if (fd >= 0)
+        fd = open_file_cache_->Insert(dirent.checksum(), fd);
+    }
+    if ((fd >= 0) && memory_candidate) {
+      memory_object =
+        cache::LoadIntoMemory(dirent.checksum(), fd, dirent.size());
+      if (memory_object)
+        open_file_cache_->Release(fd);
+    }
+  }
+
+  if (memory_object) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened from memory",
+             path.c_str());
+    fd = 0;
+  }
+  if (fd >= 0) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "file %s opened (fd %d)",
+             path.c_str(), fd);
+    // If file has changed with a new catalog, the kernel data cache needs
+    // to be invalidated.  Special case: 0s metadata timeout includes no page
+    // cache
+    fi->keep_cache = kcache_timeout_ == 0.0 ? 0 : 1;
+    if (dirent.cached_mtime() != dirent.mtime()) {
+      LogCvmfs(kLogCvmfs, kLogDebug,
+               "file might be new or changed, invalidating cache (%d %d)",
+               dirent.mtime(), dirent.cached_mtime());
+      fi->keep_cache = 0;
+      dirent.set_cached_mtime(dirent.mtime());
+      inode_cache_->Insert(ino, dirent);
+    }
+    cache::CompressedObject *compressed = NULL;
+    if (!memory_object)
+      compressed = cache::OpenCompressed(dirent.checksum(), fd);
+    if (memory_object)
+      fi->fh = kMemoryHandle | reinterpret_cast<uintptr_t>(memory_object);
+    else if (compressed)
+      fi->fh = kCompressedHandle | reinterpret_cast<uintptr_t>(compressed);
+    else
+      fi->fh = fd;
+    if (pagecache_hints_ && !memory_object && !compressed)
+      page_cache::ObserveOpen(fd, dirent.size());
+    fuse_reply_open(req, fi);
+    if (prefetch_)
+      prefetch::Observe(fuse_req_ctx(req)->pid, path);
+    return;
   } else {
     LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
              "failed to open inode: %d, CAS key %s, error code %d",
-             ino, dirent.checksum().ToString().c_str(), errno);
-    if (errno == EMFILE) {
+             ino, dirent.checksum().ToString().c_str(), -fd);
+    if (fd == -EMFILE) {
+      LogCvmfs(kLogCvmfs, kLogSyslog, "open file descriptor limit exceeded");
       fuse_reply_err(req, EMFILE);
       return;
     }
@@ -831,24 +2556,106 @@ static void cvmfs_open(fuse_req_t req, fuse_ino_t ino,
 
   // Prevent Squid DoS
   // TODO: move to download
-  time_t now = time(NULL);
-  if (now - previous_io_error_.timestamp < kForgetDos) {
-    usleep(previous_io_error_.delay*1000);
-    if (previous_io_error_.delay < kMaxIoDelay)
-      previous_io_error_.delay *= 2;
-  } else {
-    // Initial delay
-    previous_io_error_.delay = (random() % (kMaxInitIoDelay-1)) + 2;
+  atomic_inc32(&num_io_error_);
+  deferred_error_replies_->Reply(req, -fd);
+}
+
+
+/**
+ * Collects the requested range from the chunks that overlap it.  Chunks are
+ * fetched on first access, so only the read parts of the file are downloaded.
+ * Sequential readers have the following chunks read ahead.
+ */
+static void ReadChunked(fuse_req_t req, ChunkedFile *chunked_file,
+                        const size_t size, const off_t off)
+{
+  char *data = static_cast<char *>(alloca(size));
+  size_t nbytes = 0;
+  int error = 0;
+
+  pthread_mutex_lock(&chunked_file->lock);
+  while (nbytes < size) {
+    const off_t pos = off + nbytes;
+    const int idx = chunked_file->FindChunk(pos);
+    if (idx < 0)
+      break;  // end of file
+    const catalog::FileChunk &chunk = chunked_file->chunks[idx];
+
+    if (idx != chunked_file->chunk_idx) {
+      chunked_file->ReleaseChunk();
+      int fd = open_file_cache_->Acquire(chunk.content_hash);
+      if (fd < 0) {
+        fd = cache::FetchChunk(chunk, chunked_file->path);
+        if (fd >= 0)
+          fd = open_file_cache_->Insert(chunk.content_hash, fd);
+      }
+      chunked_file->chunk_fd = fd;
+      if (fd < 0) {
+        LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+                 "failed to fetch chunk %d of %s, CAS key %s, error code %d",
+                 idx, chunked_file->path.c_str(),
+                 chunk.content_hash.ToString().c_str(), -fd);
+        error = -fd;
+        break;
+      }
+      chunked_file->chunk_compressed =
+        cache::OpenCompressed(chunk.content_hash, fd);
+      chunked_file->chunk_idx = idx;
+      num_chunk_loads_.Inc();
+    }
+
+    const size_t chunk_bytes =
+      std::min(size - nbytes, size_t(chunk.offset + chunk.size - pos));
+    ssize_t result;
+    if (chunked_file->chunk_compressed) {
+      result = cache::ReadCompressed(chunked_file->chunk_compressed,
+                                     data + nbytes, chunk_bytes,
+                                     pos - chunk.offset);
+      if (result < 0) {
+        error = -result;
+        break;
+      }
+    } else {
+      result = pread(chunked_file->chunk_fd, data + nbytes, chunk_bytes,
+                     pos - chunk.offset);
+      if (result < 0) {
+        error = errno;
+        break;
+      }
+    }
+    nbytes += result;
+    if (size_t(result) < chunk_bytes)
+      break;  // truncated chunk in cache
+  }
+  if (readahead_ && (nbytes > 0)) {
+    const int window = chunked_file->access_pattern.Observe(off, size);
+    const int last_idx = chunked_file->FindChunk(off + nbytes - 1);
+    const int num_chunks = chunked_file->chunks.size();
+    for (int i = std::max(last_idx, chunked_file->readahead_idx) + 1;
+         (i <= last_idx + window) && (i < num_chunks); ++i)
+    {
+      read_ahead::Enqueue(chunked_file->chunks[i], chunked_file->path);
+      chunked_file->readahead_idx = i;
+    }
   }
-  previous_io_error_.timestamp = now;
+  pthread_mutex_unlock(&chunked_file->lock);
 
-  atomic_inc32(&num_io_error_);
-  fuse_reply_err(req, -fd);
+  if ((error != 0) && (nbytes == 0)) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "chunked read err no %d", error);
+    atomic_inc32(&num_io_error_);
+    fuse_reply_err(req, error);
+    return;
+  }
+  fuse_reply_buf(req, data, nbytes);
+  num_read_bytes_buffer_.Xadd(nbytes);
+  LogCvmfs(kLogCvmfs, kLogDebug, "pushed %d bytes from chunks to user", nbytes);
 }
 
 
 /**
- * Redirected to pread into cache.
+ * Redirected to pread into cache.  In splice mode, the cache file descriptor
+ * is handed to Fuse, which moves the pages to the kernel without copying them
+ * through user space.
  */
 static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                        struct fuse_file_info *fi)
@@ -856,17 +2663,103 @@ static void cvmfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
   LogCvmfs(kLogCvmfs, kLogDebug,
            "cvmfs_read on inode: %d reading %d bytes from offset %d fd %d",
            catalog_manager_->MangleInode(ino), size, off, fi->fh);
-  atomic_inc64(&num_fs_read_);
+  LatencyRecorder latency("read", kLatencyRead, kLatencyRead);
+  num_fs_read_.Inc();
+
+  if (fi->fh & kMemoryHandle) {
+    const cache::MemoryObject *object =
+      reinterpret_cast<const cache::MemoryObject *>(
+        uintptr_t(fi->fh & ~kMemoryHandle));
+    if (uint64_t(off) >= object->size) {
+      fuse_reply_buf(req, NULL, 0);
+      return;
+    }
+    const size_t nbytes = std::min(uint64_t(size), object->size - off);
+    fuse_reply_buf(req, reinterpret_cast<char *>(object->buffer) + off,
+                   nbytes);
+    num_read_bytes_memory_.Xadd(nbytes);
+    return;
+  }
+  if (fi->fh & kChunkedHandle) {
+    ChunkedFile *chunked_file = reinterpret_cast<ChunkedFile *>(
+      uintptr_t(fi->fh & ~kChunkedHandle));
+    ReadChunked(req, chunked_file, size, off);
+    return;
+  }
+  if (fi->fh & kStreamingHandle) {
+    cache::StreamingFetch *stream = reinterpret_cast<cache::StreamingFetch *>(
+      uintptr_t(fi->fh & ~kStreamingHandle));
+    char *data = static_cast<char *>(alloca(size));
+    const int64_t result = cache::ReadStreaming(stream, data, size, off);
+    if (result >= 0) {
+      fuse_reply_buf(req, data, result);
+      num_read_bytes_buffer_.Xadd(result);
+    } else {
+      LogCvmfs(kLogCvmfs, kLogDebug, "streaming read err no %d", -result);
+      atomic_inc32(&num_io_error_);
+      fuse_reply_err(req, -result);
+    }
+    return;
+  }
+  if (fi->fh & kCompressedHandle) {
+    cache::CompressedObject *compressed =
+      reinterpret_cast<cache::CompressedObject *>(
+        uintptr_t(fi->fh & ~kCompressedHandle));
+    char *data = static_cast<char *>(alloca(size));
+    const int64_t result = cache::ReadCompressed(compressed, data, size, off);
+    if (result >= 0) {
+      fuse_reply_buf(req, data, result);
+      num_read_bytes_buffer_.Xadd(result);
+    } else {
+      LogCvmfs(kLogCvmfs, kLogDebug, "compressed read err no %d", -result);
+      atomic_inc32(&num_io_error_);
+      fuse_reply_err(req, -result);
+    }
+    return;
+  }
+  const int64_t fd = fi->fh;
+
+#ifdef CVMFS_SPLICE_SUPPORT
+  if (splice_read_) {
+    // Fuse does not report the number of transferred bytes.  Cache files
+    // don't change, so the bytes available are known from their size.
+    platform_stat64 info;
+    if (platform_fstat(fd, &info) != 0) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "read err no %d on fstat", errno);
+      fuse_reply_err(req, errno);
+      return;
+    }
+    const size_t nbytes = (off >= info.st_size) ? 0 :
+      std::min(uint64_t(size), uint64_t(info.st_size - off));
+    struct fuse_bufvec data = FUSE_BUFVEC_INIT(nbytes);
+    data.buf[0].flags =
+      static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    data.buf[0].fd = fd;
+    data.buf[0].pos = off;
+    const int result = fuse_reply_data(req, &data, FUSE_BUF_SPLICE_MOVE);
+    if (result == 0) {
+      num_read_bytes_splice_.Xadd(nbytes);
+      LogCvmfs(kLogCvmfs, kLogDebug, "spliced %d bytes to user", nbytes);
+      if (pagecache_hints_)
+        page_cache::ObserveRead(fd, off, nbytes);
+    } else {
+      LogCvmfs(kLogCvmfs, kLogDebug, "splice err no %d", -result);
+    }
+    return;
+  }
+#endif
 
   // Get data chunk (<=4k guaranteed by Fuse)
   char *data = static_cast<char *>(alloca(size));
-  const int64_t fd = fi->fh;
   int result = pread(fd, data, size, off);
 
   // Push it to user
   if (result >= 0) {
     fuse_reply_buf(req, data, result);
+    num_read_bytes_buffer_.Xadd(result);
     LogCvmfs(kLogCvmfs, kLogDebug, "pushed %d bytes to user", result);
+    if (pagecache_hints_)
+      page_cache::ObserveRead(fd, off, result);
   } else {
     LogCvmfs(kLogCvmfs, kLogDebug, "read err no %d result %d", errno, result);
     fuse_reply_err(req, errno);
@@ -883,8 +2776,36 @@ static void cvmfs_release(fuse_req_t req, fuse_ino_t ino,
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_release on inode: %d",
            catalog_manager_->MangleInode(ino));
 
+  if (fi->fh & kMemoryHandle) {
+    cache::ReleaseMemory(reinterpret_cast<const cache::MemoryObject *>(
+      uintptr_t(fi->fh & ~kMemoryHandle)));
+    fuse_reply_err(req, 0);
+    return;
+  }
+  if (fi->fh & kChunkedHandle) {
+    delete reinterpret_cast<ChunkedFile *>(uintptr_t(fi->fh & ~kChunkedHandle));
+    fuse_reply_err(req, 0);
+    return;
+  }
+  if (fi->fh & kStreamingHandle) {
+    cache::ReleaseStreaming(reinterpret_cast<cache::StreamingFetch *>(
+      uintptr_t(fi->fh & ~kStreamingHandle)));
+    fuse_reply_err(req, 0);
+    return;
+  }
+  if (fi->fh & kCompressedHandle) {
+    const int fd = cache::CloseCompressed(
+      reinterpret_cast<cache::CompressedObject *>(
+        uintptr_t(fi->fh & ~kCompressedHandle)));
+    const bool retval = open_file_cache_->Release(fd);
+    assert(retval);
+    fuse_reply_err(req, 0);
+    return;
+  }
+
   const int64_t fd = fi->fh;
-  if (close(fd) == 0) atomic_dec32(&open_files_);
+  const bool retval = open_file_cache_->Release(fd);
+  assert(retval);
 
   fuse_reply_err(req, 0);
 }
@@ -1030,7 +2951,42 @@ static void cvmfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
           fuse_reply_err(req, EIO);
           return;
         }
-        if (!zlib::CompressFile2Null(f, &hash)) {
+        // Compressed cache files are hashed in their plain form
+        cache::CompressedObject *compressed =
+          cache::OpenCompressed(d.checksum(), fd);
+        if (compressed) {
+          FILE *fplain = tmpfile();
+          char buf[4096];
+          int64_t nbytes = -EIO;
+          for (off_t pos = 0; fplain; pos += nbytes) {
+            nbytes = cache::ReadCompressed(compressed, buf, sizeof(buf), pos);
+            if ((nbytes <= 0) ||
+                (fwrite(buf, 1, nbytes, fplain) != size_t(nbytes)))
+            {
+              break;
+            }
+          }
+          cache::CloseCompressed(compressed);
+          fclose(f);
+          f = fplain;
+          if (!f || (nbytes != 0)) {
+            if (f) fclose(f);
+            fuse_reply_err(req, EIO);
+            return;
+          }
+          rewind(f);
+        }
+        // Large objects are published in parallel blocks, older ones serially
+        platform_stat64 info;
+        bool matched = false;
+        if ((platform_fstat(fileno(f), &info) == 0) &&
+            zlib::IsParallelSize(info.st_size))
+        {
+          matched = zlib::CompressFile2NullParallel(f, &hash) &&
+                    (hash == d.checksum());
+          rewind(f);
+        }
+        if (!matched && !zlib::CompressFile2Null(f, &hash)) {
           fclose(f);
           fuse_reply_err(req, EIO);
           return;
@@ -1055,7 +3011,7 @@ static void cvmfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
       attribute_value = StringifyInt((catalogs_valid_until_-now)/60);
     }
   } else if (attr == "user.maxfd") {
-    attribute_value = StringifyInt(max_open_files_ - kNumReservedFd);
+    attribute_value = StringifyInt(max_usable_fds_);
   } else if (attr == "user.usedfd") {
     attribute_value = StringifyInt(atomic_read32(&open_files_));
   } else if (attr == "user.useddirp") {
@@ -1089,9 +3045,9 @@ static void cvmfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
     const int num_catalogs = catalog_manager_->GetNumCatalogs();
     attribute_value = StringifyInt(num_catalogs);
   } else if (attr == "user.nopen") {
-    attribute_value = StringifyInt(atomic_read64(&num_fs_open_));
+    attribute_value = StringifyInt(num_fs_open_.Get());
   } else if (attr == "user.ndiropen") {
-    attribute_value = StringifyInt(atomic_read64(&num_fs_dir_open_));
+    attribute_value = StringifyInt(num_fs_dir_open_.Get());
   } else if (attr == "user.ndownload") {
     attribute_value = StringifyInt(cache::GetNumDownloads());
   } else if (attr == "user.timeout") {
@@ -1168,12 +3124,26 @@ static void cvmfs_init(void *userdata, struct fuse_conn_info *conn) {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_init");
 
   pid_ = getpid();
+  if (log_async_)
+    StartLogAsync();
   monitor::Spawn();
   download::Spawn();
   quota::Spawn();
   talk::Spawn();
   if (nfs_maps_)
     nfs_maps::Spawn();
+  deferred_error_replies_->Spawn();
+  if (kernel_invalidator_)
+    kernel_invalidator_->Spawn();
+  if (prefetch_)
+    prefetch::Spawn();
+  if (readahead_)
+    read_ahead::Spawn();
+  if (notification_)
+    notification::Spawn();
+  memory_budget::Spawn();
+  catalog_manager_->SpawnNestedPrefetch();
+  SpawnDeferredStartup();
 
   if (*tracefile_ != "")
     tracer::Init(8192, 7000, *tracefile_);
@@ -1187,10 +3157,30 @@ static void cvmfs_init(void *userdata, struct fuse_conn_info *conn) {
 #ifdef CVMFS_NFS_SUPPORT
   conn->want |= FUSE_CAP_EXPORT_SUPPORT;
 #endif
+
+  // Zero-copy reads, fall back to buffered reads if the kernel can't splice
+#ifdef CVMFS_SPLICE_SUPPORT
+  if (splice_read_) {
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+      conn->want |= FUSE_CAP_SPLICE_WRITE;
+      if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    } else {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "kernel does not support splice, using buffered reads");
+      splice_read_ = false;
+    }
+  }
+#else
+  splice_read_ = false;
+#endif
 }
 
 static void cvmfs_destroy(void *unused __attribute__((unused))) {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_destroy");
+  deferred_error_replies_->Fini();
+  if (kernel_invalidator_)
+    kernel_invalidator_->Fini();
   tracer::Fini();
 }
 
@@ -1216,6 +3206,8 @@ static void set_cvmfs_ops(struct fuse_lowlevel_ops *cvmfs_operations) {
   cvmfs_operations->statfs      = cvmfs_statfs;
   cvmfs_operations->getxattr    = cvmfs_getxattr;
   cvmfs_operations->listxattr   = cvmfs_listxattr;
+  if (kernel_notify_)
+    cvmfs_operations->forget    = cvmfs_forget;
 }
 
 }  // namespace cvmfs
@@ -1239,7 +3231,27 @@ struct CvmfsOptions {
   char     *repo_name;
   char     *interface;
   char     *root_hash;
+  char     *quota_policy;
+  char     *notification_url;
+  char     *cache_report;
   int      memcache;
+  int      listing_cache;
+  int      readdir_prime;
+  int      memory_tier;
+  int      compressed_cache;
+  int      memory_budget;
+  int      catalog_prefetch;
+  int      catalog_readers;
+  int      catalog_mmap;
+  int      catalog_bloom;
+  int      catalog_cache;
+  int      catalog_index_mem;
+  int      proxy_hedging;
+  int      proxy_failure_limit;
+  int      http2;
+  int      dns_cache;
+  int      decompress_threads;
+  int      host_probe_interval;
   int      ignore_signature;
   int      rebuild_cachedb;
   int      nofiles;
@@ -1255,12 +3267,36 @@ struct CvmfsOptions {
   int      diskless;
   int      no_reload;
   int      shared_cache;
+  int      memcache_clock;
+  int      memcache_snapshot;
+  int      splice_read;
+  int      notify_invalidation;
+  int      prefetch;
+  int      readahead;
+  int      pagecache_prefetch;
+  int      pagecache_dropbehind;
+  int      fuse_workers;
+  int      fuse_pinning;
+  int      stream_read;
+  int      catalog_index;
+  int      catalog_deltas;
+  int      file_bundles;
+  int      peer_cache;
+  int      trace_binary;
+  int      trace_drop;
+  int      stall_threshold;
+  int      log_async;
 #ifdef CVMFS_NFS_SUPPORT
   int      nfs_source;
+  int      nfs_maps_cache;
+  int      nfs_maps_bloom;
+  int      nfs_maps_front;
 #endif
 
   int64_t  quota_limit;
   int64_t  quota_threshold;
+  int64_t  quota_share;
+  int64_t  quota_guarantee;
 };
 
 // Follow the fuse convention for option parsing
@@ -1278,8 +3314,25 @@ static struct fuse_opt cvmfs_array_opts[] = {
   CVMFS_OPT("timeout_direct=%u",   timeout_direct, 2),
   CVMFS_OPT("max_ttl=%u",          max_ttl, 0),
   CVMFS_OPT("memcache=%u",         memcache, 0),
+  CVMFS_OPT("listing_cache=%d",    listing_cache, 0),
+  CVMFS_OPT("readdir_prime=%u",    readdir_prime, 0),
+  CVMFS_OPT("memory_tier=%u",      memory_tier, 0),
+  CVMFS_OPT("compressed_cache=%u", compressed_cache, 0),
+  CVMFS_OPT("memory_budget=%u",    memory_budget, 0),
+  CVMFS_OPT("catalog_prefetch=%u", catalog_prefetch, 0),
+  CVMFS_OPT("catalog_readers=%u",  catalog_readers, 0),
+  CVMFS_OPT("catalog_mmap=%u",     catalog_mmap, 0),
+  CVMFS_OPT("catalog_bloom=%u",    catalog_bloom, 0),
+  CVMFS_OPT("catalog_cache=%u",    catalog_cache, 0),
+  CVMFS_OPT("catalog_index_mem=%u", catalog_index_mem, 0),
   CVMFS_OPT("cachedir=%s",         cachedir, 0),
   CVMFS_OPT("proxies=%s",          proxies, 0),
+  CVMFS_OPT("proxy_hedging=%u",    proxy_hedging, 0),
+  CVMFS_OPT("proxy_failure_limit=%d", proxy_failure_limit, 0),
+  CVMFS_SWITCH("http2",            http2),
+  CVMFS_OPT("dns_cache=%u",        dns_cache, 0),
+  CVMFS_OPT("decompress_threads=%u", decompress_threads, 0),
+  CVMFS_OPT("host_probe_interval=%u", host_probe_interval, 0),
   CVMFS_OPT("tracefile=%s",        tracefile, 0),
   CVMFS_SWITCH("ignore_signature", ignore_signature),
   CVMFS_OPT("pubkey=%s",           pubkey, 0),
@@ -1287,6 +3340,9 @@ static struct fuse_opt cvmfs_array_opts[] = {
   CVMFS_SWITCH("rebuild_cachedb",  rebuild_cachedb),
   CVMFS_OPT("quota_limit=%ld",     quota_limit, 0),
   CVMFS_OPT("quota_threshold=%ld", quota_threshold, 0),
+  CVMFS_OPT("quota_policy=%s",     quota_policy, 0),
+  CVMFS_OPT("quota_share=%ld",     quota_share, 0),
+  CVMFS_OPT("quota_guarantee=%ld", quota_guarantee, 0),
   CVMFS_OPT("nofiles=%d",          nofiles, 0),
   CVMFS_SWITCH("grab_mountpoint",  grab_mountpoint),
   CVMFS_OPT("repo_name=%s",        repo_name, 0),
@@ -1296,10 +3352,34 @@ static struct fuse_opt cvmfs_array_opts[] = {
   CVMFS_SWITCH("diskless",         diskless),
   CVMFS_OPT("interface=%s",        interface, 0),
   CVMFS_OPT("root_hash=%s",        root_hash, 0),
+  CVMFS_OPT("notification_url=%s", notification_url, 0),
+  CVMFS_OPT("cache_report=%s",     cache_report, 0),
   CVMFS_SWITCH("no_reload",        no_reload),
   CVMFS_SWITCH("shared_cache",     shared_cache),
+  CVMFS_SWITCH("memcache_clock",   memcache_clock),
+  CVMFS_SWITCH("memcache_snapshot", memcache_snapshot),
+  CVMFS_SWITCH("splice_read",      splice_read),
+  CVMFS_SWITCH("notify_invalidation", notify_invalidation),
+  CVMFS_SWITCH("prefetch",         prefetch),
+  CVMFS_OPT("readahead=%u",        readahead, 0),
+  CVMFS_OPT("pagecache_prefetch=%u", pagecache_prefetch, 0),
+  CVMFS_OPT("pagecache_dropbehind=%u", pagecache_dropbehind, 0),
+  CVMFS_OPT("fuse_workers=%u",     fuse_workers, 0),
+  CVMFS_SWITCH("fuse_pinning",     fuse_pinning),
+  CVMFS_SWITCH("stream_read",      stream_read),
+  CVMFS_SWITCH("catalog_index",    catalog_index),
+  CVMFS_SWITCH("catalog_deltas",   catalog_deltas),
+  CVMFS_SWITCH("file_bundles",     file_bundles),
+  CVMFS_SWITCH("peer_cache",       peer_cache),
+  CVMFS_SWITCH("trace_binary",     trace_binary),
+  CVMFS_SWITCH("trace_drop",       trace_drop),
+  CVMFS_OPT("stall_threshold=%u",  stall_threshold, 0),
+  CVMFS_SWITCH("log_async",        log_async),
 #ifdef CVMFS_NFS_SUPPORT
   CVMFS_SWITCH("nfs_source",       nfs_source),
+  CVMFS_OPT("nfs_maps_cache=%u",   nfs_maps_cache, 0),
+  CVMFS_OPT("nfs_maps_bloom=%u",   nfs_maps_bloom, 0),
+  CVMFS_OPT("nfs_maps_front=%u",   nfs_maps_front, 0),
 #endif
 
   FUSE_OPT_KEY("-V",            KEY_VERSION),
@@ -1349,10 +3429,66 @@ static void usage(const char *progname) {
       "Timeout of the kernel meta-data cache (default %d, turn off with -1)\n"
     " -o memcache=<MB>           "
       "Memory in MB reserved for the meta-data memory cache (default: %u)\n"
+    " -o memcache_clock          "
+      "Second-chance instead of LRU replacement in the meta-data cache\n"
+    " -o memcache_snapshot       "
+      "Keep the meta-data cache in the cache directory over restarts\n"
+    " -o listing_cache=<MB>      "
+      "Memory in MB for cached directory listings "
+      "(default: %u, turn off with -1)\n"
+    " -o readdir_prime=<N>       "
+      "Listings of up to N entries fill the meta-data cache (default: off)\n"
+    " -o memory_tier=<MB>        "
+      "Memory in MB for small, frequently opened files (default: off)\n"
+    " -o compressed_cache=<MB>   "
+      "Keep files compressed in the cache, with MB memory for\n"
+      "                            inflated blocks (default: off)\n"
+    " -o memory_budget=<MB>      "
+      "Shrink the memory caches to keep them within MB in total\n"
+      "                            (default: off)\n"
+    " -o catalog_prefetch=<N>    "
+      "Download up to N nested catalogs in parallel (default: off)\n"
+    " -o catalog_readers=<N>     "
+      "Database connections per catalog for parallel lookups (default: 1)\n"
+    " -o catalog_mmap=<MB>       "
+      "Memory-map read-only catalogs up to MB in total (default: off)\n"
+    " -o catalog_bloom=<BITS>    "
+      "Bloom filter with BITS per catalog entry for negative lookups\n"
+      "                            (default: off)\n"
+    " -o catalog_cache=<MB>      "
+      "SQlite page cache spread across catalogs by lookup rate\n"
+      "                            (default: off)\n"
     " -o cachedir=DIR            Where to store disk cache\n"
     " -o proxies=HTTP_PROXIES    "
       "Set the HTTP proxy list, such as 'proxy1|proxy2;DIRECT'\n"
+    " -o proxy_hedging=PERCENT   "
+      "Duplicate requests without response in the PERCENT percentile\n"
+      "                            of recent latencies to the next proxy "
+      "(default: off)\n"
+    " -o proxy_failure_limit=<N> "
+      "Skip a proxy after N connection failures in a row until it\n"
+      "                            answers a probe, -1 switches off "
+      "(default: 3)\n"
+    " -o http2                   "
+      "Multiplex requests to proxies and hosts over HTTP/2\n"
+    " -o dns_cache=SEC           "
+      "Cache proxy and host addresses for SEC seconds and refresh\n"
+      "                            them in the background (default: off)\n"
+    " -o decompress_threads=<N>  "
+      "Decompress and verify downloads in N threads (default: off)\n"
+    " -o host_probe_interval=SEC "
+      "Track host round trip times, probe every SEC seconds\n"
+      "                            and switch to the fastest host "
+      "(default: off)\n"
     " -o tracefile=FILE          Trace FUSE opaerations into FILE\n"
+    " -o trace_binary            "
+      "Write the trace in binary format (cvmfs_swissknife trace2csv)\n"
+    " -o trace_drop              "
+      "Drop and count trace messages instead of waiting on full buffers\n"
+    " -o stall_threshold=SECONDS "
+      "Dump all stacks when a Fuse request takes longer (default off)\n"
+    " -o log_async               "
+      "Write debug log and syslog messages in a background thread\n"
     " -o pubkey=PEMFILE          "
       "Public RSA key that is used to verify the whitelist signature.\n"
     " -o ignore_signature        "
@@ -1362,6 +3498,13 @@ static void usage(const char *progname) {
     " -o quota_limit=MB          "
       "Limit size of data chunks in cache. -1 Means unlimited.\n"
     " -o quota_threshold=MB      Cleanup until size is <= threshold\n"
+    " -o quota_policy=POLICY     "
+      "Eviction order: lru (default), 2q (scan resistant),\n"
+    "                            size (keeps small, frequently used files)\n"
+    " -o quota_share=MB          "
+      "Soft share of this repository in a shared cache\n"
+    " -o quota_guarantee=MB      "
+      "Minimum share of this repository in a shared cache\n"
     " -o nofiles=NUMBER          "
       "Set the maximum number of open files for CernVM-FS process "
       "(soft limit)\n"
@@ -1384,9 +3527,56 @@ static void usage(const char *progname) {
       "Avoids to reload catalogs when the TTL expires.\n"
     " -o shared_cache            "
       "Cache directory is shared among multiple instances\n"
+    " -o splice_read             "
+      "Pass cached file contents to the kernel by splice (needs Fuse >= 2.9)\n"
+    " -o notify_invalidation     "
+      "Invalidate changed kernel cache entries on reload (needs Fuse >= 2.8)\n"
+      "                            Allows for large kcache_timeout values\n"
+    " -o prefetch                "
+      "Learn the order of opened files and prefetch likely followers\n"
+    " -o readahead=<N>           "
+      "Fetch up to N chunks ahead of sequential readers (default: off)\n"
+    " -o pagecache_prefetch=KB   "
+      "Read cached files up to KB into the page cache on open\n"
+      "                            (default: off)\n"
+    " -o pagecache_dropbehind=MB "
+      "Give access pattern hints for cached files of at least MB\n"
+      "                            and drop pages behind sequential readers "
+      "(default: off)\n"
+    " -o fuse_workers=<N>        "
+      "Serve Fuse requests by N threads, each on its own clone of the\n"
+      "                            Fuse channel if the kernel supports it "
+      "(default: libfuse)\n"
+    " -o fuse_pinning            "
+      "Pin the Fuse worker threads to CPUs\n"
+    " -o stream_read             "
+      "Open large files before they are completely downloaded\n"
+    " -o catalog_index           "
+      "Serve path lookups and listings from an in-memory catalog index\n"
+    " -o catalog_index_mem=MB    "
+      "Memory in MB for the indexes of all catalogs (default: 256)\n"
+    " -o catalog_deltas          "
+      "Patch changed catalogs from their previous revision\n"
+    " -o file_bundles            "
+      "Load the bundle of a missing small file with its siblings\n"
+    " -o peer_cache              "
+      "Fetch missing objects from the caches of LAN peers first\n"
+    " -o interface=ADDRESS       "
+      "IPv4 address of the network interface used for peers\n"
+    " -o notification_url=URL    "
+      "Subscribe to revision notifications, remount on publish\n"
+    " -o cache_report=PATHS      "
+      "Account cache hits and downloads to the colon separated\n"
+      "                            path prefixes\n"
 #ifdef CVMFS_NFS_SUPPORT
     " -o nfs_source              "
       "The CernVM-FS mountpoint is exported by NFS\n"
+    " -o nfs_maps_cache=<MB>     "
+      "leveldb block cache of the NFS maps (default: 40)\n"
+    " -o nfs_maps_bloom=<BITS>   "
+      "leveldb bloom filter bits per NFS maps key (default: 10)\n"
+    " -o nfs_maps_front=<N>      "
+      "In-memory entries in front of each NFS map (default: 65536)\n"
 #endif
     " Note: you cannot load files greater than quota_limit-quota_threshold\n"
     "\nFuse options:\n"
@@ -1398,7 +3588,8 @@ static void usage(const char *progname) {
       "allow mounts over non-empty file/dir\n"
     " -o default_permissions     "
       "enable permission checking by kernel\n",
-    2, 2, int(cvmfs::kcache_timeout_), cvmfs::kDefaultMemcache/(1024*1024));
+    2, 2, int(cvmfs::kcache_timeout_), cvmfs::kDefaultMemcache/(1024*1024),
+    unsigned(cvmfs::kDefaultListingCache/(1024*1024)));
 }
 
 
@@ -1417,6 +3608,8 @@ static void FreeCvmfsOptions(CvmfsOptions *opts) {
   if (opts->repo_name)      free(opts->repo_name);
   if (opts->interface)      free(opts->interface);
   if (opts->root_hash)      free(opts->root_hash);
+  if (opts->notification_url) free(opts->notification_url);
+  if (opts->cache_report)   free(opts->cache_report);
   delete cvmfs::cachedir_;
   delete cvmfs::tracefile_;
   delete cvmfs::repository_name_;
@@ -1559,6 +3752,81 @@ static void CleanupLibcryptoMt(void) {
 }
 
 
+/**
+ * Arguments and outcome of MainQuotaInit()
+ */
+struct QuotaInit {
+  QuotaInit() : exe_path(NULL), ready(false), result(false) { }
+  const char *exe_path;
+  bool ready;  /**< quota::Fini() is needed */
+  bool result;
+};
+
+/**
+ * Starts the cache manager in parallel to the other startup steps, its index
+ * has to be loaded before the root catalog is.
+ */
+static void *MainQuotaInit(void *data) {
+  QuotaInit *args = static_cast<QuotaInit *>(data);
+  uint64_t phase_start = cvmfs::GetClockMs();
+  if (g_cvmfs_opts.quota_limit < 0) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "unlimited cache size");
+    g_cvmfs_opts.quota_limit = -1;
+    g_cvmfs_opts.quota_threshold = 0;
+  } else {
+    g_cvmfs_opts.quota_limit *= 1024*1024;
+    g_cvmfs_opts.quota_threshold *= 1024*1024;
+  }
+  if (g_cvmfs_opts.quota_policy &&
+      !quota::SetEvictionPolicy(g_cvmfs_opts.quota_policy))
+  {
+    PrintError("Unknown quota policy " + string(g_cvmfs_opts.quota_policy));
+    return NULL;
+  }
+  if (g_cvmfs_opts.shared_cache) {
+    if (!quota::InitShared(args->exe_path, ".",
+                           (uint64_t)g_cvmfs_opts.quota_limit,
+                           (uint64_t)g_cvmfs_opts.quota_threshold))
+    {
+      PrintError("Failed to initialize shared lru cache");
+      return NULL;
+    }
+  } else {
+    if (!quota::Init(".", (uint64_t)g_cvmfs_opts.quota_limit,
+                     (uint64_t)g_cvmfs_opts.quota_threshold,
+                     g_cvmfs_opts.rebuild_cachedb))
+    {
+      PrintError("Failed to initialize lru cache");
+      return NULL;
+    }
+  }
+  args->ready = true;
+  if (!quota::RegisterRepository(*cvmfs::repository_name_,
+                                 g_cvmfs_opts.quota_share*1024*1024,
+                                 g_cvmfs_opts.quota_guarantee*1024*1024))
+  {
+    PrintError("Failed to register repository with the cache manager");
+    return NULL;
+  }
+
+  if (quota::GetSize() > quota::GetCapacity()) {
+    PrintWarning("your cache is already beyond quota size, cleaning up");
+    if (!quota::Cleanup(g_cvmfs_opts.quota_threshold)) {
+      PrintWarning("Failed to clean up");
+      return NULL;
+    }
+  }
+  if (g_cvmfs_opts.quota_limit) {
+    LogCvmfs(kLogCvmfs, kLogStdout,
+             "CernVM-FS: quota initialized, current size %luMB",
+             quota::GetSize()/(1024*1024));
+  }
+  cvmfs::RecordStartupPhase("quota", &phase_start);
+  args->result = true;
+  return NULL;
+}
+
+
 /**
  * Off we go
  */
@@ -1587,14 +3855,27 @@ int main(int argc, char *argv[]) {
   bool download_ready = false;
   bool cache_ready = false;
   bool nfs_maps_ready = false;
+  bool prefetch_ready = false;
+  bool readahead_ready = false;
+  bool pagecache_ready = false;
+  bool prefix_accounting_ready = false;
+  bool warmup_ready = false;
+  bool notification_ready = false;
+  bool memory_budget_ready = false;
   bool peers_ready = false;
   bool monitor_ready = false;
   bool signature_ready = false;
   bool quota_ready = false;
   bool talk_ready = false;
   bool running_created = false;
+  QuotaInit quota_init;
+  pthread_t thread_quota_init;
+  bool quota_init_running = false;
+  const uint64_t startup_ms = cvmfs::GetClockMs();
+  uint64_t phase_start = startup_ms;
 
   cvmfs::boot_time_ = time(NULL);
+  cvmfs::startup_phases_ = new vector< pair<string, uint64_t> >();
   SetupLibcryptoMt();
 
   // Parse options
@@ -1625,6 +3906,24 @@ int main(int argc, char *argv[]) {
 
   // Fill cvmfs option variables from Fuse options
   cvmfs::mem_cache_size_ = g_cvmfs_opts.memcache;
+  if (g_cvmfs_opts.listing_cache < 0)
+    cvmfs::listing_cache_size_ = 0;
+  else if (g_cvmfs_opts.listing_cache > 0)
+    cvmfs::listing_cache_size_ = uint64_t(g_cvmfs_opts.listing_cache)*1024*1024;
+  cvmfs::readdir_prime_ = g_cvmfs_opts.readdir_prime;
+  cvmfs::memory_tier_size_ = uint64_t(g_cvmfs_opts.memory_tier)*1024*1024;
+  cvmfs::compressed_cache_size_ =
+    uint64_t(g_cvmfs_opts.compressed_cache)*1024*1024;
+  cvmfs::catalog_prefetch_ = g_cvmfs_opts.catalog_prefetch;
+  catalog::Catalog::SetMaxReaders(g_cvmfs_opts.catalog_readers);
+  catalog::Database::SetMmapLimit(
+    static_cast<uint64_t>(g_cvmfs_opts.catalog_mmap) * 1024*1024);
+  catalog::Catalog::SetUseIndex(g_cvmfs_opts.catalog_index);
+  if (g_cvmfs_opts.catalog_index_mem > 0) {
+    catalog::CatalogIndex::SetMemoryLimit(
+      static_cast<uint64_t>(g_cvmfs_opts.catalog_index_mem) * 1024*1024);
+  }
+  catalog::Catalog::SetBloomBits(g_cvmfs_opts.catalog_bloom);
   cvmfs::cachedir_ = new string(g_cvmfs_opts.cachedir);
   cvmfs::tracefile_ = new string(g_cvmfs_opts.tracefile);
   cvmfs::repository_name_ = new string(g_cvmfs_opts.repo_name);
@@ -1637,6 +3936,20 @@ int main(int argc, char *argv[]) {
   }
   LogCvmfs(kLogCvmfs, kLogDebug, "kernel caches expire after %d seconds",
            int(cvmfs::kcache_timeout_));
+  cvmfs::splice_read_ = g_cvmfs_opts.splice_read;
+  cvmfs::prefetch_ = g_cvmfs_opts.prefetch;
+  cvmfs::stream_read_ = g_cvmfs_opts.stream_read;
+  cvmfs::file_bundles_ = g_cvmfs_opts.file_bundles;
+  cvmfs::log_async_ = g_cvmfs_opts.log_async;
+  tracer::SetMode(g_cvmfs_opts.trace_binary, g_cvmfs_opts.trace_drop);
+#ifdef CVMFS_NOTIFY_SUPPORT
+  cvmfs::kernel_notify_ = g_cvmfs_opts.notify_invalidation;
+#else
+  if (g_cvmfs_opts.notify_invalidation) {
+    LogCvmfs(kLogCvmfs, kLogStdout | kLogSyslog,
+             "Fuse too old, ignoring notify_invalidation");
+  }
+#endif
   options_ready = true;
 
   // Tune SQlite3 memory
@@ -1652,22 +3965,27 @@ int main(int argc, char *argv[]) {
   assert(retval == SQLITE_OK);
 
   // Runtime counters
-  atomic_init64(&cvmfs::num_fs_open_);
-  atomic_init64(&cvmfs::num_fs_dir_open_);
-  atomic_init64(&cvmfs::num_fs_lookup_);
-  atomic_init64(&cvmfs::num_fs_lookup_negative_);
-  atomic_init64(&cvmfs::num_fs_stat_);
-  atomic_init64(&cvmfs::num_fs_read_);
-  atomic_init64(&cvmfs::num_fs_readlink_);
+  cvmfs::num_fs_open_.Reset();
+  cvmfs::num_fs_dir_open_.Reset();
+  cvmfs::num_fs_lookup_.Reset();
+  cvmfs::num_fs_lookup_negative_.Reset();
+  cvmfs::num_fs_primed_.Reset();
+  cvmfs::num_fs_stat_.Reset();
+  cvmfs::num_fs_read_.Reset();
+  cvmfs::num_fs_readlink_.Reset();
+  cvmfs::num_read_bytes_buffer_.Reset();
+  cvmfs::num_read_bytes_splice_.Reset();
+  cvmfs::num_read_bytes_memory_.Reset();
+  cvmfs::num_fs_open_chunked_.Reset();
+  cvmfs::num_chunk_loads_.Reset();
   atomic_init32(&cvmfs::num_io_error_);
-  cvmfs::previous_io_error_.timestamp = 0;
-  cvmfs::previous_io_error_.delay = 0;
 
   // Logging
   SetLogSyslogLevel(g_cvmfs_opts.syslog_level);
   SetLogSyslogPrefix(*cvmfs::repository_name_);
   if (g_cvmfs_opts.logfile)
     SetLogDebugFile(string(g_cvmfs_opts.logfile));
+  cvmfs::RecordStartupPhase("options", &phase_start);
 
   // Maximum number of open files
   if (g_cvmfs_opts.nofiles) {
@@ -1713,13 +4031,23 @@ int main(int argc, char *argv[]) {
     goto cvmfs_cleanup;
   }
 
-  // Spawn / connect to peer server
-  if (g_cvmfs_opts.diskless) {
-    if (!peers::Init(GetParentPath(*cvmfs::cachedir_), argv[0],
-                     g_cvmfs_opts.interface))
-    {
-      PrintError("failed to initialize peer socket");
-      goto cvmfs_cleanup;
+  // Spawn / connect to peer server.  Peers are optional, so with absolute
+  // paths that survive the chdir() below this happens after the mount.
+  if (g_cvmfs_opts.diskless || g_cvmfs_opts.peer_cache) {
+    if ((argv[0][0] == '/') && ((*cvmfs::cachedir_)[0] == '/')) {
+      cvmfs::deferred_peers_ = new cvmfs::DeferredPeers();
+      cvmfs::deferred_peers_->cachedir = *cvmfs::cachedir_;
+      cvmfs::deferred_peers_->exe_path = argv[0];
+      cvmfs::deferred_peers_->interface = g_cvmfs_opts.interface ?
+                                          g_cvmfs_opts.interface : "";
+    } else {
+      if (!peers::Init(*cvmfs::cachedir_, argv[0],
+                       g_cvmfs_opts.interface))
+      {
+        PrintError("failed to initialize peer socket");
+        goto cvmfs_cleanup;
+      }
+      cvmfs::RecordStartupPhase("peers", &phase_start);
     }
   }
   peers_ready = true;
@@ -1757,13 +4085,21 @@ int main(int argc, char *argv[]) {
   running_created = true;
 
   // Creates a set of cache directories (256 directories named 00..ff)
-  if (!cache::Init(".")) {
+  if (!cache::Init(".", g_cvmfs_opts.shared_cache)) {
     PrintError("Failed to setup cache in " + *cvmfs::cachedir_ +
                ": " + strerror(errno));
     goto cvmfs_cleanup;
   }
   CreateFile("./.cvmfscache", 0600);
   cache_ready = true;
+  cvmfs::RecordStartupPhase("cache", &phase_start);
+
+  // Init quota / managed cache, joined before the root catalog is loaded
+  quota_init.exe_path = argv[0];
+  retval = pthread_create(&thread_quota_init, NULL, MainQuotaInit,
+                          &quota_init);
+  assert(retval == 0);
+  quota_init_running = true;
 
   // Start NFS maps module, if necessary
 #ifdef CVMFS_NFS_SUPPORT
@@ -1777,11 +4113,16 @@ int main(int argc, char *argv[]) {
     LogCvmfs(kLogCvmfs, kLogStdout | kLogNoLinebreak,
              "CernVM-FS: loading NFS maps... ");
     cvmfs::nfs_maps_ = true;
+    // Inodes are bound to paths, they don't change with a new catalog
+    cvmfs::kernel_notify_ = false;
     const string leveldb_cache_dir = "./nfs_maps." + (*cvmfs::repository_name_);
     if (!MkdirDeep(leveldb_cache_dir, 0700)) {
       PrintError("Failed to initialize NFS maps");
       goto cvmfs_cleanup;
     }
+    nfs_maps::SetTuning(g_cvmfs_opts.nfs_maps_cache,
+                        g_cvmfs_opts.nfs_maps_bloom,
+                        g_cvmfs_opts.nfs_maps_front);
     if (!nfs_maps::Init(leveldb_cache_dir,
                         catalog::AbstractCatalogManager::GetRootInode(),
                         g_cvmfs_opts.rebuild_cachedb))
@@ -1791,57 +4132,27 @@ int main(int argc, char *argv[]) {
     }
     LogCvmfs(kLogCvmfs, kLogStdout, "done");
     nfs_maps_ready = true;
+    cvmfs::RecordStartupPhase("nfs maps", &phase_start);
   } else {
     CreateFile("./no_nfs_maps." + (*cvmfs::repository_name_), 0600);
   }
 #endif
 
-  // Init quota / managed cache
-  if (g_cvmfs_opts.quota_limit < 0) {
-    LogCvmfs(kLogCvmfs, kLogDebug, "unlimited cache size");
-    g_cvmfs_opts.quota_limit = -1;
-    g_cvmfs_opts.quota_threshold = 0;
-  } else {
-    g_cvmfs_opts.quota_limit *= 1024*1024;
-    g_cvmfs_opts.quota_threshold *= 1024*1024;
-  }
-  if (g_cvmfs_opts.shared_cache) {
-    if (!quota::InitShared(argv[0], ".", (uint64_t)g_cvmfs_opts.quota_limit,
-                           (uint64_t)g_cvmfs_opts.quota_threshold))
-    {
-      PrintError("Failed to initialize shared lru cache");
-      goto cvmfs_cleanup;
-    }
-  } else {
-    if (!quota::Init(".", (uint64_t)g_cvmfs_opts.quota_limit,
-                     (uint64_t)g_cvmfs_opts.quota_threshold,
-                     g_cvmfs_opts.rebuild_cachedb))
-    {
-      PrintError("Failed to initialize lru cache");
-      goto cvmfs_cleanup;
-    }
-  }
-  quota_ready = true;
-
-  if (quota::GetSize() > quota::GetCapacity()) {
-    PrintWarning("your cache is already beyond quota size, cleaning up");
-    if (!quota::Cleanup(g_cvmfs_opts.quota_threshold)) {
-      PrintWarning("Failed to clean up");
-      goto cvmfs_cleanup;
-    }
-  }
-  if (g_cvmfs_opts.quota_limit) {
-    LogCvmfs(kLogCvmfs, kLogStdout,
-             "CernVM-FS: quota initialized, current size %luMB",
-             quota::GetSize()/(1024*1024));
-  }
-
   // Monitor, check for maximum number of open files
   if (!monitor::Init(".", true)) {
     PrintError("failed to initialize watchdog.");
     goto cvmfs_cleanup;
   }
   cvmfs::max_open_files_ = monitor::GetMaxOpenFiles();
+  if (cvmfs::max_open_files_ > unsigned(cvmfs::kNumReservedFd)) {
+    cvmfs::max_usable_fds_ = cvmfs::max_open_files_ - cvmfs::kNumReservedFd;
+  } else {
+    cvmfs::max_usable_fds_ = cvmfs::max_open_files_ / 2;
+    PrintWarning("only " + StringifyInt(cvmfs::max_open_files_) +
+                 " open files allowed, using " +
+                 StringifyInt(cvmfs::max_usable_fds_) + " of them for files");
+  }
+  monitor::SetStallThreshold(g_cvmfs_opts.stall_threshold);
   atomic_init32(&cvmfs::open_files_);
   atomic_init32(&cvmfs::open_dirs_);
   monitor_ready = true;
@@ -1853,6 +4164,7 @@ int main(int argc, char *argv[]) {
     goto cvmfs_cleanup;
   }
   talk_ready = true;
+  cvmfs::RecordStartupPhase("monitor and talk", &phase_start);
 
   // Network initialization
   download::Init(16);
@@ -1860,6 +4172,18 @@ int main(int argc, char *argv[]) {
   download::SetProxyChain(g_cvmfs_opts.proxies ?
                           string(g_cvmfs_opts.proxies) : "");
   download::SetTimeout(g_cvmfs_opts.timeout, g_cvmfs_opts.timeout_direct);
+  download::SetHedging(g_cvmfs_opts.proxy_hedging);
+  if (g_cvmfs_opts.proxy_failure_limit != 0) {
+    download::SetProxyFailureLimit(g_cvmfs_opts.proxy_failure_limit < 0 ?
+                                   0 : g_cvmfs_opts.proxy_failure_limit);
+  }
+  if (g_cvmfs_opts.http2 && !download::SetHttp2(true)) {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "libcurl without HTTP/2 support, using HTTP/1.1");
+  }
+  download::SetDnsCache(g_cvmfs_opts.dns_cache);
+  download::SetPipelineThreads(g_cvmfs_opts.decompress_threads);
+  download::SetHostProbeInterval(g_cvmfs_opts.host_probe_interval);
   download_ready = true;
 
   signature::Init();
@@ -1884,11 +4208,27 @@ int main(int argc, char *argv[]) {
       goto cvmfs_cleanup;
     }
   }
+  cvmfs::RecordStartupPhase("download and signature", &phase_start);
+
+  // The catalogs are pinned in the cache manager
+  pthread_join(thread_quota_init, NULL);
+  quota_init_running = false;
+  quota_ready = quota_init.ready;
+  if (!quota_init.result)
+    goto cvmfs_cleanup;
+  cvmfs::RecordStartupPhase("waiting for quota", &phase_start);
 
   // Load initial file catalog
   cvmfs::catalog_manager_ = new
     cache::CatalogManager(*cvmfs::repository_name_,
                           g_cvmfs_opts.ignore_signature);
+  if (cvmfs::catalog_prefetch_ > 0)
+    cvmfs::catalog_manager_->EnableNestedPrefetch(cvmfs::catalog_prefetch_);
+  if (g_cvmfs_opts.catalog_deltas)
+    cvmfs::catalog_manager_->EnableDeltas();
+  // SQlite page cache slots of 1280 bytes, see SQLITE_CONFIG_PAGECACHE
+  cvmfs::catalog_manager_->SetSqliteCacheBudget(
+    static_cast<uint64_t>(g_cvmfs_opts.catalog_cache) * 1024*1024 / 1280);
   if (g_cvmfs_opts.root_hash) {
     retval = cvmfs::catalog_manager_->InitFixed(
       hash::Any(hash::kSha1, hash::HexPtr(string(g_cvmfs_opts.root_hash))));
@@ -1899,6 +4239,49 @@ int main(int argc, char *argv[]) {
     LogCvmfs(kLogCvmfs, kLogStderr, "Failed to initialize root file catalog");
     goto cvmfs_cleanup;
   }
+  if (cvmfs::prefetch_) {
+    if (!prefetch::Init(cvmfs::catalog_manager_,
+                        "./prefetch." + (*cvmfs::repository_name_)))
+    {
+      PrintError("Failed to initialize prefetch engine");
+      goto cvmfs_cleanup;
+    }
+    prefetch_ready = true;
+  }
+  if (g_cvmfs_opts.readahead) {
+    read_ahead::Init(g_cvmfs_opts.readahead);
+    cvmfs::readahead_ = true;
+    readahead_ready = true;
+  }
+  if (g_cvmfs_opts.pagecache_prefetch || g_cvmfs_opts.pagecache_dropbehind) {
+    page_cache::Init(uint64_t(g_cvmfs_opts.pagecache_prefetch) * 1024,
+                     uint64_t(g_cvmfs_opts.pagecache_dropbehind) * 1024 * 1024);
+    cvmfs::pagecache_hints_ = true;
+    pagecache_ready = true;
+  }
+  if (g_cvmfs_opts.cache_report) {
+    if (!prefix_accounting::Init(g_cvmfs_opts.cache_report)) {
+      PrintError("Invalid cache report prefixes");
+      goto cvmfs_cleanup;
+    }
+    prefix_accounting_ready = true;
+  }
+  cvmfs::fuse_workers_ = g_cvmfs_opts.fuse_workers;
+  warmup::Init(cvmfs::catalog_manager_);
+  warmup_ready = true;
+  if (g_cvmfs_opts.notification_url && !g_cvmfs_opts.root_hash &&
+      !g_cvmfs_opts.no_reload)
+  {
+    if (!notification::Init(g_cvmfs_opts.notification_url,
+                            *cvmfs::repository_name_, cvmfs::OnNotification))
+    {
+      PrintError("Invalid notification url");
+      goto cvmfs_cleanup;
+    }
+    notification_ready = true;
+    cvmfs::notification_ = true;
+  }
+  cvmfs::RecordStartupPhase("root catalog", &phase_start);
 
   // Set fuse callbacks, remove url from arguments
   LogCvmfs(kLogCvmfs, kLogSyslog,
@@ -1915,18 +4298,88 @@ int main(int argc, char *argv[]) {
       cvmfs::mem_cache_size_ / static_cast<unsigned>(memcache_unit_size);
     // Number of cache entries must be a multiple of 64
     const unsigned mask_64 = ~((1 << 6) - 1);
-    cvmfs::inode_cache_ = new lru::InodeCache(memcache_num_units & mask_64);
-    cvmfs::path_cache_ = new lru::PathCache(memcache_num_units & mask_64);
+    const lru::Replacement replacement = g_cvmfs_opts.memcache_clock ?
+      lru::kReplaceClock : lru::kReplaceLru;
+    cvmfs::inode_cache_ =
+      new lru::InodeCache(memcache_num_units & mask_64, replacement);
+    cvmfs::path_cache_ =
+      new lru::PathCache(memcache_num_units & mask_64, replacement);
     cvmfs::md5path_cache_ =
-      new lru::Md5PathCache((memcache_num_units*7) & mask_64);
+      new lru::Md5PathCache((memcache_num_units*7) & mask_64, replacement);
   }
   cvmfs::directory_handles_ = new cvmfs::DirectoryHandles();
-  cvmfs::directory_handles_->set_empty_key((uint64_t)(-1));
-  cvmfs::directory_handles_->set_deleted_key((uint64_t)(-2));
+  retval = pthread_key_create(&cvmfs::pkey_lookup_prefix_,
+                              cvmfs::FreeLookupPrefix);
+  assert(retval == 0);
+  cvmfs::open_file_cache_ = new cvmfs::OpenFileCache(
+    cvmfs::max_usable_fds_,
+    (quota::GetCapacity() > 0) ?
+      quota::GetCapacity() / cvmfs::kIdleFdQuotaShare : uint64_t(-1));
+  cvmfs::deferred_error_replies_ = new cvmfs::DeferredErrorReplies();
+  if (cvmfs::kernel_notify_)
+    cvmfs::kernel_invalidator_ = new cvmfs::KernelInvalidator();
+  if (cvmfs::listing_cache_size_ > 0) {
+    cvmfs::listing_cache_ =
+      new cvmfs::ListingCache(cvmfs::listing_cache_size_);
+  }
+  if (cvmfs::memory_tier_size_ > 0) {
+    cache::InitMemoryTier(cvmfs::memory_tier_size_,
+                          cvmfs::kMemoryTierMaxObject);
+  }
+  // Objects compressed by an earlier mount remain readable
+  cache::EnableCompressedReads();
+  if (cvmfs::compressed_cache_size_ > 0)
+    cache::InitCompression(cvmfs::compressed_cache_size_);
+
+  // Caches of low priority are shrunk first, the catalog cache keeps at
+  // least an eighth
+  memory_budget::Init(uint64_t(g_cvmfs_opts.memory_budget)*1024*1024);
+  memory_budget_ready = true;
+  memory_budget::RegisterFixed("metadata caches", cvmfs::GetLruUsage);
+  memory_budget::RegisterFixed("sqlite heap", cvmfs::GetSqliteHeapUsage);
+  memory_budget::RegisterFixed("catalog indexes",
+                               catalog::CatalogIndex::memory_used);
+  if (g_cvmfs_opts.catalog_cache > 0) {
+    const uint64_t catalog_cache_size =
+      static_cast<uint64_t>(g_cvmfs_opts.catalog_cache) * 1024*1024;
+    memory_budget::Register("catalog cache", memory_budget::kPriorityHigh,
+                            catalog_cache_size / 8, catalog_cache_size,
+                            cvmfs::GetCatalogCacheUsage,
+                            cvmfs::SetCatalogCacheLimit);
+  }
+  if (cvmfs::listing_cache_) {
+    memory_budget::Register("listing cache", memory_budget::kPriorityMedium,
+                            0, cvmfs::listing_cache_size_,
+                            cvmfs::GetListingCacheUsage,
+                            cvmfs::SetListingCacheLimit);
+  }
+  if (cvmfs::compressed_cache_size_ > 0) {
+    memory_budget::Register("compressed blocks", memory_budget::kPriorityMedium,
+                            0, cvmfs::compressed_cache_size_,
+                            cache::GetCompressionSize,
+                            cache::SetCompressionLimit);
+  }
+  if (cvmfs::memory_tier_size_ > 0) {
+    memory_budget::Register("memory tier", memory_budget::kPriorityLow,
+                            0, cvmfs::memory_tier_size_,
+                            cache::GetMemoryTierSize,
+                            cache::SetMemoryTierLimit);
+  }
+  cvmfs::RecordStartupPhase("memory caches", &phase_start);
+  if (g_cvmfs_opts.memcache_snapshot) {
+    memcache_snapshot::Restore("./memcache." + (*cvmfs::repository_name_),
+                               cvmfs::nfs_maps_, cvmfs::catalog_manager_,
+                               cvmfs::inode_cache_, cvmfs::path_cache_,
+                               cvmfs::md5path_cache_);
+    cvmfs::RecordStartupPhase("memory cache snapshot", &phase_start);
+  }
 
   if ((ch = fuse_mount(cvmfs::mountpoint_->c_str(), &g_fuse_args)) != NULL) {
     LogCvmfs(kLogCvmfs, kLogStdout, "CernVM-FS: mounted cvmfs on %s",
              cvmfs::mountpoint_->c_str());
+    cvmfs::fuse_channel_ = ch;
+    cvmfs::RecordStartupPhase("mount", &phase_start);
+    cvmfs::startup_mount_ms_ = phase_start - startup_ms;
     if (!g_foreground)
       Daemonize();
 
@@ -1954,10 +4407,14 @@ int main(int argc, char *argv[]) {
     if (se != NULL) {
       if (fuse_set_signal_handlers(se) != -1) {
         fuse_session_add_chan(se, ch);
-        if (g_single_threaded)
+        if (g_single_threaded) {
           result = fuse_session_loop(se);
-        else
+        } else if (cvmfs::fuse_workers_ > 0) {
+          result = fuse_workers::Run(se, ch, cvmfs::fuse_workers_,
+                                     g_cvmfs_opts.fuse_pinning);
+        } else {
           result = fuse_session_loop_mt(se);
+        }
         fuse_remove_signal_handlers(se);
         fuse_session_remove_chan(ch);
       }
@@ -1966,28 +4423,73 @@ int main(int argc, char *argv[]) {
     fuse_unmount(cvmfs::mountpoint_->c_str(), ch);
   }
   fuse_opt_free_args(&g_fuse_args);
+  if (g_cvmfs_opts.memcache_snapshot) {
+    memcache_snapshot::Save("./memcache." + (*cvmfs::repository_name_),
+                            cvmfs::catalog_manager_, cvmfs::inode_cache_,
+                            cvmfs::path_cache_, cvmfs::md5path_cache_);
+  }
 
+  // Streamed downloads continue after their files are closed
+  cache::WaitForStreaming();
+  cvmfs::JoinDeferredStartup();
+  // Uses the cache
+  if (readahead_ready) read_ahead::Fini();
+  readahead_ready = false;
+  // Uses the caches
+  if (memory_budget_ready) memory_budget::Fini();
+  memory_budget_ready = false;
+  // Uses the catalog manager
+  if (prefetch_ready) prefetch::Fini();
+  prefetch_ready = false;
+  if (notification_ready) notification::Fini();
+  notification_ready = false;
+  if (warmup_ready) warmup::Fini();
+  warmup_ready = false;
   delete cvmfs::catalog_manager_;
   delete cvmfs::directory_handles_;
+  delete cvmfs::open_file_cache_;
+  delete cvmfs::deferred_error_replies_;
+  delete cvmfs::kernel_invalidator_;
   delete cvmfs::path_cache_;
   delete cvmfs::inode_cache_;
   delete cvmfs::md5path_cache_;
+  delete cvmfs::listing_cache_;
+  pthread_key_delete(cvmfs::pkey_lookup_prefix_);
+  cache::FiniMemoryTier();
+  cache::FiniCompression();
   cvmfs::catalog_manager_ = NULL;
   cvmfs::directory_handles_ = NULL;
+  cvmfs::open_file_cache_ = NULL;
+  cvmfs::deferred_error_replies_ = NULL;
+  cvmfs::kernel_invalidator_ = NULL;
   cvmfs::path_cache_ = NULL;
   cvmfs::inode_cache_ = NULL;
   cvmfs::md5path_cache_ = NULL;
+  cvmfs::listing_cache_ = NULL;
 
   LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog, "CernVM-FS: unmounted %s (%s)",
            cvmfs::mountpoint_->c_str(), cvmfs::repository_name_->c_str());
 
  cvmfs_cleanup:
+  StopLogAsync();
+  if (quota_init_running) {
+    pthread_join(thread_quota_init, NULL);
+    quota_ready = quota_init.ready;
+  }
+  cvmfs::JoinDeferredStartup();
   if (signature_ready) signature::Fini();
   if (download_ready) download::Fini();
   if (talk_ready) talk::Fini();
   if (monitor_ready) monitor::Fini();
   if (quota_ready) quota::Fini();
   if (nfs_maps_ready) nfs_maps::Fini();
+  if (prefetch_ready) prefetch::Fini();
+  if (readahead_ready) read_ahead::Fini();
+  if (pagecache_ready) page_cache::Fini();
+  if (prefix_accounting_ready) prefix_accounting::Fini();
+  if (warmup_ready) warmup::Fini();
+  if (notification_ready) notification::Fini();
+  if (memory_budget_ready) memory_budget::Fini();
   if (cache_ready) cache::Fini();
   if (running_created) unlink(("running." + *cvmfs::repository_name_).c_str());
   if (fd_lockfile >= 0) UnlockFile(fd_lockfile);
@@ -1999,6 +4501,8 @@ int main(int argc, char *argv[]) {
 
   if (sqlite_page_cache) free(sqlite_page_cache);
   if (sqlite_scratch) free(sqlite_scratch);
+  delete cvmfs::startup_phases_;
+  cvmfs::startup_phases_ = NULL;
 
   CleanupLibcryptoMt();
 
@@ -14,6 +14,8 @@
 #include "catalog_mgr.h"
 #include "lru.h"
 
+class MetricsWriter;
+
 namespace cvmfs {
 
 extern pid_t pid_;
@@ -22,6 +24,10 @@ extern std::string *repository_name_;
 extern int max_cache_timeout_;
 extern bool foreground_;
 extern bool nfs_maps_;
+extern bool prefetch_;
+extern bool readahead_;
+extern bool pagecache_hints_;
+extern unsigned fuse_workers_;
 
 int ClearFile(const std::string &path);
 catalog::LoadError RemountStart();
@@ -34,7 +40,12 @@ void GetLruStatistics(lru::Statistics *inode_stats, lru::Statistics *path_stats,
                       lru::Statistics *md5path_stats);
 catalog::Statistics GetCatalogStatistics();
 std::string GetCertificateStats();
+std::string GetDirectoryHandleStats();
 std::string GetFsStats();
+std::string GetStartupStats();
+void GetMetrics(MetricsWriter *metrics);
+std::string GetLatencyStats();
+void ResetLatencyStats();
 
 }  // namespace cvmfs
 
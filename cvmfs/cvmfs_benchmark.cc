@@ -0,0 +1,1186 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Microbenchmarks of the data structures on the hot paths of the client: the
+ * LRU caches in both replacement modes and their hash table, sharded and
+ * plain atomic statistics counters, the command ring of the shared cache
+ * manager, content hashing with OpenSSL's CPU specific and generic kernels,
+ * compression, file copies, single and batched commits into the cache,
+ * catalog lookups and listings, short strings, and the per-request overhead
+ * of the download manager against a loopback HTTP server.
+ *
+ * The input data is synthetic and generated from fixed seeds, so that two
+ * runs on the same machine measure the same work.  Every benchmark prints one
+ * tab separated line
+ *   <benchmark> <threads> <operations> <bytes per operation> <ns per op>
+ * The nanoseconds per operation are wall clock time times threads divided by
+ * operations, i.e. the latency of an operation under contention.  Comment
+ * lines starting with '#' carry additional results, such as cache hit rates.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "cache.h"
+#include "catalog.h"
+#include "catalog_sql.h"
+#include "compression.h"
+#include "dirent.h"
+#include "download.h"
+#include "hash.h"
+#include "logging.h"
+#include "lru.h"
+#include "quota.h"
+#include "quota_ring.h"
+#include "sharded_counter.h"
+#include "shortstring.h"
+#include "smalloc.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs {
+bool foreground_ = true;  /**< Needed by the quota manager */
+}
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage = 1,
+  kErrorOperational = 2,
+};
+
+const unsigned kLruSize = 64*1024;
+const unsigned kCatalogDirectories = 100;
+const unsigned kCatalogFilesPerDirectory = 100;
+/**
+ * Set in the child process that runs the hashing cases with OpenSSL's
+ * generic code
+ */
+const char *kEnvGenericHashing = "CVMFS_BENCHMARK_GENERIC_HASHING";
+
+string *g_filter = NULL;
+unsigned g_max_threads = 8;
+uint64_t g_scale = 1;  /**< Multiplies the number of operations */
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "CernVM File System microbenchmarks, version %s\n\n"
+           "Usage: cvmfs_benchmark [-f filter] [-j #threads] [-n scale] "
+           "[-t temp dir]\n"
+           "Options:\n"
+           "  -f run only benchmarks whose name contains filter\n"
+           "  -j maximum number of threads of the contention benchmarks "
+           "(default: 8)\n"
+           "  -n multiply the number of operations by scale (default: 1)\n"
+           "  -t directory for the synthetic catalog, files, and cache "
+           "(default: /tmp)\n\n"
+           "Output: benchmark, threads, operations, bytes per operation, "
+           "nanoseconds per operation (tab separated)",
+           VERSION);
+}
+
+
+static uint64_t GetTimeNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * Deterministic pseudo-random numbers (64bit linear congruential generator)
+ */
+static inline uint64_t NextRandom(uint64_t *state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state >> 16;
+}
+
+
+static bool IsSelected(const string &name) {
+  return (g_filter == NULL) || (name.find(*g_filter) != string::npos);
+}
+
+
+static void Report(const string &name, const unsigned num_threads,
+                   const uint64_t num_ops, const uint64_t bytes_per_op,
+                   const uint64_t elapsed_ns)
+{
+  const double ns_per_op =
+    static_cast<double>(elapsed_ns) * num_threads / num_ops;
+  LogCvmfs(kLogCvmfs, kLogStdout, "%s\t%u\t%"PRIu64"\t%"PRIu64"\t%.1f",
+           name.c_str(), num_threads, num_ops, bytes_per_op, ns_per_op);
+}
+
+
+struct ThreadArgs {
+  void (*function)(const unsigned thread_idx);
+  unsigned thread_idx;
+  atomic_int32 *go;
+};
+
+static void *MainThread(void *data) {
+  ThreadArgs *args = static_cast<ThreadArgs *>(data);
+  while (atomic_read32(args->go) == 0) { }
+  args->function(args->thread_idx);
+  return NULL;
+}
+
+/**
+ * Runs a function in num_threads threads that start at the same time.  Each
+ * thread gets its number as argument.
+ *
+ * \return wall clock time in nanoseconds
+ */
+static uint64_t RunThreads(const unsigned num_threads,
+                           void (*function)(const unsigned thread_idx))
+{
+  atomic_int32 go;
+  atomic_init32(&go);
+  vector<pthread_t> threads(num_threads);
+  vector<ThreadArgs> args(num_threads);
+  for (unsigned i = 0; i < num_threads; ++i) {
+    args[i].function = function;
+    args[i].thread_idx = i;
+    args[i].go = &go;
+    int retval = pthread_create(&threads[i], NULL, MainThread, &args[i]);
+    assert(retval == 0);
+  }
+  const uint64_t start = GetTimeNs();
+  atomic_inc32(&go);
+  for (unsigned i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+  return GetTimeNs() - start;
+}
+
+
+//------------------------------------------------------------------------------
+// LRU caches
+
+
+typedef lru::LruCache<fuse_ino_t, uint64_t> BenchmarkLru;
+typedef lru::ShardedLruCache<fuse_ino_t, uint64_t> BenchmarkShardedLru;
+BenchmarkLru *g_lru = NULL;
+BenchmarkShardedLru *g_sharded_lru = NULL;
+uint64_t g_ops_per_thread = 0;
+
+
+static void LruInsert(const unsigned thread_idx) {
+  const fuse_ino_t base = fuse_ino_t(thread_idx) << 32;
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i)
+    g_lru->Insert(base + i, i);
+}
+
+
+static void LruLookup(const unsigned thread_idx) {
+  uint64_t state = thread_idx + 1;
+  uint64_t value;
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i)
+    g_lru->Lookup(NextRandom(&state) % kLruSize, &value);
+}
+
+
+static void ShardedLruLookup(const unsigned thread_idx) {
+  uint64_t state = thread_idx + 1;
+  uint64_t value;
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i)
+    g_sharded_lru->Lookup(NextRandom(&state) % kLruSize, &value);
+}
+
+
+/**
+ * Skewed access trace: most lookups go to a hot set of half the cache size,
+ * the rest is spread over a key space four times the cache size, like a
+ * traversal of the file system through a working set.  Misses are inserted.
+ */
+static void LruTrace(const unsigned thread_idx) {
+  uint64_t state = thread_idx + 1;
+  uint64_t value;
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i) {
+    const uint64_t random = NextRandom(&state);
+    const fuse_ino_t key = (random % 10 < 9) ?
+      (random / 10) % (kLruSize / 2) : (random / 10) % (4 * kLruSize);
+    if (!g_lru->Lookup(key, &value))
+      g_lru->Insert(key, i);
+  }
+}
+
+
+static void BenchmarkLruCaches() {
+  const uint64_t num_ops = 1000000 * g_scale;
+  for (unsigned threads = 1; threads <= g_max_threads; threads *= 2) {
+    g_ops_per_thread = num_ops / threads;
+
+    if (IsSelected("lru_insert")) {
+      g_lru = new BenchmarkLru(kLruSize, fuse_ino_t(-1), lru::hasher_inode);
+      Report("lru_insert", threads, g_ops_per_thread * threads, 0,
+             RunThreads(threads, LruInsert));
+      delete g_lru;
+    }
+
+    if (IsSelected("lru_lookup")) {
+      g_lru = new BenchmarkLru(kLruSize, fuse_ino_t(-1), lru::hasher_inode);
+      for (unsigned i = 0; i < kLruSize; ++i)
+        g_lru->Insert(i, i);
+      Report("lru_lookup", threads, g_ops_per_thread * threads, 0,
+             RunThreads(threads, LruLookup));
+      delete g_lru;
+    }
+
+    if (IsSelected("lru_sharded_lookup")) {
+      g_sharded_lru =
+        new BenchmarkShardedLru(kLruSize, fuse_ino_t(-1), lru::hasher_inode,
+                                lru::kReplaceLru);
+      for (unsigned i = 0; i < kLruSize; ++i)
+        g_sharded_lru->Insert(i, i);
+      Report("lru_sharded_lookup", threads, g_ops_per_thread * threads, 0,
+             RunThreads(threads, ShardedLruLookup));
+      delete g_sharded_lru;
+    }
+
+    // Strict LRU against second-chance replacement on the same trace
+    const lru::Replacement kReplacements[] =
+      {lru::kReplaceLru, lru::kReplaceClock};
+    const char *kTraceNames[] = {"lru_trace_lru", "lru_trace_clock"};
+    for (unsigned r = 0; r < 2; ++r) {
+      if (!IsSelected(kTraceNames[r]))
+        continue;
+      g_lru = new BenchmarkLru(kLruSize, fuse_ino_t(-1), lru::hasher_inode,
+                               kReplacements[r]);
+      Report(kTraceNames[r], threads, g_ops_per_thread * threads, 0,
+             RunThreads(threads, LruTrace));
+      lru::Statistics statistics = g_lru->statistics();
+      const int64_t num_hit = statistics.num_hit.Get();
+      const int64_t num_lookup = num_hit + statistics.num_miss.Get();
+      LogCvmfs(kLogCvmfs, kLogStdout, "# %s\t%u\thit rate %.2f%%",
+               kTraceNames[r], threads, 100.0 * num_hit / num_lookup);
+      delete g_lru;
+    }
+  }
+  g_lru = NULL;
+  g_sharded_lru = NULL;
+}
+
+
+static void BenchmarkSmallHash() {
+  if (!IsSelected("smallhash_"))
+    return;
+  const uint64_t num_ops = 4000000 * g_scale;
+  lru::SmallHash<fuse_ino_t, uint64_t> table;
+  table.Init(kLruSize, fuse_ino_t(-1), lru::hasher_inode);
+
+  uint64_t start = GetTimeNs();
+  for (uint64_t i = 0; i < num_ops; ++i)
+    table.Insert(i % kLruSize, i);
+  if (IsSelected("smallhash_insert"))
+    Report("smallhash_insert", 1, num_ops, 0, GetTimeNs() - start);
+
+  uint64_t state = 1;
+  uint64_t value;
+  start = GetTimeNs();
+  for (uint64_t i = 0; i < num_ops; ++i)
+    table.Lookup(NextRandom(&state) % (2*kLruSize), &value);
+  if (IsSelected("smallhash_lookup"))
+    Report("smallhash_lookup", 1, num_ops, 0, GetTimeNs() - start);
+}
+
+
+//------------------------------------------------------------------------------
+// Statistics counters
+
+
+atomic_int64 g_atomic_counter;
+ShardedCounter *g_sharded_counter = NULL;
+
+
+static void CounterAtomic(const unsigned thread_idx) {
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i)
+    atomic_inc64(&g_atomic_counter);
+}
+
+
+static void CounterSharded(const unsigned thread_idx) {
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i)
+    g_sharded_counter->Inc();
+}
+
+
+/**
+ * All threads increase the same counter, like the hit and miss counters of
+ * the metadata caches
+ */
+static void BenchmarkCounters() {
+  const uint64_t num_ops = 10000000 * g_scale;
+  for (unsigned threads = 1; threads <= g_max_threads; threads *= 2) {
+    g_ops_per_thread = num_ops / threads;
+
+    if (IsSelected("counter_atomic")) {
+      atomic_init64(&g_atomic_counter);
+      Report("counter_atomic", threads, g_ops_per_thread * threads, 0,
+             RunThreads(threads, CounterAtomic));
+      assert(uint64_t(atomic_read64(&g_atomic_counter)) ==
+             g_ops_per_thread * threads);
+    }
+
+    if (IsSelected("counter_sharded")) {
+      g_sharded_counter = new ShardedCounter();
+      Report("counter_sharded", threads, g_ops_per_thread * threads, 0,
+             RunThreads(threads, CounterSharded));
+      assert(uint64_t(g_sharded_counter->Get()) == g_ops_per_thread * threads);
+      delete g_sharded_counter;
+    }
+  }
+  g_sharded_counter = NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// Command ring of the shared cache manager
+
+
+const unsigned kRingSlots = 64;
+/**
+ * In the ring_skip case, every kRingStallEvery-th push stalls for
+ * kRingStallMs between claiming and publishing its slot; the consumer skips
+ * a slot that is stuck for kRingTimeoutNs.  The timeout is long enough that
+ * a producer is practically never preempted that long in the middle of
+ * copying its item.
+ */
+const unsigned kRingStallEvery = 256;
+const unsigned kRingStallMs = 40;
+const uint64_t kRingTimeoutNs = 20000000;
+quota::RingHeader *g_ring = NULL;
+quota::RingSlot *g_ring_slots = NULL;
+bool g_ring_stall = false;
+unsigned g_ring_producers = 0;
+atomic_int32 g_ring_running;  /**< producers that are not yet done */
+atomic_int64 g_ring_given_up;  /**< pushes that lost against a skip */
+uint64_t g_ring_popped = 0;
+uint64_t g_ring_skipped = 0;
+
+struct RingItem {
+  uint32_t producer;
+  uint32_t check;
+  uint64_t counter;
+};
+
+
+static uint32_t RingCheck(const uint32_t producer, const uint64_t counter) {
+  return uint32_t(counter * 2654435761U) ^ (producer << 16) ^ 0x5a5a5a5a;
+}
+
+
+static void RingProduce(const unsigned thread_idx) {
+  RingItem item;
+  item.producer = thread_idx;
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i) {
+    item.counter = i;
+    item.check = RingCheck(thread_idx, i);
+    int64_t pos;
+    while (!quota::ClaimRingSlot(g_ring, g_ring_slots, &pos))
+      sched_yield();
+    if (g_ring_stall && (i % kRingStallEvery == kRingStallEvery - 1))
+      usleep(kRingStallMs * 1000);
+    if (!quota::PublishRingSlot(g_ring, g_ring_slots, pos, &item,
+                                sizeof(item)))
+    {
+      atomic_inc64(&g_ring_given_up);
+    }
+  }
+  atomic_dec32(&g_ring_running);
+}
+
+
+/**
+ * Pops items like the command server of the cache manager and checks that
+ * every item arrives intact and in the order of its producer.
+ */
+static void RingConsume() {
+  vector<int64_t> last_counter(g_ring_producers + 1, -1);
+  uint64_t head = 0;
+  uint64_t stuck_since = 0;
+  while (true) {
+    const quota::RingSlot *slot =
+      quota::PeekRingSlot(g_ring, g_ring_slots, head);
+    if (slot != NULL) {
+      RingItem item;
+      memcpy(&item, slot->data, sizeof(item));
+      quota::ReleaseRingSlot(g_ring, g_ring_slots, head);
+      head++;
+      stuck_since = 0;
+      assert((item.producer >= 1) && (item.producer <= g_ring_producers));
+      assert(item.check == RingCheck(item.producer, item.counter));
+      assert(int64_t(item.counter) > last_counter[item.producer]);
+      last_counter[item.producer] = item.counter;
+      g_ring_popped++;
+      continue;
+    }
+
+    // All claims are done once the producers are done
+    const bool done = (atomic_read32(&g_ring_running) == 0);
+    if (atomic_read64(&g_ring->tail) > int64_t(head)) {
+      const uint64_t now = GetTimeNs();
+      if (stuck_since == 0) {
+        stuck_since = now;
+      } else if (g_ring_stall && (now >= stuck_since + kRingTimeoutNs)) {
+        stuck_since = 0;
+        if (quota::AbandonRingSlot(g_ring, g_ring_slots, head)) {
+          head++;
+          g_ring_skipped++;
+        }
+      }
+    } else if (done) {
+      break;
+    }
+    sched_yield();
+  }
+}
+
+
+static void RingWorker(const unsigned thread_idx) {
+  if (thread_idx == 0)
+    RingConsume();
+  else
+    RingProduce(thread_idx);
+}
+
+
+/**
+ * Pushes from many threads into the command ring of the shared cache manager
+ * and pops in one thread.  In the ring_skip case, producers stall so that the
+ * consumer skips their slots.  Every item has to be either popped or given
+ * up by its producer, skipped slots must not be published late.
+ */
+static void BenchmarkRing() {
+  if (!IsSelected("ring_"))
+    return;
+
+  const size_t size =
+    sizeof(quota::RingHeader) + kRingSlots * sizeof(quota::RingSlot);
+  g_ring = static_cast<quota::RingHeader *>(smalloc(size));
+  g_ring_slots = reinterpret_cast<quota::RingSlot *>(g_ring + 1);
+  const char *kNames[] = {"ring_push", "ring_skip"};
+  for (unsigned stall = 0; stall < 2; ++stall) {
+    if (!IsSelected(kNames[stall]))
+      continue;
+    const uint64_t num_ops = (stall ? 16384 : 1000000) * g_scale;
+    for (unsigned threads = 1; threads <= g_max_threads; threads *= 2) {
+      memset(g_ring, 0, size);
+      g_ring->num_slots = kRingSlots;
+      for (unsigned i = 0; i < kRingSlots; ++i)
+        atomic_write64(&g_ring_slots[i].seq, i);
+      g_ring_stall = stall;
+      g_ring_producers = threads;
+      g_ops_per_thread = num_ops / threads;
+      atomic_init32(&g_ring_running);
+      atomic_xadd32(&g_ring_running, threads);
+      atomic_init64(&g_ring_given_up);
+      g_ring_popped = 0;
+      g_ring_skipped = 0;
+
+      const uint64_t elapsed_ns = RunThreads(threads + 1, RingWorker);
+      Report(kNames[stall], threads, g_ops_per_thread * threads,
+             sizeof(RingItem), elapsed_ns);
+      const uint64_t given_up = atomic_read64(&g_ring_given_up);
+      assert(g_ring_popped + given_up == g_ops_per_thread * threads);
+      assert(given_up == g_ring_skipped);
+      if (stall) {
+        LogCvmfs(kLogCvmfs, kLogStdout, "# %s\t%u\t%"PRIu64" skipped",
+                 kNames[stall], threads, g_ring_skipped);
+      } else {
+        assert(given_up == 0);
+      }
+    }
+  }
+  free(g_ring);
+  g_ring = NULL;
+  g_ring_slots = NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// Hashing and compression
+
+
+/**
+ * Text-like data that compresses about as well as typical repository files
+ */
+static void FillBuffer(unsigned char *buffer, const unsigned size) {
+  const char *kWords[] = {"cvmfs ", "catalog ", "chunk ", "0x1f ", "lib",
+                          ".so\n", "/usr/share/", "\t", "include ", "42 "};
+  uint64_t state = 1;
+  unsigned pos = 0;
+  while (pos < size) {
+    const char *word = kWords[NextRandom(&state) % 10];
+    for (unsigned i = 0; (word[i] != '\0') && (pos < size); ++i)
+      buffer[pos++] = word[i];
+  }
+}
+
+
+/**
+ * Names the hashing cases, e.g. hash_sha1_4k
+ */
+static string HashingName(const string &algorithm, const unsigned size,
+                          const string &backend)
+{
+  return "hash_" + algorithm + "_" +
+    ((size < 1024*1024) ? StringifyInt(size / 1024) + "k" :
+                          StringifyInt(size / (1024*1024)) + "m") +
+    backend;
+}
+
+
+/**
+ * \param backend empty for the kernels that OpenSSL selects for this CPU,
+ *        "_generic" in the child process of BenchmarkGenericHashing()
+ */
+static void BenchmarkHashing(const string &backend) {
+  const unsigned kSizes[] = {4096, 1024*1024};
+  const hash::Algorithms kAlgorithms[] = {hash::kMd5, hash::kSha1};
+  const char *kNames[] = {"md5", "sha1"};
+
+  for (unsigned s = 0; s < 2; ++s) {
+    const unsigned size = kSizes[s];
+    unsigned char *buffer = static_cast<unsigned char *>(smalloc(size));
+    FillBuffer(buffer, size);
+    const uint64_t num_ops = (256*1024*1024 / size) * g_scale;
+    for (unsigned a = 0; a < 2; ++a) {
+      const string name = HashingName(kNames[a], size, backend);
+      if (!IsSelected(name))
+        continue;
+      hash::Any digest(kAlgorithms[a]);
+      const uint64_t start = GetTimeNs();
+      for (uint64_t i = 0; i < num_ops; ++i)
+        hash::HashMem(buffer, size, &digest);
+      Report(name, 1, num_ops, size, GetTimeNs() - start);
+    }
+    free(buffer);
+  }
+}
+
+
+/**
+ * OpenSSL picks its MD5 and SHA-1 kernels (SSSE3, AVX, AVX2, SHA extensions)
+ * from the CPU capabilities when the library is loaded.  In order to compare
+ * them with the generic code, the hashing cases run again in a child process
+ * whose OPENSSL_ia32cap masks these capabilities.
+ */
+static void BenchmarkGenericHashing(char **argv) {
+#ifdef __x86_64__
+  if (!IsSelected(HashingName("md5", 4096, "_generic")) &&
+      !IsSelected(HashingName("md5", 1024*1024, "_generic")) &&
+      !IsSelected(HashingName("sha1", 4096, "_generic")) &&
+      !IsSelected(HashingName("sha1", 1024*1024, "_generic")))
+  {
+    return;
+  }
+
+  fflush(stdout);
+  const pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    setenv(kEnvGenericHashing, "1", 1);
+    // ~SSSE3, ~AVX : ~AVX2, ~SHA
+    setenv("OPENSSL_ia32cap", "~0x1000020000000000:~0x20000020", 1);
+    execvp(argv[0], argv);
+    _exit(1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to run generic hashing cases");
+#endif
+}
+
+
+static void BenchmarkCompression() {
+  const unsigned size = 1024*1024;
+  unsigned char *buffer = static_cast<unsigned char *>(smalloc(size));
+  FillBuffer(buffer, size);
+  const uint64_t num_ops = 64 * g_scale;
+
+  void *compressed;
+  int64_t compressed_size;
+  bool retval = zlib::CompressMem2Mem(buffer, size,
+                                      &compressed, &compressed_size);
+  assert(retval);
+
+  if (IsSelected("zlib_compress_1m")) {
+    const uint64_t start = GetTimeNs();
+    for (uint64_t i = 0; i < num_ops; ++i) {
+      void *out;
+      int64_t out_size;
+      retval = zlib::CompressMem2Mem(buffer, size, &out, &out_size);
+      assert(retval);
+      free(out);
+    }
+    Report("zlib_compress_1m", 1, num_ops, size, GetTimeNs() - start);
+  }
+
+  if (IsSelected("zlib_decompress_1m")) {
+    const uint64_t start = GetTimeNs();
+    for (uint64_t i = 0; i < num_ops; ++i) {
+      void *out;
+      int64_t out_size;
+      retval = zlib::DecompressMem2Mem(compressed, compressed_size,
+                                       &out, &out_size);
+      assert(retval && (out_size == size));
+      free(out);
+    }
+    Report("zlib_decompress_1m", 1, num_ops, size, GetTimeNs() - start);
+  }
+
+  free(compressed);
+  free(buffer);
+}
+
+
+/**
+ * The fread/fwrite loop that CopyPath2Path falls back to without kernel
+ * support for file copies
+ */
+static bool CopyStdio(const string &src, const string &dest) {
+  unsigned char buf[1024];
+  FILE *fsrc = fopen(src.c_str(), "r");
+  FILE *fdest = fopen(dest.c_str(), "w");
+  bool result = (fsrc != NULL) && (fdest != NULL);
+  size_t have;
+  while (result && ((have = fread(buf, 1, 1024, fsrc)) > 0))
+    result = (fwrite(buf, 1, have, fdest) == have);
+  if (fsrc) fclose(fsrc);
+  if (fdest) result &= (fclose(fdest) == 0);
+  return result;
+}
+
+
+/**
+ * Copies of files of typical object sizes, through CopyPath2Path and through
+ * a plain fread/fwrite loop
+ */
+static void BenchmarkCopy(const string &temp_dir) {
+  if (!IsSelected("copy_"))
+    return;
+
+  const unsigned kSizes[] = {4096, 64*1024, 1024*1024, 16*1024*1024};
+  const string src = temp_dir + "/cvmfs_benchmark.copy_src";
+  const string dest = temp_dir + "/cvmfs_benchmark.copy_dest";
+  for (unsigned s = 0; s < 4; ++s) {
+    const unsigned size = kSizes[s];
+    unsigned char *buffer = static_cast<unsigned char *>(smalloc(size));
+    FillBuffer(buffer, size);
+    bool retval = CopyMem2Path(buffer, size, src);
+    free(buffer);
+    if (!retval) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to write %s", src.c_str());
+      break;
+    }
+
+    const string size_str = (size < 1024*1024) ?
+      StringifyInt(size / 1024) + "k" : StringifyInt(size / (1024*1024)) + "m";
+    const uint64_t num_ops =
+      max(uint64_t(16), uint64_t(64*1024*1024 / size)) * g_scale;
+    for (unsigned stdio = 0; stdio < 2; ++stdio) {
+      const string name = (stdio ? "copy_stdio_" : "copy_path2path_") +
+                          size_str;
+      if (!IsSelected(name))
+        continue;
+      const uint64_t start = GetTimeNs();
+      for (uint64_t i = 0; i < num_ops; ++i) {
+        retval = stdio ? CopyStdio(src, dest) : CopyPath2Path(src, dest);
+        assert(retval);
+      }
+      Report(name, 1, num_ops, size, GetTimeNs() - start);
+    }
+  }
+  unlink(src.c_str());
+  unlink(dest.c_str());
+}
+
+
+//------------------------------------------------------------------------------
+// Cache commits
+
+
+/**
+ * Downloaded objects that wait for their commit into the cache
+ */
+static bool PrepareTransactions(const unsigned num_objects, uint64_t *state,
+                                vector<cache::Transaction> *txns)
+{
+  const unsigned char kPayload[64] = {0};
+  txns->clear();
+  for (unsigned i = 0; i < num_objects; ++i) {
+    cache::Transaction txn;
+    txn.id = hash::Any(hash::kSha1);
+    for (unsigned j = 0; j < hash::kDigestSizes[hash::kSha1]; ++j)
+      txn.id.digest[j] = NextRandom(state);
+    txn.size = sizeof(kPayload);
+    txn.cvmfs_path = "/benchmark/" + txn.id.ToString();
+    const int fd = cache::StartTransaction(txn.id, &txn.final_path,
+                                           &txn.temp_path);
+    if (fd < 0)
+      return false;
+    const bool retval =
+      (write(fd, kPayload, sizeof(kPayload)) == sizeof(kPayload));
+    close(fd);
+    if (!retval)
+      return false;
+    txns->push_back(txn);
+  }
+  return true;
+}
+
+
+/**
+ * Commits small objects one by one and in batches like the cache warm-up.
+ * The time includes the rename into the cache and the quota database update,
+ * the final GetSize() waits for the quota manager to process all inserts.
+ */
+static void BenchmarkCommit(const string &temp_dir) {
+  if (!IsSelected("commit_"))
+    return;
+
+  const unsigned kBatchSize = 32;
+  const string cache_dir = temp_dir + "/cvmfs_benchmark.cache";
+  if (!cache::Init(cache_dir, false) ||
+      !quota::Init(cache_dir, uint64_t(1) << 40, uint64_t(1) << 39, false))
+  {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to initialize cache in %s",
+             cache_dir.c_str());
+    RemoveTree(cache_dir);
+    return;
+  }
+  quota::Spawn();
+
+  const unsigned num_objects = 8192 * g_scale;
+  const char *kNames[] = {"commit_single", "commit_batched"};
+  uint64_t state = 1;
+  vector<cache::Transaction> txns;
+  for (unsigned batched = 0; batched < 2; ++batched) {
+    if (!IsSelected(kNames[batched]))
+      continue;
+    if (!PrepareTransactions(num_objects, &state, &txns)) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to prepare transactions");
+      break;
+    }
+
+    const uint64_t start = GetTimeNs();
+    if (batched) {
+      for (unsigned i = 0; i < num_objects; i += kBatchSize) {
+        vector<cache::Transaction> batch(
+          txns.begin() + i, txns.begin() + min(i + kBatchSize, num_objects));
+        const unsigned num_committed = cache::CommitTransactions(batch);
+        assert(num_committed == batch.size());
+      }
+    } else {
+      for (unsigned i = 0; i < num_objects; ++i) {
+        const int retval = cache::CommitTransaction(
+          txns[i].final_path, txns[i].temp_path, txns[i].cvmfs_path,
+          txns[i].id, txns[i].size);
+        assert(retval == 0);
+      }
+    }
+    quota::GetSize();
+    const uint64_t elapsed_ns = GetTimeNs() - start;
+    Report(kNames[batched], 1, num_objects, txns[0].size, elapsed_ns);
+    LogCvmfs(kLogCvmfs, kLogStdout, "# %s\t%.0f objects/s",
+             kNames[batched], num_objects * 1e9 / elapsed_ns);
+  }
+
+  quota::Fini();
+  cache::Fini();
+  RemoveTree(cache_dir);
+}
+
+
+//------------------------------------------------------------------------------
+// Downloads
+
+
+const char *kLastModified = "Thu, 01 Jan 2015 00:00:00 GMT";
+int g_http_fd = -1;
+string *g_http_base = NULL;  /**< http://127.0.0.1:<port> */
+
+
+/**
+ * Serves the requests of one keep-alive connection.  The path of a request is
+ * the size of the object.  Conditional requests always get a 304.
+ */
+static void *MainHttpConnection(void *data) {
+  const int fd = static_cast<int>(reinterpret_cast<intptr_t>(data));
+  string buffer;
+  char piece[4096];
+  while (true) {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == string::npos) {
+      const ssize_t num_bytes = read(fd, piece, sizeof(piece));
+      if (num_bytes <= 0) {
+        close(fd);
+        return NULL;
+      }
+      buffer.append(piece, num_bytes);
+    }
+    const string request = buffer.substr(0, end);
+    buffer.erase(0, end + 4);
+
+    // GET /<size> HTTP/1.1
+    const size_t pos_path = request.find('/');
+    const uint64_t size = String2Uint64(
+      request.substr(pos_path + 1, request.find(' ', pos_path) - pos_path - 1));
+    string reply;
+    if (request.find("If-Modified-Since:") != string::npos) {
+      reply = "HTTP/1.1 304 Not Modified\r\n\r\n";
+    } else {
+      reply = "HTTP/1.1 200 OK\r\n"
+              "Content-Length: " + StringifyInt(size) + "\r\n"
+              "Last-Modified: " + string(kLastModified) + "\r\n\r\n" +
+              string(size, 'x');
+    }
+    WritePipe(fd, reply.data(), reply.length());
+  }
+}
+
+
+static void *MainHttpServer(void *data) {
+  while (true) {
+    const int fd = accept(g_http_fd, NULL, NULL);
+    if (fd < 0)
+      return NULL;
+    pthread_t thread;
+    int retval = pthread_create(&thread, NULL, MainHttpConnection,
+                                reinterpret_cast<void *>(intptr_t(fd)));
+    assert(retval == 0);
+    pthread_detach(thread);
+  }
+}
+
+
+/**
+ * Listens on an ephemeral loopback port
+ */
+static bool StartHttpServer() {
+  g_http_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (g_http_fd < 0)
+    return false;
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t address_len = sizeof(address);
+  if ((bind(g_http_fd, reinterpret_cast<struct sockaddr *>(&address),
+            sizeof(address)) != 0) ||
+      (listen(g_http_fd, 64) != 0) ||
+      (getsockname(g_http_fd, reinterpret_cast<struct sockaddr *>(&address),
+                   &address_len) != 0))
+  {
+    close(g_http_fd);
+    return false;
+  }
+  g_http_base =
+    new string("http://127.0.0.1:" + StringifyInt(ntohs(address.sin_port)));
+
+  pthread_t thread;
+  int retval = pthread_create(&thread, NULL, MainHttpServer, NULL);
+  assert(retval == 0);
+  pthread_detach(thread);
+  return true;
+}
+
+
+uint64_t g_download_size = 0;
+bool g_download_conditional = false;
+
+static void Download(const unsigned thread_idx) {
+  const string url = *g_http_base + "/" + StringifyInt(g_download_size);
+  for (uint64_t i = 0; i < g_ops_per_thread; ++i) {
+    download::JobInfo info(&url, false, false, NULL);
+    if (g_download_conditional) {
+      info.conditional = true;
+      info.if_modified_since = 1420070400;  // kLastModified
+    }
+    const download::Failures retval = download::Fetch(&info);
+    assert(retval == download::kFailOk);
+    assert(info.not_modified == g_download_conditional);
+    download::ReleaseMemBuffer(&info);
+  }
+}
+
+
+/**
+ * Requests that transfer (almost) no data show the fixed cost of a download:
+ * the submission to the I/O thread, the curl handle and the HTTP round trip
+ * on a reused connection.
+ */
+static void BenchmarkDownload() {
+  if (!IsSelected("download_"))
+    return;
+  if (!StartHttpServer()) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to start HTTP server");
+    return;
+  }
+  download::Init(16);
+  download::SetProxyChain("DIRECT");
+  download::Spawn();
+
+  const uint64_t kSizes[] = {0, 64, 4096};
+  const char *kNames[] = {"download_304", "download_64", "download_4k"};
+  const uint64_t num_ops = 5000 * g_scale;
+  for (unsigned threads = 1; threads <= g_max_threads; threads *= 2) {
+    g_ops_per_thread = num_ops / threads;
+    for (unsigned s = 0; s < 3; ++s) {
+      if (!IsSelected(kNames[s]))
+        continue;
+      g_download_size = kSizes[s];
+      g_download_conditional = (s == 0);
+      Report(kNames[s], threads, g_ops_per_thread * threads, kSizes[s],
+             RunThreads(threads, Download));
+    }
+  }
+
+  download::Fini();
+  close(g_http_fd);
+  delete g_http_base;
+  g_http_base = NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// Catalogs
+
+
+/**
+ * Same column layout as Sql::BindMd5()
+ */
+static bool BindMd5(catalog::Sql *sql, const int idx, const hash::Md5 &md5) {
+  uint64_t first, second;
+  md5.ToIntPair(&first, &second);
+  return sql->BindInt64(idx, first) && sql->BindInt64(idx + 1, second);
+}
+
+
+/**
+ * Root plus kCatalogDirectories directories with kCatalogFilesPerDirectory
+ * files each, written with plain SQL in one transaction.
+ */
+static bool CreateCatalog(const string &path, vector<string> *directories,
+                          vector<string> *files)
+{
+  unlink(path.c_str());
+  if (!catalog::Database::Create(path, catalog::DirectoryEntry(), ""))
+    return false;
+
+  catalog::Database database(path, catalog::Database::kOpenReadWrite);
+  if (!database.ready())
+    return false;
+  catalog::Sql(database, "BEGIN;").Execute();
+  catalog::Sql insert(database, "INSERT INTO catalog "
+    "(md5path_1, md5path_2, parent_1, parent_2, hardlinks, hash, size, mode, "
+    "mtime, flags, name, symlink, uid, gid) "
+    "VALUES (:md5_1, :md5_2, :p_1, :p_2, 0, :hash, :size, :mode, 0, :flags, "
+    ":name, '', 0, 0);");
+  unsigned char digest[20];
+  uint64_t state = 1;
+  bool result = true;
+  for (unsigned d = 0; d < kCatalogDirectories; ++d) {
+    const string dir_name = "dir" + StringifyInt(d);
+    const string dir_path = "/" + dir_name;
+    directories->push_back(dir_path);
+    result = result &&
+      BindMd5(&insert, 1, hash::Md5(hash::AsciiPtr(dir_path))) &&
+      BindMd5(&insert, 3, hash::Md5(hash::AsciiPtr(""))) &&
+      insert.BindNull(5) && insert.BindInt64(6, 4096) &&
+      insert.BindInt(7, S_IFDIR | 0755) &&
+      insert.BindInt(8, catalog::SqlDirent::kFlagDir) &&
+      insert.BindText(9, dir_name) && insert.Execute() && insert.Reset();
+
+    for (unsigned f = 0; f < kCatalogFilesPerDirectory; ++f) {
+      const string file_name = "file" + StringifyInt(f) + ".dat";
+      const string file_path = dir_path + "/" + file_name;
+      files->push_back(file_path);
+      for (unsigned i = 0; i < sizeof(digest); ++i)
+        digest[i] = NextRandom(&state);
+      result = result &&
+        BindMd5(&insert, 1, hash::Md5(hash::AsciiPtr(file_path))) &&
+        BindMd5(&insert, 3, hash::Md5(hash::AsciiPtr(dir_path))) &&
+        insert.BindBlob(5, digest, sizeof(digest)) &&
+        insert.BindInt64(6, NextRandom(&state) % (1024*1024)) &&
+        insert.BindInt(7, S_IFREG | 0644) &&
+        insert.BindInt(8, catalog::SqlDirent::kFlagFile) &&
+        insert.BindText(9, file_name) && insert.Execute() && insert.Reset();
+    }
+  }
+  return catalog::Sql(database, "COMMIT;").Execute() && result;
+}
+
+
+static void BenchmarkCatalog(const string &temp_dir) {
+  if (!IsSelected("catalog_"))
+    return;
+
+  const string path = temp_dir + "/cvmfs_benchmark.catalog";
+  vector<string> directories;
+  vector<string> files;
+  if (!CreateCatalog(path, &directories, &files)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to create catalog %s",
+             path.c_str());
+    unlink(path.c_str());
+    return;
+  }
+  vector<hash::Md5> file_hashes;
+  for (unsigned i = 0; i < files.size(); ++i)
+    file_hashes.push_back(hash::Md5(hash::AsciiPtr(files[i])));
+  vector<hash::Md5> dir_hashes;
+  for (unsigned i = 0; i < directories.size(); ++i)
+    dir_hashes.push_back(hash::Md5(hash::AsciiPtr(directories[i])));
+
+  // SQlite lookups, then lookups in the in-memory index
+  for (unsigned with_index = 0; with_index < 2; ++with_index) {
+    const string suffix = with_index ? "_index" : "";
+    catalog::Catalog::SetUseIndex(with_index == 1);
+    catalog::Catalog *catalog = catalog::AttachFreely("", path);
+    if (catalog == NULL) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to attach catalog %s",
+               path.c_str());
+      break;
+    }
+
+    if (IsSelected("catalog_lookup" + suffix)) {
+      const uint64_t num_ops = 200000 * g_scale;
+      uint64_t state = 1;
+      catalog::DirectoryEntry dirent;
+      const uint64_t start = GetTimeNs();
+      for (uint64_t i = 0; i < num_ops; ++i) {
+        const bool found = catalog->LookupMd5Path(
+          file_hashes[NextRandom(&state) % file_hashes.size()], &dirent);
+        assert(found);
+      }
+      Report("catalog_lookup" + suffix, 1, num_ops, 0, GetTimeNs() - start);
+    }
+
+    if (IsSelected("catalog_listing_stat" + suffix)) {
+      const uint64_t num_ops = 5000 * g_scale;
+      catalog::StatEntryList listing;
+      const uint64_t start = GetTimeNs();
+      for (uint64_t i = 0; i < num_ops; ++i) {
+        listing.clear();
+        catalog->ListingMd5PathStat(dir_hashes[i % dir_hashes.size()],
+                                    &listing);
+      }
+      Report("catalog_listing_stat" + suffix, 1, num_ops, 0,
+             GetTimeNs() - start);
+    }
+
+    delete catalog;
+  }
+  catalog::Catalog::SetUseIndex(false);
+  unlink(path.c_str());
+}
+
+
+//------------------------------------------------------------------------------
+// Short strings
+
+
+static void BenchmarkShortString() {
+  const uint64_t num_ops = 10000000 * g_scale;
+  // Fits into the stack buffer of a PathString resp. needs the heap
+  const string short_path = "/cvmfs/atlas.cern.ch/repo/sw/software";
+  const string long_path = "/cvmfs/" + string(2*kDefaultMaxPath, 'x');
+  const string *paths[] = {&short_path, &long_path};
+  const char *names[] = {"shortstring_assign_short", "shortstring_assign_long"};
+
+  for (unsigned p = 0; p < 2; ++p) {
+    if (!IsSelected(names[p]))
+      continue;
+    const PathString source(paths[p]->data(), paths[p]->length());
+    PathString target;
+    const uint64_t start = GetTimeNs();
+    for (uint64_t i = 0; i < num_ops; ++i) {
+      target = source;
+      target.Append("/", 1);
+    }
+    Report(names[p], 1, num_ops, paths[p]->length(), GetTimeNs() - start);
+  }
+}
+
+
+int main(int argc, char **argv) {
+  string temp_dir = "/tmp";
+  char c;
+  while ((c = getopt(argc, argv, "hf:j:n:t:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'f':
+        g_filter = new string(optarg);
+        break;
+      case 'j':
+        g_max_threads = String2Uint64(optarg);
+        break;
+      case 'n':
+        g_scale = String2Uint64(optarg);
+        break;
+      case 't':
+        temp_dir = optarg;
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+  if ((g_max_threads == 0) || (g_scale == 0)) {
+    Usage();
+    return kErrorUsage;
+  }
+
+  if (getenv(kEnvGenericHashing) != NULL) {
+    BenchmarkHashing("_generic");
+    delete g_filter;
+    return kErrorOk;
+  }
+
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "# benchmark\tthreads\toperations\tbytes_per_op\tns_per_op");
+  BenchmarkLruCaches();
+  BenchmarkSmallHash();
+  BenchmarkCounters();
+  BenchmarkRing();
+  BenchmarkHashing("");
+  BenchmarkGenericHashing(argv);
+  BenchmarkCompression();
+  BenchmarkCopy(temp_dir);
+  BenchmarkCommit(temp_dir);
+  BenchmarkDownload();
+  BenchmarkCatalog(temp_dir);
+  BenchmarkShortString();
+
+  delete g_filter;
+  return kErrorOk;
+}
@@ -11,17 +11,22 @@
 #include "cvmfs_config.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
 
 #include <cstring>
 #include <cstdlib>
+#include <ctime>
 
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include "platform.h"
 #include "util.h"
@@ -42,23 +47,62 @@ enum Errors {
   kErrorUsage = 16,
 };
 
+/**
+ * Objects verified by previous runs, stored next to the managed cache db.  An
+ * object is verified again if it is new, if its size or mtime differ from the
+ * record, or if its inode changed after it was verified.
+ */
+const char *kVerifiedDb = "fsckdb";
+const uint32_t kVerifiedMagic = 0x4b435346;  // "FSCK"
+const uint32_t kVerifiedVersion = 2;
+/**
+ * Suffix of the cache objects in the block format, see cache::OpenCompressed()
+ */
+const char kCompressedSuffix = 'Z';
+
+struct VerifiedObject {
+  bool operator <(const VerifiedObject &other) const {
+    return strcmp(name, other.name) < 0;
+  }
+  /**
+   * Zero terminated file name, the hash plus the suffix of compressed objects
+   */
+  char name[2*hash::kMaxDigestSize + 2];
+  int64_t size;
+  int64_t mtime;
+  int64_t verified_at;
+};
+
+struct VerifiedDbHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_objects;
+};
+
 string *g_cache_dir;
 atomic_int32 g_num_files;
+atomic_int32 g_num_skipped;
 atomic_int32 g_num_err_fixed;
 atomic_int32 g_num_err_unfixed;
 atomic_int32 g_num_err_operational;
 atomic_int32 g_num_tmp_catalog;
 /**
- * Traversal of the file system tree is serialized.
+ * Every worker traverses entire cache sub directories, the next one is taken
+ * from this counter.
+ */
+atomic_int32 g_next_dir;
+
+/**
+ * Records of the previous run (sorted, read-only) and of this run.
  */
-pthread_mutex_t g_lock_traverse = PTHREAD_MUTEX_INITIALIZER;
-DIR *g_DIRP_current = NULL;
-int g_num_dirs = -1;  /**< Number of cache directories already examined. */
-string *g_current_dir;  /**< Current cache sub directory */
+vector<VerifiedObject> *g_verified;
+vector<VerifiedObject> *g_verified_new;
+pthread_mutex_t g_lock_verified = PTHREAD_MUTEX_INITIALIZER;
 
 int g_num_threads = 1;
 bool g_fix_errors = false;
 bool g_verbose = false;
+bool g_incremental = false;
 atomic_int32 g_force_rebuild;
 atomic_int32 g_modified_cache;
 
@@ -69,162 +113,298 @@ static void Usage() {
            "This tool checks a cvmfs cache directory for consistency.\n"
            "If necessary, the managed cache db is removed so that\n"
            "it will be rebuilt on next mount.\n\n"
-           "Usage: cvmfs_fsck [-v] [-p] [-f] [-j #threads] <cache directory>\n"
+           "Usage: cvmfs_fsck [-v] [-p] [-f] [-i] [-j #threads] "
+           "<cache directory>\n"
            "Options:\n"
            "  -v verbose output\n"
            "  -p try to fix automatically\n"
            "  -f force rebuild of managed cache db on next mount\n"
+           "  -i incremental, skip files unchanged since they were verified\n"
            "  -j number of concurrent integrity check worker threads\n",
            VERSION);
 }
 
 
-static bool GetNextFile(string *relative_path, string *hash_name) {
-  platform_dirent64 *d = NULL;
+static void LoadVerified() {
+  FILE *f = fopen(kVerifiedDb, "r");
+  if (f == NULL)
+    return;
+  VerifiedDbHeader header;
+  bool valid = (fread(&header, sizeof(header), 1, f) == 1) &&
+    (header.magic == kVerifiedMagic) && (header.version == kVerifiedVersion);
+  if (valid) {
+    g_verified->resize(header.num_objects);
+    if ((header.num_objects > 0) &&
+        (fread(&(*g_verified)[0], sizeof(VerifiedObject), header.num_objects,
+               f) != header.num_objects))
+    {
+      g_verified->clear();
+      valid = false;
+    }
+  }
+  fclose(f);
+  if (!valid) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Warning: ignoring invalid %s/%s",
+             g_cache_dir->c_str(), kVerifiedDb);
+  }
+  sort(g_verified->begin(), g_verified->end());
+}
 
-  pthread_mutex_lock(&g_lock_traverse);
- get_next_file_again:
-  while (g_DIRP_current && ((d = platform_readdir(g_DIRP_current)) != NULL)) {
-    const string name = d->d_name;
-    if ((name == ".") || (name == "..")) continue;
 
-    platform_stat64 info;
-    *relative_path = *g_current_dir + "/" + name;
-    *hash_name = *g_current_dir + name;
-    const string path = *g_cache_dir + "/" + *relative_path;
-    if (platform_lstat(relative_path->c_str(), &info) != 0) {
-      LogCvmfs(kLogCvmfs, kLogStdout, "Warning: failed to stat() %s (%d)",
-               path.c_str(), errno);
-      continue;
-    }
+static void StoreVerified() {
+  sort(g_verified_new->begin(), g_verified_new->end());
+  const string tmp_path = string(kVerifiedDb) + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "w");
+  VerifiedDbHeader header;
+  header.magic = kVerifiedMagic;
+  header.version = kVerifiedVersion;
+  header.num_objects = g_verified_new->size();
+  if ((f == NULL) ||
+      (fwrite(&header, sizeof(header), 1, f) != 1) ||
+      ((header.num_objects > 0) &&
+       (fwrite(&(*g_verified_new)[0], sizeof(VerifiedObject),
+               header.num_objects, f) != header.num_objects)) ||
+      (fclose(f) != 0) ||
+      (rename(tmp_path.c_str(), kVerifiedDb) != 0))
+  {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Warning: failed to write %s/%s",
+             g_cache_dir->c_str(), kVerifiedDb);
+    unlink(tmp_path.c_str());
+  }
+}
 
-    if (!S_ISREG(info.st_mode)) {
-      LogCvmfs(kLogCvmfs, kLogStdout, "Warning: %s is not a regular file",
-               path.c_str());
-      continue;
-    }
 
-    break;
+static void AddVerified(const VerifiedObject &object) {
+  pthread_mutex_lock(&g_lock_verified);
+  g_verified_new->push_back(object);
+  pthread_mutex_unlock(&g_lock_verified);
+}
+
+
+/**
+ * @return true if the file needs no verification in incremental mode
+ */
+static bool IsVerified(const VerifiedObject &object,
+                       const platform_stat64 &info)
+{
+  vector<VerifiedObject>::const_iterator record =
+    lower_bound(g_verified->begin(), g_verified->end(), object);
+  if ((record == g_verified->end()) || (strcmp(record->name, object.name) != 0))
+    return false;
+  if ((record->size != object.size) || (record->mtime != object.mtime) ||
+      (info.st_ctime >= record->verified_at))
+  {
+    return false;
   }
+  AddVerified(*record);
+  return true;
+}
 
-  if (!d) {
-    if (g_DIRP_current) {
-      closedir(g_DIRP_current);
-      g_DIRP_current = NULL;
-    }
-    g_num_dirs++;
-    if (g_num_dirs < 256) {
-      char hex[3];
-      snprintf(hex, sizeof(hex), "%02x", g_num_dirs);
-      *g_current_dir = string(hex, 2);
-
-      if (g_verbose)
-        LogCvmfs(kLogCvmfs, kLogStdout, "Entering %s", g_current_dir->c_str());
-      if ((g_DIRP_current = opendir(hex)) == NULL) {
-        LogCvmfs(kLogCvmfs, kLogStderr,
-                 "Invalid cache directory, %s/%s does not exist",
-                 g_cache_dir->c_str(), g_current_dir->c_str());
-        pthread_mutex_unlock(&g_lock_traverse);
-        exit(kErrorUnfixed);
-      }
-      goto get_next_file_again;
+
+/**
+ * Compresses the memory mapped file and calculates the SHA-1 of the stream.
+ * Objects can be compressed by any of the codecs, large ones also in
+ * parallel blocks, so the encodings are tried until the hash matches the
+ * expected one.  Objects in the block format of a
+ * compressed cache are inflated first.
+ */
+static bool HashFile(const string &relative_path, int64_t size,
+                     const bool block_format, const string &expected_hash,
+                     hash::Any *hash)
+{
+  const zlib::Algorithms algorithms[] =
+    { zlib::kZlibDefault, zlib::kZlibStored, zlib::kLz4 };
+
+  const int fd = open(relative_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  void *buffer = NULL;
+  if (block_format) {
+    const bool retval = zlib::DecompressBlocks2Mem(fd, &buffer, &size);
+    close(fd);
+    if (!retval)
+      return false;
+  } else if (size > 0) {
+    buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buffer == MAP_FAILED) {
+      close(fd);
+      return false;
     }
+    madvise(buffer, size, MADV_SEQUENTIAL);
+  }
+  bool result = false;
+  // Large objects are published in parallel blocks, older ones serially
+  if (zlib::IsParallelSize(size)) {
+    result = zlib::CompressMem2NullParallel(buffer, size, hash);
+    if (result && (hash->ToString() == expected_hash))
+      goto hash_file_final;
+  }
+  for (unsigned i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); ++i) {
+    if (!zlib::IsAvailable(algorithms[i]))
+      continue;
+    result = zlib::CompressMem2Null(buffer, size, algorithms[i], hash);
+    if (!result || (hash->ToString() == expected_hash))
+      break;
   }
-  pthread_mutex_unlock(&g_lock_traverse);
-
-  if (d)
-    return true;
 
-  return false;
+ hash_file_final:
+  if (block_format) {
+    free(buffer);
+    return result;
+  }
+  if (size > 0)
+    munmap(buffer, size);
+  close(fd);
+  return result;
 }
 
 
-static void *MainCheck(void *data __attribute__((unused))) {
-  string relative_path;
-  string hash_name;
-
-  while (GetNextFile(&relative_path, &hash_name)) {
-    const string path = *g_cache_dir + "/" + relative_path;
+static void CheckFile(const string &relative_path, const string &hash_name,
+                      const platform_stat64 &info)
+{
+  const string path = *g_cache_dir + "/" + relative_path;
 
-    int n = atomic_xadd32(&g_num_files, 1);
-    if (g_verbose)
-      LogCvmfs(kLogCvmfs, kLogStdout, "Checking file %s", path.c_str());
-    if (!g_verbose && ((n % 1000) == 0))
-      LogCvmfs(kLogCvmfs, kLogStdout | kLogNoLinebreak, ".");
+  int n = atomic_xadd32(&g_num_files, 1);
+  if (!g_verbose && ((n % 1000) == 0))
+    LogCvmfs(kLogCvmfs, kLogStdout | kLogNoLinebreak, ".");
 
-    if (relative_path[relative_path.length()-1] == 'T') {
-      LogCvmfs(kLogCvmfs, kLogStdout,
-               "Warning: temporary file catalog %s found", path.c_str());
-      atomic_inc32(&g_num_tmp_catalog);
-      if (g_fix_errors) {
-        if (unlink(relative_path.c_str()) == 0) {
-          LogCvmfs(kLogCvmfs, kLogStdout, "Fix: %s unlinked", path.c_str());
-          atomic_inc32(&g_num_err_fixed);
-        } else {
-          LogCvmfs(kLogCvmfs, kLogStdout, "Error: failed to unlink %s",
-                   path.c_str());
-          atomic_inc32(&g_num_err_unfixed);
-        }
+  if (relative_path[relative_path.length()-1] == 'T') {
+    LogCvmfs(kLogCvmfs, kLogStdout,
+             "Warning: temporary file catalog %s found", path.c_str());
+    atomic_inc32(&g_num_tmp_catalog);
+    if (g_fix_errors) {
+      if (unlink(relative_path.c_str()) == 0) {
+        LogCvmfs(kLogCvmfs, kLogStdout, "Fix: %s unlinked", path.c_str());
+        atomic_inc32(&g_num_err_fixed);
+      } else {
+        LogCvmfs(kLogCvmfs, kLogStdout, "Error: failed to unlink %s",
+                 path.c_str());
+        atomic_inc32(&g_num_err_unfixed);
       }
-      continue;
     }
+    return;
+  }
 
-    FILE *fsrc = fopen(relative_path.c_str() , "r");
-    if (!fsrc) {
-      LogCvmfs(kLogCvmfs, kLogStdout, "Error: cannot open %s", path.c_str());
+  VerifiedObject object;
+  memset(&object, 0, sizeof(object));
+  const bool has_record = hash_name.length() < sizeof(object.name);
+  if (has_record) {
+    memcpy(object.name, hash_name.data(), hash_name.length());
+    object.size = info.st_size;
+    object.mtime = info.st_mtime;
+    object.verified_at = time(NULL);
+    if (g_incremental && IsVerified(object, info)) {
+      atomic_inc32(&g_num_skipped);
+      return;
+    }
+  }
+  if (g_verbose)
+    LogCvmfs(kLogCvmfs, kLogStdout, "Checking file %s", path.c_str());
+
+  // Compress every file and calculate SHA-1 of stream
+  const bool block_format =
+    (hash_name[hash_name.length()-1] == kCompressedSuffix);
+  const string expected_hash = block_format ?
+    hash_name.substr(0, hash_name.length()-1) : hash_name;
+  hash::Any hash(hash::kSha1);
+  if (!HashFile(relative_path, info.st_size, block_format, expected_hash,
+                &hash))
+  {
+    if (block_format) {
+      // Corrupted block index or blocks, handled like a wrong hash
+      hash = hash::Any(hash::kSha1);
+    } else {
+      LogCvmfs(kLogCvmfs, kLogStdout, "Error: could not compress %s (%d)",
+               path.c_str(), errno);
       atomic_inc32(&g_num_err_operational);
-      continue;
+      return;
     }
+  }
+  if (hash.ToString() == expected_hash) {
+    if (has_record)
+      AddVerified(object);
+    return;
+  }
 
-    // Compress every file and calculate SHA-1 of stream
-    hash::Any hash(hash::kSha1);
-    if (!zlib::CompressFile2Null(fsrc, &hash)) {
-      LogCvmfs(kLogCvmfs, kLogStdout, "Error: could not compress %s",
+  if (g_fix_errors) {
+    const string quarantaine_path = "./quarantaine/" + hash_name;
+    bool fixed = false;
+    if (rename(relative_path.c_str(), quarantaine_path.c_str()) == 0) {
+      LogCvmfs(kLogCvmfs, kLogStdout,
+               "Fix: %s is corrupted, moved to quarantaine folder",
                path.c_str());
-      atomic_inc32(&g_num_err_operational);
+      fixed = true;
     } else {
-      if (hash.ToString() != hash_name) {
-        if (g_fix_errors) {
-          const string quarantaine_path = "./quarantaine/" + hash_name;
-          bool fixed = false;
-          if (rename(relative_path.c_str(), quarantaine_path.c_str()) == 0) {
-            LogCvmfs(kLogCvmfs, kLogStdout,
-                     "Fix: %s is corrupted, moved to quarantaine folder",
-                     path.c_str());
-            fixed = true;
-          } else {
-            LogCvmfs(kLogCvmfs, kLogStdout,
-                     "Warning: failed to move %s into quarantaine folder",
-                     path.c_str());
-            if (unlink(relative_path.c_str()) == 0) {
-              LogCvmfs(kLogCvmfs, kLogStdout,
-                       "Fix: %s is corrupted, file unlinked", path.c_str());
-              fixed = true;
-            } else {
-              LogCvmfs(kLogCvmfs, kLogStdout,
-                       "Error: %s is corrupted, could not unlink",
-                       path.c_str());
-            }
-          }
-
-          if (fixed) {
-            atomic_inc32(&g_num_err_fixed);
-
-            // Changes made, we have to rebuild the managed cache db
-            atomic_cas32(&g_force_rebuild, 0, 1);
-            atomic_cas32(&g_modified_cache, 0, 1);
-          } else {
-            atomic_inc32(&g_num_err_unfixed);
-          }
-        } else {
-          LogCvmfs(kLogCvmfs, kLogStdout, "Error: %s has compressed checksum %s"
-                   ", delete this file from cache directory!",
-                   path.c_str(), hash.ToString().c_str());
-          atomic_inc32(&g_num_err_unfixed);
-        }
+      LogCvmfs(kLogCvmfs, kLogStdout,
+               "Warning: failed to move %s into quarantaine folder",
+               path.c_str());
+      if (unlink(relative_path.c_str()) == 0) {
+        LogCvmfs(kLogCvmfs, kLogStdout,
+                 "Fix: %s is corrupted, file unlinked", path.c_str());
+        fixed = true;
+      } else {
+        LogCvmfs(kLogCvmfs, kLogStdout,
+                 "Error: %s is corrupted, could not unlink",
+                 path.c_str());
       }
     }
-    fclose(fsrc);
+
+    if (fixed) {
+      atomic_inc32(&g_num_err_fixed);
+
+      // Changes made, we have to rebuild the managed cache db
+      atomic_cas32(&g_force_rebuild, 0, 1);
+      atomic_cas32(&g_modified_cache, 0, 1);
+    } else {
+      atomic_inc32(&g_num_err_unfixed);
+    }
+  } else {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Error: %s has compressed checksum %s"
+             ", delete this file from cache directory!",
+             path.c_str(), hash.ToString().c_str());
+    atomic_inc32(&g_num_err_unfixed);
+  }
+}
+
+
+static void *MainCheck(void *data __attribute__((unused))) {
+  int num_dir;
+  while ((num_dir = atomic_xadd32(&g_next_dir, 1)) < 256) {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", num_dir);
+    const string current_dir(hex, 2);
+    if (g_verbose)
+      LogCvmfs(kLogCvmfs, kLogStdout, "Entering %s", current_dir.c_str());
+    DIR *dirp = opendir(hex);
+    if (dirp == NULL) {
+      LogCvmfs(kLogCvmfs, kLogStderr,
+               "Invalid cache directory, %s/%s does not exist",
+               g_cache_dir->c_str(), current_dir.c_str());
+      exit(kErrorUnfixed);
+    }
+
+    platform_dirent64 *d;
+    while ((d = platform_readdir(dirp)) != NULL) {
+      const string name = d->d_name;
+      if ((name == ".") || (name == "..")) continue;
+
+      platform_stat64 info;
+      const string relative_path = current_dir + "/" + name;
+      const string path = *g_cache_dir + "/" + relative_path;
+      if (platform_lstat(relative_path.c_str(), &info) != 0) {
+        LogCvmfs(kLogCvmfs, kLogStdout, "Warning: failed to stat() %s (%d)",
+                 path.c_str(), errno);
+        continue;
+      }
+      if (!S_ISREG(info.st_mode)) {
+        LogCvmfs(kLogCvmfs, kLogStdout, "Warning: %s is not a regular file",
+                 path.c_str());
+        continue;
+      }
+
+      CheckFile(relative_path, current_dir + name, info);
+    }
+    closedir(dirp);
   }
 
   return NULL;
@@ -234,10 +414,12 @@ static void *MainCheck(void *data __attribute__((unused))) {
 int main(int argc, char **argv) {
   atomic_init32(&g_force_rebuild);
   atomic_init32(&g_modified_cache);
-  g_current_dir = new string();
+  atomic_init32(&g_next_dir);
+  g_verified = new vector<VerifiedObject>();
+  g_verified_new = new vector<VerifiedObject>();
 
   char c;
-  while ((c = getopt(argc, argv, "hvpfj:")) != -1) {
+  while ((c = getopt(argc, argv, "hvpfij:")) != -1) {
     switch (c) {
       case 'h':
         Usage();
@@ -251,6 +433,9 @@ int main(int argc, char **argv) {
       case 'f':
         atomic_cas32(&g_force_rebuild, 0, 1);
         break;
+      case 'i':
+        g_incremental = true;
+        break;
       case 'j':
         g_num_threads = atoi(optarg);
         if (g_num_threads < 1) {
@@ -300,7 +485,10 @@ int main(int argc, char **argv) {
   closedir(dirp_txn);
 
   // Run workers to recalculate checksums
+  if (g_incremental)
+    LoadVerified();
   atomic_init32(&g_num_files);
+  atomic_init32(&g_num_skipped);
   atomic_init32(&g_num_err_fixed);
   atomic_init32(&g_num_err_unfixed);
   atomic_init32(&g_num_err_operational);
@@ -324,13 +512,23 @@ int main(int argc, char **argv) {
   free(workers);
   if (!g_verbose)
     LogCvmfs(kLogCvmfs, kLogStdout, "");
-  LogCvmfs(kLogCvmfs, kLogStdout, "Verified %d files",
-           atomic_read32(&g_num_files));
+  StoreVerified();
+  if (g_incremental) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Verified %d files, %d of them unchanged "
+             "since the last run", atomic_read32(&g_num_files),
+             atomic_read32(&g_num_skipped));
+  } else {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Verified %d files",
+             atomic_read32(&g_num_files));
+  }
 
   if (atomic_read32(&g_num_tmp_catalog) > 0)
     LogCvmfs(kLogCvmfs, kLogStdout, "Temorary file catalogs were found.");
 
   if (atomic_read32(&g_force_rebuild)) {
+    // The LRU snapshot and journal take precedence over the database
+    unlink("lrusnapshot");
+    unlink("lrujournal");
     if (unlink("cachedb") == 0) {
       LogCvmfs(kLogCvmfs, kLogStdout,
                "Fix: managed cache db unlinked, will be rebuilt on next mount");
@@ -0,0 +1,414 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * cvmfs2_multi serves several repositories from a single process.  The
+ * repositories are attached to libcvmfs and share its cache, its quota
+ * manager, the download manager with the connection pool and the proxy
+ * state, and the public keys.  Catalogs, TTLs and path caches stay per
+ * repository.  Every repository is mounted on its own mountpoint and served
+ * through the high-level FUSE API by a FUSE loop of its own.
+ *
+ * A remount thread checks every second which repositories have reached the
+ * end of their catalog TTL and loads their new revisions.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include "cvmfs_config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <fuse/fuse.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <string>
+#include <vector>
+
+#include "libcvmfs.h"
+
+using namespace std;  // NOLINT
+
+namespace cvmfs_multi {
+
+const unsigned kShortTermTTL = 180;  /**< retry interval of failed remounts */
+const size_t kListingBufferSize = 64*1024;
+
+/**
+ * A mounted repository.  The context is the FUSE private_data.
+ */
+struct Mount {
+  string repository_name;
+  string mountpoint;
+  cvmfs_context *context;
+  struct fuse_chan *channel;
+  struct fuse *fuse;
+  pthread_t thread_loop;
+  bool loop_running;
+  time_t valid_until;
+};
+
+vector<Mount *> *mounts_ = NULL;
+pthread_t thread_remount_;
+int pipe_terminate_[2];
+
+
+static inline cvmfs_context *GetContext() {
+  return reinterpret_cast<cvmfs_context *>(fuse_get_context()->private_data);
+}
+
+
+static int multi_getattr(const char *path, struct stat *info) {
+  if (cvmfs_ctx_lstat(GetContext(), path, info) != 0)
+    return -errno;
+  return 0;
+}
+
+
+static int multi_readlink(const char *path, char *buf, size_t size) {
+  if (cvmfs_ctx_readlink(GetContext(), path, buf, size) != 0)
+    return -errno;
+  return 0;
+}
+
+
+static int multi_open(const char *path, struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    return -EROFS;
+  const int fd = cvmfs_ctx_open(GetContext(), path);
+  if (fd < 0)
+    return -errno;
+  fi->fh = fd;
+  fi->keep_cache = 1;
+  return 0;
+}
+
+
+static int multi_read(const char *path __attribute__((unused)),
+                      char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+  size_t nbytes = 0;
+  while (nbytes < size) {
+    const ssize_t retval = pread(fi->fh, buf + nbytes, size - nbytes,
+                                 offset + nbytes);
+    if (retval < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (retval == 0)
+      break;
+    nbytes += retval;
+  }
+  return nbytes;
+}
+
+
+static int multi_release(const char *path __attribute__((unused)),
+                         struct fuse_file_info *fi)
+{
+  cvmfs_ctx_close(GetContext(), fi->fh);
+  return 0;
+}
+
+
+/**
+ * Lists the directory together with the stat information, so that the
+ * kernel does not need a lookup per entry.
+ */
+static int multi_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset __attribute__((unused)),
+                         struct fuse_file_info *fi __attribute__((unused)))
+{
+  size_t size = kListingBufferSize;
+  void *listing = malloc(size);
+  int num_entries = cvmfs_ctx_listdir_stat(GetContext(), path, listing, &size);
+  if ((num_entries < 0) && (errno == ERANGE)) {
+    free(listing);
+    listing = malloc(size);
+    num_entries = cvmfs_ctx_listdir_stat(GetContext(), path, listing, &size);
+  }
+  if (num_entries < 0) {
+    const int error = errno;
+    free(listing);
+    return -error;
+  }
+
+  const struct cvmfs_stat_entry *entries =
+    reinterpret_cast<const struct cvmfs_stat_entry *>(listing);
+  for (int i = 0; i < num_entries; ++i) {
+    if (filler(buf, entries[i].name, &entries[i].st, 0) != 0)
+      break;
+  }
+  free(listing);
+  return 0;
+}
+
+
+static int multi_statfs(const char *path __attribute__((unused)),
+                        struct statvfs *info)
+{
+  memset(info, 0, sizeof(*info));
+  info->f_bsize = 4096;
+  info->f_namemax = 255;
+  return 0;
+}
+
+
+static void SetFuseOperations(struct fuse_operations *operations) {
+  memset(operations, 0, sizeof(*operations));
+  operations->getattr = multi_getattr;
+  operations->readlink = multi_readlink;
+  operations->open = multi_open;
+  operations->read = multi_read;
+  operations->release = multi_release;
+  operations->readdir = multi_readdir;
+  operations->statfs = multi_statfs;
+}
+
+
+static void *MainFuseLoop(void *data) {
+  Mount *mount = reinterpret_cast<Mount *>(data);
+  fuse_loop_mt(mount->fuse);
+  return NULL;
+}
+
+
+static void SetValidUntil(Mount *mount, const bool success) {
+  const unsigned ttl = success ? cvmfs_ctx_ttl(mount->context) : kShortTermTTL;
+  mount->valid_until = time(NULL) + ttl;
+}
+
+
+/**
+ * Remounts the repositories one after the other, so that a slow repository
+ * delays the others by at most its remount.
+ */
+static void *MainRemount(void *data __attribute__((unused))) {
+  struct pollfd watch;
+  watch.fd = pipe_terminate_[0];
+  watch.events = POLLIN;
+  while (true) {
+    watch.revents = 0;
+    if (poll(&watch, 1, 1000) != 0)
+      break;
+    const time_t now = time(NULL);
+    for (unsigned i = 0; i < mounts_->size(); ++i) {
+      Mount *mount = (*mounts_)[i];
+      if (now < mount->valid_until)
+        continue;
+      const bool success = (cvmfs_ctx_remount(mount->context) == 0);
+      if (!success) {
+        syslog(LOG_WARNING, "remount of %s failed, retrying in %u seconds",
+               mount->repository_name.c_str(), kShortTermTTL);
+      }
+      SetValidUntil(mount, success);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * Attaches the repository and mounts it on the mountpoint.
+ */
+static Mount *Attach(const string &repository_name, const string &mountpoint,
+                     const string &fuse_options)
+{
+  Mount *mount = new Mount();
+  mount->repository_name = repository_name;
+  mount->mountpoint = mountpoint;
+  mount->channel = NULL;
+  mount->fuse = NULL;
+  mount->loop_running = false;
+
+  const string repo_options = "repo_name=" + repository_name +
+                              ",mountpoint=" + mountpoint;
+  mount->context = cvmfs_attach_repo(repo_options.c_str());
+  if (mount->context == NULL) {
+    fprintf(stderr, "failed to attach %s\n", repository_name.c_str());
+    delete mount;
+    return NULL;
+  }
+  SetValidUntil(mount, true);
+
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  const string mount_options = "ro,fsname=cvmfs2" +
+    (fuse_options.empty() ? "" : "," + fuse_options);
+  fuse_opt_add_arg(&args, "cvmfs2_multi");
+  fuse_opt_add_arg(&args, "-o");
+  fuse_opt_add_arg(&args, mount_options.c_str());
+  mount->channel = fuse_mount(mountpoint.c_str(), &args);
+  if (mount->channel != NULL) {
+    struct fuse_operations operations;
+    SetFuseOperations(&operations);
+    mount->fuse = fuse_new(mount->channel, &args, &operations,
+                           sizeof(operations), mount->context);
+    if (mount->fuse == NULL) {
+      fuse_unmount(mountpoint.c_str(), mount->channel);
+      mount->channel = NULL;
+    }
+  }
+  fuse_opt_free_args(&args);
+  if (mount->fuse == NULL) {
+    fprintf(stderr, "failed to mount %s on %s\n", repository_name.c_str(),
+            mountpoint.c_str());
+    cvmfs_detach_repo(mount->context);
+    delete mount;
+    return NULL;
+  }
+  return mount;
+}
+
+
+/**
+ * Unmounts the repository and detaches it.  The FUSE loop ends as soon as
+ * the channel is gone.
+ */
+static void Detach(Mount *mount) {
+  fuse_exit(mount->fuse);
+  fuse_unmount(mount->mountpoint.c_str(), mount->channel);
+  if (mount->loop_running)
+    pthread_join(mount->thread_loop, NULL);
+  fuse_destroy(mount->fuse);
+  cvmfs_detach_repo(mount->context);
+  delete mount;
+}
+
+
+static void Usage(const char *exe) {
+  fprintf(stderr,
+          "Serves several repositories from one process with a shared cache\n"
+          "and download stack.\n\n"
+          "Usage: %s [-d] [-o <fuse options>] <libcvmfs options> "
+          "<repository>:<mountpoint> ...\n\n"
+          "  -d  runs in the background\n"
+          "  -o  additional mount options for all mountpoints, e.g. "
+          "allow_other\n\n"
+          "The libcvmfs options are given to cvmfs_init() and shared by all\n"
+          "repositories.  The url should contain the @fqrn@ placeholder.\n",
+          exe);
+}
+
+}  // namespace cvmfs_multi
+
+
+using namespace cvmfs_multi;  // NOLINT
+
+int main(int argc, char *argv[]) {
+  bool daemonize = false;
+  string fuse_options;
+  int c;
+  while ((c = getopt(argc, argv, "do:h")) != -1) {
+    switch (c) {
+      case 'd':
+        daemonize = true;
+        break;
+      case 'o':
+        fuse_options = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    Usage(argv[0]);
+    return 1;
+  }
+  const string options = argv[optind];
+  vector<string> repository_names;
+  vector<string> mountpoints;
+  for (int i = optind + 1; i < argc; ++i) {
+    const string arg = argv[i];
+    const size_t separator = arg.find(':');
+    if ((separator == string::npos) || (separator == 0) ||
+        (separator == arg.length()-1))
+    {
+      fprintf(stderr, "invalid repository %s, expected "
+              "<repository>:<mountpoint>\n", arg.c_str());
+      return 1;
+    }
+    repository_names.push_back(arg.substr(0, separator));
+    mountpoints.push_back(arg.substr(separator+1));
+  }
+
+  // libcvmfs starts its threads in cvmfs_init()
+  if (daemonize && (daemon(1, 0) != 0)) {
+    fprintf(stderr, "failed to daemonize (%d)\n", errno);
+    return 1;
+  }
+  openlog("cvmfs2_multi", LOG_PID, LOG_DAEMON);
+
+  // The signals are handled by sigwait() in the main thread only
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  if (cvmfs_init(options.c_str()) != 0) {
+    fprintf(stderr, "failed to initialize libcvmfs\n");
+    return 1;
+  }
+
+  mounts_ = new vector<Mount *>();
+  for (unsigned i = 0; i < repository_names.size(); ++i) {
+    Mount *mount = Attach(repository_names[i], mountpoints[i], fuse_options);
+    if (mount == NULL)
+      continue;
+    if (pthread_create(&mount->thread_loop, NULL, MainFuseLoop, mount) != 0) {
+      Detach(mount);
+      continue;
+    }
+    mount->loop_running = true;
+    mounts_->push_back(mount);
+    syslog(LOG_INFO, "mounted %s on %s", mount->repository_name.c_str(),
+           mount->mountpoint.c_str());
+  }
+  if (mounts_->empty()) {
+    delete mounts_;
+    cvmfs_fini();
+    return 1;
+  }
+
+  if (pipe(pipe_terminate_) != 0) {
+    fprintf(stderr, "failed to create pipe (%d)\n", errno);
+    abort();
+  }
+  int retval = pthread_create(&thread_remount_, NULL, MainRemount, NULL);
+  assert(retval == 0);
+
+  int signal_number;
+  sigwait(&signals, &signal_number);
+  syslog(LOG_INFO, "received signal %d, unmounting", signal_number);
+
+  char terminate = 'T';
+  if (write(pipe_terminate_[1], &terminate, 1) != 1)
+    abort();
+  pthread_join(thread_remount_, NULL);
+  close(pipe_terminate_[0]);
+  close(pipe_terminate_[1]);
+
+  for (unsigned i = 0; i < mounts_->size(); ++i)
+    Detach((*mounts_)[i]);
+  delete mounts_;
+  mounts_ = NULL;
+  cvmfs_fini();
+  closelog();
+  return 0;
+}
@@ -0,0 +1,445 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool replays a trace file of the client (csv or binary) against a
+ * mounted repository or, if built as cvmfs_replay_libcvmfs, directly against
+ * libcvmfs.  Requests are either issued at their original inter-arrival times,
+ * optionally accelerated, or as fast as possible.  In both cases, a number of
+ * worker threads executes the requests.
+ *
+ * For every type of operation, the tool reports the latency distribution and
+ * the fraction of requests that were answered faster than a threshold.  These
+ * are counted as cache hits, a miss in the cache (download, catalog load)
+ * is orders of magnitude slower than a hit.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "histogram.h"
+#include "logging.h"
+#include "platform.h"
+#include "tracer.h"
+#include "util.h"
+#ifdef CVMFS_REPLAY_LIBCVMFS
+#include "libcvmfs.h"
+#endif
+
+using namespace std;  // NOLINT
+
+enum Errors {
+  kErrorOk = 0,
+  kErrorUsage = 1,
+  kErrorOperational = 2,
+};
+
+/**
+ * Replayed trace events.  Other events (kernel cache, internal) are skipped.
+ */
+struct Operation {
+  int code;
+  const char *name;
+};
+const Operation kOperations[] = {
+  { tracer::kFuseOpen,     "open"     },
+  { tracer::kFuseLookup,   "lookup"   },
+  { tracer::kFuseStat,     "stat"     },
+  { tracer::kFuseLs,       "ls"       },
+  { tracer::kFuseReadlink, "readlink" },
+  { tracer::kFuseRead,     "read"     },
+};
+const unsigned kNumOperations = sizeof(kOperations) / sizeof(kOperations[0]);
+
+/**
+ * Requests started more than 10ms after their due time are reported as
+ * late, the replay is then limited by the number of threads.
+ */
+const uint64_t kLateUs = 10000;
+
+struct Request {
+  uint64_t due_us;  /**< Relative to the first request */
+  unsigned operation;
+  string path;
+};
+
+string *g_mountpoint = NULL;
+string *g_libcvmfs_options = NULL;
+int g_num_threads = 1;
+double g_speed = 0.0;  /**< 0 means as fast as possible */
+bool g_read_data = false;
+uint64_t g_hit_threshold_us = 1000;
+uint64_t g_start_us;
+vector<Request> *g_requests;
+atomic_int64 g_next_request;
+atomic_int64 g_num_late;
+Log2Histogram *g_latencies;  /**< One per operation */
+atomic_int64 g_num_hits[kNumOperations];
+atomic_int64 g_num_errors[kNumOperations];
+atomic_int64 g_bytes_read;
+
+
+static void Usage() {
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "CernVM File System trace replay, version %s\n\n"
+           "This tool replays a trace file written by the tracefile option\n"
+           "and reports latency quantiles and cache hits per operation.\n\n"
+#ifdef CVMFS_REPLAY_LIBCVMFS
+           "Usage: cvmfs_replay_libcvmfs -o <libcvmfs options> "
+#else
+           "Usage: cvmfs_replay -m <mountpoint> "
+#endif
+           "[-j #threads] [-s speed] [-r] [-H usec] [-n #requests] "
+           "<trace file>\n"
+           "Options:\n"
+#ifdef CVMFS_REPLAY_LIBCVMFS
+           "  -o options for cvmfs_init(), as for libcvmfs\n"
+#else
+           "  -m mountpoint of the repository\n"
+#endif
+           "  -j number of concurrent worker threads (default: 1)\n"
+           "  -s issue requests at the original times, accelerated by speed\n"
+           "     (default: as fast as possible)\n"
+           "  -r read the contents of opened files\n"
+           "  -H requests faster than usec are cache hits (default: 1000)\n"
+           "  -n replay only the first requests of the trace\n",
+           VERSION);
+}
+
+
+static int FindOperation(const int code) {
+  for (unsigned i = 0; i < kNumOperations; ++i) {
+    if (kOperations[i].code == code)
+      return i;
+  }
+  return -1;
+}
+
+
+static bool LoadTrace(const string &path, const uint64_t max_requests) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f)
+    return false;
+
+  const bool binary = tracer::ReadBinaryHeader(f);
+  if (!binary)
+    rewind(f);
+  bool has_first = false;
+  uint64_t first_us = 0;
+  tracer::Record record;
+  char buf[2*PATH_MAX + 64];
+  while (g_requests->size() < max_requests) {
+    if (binary) {
+      if (!tracer::ReadBinaryRecord(f, &record))
+        break;
+    } else {
+      if (!fgets(buf, sizeof(buf), f))
+        break;
+      if (!tracer::ParseCsv(buf, &record))
+        continue;
+    }
+    const int operation = FindOperation(record.code);
+    if (operation < 0)
+      continue;
+
+    const uint64_t time_us = uint64_t(record.time_stamp.tv_sec)*1000000 +
+                             record.time_stamp.tv_usec;
+    if (!has_first) {
+      first_us = time_us;
+      has_first = true;
+    }
+    Request request;
+    request.due_us = (time_us > first_us) ? time_us - first_us : 0;
+    request.operation = operation;
+    request.path = record.path.empty() ? "/" : record.path;
+    g_requests->push_back(request);
+  }
+  fclose(f);
+  return true;
+}
+
+
+#ifdef CVMFS_REPLAY_LIBCVMFS
+
+static int DoOpen(const string &path, const bool read_data) {
+  const int fd = cvmfs_open(path.c_str());
+  if (fd < 0)
+    return errno;
+  if (read_data) {
+    char buf[64*1024];
+    ssize_t nbytes;
+    while ((nbytes = read(fd, buf, sizeof(buf))) > 0)
+      atomic_xadd64(&g_bytes_read, nbytes);
+  }
+  cvmfs_close(fd);
+  return 0;
+}
+
+static int DoStat(const string &path) {
+  struct stat info;
+  return (cvmfs_lstat(path.c_str(), &info) == 0) ? 0 : errno;
+}
+
+static int DoListing(const string &path) {
+  char **entries = NULL;
+  size_t num_entries = 0;
+  if (cvmfs_listdir(path.c_str(), &entries, &num_entries) != 0)
+    return errno;
+  for (unsigned i = 0; entries && entries[i]; ++i)
+    free(entries[i]);
+  free(entries);
+  return 0;
+}
+
+static int DoReadlink(const string &path) {
+  char buf[PATH_MAX + 1];
+  return (cvmfs_readlink(path.c_str(), buf, sizeof(buf)) == 0) ? 0 : errno;
+}
+
+#else
+
+static int DoOpen(const string &path, const bool read_data) {
+  const int fd = open((*g_mountpoint + path).c_str(), O_RDONLY);
+  if (fd < 0)
+    return errno;
+  if (read_data) {
+    char buf[64*1024];
+    ssize_t nbytes;
+    while ((nbytes = read(fd, buf, sizeof(buf))) > 0)
+      atomic_xadd64(&g_bytes_read, nbytes);
+  }
+  close(fd);
+  return 0;
+}
+
+static int DoStat(const string &path) {
+  platform_stat64 info;
+  return (platform_lstat((*g_mountpoint + path).c_str(), &info) == 0) ?
+         0 : errno;
+}
+
+static int DoListing(const string &path) {
+  DIR *dirp = opendir((*g_mountpoint + path).c_str());
+  if (!dirp)
+    return errno;
+  while (platform_readdir(dirp) != NULL) { }
+  closedir(dirp);
+  return 0;
+}
+
+static int DoReadlink(const string &path) {
+  char buf[PATH_MAX + 1];
+  return (readlink((*g_mountpoint + path).c_str(), buf, sizeof(buf)) >= 0) ?
+         0 : errno;
+}
+
+#endif
+
+
+/**
+ * Executes a request and returns 0 or the errno of the failed call.
+ */
+static int Replay(const Request &request) {
+  switch (kOperations[request.operation].code) {
+    case tracer::kFuseOpen:
+      return DoOpen(request.path, g_read_data);
+    case tracer::kFuseRead:
+      return DoOpen(request.path, true);
+    case tracer::kFuseLs:
+      return DoListing(request.path);
+    case tracer::kFuseReadlink:
+      return DoReadlink(request.path);
+    default:
+      return DoStat(request.path);
+  }
+}
+
+
+static void *MainReplay(void *data __attribute__((unused))) {
+  const int64_t num_requests = g_requests->size();
+  int64_t next;
+  while ((next = atomic_xadd64(&g_next_request, 1)) < num_requests) {
+    const Request &request = (*g_requests)[next];
+    if (g_speed > 0.0) {
+      const uint64_t due_us = g_start_us + uint64_t(request.due_us / g_speed);
+      const uint64_t now_us = Log2Histogram::Now();
+      if (due_us > now_us) {
+        const uint64_t wait_us = due_us - now_us;
+        struct timespec wait;
+        wait.tv_sec = wait_us / 1000000;
+        wait.tv_nsec = (wait_us % 1000000) * 1000;
+        nanosleep(&wait, NULL);
+      } else if (now_us - due_us > kLateUs)
+        atomic_inc64(&g_num_late);
+    }
+
+    const uint64_t start_us = Log2Histogram::Now();
+    const int retval = Replay(request);
+    const uint64_t end_us = Log2Histogram::Now();
+    const uint64_t latency_us = (end_us > start_us) ? end_us - start_us : 0;
+    g_latencies[request.operation].Add(latency_us);
+    if (latency_us < g_hit_threshold_us)
+      atomic_inc64(&g_num_hits[request.operation]);
+    // Negative lookups are part of regular traces
+    if ((retval != 0) && (retval != ENOENT))
+      atomic_inc64(&g_num_errors[request.operation]);
+  }
+  return NULL;
+}
+
+
+static void PrintReport(const uint64_t duration_us) {
+  const uint64_t num_requests = g_requests->size();
+  const double seconds = double(duration_us) / 1000000.0;
+  LogCvmfs(kLogCvmfs, kLogStdout,
+           "Replayed %"PRIu64" requests in %.2fs (%.0f requests/s) "
+           "with %d threads", num_requests, seconds,
+           seconds > 0.0 ? double(num_requests) / seconds : 0.0,
+           g_num_threads);
+  if (g_speed > 0.0) {
+    LogCvmfs(kLogCvmfs, kLogStdout,
+             "Original timing with speed %.2f, started late (>%"PRIu64"ms): "
+             "%"PRId64, g_speed, kLateUs / 1000, atomic_read64(&g_num_late));
+  }
+  if (atomic_read64(&g_bytes_read) > 0) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Data read: %"PRId64" MB",
+             atomic_read64(&g_bytes_read) / (1024*1024));
+  }
+
+  for (unsigned i = 0; i < kNumOperations; ++i) {
+    // Number of requests is the first field of the histogram line
+    string latencies = g_latencies[i].Print();
+    if (latencies == "n: 0\n")
+      continue;
+    latencies.erase(latencies.length() - 1);
+    uint64_t num_operation = 0;
+    for (unsigned j = 0; j < num_requests; ++j) {
+      if ((*g_requests)[j].operation == i)
+        num_operation++;
+    }
+    const int64_t num_hits = atomic_read64(&g_num_hits[i]);
+    LogCvmfs(kLogCvmfs, kLogStdout,
+             "%-9s %s  hits (<%"PRIu64"us): %"PRId64" (%.1f%%)  "
+             "errors: %"PRId64,
+             kOperations[i].name, latencies.c_str(), g_hit_threshold_us,
+             num_hits, 100.0 * num_hits / num_operation,
+             atomic_read64(&g_num_errors[i]));
+  }
+}
+
+
+int main(int argc, char **argv) {
+  uint64_t max_requests = uint64_t(-1);
+  char c;
+  while ((c = getopt(argc, argv, "hm:o:j:s:rH:n:")) != -1) {
+    switch (c) {
+      case 'h':
+        Usage();
+        return kErrorOk;
+      case 'm':
+        g_mountpoint = new string(MakeCanonicalPath(optarg));
+        break;
+      case 'o':
+        g_libcvmfs_options = new string(optarg);
+        break;
+      case 'j':
+        g_num_threads = atoi(optarg);
+        if (g_num_threads < 1) {
+          LogCvmfs(kLogCvmfs, kLogStdout,
+                   "There is at least one worker thread required");
+          return kErrorUsage;
+        }
+        break;
+      case 's':
+        g_speed = atof(optarg);
+        break;
+      case 'r':
+        g_read_data = true;
+        break;
+      case 'H':
+        g_hit_threshold_us = String2Uint64(optarg);
+        break;
+      case 'n':
+        max_requests = String2Uint64(optarg);
+        break;
+      case '?':
+      default:
+        Usage();
+        return kErrorUsage;
+    }
+  }
+#ifdef CVMFS_REPLAY_LIBCVMFS
+  if ((optind >= argc) || !g_libcvmfs_options) {
+#else
+  if ((optind >= argc) || !g_mountpoint) {
+#endif
+    Usage();
+    return kErrorUsage;
+  }
+
+  g_requests = new vector<Request>();
+  if (!LoadTrace(argv[optind], max_requests)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "Could not read trace file %s",
+             argv[optind]);
+    return kErrorOperational;
+  }
+  LogCvmfs(kLogCvmfs, kLogStdout, "Loaded %"PRIu64" requests from %s",
+           uint64_t(g_requests->size()), argv[optind]);
+
+#ifdef CVMFS_REPLAY_LIBCVMFS
+  if (cvmfs_init(g_libcvmfs_options->c_str()) != 0) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "Could not initialize libcvmfs");
+    return kErrorOperational;
+  }
+#endif
+
+  g_latencies = new Log2Histogram[kNumOperations];
+  for (unsigned i = 0; i < kNumOperations; ++i) {
+    atomic_init64(&g_num_hits[i]);
+    atomic_init64(&g_num_errors[i]);
+  }
+  atomic_init64(&g_next_request);
+  atomic_init64(&g_num_late);
+  atomic_init64(&g_bytes_read);
+  vector<pthread_t> workers(g_num_threads);
+  g_start_us = Log2Histogram::Now();
+  for (int i = 0; i < g_num_threads; ++i) {
+    if (pthread_create(&workers[i], NULL, MainReplay, NULL) != 0) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "Fatal: could not create worker thread");
+      return kErrorOperational;
+    }
+  }
+  for (int i = 0; i < g_num_threads; ++i)
+    pthread_join(workers[i], NULL);
+  PrintReport(Log2Histogram::Now() - g_start_us);
+
+#ifdef CVMFS_REPLAY_LIBCVMFS
+  cvmfs_fini();
+#endif
+  delete[] g_latencies;
+  delete g_requests;
+  delete g_mountpoint;
+  delete g_libcvmfs_options;
+  return kErrorOk;
+}
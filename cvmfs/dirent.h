@@ -11,14 +11,17 @@
 
 #include <sys/types.h>
 
+#include <cstring>
 #include <list>
 #include <string>
+#include <vector>
 
 #include "platform.h"
 #include "util.h"
 #include "hash.h"
 #include "shortstring.h"
 #include "globals.h"
+#include "smalloc.h"
 
 namespace publish {
 class SyncItem;
@@ -27,6 +30,8 @@ class SyncItem;
 namespace catalog {
 
 class Catalog;
+class PackedDirent;
+class CatalogIndex;
 typedef uint64_t inode_t;
 
 enum SpecialDirents {
@@ -36,9 +41,12 @@ enum SpecialDirents {
 
 class DirectoryEntry {
   friend class SqlLookup;               // simplify creation of DirectoryEntry objects
+  friend class SqlListingBlob;          // simplify creation of DirectoryEntry objects
   friend class SqlDirentWrite;          // simplify write of DirectoryEntry objects in database
   friend class publish::SyncItem;       // simplify creation of DirectoryEntry objects for write back
   friend class WritableCatalogManager;  // TODO: remove this dependency
+  friend class PackedDirent;            // compact copy for the caches
+  friend class CatalogIndex;            // simplify creation of DirectoryEntry objects
 
 public:
   const static inode_t kInvalidInode = 0;
@@ -58,12 +66,13 @@ public:
     mtime_(0),
     cached_mtime_(0),
     is_nested_catalog_root_(false),
-    is_nested_catalog_mountpoint_(false) { }
+    is_nested_catalog_mountpoint_(false),
+    is_chunked_file_(false) { }
 
   inline explicit DirectoryEntry(SpecialDirents special_type) :
     catalog_((Catalog *)(-1)) { };
 
-  inline SpecialDirents GetSpecial() {
+  inline SpecialDirents GetSpecial() const {
     return (catalog_ == (Catalog *)(-1)) ? kDirentNegative : kDirentNormal;
   }
   inline bool IsNestedCatalogRoot() const { return is_nested_catalog_root_; }
@@ -71,6 +80,8 @@ public:
     return is_nested_catalog_mountpoint_;
   }
 
+  inline bool IsChunkedFile() const { return is_chunked_file_; }
+
   inline bool IsRegular() const { return S_ISREG(mode_); }
   inline bool IsLink() const { return S_ISLNK(mode_); }
   inline bool IsDirectory() const { return S_ISDIR(mode_); }
@@ -148,6 +159,9 @@ public:
   inline void set_is_nested_catalog_root(const bool val) {
     is_nested_catalog_root_ = val;
   }
+  inline void set_is_chunked_file(const bool val) {
+    is_chunked_file_ = val;
+  }
 
 private:
   // Associated cvmfs catalog
@@ -172,8 +186,248 @@ private:
   // Administrative data
   bool is_nested_catalog_root_;
   bool is_nested_catalog_mountpoint_;
+  bool is_chunked_file_;  /**< content is stored in pieces, see FileChunk */
+};
+
+/**
+ * Compact copy of a DirectoryEntry for the meta-data caches, 128 bytes instead
+ * of the ~180 bytes of a DirectoryEntry.  The name and the symlink are stored
+ * back to back in an inline buffer and only move to the heap if they don't
+ * fit.  Of the checksum, only the digest bytes of its algorithm are copied.
+ * The cache wrappers convert from and to DirectoryEntry at their interface.
+ */
+class PackedDirent {
+ public:
+  static const unsigned kInlineSize = 32;
+
+  PackedDirent() :
+    catalog_(NULL), inode_(DirectoryEntry::kInvalidInode),
+    parent_inode_(DirectoryEntry::kInvalidInode), hardlinks_(0), size_(0),
+    mtime_(0), cached_mtime_(0), mode_(0), uid_(0), gid_(0),
+    name_length_(0), symlink_length_(0), algorithm_(hash::kAny), flags_(0)
+  {
+    memset(digest_, 0, sizeof(digest_));
+  }
+  explicit PackedDirent(const DirectoryEntry &dirent) {
+    name_length_ = symlink_length_ = 0;
+    Pack(dirent);
+  }
+  PackedDirent(const PackedDirent &other) {
+    name_length_ = symlink_length_ = 0;
+    Assign(other);
+  }
+  PackedDirent &operator= (const PackedDirent &other) {
+    if (this != &other)
+      Assign(other);
+    return *this;
+  }
+  ~PackedDirent() { FreeStrings(); }
+
+  void Pack(const DirectoryEntry &dirent) {
+    catalog_ = dirent.catalog_;
+    inode_ = dirent.inode_;
+    parent_inode_ = dirent.parent_inode_;
+    hardlinks_ = dirent.hardlinks_;
+    size_ = dirent.size_;
+    mtime_ = dirent.mtime_;
+    cached_mtime_ = dirent.cached_mtime_;
+    mode_ = dirent.mode_;
+    uid_ = dirent.uid_;
+    gid_ = dirent.gid_;
+    algorithm_ = dirent.checksum_.algorithm;
+    memcpy(digest_, dirent.checksum_.digest, dirent.checksum_.GetDigestSize());
+    flags_ = 0;
+    if (dirent.is_nested_catalog_root_) flags_ |= kFlagNestedRoot;
+    if (dirent.is_nested_catalog_mountpoint_) flags_ |= kFlagNestedMountpoint;
+    if (dirent.is_chunked_file_) flags_ |= kFlagChunked;
+    SetStrings(dirent.name_.GetChars(), dirent.name_.GetLength(),
+               dirent.symlink_.GetChars(), dirent.symlink_.GetLength());
+  }
+
+  void Unpack(DirectoryEntry *dirent) const {
+    dirent->catalog_ = const_cast<Catalog *>(catalog_);
+    dirent->inode_ = inode_;
+    dirent->parent_inode_ = parent_inode_;
+    dirent->hardlinks_ = hardlinks_;
+    dirent->size_ = size_;
+    dirent->mtime_ = mtime_;
+    dirent->cached_mtime_ = cached_mtime_;
+    dirent->mode_ = mode_;
+    dirent->uid_ = uid_;
+    dirent->gid_ = gid_;
+    dirent->checksum_ = hash::Any(static_cast<hash::Algorithms>(algorithm_));
+    memcpy(dirent->checksum_.digest, digest_,
+           dirent->checksum_.GetDigestSize());
+    dirent->is_nested_catalog_root_ = flags_ & kFlagNestedRoot;
+    dirent->is_nested_catalog_mountpoint_ = flags_ & kFlagNestedMountpoint;
+    dirent->is_chunked_file_ = flags_ & kFlagChunked;
+    const char *strings = GetStrings();
+    dirent->name_.Assign(strings, name_length_);
+    dirent->symlink_.Assign(strings + name_length_, symlink_length_);
+  }
+
+  inline SpecialDirents GetSpecial() const {
+    return (catalog_ == (Catalog *)(-1)) ? kDirentNegative : kDirentNormal;
+  }
+  inline inode_t inode() const { return inode_; }
+  inline inode_t parent_inode() const { return parent_inode_; }
+
+  /**
+   * Flat copy in host byte order for the cache snapshot.  The catalog pointer
+   * is not kept, only whether the entry is negative.
+   */
+  static const unsigned kSerialHeaderSize =
+    6*8 + 3*4 + hash::kMaxDigestSize + 2*2 + 3;
+  inline unsigned GetSerialSize() const {
+    return kSerialHeaderSize + name_length_ + symlink_length_;
+  }
+
+  void Serialize(unsigned char *buffer) const {
+    const uint8_t negative = (GetSpecial() == kDirentNegative);
+    unsigned char *pos = buffer;
+    pos = Put(pos, &inode_, sizeof(inode_));
+    pos = Put(pos, &parent_inode_, sizeof(parent_inode_));
+    pos = Put(pos, &hardlinks_, sizeof(hardlinks_));
+    pos = Put(pos, &size_, sizeof(size_));
+    pos = Put(pos, &mtime_, sizeof(mtime_));
+    pos = Put(pos, &cached_mtime_, sizeof(cached_mtime_));
+    pos = Put(pos, &mode_, sizeof(mode_));
+    pos = Put(pos, &uid_, sizeof(uid_));
+    pos = Put(pos, &gid_, sizeof(gid_));
+    pos = Put(pos, digest_, sizeof(digest_));
+    pos = Put(pos, &name_length_, sizeof(name_length_));
+    pos = Put(pos, &symlink_length_, sizeof(symlink_length_));
+    pos = Put(pos, &algorithm_, sizeof(algorithm_));
+    pos = Put(pos, &flags_, sizeof(flags_));
+    pos = Put(pos, &negative, sizeof(negative));
+    Put(pos, GetStrings(), name_length_ + symlink_length_);
+  }
+
+  /**
+   * @return the number of bytes consumed, 0 if the buffer is too short
+   */
+  unsigned Deserialize(const unsigned char *buffer, const unsigned size) {
+    if (size < kSerialHeaderSize)
+      return 0;
+    uint16_t name_length;
+    uint16_t symlink_length;
+    uint8_t negative;
+    const unsigned char *pos = buffer;
+    pos = Get(pos, &inode_, sizeof(inode_));
+    pos = Get(pos, &parent_inode_, sizeof(parent_inode_));
+    pos = Get(pos, &hardlinks_, sizeof(hardlinks_));
+    pos = Get(pos, &size_, sizeof(size_));
+    pos = Get(pos, &mtime_, sizeof(mtime_));
+    pos = Get(pos, &cached_mtime_, sizeof(cached_mtime_));
+    pos = Get(pos, &mode_, sizeof(mode_));
+    pos = Get(pos, &uid_, sizeof(uid_));
+    pos = Get(pos, &gid_, sizeof(gid_));
+    pos = Get(pos, digest_, sizeof(digest_));
+    pos = Get(pos, &name_length, sizeof(name_length));
+    pos = Get(pos, &symlink_length, sizeof(symlink_length));
+    pos = Get(pos, &algorithm_, sizeof(algorithm_));
+    pos = Get(pos, &flags_, sizeof(flags_));
+    pos = Get(pos, &negative, sizeof(negative));
+    const unsigned strings_length = unsigned(name_length) + symlink_length;
+    if (size - kSerialHeaderSize < strings_length)
+      return 0;
+    SetStrings(reinterpret_cast<const char *>(pos), name_length,
+               reinterpret_cast<const char *>(pos) + name_length,
+               symlink_length);
+    catalog_ = negative ? (Catalog *)(-1) : NULL;
+    return kSerialHeaderSize + strings_length;
+  }
+
+ private:
+  static inline unsigned char *Put(unsigned char *pos, const void *field,
+                                   const unsigned size)
+  {
+    memcpy(pos, field, size);
+    return pos + size;
+  }
+  static inline const unsigned char *Get(const unsigned char *pos,
+                                         void *field, const unsigned size)
+  {
+    memcpy(field, pos, size);
+    return pos + size;
+  }
+
+  static const uint8_t kFlagNestedRoot = 0x01;
+  static const uint8_t kFlagNestedMountpoint = 0x02;
+  static const uint8_t kFlagChunked = 0x04;
+
+  inline bool IsInline() const {
+    return unsigned(name_length_) + symlink_length_ <= kInlineSize;
+  }
+  inline const char *GetStrings() const {
+    return IsInline() ? strings_.chars : strings_.heap;
+  }
+
+  void FreeStrings() {
+    if (!IsInline())
+      free(strings_.heap);
+    name_length_ = symlink_length_ = 0;
+  }
+
+  void SetStrings(const char *name, const unsigned name_length,
+                  const char *symlink, const unsigned symlink_length)
+  {
+    FreeStrings();
+    name_length_ = name_length;
+    symlink_length_ = symlink_length;
+    char *buffer = strings_.chars;
+    if (!IsInline()) {
+      strings_.heap =
+        reinterpret_cast<char *>(smalloc(name_length + symlink_length));
+      buffer = strings_.heap;
+    }
+    if (name_length > 0)
+      memcpy(buffer, name, name_length);
+    if (symlink_length > 0)
+      memcpy(buffer + name_length, symlink, symlink_length);
+  }
+
+  void Assign(const PackedDirent &other) {
+    const char *strings = other.GetStrings();
+    SetStrings(strings, other.name_length_,
+               strings + other.name_length_, other.symlink_length_);
+    catalog_ = other.catalog_;
+    inode_ = other.inode_;
+    parent_inode_ = other.parent_inode_;
+    hardlinks_ = other.hardlinks_;
+    size_ = other.size_;
+    mtime_ = other.mtime_;
+    cached_mtime_ = other.cached_mtime_;
+    mode_ = other.mode_;
+    uid_ = other.uid_;
+    gid_ = other.gid_;
+    memcpy(digest_, other.digest_, sizeof(digest_));
+    algorithm_ = other.algorithm_;
+    flags_ = other.flags_;
+  }
+
+  const Catalog *catalog_;
+  inode_t inode_;
+  inode_t parent_inode_;
+  uint64_t hardlinks_;
+  uint64_t size_;
+  int64_t mtime_;
+  int64_t cached_mtime_;
+  uint32_t mode_;
+  uint32_t uid_;
+  uint32_t gid_;
+  unsigned char digest_[hash::kMaxDigestSize];
+  uint16_t name_length_;
+  uint16_t symlink_length_;
+  uint8_t algorithm_;
+  uint8_t flags_;
+  union {
+    char chars[kInlineSize];
+    char *heap;
+  } strings_;
 };
 
+
 /**
  * Saves memory for large directory listings
  */
@@ -185,8 +439,37 @@ struct StatEntry {
   StatEntry(const NameString &n, const struct stat &i) : name(n), info(i) { }
 };
 
+/**
+ * Piece of a large file.  Chunked files are stored as a whole and in pieces,
+ * the pieces are listed in the chunks table of the catalog.
+ */
+struct FileChunk {
+  FileChunk() : offset(0), size(0) { }
+  FileChunk(const hash::Any &h, const off_t o, const size_t s) :
+    content_hash(h), offset(o), size(s) { }
+  hash::Any content_hash;
+  off_t offset;
+  size_t size;
+};
+
+/**
+ * Compressed object of a small file that is also published in a bundle.  The
+ * members of a bundle are stored back to back, the index is in the bundles
+ * table of the catalog.
+ */
+struct BundleMember {
+  BundleMember() : offset(0), size(0) { }
+  BundleMember(const hash::Any &h, const uint64_t o, const uint64_t s) :
+    content_hash(h), offset(o), size(s) { }
+  hash::Any content_hash;
+  uint64_t offset;  /**< in the bundle */
+  uint64_t size;  /**< compressed */
+};
+
 typedef std::vector<DirectoryEntry> DirectoryEntryList;
 typedef std::vector<StatEntry> StatEntryList;
+typedef std::vector<FileChunk> FileChunkList;
+typedef std::vector<BundleMember> BundleMemberList;
 
 } // namespace catalog
 
@@ -11,17 +11,34 @@
  * blocks but there is a separate I/O thread using asynchronous I/O, which
  * maintains all concurrent connections simultaneously.  As there might be more
  * than 1024 file descriptors for the CernVM-FS process, the I/O thread uses
- * poll and the libcurl multi socket interface.
+ * epoll (poll where epoll is not available) and the libcurl multi socket
+ * interface.  It sleeps until a socket is ready or curl's timer expires.
+ *
+ * Jobs are handed to the I/O thread through a lock-free queue.  A doorbell
+ * (an eventfd, if available, a pipe otherwise) wakes up the I/O thread when
+ * the queue turns non-empty.  The waiting thread blocks on the job's
+ * completion variable.  Hence a download costs at most one system call on top
+ * of the network I/O, and no file descriptors.
  *
  * While downloading, files can be decompressed and the secure hash can be
- * calculated on the fly.
+ * calculated on the fly.  For file destinations, this can be handed to a pool
+ * of pipeline threads, so that decompression does not limit all transfers to
+ * a single core.  The I/O thread waits for the pipeline if it falls behind.
  *
  * The module also implements failure handling.  If corrupted data has been
  * downloaded, the transfer is restarted using HTTP "no-cache" pragma.
  * A "host chain" can be configured.  When a host fails, there is automatic
  * fail-over to the next host in the chain until all hosts are probed.
  * Similarly a chain of proxy sets can be configured.  Inside a proxy set,
- * proxies are selected randomly (load-balancing set).
+ * proxies are selected randomly (load-balancing set).  Optionally, requests
+ * that did not receive a byte within a percentile of the recent latencies
+ * are hedged: a duplicate is sent to another proxy of the set, the first
+ * response wins and the other request is cancelled.
+ *
+ * Optionally, the addresses of the proxies and hosts are cached and
+ * refreshed by a background thread before they expire.  Curl gets them as
+ * pre-resolved entries, so that only the first request to an endpoint waits
+ * for name resolution.
  */
 
 //TODO: MS for time summing
@@ -36,15 +53,30 @@
 #include <pthread.h>
 #include <alloca.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
 
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <set>
+#include <vector>
 
 #include "duplex_curl.h"
 #include "logging.h"
@@ -53,9 +85,15 @@
 #include "util.h"
 #include "compression.h"
 #include "smalloc.h"
+#include "metrics.h"
 
 using namespace std;  // NOLINT
 
+// Multiplexing and the negotiated version of a transfer need libcurl 7.50
+#if defined(CURLPIPE_MULTIPLEX) && (LIBCURL_VERSION_NUM >= 0x073200)
+#define CVMFS_HTTP2_SUPPORT
+#endif
+
 namespace download {
 
 set<CURL *>  *pool_handles_idle_ = NULL;
@@ -69,30 +107,197 @@ pthread_t thread_download_;
 atomic_int32 multi_threaded_;
 int pipe_terminate_[2];
 
-int pipe_jobs_[2];
+JobInfo *queue_jobs_ = NULL;  /**< Submitted jobs, the last one first */
+int doorbell_[2];  /**< Both ends are the same eventfd, if supported */
+uint64_t curl_deadline_ms_ = 0;  /**< Set by curl's timer callback, 0 is none */
+#ifdef HAVE_SYS_EPOLL_H
+const int kMaxEpollEvents = 256;
+int epoll_fd_ = -1;
+struct epoll_event *epoll_events_ = NULL;
+#else
 struct pollfd *watch_fds_ = NULL;
 uint32_t watch_fds_size_ = 0;
 uint32_t watch_fds_inuse_ = 0;
+#endif
 uint32_t watch_fds_max_;
 
 pthread_mutex_t lock_options_ = PTHREAD_MUTEX_INITIALIZER;
 char *opt_dns_server_ = NULL;
+bool opt_http2_ = false;
+/**
+ * Proxies and hosts that answered an HTTP/2 request with HTTP/1, they are
+ * asked with HTTP/1.1 from then on
+ */
+set<string> *http1_endpoints_ = NULL;
 unsigned opt_timeout_proxy_ ;
 unsigned opt_timeout_direct_;
 vector<string> *opt_host_chain_ = NULL;
 vector<int> *opt_host_chain_rtt_ = NULL; /**< created by SetHostChain(),
   filled by probe_hosts.  Contains time to get .cvmfschecksum in ms.
   -1 is unprobed, -2 is error */
+vector<int> *opt_host_chain_speed_ = NULL;  /**< kB/s, -1 is unknown */
 unsigned opt_host_chain_current_;
+unsigned opt_host_probe_interval_;  /**< Seconds, 0 switches tracking off */
 vector< vector<string> > *opt_proxy_groups_ = NULL;
 unsigned opt_proxy_groups_current_;
 unsigned opt_proxy_groups_current_burned_;
 unsigned opt_num_proxies_;
+unsigned opt_hedge_percentile_;  /**< 0 switches hedging off */
+unsigned opt_breaker_threshold_;  /**< 0 switches the circuit breakers off */
+
+// Hedged requests, maintained by the I/O thread
+const unsigned kNumLatencySamples = 128;
+const unsigned kMinLatencySamples = 16;
+const uint64_t kMinHedgeDelayMs = 5;
+set<JobInfo *> *jobs_unanswered_ = NULL;  /**< Candidates for a hedge */
+vector<JobInfo *> *hedge_losers_ = NULL;  /**< Requests to cancel */
+uint32_t latency_samples_[kNumLatencySamples];  /**< Time to first byte, ms */
+unsigned num_latency_samples_ = 0;
+unsigned next_latency_sample_ = 0;
+uint64_t hedge_delay_ms_ = 0;  /**< 0 until there are enough samples */
+
+// Jobs by priority class, maintained by the I/O thread
+unsigned opt_priority_slots_[kNumPriorities];  /**< 0 is unlimited */
+deque<JobInfo *> *jobs_waiting_ = NULL;  /**< Array of kNumPriorities */
+unsigned jobs_active_[kNumPriorities];
+
+/**
+ * Received data on its way from the I/O thread to a pipeline worker
+ */
+struct DataChunk {
+  DataChunk(JobInfo *i, char *d, const size_t s) : info(i), data(d), size(s) { }
+  JobInfo *info;
+  char *data;
+  size_t size;
+};
+
+// Decompression and hashing of file downloads in worker threads.  A job
+// sticks to one worker, which keeps its chunks in order.
+const unsigned kMaxPipelineThreads = 64;
+const uint64_t kMaxPipelineBytes = 16*1024*1024;  /**< I/O thread waits above */
+unsigned opt_pipeline_threads_ = 0;
+vector<pthread_t> *pipeline_threads_ = NULL;
+vector< deque<DataChunk> > *pipeline_queues_ = NULL;
+pthread_cond_t *cond_pipeline_work_ = NULL;  /**< One per worker */
+pthread_cond_t cond_pipeline_done_ = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t lock_pipeline_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t pipeline_bytes_ = 0;
+unsigned pipeline_next_worker_ = 0;
+bool pipeline_terminate_ = false;
+
+// Background tracking of the host round trip times
+const int kHostHysteresisPercent = 20;  /**< Required gain to switch hosts */
+const int kHostMinGainMs = 10;
+const double kMinSpeedBytes = 64*1024;  /**< Smaller transfers are noise */
+pthread_t thread_host_probe_;
+bool host_probe_running_ = false;
+bool host_probe_terminate_ = false;
+pthread_mutex_t lock_host_probe_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_host_probe_ = PTHREAD_COND_INITIALIZER;
+
+// Circuit breakers for proxies that fail to connect
+const unsigned kDefaultBreakerThreshold = 3;
+const unsigned kMinBreakerBackoff = 30;  /**< Seconds */
+const unsigned kMaxBreakerBackoff = 600;
+
+/**
+ * Consecutive connection failures of a proxy.  Once there are
+ * opt_breaker_threshold_ of them, the breaker opens and the proxy is skipped
+ * until a background probe gets through.
+ */
+struct CircuitBreaker {
+  CircuitBreaker() : num_failures(0), open_until_ms(0), backoff(0) { }
+  unsigned num_failures;
+  uint64_t open_until_ms;  /**< Next probe, 0 if the breaker is closed */
+  unsigned backoff;  /**< Seconds */
+};
+map<string, CircuitBreaker> *breakers_ = NULL;  /**< Under lock_options_ */
+vector<string> *breakers_tripped_ = NULL;  /**< I/O thread aborts requests */
+pthread_t thread_proxy_probe_;
+bool proxy_probe_running_ = false;
+bool proxy_probe_terminate_ = false;
+bool proxy_probe_wakeup_ = false;
+pthread_mutex_t lock_proxy_probe_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_proxy_probe_ = PTHREAD_COND_INITIALIZER;
+
+// Resolver cache in front of curl's name resolution
+const unsigned kDnsExpireTtls = 10;  /**< Unused endpoints are dropped */
+
+/**
+ * Address of a proxy or host, resolved by the DNS refresh thread.  The
+ * refresh is due after 3/4 of the TTL, a failed refresh keeps the old
+ * address until it expires.
+ */
+struct DnsEntry {
+  DnsEntry() : port(0), is_proxy(false), refresh_ms(0), expires_ms(0),
+    last_used_ms(0) { }
+  string host;
+  unsigned port;
+  bool is_proxy;
+  vector<string> addresses;  /**< Empty until the first resolution */
+  uint64_t refresh_ms;  /**< 0 is as soon as possible */
+  uint64_t expires_ms;
+  uint64_t last_used_ms;
+};
+map<string, DnsEntry> *dns_cache_ = NULL;  /**< Keyed by endpoint */
+unsigned opt_dns_ttl_ = 0;  /**< Seconds, 0 if the cache is off */
+/**
+ * curl >= 7.59 takes several addresses per CURLOPT_RESOLVE entry and falls
+ * back to the next one if a connection fails.  Older versions take one.
+ */
+bool dns_multi_address_ = false;
+pthread_t thread_dns_refresh_;
+bool dns_refresh_running_ = false;
+bool dns_refresh_terminate_ = false;
+pthread_mutex_t lock_dns_cache_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_dns_cache_ = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Counters of the transfers through a proxy or from a host.  Every attempt
+ * counts, including the ones that lead to a fail-over.  Histogram bin i > 0
+ * covers [2^(i-1), 2^i).
+ */
+const unsigned kNumHistogramBins = 16;
+struct EndpointStatistics {
+  EndpointStatistics() : num_requests(0), num_bytes(0), num_resolves(0),
+    num_resolve_failures(0)
+  {
+    memset(num_failures, 0, sizeof(num_failures));
+    memset(ttfb_ms, 0, sizeof(ttfb_ms));
+    memset(throughput_kbs, 0, sizeof(throughput_kbs));
+    memset(resolve_ms, 0, sizeof(resolve_ms));
+  }
+  uint64_t num_requests;
+  uint64_t num_bytes;
+  uint64_t num_failures[kFailOther + 1];  /**< Indexed by Failures */
+  uint64_t ttfb_ms[kNumHistogramBins];
+  uint64_t throughput_kbs[kNumHistogramBins];
+  uint64_t num_resolves;  /**< By the DNS refresh thread */
+  uint64_t num_resolve_failures;
+  uint64_t resolve_ms[kNumHistogramBins];
+};
+pthread_mutex_t lock_endpoint_stats_ = PTHREAD_MUTEX_INITIALIZER;
+
+// Size-classed buffers for memory destinations, reused across jobs.  Class
+// i holds buffers of 2^i bytes.
+const unsigned kMinBufferClass = 12;  /**< 4 kB */
+const unsigned kMaxBufferClass = 23;  /**< 8 MB, larger buffers are freed */
+const uint64_t kMaxPoolBytes = 16*1024*1024;  /**< All size classes */
+vector<char *> *buffer_pool_ = NULL;  /**< Array of kMaxBufferClass+1 */
+uint64_t buffer_pool_bytes_ = 0;
+pthread_mutex_t lock_buffer_pool_ = PTHREAD_MUTEX_INITIALIZER;
+map<string, EndpointStatistics> *stats_proxies_ = NULL;
+map<string, EndpointStatistics> *stats_hosts_ = NULL;
 
 // Writes and reads should be atomic because reading happens in a different
 // thread than writing.
 double stat_transferred_bytes_;
 double stat_transfer_time_;
+atomic_int64 stat_hedges_fired_;
+atomic_int64 stat_hedges_won_;
+atomic_int64 stat_http2_requests_;  /**< Answered with HTTP/2 */
+atomic_int64 stat_dns_hits_;  /**< Requests with a cached address */
+atomic_int64 stat_dns_misses_;
 
 
 /**
@@ -124,6 +329,40 @@ static string EscapeUrl(const string &url) {
 }
 
 
+static uint64_t GetTimeMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return uint64_t(now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
+
+/**
+ * Replaces the @fqrn@ and @org@ placeholders of a host by the repository
+ * name (atlas.cern.ch) and its first part (atlas).
+ */
+static string ExpandHost(const string &host, const string *repository_name) {
+  if (!repository_name || (host.find('@') == string::npos))
+    return host;
+  const string org = repository_name->substr(0, repository_name->find('.'));
+  string result = host;
+  size_t pos;
+  while ((pos = result.find("@fqrn@")) != string::npos)
+    result.replace(pos, 6, *repository_name);
+  while ((pos = result.find("@org@")) != string::npos)
+    result.replace(pos, 5, org);
+  return result;
+}
+
+
+/**
+ * Checks if url was fetched from host.  For hosts with placeholders, only the
+ * part up to the first placeholder is compared.
+ */
+static bool IsFromHost(const string &url, const string &host) {
+  return HasPrefix(url, host.substr(0, host.find('@')), false);
+}
+
+
 /**
  * Switches to the next host in the chain.  If info is set, switch only if the
  * current host is identical to the one used by info, otherwise another transfer
@@ -142,8 +381,8 @@ void SwitchHost(JobInfo *info) {
     char *effective_url;
     curl_easy_getinfo(info->curl_handle, CURLINFO_EFFECTIVE_URL,
                       &effective_url);
-    if (!HasPrefix(string(effective_url),
-                   (*opt_host_chain_)[opt_host_chain_current_], false))
+    if (!IsFromHost(string(effective_url),
+                    (*opt_host_chain_)[opt_host_chain_current_]))
     {
       do_switch = false;
     }
@@ -165,26 +404,40 @@ void SwitchHost() {
 
 
 /**
- * Jumps to the next proxy in the ring of forward proxy servers.
- * Selects one randomly from a load-balancing group.
- *
- * If info is set, switch only if the current host is identical to the one used
- * by info, otherwise another transfer has already done the switch.
+ * True if the circuit breaker of the proxy is open and the proxy was not yet
+ * probed again.  Caller holds lock_options_.
  */
-static void SwitchProxy(JobInfo *info) {
-  pthread_mutex_lock(&lock_options_);
+static bool IsProxyBlocked(const string &proxy, const uint64_t now) {
+  map<string, CircuitBreaker>::const_iterator i = breakers_->find(proxy);
+  return (i != breakers_->end()) && (i->second.open_until_ms > now);
+}
 
-  if (!opt_proxy_groups_) {
-    pthread_mutex_unlock(&lock_options_);
-    return;
-  }
-  if (info &&
-      ((*opt_proxy_groups_)[opt_proxy_groups_current_][0] != info->proxy))
-  {
-    pthread_mutex_unlock(&lock_options_);
-    return;
+
+/**
+ * Picks a random proxy among the first num_candidates ones of the group.
+ * Blocked proxies are only picked if there is nothing else.  Caller holds
+ * lock_options_.
+ */
+static unsigned PickProxy(const vector<string> &group,
+                          const unsigned num_candidates)
+{
+  const uint64_t now = GetTimeMs();
+  vector<unsigned> unblocked;
+  for (unsigned i = 0; i < num_candidates; ++i) {
+    if (!IsProxyBlocked(group[i], now))
+      unblocked.push_back(i);
   }
+  if (unblocked.empty())
+    return random() % num_candidates;
+  return unblocked[random() % unblocked.size()];
+}
+
 
+/**
+ * Burns the active proxy and selects the next one.  Caller holds
+ * lock_options_.
+ */
+static void SelectNextProxy() {
   // If all proxies from the current load-balancing group are burned, switch to
   // another group
   if (opt_proxy_groups_current_burned_ ==
@@ -210,7 +463,8 @@ static void SwitchProxy(JobInfo *info) {
 
   // Select new one
   if ((group_size - opt_proxy_groups_current_burned_) > 0) {
-    int select = random() % (group_size - opt_proxy_groups_current_burned_ + 1);
+    int select = PickProxy(*group,
+                           group_size - opt_proxy_groups_current_burned_ + 1);
 
     // Move selected proxy to front
     const string swap = (*group)[select];
@@ -221,7 +475,31 @@ static void SwitchProxy(JobInfo *info) {
   LogCvmfs(kLogDownload, kLogDebug, "switched to proxy %s, %d remaining in "
            "the group",
            (*group)[0].c_str(), group_size - opt_proxy_groups_current_burned_);
+}
+
+
+/**
+ * Jumps to the next proxy in the ring of forward proxy servers.
+ * Selects one randomly from a load-balancing group.
+ *
+ * If info is set, switch only if the current host is identical to the one used
+ * by info, otherwise another transfer has already done the switch.
+ */
+static void SwitchProxy(JobInfo *info) {
+  pthread_mutex_lock(&lock_options_);
+
+  if (!opt_proxy_groups_) {
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
+  if (info &&
+      ((*opt_proxy_groups_)[opt_proxy_groups_current_][0] != info->proxy))
+  {
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
 
+  SelectNextProxy();
   pthread_mutex_unlock(&lock_options_);
 }
 
@@ -240,7 +518,7 @@ void RebalanceProxies() {
 
   opt_proxy_groups_current_burned_ = 0;
   vector<string> *group = &((*opt_proxy_groups_)[opt_proxy_groups_current_]);
-  int select = random() % group->size();
+  int select = PickProxy(*group, group->size());
   const string swap = (*group)[select];
   (*group)[select] = (*group)[0];
   (*group)[0] = swap;
@@ -269,14 +547,241 @@ void SwitchProxyGroup() {
 
 
 /**
- * Called by curl for every HTTP header. Not called for file:// transfers.
+ * Takes a buffer of at least size bytes from the pool or allocates one.
  */
-static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
-                                 void *info_link)
+static char *GetBuffer(const size_t size, size_t *capacity) {
+  unsigned size_class = kMinBufferClass;
+  while ((size_class <= kMaxBufferClass) && ((size_t(1) << size_class) < size))
+    size_class++;
+  if (size_class > kMaxBufferClass) {
+    *capacity = size;
+    return static_cast<char *>(smalloc(size));
+  }
+
+  *capacity = size_t(1) << size_class;
+  pthread_mutex_lock(&lock_buffer_pool_);
+  if (buffer_pool_ && !buffer_pool_[size_class].empty()) {
+    char *buffer = buffer_pool_[size_class].back();
+    buffer_pool_[size_class].pop_back();
+    buffer_pool_bytes_ -= *capacity;
+    pthread_mutex_unlock(&lock_buffer_pool_);
+    return buffer;
+  }
+  pthread_mutex_unlock(&lock_buffer_pool_);
+  return static_cast<char *>(smalloc(*capacity));
+}
+
+
+/**
+ * Returns a buffer of GetBuffer() to the pool, or frees it if the pool is
+ * full.
+ */
+static void PutBuffer(char *buffer, const size_t capacity) {
+  if (buffer == NULL)
+    return;
+  unsigned size_class = kMinBufferClass;
+  while ((size_class <= kMaxBufferClass) &&
+         ((size_t(1) << size_class) != capacity))
+  {
+    size_class++;
+  }
+  pthread_mutex_lock(&lock_buffer_pool_);
+  if (buffer_pool_ && (size_class <= kMaxBufferClass) &&
+      (buffer_pool_bytes_ + capacity <= kMaxPoolBytes))
+  {
+    buffer_pool_[size_class].push_back(buffer);
+    buffer_pool_bytes_ += capacity;
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&lock_buffer_pool_);
+  free(buffer);
+}
+
+
+/**
+ * Grows the memory destination to at least size bytes, keeping its content.
+ */
+static void ReserveMem(JobInfo *info, const size_t size) {
+  if (size <= info->destination_mem.capacity)
+    return;
+  size_t capacity;
+  char *buffer = GetBuffer(max(size, 2 * info->destination_mem.capacity),
+                           &capacity);
+  if (info->destination_mem.pos > 0) {
+    memcpy(buffer, info->destination_mem.data, info->destination_mem.pos);
+  }
+  PutBuffer(info->destination_mem.data, info->destination_mem.capacity);
+  info->destination_mem.data = buffer;
+  info->destination_mem.capacity = capacity;
+}
+
+
+/**
+ * Empties the memory destination.  Its buffer has to be released before.
+ */
+static void ResetMem(JobInfo *info) {
+  info->destination_mem.data = NULL;
+  info->destination_mem.capacity = 0;
+  info->destination_mem.size = 0;
+  info->destination_mem.pos = 0;
+}
+
+
+static bool AppendToMem(const void *buf, const size_t size, void *ctx) {
+  JobInfo *info = reinterpret_cast<JobInfo *>(ctx);
+  ReserveMem(info, info->destination_mem.pos + size);
+  memcpy(info->destination_mem.data + info->destination_mem.pos, buf, size);
+  info->destination_mem.pos += size;
+  return true;
+}
+
+
+/**
+ * Inflates received data into the memory destination, growing it as needed.
+ * Data after the end of the compressed stream is ignored.  Zlib streams are
+ * inflated in place, other codecs go through an intermediate buffer.
+ */
+static bool InflateToMem(JobInfo *info, const void *ptr,
+                         const size_t num_bytes)
+{
+  zlib::DecompressDetect(&info->zstream, ptr, num_bytes);
+  if (info->zstream.algorithm != zlib::kZlibDefault) {
+    const zlib::StreamStates state =
+      zlib::DecompressStream2Sink(&info->zstream, ptr, num_bytes,
+                                  AppendToMem, info);
+    if (state == zlib::kStreamEnd)
+      info->zstream_end = true;
+    return state != zlib::kStreamError;
+  }
+  if (!info->zstream.detected)
+    return true;
+
+  z_stream *strm = info->zstream.zstream;
+  strm->next_in = static_cast<Bytef *>(const_cast<void *>(ptr));
+  strm->avail_in = num_bytes;
+  while ((strm->avail_in > 0) && !info->zstream_end) {
+    if (info->destination_mem.pos == info->destination_mem.capacity)
+      ReserveMem(info, info->destination_mem.pos + 1);
+    strm->next_out = reinterpret_cast<Bytef *>(info->destination_mem.data +
+                                               info->destination_mem.pos);
+    strm->avail_out = info->destination_mem.capacity -
+                      info->destination_mem.pos;
+    const int z_ret = inflate(strm, Z_NO_FLUSH);
+    info->destination_mem.pos = info->destination_mem.capacity -
+                                strm->avail_out;
+    if (z_ret == Z_STREAM_END)
+      info->zstream_end = true;
+    else if (z_ret != Z_OK)
+      return false;
+  }
+  return true;
+}
+
+
+/**
+ * The delay after which a request without response gets a duplicate, 0 if
+ * hedging is switched off or if there are not yet enough latency samples.
+ */
+static uint64_t GetHedgeDelay() {
+  pthread_mutex_lock(&lock_options_);
+  const unsigned percentile = opt_hedge_percentile_;
+  pthread_mutex_unlock(&lock_options_);
+  return (percentile == 0) ? 0 : hedge_delay_ms_;
+}
+
+
+/**
+ * Records the time to the first byte of a request and updates the hedge
+ * delay to the configured percentile of the recent samples.
+ */
+static void RecordLatency(const uint64_t latency_ms) {
+  latency_samples_[next_latency_sample_] = latency_ms;
+  next_latency_sample_ = (next_latency_sample_ + 1) % kNumLatencySamples;
+  if (num_latency_samples_ < kNumLatencySamples)
+    num_latency_samples_++;
+
+  pthread_mutex_lock(&lock_options_);
+  const unsigned percentile = opt_hedge_percentile_;
+  pthread_mutex_unlock(&lock_options_);
+  if ((percentile == 0) || (num_latency_samples_ < kMinLatencySamples))
+    return;
+
+  vector<uint32_t> samples(latency_samples_,
+                           latency_samples_ + num_latency_samples_);
+  const unsigned rank = num_latency_samples_ * percentile / 100;
+  nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  hedge_delay_ms_ = max(uint64_t(samples[rank]), kMinHedgeDelayMs);
+}
+
+
+/**
+ * Decides the race between a request and its duplicate.  The loser is
+ * cancelled by the I/O thread outside the curl callbacks.  The winner becomes
+ * the job's curl handle.
+ */
+static void DecideHedge(JobInfo *info, const bool hedge_wins) {
+  if (hedge_wins) {
+    info->hedge_state = kHedgeWon;
+    swap(info->curl_handle, info->hedge_handle);
+    swap(info->proxy, info->hedge_proxy);
+    atomic_inc64(&stat_hedges_won_);
+  } else {
+    info->hedge_state = kHedgeLost;
+  }
+  hedge_losers_->push_back(info);
+}
+
+
+/**
+ * Called for every piece of a response, either on the original request or on
+ * its duplicate.  The first response wins.
+ *
+ * \return true if the caller's response is the one to process
+ */
+static bool ClaimResponse(JobInfo *info, const bool from_hedge) {
+  if (!info->first_byte) {
+    info->first_byte = true;
+    RecordLatency(GetTimeMs() - info->time_start_ms);
+    jobs_unanswered_->erase(info);
+  }
+  if (info->hedge_state == kHedgeRacing)
+    DecideHedge(info, from_hedge);
+  return from_hedge == (info->hedge_state == kHedgeWon);
+}
+
+
+/**
+ * A job fetches a byte range if the caller asked for one or if a broken
+ * transfer is resumed.  The range ends at the end of the object unless
+ * range_size is set.
+ */
+static inline bool IsRangeRequest(const JobInfo *info) {
+  return (info->range_size > 0) || (info->range_offset > 0) ||
+         (info->resume_offset > 0);
+}
+
+static inline uint64_t GetRangeBegin(const JobInfo *info) {
+  return info->range_offset + info->resume_offset;
+}
+
+/**
+ * \return The first byte behind the range
+ */
+static inline uint64_t GetRangeEnd(const JobInfo *info) {
+  return (info->range_size > 0) ?
+         info->range_offset + info->range_size : uint64_t(-1);
+}
+
+
+/**
+ * Processes an HTTP header. Not called for file:// transfers.
+ */
+static size_t ReceiveHeader(void *ptr, const size_t num_bytes, JobInfo *info,
+                            const bool from_hedge)
 {
-  const size_t num_bytes = size*nmemb;
+  if (!ClaimResponse(info, from_hedge))
+    return 0;
   const string header_line(static_cast<const char *>(ptr), num_bytes);
-  JobInfo *info = static_cast<JobInfo *>(info_link);
 
   //LogCvmfs(kLogDownload, kLogDebug, "REMOVE-ME: Header callback with line %s",
   //         header_line.c_str());
@@ -290,6 +795,13 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
     for (i = 8; (i < header_line.length()) && (header_line[i] == ' '); ++i) {}
 
     if (header_line[i] == '2') {
+      // A server without range support sends the whole object
+      if (IsRangeRequest(info) && (header_line.compare(i, 3, "206") != 0))
+        info->range_emulated = true;
+      return num_bytes;
+    } else if (info->conditional && (info->if_modified_since > 0) &&
+               (header_line.compare(i, 3, "304") == 0))
+    {
       return num_bytes;
     } else {
       LogCvmfs(kLogDownload, kLogDebug, "http status error code: %s",
@@ -308,11 +820,14 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
     char *tmp = (char *)alloca(num_bytes+1);
     uint64_t length = 0;
     sscanf(header_line.c_str(), "%s %"PRIu64, tmp, &length);
+    if (info->range_emulated) {
+      const uint64_t begin = GetRangeBegin(info);
+      length = (length > begin) ?
+               min(length, GetRangeEnd(info)) - begin : 0;
+    }
+    // Compressed objects grow on demand while they are inflated
     if (length > 0)
-      info->destination_mem.data = static_cast<char *>(smalloc(length));
-    else
-      info->destination_mem.data = NULL;
-    info->destination_mem.size = length;
+      ReserveMem(info, info->compressed ? 2*length : length);
   }
 
   return num_bytes;
@@ -320,107 +835,385 @@ static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
 
 
 /**
- * Called by curl for every received data chunk.
+ * Hashes and writes (decompresses) received data to the destination file.
  */
-static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
-                               void *info_link)
+static Failures WriteToFile(JobInfo *info, const void *ptr,
+                            const size_t num_bytes)
 {
-  const size_t num_bytes = size*nmemb;
-  JobInfo *info = static_cast<JobInfo *>(info_link);
-
-  //LogCvmfs(kLogDownload, kLogDebug, "Data callback with %d bytes", num_bytes);
-
-  if (num_bytes == 0)
-    return 0;
-
   if (info->expected_hash)
     hash::Update((unsigned char *)ptr, num_bytes, info->hash_context);
 
-  if (info->destination == kDestinationMem) {
-    // Write to memory
-    if (info->destination_mem.pos + num_bytes > info->destination_mem.size)
-      return 0;
-    memcpy(info->destination_mem.data + info->destination_mem.pos,
-           ptr, num_bytes);
-    info->destination_mem.pos += num_bytes;
-  } else {
-    // Write to file
-    if (info->compressed) {
-      //LogCvmfs(kLogDownload, kLogDebug, "REMOVE-ME: writing %d bytes for %s",
-      //         num_bytes, info->url->c_str());
-      bool retval = zlib::DecompressZStream2File(&info->zstream,
-                                                 info->destination_file,
-                                                 ptr, num_bytes);
-      if (!retval) {
-        LogCvmfs(kLogDownload, kLogDebug, "failed to decompress %s",
-                 info->url->c_str());
-        info->error_code = kFailBadData;
-        return 0;
-      }
-    } else {
-      if (fwrite(ptr, 1, num_bytes, info->destination_file) != num_bytes) {
-        info->error_code = kFailLocalIO;
-        return 0;
-      }
+  if (info->compressed) {
+    //LogCvmfs(kLogDownload, kLogDebug, "REMOVE-ME: writing %d bytes for %s",
+    //         num_bytes, info->url->c_str());
+    bool retval = zlib::DecompressStream2File(&info->zstream,
+                                              info->destination_file,
+                                              ptr, num_bytes);
+    if (!retval) {
+      LogCvmfs(kLogDownload, kLogDebug, "failed to decompress %s",
+               info->url->c_str());
+      return kFailBadData;
     }
+  } else {
+    if (fwrite(ptr, 1, num_bytes, info->destination_file) != num_bytes)
+      return kFailLocalIO;
   }
-
-  return num_bytes;
+  if (info->progress_callback) {
+    if (fflush(info->destination_file) != 0)
+      return kFailLocalIO;
+    info->progress_callback(info->progress_ctx,
+                            ftell(info->destination_file));
+  }
+  return kFailOk;
 }
 
 
 /**
- * Gets an idle CURL handle from the pool. Creates a new one and adds it to
- * the pool if necessary.
+ * Pipeline worker: decompresses and hashes the data chunks of its jobs.
  */
-static CURL *AcquireCurlHandle() {
-  CURL *handle;
+static void *MainPipeline(void *data) {
+  const unsigned id = static_cast<unsigned>(reinterpret_cast<uintptr_t>(data));
+  deque<DataChunk> *queue = &(*pipeline_queues_)[id];
+  LogCvmfs(kLogDownload, kLogDebug, "download pipeline thread %u started", id);
 
-  if (pool_handles_idle_->empty()) {
-    // Create a new handle
-    handle = curl_easy_init();
-    assert(handle != NULL);
+  pthread_mutex_lock(&lock_pipeline_);
+  while (true) {
+    while (queue->empty() && !pipeline_terminate_)
+      pthread_cond_wait(&cond_pipeline_work_[id], &lock_pipeline_);
+    if (queue->empty())
+      break;
+    const DataChunk chunk = queue->front();
+    queue->pop_front();
+    // Data after an error is dropped, the transfer gets aborted anyway
+    const bool skip = (chunk.info->error_code != kFailOk);
+    pthread_mutex_unlock(&lock_pipeline_);
+
+    const Failures result = skip ? kFailOk :
+                            WriteToFile(chunk.info, chunk.data, chunk.size);
+    free(chunk.data);
+
+    pthread_mutex_lock(&lock_pipeline_);
+    if (result != kFailOk)
+      chunk.info->error_code = result;
+    chunk.info->pipeline_pending--;
+    pipeline_bytes_ -= chunk.size;
+    pthread_cond_broadcast(&cond_pipeline_done_);
+  }
+  pthread_mutex_unlock(&lock_pipeline_);
 
-    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
-    //curl_easy_setopt(curl_default, CURLOPT_FAILONERROR, 1);
-    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 100);
-    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, CallbackCurlHeader);
-    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CallbackCurlData);
-  } else {
-    handle = *(pool_handles_idle_->begin());
-    pool_handles_idle_->erase(pool_handles_idle_->begin());
+  LogCvmfs(kLogDownload, kLogDebug, "download pipeline thread %u stopped", id);
+  return NULL;
+}
+
+
+/**
+ * Hands received data of the I/O thread to the job's pipeline worker.  If the
+ * workers fall behind, the I/O thread waits.
+ *
+ * \return false if a previous chunk of the job failed
+ */
+static bool QueueData(JobInfo *info, const void *ptr, const size_t num_bytes) {
+  char *data = static_cast<char *>(smalloc(num_bytes));
+  memcpy(data, ptr, num_bytes);
+
+  pthread_mutex_lock(&lock_pipeline_);
+  while ((pipeline_bytes_ > 0) &&
+         (pipeline_bytes_ + num_bytes > kMaxPipelineBytes) &&
+         (info->error_code == kFailOk))
+  {
+    pthread_cond_wait(&cond_pipeline_done_, &lock_pipeline_);
+  }
+  if (info->error_code != kFailOk) {
+    pthread_mutex_unlock(&lock_pipeline_);
+    free(data);
+    return false;
+  }
+  if (info->pipeline_worker < 0) {
+    info->pipeline_worker = pipeline_next_worker_;
+    pipeline_next_worker_ = (pipeline_next_worker_ + 1) %
+                            pipeline_threads_->size();
   }
+  (*pipeline_queues_)[info->pipeline_worker].push_back(
+    DataChunk(info, data, num_bytes));
+  info->pipeline_pending++;
+  pipeline_bytes_ += num_bytes;
+  pthread_cond_signal(&cond_pipeline_work_[info->pipeline_worker]);
+  pthread_mutex_unlock(&lock_pipeline_);
+  return true;
+}
 
-  pool_handles_inuse_->insert(handle);
 
-  return handle;
+/**
+ * Waits until the pipeline worker is done with all the data of a job, so that
+ * the hash and the destination file are complete.
+ */
+static void DrainPipeline(JobInfo *info) {
+  if (!pipeline_threads_)
+    return;
+  pthread_mutex_lock(&lock_pipeline_);
+  while (info->pipeline_pending > 0)
+    pthread_cond_wait(&cond_pipeline_done_, &lock_pipeline_);
+  info->pipeline_worker = -1;
+  pthread_mutex_unlock(&lock_pipeline_);
 }
 
 
-static void ReleaseCurlHandle(CURL *handle) {
-  set<CURL *>::iterator elem = pool_handles_inuse_->find(handle);
-  assert(elem != pool_handles_inuse_->end());
+static void StartPipeline() {
+  if (opt_pipeline_threads_ == 0)
+    return;
+  pipeline_terminate_ = false;
+  pipeline_bytes_ = 0;
+  pipeline_next_worker_ = 0;
+  pipeline_queues_ = new vector< deque<DataChunk> >(opt_pipeline_threads_);
+  cond_pipeline_work_ = reinterpret_cast<pthread_cond_t *>(
+    smalloc(opt_pipeline_threads_ * sizeof(pthread_cond_t)));
+  pipeline_threads_ = new vector<pthread_t>(opt_pipeline_threads_);
+  for (unsigned i = 0; i < opt_pipeline_threads_; ++i) {
+    int retval = pthread_cond_init(&cond_pipeline_work_[i], NULL);
+    assert(retval == 0);
+    retval = pthread_create(&(*pipeline_threads_)[i], NULL, MainPipeline,
+                            reinterpret_cast<void *>(uintptr_t(i)));
+    assert(retval == 0);
+  }
+}
 
-  if (pool_handles_idle_->size() > pool_max_handles_)
-    curl_easy_cleanup(*elem);
-  else
-    pool_handles_idle_->insert(*elem);
 
-  pool_handles_inuse_->erase(elem);
+/**
+ * Runs after the I/O thread is gone, so no new data arrives.
+ */
+static void StopPipeline() {
+  if (!pipeline_threads_)
+    return;
+  pthread_mutex_lock(&lock_pipeline_);
+  pipeline_terminate_ = true;
+  for (unsigned i = 0; i < pipeline_threads_->size(); ++i)
+    pthread_cond_signal(&cond_pipeline_work_[i]);
+  pthread_mutex_unlock(&lock_pipeline_);
+  for (unsigned i = 0; i < pipeline_threads_->size(); ++i) {
+    pthread_join((*pipeline_threads_)[i], NULL);
+    pthread_cond_destroy(&cond_pipeline_work_[i]);
+  }
+  free(cond_pipeline_work_);
+  delete pipeline_queues_;
+  delete pipeline_threads_;
+  cond_pipeline_work_ = NULL;
+  pipeline_queues_ = NULL;
+  pipeline_threads_ = NULL;
 }
 
 
 /**
- * Request parameters set the URL and other options such as timeout and
- * proxy.
+ * Processes a received data chunk.
  */
-static void InitializeRequest(JobInfo *info, CURL *handle) {
+static size_t ReceiveData(void *ptr, const size_t num_received, JobInfo *info,
+                          const bool from_hedge)
+{
+  //LogCvmfs(kLogDownload, kLogDebug, "Data callback with %d bytes",
+  //         num_received);
+
+  if (num_received == 0)
+    return 0;
+  if (!ClaimResponse(info, from_hedge))
+    return 0;
+
+  size_t num_bytes = num_received;
+  if (info->range_emulated) {
+    // Cut the requested range out of the whole object
+    const uint64_t begin = info->range_pos;
+    const uint64_t end = begin + num_received;
+    const uint64_t range_begin = GetRangeBegin(info);
+    const uint64_t range_end = GetRangeEnd(info);
+    info->range_pos = end;
+    if ((end <= range_begin) || (begin >= range_end))
+      return num_received;
+    const uint64_t skip = (begin < range_begin) ? range_begin - begin : 0;
+    ptr = static_cast<char *>(ptr) + skip;
+    num_bytes = min(end, range_end) - begin - skip;
+  }
+  info->range_received += num_bytes;
+
+  if (info->destination == kDestinationMem) {
+    // Write to memory
+    if (info->expected_hash)
+      hash::Update((unsigned char *)ptr, num_bytes, info->hash_context);
+    if (info->compressed) {
+      if (!InflateToMem(info, ptr, num_bytes)) {
+        LogCvmfs(kLogDownload, kLogDebug, "failed to decompress %s",
+                 info->url->c_str());
+        info->error_code = kFailBadData;
+        return 0;
+      }
+    } else {
+      ReserveMem(info, info->destination_mem.pos + num_bytes);
+      memcpy(info->destination_mem.data + info->destination_mem.pos,
+             ptr, num_bytes);
+      info->destination_mem.pos += num_bytes;
+    }
+  } else if (pipeline_threads_) {
+    if (!QueueData(info, ptr, num_bytes))
+      return 0;
+  } else {
+    const Failures result = WriteToFile(info, ptr, num_bytes);
+    if (result != kFailOk) {
+      info->error_code = result;
+      return 0;
+    }
+  }
+
+  return num_received;
+}
+
+
+/**
+ * Called by curl for every HTTP header of a request.
+ */
+static size_t CallbackCurlHeader(void *ptr, size_t size, size_t nmemb,
+                                 void *info_link)
+{
+  return ReceiveHeader(ptr, size*nmemb, static_cast<JobInfo *>(info_link),
+                       false);
+}
+
+
+/**
+ * Called by curl for every received data chunk of a request.
+ */
+static size_t CallbackCurlData(void *ptr, size_t size, size_t nmemb,
+                               void *info_link)
+{
+  return ReceiveData(ptr, size*nmemb, static_cast<JobInfo *>(info_link),
+                     false);
+}
+
+
+/**
+ * Like CallbackCurlHeader for the duplicate of a hedged request.
+ */
+static size_t CallbackHedgeHeader(void *ptr, size_t size, size_t nmemb,
+                                  void *info_link)
+{
+  return ReceiveHeader(ptr, size*nmemb, static_cast<JobInfo *>(info_link),
+                       true);
+}
+
+
+/**
+ * Like CallbackCurlData for the duplicate of a hedged request.
+ */
+static size_t CallbackHedgeData(void *ptr, size_t size, size_t nmemb,
+                                void *info_link)
+{
+  return ReceiveData(ptr, size*nmemb, static_cast<JobInfo *>(info_link),
+                     true);
+}
+
+
+/**
+ * Gets an idle CURL handle from the pool. Creates a new one and adds it to
+ * the pool if necessary.
+ */
+static CURL *AcquireCurlHandle() {
+  CURL *handle;
+
+  if (pool_handles_idle_->empty()) {
+    // Create a new handle
+    handle = curl_easy_init();
+    assert(handle != NULL);
+
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
+    //curl_easy_setopt(curl_default, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 100);
+  } else {
+    handle = *(pool_handles_idle_->begin());
+    pool_handles_idle_->erase(pool_handles_idle_->begin());
+  }
+
+  pool_handles_inuse_->insert(handle);
+
+  return handle;
+}
+
+
+static void ReleaseCurlHandle(CURL *handle) {
+  set<CURL *>::iterator elem = pool_handles_inuse_->find(handle);
+  assert(elem != pool_handles_inuse_->end());
+
+  if (pool_handles_idle_->size() > pool_max_handles_)
+    curl_easy_cleanup(*elem);
+  else
+    pool_handles_idle_->insert(*elem);
+
+  pool_handles_inuse_->erase(elem);
+}
+
+
+static void SetRangeOptions(JobInfo *info, CURL *handle) {
+  if (!IsRangeRequest(info)) {
+    curl_easy_setopt(handle, CURLOPT_RANGE, NULL);
+    return;
+  }
+  string range = StringifyInt(GetRangeBegin(info)) + "-";
+  if (info->range_size > 0)
+    range += StringifyInt(GetRangeEnd(info) - 1);
+  curl_easy_setopt(handle, CURLOPT_RANGE, range.c_str());
+}
+
+
+/**
+ * Connects a curl handle to a job.  The duplicate of a hedged request uses
+ * its own callbacks.
+ */
+static void SetRequestOptions(JobInfo *info, CURL *handle, const bool hedge) {
+  curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION,
+                   hedge ? CallbackHedgeHeader : CallbackCurlHeader);
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
+                   hedge ? CallbackHedgeData : CallbackCurlData);
+  curl_easy_setopt(handle, CURLOPT_PRIVATE, static_cast<void *>(info));
+  curl_easy_setopt(handle, CURLOPT_WRITEHEADER,
+                   static_cast<void *>(info));
+  curl_easy_setopt(handle, CURLOPT_WRITEDATA, static_cast<void *>(info));
+  curl_easy_setopt(handle, CURLOPT_HTTPHEADER,
+                   info->nocache ? http_headers_nocache_ : http_headers_);
+  SetRangeOptions(info, handle);
+  if (info->head_request)
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 1);
+  else
+    curl_easy_setopt(handle, CURLOPT_HTTPGET, 1);
+  curl_easy_setopt(handle, CURLOPT_FILETIME, info->conditional ? 1L : 0L);
+  if (info->conditional && (info->if_modified_since > 0)) {
+    curl_easy_setopt(handle, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
+    curl_easy_setopt(handle, CURLOPT_TIMEVALUE,
+                     static_cast<long>(info->if_modified_since));
+  } else {
+    curl_easy_setopt(handle, CURLOPT_TIMECONDITION, CURL_TIMECOND_NONE);
+  }
+}
+
+
+/**
+ * Request parameters set the URL and other options such as timeout and
+ * proxy.
+ */
+static void InitializeRequest(JobInfo *info, CURL *handle) {
   // Initialize internal download state
   info->curl_handle = handle;
   info->error_code = kFailOk;
   info->nocache = false;
   info->num_failed_proxies = 0;
   info->num_failed_hosts = 0;
+  info->hedge_handle = NULL;
+  info->hedge_state = kHedgeOff;
+  info->time_start_ms = GetTimeMs();
+  info->first_byte = false;
+  info->range_emulated = false;
+  info->range_pos = 0;
+  info->range_received = 0;
+  info->resume_offset = 0;
+  info->pipeline_worker = -1;
+  info->pipeline_pending = 0;
+  info->zstream_end = false;
+  info->last_modified = 0;
+  info->not_modified = false;
   if (info->compressed) {
     zlib::DecompressInit(&(info->zstream));
   }
@@ -429,34 +1222,154 @@ static void InitializeRequest(JobInfo *info, CURL *handle) {
     hash::Init(info->hash_context);
   }
 
-  if ((info->destination == kDestinationMem) &&
-      (HasPrefix(*(info->url), "file://", false)))
-  {
-    info->destination_mem.size = 64*1024;
-    info->destination_mem.data = static_cast<char *>(smalloc(64*1024));
-  }
+  SetRequestOptions(info, handle, false);
+}
 
-  // Set curl parameters
-  curl_easy_setopt(handle, CURLOPT_PRIVATE, static_cast<void *>(info));
-  curl_easy_setopt(handle, CURLOPT_WRITEHEADER,
-                   static_cast<void *>(info));
-  curl_easy_setopt(handle, CURLOPT_WRITEDATA, static_cast<void *>(info));
-  curl_easy_setopt(handle, CURLOPT_HTTPHEADER, http_headers_);
-  if (info->head_request)
-    curl_easy_setopt(handle, CURLOPT_NOBODY, 1);
-  else
-    curl_easy_setopt(handle, CURLOPT_HTTPGET, 1);
+
+/**
+ * The scheme, host and port part of a URL.
+ */
+static string GetUrlEndpoint(const string &url) {
+  const size_t pos_scheme = url.find("://");
+  if (pos_scheme == string::npos)
+    return url;
+  return url.substr(0, url.find('/', pos_scheme + 3));
+}
+
+
+/**
+ * With HTTP/2, concurrent requests to the same proxy or host share a
+ * multiplexed connection.  Endpoints that answered with HTTP/1 before, such
+ * as plain HTTP proxies, are asked with HTTP/1.1.  lock_options_ has to be
+ * held.
+ */
+static void SetHttpVersion(CURL *handle, const string &endpoint) {
+#ifdef CVMFS_HTTP2_SUPPORT
+  const bool http2 =
+    opt_http2_ && (http1_endpoints_->find(endpoint) == http1_endpoints_->end());
+  curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,
+                   http2 ? CURL_HTTP_VERSION_2_0 : CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt(handle, CURLOPT_PIPEWAIT, http2 ? 1L : 0L);
+#endif
 }
 
 
 /**
  * Sets the URL specific options such as host to use and timeout.
  */
+/**
+ * Splits an endpoint such as http://host:port or, for proxies, host:port into
+ * host and port.  Fails for IP addresses, which need no resolution, and for
+ * endpoints that are not HTTP.
+ */
+static bool ParseEndpoint(const string &endpoint, const bool is_proxy,
+                          string *host, unsigned *port)
+{
+  string rest = endpoint;
+  unsigned default_port = is_proxy ? 1080 : 80;
+  const size_t pos_scheme = rest.find("://");
+  if (pos_scheme != string::npos) {
+    const string scheme = rest.substr(0, pos_scheme);
+    if (!is_proxy && (scheme == "https"))
+      default_port = 443;
+    else if (scheme != "http")
+      return false;
+    rest = rest.substr(pos_scheme + 3);
+  }
+  if (rest.empty() || (rest[0] == '[') || (rest.find('@') != string::npos))
+    return false;
+  const size_t pos_port = rest.find(':');
+  *host = rest.substr(0, pos_port);
+  *port = (pos_port == string::npos) ?
+          default_port : String2Uint64(rest.substr(pos_port + 1));
+  struct in_addr addr;
+  return !host->empty() && (*port > 0) && (*port < 65536) &&
+         (inet_pton(AF_INET, host->c_str(), &addr) != 1);
+}
+
+
+/**
+ * Hands the cached addresses of the proxy or host to curl.  Unknown endpoints
+ * are queued for the DNS refresh thread, until then curl resolves them
+ * itself.  With an explicit DNS server, curl always resolves.  lock_options_
+ * has to be held.
+ *
+ * Entries given by CURLOPT_RESOLVE stay in the DNS cache of the reused curl
+ * handle and are not replaced by a later entry for the same host and port.
+ * Therefore the old entry is always removed first ("-host:port"), so that a
+ * refreshed or expired address does not linger.
+ */
+static void SetResolveOptions(JobInfo *info, const string &endpoint,
+                              const bool is_proxy)
+{
+  curl_easy_setopt(info->curl_handle, CURLOPT_RESOLVE, NULL);
+  curl_slist_free_all(info->resolve_list);
+  info->resolve_list = NULL;
+  string host;
+  unsigned port;
+  if ((opt_dns_ttl_ == 0) || opt_dns_server_ ||
+      !ParseEndpoint(endpoint, is_proxy, &host, &port))
+  {
+    return;
+  }
+
+  const uint64_t now = GetTimeMs();
+  vector<string> addresses;
+  pthread_mutex_lock(&lock_dns_cache_);
+  map<string, DnsEntry>::iterator i = dns_cache_->find(endpoint);
+  if (i == dns_cache_->end()) {
+    DnsEntry entry;
+    entry.host = host;
+    entry.port = port;
+    entry.is_proxy = is_proxy;
+    i = dns_cache_->insert(make_pair(endpoint, entry)).first;
+    pthread_cond_signal(&cond_dns_cache_);
+  }
+  i->second.last_used_ms = now;
+  if (i->second.expires_ms > now)
+    addresses = i->second.addresses;
+  pthread_mutex_unlock(&lock_dns_cache_);
+
+  const string host_port = host + ":" + StringifyInt(port);
+  info->resolve_list = curl_slist_append(NULL, ("-" + host_port).c_str());
+  if (addresses.empty()) {
+    atomic_inc64(&stat_dns_misses_);
+  } else {
+    atomic_inc64(&stat_dns_hits_);
+    string resolve = host_port + ":";
+    if (dns_multi_address_) {
+      for (unsigned j = 0; j < addresses.size(); ++j) {
+        if (j > 0)
+          resolve += ",";
+        if (addresses[j].find(':') != string::npos)
+          resolve += "[" + addresses[j] + "]";
+        else
+          resolve += addresses[j];
+      }
+    } else {
+      resolve += addresses[0];
+    }
+    info->resolve_list = curl_slist_append(info->resolve_list, resolve.c_str());
+  }
+  curl_easy_setopt(info->curl_handle, CURLOPT_RESOLVE, info->resolve_list);
+}
+
+
 static void SetUrlOptions(JobInfo *info) {
   CURL *curl_handle = info->curl_handle;
   string url_prefix;
 
   pthread_mutex_lock(&lock_options_);
+  // Skip proxies with an open circuit breaker, unless all of them have one
+  if (opt_proxy_groups_ && !breakers_->empty()) {
+    const uint64_t now = GetTimeMs();
+    for (unsigned i = 0; (i < opt_num_proxies_) &&
+         IsProxyBlocked((*opt_proxy_groups_)[opt_proxy_groups_current_][0],
+                        now); ++i)
+    {
+      SelectNextProxy();
+    }
+  }
   if (!opt_proxy_groups_ ||
       ((*opt_proxy_groups_)[opt_proxy_groups_current_][0] == "DIRECT"))
   {
@@ -475,8 +1388,14 @@ static void SetUrlOptions(JobInfo *info) {
   if (opt_dns_server_)
     curl_easy_setopt(curl_handle, CURLOPT_DNS_SERVERS, opt_dns_server_);
 
-  if (info->probe_hosts && opt_host_chain_)
-    url_prefix = (*opt_host_chain_)[opt_host_chain_current_];
+  if (info->probe_hosts && opt_host_chain_) {
+    url_prefix = ExpandHost((*opt_host_chain_)[opt_host_chain_current_],
+                            info->repository_name);
+  }
+  const string endpoint = (info->proxy != "") ?
+    info->proxy : GetUrlEndpoint(url_prefix + *(info->url));
+  SetHttpVersion(curl_handle, endpoint);
+  SetResolveOptions(info, endpoint, info->proxy != "");
   pthread_mutex_unlock(&lock_options_);
 
   curl_easy_setopt(curl_handle, CURLOPT_URL,
@@ -487,13 +1406,143 @@ static void SetUrlOptions(JobInfo *info) {
 
 
 /**
- * Adds transfer time and downloaded bytes to the global counters.
+ * Adds the downloaded bytes to the global counters and to the job.
  */
-static void UpdateStatistics(CURL *handle) {
+static void UpdateStatistics(CURL *handle, JobInfo *info) {
   double val;
 
-  if (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &val) == CURLE_OK)
+  if (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &val) == CURLE_OK) {
     stat_transferred_bytes_ += val;
+    info->transferred_bytes += uint64_t(val);
+  }
+}
+
+
+/**
+ * Folds the timings of a successful transfer from one of the hosts of the
+ * chain into the host's round trip time and throughput estimates.  The round
+ * trip time is the time from sending the request to the first byte, so that
+ * connection setup and reuse do not matter.
+ */
+static void UpdateHostEstimates(CURL *handle) {
+  char *effective_url;
+  double time_pretransfer, time_starttransfer, time_total, size;
+  if ((curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url) !=
+       CURLE_OK) ||
+      (curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME,
+                         &time_pretransfer) != CURLE_OK) ||
+      (curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME,
+                         &time_starttransfer) != CURLE_OK) ||
+      (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &time_total) !=
+       CURLE_OK) ||
+      (curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &size) != CURLE_OK))
+  {
+    return;
+  }
+  const string url(effective_url);
+  const int rtt = int((time_starttransfer - time_pretransfer) * 1000);
+  const double time_receive = time_total - time_starttransfer;
+
+  pthread_mutex_lock(&lock_options_);
+  if (!opt_host_chain_ || (opt_host_probe_interval_ == 0)) {
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
+  for (unsigned i = 0; i < opt_host_chain_->size(); ++i) {
+    if (!IsFromHost(url, (*opt_host_chain_)[i]))
+      continue;
+    int *host_rtt = &((*opt_host_chain_rtt_)[i]);
+    *host_rtt = (*host_rtt < 0) ? rtt : (3 * *host_rtt + rtt) / 4;
+    if ((size >= kMinSpeedBytes) && (time_receive > 0.0)) {
+      const int speed = int(size / 1024 / time_receive);
+      int *host_speed = &((*opt_host_chain_speed_)[i]);
+      *host_speed = (*host_speed < 0) ? speed : (3 * *host_speed + speed) / 4;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+static unsigned GetHistogramBin(const uint64_t value) {
+  unsigned bin = 0;
+  for (uint64_t v = value; (v > 0) && (bin < kNumHistogramBins - 1); v >>= 1)
+    bin++;
+  return bin;
+}
+
+
+/**
+ * Accounts a finished transfer attempt to its proxy and its host.
+ */
+static void UpdateEndpointStatistics(JobInfo *info) {
+  char *effective_url = NULL;
+  double time_starttransfer = 0.0, time_total = 0.0, size = 0.0;
+  curl_easy_getinfo(info->curl_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+  curl_easy_getinfo(info->curl_handle, CURLINFO_STARTTRANSFER_TIME,
+                    &time_starttransfer);
+  curl_easy_getinfo(info->curl_handle, CURLINFO_TOTAL_TIME, &time_total);
+  curl_easy_getinfo(info->curl_handle, CURLINFO_SIZE_DOWNLOAD, &size);
+  const string host = effective_url ? GetUrlEndpoint(effective_url) : "";
+  const double time_receive = time_total - time_starttransfer;
+
+  EndpointStatistics *endpoints[2];
+  pthread_mutex_lock(&lock_endpoint_stats_);
+  endpoints[0] = &(*stats_proxies_)[(info->proxy == "") ? "DIRECT" :
+                                                         info->proxy];
+  endpoints[1] = &(*stats_hosts_)[host];
+  for (unsigned i = 0; i < 2; ++i) {
+    EndpointStatistics *stats = endpoints[i];
+    stats->num_requests++;
+    stats->num_bytes += uint64_t(size);
+    stats->num_failures[info->error_code]++;
+    if (time_starttransfer > 0.0)
+      stats->ttfb_ms[GetHistogramBin(uint64_t(time_starttransfer * 1000))]++;
+    if ((info->error_code == kFailOk) && (size >= kMinSpeedBytes) &&
+        (time_receive > 0.0))
+    {
+      stats->throughput_kbs[
+        GetHistogramBin(uint64_t(size / 1024 / time_receive))]++;
+    }
+  }
+  pthread_mutex_unlock(&lock_endpoint_stats_);
+}
+
+
+/**
+ * Counts the answers by HTTP/2 and remembers the proxies and hosts that fall
+ * back to HTTP/1.
+ */
+static void UpdateHttpVersion(const JobInfo *info) {
+#ifdef CVMFS_HTTP2_SUPPORT
+  long version = 0;  // NOLINT
+  if (!opt_http2_ || !info->first_byte ||
+      (curl_easy_getinfo(info->curl_handle, CURLINFO_HTTP_VERSION, &version) !=
+       CURLE_OK))
+  {
+    return;
+  }
+  if (version == CURL_HTTP_VERSION_2_0) {
+    atomic_inc64(&stat_http2_requests_);
+    return;
+  }
+
+  string endpoint = info->proxy;
+  if (endpoint == "") {
+    char *effective_url = NULL;
+    curl_easy_getinfo(info->curl_handle, CURLINFO_EFFECTIVE_URL,
+                      &effective_url);
+    if (!effective_url)
+      return;
+    endpoint = GetUrlEndpoint(effective_url);
+  }
+  pthread_mutex_lock(&lock_options_);
+  if (http1_endpoints_->insert(endpoint).second) {
+    LogCvmfs(kLogDownload, kLogDebug, "%s does not support HTTP/2, "
+             "falling back to HTTP/1.1", endpoint.c_str());
+  }
+  pthread_mutex_unlock(&lock_options_);
+#endif
 }
 
 
@@ -503,14 +1552,77 @@ static void UpdateStatistics(CURL *handle) {
  *
  * \return true if another download should be performed, false otherwise
  */
+/**
+ * Counts the consecutive connection failures of the proxy of a finished
+ * request and opens its circuit breaker at opt_breaker_threshold_ failures.
+ * Any response through the proxy, even an HTTP error, closes the breaker.
+ */
+static void UpdateCircuitBreaker(const JobInfo *info) {
+  if (info->proxy == "")
+    return;
+
+  bool tripped = false;
+  pthread_mutex_lock(&lock_options_);
+  if (info->first_byte) {
+    map<string, CircuitBreaker>::iterator i = breakers_->find(info->proxy);
+    if (i != breakers_->end()) {
+      if (i->second.open_until_ms > 0) {
+        LogCvmfs(kLogDownload, kLogDebug | kLogSyslog,
+                 "proxy %s is reachable again", info->proxy.c_str());
+      }
+      breakers_->erase(i);
+    }
+  } else if ((info->error_code == kFailProxyConnection) &&
+             (opt_breaker_threshold_ > 0))
+  {
+    CircuitBreaker *breaker = &(*breakers_)[info->proxy];
+    breaker->num_failures++;
+    if ((breaker->num_failures >= opt_breaker_threshold_) &&
+        (breaker->open_until_ms == 0))
+    {
+      breaker->backoff = kMinBreakerBackoff;
+      breaker->open_until_ms = GetTimeMs() + breaker->backoff * 1000;
+      breakers_tripped_->push_back(info->proxy);
+      tripped = true;
+      LogCvmfs(kLogDownload, kLogDebug | kLogSyslog,
+               "proxy %s failed %u times in a row, skipping it for %u seconds",
+               info->proxy.c_str(), breaker->num_failures, breaker->backoff);
+    }
+  }
+  pthread_mutex_unlock(&lock_options_);
+
+  if (tripped) {
+    pthread_mutex_lock(&lock_proxy_probe_);
+    proxy_probe_wakeup_ = true;
+    pthread_cond_signal(&cond_proxy_probe_);
+    pthread_mutex_unlock(&lock_proxy_probe_);
+  }
+}
+
+
 static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
   //LogCvmfs(kLogDownload, kLogDebug, "Verify Download (curl error %d)",
   //         curl_error);
-  UpdateStatistics(info->curl_handle);
+  UpdateStatistics(info->curl_handle, info);
 
   // Verification and error classification
   switch (curl_error) {
     case CURLE_OK:
+      UpdateHostEstimates(info->curl_handle);
+      if (info->conditional) {
+        long filetime = -1;
+        long unmet = 0;
+        curl_easy_getinfo(info->curl_handle, CURLINFO_FILETIME, &filetime);
+        curl_easy_getinfo(info->curl_handle, CURLINFO_CONDITION_UNMET, &unmet);
+        info->last_modified = (filetime > 0) ? filetime : 0;
+        if (unmet && (info->if_modified_since > 0)) {
+          info->not_modified = true;
+          if (info->destination == kDestinationMem)
+            info->destination_mem.size = 0;
+          info->error_code = kFailOk;
+          break;
+        }
+      }
       // Verify content hash
       if (info->expected_hash) {
         hash::Any match_hash;
@@ -525,24 +1637,16 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
         }
       }
 
-      // Decompress memory in a single run
-      if ((info->destination == kDestinationMem) && info->compressed) {
-        void *buf;
-        int64_t size;
-        bool retval = zlib::DecompressMem2Mem(info->destination_mem.data,
-                                              info->destination_mem.size,
-                                              &buf, &size);
-        if (retval) {
-          free(info->destination_mem.data);
-          info->destination_mem.data = static_cast<char *>(buf);
-          info->destination_mem.size = size;
-        } else {
+      // Memory has been inflated on the fly
+      if (info->destination == kDestinationMem) {
+        if (info->compressed && !info->zstream_end) {
           LogCvmfs(kLogDownload, kLogDebug,
                    "decompression (memory) of url %s failed",
                    info->url->c_str());
           info->error_code = kFailBadData;
           break;
         }
+        info->destination_mem.size = info->destination_mem.pos;
       }
 
       info->error_code = kFailOk;
@@ -575,6 +1679,10 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
       break;
   }
 
+  UpdateEndpointStatistics(info);
+  UpdateCircuitBreaker(info);
+  UpdateHttpVersion(info);
+
   // Determination if download should be repeated
   bool try_again = false;
   if (info->error_code != kFailOk) {
@@ -596,28 +1704,52 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
   }
 
   if (try_again) {
-    // Reset internal state and destination
-    if ((info->destination == kDestinationMem) && info->destination_mem.data) {
-      if (info->destination_mem.data)
-        free(info->destination_mem.data);
-      info->destination_mem.data = NULL;
-      info->destination_mem.size = 0;
-      info->destination_mem.pos = 0;
-    }
-    if ((info->destination == kDestinationFile) ||
-        (info->destination == kDestinationPath))
-    {
-      if ((fflush(info->destination_file) != 0) ||
-          (ftruncate(fileno(info->destination_file), 0) != 0))
+    // A file transfer that broke off is resumed with a range request behind
+    // the received bytes.  The hash and the decompression carry on, so that
+    // the object is verified as a whole.  Bad data are fetched again.
+    const bool resume =
+      (info->error_code != kFailBadData) &&
+      ((info->destination == kDestinationFile) ||
+       (info->destination == kDestinationPath)) &&
+      (GetRangeBegin(info) + info->range_received < GetRangeEnd(info));
+    if (resume) {
+      if (info->range_received > 0) {
+        info->resume_offset += info->range_received;
+        LogCvmfs(kLogDownload, kLogDebug, "resuming %s at byte %"PRIu64,
+                 info->url->c_str(), GetRangeBegin(info));
+      }
+    } else {
+      // Reset internal state and destination
+      if (info->destination == kDestinationMem) {
+        ReleaseMemBuffer(info);
+        ResetMem(info);
+      }
+      if ((info->destination == kDestinationFile) ||
+          (info->destination == kDestinationPath))
       {
-        info->error_code = kFailLocalIO;
-        goto verify_and_finalize_stop;
+        if ((fflush(info->destination_file) != 0) ||
+            (ftruncate(fileno(info->destination_file), 0) != 0))
+        {
+          info->error_code = kFailLocalIO;
+          goto verify_and_finalize_stop;
+        }
+        rewind(info->destination_file);
+        if (info->progress_callback)
+          info->progress_callback(info->progress_ctx, 0);
+      }
+      if (info->expected_hash)
+        hash::Init(info->hash_context);
+      if (info->compressed) {
+        zlib::DecompressFini(&info->zstream);
+        zlib::DecompressInit(&info->zstream);
       }
+      info->zstream_end = false;
+      info->resume_offset = 0;
     }
-    if (info->expected_hash)
-      hash::Init(info->hash_context);
-    if (info->compressed)
-      zlib::DecompressInit(&info->zstream);
+    info->range_emulated = false;
+    info->range_pos = 0;
+    info->range_received = 0;
+    SetRangeOptions(info, info->curl_handle);
 
     // Failure handling
     if (info->error_code == kFailBadData) {
@@ -657,9 +1789,7 @@ static bool VerifyAndFinalize(const int curl_error, JobInfo *info) {
 
 
 static Failures PrepareDownloadDestination(JobInfo *info) {
-  info->destination_mem.size = 0;
-  info->destination_mem.pos = 0;
-  info->destination_mem.data = NULL;
+  ResetMem(info);
 
   if (info->destination == kDestinationFile)
     assert(info->destination_file != NULL);
@@ -675,13 +1805,126 @@ static Failures PrepareDownloadDestination(JobInfo *info) {
 }
 
 
+static void MakeDoorbell() {
+#ifdef HAVE_SYS_EVENTFD_H
+  doorbell_[0] = doorbell_[1] = eventfd(0, 0);
+  if (doorbell_[0] < 0)
+#endif
+    MakePipe(doorbell_);
+  int retval = fcntl(doorbell_[0], F_SETFL,
+                     fcntl(doorbell_[0], F_GETFL) | O_NONBLOCK);
+  assert(retval == 0);
+}
+
+
+static void CloseDoorbell() {
+  if (doorbell_[1] != doorbell_[0])
+    close(doorbell_[1]);
+  close(doorbell_[0]);
+}
+
+
 /**
- * Downloads data from an unsecure outside channel (currently HTTP or file).
+ * Eight bytes is a valid eventfd increment as well as pipe data.
  */
-Failures Fetch(JobInfo *info) {
+static void RingDoorbell() {
+  const uint64_t value = 1;
+  WritePipe(doorbell_[1], &value, sizeof(value));
+}
+
+
+static void ClearDoorbell() {
+  uint64_t buf[64];
+  while (read(doorbell_[0], buf, sizeof(buf)) > 0) { }
+}
+
+
+/**
+ * Pushes a job to the I/O thread.  The doorbell only rings if the I/O thread
+ * might be asleep, i.e. if the queue was empty.
+ */
+static void SubmitJob(JobInfo *info) {
+  JobInfo *head;
+  do {
+    head = queue_jobs_;
+    info->next_job = head;
+  } while (!__sync_bool_compare_and_swap(&queue_jobs_, head, info));
+  if (head == NULL)
+    RingDoorbell();
+}
+
+
+/**
+ * Takes all the submitted jobs from the queue.
+ *
+ * \return The jobs in submission order
+ */
+static vector<JobInfo *> TakeJobs() {
+  JobInfo *head;
+  do {
+    head = queue_jobs_;
+  } while (!__sync_bool_compare_and_swap(&queue_jobs_, head,
+                                         static_cast<JobInfo *>(NULL)));
+  vector<JobInfo *> jobs;
+  for (; head != NULL; head = head->next_job)
+    jobs.push_back(head);
+  reverse(jobs.begin(), jobs.end());
+  return jobs;
+}
+
+
+/**
+ * Finished jobs of a FetchBatch() call
+ */
+struct BatchCompletion {
+  BatchCompletion() {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+  ~BatchCompletion() {
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&cond);
+  }
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  vector<JobInfo *> completed;
+};
+
+
+static void CompleteJob(JobInfo *info) {
+  BatchCompletion *batch = info->batch;
+  if (batch) {
+    pthread_mutex_lock(&batch->lock);
+    batch->completed.push_back(info);
+    pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+    return;
+  }
+  pthread_mutex_lock(&info->lock_completion);
+  info->completed = true;
+  pthread_cond_signal(&info->cond_completion);
+  pthread_mutex_unlock(&info->lock_completion);
+}
+
+
+/**
+ * Opens the destination and sizes the hash context.  The caller provides the
+ * buffer of the hash context.
+ */
+static Failures PrepareJob(JobInfo *info) {
   assert(info != NULL);
   assert(info->url != NULL);
+  // Only a prefix of a compressed object can be inflated, and only as a stream
+  if (info->compressed && (info->range_size > 0) &&
+      ((info->range_offset > 0) || (info->destination == kDestinationMem)))
+  {
+    LogCvmfs(kLogDownload, kLogDebug, "cannot inflate range %"PRIu64
+             "+%"PRIu64" of %s", info->range_offset, info->range_size,
+             info->url->c_str());
+    return kFailOther;
+  }
 
+  info->transferred_bytes = 0;
   Failures result;
   result = PrepareDownloadDestination(info);
   if (result != kFailOk)
@@ -691,19 +1934,57 @@ Failures Fetch(JobInfo *info) {
     const hash::Algorithms algorithm = info->expected_hash->algorithm;
     info->hash_context.algorithm = algorithm;
     info->hash_context.size = hash::GetContextSize(algorithm);
-    info->hash_context.buffer = alloca(info->hash_context.size);
   }
+  return kFailOk;
+}
 
-  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
-    if (info->wait_at[0] == -1) {
-      MakePipe(info->wait_at);
-    }
 
-    //LogCvmfs(kLogDownload, kLogDebug, "send job to thread, pipe %d %d",
-    //         info->wait_at[0], info->wait_at[1]);
-    WritePipe(pipe_jobs_[1], &info, sizeof(info));
-    ReadPipe(info->wait_at[0], &result, sizeof(result));
-    //LogCvmfs(kLogDownload, kLogDebug, "got result %d", result);
+/**
+ * Removes the remains of a failed download.
+ */
+static void CleanupFailedJob(JobInfo *info) {
+  LogCvmfs(kLogDownload, kLogDebug, "download failed (error %d)",
+           info->error_code);
+
+  if (info->destination == kDestinationPath)
+    unlink(info->destination_path->c_str());
+
+  ReleaseMemBuffer(info);
+}
+
+
+/**
+ * Returns the buffer of a memory destination to the pool.  Callers that keep
+ * the data longer than the job copy them out first.
+ */
+void ReleaseMemBuffer(JobInfo *info) {
+  PutBuffer(info->destination_mem.data, info->destination_mem.capacity);
+  info->destination_mem.data = NULL;
+  info->destination_mem.size = 0;
+  info->destination_mem.pos = 0;
+  info->destination_mem.capacity = 0;
+}
+
+
+/**
+ * Downloads data from an unsecure outside channel (currently HTTP or file).
+ */
+Failures Fetch(JobInfo *info) {
+  Failures result = PrepareJob(info);
+  if (result != kFailOk)
+    return result;
+  if (info->expected_hash)
+    info->hash_context.buffer = alloca(info->hash_context.size);
+
+  if (atomic_xadd32(&multi_threaded_, 0) == 1) {
+    info->batch = NULL;
+    info->completed = false;
+    SubmitJob(info);
+    pthread_mutex_lock(&info->lock_completion);
+    while (!info->completed)
+      pthread_cond_wait(&info->cond_completion, &info->lock_completion);
+    pthread_mutex_unlock(&info->lock_completion);
+    result = info->error_code;
   } else {
     CURL *handle = AcquireCurlHandle();
     InitializeRequest(info, handle);
@@ -720,20 +2001,113 @@ Failures Fetch(JobInfo *info) {
     ReleaseCurlHandle(info->curl_handle);
   }
 
-  if (result != kFailOk) {
-    LogCvmfs(kLogDownload, kLogDebug, "download failed (error %d)", result);
+  if (result != kFailOk)
+    CleanupFailedJob(info);
+
+  return result;
+}
 
-    if (info->destination == kDestinationPath)
-      unlink(info->destination_path->c_str());
 
-    if (info->destination_mem.data) {
-      free(info->destination_mem.data);
-      info->destination_mem.data = NULL;
-      info->destination_mem.size = 0;
+/**
+ * Downloads many objects concurrently, keeping at most max_parallel of them
+ * in the I/O thread.  Since the transfers share the I/O thread's connection
+ * cache, a small max_parallel reuses the connections to the proxy.  The
+ * result of every job is in its error_code.  If on_complete is set, it is
+ * called in the calling thread for every job as soon as it finished, in
+ * completion order.
+ *
+ * \return The number of failed jobs
+ */
+unsigned FetchBatch(const vector<JobInfo *> &jobs, const unsigned max_parallel,
+                    void (*on_complete)(JobInfo *info, void *ctx), void *ctx)
+{
+  assert(max_parallel > 0);
+  unsigned num_failed = 0;
+
+  if (atomic_xadd32(&multi_threaded_, 0) == 0) {
+    for (unsigned i = 0; i < jobs.size(); ++i) {
+      jobs[i]->error_code = Fetch(jobs[i]);
+      if (jobs[i]->error_code != kFailOk)
+        num_failed++;
+      if (on_complete)
+        on_complete(jobs[i], ctx);
     }
+    return num_failed;
   }
 
-  return result;
+  BatchCompletion batch;
+  unsigned next_job = 0;
+  unsigned num_running = 0;
+  unsigned num_done = 0;
+  while (num_done < jobs.size()) {
+    while ((next_job < jobs.size()) && (num_running < max_parallel)) {
+      JobInfo *info = jobs[next_job++];
+      info->error_code = PrepareJob(info);
+      if (info->error_code != kFailOk) {
+        num_failed++;
+        num_done++;
+        if (on_complete)
+          on_complete(info, ctx);
+        continue;
+      }
+      if (info->expected_hash)
+        info->hash_context.buffer = smalloc(info->hash_context.size);
+      info->batch = &batch;
+      info->completed = false;
+      SubmitJob(info);
+      num_running++;
+    }
+    if (num_running == 0)
+      continue;
+
+    vector<JobInfo *> completed;
+    pthread_mutex_lock(&batch.lock);
+    while (batch.completed.empty())
+      pthread_cond_wait(&batch.cond, &batch.lock);
+    completed.swap(batch.completed);
+    pthread_mutex_unlock(&batch.lock);
+
+    for (unsigned i = 0; i < completed.size(); ++i) {
+      JobInfo *info = completed[i];
+      num_running--;
+      num_done++;
+      info->batch = NULL;
+      if (info->expected_hash) {
+        free(info->hash_context.buffer);
+        info->hash_context.buffer = NULL;
+      }
+      if (info->error_code != kFailOk) {
+        num_failed++;
+        CleanupFailedJob(info);
+      }
+      if (on_complete)
+        on_complete(info, ctx);
+    }
+  }
+  return num_failed;
+}
+
+
+/**
+ * Called by curl with the time until curl_multi_socket_action() has to be
+ * called with CURL_SOCKET_TIMEOUT.  -1 means no timeout.
+ */
+static int CallbackCurlTimer(CURLM *multi, long timeout_ms,  // NOLINT
+                             void *userp)
+{
+  curl_deadline_ms_ = (timeout_ms < 0) ? 0 : GetTimeMs() + timeout_ms;
+  return 0;
+}
+
+
+/**
+ * Runs curl's timeout handling if its timer expired.
+ */
+static void HandleCurlTimer(int *still_running) {
+  if ((curl_deadline_ms_ == 0) || (GetTimeMs() < curl_deadline_ms_))
+    return;
+  curl_deadline_ms_ = 0;
+  curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0, still_running);
 }
 
 
@@ -748,6 +2122,27 @@ static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
   if (action == CURL_POLL_NONE)
     return 0;
 
+#ifdef HAVE_SYS_EPOLL_H
+  if (action == CURL_POLL_REMOVE) {
+    // Fails if curl has closed the socket already, which is fine
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.data.fd = s;
+  if ((action == CURL_POLL_IN) || (action == CURL_POLL_INOUT))
+    event.events |= EPOLLIN | EPOLLPRI;
+  if ((action == CURL_POLL_OUT) || (action == CURL_POLL_INOUT))
+    event.events |= EPOLLOUT;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, s, &event) != 0) {
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, s, &event) != 0) {
+      LogCvmfs(kLogDownload, kLogDebug | kLogSyslog,
+               "failed to watch socket %d (%d)", s, errno);
+      return -1;
+    }
+  }
+#else
   // Find s in watch_fds_
   unsigned index;
   for (index = 0; index < watch_fds_inuse_; ++index) {
@@ -759,10 +2154,8 @@ static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
     // Extend array if necessary
     if (watch_fds_inuse_ == watch_fds_size_) {
       watch_fds_size_ *= 2;
-      //LogCvmfs(kLogDownload, kLogDebug, "extending watch_fds_ (%d)", watch_fds_size_);
       watch_fds_ = static_cast<struct pollfd *>(
                    srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
-      //LogCvmfs(kLogDownload, kLogDebug, "extending watch_fds_ done (%d)", watch_fds_size_);
     }
     watch_fds_[watch_fds_inuse_].fd = s;
     watch_fds_[watch_fds_inuse_].events = 0;
@@ -772,13 +2165,13 @@ static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
 
   switch (action) {
     case CURL_POLL_IN:
-      watch_fds_[index].events |= POLLIN | POLLPRI;
+      watch_fds_[index].events = POLLIN | POLLPRI;
       break;
     case CURL_POLL_OUT:
-      watch_fds_[index].events |= POLLOUT | POLLWRBAND;
+      watch_fds_[index].events = POLLOUT | POLLWRBAND;
       break;
     case CURL_POLL_INOUT:
-      watch_fds_[index].events |= POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
+      watch_fds_[index].events = POLLIN | POLLPRI | POLLOUT | POLLWRBAND;
       break;
     case CURL_POLL_REMOVE:
       if (index < watch_fds_inuse_-1)
@@ -788,145 +2181,846 @@ static int CallbackCurlSocket(CURL *easy, curl_socket_t s, int action,
       if ((watch_fds_inuse_ > watch_fds_max_) &&
           (watch_fds_inuse_ < watch_fds_size_/2))
       {
-        watch_fds_size_ /= 2;
-        //LogCvmfs(kLogDownload, kLogDebug, "shrinking watch_fds_ (%d)", watch_fds_size_);
-        watch_fds_ = static_cast<struct pollfd *>(
-                   srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
-        //LogCvmfs(kLogDownload, kLogDebug, "shrinking watch_fds_ done", watch_fds_size_);
+        watch_fds_size_ /= 2;
+        watch_fds_ = static_cast<struct pollfd *>(
+                   srealloc(watch_fds_, watch_fds_size_*sizeof(struct pollfd)));
+      }
+      break;
+    default:
+      break;
+  }
+#endif
+
+  return 0;
+}
+
+
+/**
+ * A ready file descriptor with its events as CURL_CSELECT_ bits.
+ */
+struct IoEvent {
+  IoEvent(const int f, const int e) : fd(f), ev_bitmask(e) { }
+  int fd;
+  int ev_bitmask;
+};
+
+
+static void InitEvents() {
+#ifdef HAVE_SYS_EPOLL_H
+  epoll_fd_ = epoll_create(kMaxEpollEvents);
+  assert(epoll_fd_ >= 0);
+  epoll_events_ = static_cast<struct epoll_event *>(
+                  smalloc(kMaxEpollEvents * sizeof(struct epoll_event)));
+  const int fds[2] = { pipe_terminate_[0], doorbell_[0] };
+  for (unsigned i = 0; i < 2; ++i) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLPRI;
+    event.data.fd = fds[i];
+    int retval = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fds[i], &event);
+    assert(retval == 0);
+  }
+#else
+  watch_fds_ = static_cast<struct pollfd *>(smalloc(2 * sizeof(struct pollfd)));
+  watch_fds_size_ = 2;
+  watch_fds_[0].fd = pipe_terminate_[0];
+  watch_fds_[0].events = POLLIN | POLLPRI;
+  watch_fds_[0].revents = 0;
+  watch_fds_[1].fd = doorbell_[0];
+  watch_fds_[1].events = POLLIN | POLLPRI;
+  watch_fds_[1].revents = 0;
+  watch_fds_inuse_ = 2;
+#endif
+}
+
+
+static void FiniEvents() {
+#ifdef HAVE_SYS_EPOLL_H
+  close(epoll_fd_);
+  free(epoll_events_);
+  epoll_fd_ = -1;
+  epoll_events_ = NULL;
+#else
+  free(watch_fds_);
+  watch_fds_ = NULL;
+  watch_fds_size_ = watch_fds_inuse_ = 0;
+#endif
+}
+
+
+/**
+ * Blocks until file descriptors are ready or timeout_ms passed; -1 waits
+ * indefinitely.
+ */
+static void WaitForEvents(const int timeout_ms, vector<IoEvent> *events) {
+  events->clear();
+#ifdef HAVE_SYS_EPOLL_H
+  const int num_ready =
+    epoll_wait(epoll_fd_, epoll_events_, kMaxEpollEvents, timeout_ms);
+  for (int i = 0; i < num_ready; ++i) {
+    const uint32_t revents = epoll_events_[i].events;
+    int ev_bitmask = 0;
+    if (revents & (EPOLLIN | EPOLLPRI))
+      ev_bitmask |= CURL_CSELECT_IN;
+    if (revents & EPOLLOUT)
+      ev_bitmask |= CURL_CSELECT_OUT;
+    if (revents & (EPOLLERR | EPOLLHUP))
+      ev_bitmask |= CURL_CSELECT_ERR;
+    events->push_back(IoEvent(epoll_events_[i].data.fd, ev_bitmask));
+  }
+#else
+  const int num_ready = poll(watch_fds_, watch_fds_inuse_, timeout_ms);
+  for (unsigned i = 0; (num_ready > 0) && (i < watch_fds_inuse_); ++i) {
+    const short revents = watch_fds_[i].revents;  // NOLINT
+    if (!revents)
+      continue;
+    int ev_bitmask = 0;
+    if (revents & (POLLIN | POLLPRI))
+      ev_bitmask |= CURL_CSELECT_IN;
+    if (revents & (POLLOUT | POLLWRBAND))
+      ev_bitmask |= CURL_CSELECT_OUT;
+    if (revents & (POLLERR | POLLHUP | POLLNVAL))
+      ev_bitmask |= CURL_CSELECT_ERR;
+    watch_fds_[i].revents = 0;
+    events->push_back(IoEvent(watch_fds_[i].fd, ev_bitmask));
+  }
+#endif
+}
+
+
+/**
+ * Sends a duplicate of a slow request to the next proxy of the current
+ * load-balancing group.  Nothing happens for direct connections or if there
+ * is no other proxy in the group.
+ */
+static void StartHedge(JobInfo *info, int *still_running) {
+  if (info->proxy == "")
+    return;
+
+  string proxy;
+  pthread_mutex_lock(&lock_options_);
+  if (opt_proxy_groups_) {
+    const vector<string> &group =
+      (*opt_proxy_groups_)[opt_proxy_groups_current_];
+    for (unsigned i = 0; i < group.size(); ++i) {
+      if ((group[i] != info->proxy) && (group[i] != "DIRECT")) {
+        proxy = group[i];
+        break;
+      }
+    }
+  }
+  if (proxy == "") {
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
+  CURL *handle = AcquireCurlHandle();
+  curl_easy_setopt(handle, CURLOPT_PROXY, proxy.c_str());
+  curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, opt_timeout_proxy_);
+  curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, opt_timeout_proxy_);
+  if (opt_dns_server_)
+    curl_easy_setopt(handle, CURLOPT_DNS_SERVERS, opt_dns_server_);
+  SetHttpVersion(handle, proxy);
+  curl_easy_setopt(handle, CURLOPT_RESOLVE, NULL);
+  pthread_mutex_unlock(&lock_options_);
+
+  char *url;
+  curl_easy_getinfo(info->curl_handle, CURLINFO_EFFECTIVE_URL, &url);
+  SetRequestOptions(info, handle, true);
+  curl_easy_setopt(handle, CURLOPT_URL, url);
+
+  LogCvmfs(kLogDownload, kLogDebug, "hedging %s through proxy %s", url,
+           proxy.c_str());
+  info->hedge_handle = handle;
+  info->hedge_proxy = proxy;
+  info->hedge_state = kHedgeRacing;
+  atomic_inc64(&stat_hedges_fired_);
+  curl_multi_add_handle(curl_multi_, handle);
+  curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0, still_running);
+}
+
+
+/**
+ * Removes the requests that lost the race against their duplicate (or the
+ * duplicates that lost against the original request).
+ */
+static void CancelHedgeLosers() {
+  for (unsigned i = 0; i < hedge_losers_->size(); ++i) {
+    JobInfo *info = (*hedge_losers_)[i];
+    curl_multi_remove_handle(curl_multi_, info->hedge_handle);
+    UpdateStatistics(info->hedge_handle, info);
+    ReleaseCurlHandle(info->hedge_handle);
+    info->hedge_handle = NULL;
+  }
+  hedge_losers_->clear();
+}
+
+
+/**
+ * Sends duplicates for the requests that did not get a response within the
+ * hedge delay.
+ */
+static void LaunchHedges(int *still_running) {
+  if (jobs_unanswered_->empty())
+    return;
+  const uint64_t delay = GetHedgeDelay();
+  const uint64_t now = GetTimeMs();
+  vector<JobInfo *> due;
+  for (set<JobInfo *>::const_iterator i = jobs_unanswered_->begin(),
+       iEnd = jobs_unanswered_->end(); i != iEnd; ++i)
+  {
+    if ((delay == 0) || ((*i)->time_start_ms + delay <= now))
+      due.push_back(*i);
+  }
+  // Starting a hedge can run curl callbacks that change jobs_unanswered_
+  for (unsigned i = 0; i < due.size(); ++i) {
+    jobs_unanswered_->erase(due[i]);
+    if (delay > 0)
+      StartHedge(due[i], still_running);
+  }
+}
+
+
+/**
+ * Milliseconds until the next request is due for hedging, -1 if none.
+ */
+static int GetHedgeTimeout() {
+  const uint64_t delay = GetHedgeDelay();
+  if (jobs_unanswered_->empty() || (delay == 0))
+    return -1;
+  uint64_t deadline = 0;
+  for (set<JobInfo *>::const_iterator i = jobs_unanswered_->begin(),
+       iEnd = jobs_unanswered_->end(); i != iEnd; ++i)
+  {
+    if ((deadline == 0) || ((*i)->time_start_ms + delay < deadline))
+      deadline = (*i)->time_start_ms + delay;
+  }
+  const uint64_t now = GetTimeMs();
+  return (deadline > now) ? deadline - now : 0;
+}
+
+
+/**
+ * Starts the clock for the time to first byte of a (repeated) request.  Only
+ * requests that were not hedged before are candidates for a hedge.
+ */
+static void WatchFirstByte(JobInfo *info) {
+  info->time_start_ms = GetTimeMs();
+  info->first_byte = false;
+  if ((info->hedge_state == kHedgeOff) && (GetHedgeDelay() > 0))
+    jobs_unanswered_->insert(info);
+}
+
+
+/**
+ * Verifies a request that was removed from the multi handle.  It is either
+ * sent again or its job completes.
+ */
+static void FinishRequest(JobInfo *info, CURL *handle, const int curl_error,
+                          int *still_running)
+{
+  DrainPipeline(info);
+  if (VerifyAndFinalize(curl_error, info)) {
+    WatchFirstByte(info);
+    curl_multi_add_handle(curl_multi_, handle);
+    curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
+                             still_running);
+  } else {
+    // Return easy handle into pool and write result back
+    ReleaseCurlHandle(handle);
+    jobs_active_[info->priority]--;
+    CompleteJob(info);
+  }
+}
+
+
+static void StartJob(JobInfo *info, int *still_running) {
+  CURL *handle = AcquireCurlHandle();
+  InitializeRequest(info, handle);
+  SetUrlOptions(info);
+  WatchFirstByte(info);
+  curl_multi_add_handle(curl_multi_, handle);
+  curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0, still_running);
+}
+
+
+/**
+ * Starts waiting jobs, higher priority classes first, as long as their class
+ * has free slots.
+ *
+ * \return The number of started jobs
+ */
+static unsigned StartWaitingJobs(int *still_running) {
+  bool has_waiting = false;
+  for (unsigned p = 0; p < kNumPriorities; ++p)
+    has_waiting |= !jobs_waiting_[p].empty();
+  if (!has_waiting)
+    return 0;
+
+  unsigned slots[kNumPriorities];
+  pthread_mutex_lock(&lock_options_);
+  for (unsigned p = 0; p < kNumPriorities; ++p)
+    slots[p] = opt_priority_slots_[p];
+  pthread_mutex_unlock(&lock_options_);
+
+  unsigned num_started = 0;
+  for (unsigned p = 0; p < kNumPriorities; ++p) {
+    while (!jobs_waiting_[p].empty() &&
+           ((slots[p] == 0) || (jobs_active_[p] < slots[p])))
+    {
+      JobInfo *info = jobs_waiting_[p].front();
+      jobs_waiting_[p].pop_front();
+      jobs_active_[p]++;
+      StartJob(info, still_running);
+      num_started++;
+    }
+  }
+  return num_started;
+}
+
+
+/**
+ * Fails the requests that still wait for a response from a proxy whose
+ * circuit breaker just opened.  They go to another proxy right away instead
+ * of running into their own timeouts.  Hedged requests are left alone.
+ */
+static void AbortTrippedRequests(int *still_running) {
+  vector<string> tripped;
+  pthread_mutex_lock(&lock_options_);
+  tripped.swap(*breakers_tripped_);
+  pthread_mutex_unlock(&lock_options_);
+  if (tripped.empty())
+    return;
+
+  vector<JobInfo *> aborted;
+  for (set<CURL *>::const_iterator i = pool_handles_inuse_->begin(),
+       iEnd = pool_handles_inuse_->end(); i != iEnd; ++i)
+  {
+    JobInfo *info;
+    curl_easy_getinfo(*i, CURLINFO_PRIVATE, &info);
+    if ((*i != info->curl_handle) || (info->hedge_state != kHedgeOff) ||
+        info->first_byte)
+    {
+      continue;
+    }
+    if (find(tripped.begin(), tripped.end(), info->proxy) != tripped.end())
+      aborted.push_back(info);
+  }
+  for (unsigned i = 0; i < aborted.size(); ++i) {
+    JobInfo *info = aborted[i];
+    LogCvmfs(kLogDownload, kLogDebug, "aborting request %s to proxy %s",
+             info->url->c_str(), info->proxy.c_str());
+    curl_multi_remove_handle(curl_multi_, info->curl_handle);
+    jobs_unanswered_->erase(info);
+    FinishRequest(info, info->curl_handle, CURLE_COULDNT_CONNECT,
+                  still_running);
+  }
+}
+
+
+/**
+ * Finishes the transfers that curl reports as completed.
+ */
+static void ReapTransfers(int *still_running) {
+  CURLMsg *curl_msg;
+  int msgs_in_queue;
+  while ((curl_msg = curl_multi_info_read(curl_multi_, &msgs_in_queue))) {
+    if (curl_msg->msg == CURLMSG_DONE) {
+      // Losers have to be gone before their job can complete
+      CancelHedgeLosers();
+      JobInfo *info;
+      CURL *easy_handle = curl_msg->easy_handle;
+      int curl_error = curl_msg->data.result;
+      curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info);
+      jobs_unanswered_->erase(info);
+
+      if (info->hedge_state == kHedgeRacing) {
+        const bool from_hedge = (easy_handle == info->hedge_handle);
+        if (curl_error != CURLE_OK) {
+          // Failed without a response, the other request carries on
+          DecideHedge(info, !from_hedge);
+          CancelHedgeLosers();
+          continue;
+        }
+        // Completed without a single byte
+        DecideHedge(info, from_hedge);
+        CancelHedgeLosers();
+      }
+
+      curl_multi_remove_handle(curl_multi_, easy_handle);
+      FinishRequest(info, easy_handle, curl_error, still_running);
+    }
+  }
+}
+
+
+/**
+ * Worker thread event loop. Waits on new JobInfo structs in the job queue.
+ * The loop sleeps until a socket is ready, a job arrives, or curl's timer
+ * expires.
+ */
+static void *MainDownload(void *data __attribute__((unused))) {
+  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread started");
+  InitEvents();
+
+  int still_running = 0;
+  bool transferring = false;
+  vector<IoEvent> events;
+  struct timeval timeval_start, timeval_stop;
+  bool terminate = false;
+  while (true) {
+    if (transferring && !still_running) {
+      gettimeofday(&timeval_stop, NULL);
+      stat_transfer_time_ += DiffTimeSeconds(timeval_start, timeval_stop);
+      transferring = false;
+    }
+    int timeout_ms = GetHedgeTimeout();
+    if (curl_deadline_ms_ > 0) {
+      const uint64_t now = GetTimeMs();
+      const int curl_timeout_ms =
+        (curl_deadline_ms_ > now) ? curl_deadline_ms_ - now : 0;
+      if ((timeout_ms < 0) || (curl_timeout_ms < timeout_ms))
+        timeout_ms = curl_timeout_ms;
+    }
+    WaitForEvents(timeout_ms, &events);
+
+    for (unsigned e = 0; e < events.size(); ++e) {
+      // Terminate I/O thread
+      if (events[e].fd == pipe_terminate_[0]) {
+        terminate = true;
+        break;
+      }
+
+      // New jobs arrive, the doorbell has to be cleared before taking them
+      if (events[e].fd == doorbell_[0]) {
+        ClearDoorbell();
+        const vector<JobInfo *> jobs = TakeJobs();
+        for (unsigned i = 0; i < jobs.size(); ++i)
+          jobs_waiting_[jobs[i]->priority].push_back(jobs[i]);
+        continue;
+      }
+
+      // Activity on curl sockets
+      curl_multi_socket_action(curl_multi_, events[e].fd,
+                               events[e].ev_bitmask, &still_running);
+    }
+    if (terminate)
+      break;
+    HandleCurlTimer(&still_running);
+    LaunchHedges(&still_running);
+
+    // New jobs and jobs that waited for a free slot of their class.  A job
+    // can complete already while it is started (e.g. on a cached connection),
+    // so completions are collected again until no more jobs start.
+    unsigned num_started;
+    do {
+      ReapTransfers(&still_running);
+      CancelHedgeLosers();
+      AbortTrippedRequests(&still_running);
+      num_started = StartWaitingJobs(&still_running);
+      if ((num_started > 0) && !transferring) {
+        gettimeofday(&timeval_start, NULL);
+        transferring = true;
+      }
+    } while (num_started > 0);
+  }
+
+  for (set<CURL *>::iterator i = pool_handles_inuse_->begin(),
+       iEnd = pool_handles_inuse_->end(); i != iEnd; ++i)
+  {
+    curl_multi_remove_handle(curl_multi_, *i);
+    curl_multi_cleanup(*i);
+  }
+  pool_handles_inuse_->clear();
+  FiniEvents();
+
+  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread terminated");
+  return NULL;
+}
+
+
+/**
+ * Moves the host with the lowest round trip time to the front of the chain,
+ * provided it is faster than the active host by a margin.  The hysteresis
+ * prevents flapping between hosts of similar distance.
+ */
+static void ReorderHosts() {
+  pthread_mutex_lock(&lock_options_);
+  if (!opt_host_chain_ || (opt_host_chain_->size() < 2)) {
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
+  const vector<int> &rtt = *opt_host_chain_rtt_;
+  int best = -1;
+  for (unsigned i = 0; i < rtt.size(); ++i) {
+    if ((rtt[i] >= 0) && ((best < 0) || (rtt[i] < rtt[best])))
+      best = i;
+  }
+  const int current = opt_host_chain_current_;
+  if ((best < 0) || (best == current) ||
+      ((rtt[current] >= 0) &&
+       ((rtt[current] - rtt[best] < kHostMinGainMs) ||
+        (rtt[best] * 100 > rtt[current] * (100 - kHostHysteresisPercent)))))
+  {
+    pthread_mutex_unlock(&lock_options_);
+    return;
+  }
+
+  // Stable sort by round trip time, unknown and failed hosts go last
+  vector<unsigned> order;
+  for (unsigned i = 0; i < rtt.size(); ++i) {
+    unsigned pos = order.size();
+    while ((pos > 0) && (rtt[i] >= 0) &&
+           ((rtt[order[pos-1]] < 0) || (rtt[order[pos-1]] > rtt[i])))
+    {
+      --pos;
+    }
+    order.insert(order.begin() + pos, i);
+  }
+  vector<string> *host_chain = new vector<string>();
+  vector<int> *host_rtt = new vector<int>();
+  vector<int> *host_speed = new vector<int>();
+  for (unsigned i = 0; i < order.size(); ++i) {
+    host_chain->push_back((*opt_host_chain_)[order[i]]);
+    host_rtt->push_back((*opt_host_chain_rtt_)[order[i]]);
+    host_speed->push_back((*opt_host_chain_speed_)[order[i]]);
+  }
+  LogCvmfs(kLogDownload, kLogDebug | kLogSyslog,
+           "switching from host %s (%d ms) to host %s (%d ms)",
+           (*opt_host_chain_)[current].c_str(), rtt[current],
+           (*host_chain)[0].c_str(), (*host_rtt)[0]);
+  delete opt_host_chain_;
+  delete opt_host_chain_rtt_;
+  delete opt_host_chain_speed_;
+  opt_host_chain_ = host_chain;
+  opt_host_chain_rtt_ = host_rtt;
+  opt_host_chain_speed_ = host_speed;
+  opt_host_chain_current_ = 0;
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Sends a HEAD request to every host of the chain every
+ * opt_host_probe_interval_ seconds.  Successful probes update the estimates
+ * through VerifyAndFinalize(), failed probes mark the host down.
+ */
+static void *MainHostProbe(void *data __attribute__((unused))) {
+  LogCvmfs(kLogDownload, kLogDebug, "host probe thread started");
+  while (true) {
+    vector<string> host_chain;
+    pthread_mutex_lock(&lock_options_);
+    const unsigned interval = opt_host_probe_interval_;
+    if (opt_host_chain_)
+      host_chain = *opt_host_chain_;
+    pthread_mutex_unlock(&lock_options_);
+
+    for (unsigned i = 0; i < host_chain.size(); ++i) {
+      const string url = host_chain[i] + "/.cvmfspublished";
+      JobInfo info(&url, false);
+      info.priority = kPriorityMetadata;
+      if (Fetch(&info) == kFailOk)
+        continue;
+      LogCvmfs(kLogDownload, kLogDebug, "host probe of %s failed (%d)",
+               url.c_str(), info.error_code);
+      pthread_mutex_lock(&lock_options_);
+      if (opt_host_chain_ && (i < opt_host_chain_->size()) &&
+          ((*opt_host_chain_)[i] == host_chain[i]))
+      {
+        (*opt_host_chain_rtt_)[i] = -2;
+        (*opt_host_chain_speed_)[i] = -1;
       }
-      break;
-    default:
+      pthread_mutex_unlock(&lock_options_);
+    }
+    ReorderHosts();
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + interval;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    pthread_mutex_lock(&lock_host_probe_);
+    while (!host_probe_terminate_) {
+      if (pthread_cond_timedwait(&cond_host_probe_, &lock_host_probe_,
+                                 &deadline) == ETIMEDOUT)
+      {
+        break;
+      }
+    }
+    const bool terminate = host_probe_terminate_;
+    pthread_mutex_unlock(&lock_host_probe_);
+    if (terminate)
       break;
   }
+  LogCvmfs(kLogDownload, kLogDebug, "host probe thread stopped");
+  return NULL;
+}
 
-  return 0;
+
+static void StopHostProbe() {
+  if (!host_probe_running_)
+    return;
+  pthread_mutex_lock(&lock_host_probe_);
+  host_probe_terminate_ = true;
+  pthread_cond_signal(&cond_host_probe_);
+  pthread_mutex_unlock(&lock_host_probe_);
+  pthread_join(thread_host_probe_, NULL);
+  host_probe_running_ = false;
 }
 
 
 /**
- * Worker thread event loop. Waits on new JobInfo structs on a pipe.
+ * Resolves a host with the system resolver into its addresses, in the order
+ * of preference.
  */
-static void *MainDownload(void *data __attribute__((unused))) {
-  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread started");
+static bool ResolveHost(const string &host, vector<string> *addresses) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *result = NULL;
+  if (getaddrinfo(host.c_str(), NULL, &hints, &result) != 0)
+    return false;
+  addresses->clear();
+  char buf[INET6_ADDRSTRLEN];
+  for (struct addrinfo *a = result; a; a = a->ai_next) {
+    const void *addr = NULL;
+    if (a->ai_family == AF_INET)
+      addr = &(reinterpret_cast<struct sockaddr_in *>(a->ai_addr)->sin_addr);
+    else if (a->ai_family == AF_INET6)
+      addr = &(reinterpret_cast<struct sockaddr_in6 *>(a->ai_addr)->sin6_addr);
+    if (addr && inet_ntop(a->ai_family, addr, buf, sizeof(buf)) &&
+        (find(addresses->begin(), addresses->end(), string(buf)) ==
+         addresses->end()))
+    {
+      addresses->push_back(buf);
+    }
+  }
+  freeaddrinfo(result);
+  return !addresses->empty();
+}
 
-  watch_fds_ = static_cast<struct pollfd *>(smalloc(2 * sizeof(struct pollfd)));
-  watch_fds_size_ = 2;
-  watch_fds_[0].fd = pipe_terminate_[0];
-  watch_fds_[0].events = POLLIN | POLLPRI;
-  watch_fds_[0].revents = 0;
-  watch_fds_[1].fd = pipe_jobs_[0];
-  watch_fds_[1].events = POLLIN | POLLPRI;
-  watch_fds_[1].revents = 0;
-  watch_fds_inuse_ = 2;
 
-  int still_running = 0;
-  struct timeval timeval_start, timeval_stop;
-  gettimeofday(&timeval_start, NULL);
-  while (true) {
-    int timeout;
-    if (still_running) {
-      timeout = 1;
-    } else {
-      timeout = -1;
-      gettimeofday(&timeval_stop, NULL);
-      stat_transfer_time_ += DiffTimeSeconds(timeval_start, timeval_stop);
+/**
+ * Resolves new endpoints as soon as they are queued and refreshes the known
+ * ones before they expire.  Endpoints that have not been used for
+ * kDnsExpireTtls TTLs are dropped.
+ */
+static void *MainDnsRefresh(void *data __attribute__((unused))) {
+  LogCvmfs(kLogDownload, kLogDebug, "dns refresh thread started");
+  const uint64_t ttl_ms = uint64_t(opt_dns_ttl_) * 1000;
+  pthread_mutex_lock(&lock_dns_cache_);
+  while (!dns_refresh_terminate_) {
+    const uint64_t now = GetTimeMs();
+    uint64_t next_ms = now + ttl_ms;
+    vector<string> endpoints;
+    vector<DnsEntry> entries;
+    map<string, DnsEntry>::iterator i = dns_cache_->begin();
+    while (i != dns_cache_->end()) {
+      if ((now > i->second.last_used_ms) &&
+          (now - i->second.last_used_ms > kDnsExpireTtls * ttl_ms))
+      {
+        dns_cache_->erase(i++);
+        continue;
+      }
+      if (i->second.refresh_ms <= now) {
+        endpoints.push_back(i->first);
+        entries.push_back(i->second);
+      } else {
+        next_ms = min(next_ms, i->second.refresh_ms);
+      }
+      ++i;
     }
-    int retval = poll(watch_fds_, watch_fds_inuse_, timeout);
-    if (errno == -1) {
+
+    if (endpoints.empty()) {
+      struct timespec deadline;
+      deadline.tv_sec = next_ms / 1000;
+      deadline.tv_nsec = (next_ms % 1000) * 1000 * 1000;
+      pthread_cond_timedwait(&cond_dns_cache_, &lock_dns_cache_, &deadline);
       continue;
     }
+    pthread_mutex_unlock(&lock_dns_cache_);
 
-    // Handle timeout
-    if (retval == 0) {
-      retval = curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
-                                        &still_running);
+    for (unsigned e = 0; e < endpoints.size(); ++e) {
+      vector<string> addresses;
+      const uint64_t time_start = GetTimeMs();
+      const bool retval = ResolveHost(entries[e].host, &addresses);
+      const uint64_t time_end = GetTimeMs();
+      if (!retval) {
+        LogCvmfs(kLogDownload, kLogDebug, "failed to resolve %s",
+                 entries[e].host.c_str());
+      }
+
+      pthread_mutex_lock(&lock_endpoint_stats_);
+      EndpointStatistics *stats = entries[e].is_proxy ?
+        &(*stats_proxies_)[endpoints[e]] : &(*stats_hosts_)[endpoints[e]];
+      stats->num_resolves++;
+      if (!retval)
+        stats->num_resolve_failures++;
+      stats->resolve_ms[GetHistogramBin(time_end - time_start)]++;
+      pthread_mutex_unlock(&lock_endpoint_stats_);
+
+      pthread_mutex_lock(&lock_dns_cache_);
+      map<string, DnsEntry>::iterator entry = dns_cache_->find(endpoints[e]);
+      if (entry != dns_cache_->end()) {
+        if (retval) {
+          entry->second.addresses = addresses;
+          entry->second.expires_ms = time_end + ttl_ms;
+          entry->second.refresh_ms = time_end + ttl_ms * 3 / 4;
+        } else {
+          entry->second.refresh_ms = time_end + ttl_ms / 4;
+        }
+      }
+      pthread_mutex_unlock(&lock_dns_cache_);
     }
+    pthread_mutex_lock(&lock_dns_cache_);
+  }
+  pthread_mutex_unlock(&lock_dns_cache_);
+  LogCvmfs(kLogDownload, kLogDebug, "dns refresh thread stopped");
+  return NULL;
+}
 
-    // Terminate I/O thread
-    if (watch_fds_[0].revents)
-      break;
 
-    // New job arrives
-    if (watch_fds_[1].revents) {
-      watch_fds_[1].revents = 0;
-      JobInfo *info;
-      ReadPipe(pipe_jobs_[0], &info, sizeof(info));
-      //LogCvmfs(kLogDownload, kLogDebug, "IO thread, got job: url %s, compressed %d, nocache %d, destination %d, file %p, expected hash %p, wait at %d", info->url->c_str(), info->compressed, info->nocache,
-      //         info->destination, info->destination_file, info->expected_hash, info->wait_at[1]);
+static void StopDnsRefresh() {
+  if (!dns_refresh_running_)
+    return;
+  pthread_mutex_lock(&lock_dns_cache_);
+  dns_refresh_terminate_ = true;
+  pthread_cond_signal(&cond_dns_cache_);
+  pthread_mutex_unlock(&lock_dns_cache_);
+  pthread_join(thread_dns_refresh_, NULL);
+  dns_refresh_running_ = false;
+}
 
-      if (!still_running)
-        gettimeofday(&timeval_start, NULL);
-      CURL *handle = AcquireCurlHandle();
-      InitializeRequest(info, handle);
-      SetUrlOptions(info);
-      curl_multi_add_handle(curl_multi_, handle);
-      retval = curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
-                                        &still_running);
-      //LogCvmfs(kLogDownload, kLogDebug, "socket action returned with %d, still_running %d", retval, still_running);
-    }
 
-    // Activity on curl sockets
-    for (unsigned i = 2; i < watch_fds_inuse_; ++i) {
-      if (watch_fds_[i].revents) {
-        int ev_bitmask = 0;
-        if (watch_fds_[i].revents & (POLLIN | POLLPRI))
-          ev_bitmask |= CURL_CSELECT_IN;
-        if (watch_fds_[i].revents & (POLLOUT | POLLWRBAND))
-          ev_bitmask |= CURL_CSELECT_IN;
-        if (watch_fds_[i].revents & (POLLERR | POLLHUP | POLLNVAL))
-          ev_bitmask |= CURL_CSELECT_ERR;
-        watch_fds_[i].revents = 0;
-
-        retval = curl_multi_socket_action(curl_multi_, watch_fds_[i].fd,
-                                          ev_bitmask, &still_running);
-        //LogCvmfs(kLogDownload, kLogDebug, "socket action on socket %d, returned with %d, still_running %d", watch_fds_[i].fd, retval, still_running);
-      }
+/**
+ * Sends a HEAD request through the proxy, bypassing the I/O thread.  Any
+ * response counts.
+ */
+static bool ProbeProxy(const string &proxy, const string &url,
+                       const unsigned timeout)
+{
+  CURL *handle = curl_easy_init();
+  assert(handle != NULL);
+  curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
+  curl_easy_setopt(handle, CURLOPT_NOBODY, 1);
+  curl_easy_setopt(handle, CURLOPT_PROXY, proxy.c_str());
+  curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, timeout);
+  curl_easy_setopt(handle, CURLOPT_TIMEOUT, 2*timeout);
+  curl_easy_setopt(handle, CURLOPT_HTTPHEADER, http_headers_);
+  curl_easy_setopt(handle, CURLOPT_URL, EscapeUrl(url).c_str());
+  const CURLcode result = curl_easy_perform(handle);
+  curl_easy_cleanup(handle);
+  return result == CURLE_OK;
+}
+
+
+/**
+ * Probes the proxies whose circuit breaker is open once their backoff window
+ * passed.  A proxy that answers is used again, otherwise its backoff doubles
+ * up to kMaxBreakerBackoff.
+ */
+static void *MainProxyProbe(void *data __attribute__((unused))) {
+  LogCvmfs(kLogDownload, kLogDebug, "proxy probe thread started");
+  while (true) {
+    vector<string> due;
+    string url;
+    pthread_mutex_lock(&lock_options_);
+    uint64_t now = GetTimeMs();
+    for (map<string, CircuitBreaker>::const_iterator i = breakers_->begin(),
+         iEnd = breakers_->end(); i != iEnd; ++i)
+    {
+      if ((i->second.open_until_ms > 0) && (i->second.open_until_ms <= now))
+        due.push_back(i->first);
+    }
+    // Hosts with placeholders have no repository to probe
+    if (opt_host_chain_ &&
+        ((*opt_host_chain_)[opt_host_chain_current_].find('@') == string::npos))
+    {
+      url = (*opt_host_chain_)[opt_host_chain_current_] + "/.cvmfspublished";
     }
+    const unsigned timeout = opt_timeout_proxy_;
+    pthread_mutex_unlock(&lock_options_);
 
-    // Check if transfers are completed
-    CURLMsg *curl_msg;
-    int msgs_in_queue;
-    while ((curl_msg = curl_multi_info_read(curl_multi_, &msgs_in_queue))) {
-      if (curl_msg->msg == CURLMSG_DONE) {
-        JobInfo *info;
-        CURL *easy_handle = curl_msg->easy_handle;
-        int curl_error = curl_msg->data.result;
-        curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, &info);
-        //LogCvmfs(kLogDownload, kLogDebug, "Done message for %s", info->url->c_str());
-
-        curl_multi_remove_handle(curl_multi_, easy_handle);
-        if (VerifyAndFinalize(curl_error, info)) {
-          curl_multi_add_handle(curl_multi_, easy_handle);
-          retval = curl_multi_socket_action(curl_multi_, CURL_SOCKET_TIMEOUT, 0,
-                                            &still_running);
+    for (unsigned i = 0; i < due.size(); ++i) {
+      // Without a host, regular requests have to find out
+      const bool reachable = (url == "") || ProbeProxy(due[i], url, timeout);
+      pthread_mutex_lock(&lock_options_);
+      map<string, CircuitBreaker>::iterator breaker = breakers_->find(due[i]);
+      if ((breaker != breakers_->end()) &&
+          (breaker->second.open_until_ms > 0))
+      {
+        if (reachable) {
+          LogCvmfs(kLogDownload, kLogDebug | kLogSyslog,
+                   "proxy %s is reachable again", due[i].c_str());
+          breakers_->erase(breaker);
         } else {
-          // Return easy handle into pool and write result back
-          ReleaseCurlHandle(easy_handle);
-
-          WritePipe(info->wait_at[1], &info->error_code,
-                    sizeof(info->error_code));
+          breaker->second.backoff = min(2 * breaker->second.backoff,
+                                        kMaxBreakerBackoff);
+          breaker->second.open_until_ms =
+            GetTimeMs() + breaker->second.backoff * 1000;
+          LogCvmfs(kLogDownload, kLogDebug, "probe of proxy %s failed, "
+                   "skipping it for %u seconds", due[i].c_str(),
+                   breaker->second.backoff);
         }
       }
+      pthread_mutex_unlock(&lock_options_);
     }
-  }
 
-  for (set<CURL *>::iterator i = pool_handles_inuse_->begin(),
-       iEnd = pool_handles_inuse_->end(); i != iEnd; ++i)
-  {
-    curl_multi_remove_handle(curl_multi_, *i);
-    curl_multi_cleanup(*i);
+    // Sleep until the next backoff window passes or a breaker opens
+    uint64_t deadline_ms = 0;
+    pthread_mutex_lock(&lock_options_);
+    for (map<string, CircuitBreaker>::const_iterator i = breakers_->begin(),
+         iEnd = breakers_->end(); i != iEnd; ++i)
+    {
+      if ((i->second.open_until_ms > 0) &&
+          ((deadline_ms == 0) || (i->second.open_until_ms < deadline_ms)))
+      {
+        deadline_ms = i->second.open_until_ms;
+      }
+    }
+    pthread_mutex_unlock(&lock_options_);
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ms / 1000;
+    deadline.tv_nsec = (deadline_ms % 1000) * 1000 * 1000;
+    pthread_mutex_lock(&lock_proxy_probe_);
+    while (!proxy_probe_terminate_ && !proxy_probe_wakeup_) {
+      if (deadline_ms == 0) {
+        pthread_cond_wait(&cond_proxy_probe_, &lock_proxy_probe_);
+      } else if (pthread_cond_timedwait(&cond_proxy_probe_, &lock_proxy_probe_,
+                                        &deadline) == ETIMEDOUT)
+      {
+        break;
+      }
+    }
+    proxy_probe_wakeup_ = false;
+    const bool terminate = proxy_probe_terminate_;
+    pthread_mutex_unlock(&lock_proxy_probe_);
+    if (terminate)
+      break;
   }
-  pool_handles_inuse_->clear();
-
-  LogCvmfs(kLogDownload, kLogDebug, "download I/O thread terminated");
+  LogCvmfs(kLogDownload, kLogDebug, "proxy probe thread stopped");
   return NULL;
 }
 
 
+static void StopProxyProbe() {
+  if (!proxy_probe_running_)
+    return;
+  pthread_mutex_lock(&lock_proxy_probe_);
+  proxy_probe_terminate_ = true;
+  pthread_cond_signal(&cond_proxy_probe_);
+  pthread_mutex_unlock(&lock_proxy_probe_);
+  pthread_join(thread_proxy_probe_, NULL);
+  proxy_probe_running_ = false;
+}
+
+
 void Init(const unsigned max_pool_handles) {
   atomic_init32(&multi_threaded_);
   int retval = curl_global_init(CURL_GLOBAL_ALL);
   assert(retval == CURLE_OK);
+  dns_multi_address_ =
+    curl_version_info(CURLVERSION_NOW)->version_num >= 0x073b00;
   pool_handles_idle_ = new set<CURL *>;
   pool_handles_inuse_ = new set<CURL *>;
   pool_max_handles_ = max_pool_handles;
@@ -938,9 +3032,37 @@ void Init(const unsigned max_pool_handles) {
   opt_proxy_groups_current_burned_ = 0;
   opt_num_proxies_ = 0;
   opt_host_chain_current_ = 0;
+  opt_host_probe_interval_ = 0;
+  opt_hedge_percentile_ = 0;
+  opt_breaker_threshold_ = kDefaultBreakerThreshold;
+  opt_priority_slots_[kPriorityMetadata] = 0;
+  opt_priority_slots_[kPriorityInteractive] = 0;
+  opt_priority_slots_[kPriorityBulk] = max(max_pool_handles / 4, 1U);
+
+  jobs_unanswered_ = new set<JobInfo *>;
+  jobs_waiting_ = new deque<JobInfo *>[kNumPriorities];
+  for (unsigned p = 0; p < kNumPriorities; ++p)
+    jobs_active_[p] = 0;
+  breakers_ = new map<string, CircuitBreaker>;
+  breakers_tripped_ = new vector<string>;
+  stats_proxies_ = new map<string, EndpointStatistics>;
+  stats_hosts_ = new map<string, EndpointStatistics>;
+  buffer_pool_ = new vector<char *>[kMaxBufferClass + 1];
+  hedge_losers_ = new vector<JobInfo *>;
+  http1_endpoints_ = new set<string>;
+  opt_http2_ = false;
+  dns_cache_ = new map<string, DnsEntry>;
+  opt_dns_ttl_ = 0;
+  num_latency_samples_ = next_latency_sample_ = 0;
+  hedge_delay_ms_ = 0;
 
   stat_transferred_bytes_ = 0.0;
   stat_transfer_time_ = 0.0;
+  atomic_init64(&stat_hedges_fired_);
+  atomic_init64(&stat_hedges_won_);
+  atomic_init64(&stat_http2_requests_);
+  atomic_init64(&stat_dns_hits_);
+  atomic_init64(&stat_dns_misses_);
 
   // Prepare HTTP headers
   string custom_header;
@@ -963,6 +3085,7 @@ void Init(const unsigned max_pool_handles) {
   curl_multi_ = curl_multi_init();
   assert(curl_multi_ != NULL);
   curl_multi_setopt(curl_multi_, CURLMOPT_SOCKETFUNCTION, CallbackCurlSocket);
+  curl_multi_setopt(curl_multi_, CURLMOPT_TIMERFUNCTION, CallbackCurlTimer);
   curl_multi_setopt(curl_multi_, CURLMOPT_MAXCONNECTS, watch_fds_max_);
   //curl_multi_setopt(curl_multi_, CURLMOPT_PIPELINING, 1);
 
@@ -974,6 +3097,10 @@ void Init(const unsigned max_pool_handles) {
 
 
 void Fini() {
+  // Probes need the I/O thread
+  StopHostProbe();
+  StopProxyProbe();
+  StopDnsRefresh();
   if (atomic_xadd32(&multi_threaded_, 0) == 1) {
     // Shutdown I/O thread
     char buf = 'T';
@@ -982,8 +3109,8 @@ void Fini() {
     // All handles are removed from the multi stack
     close(pipe_terminate_[1]);
     close(pipe_terminate_[0]);
-    close(pipe_jobs_[1]);
-    close(pipe_jobs_[0]);
+    CloseDoorbell();
+    StopPipeline();
   }
 
   for (set<CURL *>::iterator i = pool_handles_idle_->begin(),
@@ -993,20 +3120,49 @@ void Fini() {
   }
   delete pool_handles_idle_;
   delete pool_handles_inuse_;
+  delete jobs_unanswered_;
+  delete[] jobs_waiting_;
+  delete hedge_losers_;
+  delete http1_endpoints_;
+  delete dns_cache_;
+  delete breakers_;
+  delete breakers_tripped_;
+  delete stats_proxies_;
+  delete stats_hosts_;
+  pthread_mutex_lock(&lock_buffer_pool_);
+  for (unsigned i = 0; i <= kMaxBufferClass; ++i) {
+    for (unsigned j = 0; j < buffer_pool_[i].size(); ++j)
+      free(buffer_pool_[i][j]);
+  }
+  delete[] buffer_pool_;
+  buffer_pool_ = NULL;
+  buffer_pool_bytes_ = 0;
+  pthread_mutex_unlock(&lock_buffer_pool_);
   curl_slist_free_all(http_headers_);
   curl_slist_free_all(http_headers_nocache_);
   curl_multi_cleanup(curl_multi_);
   pool_handles_idle_ = NULL;
   pool_handles_inuse_ = NULL;
+  jobs_unanswered_ = NULL;
+  jobs_waiting_ = NULL;
+  hedge_losers_ = NULL;
+  http1_endpoints_ = NULL;
+  dns_cache_ = NULL;
+  breakers_ = NULL;
+  breakers_tripped_ = NULL;
+  stats_proxies_ = NULL;
+  stats_hosts_ = NULL;
   http_headers_ = NULL;
   http_headers_nocache_ = NULL;
   curl_multi_ = NULL;
 
   delete opt_host_chain_;
   delete opt_host_chain_rtt_;
+  delete opt_host_chain_speed_;
   delete opt_proxy_groups_;
   opt_host_chain_ = NULL;
   opt_host_chain_rtt_ = NULL;
+  opt_host_chain_speed_ = NULL;
   opt_proxy_groups_ = NULL;
 
   curl_global_cleanup();
@@ -1019,12 +3175,35 @@ void Fini() {
  */
 void Spawn() {
   MakePipe(pipe_terminate_);
-  MakePipe(pipe_jobs_);
+  MakeDoorbell();
+  StartPipeline();
 
   int retval = pthread_create(&thread_download_, NULL, MainDownload, NULL);
   assert(retval == 0);
 
   atomic_inc32(&multi_threaded_);
+
+  if (opt_host_probe_interval_ > 0) {
+    host_probe_terminate_ = false;
+    retval = pthread_create(&thread_host_probe_, NULL, MainHostProbe, NULL);
+    assert(retval == 0);
+    host_probe_running_ = true;
+  }
+
+  if (opt_breaker_threshold_ > 0) {
+    proxy_probe_terminate_ = false;
+    proxy_probe_wakeup_ = false;
+    retval = pthread_create(&thread_proxy_probe_, NULL, MainProxyProbe, NULL);
+    assert(retval == 0);
+    proxy_probe_running_ = true;
+  }
+
+  if (opt_dns_ttl_ > 0) {
+    dns_refresh_terminate_ = false;
+    retval = pthread_create(&thread_dns_refresh_, NULL, MainDnsRefresh, NULL);
+    assert(retval == 0);
+    dns_refresh_running_ = true;
+  }
 }
 
 
@@ -1085,6 +3264,305 @@ uint64_t GetTransferTime() {
 }
 
 
+/**
+ * Sends a duplicate of a request to another proxy of the load-balancing group
+ * if there is no response within the given percentile (1-99) of the recent
+ * times to first byte.  The first response wins, the other request is
+ * cancelled.  0 switches hedging off.
+ */
+void SetHedging(const unsigned percentile) {
+  pthread_mutex_lock(&lock_options_);
+  opt_hedge_percentile_ = min(percentile, 99U);
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Requests HTTP/2 from proxies and hosts, so that concurrent small transfers
+ * share a few multiplexed connections.  Endpoints that don't speak HTTP/2
+ * fall back to HTTP/1.1 individually.  Has to be set before Spawn().
+ *
+ * \return false if libcurl lacks HTTP/2 support
+ */
+bool SetHttp2(const bool value) {
+#ifdef CVMFS_HTTP2_SUPPORT
+  if (value &&
+      !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+  {
+    return false;
+  }
+  pthread_mutex_lock(&lock_options_);
+  opt_http2_ = value;
+  curl_multi_setopt(curl_multi_, CURLMOPT_PIPELINING,
+                    value ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+  pthread_mutex_unlock(&lock_options_);
+  return true;
+#else
+  return !value;
+#endif
+}
+
+
+/**
+ * Caches the addresses of proxies and hosts for the given number of seconds
+ * and refreshes them in the background.  The system resolver does not
+ * report TTLs, so the same TTL holds for all endpoints.  Has to be set before
+ * Spawn(), 0 switches the cache off.
+ */
+void SetDnsCache(const unsigned ttl_seconds) {
+  pthread_mutex_lock(&lock_options_);
+  opt_dns_ttl_ = ttl_seconds;
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Number of consecutive connection failures after which a proxy is skipped
+ * until a background probe gets through.  0 switches the circuit breakers
+ * off.  Has to be set before Spawn().
+ */
+void SetProxyFailureLimit(const unsigned num_failures) {
+  pthread_mutex_lock(&lock_options_);
+  opt_breaker_threshold_ = num_failures;
+  if (num_failures == 0)
+    breakers_->clear();
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Maximum number of concurrent transfers of a priority class, 0 is
+ * unlimited.  Jobs beyond the limit wait in the I/O thread.  By default, only
+ * bulk transfers are limited.
+ */
+void SetPrioritySlots(const Priority priority, const unsigned num_slots) {
+  assert(priority < kNumPriorities);
+  pthread_mutex_lock(&lock_options_);
+  opt_priority_slots_[priority] = num_slots;
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Lists the proxies with an open circuit breaker.
+ */
+string GetBlockedProxies() {
+  string result;
+  pthread_mutex_lock(&lock_options_);
+  const uint64_t now = GetTimeMs();
+  for (map<string, CircuitBreaker>::const_iterator i = breakers_->begin(),
+       iEnd = breakers_->end(); i != iEnd; ++i)
+  {
+    if (i->second.open_until_ms == 0)
+      continue;
+    result += "  " + i->first + ": " + StringifyInt(i->second.num_failures) +
+              " connection failures, next probe in " +
+              StringifyInt((i->second.open_until_ms > now) ?
+                           (i->second.open_until_ms - now) / 1000 : 0) +
+              "s\n";
+  }
+  pthread_mutex_unlock(&lock_options_);
+  return result;
+}
+
+
+/**
+ * Number of threads that decompress and hash file downloads off the I/O
+ * thread, at most kMaxPipelineThreads.  0 does it in the I/O thread.  Has to
+ * be set before Spawn().
+ */
+void SetPipelineThreads(const unsigned num_threads) {
+  opt_pipeline_threads_ = min(num_threads, kMaxPipelineThreads);
+}
+
+
+/**
+ * Number of duplicate requests sent to another proxy.
+ */
+uint64_t GetNumHedgesFired() {
+  return atomic_read64(&stat_hedges_fired_);
+}
+
+
+/**
+ * Number of duplicate requests that answered before the original request.
+ */
+uint64_t GetNumHedgesWon() {
+  return atomic_read64(&stat_hedges_won_);
+}
+
+
+uint64_t GetNumHttp2Requests() {
+  return atomic_read64(&stat_http2_requests_);
+}
+
+
+/**
+ * Number of requests that used an address from the DNS cache.
+ */
+uint64_t GetNumDnsHits() {
+  return atomic_read64(&stat_dns_hits_);
+}
+
+
+/**
+ * Number of requests that had to resolve the proxy or host in curl.
+ */
+uint64_t GetNumDnsMisses() {
+  return atomic_read64(&stat_dns_misses_);
+}
+
+
+static string PrintHistogram(const uint64_t *bins) {
+  string result;
+  for (unsigned i = 0; i < kNumHistogramBins; ++i) {
+    if (bins[i] == 0)
+      continue;
+    if (i == 0)
+      result += " <1:";
+    else if (i == kNumHistogramBins - 1)
+      result += " >=" + StringifyInt(1 << (i-1)) + ":";
+    else
+      result += " " + StringifyInt(1 << (i-1)) + "-" + StringifyInt(1 << i) +
+                ":";
+    result += StringifyInt(bins[i]);
+  }
+  return (result == "") ? " none" : result;
+}
+
+
+static string PrintEndpointStatistics(
+  const map<string, EndpointStatistics> &endpoints)
+{
+  const char *failure_names[] = { "ok", "local I/O", "bad URL", "proxy",
+                                  "host", "bad data", "other" };
+  string result;
+  pthread_mutex_lock(&lock_endpoint_stats_);
+  for (map<string, EndpointStatistics>::const_iterator i = endpoints.begin(),
+       iEnd = endpoints.end(); i != iEnd; ++i)
+  {
+    const EndpointStatistics &stats = i->second;
+    result += "  " + i->first + ": requests " +
+              StringifyInt(stats.num_requests) + ", " +
+              StringifyInt(stats.num_bytes / 1024) + " kB, errors:";
+    bool has_failures = false;
+    for (unsigned f = kFailOk + 1; f <= kFailOther; ++f) {
+      if (stats.num_failures[f] == 0)
+        continue;
+      result += string(" ") + failure_names[f] + " " +
+                StringifyInt(stats.num_failures[f]);
+      has_failures = true;
+    }
+    if (!has_failures)
+      result += " none";
+    result += "\n    time to first byte (ms):" +
+              PrintHistogram(stats.ttfb_ms) + "\n" +
+              "    throughput (kB/s):" + PrintHistogram(stats.throughput_kbs) +
+              "\n";
+    if (stats.num_resolves > 0) {
+      result += "    name resolution (ms):" +
+                PrintHistogram(stats.resolve_ms) + ", failures " +
+                StringifyInt(stats.num_resolve_failures) + "\n";
+    }
+  }
+  pthread_mutex_unlock(&lock_endpoint_stats_);
+  return result;
+}
+
+
+/**
+ * Per-proxy transfer statistics, one entry per proxy that was used.
+ */
+string GetProxyStatistics() {
+  return PrintEndpointStatistics(*stats_proxies_);
+}
+
+
+/**
+ * Per-host transfer statistics, one entry per host that was used.
+ */
+string GetHostStatistics() {
+  return PrintEndpointStatistics(*stats_hosts_);
+}
+
+
+/**
+ * Transfer counters in total and per proxy and host.  Samples of a metric
+ * have to be consecutive, so the endpoints are traversed per metric.
+ */
+void GetMetrics(MetricsWriter *metrics) {
+  metrics->Counter("download_bytes_total", "Transferred bytes",
+                   GetTransferredBytes());
+  metrics->Counter("download_seconds_total", "Time spent in transfers",
+                   GetTransferTime());
+  metrics->Counter("download_hedges_total", "Hedged requests sent",
+                   GetNumHedgesFired());
+  metrics->Counter("download_hedges_won_total",
+                   "Hedged requests that answered first", GetNumHedgesWon());
+  metrics->Counter("download_http2_requests_total",
+                   "Requests answered with HTTP/2", GetNumHttp2Requests());
+  metrics->Counter("download_dns_hits_total",
+                   "Requests with a cached proxy or host address",
+                   GetNumDnsHits());
+  metrics->Counter("download_dns_misses_total",
+                   "Requests without a cached proxy or host address",
+                   GetNumDnsMisses());
+
+  const char *failure_names[] = { "ok", "local_io", "bad_url", "proxy",
+                                  "host", "bad_data", "other" };
+  const map<string, EndpointStatistics> *endpoints[2] =
+    { stats_proxies_, stats_hosts_ };
+  const char *types[2] = { "proxy", "host" };
+  pthread_mutex_lock(&lock_endpoint_stats_);
+  for (unsigned metric = 0; metric < 4; ++metric) {
+    for (unsigned t = 0; t < 2; ++t) {
+      for (map<string, EndpointStatistics>::const_iterator
+           i = endpoints[t]->begin(), iEnd = endpoints[t]->end(); i != iEnd;
+           ++i)
+      {
+        const string labels = MetricsWriter::Label("type", types[t]) + "," +
+                              MetricsWriter::Label("endpoint", i->first);
+        if (metric == 0) {
+          metrics->Counter("download_endpoint_requests_total",
+                           "Requests per proxy and host",
+                           i->second.num_requests, labels);
+        } else if (metric == 1) {
+          metrics->Counter("download_endpoint_bytes_total",
+                           "Transferred bytes per proxy and host",
+                           i->second.num_bytes, labels);
+        } else if (metric == 2) {
+          if (i->second.num_resolves == 0)
+            continue;
+          metrics->Counter("download_endpoint_resolves_total",
+                           "Name resolutions per proxy and host",
+                           i->second.num_resolves, labels);
+        } else {
+          for (unsigned f = kFailOk + 1; f <= kFailOther; ++f) {
+            metrics->Counter("download_endpoint_failures_total",
+                             "Failed requests per proxy and host",
+                             i->second.num_failures[f],
+                             labels + "," +
+                             MetricsWriter::Label("reason", failure_names[f]));
+          }
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&lock_endpoint_stats_);
+
+  vector<string> host_chain;
+  vector<int> rtt;
+  unsigned current_host = 0;
+  GetHostInfo(&host_chain, &rtt, &current_host);
+  for (unsigned i = 0; i < host_chain.size(); ++i) {
+    if (rtt[i] < 0)
+      continue;
+    metrics->Gauge("download_host_rtt_ms", "Round trip time of the hosts",
+                   rtt[i], MetricsWriter::Label("host", host_chain[i]));
+  }
+}
+
+
 /**
  * Parses a list of ';'-separated hosts for the host chain.  The empty string
  * removes the host list.
@@ -1093,19 +3571,55 @@ void SetHostChain(const string &host_list) {
   pthread_mutex_lock(&lock_options_);
   delete opt_host_chain_;
   delete opt_host_chain_rtt_;
+  delete opt_host_chain_speed_;
   opt_host_chain_current_ = 0;
 
   if (host_list == "") {
     opt_host_chain_ = NULL;
     opt_host_chain_rtt_ = NULL;
+    opt_host_chain_speed_ = NULL;
     pthread_mutex_unlock(&lock_options_);
     return;
   }
 
   opt_host_chain_ = new vector<string>(SplitString(host_list, ';'));
-  opt_host_chain_rtt_ = new vector<int>();
-  for (unsigned i = 0, s = opt_host_chain_->size(); i < s; ++i)
-    opt_host_chain_rtt_->push_back(-1);
+  opt_host_chain_rtt_ = new vector<int>(opt_host_chain_->size(), -1);
+  opt_host_chain_speed_ = new vector<int>(opt_host_chain_->size(), -1);
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Keeps the round trip times and the throughput of the hosts up to date from
+ * the transfers and from HEAD requests every given number of seconds.  The
+ * fastest host becomes the active one if it beats the active host by a
+ * margin.  Has to be set before Spawn(), 0 switches it off.
+ */
+void SetHostProbeInterval(const unsigned seconds) {
+  pthread_mutex_lock(&lock_options_);
+  opt_host_probe_interval_ = seconds;
+  pthread_mutex_unlock(&lock_options_);
+}
+
+
+/**
+ * Seconds between two rounds of host probes, 0 if tracking is off.
+ */
+unsigned GetHostProbeInterval() {
+  pthread_mutex_lock(&lock_options_);
+  const unsigned result = opt_host_probe_interval_;
+  pthread_mutex_unlock(&lock_options_);
+  return result;
+}
+
+
+/**
+ * Retrieves the estimated throughput of the hosts in kB/s, -1 is unknown.
+ */
+void GetHostThroughput(std::vector<int> *throughput) {
+  pthread_mutex_lock(&lock_options_);
+  if (opt_host_chain_speed_)
+    *throughput = *opt_host_chain_speed_;
   pthread_mutex_unlock(&lock_options_);
 }
 
@@ -1135,6 +3649,7 @@ void SetProxyChain(const std::string &proxy_list) {
   pthread_mutex_lock(&lock_options_);
 
   delete opt_proxy_groups_;
+  breakers_->clear();
   if (proxy_list == "") {
     opt_proxy_groups_ = NULL;
     opt_proxy_groups_current_ = 0;
@@ -1212,10 +3727,9 @@ void ProbeHosts() {
       gettimeofday(&tv_start, NULL);
       Failures result = Fetch(&info);
       gettimeofday(&tv_end, NULL);
-      if (info.destination_mem.data)
-        free(info.destination_mem.data);
+      ReleaseMemBuffer(&info);
       if (result == kFailOk) {
-        host_rtt[i] = int(DiffTimeSeconds(tv_start, tv_end));
+        host_rtt[i] = int(DiffTimeSeconds(tv_start, tv_end) * 1000);
         LogCvmfs(kLogDownload, kLogDebug, "probing host %s had %dms rtt",
                  url.c_str(), host_rtt[i]);
       } else {
@@ -1245,8 +3759,10 @@ void ProbeHosts() {
   pthread_mutex_lock(&lock_options_);
   delete opt_host_chain_;
   delete opt_host_chain_rtt_;
+  delete opt_host_chain_speed_;
   opt_host_chain_ = new vector<string>(host_chain);
   opt_host_chain_rtt_ = new vector<int>(host_rtt);
+  opt_host_chain_speed_ = new vector<int>(host_chain.size(), -1);
   opt_host_chain_current_ = 0;
   pthread_mutex_unlock(&lock_options_);
 }
@@ -5,10 +5,12 @@
 #ifndef CVMFS_DOWNLOAD_H_
 #define CVMFS_DOWNLOAD_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
 
 #include <cstdio>
+#include <ctime>
 
 #include <string>
 #include <vector>
@@ -17,6 +19,8 @@
 #include "compression.h"
 #include "hash.h"
 
+class MetricsWriter;
+
 namespace download {
 
 /**
@@ -42,6 +46,32 @@ enum Failures {
   kFailOther,
 };
 
+/**
+ * State of a hedged request, i.e. a duplicate of a slow request sent to
+ * another proxy.  Whichever request answers first wins, the other one is
+ * cancelled.
+ */
+enum HedgeState {
+  kHedgeOff = 0,  /**< No duplicate request */
+  kHedgeRacing,
+  kHedgeWon,      /**< The duplicate answered first */
+  kHedgeLost,     /**< The original request answered first */
+};
+
+/**
+ * Scheduling class of a job.  The I/O thread caps the number of concurrent
+ * transfers per class, so that bulk transfers do not crowd out the metadata
+ * that blocked file system calls wait for.
+ */
+enum Priority {
+  kPriorityMetadata = 0,  /**< Manifests, whitelists, catalogs */
+  kPriorityInteractive,   /**< Files opened by users */
+  kPriorityBulk,          /**< Prefetch, warm-up, pull */
+  kNumPriorities,
+};
+
+struct BatchCompletion;
+
 /**
  * Contains all the information to specify a download job.
  */
@@ -51,52 +81,130 @@ struct JobInfo {
   bool probe_hosts;
   bool head_request;
   Destination destination;
+  // Pooled buffer, to be returned by ReleaseMemBuffer()
   struct {
     size_t size;
     size_t pos;
     char *data;
+    size_t capacity;
   } destination_mem;
+  Priority priority;
   FILE *destination_file;
   const std::string *destination_path;
   const hash::Any *expected_hash;
+  /**
+   * For file destinations: if set, the file is flushed after every received
+   * piece of data and the number of bytes written so far is reported.  On
+   * retries, 0 is reported.
+   */
+  void (*progress_callback)(void *progress_ctx, const int64_t written);
+  void *progress_ctx;
+  /**
+   * If range_size is set, only the given byte range of the object is fetched.
+   * The expected hash and the decompression refer to the range.  Compressed
+   * ranges have to start at 0 and to go to a file, otherwise the job fails.
+   * Servers that do not support ranges send the whole object, of which the
+   * range is cut out.  Broken transfers into files are resumed by ranges.
+   */
+  uint64_t range_offset;
+  uint64_t range_size;
+  /**
+   * Replaces the @fqrn@ and @org@ placeholders in the host chain, so that
+   * several repositories of libcvmfs can share one host chain.
+   */
+  const std::string *repository_name;
+  /**
+   * If conditional is set, last_modified reports the modification time of
+   * the object (0 if unknown).  If if_modified_since is set, too, and the
+   * object has not changed since then, no data are received (HTTP 304) and
+   * not_modified is set.
+   */
+  bool conditional;
+  time_t if_modified_since;
+  time_t last_modified;
+  bool not_modified;
+  /**
+   * Bytes received from the network for this job, including retries and
+   * the duplicate of a hedged request.
+   */
+  uint64_t transferred_bytes;
 
   // One constructor per destination + head request
-  JobInfo() { wait_at[0] = wait_at[1] = -1; head_request = false; }
+  JobInfo() {
+    head_request = false;
+    InitState();
+  }
   JobInfo(const std::string *u, const bool c, const bool ph,
           const std::string *p, const hash::Any *h) : url(u), compressed(c),
           probe_hosts(ph), head_request(false),
           destination(kDestinationPath), destination_path(p), expected_hash(h)
-          { wait_at[0] = wait_at[1] = -1; }
+          { InitState(); }
   JobInfo(const std::string *u, const bool c, const bool ph, FILE *f,
           const hash::Any *h) : url(u), compressed(c), probe_hosts(ph),
           head_request(false),
           destination(kDestinationFile), destination_file(f), expected_hash(h)
-          { wait_at[0] = wait_at[1] = -1; }
+          { InitState(); }
   JobInfo(const std::string *u, const bool c, const bool ph,
           const hash::Any *h) : url(u), compressed(c), probe_hosts(ph),
           head_request(false), destination(kDestinationMem), expected_hash(h)
-          { wait_at[0] = wait_at[1] = -1; }
+          { InitState(); }
   JobInfo(const std::string *u, const bool ph) :
           url(u), compressed(false), probe_hosts(ph), head_request(true),
           destination(kDestinationNone), expected_hash(NULL)
-          { wait_at[0] = wait_at[1] = -1; }
+          { InitState(); }
   ~JobInfo() {
-    if (wait_at[0] >= 0) {
-      close(wait_at[0]);
-      close(wait_at[1]);
-    }
+    curl_slist_free_all(resolve_list);
+    pthread_mutex_destroy(&lock_completion);
+    pthread_cond_destroy(&cond_completion);
   }
 
   // Internal state, don't touch
   CURL *curl_handle;
-  z_stream zstream;
+  zlib::DecompressStream zstream;
   hash::ContextPtr hash_context;
-  int wait_at[2];  /**< Pipe used for the return value */
+  JobInfo *next_job;  /**< Link in the submission queue of the I/O thread */
+  pthread_mutex_t lock_completion;  /**< The I/O thread reports the result */
+  pthread_cond_t cond_completion;
+  bool completed;
+  BatchCompletion *batch;  /**< Set for jobs of FetchBatch() */
   std::string proxy;
+  curl_slist *resolve_list;  /**< Cached address of the proxy or host */
   bool nocache;
   Failures error_code;
   unsigned char num_failed_proxies;
   unsigned char num_failed_hosts;
+  CURL *hedge_handle;  /**< The losing or the still racing duplicate */
+  std::string hedge_proxy;
+  HedgeState hedge_state;
+  uint64_t time_start_ms;
+  bool first_byte;
+  bool zstream_end;  /**< Decompressed into memory up to the end */
+  bool range_emulated;  /**< Server sent the whole object */
+  uint64_t range_pos;  /**< Position in the whole object */
+  uint64_t range_received;  /**< Bytes of the range in this attempt */
+  uint64_t resume_offset;  /**< Bytes of the range from broken attempts */
+  int pipeline_worker;  /**< Decompresses and hashes the job's data, or -1 */
+  unsigned pipeline_pending;  /**< Chunks queued for the worker */
+
+ private:
+  JobInfo(const JobInfo &other);
+  JobInfo &operator=(const JobInfo &other);
+  void InitState() {
+    progress_callback = NULL;
+    range_offset = range_size = 0;
+    repository_name = NULL;
+    conditional = false;
+    if_modified_since = last_modified = 0;
+    not_modified = false;
+    transferred_bytes = 0;
+    priority = kPriorityInteractive;
+    next_job = NULL;
+    batch = NULL;
+    resolve_list = NULL;
+    completed = false;
+    pthread_mutex_init(&lock_completion, NULL);
+    pthread_cond_init(&cond_completion, NULL);
+  }
 };
 
 
@@ -104,17 +212,39 @@ void Init(const unsigned max_pool_handles);
 void Fini();
 void Spawn();
 Failures Fetch(JobInfo *info);
+unsigned FetchBatch(const std::vector<JobInfo *> &jobs,
+                    const unsigned max_parallel,
+                    void (*on_complete)(JobInfo *info, void *ctx), void *ctx);
 Failures Head(const std::string *url);
+void ReleaseMemBuffer(JobInfo *info);
 
 void SetDnsServer(const std::string &address);
 void SetTimeout(const unsigned seconds_proxy, const unsigned seconds_direct);
 void GetTimeout(unsigned *seconds_proxy, unsigned *seconds_direct);
 uint64_t GetTransferredBytes();
 uint64_t GetTransferTime();
+void SetHedging(const unsigned percentile);
+void SetPipelineThreads(const unsigned num_threads);
+uint64_t GetNumHedgesFired();
+uint64_t GetNumHedgesWon();
+bool SetHttp2(const bool value);
+uint64_t GetNumHttp2Requests();
+void SetDnsCache(const unsigned ttl_seconds);
+uint64_t GetNumDnsHits();
+uint64_t GetNumDnsMisses();
 void SetHostChain(const std::string &host_list);
 void GetHostInfo(std::vector<std::string> *host_chain,
                  std::vector<int> *rtt, unsigned *current_host);
 void ProbeHosts();
+void SetHostProbeInterval(const unsigned seconds);
+unsigned GetHostProbeInterval();
+void GetHostThroughput(std::vector<int> *throughput);
+std::string GetHostStatistics();
+std::string GetProxyStatistics();
+void GetMetrics(MetricsWriter *metrics);
+void SetProxyFailureLimit(const unsigned num_failures);
+std::string GetBlockedProxies();
+void SetPrioritySlots(const Priority priority, const unsigned num_slots);
 void SwitchHost();
 void SetProxyChain(const std::string &proxy_list);
 void GetProxyInfo(std::vector< std::vector<std::string> > *proxy_chain,
@@ -8,10 +8,15 @@
 #ifndef CVMFS_FS_TRAVERSAL_H_
 #define CVMFS_FS_TRAVERSAL_H_
 
+#include <pthread.h>
+
 #include <cassert>
 
+#include <deque>
+#include <map>
 #include <string>
 #include <set>
+#include <vector>
 
 #include "platform.h"
 #include "logging.h"
@@ -25,6 +30,13 @@
  *
  * Callbacks are called for every directory entry found by the recursion engine.
  * The recursion can be influenced by return values of these callbacks.
+ *
+ * With more than one worker, directories are read and their entries are
+ * stat'ed ahead of time by a pool of threads.  Every worker keeps a queue of
+ * directories to read, it takes the most recently added one from its own
+ * queue and steals the oldest ones from the others when it runs dry.  The
+ * callbacks are still called on the calling thread in the very order of the
+ * serial traversal, so they need not be thread-safe.
  */
 template <class T>
 class FileSystemTraversal {
@@ -80,9 +92,12 @@ class FileSystemTraversal {
     fn_new_symlink = NULL;
     fn_new_dir_prefix = NULL;
     fn_new_dir_postfix = NULL;
+    num_workers_ = 1;
     Init();
   }
 
+  void set_num_workers(const unsigned value) { num_workers_ = value; }
+
   /**
    * Start the recursion.
    * @param dir_path The directory to start the recursion at
@@ -98,7 +113,15 @@ class FileSystemTraversal {
            dir_path.substr(0, relative_to_directory_.length()) ==
              relative_to_directory_);
 
-    DoRecursion(dir_path, "");
+    if ((num_workers_ < 2) || !recurse_) {
+      DoRecursion(dir_path, "");
+      return;
+    }
+
+    ScanPool pool;
+    StartWorkers(&pool);
+    DoParallelRecursion(&pool, dir_path, "");
+    StopWorkers(&pool);
   }
 
  private:
@@ -111,6 +134,56 @@ class FileSystemTraversal {
 
 	// If one of these files are found somewhere they are completely ignored
 	std::set<std::string> ignored_files_;
+  unsigned num_workers_;
+
+  /**
+   * Limits the number of directories read ahead of the traversal
+   */
+  static const unsigned kMaxScansPerWorker = 256;
+
+  struct ScannedEntry {
+    ScannedEntry(const std::string &n, const mode_t m) : name(n), mode(m) { }
+    std::string name;
+    mode_t mode;
+  };
+  typedef std::vector<ScannedEntry> ScannedDirectory;
+
+  enum ScanState {
+    kScanQueued = 0,
+    kScanRunning,
+    kScanDone,
+  };
+
+  /**
+   * A directory read ahead by a worker.  Subdirectories lists the queued
+   * children, in case the traversal does not descend into the directory.
+   */
+  struct Scan {
+    Scan() : state(kScanQueued), discarded(false) { }
+    ScanState state;
+    bool discarded;
+    ScannedDirectory entries;
+    std::vector<std::string> subdirectories;
+  };
+
+  struct ScanPool;
+  struct WorkerArgs {
+    ScanPool *pool;
+    unsigned id;
+  };
+
+  struct ScanPool {
+    const FileSystemTraversal<T> *traversal;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_work;  ///< Signaled on new work and on termination
+    pthread_cond_t cond_done;  ///< Signaled whenever a scan finishes
+    std::map<std::string, Scan *> scans;  ///< By absolute path
+    std::vector<std::deque<std::string> > queues;  ///< One per worker
+    unsigned next_queue;
+    bool terminate;
+    std::vector<pthread_t> threads;
+    std::vector<WorkerArgs> args;
+  };
 
 
   void Init() {
@@ -170,6 +243,264 @@ class FileSystemTraversal {
     Notify(fn_leave_dir, parent_path, dir_name);
   }
 
+  /**
+   * Lists a directory and stats its entries, for the parallel traversal.
+   */
+  void ReadDirectory(const std::string &path, ScannedDirectory *entries) const
+  {
+    DIR *dip = opendir(path.c_str());
+    assert(dip);
+    platform_dirent64 *dit;
+    while ((dit = platform_readdir(dip)) != NULL) {
+      if (ignored_files_.find(dit->d_name) != ignored_files_.end())
+        continue;
+      platform_stat64 info;
+      int retval = platform_lstat((path + "/" + dit->d_name).c_str(), &info);
+      assert(retval == 0);
+      entries->push_back(ScannedEntry(dit->d_name, info.st_mode));
+    }
+    closedir(dip);
+  }
+
+  /**
+   * Same sequence of callbacks as DoRecursion() but on directory listings
+   * that are read ahead.
+   */
+  void DoParallelRecursion(ScanPool *pool, const std::string &parent_path,
+                           const std::string &dir_name) const
+  {
+    const std::string path = parent_path + ((!dir_name.empty()) ?
+                                           ("/" + dir_name) : "");
+
+    LogCvmfs(kLogFsTraversal, kLogVerboseMsg, "entering %s (%s -- %s)",
+             path.c_str(), parent_path.c_str(), dir_name.c_str());
+    ScannedDirectory entries;
+    AcquireScan(pool, path, &entries);
+    Notify(fn_enter_dir, parent_path, dir_name);
+
+    for (unsigned i = 0; i < entries.size(); ++i) {
+      const char *name = entries[i].name.c_str();
+      const mode_t mode = entries[i].mode;
+      if (S_ISDIR(mode)) {
+        LogCvmfs(kLogFsTraversal, kLogVerboseMsg, "passing directory %s/%s",
+                 path.c_str(), name);
+        if (Notify(fn_new_dir_prefix, path, name))
+          DoParallelRecursion(pool, path, name);
+        else
+          DiscardScan(pool, path + "/" + name);
+        Notify(fn_new_dir_postfix, path, name);
+      } else if (S_ISREG(mode)) {
+        LogCvmfs(kLogFsTraversal, kLogVerboseMsg, "passing regular file %s/%s",
+                 path.c_str(), name);
+        Notify(fn_new_file, path, name);
+      } else if (S_ISLNK(mode)) {
+        LogCvmfs(kLogFsTraversal, kLogVerboseMsg, "passing symlink %s/%s",
+                 path.c_str(), name);
+        Notify(fn_new_symlink, path, name);
+      } else {
+        LogCvmfs(kLogFsTraversal, kLogVerboseMsg, "unknown file type %s/%s",
+                 path.c_str(), name);
+      }
+    }
+
+    LogCvmfs(kLogFsTraversal, kLogVerboseMsg, "leaving %s", path.c_str());
+    Notify(fn_leave_dir, parent_path, dir_name);
+  }
+
+  void StartWorkers(ScanPool *pool) const {
+    pool->traversal = this;
+    pool->queues.resize(num_workers_);
+    pool->next_queue = 0;
+    pool->terminate = false;
+    int retval = pthread_mutex_init(&pool->lock, NULL);
+    assert(retval == 0);
+    retval = pthread_cond_init(&pool->cond_work, NULL);
+    assert(retval == 0);
+    retval = pthread_cond_init(&pool->cond_done, NULL);
+    assert(retval == 0);
+
+    pool->threads.resize(num_workers_);
+    pool->args.resize(num_workers_);
+    for (unsigned i = 0; i < num_workers_; ++i) {
+      pool->args[i].pool = pool;
+      pool->args[i].id = i;
+      retval = pthread_create(&pool->threads[i], NULL, MainScanWorker,
+                              &pool->args[i]);
+      assert(retval == 0);
+    }
+  }
+
+  void StopWorkers(ScanPool *pool) const {
+    pthread_mutex_lock(&pool->lock);
+    pool->terminate = true;
+    pthread_cond_broadcast(&pool->cond_work);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->threads.size(); ++i)
+      pthread_join(pool->threads[i], NULL);
+
+    for (typename std::map<std::string, Scan *>::iterator i =
+         pool->scans.begin(), iEnd = pool->scans.end(); i != iEnd; ++i)
+    {
+      delete i->second;
+    }
+    pool->scans.clear();
+    pthread_cond_destroy(&pool->cond_done);
+    pthread_cond_destroy(&pool->cond_work);
+    pthread_mutex_destroy(&pool->lock);
+  }
+
+  /**
+   * Takes the listing of a directory from the pool.  Directories that no
+   * worker started on yet are read right here.
+   */
+  void AcquireScan(ScanPool *pool, const std::string &path,
+                   ScannedDirectory *entries) const
+  {
+    pthread_mutex_lock(&pool->lock);
+    typename std::map<std::string, Scan *>::iterator i =
+      pool->scans.find(path);
+    if ((i == pool->scans.end()) || (i->second->state == kScanQueued)) {
+      if (i != pool->scans.end()) {
+        delete i->second;
+        pool->scans.erase(i);
+      }
+      pthread_mutex_unlock(&pool->lock);
+      ReadDirectory(path, entries);
+      pthread_mutex_lock(&pool->lock);
+      QueueSubdirectories(pool, path, *entries, NULL);
+      pthread_mutex_unlock(&pool->lock);
+      return;
+    }
+
+    Scan *scan = i->second;
+    while (scan->state != kScanDone)
+      pthread_cond_wait(&pool->cond_done, &pool->lock);
+    entries->swap(scan->entries);
+    pool->scans.erase(path);
+    delete scan;
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  /**
+   * The traversal does not descend into path, drops its read-ahead subtree.
+   */
+  void DiscardScan(ScanPool *pool, const std::string &path) const {
+    pthread_mutex_lock(&pool->lock);
+    DiscardScanLocked(pool, path);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  static void DiscardScanLocked(ScanPool *pool, const std::string &path) {
+    typename std::map<std::string, Scan *>::iterator i =
+      pool->scans.find(path);
+    if (i == pool->scans.end())
+      return;
+    Scan *scan = i->second;
+    if (scan->state == kScanRunning) {
+      // The worker cleans up
+      scan->discarded = true;
+      return;
+    }
+    pool->scans.erase(i);
+    for (unsigned j = 0; j < scan->subdirectories.size(); ++j)
+      DiscardScanLocked(pool, scan->subdirectories[j]);
+    delete scan;
+  }
+
+  static void QueueSubdirectories(ScanPool *pool, const std::string &path,
+                                  const ScannedDirectory &entries, Scan *scan)
+  {
+    const unsigned max_scans = pool->queues.size() * kMaxScansPerWorker;
+    bool queued = false;
+    for (unsigned i = 0; i < entries.size(); ++i) {
+      if (!S_ISDIR(entries[i].mode))
+        continue;
+      if (pool->scans.size() >= max_scans)
+        break;
+      const std::string subdirectory = path + "/" + entries[i].name;
+      if (pool->scans.find(subdirectory) != pool->scans.end())
+        continue;
+      pool->scans[subdirectory] = new Scan();
+      pool->queues[pool->next_queue].push_back(subdirectory);
+      pool->next_queue = (pool->next_queue + 1) % pool->queues.size();
+      if (scan != NULL)
+        scan->subdirectories.push_back(subdirectory);
+      queued = true;
+    }
+    if (queued)
+      pthread_cond_broadcast(&pool->cond_work);
+  }
+
+  /**
+   * Newest directory of the own queue first, then the oldest ones of the
+   * other queues.  Entries that were taken over or discarded are skipped.
+   */
+  static bool TakeScanLocked(ScanPool *pool, const unsigned id,
+                             std::string *path)
+  {
+    std::deque<std::string> *own = &pool->queues[id];
+    while (!own->empty()) {
+      *path = own->back();
+      own->pop_back();
+      if (IsQueuedLocked(pool, *path))
+        return true;
+    }
+    for (unsigned i = 1; i < pool->queues.size(); ++i) {
+      std::deque<std::string> *other =
+        &pool->queues[(id + i) % pool->queues.size()];
+      while (!other->empty()) {
+        *path = other->front();
+        other->pop_front();
+        if (IsQueuedLocked(pool, *path))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  static bool IsQueuedLocked(ScanPool *pool, const std::string &path) {
+    typename std::map<std::string, Scan *>::const_iterator i =
+      pool->scans.find(path);
+    return (i != pool->scans.end()) && (i->second->state == kScanQueued);
+  }
+
+  static void *MainScanWorker(void *data) {
+    WorkerArgs *args = reinterpret_cast<WorkerArgs *>(data);
+    ScanPool *pool = args->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+      std::string path;
+      bool found = false;
+      while (!pool->terminate &&
+             !(found = TakeScanLocked(pool, args->id, &path)))
+      {
+        pthread_cond_wait(&pool->cond_work, &pool->lock);
+      }
+      if (!found)
+        break;
+
+      Scan *scan = pool->scans[path];
+      scan->state = kScanRunning;
+      pthread_mutex_unlock(&pool->lock);
+      ScannedDirectory entries;
+      pool->traversal->ReadDirectory(path, &entries);
+      pthread_mutex_lock(&pool->lock);
+
+      if (scan->discarded) {
+        pool->scans.erase(path);
+        delete scan;
+      } else {
+        scan->entries.swap(entries);
+        scan->state = kScanDone;
+        QueueSubdirectories(pool, path, scan->entries, scan);
+      }
+      pthread_cond_broadcast(&pool->cond_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+  }
+
   inline bool Notify(const BoolCallback callback,
         	           const std::string &parent_path,
         	           const std::string &entry_name) const
@@ -0,0 +1,313 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A fixed pool of Fuse worker threads.  With libfuse's multi-threaded loop,
+ * all workers read from and reply to the single /dev/fuse descriptor, whose
+ * list of requests in processing becomes a point of contention.  Here, every
+ * worker reads from its own clone of the connection if the kernel supports
+ * it, and it can be pinned to a CPU.  Workers whose clone fails share the
+ * descriptor of the mount.
+ *
+ * The kernel does not tell how long a request was queued.  A request that
+ * is returned right away to a worker asking for one was waiting for it, so
+ * the share of these requests shows how far the workers lag behind.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include "cvmfs_config.h"
+#include "fuse_workers.h"
+
+#include <errno.h>
+#include <fuse/fuse_lowlevel.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "logging.h"
+#include "metrics.h"
+#include "platform.h"
+#include "smalloc.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace fuse_workers {
+
+/**
+ * A read from /dev/fuse that returns faster found a request waiting
+ */
+const uint64_t kWaitingUs = 20;
+const unsigned kFuseInHeaderSize = 40;  /**< sizeof(struct fuse_in_header) */
+
+struct Worker {
+  Worker() : id(0), channel(NULL), cloned(false), cpu(-1) {
+    atomic_init64(&num_requests);
+    atomic_init64(&num_waiting);
+    atomic_init64(&busy_us);
+    atomic_init64(&idle_us);
+  }
+
+  unsigned id;
+  pthread_t thread;
+  struct fuse_chan *channel;
+  bool cloned;  /**< reads from its own descriptor */
+  int cpu;  /**< -1 if not pinned */
+  atomic_int64 num_requests;
+  atomic_int64 num_waiting;  /**< requests that were already queued */
+  atomic_int64 busy_us;
+  atomic_int64 idle_us;
+};
+
+struct fuse_session *session_ = NULL;
+size_t bufsize_ = 0;
+vector<Worker *> *workers_ = NULL;
+
+
+static uint64_t GetTimeUs() {
+  struct timeval tv_now;
+  gettimeofday(&tv_now, NULL);
+  return uint64_t(tv_now.tv_sec)*1000000 + tv_now.tv_usec;
+}
+
+
+/**
+ * Channel operations of the cloned descriptors, as libfuse does it for the
+ * descriptor of the mount
+ */
+static int CloneReceive(struct fuse_chan **chp, char *buf, size_t size) {
+  while (true) {
+    const ssize_t res = read(fuse_chan_fd(*chp), buf, size);
+    const int err = errno;
+    if (fuse_session_exited(session_))
+      return 0;
+    if (res == -1) {
+      // ENOENT means the operation was interrupted, it's safe to restart
+      if (err == ENOENT)
+        continue;
+      // The file system is unmounted
+      if (err == ENODEV) {
+        fuse_session_exit(session_);
+        return 0;
+      }
+      if ((err != EINTR) && (err != EAGAIN)) {
+        LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+                 "reading Fuse device failed (%d)", err);
+      }
+      return -err;
+    }
+    if (static_cast<size_t>(res) < kFuseInHeaderSize) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog, "short read on Fuse device");
+      return -EIO;
+    }
+    return res;
+  }
+}
+
+
+static int CloneSend(struct fuse_chan *ch, const struct iovec iov[],
+                     size_t count)
+{
+  if (writev(fuse_chan_fd(ch), iov, count) == -1) {
+    const int err = errno;
+    // ENOENT means the operation was interrupted
+    if (!fuse_session_exited(session_) && (err != ENOENT)) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "writing Fuse device failed (%d)", err);
+    }
+    return -err;
+  }
+  return 0;
+}
+
+
+static void CloneDestroy(struct fuse_chan *ch) {
+  close(fuse_chan_fd(ch));
+}
+
+
+/**
+ * Returns when the session exits.  Worker threads can only be cancelled
+ * while they wait for a request.
+ */
+static void Serve(Worker *worker) {
+  char *buf = static_cast<char *>(smalloc(bufsize_));
+  if ((worker->cpu >= 0) && (platform_pin_thread(worker->cpu) != 0)) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "failed to pin Fuse worker %u to cpu %d",
+             worker->id, worker->cpu);
+  }
+
+  uint64_t idle_since = GetTimeUs();
+  while (!fuse_session_exited(session_)) {
+    struct fuse_chan *ch = worker->channel;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    const int res = fuse_chan_recv(&ch, buf, bufsize_);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if ((res == -EINTR) || (res == -EAGAIN))
+      continue;
+    if (res <= 0) {
+      if (res < 0)
+        fuse_session_exit(session_);
+      break;
+    }
+
+    const uint64_t start = GetTimeUs();
+    atomic_xadd64(&worker->idle_us, start - idle_since);
+    if (start - idle_since < kWaitingUs)
+      atomic_inc64(&worker->num_waiting);
+    fuse_session_process(session_, buf, res, ch);
+    idle_since = GetTimeUs();
+    atomic_xadd64(&worker->busy_us, idle_since - start);
+    atomic_inc64(&worker->num_requests);
+  }
+  free(buf);
+}
+
+
+static void *MainWorker(void *data) {
+  Worker *worker = static_cast<Worker *>(data);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  Serve(worker);
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  return NULL;
+}
+
+
+/**
+ * Serves the session with num_workers threads, the calling thread being the
+ * first of them.  The calling thread receives the signals that end the
+ * session.
+ */
+int Run(struct fuse_session *session, struct fuse_chan *channel,
+        const unsigned num_workers, const bool pin_cpus)
+{
+  session_ = session;
+  bufsize_ = fuse_chan_bufsize(channel);
+  const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct fuse_chan_ops clone_ops;
+  clone_ops.receive = CloneReceive;
+  clone_ops.send = CloneSend;
+  clone_ops.destroy = CloneDestroy;
+
+  vector<Worker *> *workers = new vector<Worker *>();
+  unsigned num_cloned = 0;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    Worker *worker = new Worker();
+    worker->id = i;
+    worker->channel = channel;
+    if (pin_cpus && (num_cpus > 0))
+      worker->cpu = i % num_cpus;
+    // The first worker keeps the descriptor of the mount
+    const int fd =
+      (i == 0) ? -1 : platform_clone_fuse_fd(fuse_chan_fd(channel));
+    if (fd >= 0) {
+      struct fuse_chan *clone = fuse_chan_new(&clone_ops, fd, bufsize_, NULL);
+      if (clone) {
+        worker->channel = clone;
+        worker->cloned = true;
+        num_cloned++;
+      } else {
+        close(fd);
+      }
+    }
+    workers->push_back(worker);
+  }
+  workers_ = workers;
+  LogCvmfs(kLogCvmfs, kLogDebug, "starting %u Fuse workers, %u with cloned "
+           "channels", num_workers, num_cloned);
+
+  sigset_t all_signals;
+  sigset_t previous_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &previous_signals);
+  vector<bool> started(num_workers, false);
+  for (unsigned i = 1; i < num_workers; ++i) {
+    started[i] = (pthread_create(&(*workers)[i]->thread, NULL, MainWorker,
+                                 (*workers)[i]) == 0);
+    if (!started[i]) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "failed to start Fuse worker %u", i);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+
+  int cancel_state;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+  Serve((*workers)[0]);
+  pthread_setcancelstate(cancel_state, NULL);
+
+  for (unsigned i = 1; i < num_workers; ++i) {
+    if (!started[i])
+      continue;
+    pthread_cancel((*workers)[i]->thread);
+    pthread_join((*workers)[i]->thread, NULL);
+  }
+  // The statistics of the workers remain
+  for (unsigned i = 0; i < num_workers; ++i) {
+    if ((*workers)[i]->cloned)
+      fuse_chan_destroy((*workers)[i]->channel);
+    (*workers)[i]->channel = NULL;
+  }
+  return fuse_session_exited(session) ? 0 : -1;
+}
+
+
+string GetStatistics() {
+  if (!workers_)
+    return "";
+  string result;
+  for (unsigned i = 0; i < workers_->size(); ++i) {
+    Worker *worker = (*workers_)[i];
+    const int64_t num_requests = atomic_read64(&worker->num_requests);
+    const int64_t num_waiting = atomic_read64(&worker->num_waiting);
+    result += "  worker " + StringifyInt(worker->id) +
+      (worker->cloned ? " (cloned" : " (shared") + " channel" +
+      ((worker->cpu >= 0) ? ", cpu " + StringifyInt(worker->cpu) : "") +
+      "): requests " + StringifyInt(num_requests) +
+      "  already queued " +
+      StringifyInt((num_requests == 0) ? 0 : num_waiting*100 / num_requests) +
+      "%  busy " + StringifyInt(atomic_read64(&worker->busy_us) / 1000) +
+      " ms  idle " + StringifyInt(atomic_read64(&worker->idle_us) / 1000) +
+      " ms\n";
+  }
+  return result;
+}
+
+
+void GetMetrics(MetricsWriter *metrics) {
+  if (!workers_)
+    return;
+  for (unsigned i = 0; i < workers_->size(); ++i) {
+    Worker *worker = (*workers_)[i];
+    const string label =
+      MetricsWriter::Label("worker", StringifyInt(worker->id));
+    metrics->Counter("fuse_worker_requests_total",
+                     "Fuse requests served by the worker",
+                     atomic_read64(&worker->num_requests), label);
+  }
+  for (unsigned i = 0; i < workers_->size(); ++i) {
+    Worker *worker = (*workers_)[i];
+    const string label =
+      MetricsWriter::Label("worker", StringifyInt(worker->id));
+    metrics->Counter("fuse_worker_queued_total",
+                     "Fuse requests that were queued when the worker asked",
+                     atomic_read64(&worker->num_waiting), label);
+  }
+  for (unsigned i = 0; i < workers_->size(); ++i) {
+    Worker *worker = (*workers_)[i];
+    const string label =
+      MetricsWriter::Label("worker", StringifyInt(worker->id));
+    metrics->Counter("fuse_worker_busy_us_total",
+                     "Time the worker spent on Fuse requests",
+                     atomic_read64(&worker->busy_us), label);
+  }
+}
+
+}  // namespace fuse_workers
@@ -0,0 +1,24 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_FUSE_WORKERS_H_
+#define CVMFS_FUSE_WORKERS_H_
+
+#include <string>
+
+struct fuse_session;
+struct fuse_chan;
+class MetricsWriter;
+
+namespace fuse_workers {
+
+int Run(struct fuse_session *session, struct fuse_chan *channel,
+        const unsigned num_workers, const bool pin_cpus);
+
+std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
+
+}  // namespace fuse_workers
+
+#endif  // CVMFS_FUSE_WORKERS_H_
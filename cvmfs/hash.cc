@@ -6,12 +6,17 @@
 #include "hash.h"
 
 #include <alloca.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
 #include <cstdlib>
 #include <cstdio>
 
+#include "smalloc.h"
+
 using namespace std;  // NOLINT
 
 namespace hash {
@@ -112,9 +117,15 @@ void HashMem(const unsigned char *buffer, const unsigned buffer_size,
    }*/
 
 
+/**
+ * The MD5 and SHA-1 implementations of OpenSSL select SHA-NI resp. ARMv8
+ * crypto extension kernels at runtime, if the CPU has them.  With those,
+ * small reads instead of hashing dominate, so the file is read in large
+ * blocks.
+ */
 bool HashFile(const std::string filename, Any *any_digest) {
-  FILE *file = fopen(filename.c_str(), "r");
-  if (file == NULL)
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
     return false;
 
   Algorithms algorithm = any_digest->algorithm;
@@ -122,19 +133,21 @@ bool HashFile(const std::string filename, Any *any_digest) {
   context.buffer = alloca(context.size);
 
   Init(context);
-  unsigned char io_buffer[4096];
-  int actual_bytes;
-  while ((actual_bytes = fread(io_buffer, 1, 4096, file))) {
-    Update(io_buffer, 4096, context);
-  }
-
-  if (ferror(file)) {
-    fclose(file);
+  const unsigned kBlockSize = 128*1024;
+  unsigned char *io_buffer = static_cast<unsigned char *>(smalloc(kBlockSize));
+  ssize_t actual_bytes;
+  do {
+    actual_bytes = read(fd, io_buffer, kBlockSize);
+    if (actual_bytes > 0)
+      Update(io_buffer, actual_bytes, context);
+  } while ((actual_bytes > 0) || ((actual_bytes < 0) && (errno == EINTR)));
+  free(io_buffer);
+  close(fd);
+
+  if (actual_bytes < 0)
     return false;
-  }
 
   Final(context, any_digest);
-  fclose(file);
   return true;
 }
 
@@ -165,6 +178,26 @@ Md5::Md5(const char *chars, const unsigned length) {
 }
 
 
+Md5Prefix::Md5Prefix(const char *chars, const unsigned length) {
+  assert(sizeof(MD5_CTX) <= sizeof(state));
+  MD5_CTX *md5_state = reinterpret_cast<MD5_CTX *>(state);
+  MD5_Init(md5_state);
+  MD5_Update(md5_state, reinterpret_cast<const unsigned char *>(chars),
+             length);
+}
+
+
+Md5::Md5(const Md5Prefix &prefix, const char *chars, const unsigned length) {
+  algorithm = kMd5;
+
+  MD5_CTX md5_state;
+  memcpy(&md5_state, prefix.state, sizeof(md5_state));
+  MD5_Update(&md5_state, reinterpret_cast<const unsigned char *>(chars),
+             length);
+  MD5_Final(digest, &md5_state);
+}
+
+
 Md5::Md5(const uint64_t lo, const uint64_t hi) {
   algorithm = kMd5;
   memcpy(digest, &lo, 8);
@@ -114,30 +114,43 @@ struct Digest {
   }
 
   /**
-   * Create a path string from the hex notation of the digest.
+   * Writes the path of MakePath() into path, which has to hold
+   * 2*digest_size_ + dir_levels + 2 bytes.  Used where a heap allocation
+   * would cost more than the lookup itself.
+   *
+   * \return Length of the path without the terminating null byte
    */
-  std::string MakePath(const unsigned dir_levels,
-                       const unsigned digits_per_level) const
+  unsigned MakePathCStr(const unsigned dir_levels,
+                        const unsigned digits_per_level, char *path) const
   {
-    const unsigned string_length = 2*kDigestSizes[algorithm] + dir_levels + 1;
-    std::string result(string_length, 0);
-
     unsigned i = 0, pos = 0;
     while (i < 2*kDigestSizes[algorithm]) {
       if (((i % digits_per_level) == 0) &&
           ((i / digits_per_level) <= dir_levels))
       {
-        result[pos] = '/';
+        path[pos] = '/';
         ++pos;
       }
       char digit = ((i % 2) == 0) ? digest[i/2] / 16 : digest[i/2] % 16;
       digit += (digit <= 9) ? '0' : 'a' - 10;
-      result[pos] = digit;
+      path[pos] = digit;
       ++pos;
       ++i;
     }
+    path[pos] = '\0';
+    return pos;
+  }
 
-    return result;
+  /**
+   * Create a path string from the hex notation of the digest.
+   */
+  std::string MakePath(const unsigned dir_levels,
+                       const unsigned digits_per_level) const
+  {
+    char result[2*digest_size_ + dir_levels + 2];
+    const unsigned length =
+      MakePathCStr(dir_levels, digits_per_level, result);
+    return std::string(result, length);
   }
 
   bool IsNull() const {
@@ -182,11 +195,26 @@ struct Digest {
 };
 
 
+/**
+ * MD5 state after hashing a path prefix, usually a directory path including
+ * the trailing slash.  Paths below the directory are hashed by continuing
+ * from this state, so the prefix is not hashed again for every entry.
+ */
+struct Md5Prefix {
+  Md5Prefix() { }
+  Md5Prefix(const char *chars, const unsigned length);
+  uint64_t state[16];  /**< Opaque MD5_CTX */
+};
+
 struct Md5 : public Digest<16, kMd5> {
   Md5() : Digest<16, kMd5>() { }
   explicit Md5(const AsciiPtr ascii);
   explicit Md5(const HexPtr hex) : Digest<16, kMd5>(kMd5, hex) { } ;
   Md5(const char *chars, const unsigned length);
+  /**
+   * Hashes prefix + chars.
+   */
+  Md5(const Md5Prefix &prefix, const char *chars, const unsigned length);
 
   /**
    * An MD5 hash can be seen as two 64bit integers.
@@ -0,0 +1,119 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Lock-free latency histograms with logarithmic bins.  Bin i counts values in
+ * [2^i, 2^(i+1)) microseconds, the last bin collects everything above.
+ * Recording a value is a few atomic increments, so histograms can be used in
+ * the Fuse callbacks.
+ */
+
+#ifndef CVMFS_HISTOGRAM_H_
+#define CVMFS_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <string>
+
+#include "atomic.h"
+#include "util.h"
+
+class Log2Histogram {
+ public:
+  static const unsigned kNumBins = 26;  /**< Last bin starts at ~33 seconds */
+
+  Log2Histogram() { Reset(); }
+
+  /**
+   * Microseconds since the epoch, the reference point for Add().
+   */
+  static inline uint64_t Now() {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    return uint64_t(tv_now.tv_sec)*1000000 + tv_now.tv_usec;
+  }
+
+  inline void Add(const uint64_t value_us) {
+    unsigned bin = 0;
+    if (value_us > 1) {
+      bin = 63 - __builtin_clzll(value_us);
+      if (bin >= kNumBins) bin = kNumBins - 1;
+    }
+    atomic_inc64(&bins_[bin]);
+    atomic_xadd64(&sum_us_, value_us);
+  }
+
+  inline void AddSince(const uint64_t start_us) {
+    const uint64_t now = Now();
+    // Clock might have been set back
+    Add((now > start_us) ? now - start_us : 0);
+  }
+
+  void Reset() {
+    for (unsigned i = 0; i < kNumBins; ++i)
+      atomic_init64(&bins_[i]);
+    atomic_init64(&sum_us_);
+  }
+
+  /**
+   * Copies the bins and the sum of all values.
+   */
+  void Snapshot(uint64_t *bins, uint64_t *sum_us) {
+    for (unsigned i = 0; i < kNumBins; ++i)
+      bins[i] = atomic_read64(&bins_[i]);
+    *sum_us = atomic_read64(&sum_us_);
+  }
+
+  /**
+   * One line with the number of values, the mean and upper bounds of
+   * the 50%, 90%, 99% quantiles and the maximum.
+   */
+  std::string Print() {
+    uint64_t bins[kNumBins];
+    uint64_t total = 0;
+    for (unsigned i = 0; i < kNumBins; ++i) {
+      bins[i] = atomic_read64(&bins_[i]);
+      total += bins[i];
+    }
+    if (total == 0)
+      return "n: 0\n";
+
+    const uint64_t sum_us = atomic_read64(&sum_us_);
+    return "n: " + StringifyInt(total) + "  " +
+      "avg: " + PrintDuration(sum_us / total) + "  " +
+      "p50: <" + PrintDuration(GetQuantileBound(bins, total, 0.5)) + "  " +
+      "p90: <" + PrintDuration(GetQuantileBound(bins, total, 0.9)) + "  " +
+      "p99: <" + PrintDuration(GetQuantileBound(bins, total, 0.99)) + "  " +
+      "max: <" + PrintDuration(GetQuantileBound(bins, total, 1.0)) + "\n";
+  }
+
+ private:
+  /**
+   * Upper bound of the bin that contains the given quantile.
+   */
+  static uint64_t GetQuantileBound(const uint64_t *bins, const uint64_t total,
+                                   const double quantile)
+  {
+    const uint64_t rank = uint64_t(quantile * total + 0.5);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < kNumBins; ++i) {
+      seen += bins[i];
+      if ((seen >= rank) && (bins[i] > 0))
+        return uint64_t(2) << i;
+    }
+    return uint64_t(2) << (kNumBins - 1);
+  }
+
+  static std::string PrintDuration(const uint64_t value_us) {
+    if (value_us < 10000)
+      return StringifyInt(value_us) + "us";
+    if (value_us < 10000000)
+      return StringifyInt(value_us / 1000) + "ms";
+    return StringifyInt(value_us / 1000000) + "s";
+  }
+
+  atomic_int64 bins_[kNumBins];
+  atomic_int64 sum_us_;
+};
+
+#endif  // CVMFS_HISTOGRAM_H_
@@ -11,12 +11,16 @@
 
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <cstdlib>
+#include <cstring>
 #include <stddef.h>
 
 #include <string>
+#include <vector>
 
 #include "util.h"
+#include "atomic.h"
 #include "logging.h"
 #include "smalloc.h"
 #include "libcvmfs_int.h"
@@ -206,6 +210,7 @@ struct cvmfs_opts {
 
             "options are:\n"
             " url=REPOSITORY_URL      The URL of the CernVM-FS server(s): 'url1;url2;...'\n"
+            "                         @fqrn@ and @org@ are replaced by the repository name\n"
             " timeout=SECONDS         Timeout for network operations (default is %d)\n"
             " timeout_direct=SECONDS  Timeout for network operations without proxy (default is %d)\n"
             " cachedir=DIR            Where to store disk cache\n"
@@ -226,14 +231,44 @@ struct cvmfs_opts {
             " blacklist=FILE          Local blacklist for invalid certificates.  Has precedence over the whitelist.\n"
             " syslog_level=NUMBER     Sets the level used for syslog to DEBUG (1), INFO (2), or NOTICE (3).\n"
             "                         Default is NOTICE.\n"
-            " Note: you cannot load files greater than quota_limit-quota_threshold\n",
+            " Note: you cannot load files greater than quota_limit-quota_threshold\n"
+            "\n"
+            "cvmfs_attach_repo() takes repo_name, mountpoint, and allow_unsigned, the other\n"
+            "options are shared by all repositories and given to cvmfs_init().\n",
             PACKAGE_VERSION, defaults.timeout, defaults.timeout_direct
             );
   }
 };
 
-/* Path to root of repository.  Used to resolve absolute symlinks. */
-static string mountpoint;
+struct cvmfs_context {
+  explicit cvmfs_context(cvmfs::LibContext *c) : impl(c) { }
+  cvmfs::LibContext *impl;
+};
+
+/* Repository attached by cvmfs_init(), NULL if there is none. */
+static cvmfs_context *default_context = NULL;
+
+static int expand_path(cvmfs::LibContext *ctx, char const *path,
+                       string &expanded_path, int depth=0);
+
+/* Like expand_path() for the parent directory of a path.  Parent
+ * directories are shared by many paths, so their expansion is taken
+ * from the resolved path cache of the context if possible.  Paths in
+ * the cache have been looked up before with the current catalogs, so
+ * that the nested catalogs on the way are loaded.
+ */
+static int expand_parent(cvmfs::LibContext *ctx, const string &p_path,
+                         string &expanded_path, int depth)
+{
+  if( ctx->LookupResolved(p_path,&expanded_path) ) {
+    return 0;
+  }
+  int rc = expand_path(ctx,p_path.c_str(),expanded_path,depth);
+  if( rc == 0 ) {
+    ctx->InsertResolved(p_path,expanded_path);
+  }
+  return rc;
+}
 
 /* Expand symlinks in all levels of a path.  Also, expand ".." and
  * ".".  This also has the side-effect of ensuring that
@@ -241,14 +276,15 @@ static string mountpoint;
  * ensure proper loading of nested catalogs before the child is
  * accessed.
  */
-static int expand_path(char const *path,string &expanded_path,int depth=0)
+static int expand_path(cvmfs::LibContext *ctx, char const *path,
+                       string &expanded_path, int depth)
 {
   string p_path = GetParentPath(path);
   string fname = GetFileName(path);
   int rc;
 
   if( fname == ".." ) {
-    rc = expand_path(p_path.c_str(),expanded_path,depth);
+    rc = expand_parent(ctx,p_path,expanded_path,depth);
     if( rc != 0 ) {
       return -1;
     }
@@ -267,7 +303,7 @@ static int expand_path(char const *path,string &expanded_path,int depth=0)
 
   string buf;
   if( p_path != "" ) {
-    rc = expand_path(p_path.c_str(),buf,depth);
+    rc = expand_parent(ctx,p_path,buf,depth);
     if( rc != 0 ) {
       return -1;
     }
@@ -284,7 +320,7 @@ static int expand_path(char const *path,string &expanded_path,int depth=0)
   buf += fname;
 
   struct stat st;
-  rc = cvmfs::cvmfs_getattr(buf.c_str(),&st);
+  rc = ctx->GetAttr(buf.c_str(),&st);
   if( rc != 0 ) {
     errno = -rc;
     return -1;
@@ -309,7 +345,7 @@ static int expand_path(char const *path,string &expanded_path,int depth=0)
     errno = ENOMEM;
     return -1;
   }
-  rc = cvmfs::cvmfs_readlink(buf.c_str(),ln_buf,st.st_size+2);
+  rc = ctx->Readlink(buf.c_str(),ln_buf,st.st_size+2);
   if( rc != 0 ) {
     free(ln_buf);
     errno = -rc;
@@ -318,8 +354,9 @@ static int expand_path(char const *path,string &expanded_path,int depth=0)
   if( ln_buf[0] == '/' ) {
     // symlink is absolute path
     // convert /cvmfs/repo/blah --> /blah
-	  size_t len = ::mountpoint.length();
-    if( strncmp(ln_buf,::mountpoint.c_str(),len)==0
+    const string &mountpoint = ctx->mountpoint();
+	  size_t len = mountpoint.length();
+    if( strncmp(ln_buf,mountpoint.c_str(),len)==0
        && (ln_buf[len] == '/' || ln_buf[len] == '\0'))
     {
       buf = ln_buf+len;
@@ -329,7 +366,7 @@ static int expand_path(char const *path,string &expanded_path,int depth=0)
     }
     else {
       LogCvmfs(kLogCvmfs,kLogDebug,"libcvmfs cannot resolve symlinks to paths outside of the repository: %s --> %s (mountpoint=%s)",
-               path,ln_buf,::mountpoint.c_str());
+               path,ln_buf,mountpoint.c_str());
       errno = ENOENT;
       free(ln_buf);
       return -1;
@@ -346,11 +383,12 @@ static int expand_path(char const *path,string &expanded_path,int depth=0)
   // In case the symlink references other symlinks or contains ".."
   // or "."  we must now call expand_path on the result.
 
-  return expand_path(buf.c_str(),expanded_path,depth+1);
+  return expand_path(ctx,buf.c_str(),expanded_path,depth+1);
 }
 
 /* Like expand_path(), but do not expand the final element of the path. */
-static int expand_ppath(char const *path,string &expanded_path)
+static int expand_ppath(cvmfs::LibContext *ctx, char const *path,
+                        string &expanded_path)
 {
   string p_path = GetParentPath(path);
   string fname = GetFileName(path);
@@ -360,7 +398,7 @@ static int expand_ppath(char const *path,string &expanded_path)
     return 0;
   }
 
-  int rc = expand_path(p_path.c_str(),expanded_path);
+  int rc = expand_parent(ctx,p_path,expanded_path,0);
   if( rc != 0 ) {
     return rc;
   }
@@ -371,17 +409,17 @@ static int expand_ppath(char const *path,string &expanded_path)
   return 0;
 }
 
-int cvmfs_open(const char *path)
+int cvmfs_ctx_open(cvmfs_context *ctx, const char *path)
 {
   string lpath;
   int rc;
-  rc = expand_path(path,lpath);
+  rc = expand_path(ctx->impl,path,lpath);
   if( rc < 0 ) {
     return -1;
   }
   path = lpath.c_str();
 
-  rc = cvmfs::cvmfs_open(path);
+  rc = ctx->impl->Open(path);
   if (rc < 0) {
     errno = -rc;
     return -1;
@@ -389,9 +427,9 @@ int cvmfs_open(const char *path)
   return rc;
 }
 
-int cvmfs_close(int fd)
+int cvmfs_ctx_close(cvmfs_context *ctx, int fd)
 {
-  int rc = cvmfs::cvmfs_close(fd);
+  int rc = ctx->impl->Close(fd);
   if (rc < 0) {
     errno = -rc;
     return -1;
@@ -399,16 +437,18 @@ int cvmfs_close(int fd)
   return 0;
 }
 
-int cvmfs_readlink(const char *path, char *buf, size_t size) {
+int cvmfs_ctx_readlink(cvmfs_context *ctx, const char *path, char *buf,
+                       size_t size)
+{
   string lpath;
   int rc;
-  rc = expand_ppath(path,lpath);
+  rc = expand_ppath(ctx->impl,path,lpath);
   if( rc < 0 ) {
     return -1;
   }
   path = lpath.c_str();
 
-  rc = cvmfs::cvmfs_readlink(path,buf,size);
+  rc = ctx->impl->Readlink(path,buf,size);
   if (rc < 0) {
     errno = -rc;
     return -1;
@@ -416,17 +456,17 @@ int cvmfs_readlink(const char *path, char *buf, size_t size) {
   return 0;
 }
 
-int cvmfs_stat(const char *path,struct stat *st)
+int cvmfs_ctx_stat(cvmfs_context *ctx, const char *path, struct stat *st)
 {
   string lpath;
   int rc;
-  rc = expand_path(path,lpath);
+  rc = expand_path(ctx->impl,path,lpath);
   if( rc < 0 ) {
     return -1;
   }
   path = lpath.c_str();
 
-  rc = cvmfs::cvmfs_getattr(path,st);
+  rc = ctx->impl->GetAttr(path,st);
   if( rc < 0 ) {
     errno = -rc;
     return -1;
@@ -434,17 +474,17 @@ int cvmfs_stat(const char *path,struct stat *st)
   return 0;
 }
 
-int cvmfs_lstat(const char *path,struct stat *st)
+int cvmfs_ctx_lstat(cvmfs_context *ctx, const char *path, struct stat *st)
 {
   string lpath;
   int rc;
-  rc = expand_ppath(path,lpath);
+  rc = expand_ppath(ctx->impl,path,lpath);
   if( rc < 0 ) {
     return -1;
   }
   path = lpath.c_str();
 
-  rc = cvmfs::cvmfs_getattr(path,st);
+  rc = ctx->impl->GetAttr(path,st);
   if( rc < 0 ) {
     errno = -rc;
     return -1;
@@ -452,17 +492,18 @@ int cvmfs_lstat(const char *path,struct stat *st)
   return 0;
 }
 
-int cvmfs_listdir(const char *path,char ***buf,size_t *buflen)
+int cvmfs_ctx_listdir(cvmfs_context *ctx, const char *path, char ***buf,
+                      size_t *buflen)
 {
   string lpath;
   int rc;
-  rc = expand_path(path,lpath);
+  rc = expand_path(ctx->impl,path,lpath);
   if( rc < 0 ) {
     return -1;
   }
   path = lpath.c_str();
 
-  rc = cvmfs::cvmfs_listdir(path,buf,buflen);
+  rc = ctx->impl->ListDirectory(path,buf,buflen);
   if( rc < 0 ) {
     errno = -rc;
     return -1;
@@ -470,6 +511,169 @@ int cvmfs_listdir(const char *path,char ***buf,size_t *buflen)
   return 0;
 }
 
+int cvmfs_ctx_listdir_stat(cvmfs_context *ctx, const char *path, void *buf,
+                           size_t *size)
+{
+  string lpath;
+  int rc;
+  rc = expand_path(ctx->impl,path,lpath);
+  if( rc < 0 ) {
+    return -1;
+  }
+  path = lpath.c_str();
+
+  catalog::StatEntryList listing;
+  rc = ctx->impl->ListDirectoryStat(path,&listing);
+  if( rc < 0 ) {
+    errno = -rc;
+    return -1;
+  }
+
+  size_t needed = listing.size() * sizeof(struct cvmfs_stat_entry);
+  for( unsigned i = 0; i < listing.size(); ++i ) {
+    needed += listing[i].name.GetLength() + 1;
+  }
+  if( needed > *size ) {
+    *size = needed;
+    errno = ERANGE;
+    return -1;
+  }
+
+  struct cvmfs_stat_entry *entries = (struct cvmfs_stat_entry *)buf;
+  char *names = (char *)buf + listing.size()*sizeof(struct cvmfs_stat_entry);
+  for( unsigned i = 0; i < listing.size(); ++i ) {
+    const unsigned length = listing[i].name.GetLength();
+    memcpy(names,listing[i].name.GetChars(),length);
+    names[length] = '\0';
+    entries[i].name = names;
+    entries[i].st = listing[i].info;
+    names += length + 1;
+  }
+  *size = needed;
+  return listing.size();
+}
+
+/* Batch operations.  The calling thread and up to kMaxBatchThreads-1
+ * helper threads take the paths one by one, so that catalog loads and
+ * downloads of different paths overlap.
+ */
+static const int kMaxBatchThreads = 16;
+
+enum batch_op {
+  kBatchStat,
+  kBatchLstat,
+  kBatchOpen,
+};
+
+struct batch_job {
+  cvmfs_context *ctx;
+  batch_op op;
+  const char **paths;
+  int num;
+  struct stat *st;
+  int *results;
+  atomic_int32 next;
+  atomic_int32 num_ok;
+};
+
+static void *batch_worker(void *data)
+{
+  batch_job *job = reinterpret_cast<batch_job *>(data);
+  int i;
+  while( (i = atomic_xadd32(&job->next,1)) < job->num ) {
+    int rc;
+    switch( job->op ) {
+      case kBatchStat:
+        rc = cvmfs_ctx_stat(job->ctx,job->paths[i],&job->st[i]);
+        break;
+      case kBatchLstat:
+        rc = cvmfs_ctx_lstat(job->ctx,job->paths[i],&job->st[i]);
+        break;
+      default:
+        rc = cvmfs_ctx_open(job->ctx,job->paths[i]);
+    }
+    if( rc < 0 ) {
+      job->results[i] = (job->op == kBatchOpen) ? -errno : errno;
+    } else {
+      job->results[i] = (job->op == kBatchOpen) ? rc : 0;
+      atomic_inc32(&job->num_ok);
+    }
+  }
+  return NULL;
+}
+
+static int run_batch(cvmfs_context *ctx, batch_op op, const char **paths,
+                     int num, struct stat *st, int *results)
+{
+  batch_job job;
+  job.ctx = ctx;
+  job.op = op;
+  job.paths = paths;
+  job.num = num;
+  job.st = st;
+  job.results = results;
+  atomic_init32(&job.next);
+  atomic_init32(&job.num_ok);
+
+  // Threads that fail to start are not needed, the caller works anyway
+  vector<pthread_t> threads;
+  const int num_threads = (num < kMaxBatchThreads) ? num : kMaxBatchThreads;
+  for( int i = 1; i < num_threads; ++i ) {
+    pthread_t thread;
+    if( pthread_create(&thread,NULL,batch_worker,&job) == 0 ) {
+      threads.push_back(thread);
+    }
+  }
+  batch_worker(&job);
+  for( unsigned i = 0; i < threads.size(); ++i ) {
+    pthread_join(threads[i],NULL);
+  }
+  return atomic_read32(&job.num_ok);
+}
+
+int cvmfs_ctx_stat_batch(cvmfs_context *ctx, const char **paths, int num,
+                         struct stat *st, int *results)
+{
+  return run_batch(ctx,kBatchStat,paths,num,st,results);
+}
+
+int cvmfs_ctx_lstat_batch(cvmfs_context *ctx, const char **paths, int num,
+                          struct stat *st, int *results)
+{
+  return run_batch(ctx,kBatchLstat,paths,num,st,results);
+}
+
+int cvmfs_ctx_open_batch(cvmfs_context *ctx, const char **paths, int num,
+                         int *fds)
+{
+  return run_batch(ctx,kBatchOpen,paths,num,NULL,fds);
+}
+
+int cvmfs_ctx_remount(cvmfs_context *ctx)
+{
+	catalog::LoadError retval = ctx->impl->Remount();
+	if( retval == catalog::kLoadNew || retval == catalog::kLoadUp2Date) {
+		return 0;
+	}
+	return -1;
+}
+
+unsigned cvmfs_ctx_ttl(cvmfs_context *ctx)
+{
+  return ctx->impl->GetTTL();
+}
+
+static cvmfs_context *attach_repo(const struct cvmfs_opts &cvmfs_opts)
+{
+  cvmfs::LibContext *impl =
+    cvmfs::LibContext::Create(cvmfs_opts.repo_name, cvmfs_opts.mountpoint,
+                              cvmfs_opts.allow_unsigned, "" /* root_hash */);
+  if( !impl ) {
+    return NULL;
+  }
+  return new cvmfs_context(impl);
+}
+
 int cvmfs_init(char const *options)
 {
   /* Parse options */
@@ -488,41 +692,72 @@ int cvmfs_init(char const *options)
     return -1;
   }
 
-  int rc = cvmfs::cvmfs_int_init(
-                          cvmfs_opts.url,
-                          cvmfs_opts.proxies,
-                          cvmfs_opts.repo_name,
-                          cvmfs_opts.mountpoint,
-                          cvmfs_opts.pubkey,
-                          cvmfs_opts.cachedir,
-                          false, /* cd_to_cachedir */
-                          cvmfs_opts.quota_limit,
-                          cvmfs_opts.quota_threshold,
-                          cvmfs_opts.rebuild_cachedb,
-                          cvmfs_opts.allow_unsigned,
-                          "" /* root_hash */,
-                          cvmfs_opts.timeout,
-                          cvmfs_opts.timeout_direct,
-                          cvmfs_opts.syslog_level,
-                          cvmfs_opts.logfile,
-                          cvmfs_opts.tracefile,
-                          cvmfs_opts.deep_mount,
-                          cvmfs_opts.blacklist,
-                          cvmfs_opts.nofiles,
-                          false   /* enable_monitor */
-                          );
+  cvmfs::GlobalOptions global_options;
+  global_options.hostname = cvmfs_opts.url;
+  global_options.proxies = cvmfs_opts.proxies;
+  global_options.pubkey = cvmfs_opts.pubkey;
+  global_options.cachedir = cvmfs_opts.cachedir;
+  global_options.cd_to_cachedir = false;
+  global_options.lock_name =
+    cvmfs_opts.repo_name.empty() ? "libcvmfs" : cvmfs_opts.repo_name;
+  global_options.quota_limit = cvmfs_opts.quota_limit;
+  global_options.quota_threshold = cvmfs_opts.quota_threshold;
+  global_options.rebuild_cachedb = cvmfs_opts.rebuild_cachedb;
+  global_options.timeout = cvmfs_opts.timeout;
+  global_options.timeout_direct = cvmfs_opts.timeout_direct;
+  global_options.syslog_level = cvmfs_opts.syslog_level;
+  global_options.logfile = cvmfs_opts.logfile;
+  global_options.tracefile = cvmfs_opts.tracefile;
+  global_options.blacklist = cvmfs_opts.blacklist;
+  global_options.nofiles = cvmfs_opts.nofiles;
+  global_options.enable_monitor = false;
+  int rc = cvmfs::cvmfs_int_init(global_options);
   if( rc != 0 ) {
     return -1;
   }
 
-  ::mountpoint = cvmfs_opts.mountpoint;
+  if( !cvmfs_opts.repo_name.empty() ) {
+    default_context = attach_repo(cvmfs_opts);
+    if( !default_context ) {
+      cvmfs::cvmfs_int_fini();
+      return -1;
+    }
+  }
 
   return 0;
 }
 
 void cvmfs_fini() {
+  if( default_context ) {
+    cvmfs_detach_repo(default_context);
+    default_context = NULL;
+  }
   cvmfs::cvmfs_int_fini();
-  ::mountpoint = "";
+}
+
+cvmfs_context *cvmfs_attach_repo(char const *options)
+{
+  struct cvmfs_opts cvmfs_opts;
+  int parse_result = cvmfs_opts.parse_options(options);
+  if (parse_result != 0)
+  {
+    if (parse_result < 0) {
+      fprintf(stderr,"Invalid CVMFS options: %s.\n",options);
+      cvmfs_opts.usage();
+    }
+    return NULL;
+  }
+  if (cvmfs_opts.repo_name.empty()) {
+    fprintf(stderr,"No repo_name specified in CVMFS options: %s.\n",options);
+    return NULL;
+  }
+  return attach_repo(cvmfs_opts);
+}
+
+void cvmfs_detach_repo(cvmfs_context *ctx)
+{
+  delete ctx->impl;
+  delete ctx;
 }
 
 static void (*ext_log_fn)(const char *msg) = NULL;
@@ -544,11 +779,81 @@ void cvmfs_set_log_fn( void (*log_fn)(const char *msg) )
 	}
 }
 
+/* The functions of the default repository */
+
+static bool has_default_context()
+{
+  if( !default_context ) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
 int cvmfs_remount()
 {
-	catalog::LoadError retval = cvmfs::RemountStart();
-	if( retval == catalog::kLoadNew || retval == catalog::kLoadUp2Date) {
-		return 0;
-	}
-	return -1;
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_remount(default_context);
+}
+
+int cvmfs_open(const char *path)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_open(default_context,path);
+}
+
+int cvmfs_close(int fd)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_close(default_context,fd);
+}
+
+int cvmfs_readlink(const char *path, char *buf, size_t size)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_readlink(default_context,path,buf,size);
+}
+
+int cvmfs_stat(const char *path,struct stat *st)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_stat(default_context,path,st);
+}
+
+int cvmfs_lstat(const char *path,struct stat *st)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_lstat(default_context,path,st);
+}
+
+int cvmfs_listdir(const char *path,char ***buf,size_t *buflen)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_listdir(default_context,path,buf,buflen);
+}
+
+int cvmfs_stat_batch(const char **paths, int num, struct stat *st,
+                     int *results)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_stat_batch(default_context,paths,num,st,results);
+}
+
+int cvmfs_lstat_batch(const char **paths, int num, struct stat *st,
+                      int *results)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_lstat_batch(default_context,paths,num,st,results);
+}
+
+int cvmfs_open_batch(const char **paths, int num, int *fds)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_open_batch(default_context,paths,num,fds);
+}
+
+int cvmfs_listdir_stat(const char *path, void *buf, size_t *size)
+{
+  if( !has_default_context() ) return -1;
+  return cvmfs_ctx_listdir_stat(default_context,path,buf,size);
 }
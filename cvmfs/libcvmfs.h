@@ -5,6 +5,8 @@
 #ifndef CVMFS_LIBCVMFS_H_
 #define CVMFS_LIBCVMFS_H_ 1
 
+#include <sys/stat.h>
+
 /*
  * NOTE: when adding or removing public symbols, you must also update
  * the list in libcvmfs_public_syms.txt.
@@ -13,8 +15,26 @@
 extern "C" {
 
 /**
- * Initialize the CVMFS library and attach the specified remote
- * repository.
+ * An attached repository, see cvmfs_attach_repo().
+ */
+typedef struct cvmfs_context cvmfs_context;
+
+/**
+ * A directory entry as returned by cvmfs_listdir_stat().
+ */
+struct cvmfs_stat_entry {
+  const char *name;  /**< points into the caller's buffer */
+  struct stat st;
+};
+
+/**
+ * Initialize the CVMFS library.  If repo_name is given, the repository
+ * is attached as the default repository, which is used by the functions
+ * without a context.
+ *
+ * The cache, the quota, the network settings and the public keys are
+ * shared by all repositories.  The servers in url can contain the
+ * placeholders @fqrn@ and @org@, which are replaced per repository.
  *
  * See libcvmfs usage() for possible options.
  *
@@ -24,10 +44,55 @@ extern "C" {
 int cvmfs_init(char const *options);
 
 /**
- * Shut down the CVMFS library and release all resources.
+ * Shut down the CVMFS library and release all resources.  Repositories
+ * attached by cvmfs_attach_repo() have to be detached before.
  */
 void cvmfs_fini();
 
+/**
+ * Attach another repository after cvmfs_init().  Takes the repository
+ * options repo_name (required), mountpoint, and allow_unsigned.
+ *
+ * @param[in] options, option1,option2,...
+ * \return the new context, NULL on failure (or if repo_name is already
+ *         attached)
+ */
+cvmfs_context *cvmfs_attach_repo(char const *options);
+
+/**
+ * Detach a repository.  Files opened by the context have to be closed
+ * before.  The context must not be in use by other threads.
+ */
+void cvmfs_detach_repo(cvmfs_context *ctx);
+
+/*
+ * The following functions take a context and behave like the
+ * functions of the default repository further below.  All of them can
+ * be called concurrently from many threads, for the same or for
+ * different contexts.
+ */
+int cvmfs_ctx_remount(cvmfs_context *ctx);
+/* Seconds until the catalogs of a context should be remounted, as
+ * given by the root catalog or the default TTL.
+ */
+unsigned cvmfs_ctx_ttl(cvmfs_context *ctx);
+int cvmfs_ctx_open(cvmfs_context *ctx, const char *path);
+int cvmfs_ctx_close(cvmfs_context *ctx, int fd);
+int cvmfs_ctx_readlink(cvmfs_context *ctx, const char *path, char *buf,
+                       size_t size);
+int cvmfs_ctx_stat(cvmfs_context *ctx, const char *path, struct stat *st);
+int cvmfs_ctx_lstat(cvmfs_context *ctx, const char *path, struct stat *st);
+int cvmfs_ctx_listdir(cvmfs_context *ctx, const char *path, char ***buf,
+                      size_t *buflen);
+int cvmfs_ctx_stat_batch(cvmfs_context *ctx, const char **paths, int num,
+                         struct stat *st, int *results);
+int cvmfs_ctx_lstat_batch(cvmfs_context *ctx, const char **paths, int num,
+                          struct stat *st, int *results);
+int cvmfs_ctx_open_batch(cvmfs_context *ctx, const char **paths, int num,
+                         int *fds);
+int cvmfs_ctx_listdir_stat(cvmfs_context *ctx, const char *path, void *buf,
+                           size_t *size);
+
 /* Load a new catalog if there is one
  * \return 0 on success
  */
@@ -98,6 +163,51 @@ int cvmfs_lstat(const char *path,struct stat *st);
  */
 int cvmfs_listdir(const char *path,char ***buf,size_t *buflen);
 
+/* Get information about many files at once.  The paths are looked up
+ * by a few threads in parallel, so that the catalogs on the way are
+ * loaded concurrently.  For every path, results[i] is 0 and st[i] is
+ * filled in on success, otherwise results[i] is the errno value.
+ * cvmfs_lstat_batch() does not follow the final symlinks.
+ *
+ * @param[in] paths, paths of the files (e.g. /dir/file)
+ * @param[in] num, number of paths
+ * @param[out] st, array of num stat buffers
+ * @param[out] results, array of num error codes
+ * \return number of successfully stat'ed paths
+ */
+int cvmfs_stat_batch(const char **paths, int num, struct stat *st,
+                     int *results);
+int cvmfs_lstat_batch(const char **paths, int num, struct stat *st,
+                      int *results);
+
+/* Open many files at once.  Files that are not in the cache are
+ * downloaded in parallel.  For every path, fds[i] is the read-only
+ * file descriptor on success, to be closed by cvmfs_close(), otherwise
+ * -errno.
+ *
+ * @param[in] paths, paths of the files (e.g. /dir/file)
+ * @param[in] num, number of paths
+ * @param[out] fds, array of num file descriptors
+ * \return number of successfully opened paths
+ */
+int cvmfs_open_batch(const char **paths, int num, int *fds);
+
+/* Get the directory contents together with the stat information of
+ * the entries, including "." and "..", in a caller-provided buffer.
+ *
+ * On return, the buffer starts with an array of struct
+ * cvmfs_stat_entry, followed by the names.  Nothing has to be freed.
+ * If the buffer is too small, -1 is returned, errno is set to ERANGE,
+ * and *size is set to the required size.  The buffer has to be
+ * suitably aligned for struct cvmfs_stat_entry, e.g. by malloc().
+ *
+ * @param[in] path, path of directory (e.g. /dir, not /cvmfs/repo/dir)
+ * @param[out] buf, buffer for the entries and the names
+ * @param[in,out] size, size of buf, the used size on return
+ * \return number of entries, -1 on failure (sets errno)
+ */
+int cvmfs_listdir_stat(const char *path, void *buf, size_t *size);
+
 }
 
 #endif  // CVMFS_LIBCVMFS_H_
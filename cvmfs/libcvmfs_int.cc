@@ -58,6 +58,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <functional>
 
@@ -80,17 +81,13 @@
 #include "shortstring.h"
 #include "smalloc.h"
 #include "globals.h"
+#include "sharded_counter.h"
 #include "libcvmfs_int.h"
 
 using namespace std;  // NOLINT
 
 namespace cvmfs {
 
-const unsigned int kPathCacheSize = 4800;
-const unsigned int kMd5pathCacheSize = 32000;
-
-const unsigned int kShortTermTTL = 180;  /**< If catalog reload fails, try again
-                                              in 3 minutes */
 const time_t kIndefiniteDeadline = time_t(-1);
 
 const int kMaxInitIoDelay = 32; /**< Maximum start value for exponential
@@ -98,33 +95,36 @@ const int kMaxInitIoDelay = 32; /**< Maximum start value for exponential
 const int kMaxIoDelay = 2000; /**< Maximum 2 seconds */
 const int kForgetDos = 10000; /**< Clear DoS memory after 10 seconds */
 /**
- * Prevent DoS attacks on the Squid server
+ * Prevent DoS attacks on the Squid server, shared by all repositories
  */
 static struct {
   time_t timestamp;
   int delay;
 } previous_io_error_;
+pthread_mutex_t lock_io_error_ = PTHREAD_MUTEX_INITIALIZER;
 
 bool foreground_ = false;
-string *mountpoint_ = NULL;
 string *cachedir_ = NULL;
 string relative_cachedir; /* path to cachedir, relative to current working dir */
 string *tracefile_ = NULL;
-string *repository_name_ = NULL;  /**< Expected repository name,
-                                       e.g. atlas.cern.ch */
+string *lock_name_ = NULL;  /**< names lock file and running sentinel */
 pid_t pid_ = 0;  /**< will be set after deamon() */
 time_t boot_time_;
-pthread_mutex_t lock_max_ttl_ = PTHREAD_MUTEX_INITIALIZER;
-cache::CatalogManager *catalog_manager_;
-lru::Md5PathCache *md5path_cache_ = NULL;
-
-atomic_int64 num_fs_open_;
-atomic_int64 num_fs_dir_open_;
-atomic_int64 num_fs_lookup_;
-atomic_int64 num_fs_lookup_negative_;
-atomic_int64 num_fs_stat_;
-atomic_int64 num_fs_read_;
-atomic_int64 num_fs_readlink_;
+
+/**
+ * Names of the attached repositories.  A repository can only be attached
+ * once, the catalog managers would compete for the same files in the cache.
+ */
+set<string> *attached_repositories_ = NULL;
+pthread_mutex_t lock_attached_ = PTHREAD_MUTEX_INITIALIZER;
+
+ShardedCounter num_fs_open_;
+ShardedCounter num_fs_dir_open_;
+ShardedCounter num_fs_lookup_;
+ShardedCounter num_fs_lookup_negative_;
+ShardedCounter num_fs_stat_;
+ShardedCounter num_fs_read_;
+ShardedCounter num_fs_readlink_;
 atomic_int32 num_io_error_;
 atomic_int32 open_files_; /**< number of currently open files by Fuse calls */
 atomic_int32 open_dirs_; /**< number of currently open directories */
@@ -132,113 +132,6 @@ unsigned max_open_files_; /**< maximum allowed number of open files */
 const int kNumReservedFd = 512;  /**< Number of reserved file descriptors for
                                       internal use */
 
-
-unsigned GetMaxTTL() {
-  return 0;
-}
-
-
-void SetMaxTTL(const unsigned value) {
-}
-
-
-unsigned GetRevision() {
-  return catalog_manager_->GetRevision();
-};
-
-
-std::string GetOpenCatalogs() {
-  return catalog_manager_->PrintHierarchy();
-}
-
-
-void ResetErrorCounters() {
-  atomic_init32(&num_io_error_);
-}
-
-
-void GetLruStatistics(lru::Statistics *inode_stats, lru::Statistics *path_stats,
-                      lru::Statistics *md5path_stats)
-{
-  *md5path_stats = md5path_cache_->statistics();
-}
-
-
-catalog::Statistics GetCatalogStatistics() {
-  return catalog_manager_->statistics();
-}
-
-string GetCertificateStats() {
-  return catalog_manager_->GetCertificateStats();
-}
-
-string GetFsStats() {
-  return "lookup(all): " + StringifyInt(atomic_read64(&num_fs_lookup_)) + "  " +
-    "lookup(negative): " + StringifyInt(atomic_read64(&num_fs_lookup_negative_))
-      + "  " +
-    "stat(): " + StringifyInt(atomic_read64(&num_fs_stat_)) + "  " +
-    "open(): " + StringifyInt(atomic_read64(&num_fs_open_)) + "  " +
-    "diropen(): " + StringifyInt(atomic_read64(&num_fs_dir_open_)) + "  " +
-    "read(): " + StringifyInt(atomic_read64(&num_fs_read_)) + "  " +
-    "readlink(): " + StringifyInt(atomic_read64(&num_fs_readlink_)) + "\n";
-}
-
-
-/**
- * If there is a new catalog version, load it.
- */
-catalog::LoadError RemountStart() {
-  catalog::LoadError retval = catalog_manager_->Remount(true);
-  if (retval == catalog::kLoadNew) {
-    LogCvmfs(kLogCvmfs, kLogDebug,
-             "new catalog revision available");
-
-    LogCvmfs(kLogCvmfs, kLogDebug, "applying new catalog");
-    md5path_cache_->Pause();
-    md5path_cache_->Drop();
-    retval = catalog_manager_->Remount(false);
-    md5path_cache_->Resume();
-    if ((retval == catalog::kLoadFail) || (retval == catalog::kLoadNoSpace) ||
-        catalog_manager_->offline_mode())
-    {
-      LogCvmfs(kLogCvmfs, kLogDebug, "reload/finish failed");
-    }
-  }
-  return retval;
-}
-
-
-static bool GetDirentForPath(const PathString &path,
-                             catalog::DirectoryEntry *dirent)
-{
-  if( path.GetLength() == 1 && path.GetChars()[0] == '/' ) {
-    // root path is expected to be "", not "/"
-    PathString p;
-    return GetDirentForPath(p,dirent);
-  }
-  hash::Md5 md5path(path.GetChars(), path.GetLength());
-  if (md5path_cache_->Lookup(md5path, dirent))
-    return dirent->GetSpecial() != catalog::kDirentNegative;
-
-  // Lookup inode in catalog TODO: not twice md5 calculation
-  if (catalog_manager_->LookupPath(path, catalog::kLookupSole, dirent)) {
-    md5path_cache_->Insert(md5path, *dirent);
-    return true;
-  }
-
-  LogCvmfs(kLogCvmfs, kLogDebug, "GetDirentForPath, no entry");
-  md5path_cache_->InsertNegative(md5path);
-  return false;
-}
-
-/**
- * Removes a file from local cache
- */
-int ClearFile(const string &path) {
-	// not implemented, but required for linking
-  return 0;
-}
-
 }  // namespace cvmfs
 
 
@@ -299,39 +192,18 @@ static bool peers_ready;
 static bool monitor_ready;
 static bool signature_ready;
 static bool quota_ready;
-static bool catalog_ready;
 static bool running_created;
 
 
 /**
- * Off we go
+ * Off we go.  Sets up everything that is shared by the repositories, which
+ * are attached afterwards by LibContext::Create().
  */
-
-int cvmfs_int_init(
-  const std::string &cvmfs_opts_hostname, /* url of repository */
-  const std::string &cvmfs_opts_proxies,
-  const std::string &cvmfs_opts_repo_name,
-  const std::string &cvmfs_opts_mountpoint,
-  const std::string &cvmfs_opts_pubkey,
-  const std::string &cvmfs_opts_cachedir,
-  bool cvmfs_opts_cd_to_cachedir,
-  int64_t cvmfs_opts_quota_limit,
-  int64_t cvmfs_opts_quota_threshold,
-  bool cvmfs_opts_rebuild_cachedb,
-  bool cvmfs_opts_ignore_signature,
-  const std::string &cvmfs_opts_root_hash,
-  unsigned cvmfs_opts_timeout,
-  unsigned cvmfs_opts_timeout_direct,
-  int cvmfs_opts_syslog_level,
-  const std::string &cvmfs_opts_logfile,
-  const std::string &cvmfs_opts_tracefile,
-  const std::string &cvmfs_opts_deep_mount,
-  const std::string &cvmfs_opts_blacklist,
-  int cvmfs_opts_nofiles,
-  bool cvmfs_opts_enable_monitor
-) {
-
+int cvmfs_int_init(const GlobalOptions &options) {
   int retval;
+  int64_t quota_limit = options.quota_limit;
+  int64_t quota_threshold = options.quota_threshold;
+  bool rebuild_cachedb = options.rebuild_cachedb;
 
   fd_lockfile = -1;
   sqlite_scratch = NULL;
@@ -343,23 +215,22 @@ int cvmfs_int_init(
   monitor_ready = false;
   signature_ready = false;
   quota_ready = false;
-  catalog_ready = false;
   running_created = false;
 
   cvmfs::boot_time_ = time(NULL);
   SetupLibcryptoMt();
 
   // Fill cvmfs option variables from arguments
-  cvmfs::mountpoint_ = new string(cvmfs_opts_mountpoint);
-  cvmfs::cachedir_ = new string(cvmfs_opts_cachedir);
-  if (cvmfs_opts_cd_to_cachedir) {
+  cvmfs::cachedir_ = new string(options.cachedir);
+  if (options.cd_to_cachedir) {
     cvmfs::relative_cachedir = ".";
   }
   else {
     cvmfs::relative_cachedir = *cvmfs::cachedir_;
   }
-  cvmfs::tracefile_ = new string(cvmfs_opts_tracefile);
-  cvmfs::repository_name_ = new string(cvmfs_opts_repo_name);
+  cvmfs::tracefile_ = new string(options.tracefile);
+  cvmfs::lock_name_ = new string(options.lock_name);
+  cvmfs::attached_repositories_ = new set<string>();
   g_uid = getuid();
   g_gid = getgid();
   options_ready = true;
@@ -377,35 +248,35 @@ int cvmfs_int_init(
   assert(retval == SQLITE_OK);
 
   // Runtime counters
-  atomic_init64(&cvmfs::num_fs_open_);
-  atomic_init64(&cvmfs::num_fs_dir_open_);
-  atomic_init64(&cvmfs::num_fs_lookup_);
-  atomic_init64(&cvmfs::num_fs_lookup_negative_);
-  atomic_init64(&cvmfs::num_fs_stat_);
-  atomic_init64(&cvmfs::num_fs_read_);
-  atomic_init64(&cvmfs::num_fs_readlink_);
+  cvmfs::num_fs_open_.Reset();
+  cvmfs::num_fs_dir_open_.Reset();
+  cvmfs::num_fs_lookup_.Reset();
+  cvmfs::num_fs_lookup_negative_.Reset();
+  cvmfs::num_fs_stat_.Reset();
+  cvmfs::num_fs_read_.Reset();
+  cvmfs::num_fs_readlink_.Reset();
   atomic_init32(&cvmfs::num_io_error_);
   cvmfs::previous_io_error_.timestamp = 0;
   cvmfs::previous_io_error_.delay = 0;
 
   // Logging
-  SetLogSyslogLevel(cvmfs_opts_syslog_level);
-  SetLogSyslogPrefix(*cvmfs::repository_name_);
-  if (!cvmfs_opts_logfile.empty())
-    SetLogDebugFile(string(cvmfs_opts_logfile));
+  SetLogSyslogLevel(options.syslog_level);
+  SetLogSyslogPrefix(*cvmfs::lock_name_);
+  if (!options.logfile.empty())
+    SetLogDebugFile(options.logfile);
 
   // Maximum number of open files
-  if (cvmfs_opts_nofiles) {
-    if (cvmfs_opts_nofiles < 0) {
+  if (options.nofiles) {
+    if (options.nofiles < 0) {
       PrintError("number of open files must be a positive number");
       goto cvmfs_cleanup;
     }
     struct rlimit rpl;
     memset(&rpl, 0, sizeof(rpl));
     getrlimit(RLIMIT_NOFILE, &rpl);
-    if (rpl.rlim_max < (unsigned)cvmfs_opts_nofiles)
-      rpl.rlim_max = cvmfs_opts_nofiles;
-    rpl.rlim_cur = cvmfs_opts_nofiles;
+    if (rpl.rlim_max < (unsigned)options.nofiles)
+      rpl.rlim_max = options.nofiles;
+    rpl.rlim_cur = options.nofiles;
     if (setrlimit(RLIMIT_NOFILE, &rpl) != 0) {
       PrintError("Failed to set maximum number of open files, "
                  "insufficient permissions");
@@ -423,29 +294,29 @@ int cvmfs_int_init(
 
   // Try to jump to cache directory.  This tests, if it is accassible.
   // Also, it brings speed later on.
-  if (cvmfs_opts_cd_to_cachedir && chdir(cvmfs::cachedir_->c_str()) != 0) {
+  if (options.cd_to_cachedir && chdir(cvmfs::cachedir_->c_str()) != 0) {
     PrintError("cache directory " + *cvmfs::cachedir_ + " is unavailable");
     goto cvmfs_cleanup;
   }
 
   // Create lock file and running sentinel
-  fd_lockfile = LockFile(relative_cachedir + "/lock." + *cvmfs::repository_name_);
+  fd_lockfile = LockFile(relative_cachedir + "/lock." + *cvmfs::lock_name_);
   if (fd_lockfile < 0) {
     PrintError("could not acquire lock (" + StringifyInt(errno) + ")");
     goto cvmfs_cleanup;
   }
   {
     platform_stat64 info;
-    if (platform_stat((relative_cachedir + "/running." + *cvmfs::repository_name_).c_str(),
-                      &info) == 0)
+    if (platform_stat((relative_cachedir + "/running." +
+                       *cvmfs::lock_name_).c_str(), &info) == 0)
     {
       LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog, "looks like cvmfs has been "
                "crashed previously, rebuilding cache database");
-      cvmfs_opts_rebuild_cachedb = 1;
+      rebuild_cachedb = true;
     }
   }
-  retval = open((relative_cachedir + "/running." + *cvmfs::repository_name_).c_str(),
-                O_RDONLY | O_CREAT, 0600);
+  retval = open((relative_cachedir + "/running." +
+                 *cvmfs::lock_name_).c_str(), O_RDONLY | O_CREAT, 0600);
   if (retval < 0) {
     PrintError("could not open running sentinel (" + StringifyInt(errno) + ")");
     goto cvmfs_cleanup;
@@ -454,7 +325,7 @@ int cvmfs_int_init(
   running_created = true;
 
   // Creates a set of cache directories (256 directories named 00..ff)
-  if (!cache::Init(relative_cachedir)) {
+  if (!cache::Init(relative_cachedir, false)) {
     PrintError("Failed to setup cache in " + *cvmfs::cachedir_ +
                ": " + strerror(errno));
     goto cvmfs_cleanup;
@@ -462,17 +333,16 @@ int cvmfs_int_init(
   cache_ready = true;
 
   // Init quota / managed cache
-  if (cvmfs_opts_quota_limit < 0) {
+  if (quota_limit < 0) {
     LogCvmfs(kLogCvmfs, kLogDebug, "unlimited cache size");
-    cvmfs_opts_quota_limit = -1;
-    cvmfs_opts_quota_threshold = 0;
+    quota_limit = -1;
+    quota_threshold = 0;
   } else {
-    cvmfs_opts_quota_limit *= 1024*1024;
-    cvmfs_opts_quota_threshold *= 1024*1024;
+    quota_limit *= 1024*1024;
+    quota_threshold *= 1024*1024;
   }
-  if (!quota::Init(relative_cachedir, (uint64_t)cvmfs_opts_quota_limit,
-                   (uint64_t)cvmfs_opts_quota_threshold,
-                   cvmfs_opts_rebuild_cachedb))
+  if (!quota::Init(relative_cachedir, (uint64_t)quota_limit,
+                   (uint64_t)quota_threshold, rebuild_cachedb))
   {
     PrintError("Failed to initialize lru cache");
     goto cvmfs_cleanup;
@@ -481,19 +351,19 @@ int cvmfs_int_init(
 
   if (quota::GetSize() > quota::GetCapacity()) {
     PrintWarning("your cache is already beyond quota size, cleaning up");
-    if (!quota::Cleanup(cvmfs_opts_quota_threshold)) {
+    if (!quota::Cleanup(quota_threshold)) {
       PrintWarning("Failed to clean up");
       goto cvmfs_cleanup;
     }
   }
-  if (cvmfs_opts_quota_limit) {
+  if (quota_limit) {
     LogCvmfs(kLogCvmfs, kLogStdout,
              "CernVM-FS: quota initialized, current size %luMB",
              quota::GetSize()/(1024*1024));
   }
 
   // Monitor, check for maximum number of open files
-  if (cvmfs_opts_enable_monitor) {
+  if (options.enable_monitor) {
     if (!monitor::Init(relative_cachedir, true)) {
       PrintError("failed to initialize watchdog.");
       goto cvmfs_cleanup;
@@ -509,52 +379,29 @@ int cvmfs_int_init(
 
   // Network initialization
   download::Init(16);
-  download::SetHostChain(string(cvmfs_opts_hostname));
-  download::SetProxyChain(cvmfs_opts_proxies);
-  download::SetTimeout(cvmfs_opts_timeout, cvmfs_opts_timeout_direct);
+  download::SetHostChain(options.hostname);
+  download::SetProxyChain(options.proxies);
+  download::SetTimeout(options.timeout, options.timeout_direct);
   download_ready = true;
 
   signature::Init();
-  if (!signature::LoadPublicRsaKeys(cvmfs_opts_pubkey))
+  signature_ready = true;
+  if (!signature::LoadPublicRsaKeys(options.pubkey))
   {
     PrintError("failed to load public key(s)");
     goto cvmfs_cleanup;
   } else {
       LogCvmfs(kLogCvmfs, kLogStdout, "CernVM-FS: using public key(s) %s",
                JoinStrings(
-                 SplitString(cvmfs_opts_pubkey, ':'), ", ").c_str());
+                 SplitString(options.pubkey, ':'), ", ").c_str());
   }
-  signature_ready = true;
-  if (!cvmfs_opts_blacklist.empty()) {
-    if (!signature::LoadBlacklist(cvmfs_opts_blacklist)) {
+  if (!options.blacklist.empty()) {
+    if (!signature::LoadBlacklist(options.blacklist)) {
       LogCvmfs(kLogCvmfs, kLogDebug, "failed to load blacklist");
       goto cvmfs_cleanup;
     }
   }
 
-  // Load initial file catalog
-  cvmfs::catalog_manager_ = new
-    cache::CatalogManager(*cvmfs::repository_name_,
-                          cvmfs_opts_ignore_signature);
-  if (!cvmfs_opts_root_hash.empty()) {
-    retval = cvmfs::catalog_manager_->InitFixed(
-      hash::Any(hash::kSha1, hash::HexPtr(string(cvmfs_opts_root_hash))));
-  } else {
-    retval = cvmfs::catalog_manager_->Init();
-  }
-  if (!retval) {
-    LogCvmfs(kLogCvmfs, kLogStderr, "Failed to initialize root file catalog");
-    goto cvmfs_cleanup;
-  }
-  catalog_ready = true;
-
-  // Set fuse callbacks, remove url from arguments
-  LogCvmfs(kLogCvmfs, kLogSyslog,
-           "CernVM-FS: linking %s to repository %s",
-           cvmfs::mountpoint_->c_str(), cvmfs::repository_name_->c_str());
-
-  cvmfs::md5path_cache_ = new lru::Md5PathCache(cvmfs::kMd5pathCacheSize);
-
   cvmfs_int_spawn();
   return 0;
 
@@ -583,20 +430,19 @@ void cvmfs_int_spawn() {
 
 }
 
+/**
+ * All contexts have to be destroyed before.
+ */
 void cvmfs_int_fini() {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_destroy");
 
-  delete cvmfs::catalog_manager_;
-  delete cvmfs::md5path_cache_;
-  cvmfs::catalog_manager_ = NULL;
-  cvmfs::md5path_cache_ = NULL;
-
   if (signature_ready) signature::Fini();
   if (download_ready) download::Fini();
   if (monitor_ready) monitor::Fini();
   if (quota_ready) quota::Fini();
   if (cache_ready) cache::Fini();
-  if (running_created) unlink((relative_cachedir + "/running." + *cvmfs::repository_name_).c_str());
+  if (running_created)
+    unlink((relative_cachedir + "/running." + *cvmfs::lock_name_).c_str());
   if (fd_lockfile >= 0) UnlockFile(fd_lockfile);
   if (peers_ready) peers::Fini();
   tracer::Fini();
@@ -607,10 +453,169 @@ void cvmfs_int_fini() {
   sqlite_page_cache = NULL;
   sqlite_scratch = NULL;
 
+  delete cvmfs::cachedir_;
+  delete cvmfs::tracefile_;
+  delete cvmfs::lock_name_;
+  delete cvmfs::attached_repositories_;
+  cvmfs::cachedir_ = NULL;
+  cvmfs::tracefile_ = NULL;
+  cvmfs::lock_name_ = NULL;
+  cvmfs::attached_repositories_ = NULL;
+
   CleanupLibcryptoMt();
 }
 
-int cvmfs_open(const char *c_path)
+
+LibContext::LibContext(const string &repository_name,
+                       const string &mountpoint) :
+  repository_name_(repository_name),
+  mountpoint_(mountpoint),
+  catalog_manager_(NULL),
+  md5path_cache_(NULL),
+  resolved_path_cache_(NULL)
+{ }
+
+
+/**
+ * Loads the root catalog of a repository.  Returns NULL if the repository is
+ * already attached or if the catalog cannot be loaded.
+ */
+LibContext *LibContext::Create(const string &repository_name,
+                               const string &mountpoint,
+                               const bool ignore_signature,
+                               const string &root_hash)
+{
+  pthread_mutex_lock(&lock_attached_);
+  const bool is_new = attached_repositories_->insert(repository_name).second;
+  pthread_mutex_unlock(&lock_attached_);
+  if (!is_new) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "repository %s is already attached",
+             repository_name.c_str());
+    return NULL;
+  }
+
+  LibContext *context = new LibContext(repository_name, mountpoint);
+  context->catalog_manager_ =
+    new cache::CatalogManager(repository_name, ignore_signature);
+  bool retval;
+  if (!root_hash.empty()) {
+    retval = context->catalog_manager_->InitFixed(
+      hash::Any(hash::kSha1, hash::HexPtr(root_hash)));
+  } else {
+    retval = context->catalog_manager_->Init();
+  }
+  if (!retval) {
+    LogCvmfs(kLogCvmfs, kLogStderr,
+             "Failed to initialize root file catalog of %s",
+             repository_name.c_str());
+    delete context;
+    return NULL;
+  }
+  context->md5path_cache_ = new lru::Md5PathCache(kMd5pathCacheSize);
+  context->resolved_path_cache_ =
+    new lru::ResolvedPathCache(kResolvedPathCacheSize);
+
+  LogCvmfs(kLogCvmfs, kLogSyslog,
+           "CernVM-FS: linking %s to repository %s",
+           mountpoint.c_str(), repository_name.c_str());
+  return context;
+}
+
+
+/**
+ * Open files of the context have to be closed before.
+ */
+LibContext::~LibContext() {
+  delete catalog_manager_;
+  delete md5path_cache_;
+  delete resolved_path_cache_;
+  pthread_mutex_lock(&lock_attached_);
+  attached_repositories_->erase(repository_name_);
+  pthread_mutex_unlock(&lock_attached_);
+}
+
+
+/**
+ * If there is a new catalog version, load it.
+ */
+catalog::LoadError LibContext::Remount() {
+  catalog::LoadError retval = catalog_manager_->Remount(true);
+  if (retval == catalog::kLoadNew) {
+    LogCvmfs(kLogCvmfs, kLogDebug,
+             "new catalog revision of %s available", repository_name_.c_str());
+
+    LogCvmfs(kLogCvmfs, kLogDebug, "applying new catalog");
+    md5path_cache_->Pause();
+    resolved_path_cache_->Pause();
+    md5path_cache_->Drop();
+    resolved_path_cache_->Drop();
+    retval = catalog_manager_->Remount(false);
+    resolved_path_cache_->Resume();
+    md5path_cache_->Resume();
+    if ((retval == catalog::kLoadFail) || (retval == catalog::kLoadNoSpace) ||
+        catalog_manager_->offline_mode())
+    {
+      LogCvmfs(kLogCvmfs, kLogDebug, "reload/finish failed");
+    }
+  }
+  return retval;
+}
+
+
+uint64_t LibContext::GetTTL() const {
+  return catalog_manager_->GetTTL();
+}
+
+
+bool LibContext::GetDirentForPath(const PathString &path,
+                                  catalog::DirectoryEntry *dirent)
+{
+  if( path.GetLength() == 1 && path.GetChars()[0] == '/' ) {
+    // root path is expected to be "", not "/"
+    PathString p;
+    return GetDirentForPath(p,dirent);
+  }
+  hash::Md5 md5path(path.GetChars(), path.GetLength());
+  if (md5path_cache_->Lookup(md5path, dirent))
+    return dirent->GetSpecial() != catalog::kDirentNegative;
+
+  // Lookup inode in catalog
+  if (catalog_manager_->LookupPath(path, md5path, catalog::kLookupSole,
+                                   dirent))
+  {
+    md5path_cache_->Insert(md5path, *dirent);
+    return true;
+  }
+
+  LogCvmfs(kLogCvmfs, kLogDebug, "GetDirentForPath, no entry");
+  md5path_cache_->InsertNegative(md5path);
+  return false;
+}
+
+
+/**
+ * Symlinks can change with every catalog revision, so the cache is dropped on
+ * remount.
+ */
+bool LibContext::LookupResolved(const string &path, string *resolved) {
+  PathString resolved_path;
+  if (!resolved_path_cache_->Lookup(hash::Md5(path.data(), path.length()),
+                                    &resolved_path))
+  {
+    return false;
+  }
+  resolved->assign(resolved_path.GetChars(), resolved_path.GetLength());
+  return true;
+}
+
+
+void LibContext::InsertResolved(const string &path, const string &resolved) {
+  resolved_path_cache_->Insert(hash::Md5(path.data(), path.length()),
+                               PathString(resolved.data(), resolved.length()));
+}
+
+
+int LibContext::Open(const char *c_path)
 {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_open on path: %s", c_path);
 
@@ -624,9 +629,18 @@ int cvmfs_open(const char *c_path)
   if (!found) {
     return -ENOENT;
   }
+  // Chunked files without a bulk version cannot be read here
+  if (dirent.IsRegular() && dirent.checksum().IsNull()) {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "no bulk version of chunked file %s", c_path);
+    return -EIO;
+  }
 
-  fd = cache::Fetch(dirent, string(path.GetChars(), path.GetLength()));  // TODO
-  atomic_inc64(&num_fs_open_);
+  // The host chain might contain the repository name
+  cache::SetDownloadRepository(&repository_name_);
+  fd = cache::Fetch(dirent, path);
+  cache::SetDownloadRepository(NULL);
+  num_fs_open_.Inc();
 
   if (fd >= 0) {
     if (atomic_xadd32(&open_files_, 1) <
@@ -651,8 +665,10 @@ int cvmfs_open(const char *c_path)
   // Prevent Squid DoS
   // TODO: move to download
   time_t now = time(NULL);
+  pthread_mutex_lock(&lock_io_error_);
+  int delay = 0;
   if (now - previous_io_error_.timestamp < kForgetDos) {
-    usleep(previous_io_error_.delay*1000);
+    delay = previous_io_error_.delay;
     if (previous_io_error_.delay < kMaxIoDelay)
       previous_io_error_.delay *= 2;
   } else {
@@ -660,12 +676,15 @@ int cvmfs_open(const char *c_path)
     previous_io_error_.delay = (random() % (kMaxInitIoDelay-1)) + 2;
   }
   previous_io_error_.timestamp = now;
+  pthread_mutex_unlock(&lock_io_error_);
+  if (delay > 0)
+    usleep(delay*1000);
 
   atomic_inc32(&num_io_error_);
   return fd;
 }
 
-int cvmfs_close(int fd)
+int LibContext::Close(const int fd)
 {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_close on file number: %d",
            fd);
@@ -678,9 +697,9 @@ int cvmfs_close(int fd)
 /**
  * Transform a cvmfs dirent into a struct stat.
  */
-int cvmfs_getattr(const char *c_path, struct stat *info)
+int LibContext::GetAttr(const char *c_path, struct stat *info)
 {
-  atomic_inc64(&num_fs_stat_);
+  num_fs_stat_.Inc();
 
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_getattr (stat) for path: %s", c_path);
 
@@ -701,9 +720,9 @@ int cvmfs_getattr(const char *c_path, struct stat *info)
 /**
  * Reads a symlink from the catalog.  Environment variables are expanded.
  */
-int cvmfs_readlink(const char *c_path, char *buf, size_t size)
+int LibContext::Readlink(const char *c_path, char *buf, const size_t size)
 {
-  atomic_inc64(&num_fs_readlink_);
+  num_fs_readlink_.Inc();
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_readlink on path: %s", c_path);
 
   PathString p;
@@ -746,7 +765,7 @@ static void append_string_to_list(char const *str,char ***buf,size_t *listlen,si
    }
 }
 
-int cvmfs_listdir(const char *c_path,char ***buf,size_t *buflen)
+int LibContext::ListDirectory(const char *c_path,char ***buf,size_t *buflen)
 {
   LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_listdir on path: %s", c_path);
 
@@ -797,40 +816,47 @@ int cvmfs_listdir(const char *c_path,char ***buf,size_t *buflen)
   return 0;
 }
 
-int cvmfs_statfs(const char *c_path __attribute__((unused)), struct statvfs *info)
+/**
+ * Like ListDirectory() but with the stat information, which the catalog
+ * provides anyway.  Includes "." and, except for the root, "..".
+ */
+int LibContext::ListDirectoryStat(const char *c_path,
+                                  catalog::StatEntryList *listing)
 {
-  LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_statfs on path: %s", c_path);
-
-  // If we return 0 it will cause the fs to be ignored in "df"
-  memset(info, 0, sizeof(*info));
+  LogCvmfs(kLogCvmfs, kLogDebug, "cvmfs_listdir_stat on path: %s", c_path);
 
-  // Unmanaged cache
-  if (quota::GetCapacity() == 0) {
-    return 0;
+  if( c_path[0] == '/' && c_path[1] == '\0' ) {
+    // root path is expected to be "", not "/"
+    c_path = "";
   }
 
-  uint64_t available = 0;
-  uint64_t size = quota::GetSize();
-  info->f_bsize = 1;
+  PathString path;
+  path.Assign(c_path, strlen(c_path));
 
-  if (quota::GetCapacity() == (uint64_t)(-1)) {
-    // Unrestricted cache, look at free space on cache dir fs
-    struct statfs cache_buf;
-    if (statfs(relative_cachedir.c_str(), &cache_buf) == 0) {
-      available = cache_buf.f_bavail * cache_buf.f_bsize;
-      info->f_blocks = size + available;
-    } else {
-      info->f_blocks = size;
-    }
-  } else {
-    // Take values from LRU module
-    info->f_blocks = quota::GetCapacity();
-    available = quota::GetCapacity() - size;
-  }
+  catalog::DirectoryEntry d;
+  if (!GetDirentForPath(path, &d))
+    return -ENOENT;
+  if (!d.IsDirectory())
+    return -ENOTDIR;
 
-  info->f_bfree = info->f_bavail = available;
+  listing->clear();
+  listing->push_back(catalog::StatEntry(NameString(".", 1),
+                                        d.GetStatStructure()));
+  if (d.inode() != catalog_manager_->GetRootInode()) {
+    const string parent = GetParentPath(string(c_path));
+    catalog::DirectoryEntry p;
+    if (!GetDirentForPath(PathString(parent.data(), parent.length()), &p))
+      return -EIO;
+    listing->push_back(catalog::StatEntry(NameString("..", 2),
+                                          p.GetStatStructure()));
+  }
 
+  catalog::StatEntryList listing_from_catalog;
+  if (!catalog_manager_->ListingStat(path, &listing_from_catalog))
+    return -EIO;
+  listing->insert(listing->end(), listing_from_catalog.begin(),
+                  listing_from_catalog.end());
   return 0;
 }
 
-}
+}  // namespace cvmfs
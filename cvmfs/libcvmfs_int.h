@@ -8,6 +8,9 @@
 #ifndef CVMFS_LIBCVMFS_INT_H_
 #define CVMFS_LIBCVMFS_INT_H_
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -17,61 +20,89 @@
 #include "catalog_mgr.h"
 #include "lru.h"
 
+namespace cache {
+class CatalogManager;
+}
+
 namespace cvmfs {
 
 extern pid_t pid_;
-extern std::string *mountpoint_;
-extern std::string *repository_name_;
-extern int max_cache_timeout_;
 extern bool foreground_;
 
-int ClearFile(const std::string &path);
-catalog::LoadError RemountStart();
-unsigned GetRevision();
-std::string GetOpenCatalogs();
-unsigned GetMaxTTL();  // in minutes
-void SetMaxTTL(const unsigned value);  // in minutes
-void ResetErrorCounters();
-void GetLruStatistics(lru::Statistics *inode_stats, lru::Statistics *path_stats,
-                      lru::Statistics *md5path_stats);
-catalog::Statistics GetCatalogStatistics();
-std::string GetCertificateStats();
-std::string GetFsStats();
-
-int cvmfs_readlink(const char *path, char *buf, size_t size);
-int cvmfs_open(const char *c_path);
-int cvmfs_close(int fd);
-int cvmfs_statfs(const char *path __attribute__((unused)), struct statvfs *info);
-int cvmfs_getattr(const char *c_path, struct stat *info);
-int cvmfs_listdir(const char *path,char ***buf,size_t *buflen);
-
-int cvmfs_int_init(
-  const std::string &cvmfs_opts_hostname,  // url of repository
-  const std::string &cvmfs_opts_proxies,
-  const std::string &cvmfs_opts_repo_name,
-  const std::string &cvmfs_opts_mountpoint,
-  const std::string &cvmfs_opts_pubkey,
-  const std::string &cvmfs_opts_cachedir,
-  bool cvmfs_opts_cd_to_cachedir,
-  int64_t cvmfs_opts_quota_limit,
-  int64_t cvmfs_opts_quota_threshold,
-  bool cvmfs_opts_rebuild_cachedb,
-  bool cvmfs_opts_ignore_signature,
-  const std::string &cvmfs_opts_root_hash,
-  unsigned cvmfs_opts_timeout,
-  unsigned cvmfs_opts_timeout_direct,
-  int cvmfs_opts_syslog_level,
-  const std::string &cvmfs_opts_logfile,
-  const std::string &cvmfs_opts_tracefile,
-  const std::string &cvmfs_opts_deep_mount,
-  const std::string &cvmfs_opts_blacklist,
-  int cvmfs_opts_nofiles,
-  bool cvmfs_opts_enable_monitor
-);
+/**
+ * Options of the parts that are shared by all repositories of the process.
+ */
+struct GlobalOptions {
+  GlobalOptions() : cd_to_cachedir(false), quota_limit(0), quota_threshold(0),
+    rebuild_cachedb(false), timeout(2), timeout_direct(2), syslog_level(3),
+    nofiles(0), enable_monitor(false) { }
+
+  std::string hostname;  /**< url(s) of the servers, may contain @fqrn@ */
+  std::string proxies;
+  std::string pubkey;  /**< keys of all attached repositories */
+  std::string cachedir;
+  bool cd_to_cachedir;
+  std::string lock_name;  /**< names the lock file and the running sentinel */
+  int64_t quota_limit;
+  int64_t quota_threshold;
+  bool rebuild_cachedb;
+  unsigned timeout;
+  unsigned timeout_direct;
+  int syslog_level;
+  std::string logfile;
+  std::string tracefile;
+  std::string blacklist;
+  int nofiles;
+  bool enable_monitor;
+};
 
+int cvmfs_int_init(const GlobalOptions &options);
 void cvmfs_int_spawn();
 void cvmfs_int_fini();
 
+
+/**
+ * An attached repository with its own catalogs and path cache.  The cache,
+ * the quota manager, the download module and the public keys are shared and
+ * set up by cvmfs_int_init().  All methods can be called concurrently.
+ */
+class LibContext {
+ public:
+  static LibContext *Create(const std::string &repository_name,
+                            const std::string &mountpoint,
+                            const bool ignore_signature,
+                            const std::string &root_hash);
+  ~LibContext();
+
+  catalog::LoadError Remount();
+  uint64_t GetTTL() const;
+  int Open(const char *c_path);
+  int Close(const int fd);
+  int GetAttr(const char *c_path, struct stat *info);
+  int Readlink(const char *c_path, char *buf, const size_t size);
+  int ListDirectory(const char *c_path, char ***buf, size_t *buflen);
+  int ListDirectoryStat(const char *c_path, catalog::StatEntryList *listing);
+  bool LookupResolved(const std::string &path, std::string *resolved);
+  void InsertResolved(const std::string &path, const std::string &resolved);
+
+  const std::string &repository_name() const { return repository_name_; }
+  const std::string &mountpoint() const { return mountpoint_; }
+
+ private:
+  static const unsigned kMd5pathCacheSize = 32000;
+  static const unsigned kResolvedPathCacheSize = 8192;
+
+  LibContext(const std::string &repository_name, const std::string &mountpoint);
+  bool GetDirentForPath(const PathString &path,
+                        catalog::DirectoryEntry *dirent);
+
+  std::string repository_name_;
+  std::string mountpoint_;  /**< resolves absolute symlinks */
+  cache::CatalogManager *catalog_manager_;
+  lru::Md5PathCache *md5path_cache_;
+  lru::ResolvedPathCache *resolved_path_cache_;  /**< for expand_path() */
+};
+
 }  // namespace cvmfs
 
 #endif  // CVMFS_LIBCVMFS_INT_H_
@@ -9,6 +9,16 @@
  * invoked at the very first, single-threaded stage.
  *
  * If DEBUGMSG is undefined, pure debug messages are compiled into no-ops.
+ * The check in logging.h also skips the evaluation of the arguments of
+ * messages that are below the current verbosity.
+ *
+ * After StartLogAsync(), debug file and syslog messages are not written by
+ * the calling thread.  They are copied into a fixed ring of records, which a
+ * background thread drains.  Claiming a record takes a single compare-and-
+ * swap (a bounded queue with per-record sequence numbers), so threads that
+ * log do not serialize on the debug file.  If the ring is full, the message
+ * is dropped and counted; the number of lost messages is written into the
+ * debug log by the drainer.  Stdout and stderr are always synchronous.
  */
 
 #include "logging_internal.h"
@@ -16,7 +26,9 @@
 #include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include <cstdlib>
 #include <cstdio>
@@ -24,6 +36,7 @@
 #include <ctime>
 #include <cstring>
 
+#include "atomic.h"
 #include "smalloc.h"
 
 using namespace std;  // NOLINT
@@ -40,15 +53,42 @@ string *path_debug = NULL;
 const char *module_names[] = { "unknown", "cache", "catalog", "sql", "cvmfs",
   "hash", "download", "compress", "quota", "talk", "monitor", "lru",
   "fuse stub", "signature", "peers", "fs traversal", "nfs maps", "publish",
-  "spooler" };
+  "spooler", "prefetch" };
 int syslog_level = LOG_NOTICE;
 char *syslog_prefix = NULL;
-LogLevels min_log_level = kLogNormal;
 static void (*alt_log_func)(const LogSource source, const int mask,
                             const char *msg) = NULL;
 
+const unsigned kAsyncRingSize = 4096;  /**< power of 2 */
+const unsigned kAsyncRecordSize = 512;  /**< longer messages are truncated */
+
+/**
+ * A message in the ring.  The owner of a record is given by its sequence
+ * number: a producer may fill record i of round r if seq == position, the
+ * drainer may read it if seq == position + 1.
+ */
+struct AsyncRecord {
+  atomic_int32 seq;
+  LogSource source;
+  int mask;
+  time_t timestamp;
+  char msg[kAsyncRecordSize];
+};
+
+AsyncRecord *async_ring = NULL;
+atomic_int32 async_enabled = 0;
+atomic_int32 async_head = 0;  /**< next position claimed by a producer */
+uint32_t async_tail = 0;  /**< next position read by the drainer */
+atomic_int32 async_sleeping = 0;
+atomic_int64 async_lost = 0;
+bool async_stop = false;
+int async_pipe[2];
+pthread_t async_thread;
+
 }  // namespace
 
+LogLevels g_log_min_level = kLogNormal;
+
 
 /**
  * Sets the level that is used for all messages to the syslog facility.
@@ -94,7 +134,7 @@ void SetLogSyslogPrefix(const std::string &prefix) {
  * Set the minimum verbosity level.  By default kLogNormal.
  */
 void SetLogVerbosity(const LogLevels min_level) {
-  min_log_level = min_level;
+  g_log_min_level = min_level;
 }
 
 
@@ -129,6 +169,212 @@ string GetLogDebugFile() {
 #endif
 
 
+/**
+ * Writes a message to the debug log file and/or to syslog, depending on mask.
+ */
+static void WriteMessage(const LogSource source, const int mask,
+                         const char *msg, const time_t rawtime,
+                         const bool flush)
+{
+#ifdef DEBUGMSG
+  if (mask & kLogDebug) {
+    pthread_mutex_lock(&lock_debug);
+
+    // Set the file pointer for debuging to stderr, if necessary
+    if (file_debug == NULL)
+      file_debug = stderr;
+
+    struct tm now;
+    localtime_r(&rawtime, &now);
+
+    if (file_debug == stderr) pthread_mutex_lock(&lock_stderr);
+    fprintf(file_debug, "(%s) %s    [%02d-%02d-%04d %02d:%02d:%02d %s]\n",
+            module_names[source], msg,
+            (now.tm_mon)+1, now.tm_mday, (now.tm_year)+1900, now.tm_hour,
+            now.tm_min, now.tm_sec, now.tm_zone);
+    if (flush)
+      fflush(file_debug);
+    if (file_debug == stderr) pthread_mutex_unlock(&lock_stderr);
+
+    pthread_mutex_unlock(&lock_debug);
+  }
+#endif
+
+  if (mask & kLogSyslog) {
+    if (syslog_prefix) {
+      syslog(LOG_MAKEPRI(LOG_USER, syslog_level), "(%s) %s",
+             syslog_prefix, msg);
+    } else {
+      syslog(LOG_MAKEPRI(LOG_USER, syslog_level), "%s", msg);
+    }
+  }
+}
+
+
+/**
+ * Copies a message into the ring.  Returns false if the ring is full.
+ */
+static bool EnqueueAsync(const LogSource source, const int mask,
+                         const char *msg)
+{
+  AsyncRecord *record;
+  uint32_t pos = atomic_read32(&async_head);
+  while (true) {
+    record = &async_ring[pos & (kAsyncRingSize-1)];
+    const int32_t diff = atomic_read32(&record->seq) - int32_t(pos);
+    if (diff == 0) {
+      if (atomic_cas32(&async_head, pos, pos + 1))
+        break;
+      pos = atomic_read32(&async_head);
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_read32(&async_head);
+    }
+  }
+
+  record->source = source;
+  record->mask = mask;
+  record->timestamp = time(NULL);
+  const size_t length = strlen(msg);
+  const size_t copy_length =
+    (length < kAsyncRecordSize) ? length : kAsyncRecordSize-1;
+  memcpy(record->msg, msg, copy_length);
+  record->msg[copy_length] = '\0';
+  atomic_write32(&record->seq, pos + 1);
+
+  if (atomic_read32(&async_sleeping) && atomic_cas32(&async_sleeping, 1, 0)) {
+    char c = 'w';
+    (void)write(async_pipe[1], &c, 1);
+  }
+  return true;
+}
+
+
+/**
+ * Writes all published records.  Returns the number of records written.
+ */
+static unsigned DrainAsync() {
+  unsigned num_drained = 0;
+  while (true) {
+    AsyncRecord *record = &async_ring[async_tail & (kAsyncRingSize-1)];
+    if (atomic_read32(&record->seq) != int32_t(async_tail + 1))
+      break;
+    WriteMessage(record->source, record->mask, record->msg, record->timestamp,
+                 false);
+    atomic_write32(&record->seq, async_tail + kAsyncRingSize);
+    async_tail++;
+    num_drained++;
+  }
+  return num_drained;
+}
+
+
+static void *MainLogAsync(void *data __attribute__((unused))) {
+  int64_t num_lost_reported = 0;
+  while (true) {
+    bool wrote = DrainAsync() > 0;
+    const int64_t num_lost = atomic_read64(&async_lost);
+    if (num_lost != num_lost_reported) {
+      char msg[128];
+      snprintf(msg, sizeof(msg),
+               "asynchronous log ring full, lost %lld messages",
+               static_cast<long long>(num_lost - num_lost_reported));
+      WriteMessage(kLogCvmfs, kLogDebug, msg, time(NULL), false);
+      num_lost_reported = num_lost;
+      wrote = true;
+    }
+#ifdef DEBUGMSG
+    if (wrote) {
+      pthread_mutex_lock(&lock_debug);
+      if (file_debug != NULL)
+        fflush(file_debug);
+      pthread_mutex_unlock(&lock_debug);
+    }
+#endif
+    if (wrote)
+      continue;
+    if (async_stop)
+      break;
+
+    // Announce the nap, then check once more in order to not miss a wake-up
+    atomic_write32(&async_sleeping, 1);
+    AsyncRecord *record = &async_ring[async_tail & (kAsyncRingSize-1)];
+    if (atomic_read32(&record->seq) == int32_t(async_tail + 1)) {
+      atomic_write32(&async_sleeping, 0);
+      continue;
+    }
+    struct pollfd watch;
+    watch.fd = async_pipe[0];
+    watch.events = POLLIN;
+    watch.revents = 0;
+    if (poll(&watch, 1, 1000) > 0) {
+      char buf[64];
+      (void)read(async_pipe[0], buf, sizeof(buf));
+    }
+    atomic_write32(&async_sleeping, 0);
+  }
+  return NULL;
+}
+
+
+/**
+ * Starts the background thread that writes debug and syslog messages.  Has to
+ * be called after forking into the background.
+ */
+void StartLogAsync() {
+  if (atomic_read32(&async_enabled))
+    return;
+  if (async_ring == NULL) {
+    async_ring = static_cast<AsyncRecord *>(
+      smalloc(kAsyncRingSize * sizeof(AsyncRecord)));
+    for (unsigned i = 0; i < kAsyncRingSize; ++i)
+      atomic_write32(&async_ring[i].seq, i);
+    atomic_write32(&async_head, 0);
+    async_tail = 0;
+  }
+  if (pipe(async_pipe) != 0) {
+    WriteMessage(kLogCvmfs, kLogDebug | kLogSyslog,
+                 "failed to create pipe for asynchronous logging", time(NULL),
+                 true);
+    return;
+  }
+  async_stop = false;
+  if (pthread_create(&async_thread, NULL, MainLogAsync, NULL) != 0) {
+    close(async_pipe[0]);
+    close(async_pipe[1]);
+    WriteMessage(kLogCvmfs, kLogDebug | kLogSyslog,
+                 "failed to start asynchronous logging", time(NULL), true);
+    return;
+  }
+  atomic_write32(&async_enabled, 1);
+}
+
+
+/**
+ * Writes the pending messages and returns to synchronous logging.  The ring
+ * is not freed because other threads might still be about to fill a record.
+ */
+void StopLogAsync() {
+  if (!atomic_cas32(&async_enabled, 1, 0))
+    return;
+  async_stop = true;
+  char c = 's';
+  (void)write(async_pipe[1], &c, 1);
+  pthread_join(async_thread, NULL);
+  close(async_pipe[0]);
+  close(async_pipe[1]);
+}
+
+
+/**
+ * Number of messages that were dropped because the ring was full.
+ */
+int64_t GetLogAsyncLost() {
+  return atomic_read64(&async_lost);
+}
+
+
 void SetAltLogFunc(void (*fn)(const LogSource source, const int mask,
                               const char *msg))
 {
@@ -152,7 +398,7 @@ void LogCvmfs(const LogSource source, const int mask, const char *format, ...) {
   int log_level = mask & ((2*kLogNone - 1) ^ (kLogLevel0 - 1));
   if (!log_level)
     log_level = kLogNormal;
-  if (log_level < min_log_level)
+  if (log_level < g_log_min_level)
     return;
 #endif
 
@@ -167,31 +413,15 @@ void LogCvmfs(const LogSource source, const int mask, const char *format, ...) {
     return;
   }
 
-#ifdef DEBUGMSG
-  if (mask & kLogDebug) {
-    pthread_mutex_lock(&lock_debug);
-
-    // Set the file pointer for debuging to stderr, if necessary
-    if (file_debug == NULL)
-      file_debug = stderr;
-
-    //  Get timestamp
-    time_t rawtime;
-    time(&rawtime);
-    struct tm now;
-    localtime_r(&rawtime, &now);
-
-    if (file_debug == stderr) pthread_mutex_lock(&lock_stderr);
-    fprintf(file_debug, "(%s) %s    [%02d-%02d-%04d %02d:%02d:%02d %s]\n",
-            module_names[source], msg,
-            (now.tm_mon)+1, now.tm_mday, (now.tm_year)+1900, now.tm_hour,
-            now.tm_min, now.tm_sec, now.tm_zone);
-    fflush(file_debug);
-    if (file_debug == stderr) pthread_mutex_unlock(&lock_stderr);
-
-    pthread_mutex_unlock(&lock_debug);
+  const int async_mask = mask & (kLogDebug | kLogSyslog);
+  if (async_mask) {
+    if (atomic_read32(&async_enabled)) {
+      if (!EnqueueAsync(source, async_mask, msg))
+        atomic_inc64(&async_lost);
+    } else {
+      WriteMessage(source, async_mask, msg, time(NULL), true);
+    }
   }
-#endif
 
   if (mask & kLogStdout) {
     pthread_mutex_lock(&lock_stdout);
@@ -215,15 +445,6 @@ void LogCvmfs(const LogSource source, const int mask, const char *format, ...) {
     pthread_mutex_unlock(&lock_stderr);
   }
 
-  if (mask & kLogSyslog) {
-    if (syslog_prefix) {
-      syslog(LOG_MAKEPRI(LOG_USER, syslog_level), "(%s) %s",
-             syslog_prefix, msg);
-    } else {
-      syslog(LOG_MAKEPRI(LOG_USER, syslog_level), "%s", msg);
-    }
-  }
-
   free(msg);
 }
 
@@ -9,10 +9,24 @@
 #include "logging_internal.h"
 
 void LogCvmfs(const LogSource source, const int mask, const char *format, ...);
-// Ensure that pure debug messages are not compiled except in DEBUGMSG mode
+
 #ifndef DEBUGMSG
+/**
+ * Checked before the arguments of a LogCvmfs() call are evaluated, so that
+ * dropped messages don't cost their formatting.  Pure debug messages are
+ * compiled out because the mask is usually a constant; messages below the
+ * verbosity set by SetLogVerbosity() are dropped at runtime.  Debug builds
+ * (DEBUGMSG) log everything, so there the call goes straight to LogCvmfs().
+ */
+static inline bool IsLogEnabled(const int mask) {
+  if (mask == kLogDebug)
+    return false;
+  const int log_level = mask & ((2*kLogNone - 1) ^ (kLogLevel0 - 1));
+  return (log_level ? log_level : kLogNormal) >= GetLogVerbosity();
+}
+
 #define LogCvmfs(source, mask, ...) \
-  (((mask) == kLogDebug) ? ((void)0) : LogCvmfs(source, mask, __VA_ARGS__))
+  (IsLogEnabled(mask) ? LogCvmfs(source, mask, __VA_ARGS__) : ((void)0))
 #endif
 
 void PrintWarning(const std::string &message);
@@ -7,6 +7,8 @@
 #ifndef CVMFS_LOGGING_INTERNAL_H_
 #define CVMFS_LOGGING_INTERNAL_H_
 
+#include <stdint.h>
+
 #include <cstdarg>
 #include <string>
 
@@ -49,6 +51,7 @@ enum LogSource {
   kLogNfsMaps,
   kLogPublish,
   kLogSpooler,
+  kLogPrefetch,
 };
 
 const int kLogVerboseMsg = kLogStdout | kLogShowSource | kLogVerbose;
@@ -57,6 +60,14 @@ void SetLogSyslogLevel(const int level);
 void SetLogSyslogPrefix(const std::string &prefix);
 void SetLogVerbosity(const LogLevels min_level);
 
+/**
+ * Inline for the cheap log level check in logging.h
+ */
+extern LogLevels g_log_min_level;
+static inline LogLevels GetLogVerbosity() {
+  return g_log_min_level;
+}
+
 #ifdef DEBUGMSG
 void SetLogDebugFile(const std::string &filename);
 std::string GetLogDebugFile();
@@ -65,6 +76,10 @@ std::string GetLogDebugFile();
 #define GetLogDebugFile() (std::string(""))
 #endif
 
+void StartLogAsync();
+void StopLogAsync();
+int64_t GetLogAsyncLost();
+
 void SetAltLogFunc(void (*fn)(const LogSource source, const int mask,
                               const char *msg));
 
@@ -13,6 +13,15 @@
  *
  * The cache size has to be a multiply of 64.
  *
+ * Instead of strict LRU, a cache can use second-chance (CLOCK) replacement.
+ * A hit then only sets a reference bit of the entry, so that lookups can run
+ * concurrently under a shared lock.  The eviction passes over referenced
+ * entries once and clears their bits.
+ *
+ * The metadata caches are ShardedLruCaches, a number of independent LruCaches
+ * selected by the key hash, so that the fuse threads don't contend for a
+ * single lock.
+ *
  * usage:
  *   // 100 entries, -1 special key
  *   LruCache<int, string> cache(100, -1, hasher_int);
@@ -45,11 +54,18 @@
 
 #include <cstring>
 #include <cassert>
+#include <new>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <map>
 #include <algorithm>
 #include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <fuse/fuse_lowlevel.h>
 
@@ -59,88 +75,119 @@
 #include "dirent.h"
 #include "hash.h"
 #include "atomic.h"
+#include "sharded_counter.h"
 #include "util.h"
 #include "shortstring.h"
 
 namespace lru {
 
+enum Replacement {
+  kReplaceLru = 0,
+  kReplaceClock,
+};
+
 /**
  * Counting of cache operations.
  */
 struct Statistics {
   int64_t size;
-  atomic_int64 num_hit;
-  atomic_int64 num_miss;
-  atomic_int64 num_insert;
-  atomic_int64 num_insert_negative;
+  ShardedCounter num_hit;
+  ShardedCounter num_miss;
+  ShardedCounter num_insert;
+  ShardedCounter num_insert_negative;
   uint64_t num_collisions;
   uint32_t max_collisions;
-  atomic_int64 num_update;
-  atomic_int64 num_replace;
-  atomic_int64 num_forget;
-  atomic_int64 num_drop;
+  ShardedCounter num_update;
+  ShardedCounter num_replace;
+  ShardedCounter num_forget;
+  ShardedCounter num_drop;
   atomic_int64 allocated;
 
   Statistics() {
     size = 0;
     num_collisions = 0;
     max_collisions = 0;
-    atomic_init64(&num_hit);
-    atomic_init64(&num_miss);
-    atomic_init64(&num_insert);
-    atomic_init64(&num_insert_negative);
-    atomic_init64(&num_update);
-    atomic_init64(&num_replace);
-    atomic_init64(&num_forget);
-    atomic_init64(&num_drop);
     atomic_init64(&allocated);
   }
 
+  /**
+   * Adds up the counters of the segments of a sharded cache.
+   */
+  void Add(Statistics *other) {
+    size += other->size;
+    num_hit.Xadd(other->num_hit.Get());
+    num_miss.Xadd(other->num_miss.Get());
+    num_insert.Xadd(other->num_insert.Get());
+    num_insert_negative.Xadd(other->num_insert_negative.Get());
+    num_collisions += other->num_collisions;
+    max_collisions = std::max(max_collisions, other->max_collisions);
+    num_update.Xadd(other->num_update.Get());
+    num_replace.Xadd(other->num_replace.Get());
+    num_forget.Xadd(other->num_forget.Get());
+    num_drop.Xadd(other->num_drop.Get());
+    atomic_xadd64(&allocated, atomic_read64(&other->allocated));
+  }
+
   std::string Print() {
     return "size: " + StringifyInt(size) + "  " +
-      "hits: " + StringifyInt(atomic_read64(&num_hit)) + "  " +
-      "misses: " + StringifyInt(atomic_read64(&num_miss)) + "  " +
-      "inserts(all): " + StringifyInt(atomic_read64(&num_insert)) + "  " +
-      "inserts(negative): " + StringifyInt(atomic_read64(&num_insert_negative))
-        + "  " +
+      "hits: " + StringifyInt(num_hit.Get()) + "  " +
+      "misses: " + StringifyInt(num_miss.Get()) + "  " +
+      "inserts(all): " + StringifyInt(num_insert.Get()) + "  " +
+      "inserts(negative): " + StringifyInt(num_insert_negative.Get()) + "  " +
       "collisions: " + StringifyInt(num_collisions) + "  " +
       "collisions(max): " + StringifyInt(max_collisions) + "  " +
-      "updates: " + StringifyInt(atomic_read64(&num_update)) + "  " +
-      "replacements: " + StringifyInt(atomic_read64(&num_replace)) + "  " +
-      "forgets: " + StringifyInt(atomic_read64(&num_forget)) + "  " +
-      "drops: " + StringifyInt(atomic_read64(&num_drop)) + "  " +
+      "updates: " + StringifyInt(num_update.Get()) + "  " +
+      "replacements: " + StringifyInt(num_replace.Get()) + "  " +
+      "forgets: " + StringifyInt(num_forget.Get()) + "  " +
+      "drops: " + StringifyInt(num_drop.Get()) + "  " +
       "allocated: " + StringifyInt(atomic_read64(&allocated) / 1024) + " KB\n";
   }
 };
 
 
 /**
- * Hash table with linear probing as collision resolution.  Works only for
- * a fixed (maximum) number of elements, i.e. no resizing.  Load factor fixed
- * to 0.7.
+ * Hash table with open addressing in the style of Swiss tables.  The slots
+ * are organized in groups of kGroupSize.  Next to the keys and values, a
+ * control byte per slot stores whether the slot is empty, deleted, or a
+ * 7 bit tag of the hash of its key.  A lookup compares the tags of a whole
+ * group at once (with SSE2, if available) and only compares the keys of
+ * matching slots.  Full groups overflow into the next group.
+ *
+ * The table starts small and grows by doubling the number of groups, up to the
+ * size given to Init() at the load factor.  It only grows beyond that if more
+ * elements are inserted.  Growing rehashes the table at once.  Since the
+ * caches never hold more elements than their size, this happens only a few
+ * times while a cache fills up.
  */
 template<class Key, class Value>
 class SmallHash {
  public:
   static const double kLoadFactor;
+  static const unsigned kGroupSize = 16;
+  static const uint32_t kInitialGroups = 4;
 
   SmallHash() {
     keys_ = NULL;
     values_ = NULL;
+    ctrl_ = NULL;
     hasher_ = NULL;
+    num_groups_ = 0;
+    max_groups_ = 0;
+    size_ = 0;
+    num_deleted_ = 0;
     bytes_allocated_ = 0;
     num_collisions_ = 0;
     max_collisions_ = 0;
   }
 
   void Init(uint32_t size, Key empty, uint32_t (*hasher)(const Key &key)) {
-    capacity_ = static_cast<uint32_t>(static_cast<double>(size)/kLoadFactor);
-    keys_ = new Key[capacity_];
-    values_ = new Value[capacity_];
-    bytes_allocated_ = (sizeof(Key) + sizeof(Value)) * capacity_;
+    const uint32_t capacity =
+      static_cast<uint32_t>(static_cast<double>(size)/kLoadFactor);
+    max_groups_ = std::max((capacity + kGroupSize - 1) / kGroupSize,
+                           uint32_t(1));
     hasher_ = hasher;
     empty_key_ = empty;
-    this->Clear();
+    Allocate(std::min(uint32_t(kInitialGroups), max_groups_));
   }
 
   bool Lookup(const Key &key, Value *value) const {
@@ -153,33 +200,58 @@ class SmallHash {
   }
 
   void Insert(const Key &key, const Value &value) {
-    DoInsert(key, value, true);
+    uint32_t bucket;
+    uint32_t collisions;
+    if (DoLookup(key, &bucket, &collisions)) {
+      values_[bucket] = value;
+      return;
+    }
+    num_collisions_ += collisions;
+    max_collisions_ = std::max(collisions, max_collisions_);
+
+    // Deleted slots are purged once they take most of the headroom
+    const uint32_t capacity = num_groups_ * kGroupSize;
+    if (size_ + 1 > GetMaxLoad(num_groups_)) {
+      uint32_t num_groups = 2*num_groups_;
+      if ((num_groups_ < max_groups_) && (num_groups > max_groups_))
+        num_groups = max_groups_;
+      Rehash(num_groups);
+    } else if (size_ + num_deleted_ + 1 > capacity - capacity/8) {
+      Rehash(num_groups_);
+    }
+    DoInsert(key, value);
   }
 
   void Erase(const Key &key) {
     uint32_t bucket;
     uint32_t collisions;
-    const bool found = DoLookup(key, &bucket, &collisions);
-    if (found) {
-      keys_[bucket] = empty_key_;
-      bucket = (bucket+1) % capacity_;
-      while (!(keys_[bucket] == empty_key_)) {
-        Key rehash = keys_[bucket];
-        keys_[bucket] = empty_key_;
-        DoInsert(rehash, values_[bucket], false);
-        bucket = (bucket+1) % capacity_;
-      }
+    if (!DoLookup(key, &bucket, &collisions))
+      return;
+    // As long as the group has an empty slot, no key ever overflowed from it
+    // into the next group, so the slot can become empty, too
+    const uint8_t *group = ctrl_ + (bucket / kGroupSize) * kGroupSize;
+    if (MatchEmpty(group) != 0) {
+      ctrl_[bucket] = kCtrlEmpty;
+    } else {
+      ctrl_[bucket] = kCtrlDeleted;
+      num_deleted_++;
     }
+    keys_[bucket] = empty_key_;
+    size_--;
   }
 
   void Clear() {
-    for (uint32_t i = 0; i < capacity_; ++i)
+    const uint32_t capacity = num_groups_ * kGroupSize;
+    memset(ctrl_, kCtrlEmpty, capacity);
+    for (uint32_t i = 0; i < capacity; ++i)
       keys_[i] = empty_key_;
+    size_ = 0;
+    num_deleted_ = 0;
   }
 
   uint64_t bytes_allocated() const { return bytes_allocated_; }
   static double GetEntrySize() {
-    const double unit = sizeof(Key) + sizeof(Value);
+    const double unit = sizeof(Key) + sizeof(Value) + 1;
     return unit/kLoadFactor;
   }
 
@@ -193,36 +265,141 @@ class SmallHash {
   ~SmallHash() {
     delete[] keys_;
     delete[] values_;
+    delete[] ctrl_;
   }
 
  private:
-  uint32_t ScaleHash(const Key &key) const {
-    double bucket = (double(hasher_(key)) * double(capacity_) /
-                     double((uint32_t)(-1)));
-    return (uint32_t)bucket % capacity_;
+  static const uint8_t kCtrlEmpty = 0x80;
+  static const uint8_t kCtrlDeleted = 0xfe;
+
+  /**
+   * Spreads the bits of the user-provided hash, the sharded caches use its
+   * lower bits to select the segment.
+   */
+  static inline uint32_t Mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
   }
 
-  void DoInsert(const Key &key, const Value &value,
-                const bool count_collisions)
-  {
-    uint32_t bucket;
-    uint32_t collisions;
-    DoLookup(key, &bucket, &collisions);
-    if (count_collisions) {
-      num_collisions_ += collisions;
-      max_collisions_ = std::max(collisions, max_collisions_);
+  static inline uint32_t GetMaxLoad(const uint32_t num_groups) {
+    return static_cast<uint32_t>(
+      static_cast<double>(num_groups * kGroupSize) * kLoadFactor);
+  }
+
+  /**
+   * Bit i is set if the control byte of slot i of the group equals c.
+   */
+  static inline uint32_t Match(const uint8_t *group, const uint8_t c) {
+#ifdef __SSE2__
+    const __m128i ctrl =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+    uint32_t result = 0;
+    for (unsigned i = 0; i < kGroupSize; ++i)
+      result |= uint32_t(group[i] == c) << i;
+    return result;
+#endif
+  }
+
+  static inline uint32_t MatchEmpty(const uint8_t *group) {
+    return Match(group, kCtrlEmpty);
+  }
+
+  /**
+   * Empty or deleted slots, i.e. control bytes with the high bit set.
+   */
+  static inline uint32_t MatchFree(const uint8_t *group) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(group)));
+#else
+    uint32_t result = 0;
+    for (unsigned i = 0; i < kGroupSize; ++i)
+      result |= uint32_t(group[i] >> 7) << i;
+    return result;
+#endif
+  }
+
+  inline uint32_t GetGroup(const uint32_t mixed) const {
+    return static_cast<uint32_t>(
+      (static_cast<uint64_t>(mixed) * num_groups_) >> 32);
+  }
+
+  inline uint32_t NextGroup(const uint32_t group) const {
+    return (group + 1 == num_groups_) ? 0 : group + 1;
+  }
+
+  void Allocate(const uint32_t num_groups) {
+    const uint32_t capacity = num_groups * kGroupSize;
+    num_groups_ = num_groups;
+    keys_ = new Key[capacity];
+    values_ = new Value[capacity];
+    ctrl_ = new uint8_t[capacity];
+    bytes_allocated_ = (sizeof(Key) + sizeof(Value) + 1) * capacity;
+    this->Clear();
+  }
+
+  /**
+   * Moves all the elements into a table of num_groups groups.  Drops the
+   * deleted slots.
+   */
+  void Rehash(const uint32_t num_groups) {
+    Key *old_keys = keys_;
+    Value *old_values = values_;
+    uint8_t *old_ctrl = ctrl_;
+    const uint32_t old_capacity = num_groups_ * kGroupSize;
+    Allocate(num_groups);
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+      if ((old_ctrl[i] & kCtrlEmpty) == 0)
+        DoInsert(old_keys[i], old_values[i]);
     }
+    delete[] old_keys;
+    delete[] old_values;
+    delete[] old_ctrl;
+  }
+
+  /**
+   * Puts a key that is not yet in the table into the first free slot of its
+   * probe sequence.  The load factor guarantees that there is one.
+   */
+  void DoInsert(const Key &key, const Value &value) {
+    const uint32_t mixed = Mix(hasher_(key));
+    uint32_t group = GetGroup(mixed);
+    uint32_t free_slots;
+    while ((free_slots = MatchFree(ctrl_ + group*kGroupSize)) == 0)
+      group = NextGroup(group);
+    const uint32_t bucket = group*kGroupSize + __builtin_ctz(free_slots);
+    if (ctrl_[bucket] == kCtrlDeleted)
+      num_deleted_--;
+    ctrl_[bucket] = mixed & 0x7f;
     keys_[bucket] = key;
     values_[bucket] = value;
+    size_++;
   }
 
   bool DoLookup(const Key &key, uint32_t *bucket, uint32_t *collisions) const {
-    *bucket = ScaleHash(key);
+    const uint32_t mixed = Mix(hasher_(key));
+    const uint8_t tag = mixed & 0x7f;
+    uint32_t group = GetGroup(mixed);
     *collisions = 0;
-    while (!(keys_[*bucket] == empty_key_)) {
-      if (keys_[*bucket] == key)
-        return true;
-      *bucket = (*bucket+1) % capacity_;
+    for (uint32_t n = 0; n < num_groups_; ++n) {
+      const uint8_t *ctrl = ctrl_ + group*kGroupSize;
+      uint32_t candidates = Match(ctrl, tag);
+      while (candidates != 0) {
+        *bucket = group*kGroupSize + __builtin_ctz(candidates);
+        if (keys_[*bucket] == key)
+          return true;
+        (*collisions)++;
+        candidates &= candidates - 1;
+      }
+      if (MatchEmpty(ctrl) != 0)
+        return false;
+      group = NextGroup(group);
       (*collisions)++;
     }
     return false;
@@ -231,7 +408,11 @@ class SmallHash {
   // Separate key and value arrays for better locality
   Key *keys_;
   Value *values_;
-  uint32_t capacity_;
+  uint8_t *ctrl_;  /**< empty, deleted, or the tag of the key */
+  uint32_t num_groups_;
+  uint32_t max_groups_;  /**< Growth slows down beyond, see Init() */
+  uint32_t size_;
+  uint32_t num_deleted_;
   uint32_t (*hasher_)(const Key &key);
   uint64_t bytes_allocated_;
   uint64_t num_collisions_;
@@ -242,7 +423,7 @@ class SmallHash {
 
 // initialize the static load factor field
 template<class Key, class Value>
-const double SmallHash<Key, Value>::kLoadFactor = 0.7;
+const double SmallHash<Key, Value>::kLoadFactor = 0.8;
 
 
 
@@ -277,7 +458,7 @@ class LruCache {
   // Internal data fields
   unsigned int cache_gauge_;
   unsigned int cache_size_;
-  static ConcreteMemoryAllocator *allocator_;
+  ConcreteMemoryAllocator *allocator_;
 
   /**
    * A doubly linked list to keep track of the least recently used data entries.
@@ -288,8 +469,9 @@ class LruCache {
    */
   ListEntryHead<Key> *lru_list_;
   SmallHash<Key, CacheEntry> cache_;
+  Replacement replacement_;
 #ifdef LRU_CACHE_THREAD_SAFE
-  pthread_mutex_t lock_;  /**< Mutex to make cache thread safe. */
+  pthread_rwlock_t lock_;  /**< Makes cache thread safe. */
 #endif
 
   /**
@@ -523,29 +705,23 @@ class LruCache {
    public:
     ListEntryContent(Key content) {
       content_ = content;
+      referenced_ = false;
     };
 
-    /**
-     * Overwritten the new operator of this class to redirect it to our own
-     * memory allocator.  This ensures that heap is not fragmented by loads of
-     * malloc and free calls.
-     */
-    static void* operator new(size_t size) {
-      assert(LruCache::allocator_ != NULL);
-      return (void *)LruCache::allocator_->Allocate();
-    }
+    inline bool IsListHead() const { return false; }
+    inline T content() const { return content_; }
 
     /**
-     * Overwritten delete operator to redirect deallocation to our own memory
-     * allocator.
+     * Concurrent lookups only ever set the bit, the bit is cleared under the
+     * exclusive lock.  Checking first keeps the cache line clean on repeated
+     * hits.
      */
-    static void operator delete (void *p) {
-      assert(LruCache::allocator_ != NULL);
-      LruCache::allocator_->Deallocate(static_cast<ListEntryContent<T> *>(p));
+    inline void Reference() {
+      if (!referenced_)
+        referenced_ = true;
     }
-
-    inline bool IsListHead() const { return false; }
-    inline T content() const { return content_; }
+    inline bool referenced() const { return referenced_; }
+    inline void ClearReference() { referenced_ = false; }
 
     /**
      * See ListEntry base class.
@@ -563,15 +739,21 @@ class LruCache {
     }
    private:
     T content_;  /**< The data content of this ListEntry */
+    volatile bool referenced_;  /**< Hit since the last pass, CLOCK only */
   };
 
   /**
    * Specialized ListEntry to form a list head.
    * Every list has exactly one list head which is also the entry point
-   * in the list. It is used to manipulate the list.
+   * in the list. It is used to manipulate the list.  The list entries are
+   * placed in the memory pool of the cache, so that heap is not fragmented by
+   * loads of malloc and free calls.
    */
   template<class T> class ListEntryHead : public ListEntry<T> {
    public:
+    explicit ListEntryHead(ConcreteMemoryAllocator *allocator)
+      : allocator_(allocator) { }
+
     virtual ~ListEntryHead() {
       this->clear();
     }
@@ -587,7 +769,7 @@ class LruCache {
       while (!entry->IsListHead()) {
         delete_me = entry;
         entry = entry->next;
-        delete delete_me;
+        this->Free(static_cast<ListEntryContent<T> *>(delete_me));
       }
 
       // Reset the list to lonely
@@ -604,7 +786,8 @@ class LruCache {
      * @return the ListEntryContent structure wrapped around the data object
      */
     inline ListEntryContent<T>* PushBack(T content) {
-      ListEntryContent<T> *new_entry = new ListEntryContent<T>(content);
+      ListEntryContent<T> *new_entry =
+        new (allocator_->Allocate()) ListEntryContent<T>(content);
       this->InsertAsPredecessor(new_entry);
       return new_entry;
     }
@@ -619,6 +802,11 @@ class LruCache {
       return Pop(this->next);
     }
 
+    inline ListEntryContent<T> *Front() const {
+      assert (!this->IsEmpty());
+      return static_cast<ListEntryContent<T> *>(this->next);
+    }
+
     /**
      * Take a list entry out of it's list and reinsert at the end of this list.
      * @param the ListEntry to be moved to the end of this list
@@ -630,12 +818,26 @@ class LruCache {
       this->InsertAsPredecessor(entry);
     }
 
+    /**
+     * Take a list entry out of this list and delete it.
+     * @param entry the ListEntry to be removed
+     */
+    inline void Remove(ListEntryContent<T> *entry) {
+      entry->RemoveFromList();
+      this->Free(entry);
+    }
+
     /**
      * See ListEntry base class
      */
     inline void RemoveFromList() { assert(false); }
 
    private:
+    inline void Free(ListEntryContent<T> *entry) {
+      entry->~ListEntryContent<T>();
+      allocator_->Deallocate(entry);
+    }
+
     /**
      * Pop a ListEntry from the list (arbitrary position).
      * The given ListEntry is removed from the list, deleted and it's
@@ -649,22 +851,26 @@ class LruCache {
       ListEntryContent<T> *popped = (ListEntryContent<T> *)popped_entry;
       popped->RemoveFromList();
       T result = popped->content();
-      delete popped_entry;
+      this->Free(popped);
       return result;
     }
+
+    ConcreteMemoryAllocator *allocator_;
   };
 
  public:  // LruCache
   /**
    * Create a new LRU cache object
    * @param cache_size the maximal size of the cache
+   * @param replacement strict LRU or second-chance
    */
   LruCache(const unsigned cache_size, const Key &empty_key,
-           uint32_t (*hasher)(const Key &key))
+           uint32_t (*hasher)(const Key &key),
+           const Replacement replacement = kReplaceLru)
   {
     assert(cache_size > 0);
 
-    LruCache<Key, Value>::allocator_ = new ConcreteMemoryAllocator(cache_size);
+    allocator_ = new ConcreteMemoryAllocator(cache_size);
 
     cache_gauge_ = 0;
     cache_size_ = cache_size;
@@ -673,11 +879,12 @@ class LruCache {
     cache_.Init(cache_size_, empty_key, hasher);
     atomic_xadd64(&statistics_.allocated, allocator_->bytes_allocated() +
                   cache_.bytes_allocated());
-    lru_list_ = new ListEntryHead<Key>();
+    lru_list_ = new ListEntryHead<Key>(allocator_);
+    replacement_ = replacement;
     pause_ = false;
 
 #ifdef LRU_CACHE_THREAD_SAFE
-    int retval = pthread_mutex_init(&lock_, NULL);
+    int retval = pthread_rwlock_init(&lock_, NULL);
     assert(retval == 0);
 #endif
   }
@@ -689,8 +896,9 @@ class LruCache {
 
   virtual ~LruCache() {
     delete lru_list_;
+    delete allocator_;
 #ifdef LRU_CACHE_THREAD_SAFE
-    pthread_mutex_destroy(&lock_);
+    pthread_rwlock_destroy(&lock_);
 #endif
   }
 
@@ -715,7 +923,7 @@ class LruCache {
 
     // Check if we have to update an existent entry
     if (this->DoLookup(key, entry)) {
-      atomic_inc64(&statistics_.num_update);
+      statistics_.num_update.Inc();
       entry.value = value;
       cache_.Insert(key, entry);
       this->Touch(entry);
@@ -723,7 +931,7 @@ class LruCache {
       return false;
     }
 
-    atomic_inc64(&statistics_.num_insert);
+    statistics_.num_insert.Inc();
     // Check if we have to make some space in the cache a
     if (this->IsFull())
       this->DeleteOldest();
@@ -747,7 +955,7 @@ class LruCache {
    */
   virtual bool Lookup(const Key &key, Value *value) {
     bool found = false;
-    Lock();
+    LockLookup();
     if (pause_) {
       Unlock();
       return false;
@@ -756,12 +964,12 @@ class LruCache {
     CacheEntry entry;
     if (DoLookup(key, entry)) {
       // Hit
-      atomic_inc64(&statistics_.num_hit);
+      statistics_.num_hit.Inc();
       Touch(entry);
       *value = entry.value;
       found = true;
     } else {
-      atomic_inc64(&statistics_.num_miss);
+      statistics_.num_miss.Inc();
     }
 
     Unlock();
@@ -784,10 +992,9 @@ class LruCache {
     CacheEntry entry;
     if (this->DoLookup(key, entry)) {
       found = true;
-      atomic_inc64(&statistics_.num_forget);
+      statistics_.num_forget.Inc();
 
-      entry.list_entry->RemoveFromList();
-      delete entry.list_entry;
+      lru_list_->Remove(entry.list_entry);
       cache_.Erase(key);
       --cache_gauge_;
     }
@@ -807,7 +1014,7 @@ class LruCache {
     cache_gauge_ = 0;
     lru_list_->clear();
     cache_.Clear();
-    atomic_inc64(&statistics_.num_drop);
+    statistics_.num_drop.Inc();
     atomic_init64(&statistics_.allocated);
     atomic_xadd64(&statistics_.allocated, allocator_->bytes_allocated() +
                   cache_.bytes_allocated());
@@ -815,6 +1022,73 @@ class LruCache {
     this->Unlock();
   }
 
+  /**
+   * Removes all entries for which (*filter)(key, value) returns true.  Works
+   * on paused caches, too.  The filter may take other locks, so it runs on a
+   * copy of the entries without holding the cache lock.
+   * @param filter a function object that selects the entries to forget
+   * @return the number of removed entries
+   */
+  template<class Filter>
+  unsigned ForgetIf(Filter *filter) {
+    std::vector<std::pair<Key, Value> > candidates;
+    this->Lock();
+    candidates.reserve(cache_gauge_);
+    for (ListEntry<Key> *entry = lru_list_->next; !entry->IsListHead();
+         entry = entry->next)
+    {
+      const Key key = static_cast<ListEntryContent<Key> *>(entry)->content();
+      CacheEntry cache_entry;
+      const bool found = this->DoLookup(key, cache_entry);
+      assert(found);
+      candidates.push_back(std::make_pair(key, cache_entry.value));
+    }
+    this->Unlock();
+
+    std::vector<Key> stale;
+    for (unsigned i = 0; i < candidates.size(); ++i) {
+      if ((*filter)(candidates[i].first, candidates[i].second))
+        stale.push_back(candidates[i].first);
+    }
+    candidates.clear();
+
+    unsigned num_forgotten = 0;
+    this->Lock();
+    for (unsigned i = 0; i < stale.size(); ++i) {
+      CacheEntry cache_entry;
+      if (!this->DoLookup(stale[i], cache_entry))
+        continue;
+      statistics_.num_forget.Inc();
+      lru_list_->Remove(cache_entry.list_entry);
+      cache_.Erase(stale[i]);
+      --cache_gauge_;
+      num_forgotten++;
+    }
+    this->Unlock();
+    return num_forgotten;
+  }
+
+  /**
+   * Calls (*visitor)(key, value) for all entries, from the least to the most
+   * recently used one.  Inserting the entries in this order into an empty
+   * cache rebuilds the LRU order.
+   * @param visitor a function object
+   */
+  template<class Visitor>
+  void Traverse(Visitor *visitor) {
+    this->Lock();
+    for (ListEntry<Key> *entry = lru_list_->next; !entry->IsListHead();
+         entry = entry->next)
+    {
+      const Key key = static_cast<ListEntryContent<Key> *>(entry)->content();
+      CacheEntry cache_entry;
+      const bool found = this->DoLookup(key, cache_entry);
+      assert(found);
+      (*visitor)(key, cache_entry.value);
+    }
+    this->Unlock();
+  }
+
   void Pause() {
     Lock();
     pause_ = true;
@@ -834,6 +1108,10 @@ class LruCache {
     Lock();
     cache_.GetCollisionStats(&statistics_.num_collisions,
                              &statistics_.max_collisions);
+    // The hash table grows while the cache fills
+    atomic_init64(&statistics_.allocated);
+    atomic_xadd64(&statistics_.allocated, allocator_->bytes_allocated() +
+                  cache_.bytes_allocated());
     Unlock();
     return statistics_;
   }
@@ -860,7 +1138,10 @@ class LruCache {
    * @param entry the CacheEntry to be touched (CacheEntry is the internal wrapper data structure)
    */
   inline void Touch(const CacheEntry &entry) {
-    lru_list_->MoveToBack(entry.list_entry);
+    if (replacement_ == kReplaceClock)
+      entry.list_entry->Reference();
+    else
+      lru_list_->MoveToBack(entry.list_entry);
   }
 
   /**
@@ -869,7 +1150,15 @@ class LruCache {
   inline void DeleteOldest() {
     assert(!this->IsEmpty());
 
-    atomic_inc64(&statistics_.num_replace);
+    statistics_.num_replace.Inc();
+    if (replacement_ == kReplaceClock) {
+      // Second chance for the referenced entries in front of the hand
+      ListEntryContent<Key> *front;
+      while ((front = lru_list_->Front())->referenced()) {
+        front->ClearReference();
+        lru_list_->MoveToBack(front);
+      }
+    }
     Key delete_me = lru_list_->PopFront();
     cache_.Erase(delete_me);
 
@@ -881,7 +1170,19 @@ class LruCache {
    */
   inline void Lock() {
 #ifdef LRU_CACHE_THREAD_SAFE
-    pthread_mutex_lock(&lock_);
+    pthread_rwlock_wrlock(&lock_);
+#endif
+  }
+
+  /**
+   * Lookups only share the lock if they don't reorder the list.
+   */
+  inline void LockLookup() {
+#ifdef LRU_CACHE_THREAD_SAFE
+    if (replacement_ == kReplaceClock)
+      pthread_rwlock_rdlock(&lock_);
+    else
+      pthread_rwlock_wrlock(&lock_);
 #endif
   }
 
@@ -890,29 +1191,131 @@ class LruCache {
    */
   inline void Unlock() {
 #ifdef LRU_CACHE_THREAD_SAFE
-    pthread_mutex_unlock(&lock_);
+    pthread_rwlock_unlock(&lock_);
 #endif
   }
 
   bool pause_;  /**< Temporarily stops the cache in order to avoid poisoning */
 };  // class LruCache
 
-// initialize the static allocator field
+
+/**
+ * A cache split into independent LruCache segments, each with its own list
+ * and lock.  The lower bits of the key hash select the segment, the hash table
+ * of the segment uses the upper bits.  The least recently used entry is
+ * evicted per segment.
+ */
 template<class Key, class Value>
-typename LruCache<Key, Value>::ConcreteMemoryAllocator
-  *LruCache<Key, Value>::allocator_ = NULL;
+class ShardedLruCache {
+ public:
+  static const unsigned kMaxSegments = 16;
+  static const unsigned kMinSegmentSize = 1024;
+
+  ShardedLruCache(const unsigned cache_size, const Key &empty_key,
+                  uint32_t (*hasher)(const Key &key),
+                  const Replacement replacement)
+  {
+    assert(cache_size > 0);
+    hasher_ = hasher;
+    num_segments_ = 1;
+    while ((num_segments_ < kMaxSegments) &&
+           (cache_size / (2*num_segments_) >= kMinSegmentSize))
+    {
+      num_segments_ *= 2;
+    }
+    // Every segment needs a multiple of 64 entries
+    const unsigned segment_size = ((cache_size / num_segments_ + 63) / 64) * 64;
+    for (unsigned i = 0; i < num_segments_; ++i)
+      segments_[i] = new LruCache<Key, Value>(segment_size, empty_key, hasher,
+                                              replacement);
+  }
+
+  ~ShardedLruCache() {
+    for (unsigned i = 0; i < num_segments_; ++i)
+      delete segments_[i];
+  }
+
+  static double GetEntrySize() {
+    return LruCache<Key, Value>::GetEntrySize();
+  }
+
+  bool Insert(const Key &key, const Value &value) {
+    return GetSegment(key)->Insert(key, value);
+  }
+
+  bool Lookup(const Key &key, Value *value) {
+    return GetSegment(key)->Lookup(key, value);
+  }
+
+  bool Forget(const Key &key) {
+    return GetSegment(key)->Forget(key);
+  }
+
+  void Drop() {
+    for (unsigned i = 0; i < num_segments_; ++i)
+      segments_[i]->Drop();
+  }
+
+  template<class Filter>
+  unsigned ForgetIf(Filter *filter) {
+    unsigned num_forgotten = 0;
+    for (unsigned i = 0; i < num_segments_; ++i)
+      num_forgotten += segments_[i]->ForgetIf(filter);
+    return num_forgotten;
+  }
+
+  template<class Visitor>
+  void Traverse(Visitor *visitor) {
+    for (unsigned i = 0; i < num_segments_; ++i)
+      segments_[i]->Traverse(visitor);
+  }
+
+  void Pause() {
+    for (unsigned i = 0; i < num_segments_; ++i)
+      segments_[i]->Pause();
+  }
+
+  void Resume() {
+    for (unsigned i = 0; i < num_segments_; ++i)
+      segments_[i]->Resume();
+  }
+
+  Statistics statistics() {
+    Statistics result = statistics_;
+    for (unsigned i = 0; i < num_segments_; ++i) {
+      Statistics segment = segments_[i]->statistics();
+      result.Add(&segment);
+    }
+    return result;
+  }
+
+ protected:
+  Statistics statistics_;  /**< Counters kept outside the segments */
+
+ private:
+  inline LruCache<Key, Value> *GetSegment(const Key &key) {
+    return segments_[hasher_(key) & (num_segments_ - 1)];
+  }
+
+  LruCache<Key, Value> *segments_[kMaxSegments];
+  unsigned num_segments_;  /**< power of 2 */
+  uint32_t (*hasher_)(const Key &key);
+};  // class ShardedLruCache
+
 
 // Hash functions
 uint32_t hasher_md5(const hash::Md5 &key);
 uint32_t hasher_inode(const fuse_ino_t &inode);
 
 
-class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
+class InodeCache :
+  public ShardedLruCache<fuse_ino_t, catalog::PackedDirent>
 {
  public:
-  InodeCache(unsigned int cache_size) :
-    LruCache<fuse_ino_t, catalog::DirectoryEntry>(
-      cache_size, fuse_ino_t(-1), hasher_inode)
+  InodeCache(unsigned int cache_size,
+             const Replacement replacement = kReplaceLru) :
+    ShardedLruCache<fuse_ino_t, catalog::PackedDirent>(
+      cache_size, fuse_ino_t(-1), hasher_inode, replacement)
   {
   }
 
@@ -920,13 +1323,18 @@ class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
     LogCvmfs(kLogLru, kLogDebug, "insert inode --> dirent: %d -> '%s'",
              inode, dirent.name().c_str());
     const bool result =
-      LruCache<fuse_ino_t, catalog::DirectoryEntry>::Insert(inode, dirent);
+      ShardedLruCache<fuse_ino_t, catalog::PackedDirent>::Insert(
+        inode, catalog::PackedDirent(dirent));
     return result;
   }
 
   bool Lookup(const fuse_ino_t inode, catalog::DirectoryEntry *dirent) {
+    catalog::PackedDirent packed;
     const bool result =
-      LruCache<fuse_ino_t, catalog::DirectoryEntry>::Lookup(inode, dirent);
+      ShardedLruCache<fuse_ino_t, catalog::PackedDirent>::Lookup(
+        inode, &packed);
+    if (result)
+      packed.Unpack(dirent);
     LogCvmfs(kLogLru, kLogDebug, "lookup inode --> dirent: %d (%s)",
              inode, result ? "hit" : "miss");
     return result;
@@ -934,15 +1342,17 @@ class InodeCache : public LruCache<fuse_ino_t, catalog::DirectoryEntry>
 
   void Drop() {
     LogCvmfs(kLogLru, kLogDebug, "dropping inode cache");
-    LruCache<fuse_ino_t, catalog::DirectoryEntry>::Drop();
+    ShardedLruCache<fuse_ino_t, catalog::PackedDirent>::Drop();
   }
 };  // InodeCache
 
 
-class PathCache : public LruCache<fuse_ino_t, PathString> {
+class PathCache : public ShardedLruCache<fuse_ino_t, PathString> {
  public:
-  PathCache(unsigned int cache_size) :
-    LruCache<fuse_ino_t, PathString>(cache_size, fuse_ino_t(-1), hasher_inode)
+  PathCache(unsigned int cache_size,
+            const Replacement replacement = kReplaceLru) :
+    ShardedLruCache<fuse_ino_t, PathString>(cache_size, fuse_ino_t(-1),
+                                            hasher_inode, replacement)
   {
   }
 
@@ -950,13 +1360,13 @@ class PathCache : public LruCache<fuse_ino_t, PathString> {
     LogCvmfs(kLogLru, kLogDebug, "insert inode --> path %d -> '%s'",
              inode, path.c_str());
     const bool result =
-      LruCache<fuse_ino_t, PathString>::Insert(inode, path);
+      ShardedLruCache<fuse_ino_t, PathString>::Insert(inode, path);
     return result;
   }
 
   bool Lookup(const fuse_ino_t inode, PathString *path) {
     const bool found =
-      LruCache<fuse_ino_t, PathString>::Lookup(inode, path);
+      ShardedLruCache<fuse_ino_t, PathString>::Lookup(inode, path);
     LogCvmfs(kLogLru, kLogDebug, "lookup inode --> path: %d (%s)",
              inode, found ? "hit" : "miss");
     return found;
@@ -964,40 +1374,48 @@ class PathCache : public LruCache<fuse_ino_t, PathString> {
 
   void Drop() {
     LogCvmfs(kLogLru, kLogDebug, "dropping path cache");
-    LruCache<fuse_ino_t, PathString>::Drop();
+    ShardedLruCache<fuse_ino_t, PathString>::Drop();
   }
 };  // PathCache
 
 
 class Md5PathCache :
-  public LruCache<hash::Md5, catalog::DirectoryEntry>
+  public ShardedLruCache<hash::Md5, catalog::PackedDirent>
 {
  public:
-  Md5PathCache(unsigned int cache_size) :
-    LruCache<hash::Md5, catalog::DirectoryEntry>(
-      cache_size, hash::Md5(hash::AsciiPtr("!")), hasher_md5)
+  Md5PathCache(unsigned int cache_size,
+               const Replacement replacement = kReplaceLru) :
+    ShardedLruCache<hash::Md5, catalog::PackedDirent>(
+      cache_size, hash::Md5(hash::AsciiPtr("!")), hasher_md5, replacement)
   {
-    dirent_negative_ = catalog::DirectoryEntry(catalog::kDirentNegative);
+    dirent_negative_ = catalog::PackedDirent(
+      catalog::DirectoryEntry(catalog::kDirentNegative));
   }
 
   bool Insert(const hash::Md5 &hash, const catalog::DirectoryEntry &dirent) {
     LogCvmfs(kLogLru, kLogDebug, "insert md5 --> dirent: %s -> '%s'",
              hash.ToString().c_str(), dirent.name().c_str());
     const bool result =
-      LruCache<hash::Md5, catalog::DirectoryEntry>::Insert(hash, dirent);
+      ShardedLruCache<hash::Md5, catalog::PackedDirent>::Insert(
+        hash, catalog::PackedDirent(dirent));
     return result;
   }
 
   bool InsertNegative(const hash::Md5 &hash) {
-    const bool result = Insert(hash, dirent_negative_);
+    const bool result =
+      ShardedLruCache<hash::Md5, catalog::PackedDirent>::Insert(
+        hash, dirent_negative_);
     if (result)
-      atomic_inc64(&statistics_.num_insert_negative);
+      statistics_.num_insert_negative.Inc();
     return result;
   }
 
   bool Lookup(const hash::Md5 &hash, catalog::DirectoryEntry *dirent) {
+    catalog::PackedDirent packed;
     const bool result =
-      LruCache<hash::Md5, catalog::DirectoryEntry>::Lookup(hash, dirent);
+      ShardedLruCache<hash::Md5, catalog::PackedDirent>::Lookup(hash, &packed);
+    if (result)
+      packed.Unpack(dirent);
     LogCvmfs(kLogLru, kLogDebug, "lookup md5 --> dirent: %s (%s)",
              hash.ToString().c_str(), result ? "hit" : "miss");
     return result;
@@ -1006,18 +1424,52 @@ class Md5PathCache :
   bool Forget(const hash::Md5 &hash) {
     LogCvmfs(kLogLru, kLogDebug, "forget md5: %s",
              hash.ToString().c_str());
-    return LruCache<hash::Md5, catalog::DirectoryEntry>::Forget(hash);
+    return ShardedLruCache<hash::Md5, catalog::PackedDirent>::Forget(hash);
   }
 
   void Drop() {
     LogCvmfs(kLogLru, kLogDebug, "dropping md5path cache");
-    LruCache<hash::Md5, catalog::DirectoryEntry>::Drop();
+    ShardedLruCache<hash::Md5, catalog::PackedDirent>::Drop();
   }
 
  private:
-  catalog::DirectoryEntry dirent_negative_;
+  catalog::PackedDirent dirent_negative_;
 };  // Md5PathCache
 
+
+/**
+ * Maps the md5 of a directory path as given to libcvmfs to the path with all
+ * symlinks, "." and ".." expanded.
+ */
+class ResolvedPathCache : public ShardedLruCache<hash::Md5, PathString> {
+ public:
+  ResolvedPathCache(unsigned int cache_size,
+                    const Replacement replacement = kReplaceLru) :
+    ShardedLruCache<hash::Md5, PathString>(
+      cache_size, hash::Md5(hash::AsciiPtr("!")), hasher_md5, replacement)
+  {
+  }
+
+  bool Insert(const hash::Md5 &hash, const PathString &resolved) {
+    LogCvmfs(kLogLru, kLogDebug, "insert md5 --> resolved path: %s -> '%s'",
+             hash.ToString().c_str(), resolved.c_str());
+    return ShardedLruCache<hash::Md5, PathString>::Insert(hash, resolved);
+  }
+
+  bool Lookup(const hash::Md5 &hash, PathString *resolved) {
+    const bool found =
+      ShardedLruCache<hash::Md5, PathString>::Lookup(hash, resolved);
+    LogCvmfs(kLogLru, kLogDebug, "lookup md5 --> resolved path: %s (%s)",
+             hash.ToString().c_str(), found ? "hit" : "miss");
+    return found;
+  }
+
+  void Drop() {
+    LogCvmfs(kLogLru, kLogDebug, "dropping resolved path cache");
+    ShardedLruCache<hash::Md5, PathString>::Drop();
+  }
+};  // ResolvedPathCache
+
 }  // namespace lru
 
 #endif  // CVMFS_LRU_H_
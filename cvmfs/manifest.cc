@@ -114,9 +114,12 @@ Manifest *Manifest::Load(const map<char, string> &content) {
   if ((iter = content.find('T')) != content.end())
     publish_timestamp = String2Uint64(iter->second);
 
-  return new Manifest(catalog_hash, root_path, ttl, revision,
-                      micro_catalog_hash, repository_name, certificate,
-                      publish_timestamp);
+  Manifest *manifest = new Manifest(catalog_hash, root_path, ttl, revision,
+                                    micro_catalog_hash, repository_name,
+                                    certificate, publish_timestamp);
+  if ((iter = content.find('Z')) != content.end())
+    manifest->set_compression_algorithm(iter->second);
+  return manifest;
 }
 
 
@@ -147,6 +150,8 @@ string Manifest::ExportString() const {
     manifest += "X" + certificate_.ToString() + "\n";
   if (publish_timestamp_ > 0)
     manifest += "T" + StringifyInt(publish_timestamp_) + "\n";
+  if ((compression_algorithm_ != "") && (compression_algorithm_ != "zlib"))
+    manifest += "Z" + compression_algorithm_ + "\n";
 
   return manifest;
 }
@@ -48,12 +48,20 @@ class Manifest {
   void set_publish_timestamp(const uint32_t publish_timestamp) {
     publish_timestamp_ = publish_timestamp;
   }
+  void set_compression_algorithm(const std::string &compression_algorithm) {
+    compression_algorithm_ = compression_algorithm;
+  }
 
   std::string repository_name() const { return repository_name_; }
   hash::Md5 root_path() const { return root_path_; }
   hash::Any catalog_hash() const { return catalog_hash_; }
   hash::Any certificate() const { return certificate_; }
   uint64_t publish_timestamp() const { return publish_timestamp_; }
+  /**
+   * Codec of new objects, empty for zlib.  Objects of older revisions can
+   * still be compressed by zlib.
+   */
+  std::string compression_algorithm() const { return compression_algorithm_; }
  private:
   static Manifest *Load(const std::map<char, std::string> &content);
   hash::Any catalog_hash_;
@@ -64,6 +72,7 @@ class Manifest {
   std::string repository_name_;
   hash::Any certificate_;
   uint64_t publish_timestamp_;
+  std::string compression_algorithm_;
 };  // class Manifest
 
 }  // namespace manifest
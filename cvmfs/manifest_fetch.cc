@@ -4,27 +4,183 @@
 
 #include "manifest_fetch.h"
 
+#include <pthread.h>
+
+#include <ctime>
+#include <map>
 #include <string>
 #include <vector>
 
 #include <cassert>
+#include <cstring>
 
+#include "atomic.h"
 #include "manifest.h"
 #include "download.h"
 #include "signature.h"
+#include "smalloc.h"
 #include "util.h"
 
 using namespace std;  // NOLINT
 
 namespace manifest {
 
+/**
+ * The signature module keeps the loaded certificate in a global variable.
+ * Verifications of several repositories in one process (libcvmfs contexts)
+ * are serialized.
+ */
+pthread_mutex_t lock_verify_ = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The last copy of the manifest and the whitelist per repository and URL.
+ * They are requested with If-Modified-Since, so that unchanged files cost a
+ * 304 without body.  The copy is only used for the host it came from.
+ */
+struct CachedObject {
+  CachedObject() : last_modified(0) { }
+  std::string data;
+  std::string host;
+  time_t last_modified;
+};
+map<string, CachedObject> cached_objects_;
+pthread_mutex_t lock_cached_objects_ = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Successfully verified ensembles, keyed by the repository name and the
+ * hashes of the manifest, the certificate, and the whitelist.  An entry is
+ * valid until the whitelist expires.  The fingerprint is kept for the
+ * blacklist check, which is always repeated.  Protected by lock_verify_.
+ */
+struct VerifiedEnsemble {
+  time_t expires;
+  std::string fingerprint;
+};
+const unsigned kMaxVerified = 64;
+map<string, VerifiedEnsemble> verified_;
+
+atomic_int64 num_not_modified_ = 0;
+atomic_int64 num_verified_ = 0;
+atomic_int64 num_verify_cached_ = 0;
+
+
+FetchStatistics GetFetchStatistics() {
+  FetchStatistics result;
+  result.num_not_modified = atomic_read64(&num_not_modified_);
+  result.num_verified = atomic_read64(&num_verified_);
+  result.num_verify_cached = atomic_read64(&num_verify_cached_);
+  return result;
+}
+
+
+/**
+ * The host that serves requests with probe_hosts, the base URL otherwise.
+ */
+static string GetCurrentHost(const string &base_url) {
+  if (base_url != "")
+    return base_url;
+  vector<string> host_chain;
+  vector<int> rtt;
+  unsigned current_host = 0;
+  download::GetHostInfo(&host_chain, &rtt, &current_host);
+  if (current_host >= host_chain.size())
+    return "";
+  return host_chain[current_host];
+}
+
+
+/**
+ * Downloads a small file into memory with a conditional request.  On 304, the
+ * stored copy is returned in a newly allocated buffer instead.
+ */
+static download::Failures FetchConditional(const string &key,
+                                           const string &base_url,
+                                           download::JobInfo *info)
+{
+  const string host = GetCurrentHost(base_url);
+  CachedObject cached;
+  pthread_mutex_lock(&lock_cached_objects_);
+  map<string, CachedObject>::const_iterator iter = cached_objects_.find(key);
+  const bool has_copy = (iter != cached_objects_.end()) &&
+                        (iter->second.host == host);
+  if (has_copy)
+    cached = iter->second;
+  pthread_mutex_unlock(&lock_cached_objects_);
+
+  info->conditional = true;
+  info->if_modified_since = has_copy ? cached.last_modified : 0;
+  download::Failures retval = download::Fetch(info);
+  if (retval != download::kFailOk)
+    return retval;
+
+  if (info->not_modified) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "%s not modified, using stored copy",
+             info->url->c_str());
+    atomic_inc64(&num_not_modified_);
+    download::ReleaseMemBuffer(info);
+    info->destination_mem.size = cached.data.length();
+    info->destination_mem.data =
+      static_cast<char *>(smalloc(cached.data.length() + 1));
+    memcpy(info->destination_mem.data, cached.data.data(),
+           cached.data.length());
+    return download::kFailOk;
+  }
+
+  pthread_mutex_lock(&lock_cached_objects_);
+  if (info->last_modified > 0) {
+    CachedObject *object = &cached_objects_[key];
+    object->data.assign(info->destination_mem.data,
+                        info->destination_mem.size);
+    object->host = host;
+    object->last_modified = info->last_modified;
+  } else {
+    cached_objects_.erase(key);
+  }
+  pthread_mutex_unlock(&lock_cached_objects_);
+  return download::kFailOk;
+}
+
+
+/**
+ * Copies the downloaded data into a buffer owned by the ensemble, so that the
+ * buffer of the download module goes back to its pool.
+ */
+static unsigned char *TakeMemBuffer(download::JobInfo *info, unsigned *size) {
+  *size = info->destination_mem.size;
+  unsigned char *buffer =
+    static_cast<unsigned char *>(smalloc((*size > 0) ? *size : 1));
+  memcpy(buffer, info->destination_mem.data, *size);
+  download::ReleaseMemBuffer(info);
+  return buffer;
+}
+
+
+/**
+ * Checks a certificate fingerprint against the local blacklist.
+ */
+static bool IsBlacklisted(const string &fingerprint) {
+  vector<string> blacklisted_certificates =
+    signature::GetBlacklistedCertificates();
+  for (unsigned i = 0; i < blacklisted_certificates.size(); ++i) {
+    if (blacklisted_certificates[i].substr(0, 59) == fingerprint) {
+      LogCvmfs(kLogSignature, kLogDebug | kLogSyslog,
+               "blacklisted fingerprint (%s)", fingerprint.c_str());
+      return true;
+    }
+  }
+  return false;
+}
+
+
 /**
  * Checks whether the fingerprint of the loaded PEM certificate is listed on the
- * whitelist stored in a memory chunk.
+ * whitelist stored in a memory chunk.  Returns the expiry time of the
+ * whitelist in expires.
  */
 static bool VerifyWhitelist(const unsigned char *whitelist,
                             const unsigned whitelist_size,
-                            const string &expected_repository)
+                            const string &expected_repository,
+                            time_t *expires)
 {
   const string fingerprint = signature::FingerprintCertificate();
   if (fingerprint == "") {
@@ -76,6 +232,7 @@ static bool VerifyWhitelist(const unsigned char *whitelist,
              "whitelist lifetime verification failed, expired");
     return false;
   }
+  *expires = timestamp;
   payload_bytes += 16;
 
   // Check repository name
@@ -108,23 +265,96 @@ static bool VerifyWhitelist(const unsigned char *whitelist,
   }
 
   // Check local blacklist
-  vector<string> blacklisted_certificates =
-    signature::GetBlacklistedCertificates();
-  for (unsigned i = 0; i < blacklisted_certificates.size(); ++i) {
-    if (blacklisted_certificates[i].substr(0, 59) == fingerprint) {
-      LogCvmfs(kLogSignature, kLogDebug | kLogSyslog,
-               "blacklisted fingerprint (%s)", fingerprint.c_str());
-      return false;
+  return !IsBlacklisted(fingerprint);
+}
+
+
+/**
+ * Verifies the manifest signature with the certificate and the certificate
+ * with the whitelist.  On success, the ensemble can be trusted until expires.
+ */
+static Failures VerifyEnsemble(const ManifestEnsemble &ensemble,
+                               const string &repository_name,
+                               time_t *expires)
+{
+  if (!signature::LoadCertificateMem(ensemble.cert_buf, ensemble.cert_size))
+    return kFailBadCertificate;
+  if (!signature::VerifyLetter(ensemble.raw_manifest_buf,
+                               ensemble.raw_manifest_size, false))
+  {
+    return kFailBadSignature;
+  }
+  if (!signature::VerifyLetter(ensemble.whitelist_buf, ensemble.whitelist_size,
+                               true) ||
+      !VerifyWhitelist(ensemble.whitelist_buf, ensemble.whitelist_size,
+                       repository_name, expires))
+  {
+    return kFailBadWhitelist;
+  }
+  return kFailOk;
+}
+
+
+/**
+ * Like VerifyEnsemble() but skips the signature checks if the same ensemble
+ * has been verified before.  Caller holds lock_verify_.
+ */
+static Failures VerifyEnsembleCached(const ManifestEnsemble &ensemble,
+                                     const string &repository_name)
+{
+  hash::Any manifest_hash(hash::kSha1);
+  hash::Any whitelist_hash(hash::kSha1);
+  hash::HashMem(ensemble.raw_manifest_buf, ensemble.raw_manifest_size,
+                &manifest_hash);
+  hash::HashMem(ensemble.whitelist_buf, ensemble.whitelist_size,
+                &whitelist_hash);
+  const string key = repository_name + "|" + manifest_hash.ToString() + "|" +
+    ensemble.manifest->certificate().ToString() + "|" +
+    whitelist_hash.ToString();
+  const time_t now = time(NULL);
+
+  map<string, VerifiedEnsemble>::iterator iter = verified_.find(key);
+  if (iter != verified_.end()) {
+    if ((now < iter->second.expires) &&
+        !IsBlacklisted(iter->second.fingerprint))
+    {
+      LogCvmfs(kLogSignature, kLogDebug,
+               "manifest ensemble of %s verified before",
+               repository_name.c_str());
+      atomic_inc64(&num_verify_cached_);
+      return kFailOk;
     }
+    verified_.erase(iter);
   }
 
-  return true;
+  time_t expires = 0;
+  const Failures result = VerifyEnsemble(ensemble, repository_name, &expires);
+  atomic_inc64(&num_verified_);
+  if (result != kFailOk)
+    return result;
+
+  if (verified_.size() >= kMaxVerified) {
+    for (iter = verified_.begin(); iter != verified_.end(); ) {
+      if (iter->second.expires <= now)
+        verified_.erase(iter++);
+      else
+        ++iter;
+    }
+    if (verified_.size() >= kMaxVerified)
+      verified_.clear();
+  }
+  VerifiedEnsemble verified;
+  verified.expires = expires;
+  verified.fingerprint = signature::FingerprintCertificate();
+  verified_[key] = verified;
+  return kFailOk;
 }
 
 
 /**
  * Downloads and verifies the manifest, the certificate, and the whitelist.
  * If base_url is empty, uses the probe_hosts feature from download module.
+ * Manifest and whitelist are requested conditionally.
  */
 Failures Fetch(const std::string &base_url, const std::string &repository_name,
                const uint64_t minimum_timestamp, const hash::Any *base_catalog,
@@ -143,15 +373,21 @@ Failures Fetch(const std::string &base_url, const std::string &repository_name,
   string certificate_url = base_url + "/data";  // rest is in manifest
   download::JobInfo download_certificate(&certificate_url, true, probe_hosts,
                                          &certificate_hash);
+  download_manifest.priority = download::kPriorityMetadata;
+  download_whitelist.priority = download::kPriorityMetadata;
+  download_certificate.priority = download::kPriorityMetadata;
+  download_manifest.repository_name = &repository_name;
+  download_whitelist.repository_name = &repository_name;
+  download_certificate.repository_name = &repository_name;
 
-  retval = download::Fetch(&download_manifest);
+  retval = FetchConditional(repository_name + "|" + manifest_url, base_url,
+                            &download_manifest);
   if (retval != download::kFailOk)
     return kFailLoad;
 
   // Load Manifest
   ensemble->raw_manifest_buf =
-    reinterpret_cast<unsigned char *>(download_manifest.destination_mem.data);
-  ensemble->raw_manifest_size = download_manifest.destination_mem.size;
+    TakeMemBuffer(&download_manifest, &ensemble->raw_manifest_size);
   ensemble->manifest =
     manifest::Manifest::LoadMem(ensemble->raw_manifest_buf,
                                 ensemble->raw_manifest_size);
@@ -187,45 +423,24 @@ Failures Fetch(const std::string &base_url, const std::string &repository_name,
         goto cleanup;
     }
     ensemble->cert_buf =
-      reinterpret_cast<unsigned char *>(download_certificate.destination_mem.data);
-    ensemble->cert_size = download_certificate.destination_mem.size;
-  }
-  retval = signature::LoadCertificateMem(ensemble->cert_buf,
-                                         ensemble->cert_size);
-  if (!retval) {
-    result = kFailBadCertificate;
-    goto cleanup;
-  }
-
-  // Verify manifest
-  retval = signature::VerifyLetter(ensemble->raw_manifest_buf,
-                                   ensemble->raw_manifest_size, false);
-  if (!retval) {
-    result = kFailBadSignature;
-    goto cleanup;
+      TakeMemBuffer(&download_certificate, &ensemble->cert_size);
   }
 
-  // Load whitelist and verify
-  retval = download::Fetch(&download_whitelist);
+  // Load whitelist
+  retval = FetchConditional(repository_name + "|" + whitelist_url, base_url,
+                            &download_whitelist);
   if (retval != download::kFailOk) {
     result = kFailLoad;
     goto cleanup;
   }
   ensemble->whitelist_buf =
-    reinterpret_cast<unsigned char *>(download_whitelist.destination_mem.data);
-  ensemble->whitelist_size = download_whitelist.destination_mem.size;
-  retval = signature::VerifyLetter(ensemble->whitelist_buf,
-                                   ensemble->whitelist_size, true);
-  if (!retval) {
-    result = kFailBadWhitelist;
-    goto cleanup;
-  }
-  retval = VerifyWhitelist(ensemble->whitelist_buf, ensemble->whitelist_size,
-                           repository_name);
-  if (!retval) {
-    result = kFailBadWhitelist;
+    TakeMemBuffer(&download_whitelist, &ensemble->whitelist_size);
+
+  pthread_mutex_lock(&lock_verify_);
+  result = VerifyEnsembleCached(*ensemble, repository_name);
+  pthread_mutex_unlock(&lock_verify_);
+  if (result != kFailOk)
     goto cleanup;
-  }
 
   return kFailOk;
 
@@ -5,6 +5,8 @@
 #ifndef CVMFS_MANIFEST_FETCH_H_
 #define CVMFS_MANIFEST_FETCH_H_
 
+#include <stdint.h>
+
 #include <string>
 #include <cstdlib>
 
@@ -56,6 +58,17 @@ struct ManifestEnsemble {
 };
 
 
+/**
+ * Counters of the shortcuts taken by Fetch().
+ */
+struct FetchStatistics {
+  int64_t num_not_modified;  /**< manifests and whitelists answered by 304 */
+  int64_t num_verified;  /**< full signature verifications */
+  int64_t num_verify_cached;  /**< verifications taken from the cache */
+};
+
+FetchStatistics GetFetchStatistics();
+
 Failures Fetch(const std::string &base_url, const std::string &repository_name,
                const uint64_t minimum_timestamp, const hash::Any *base_catalog,
                ManifestEnsemble *ensemble);
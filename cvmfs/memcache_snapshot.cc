@@ -0,0 +1,410 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Keeps the inode, path, and md5path caches over a restart of the client.  On
+ * unmount, the cache entries are written in LRU order together with the
+ * catalog revision and the inode ranges of the attached catalogs.  On mount,
+ * the snapshot is used only if the root catalog has the same revision.  The
+ * nested catalogs are attached again with their previous inode ranges so
+ * that the inodes of the snapshot remain valid.  Entries of catalogs that
+ * changed or failed to load are skipped.
+ *
+ * The snapshot is in host byte order and it is read through mmap().
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "memcache_snapshot.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "catalog_mgr.h"
+#include "dirent.h"
+#include "hash.h"
+#include "logging.h"
+#include "lru.h"
+#include "platform.h"
+#include "shortstring.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace memcache_snapshot {
+
+const uint32_t kMagic = 0x4d434d43;  // "CMCM"
+const uint32_t kVersion = 1;
+/**
+ * Magic, version, revision, and the number of catalogs, inodes, paths, and
+ * md5paths
+ */
+const unsigned kHeaderSize = 4 + 4 + 8 + 4*4;
+const unsigned kMaxDirentSize =
+  catalog::PackedDirent::kSerialHeaderSize + 2*65535;
+
+typedef map<PathString, catalog::AbstractCatalogManager::PreservedCatalog>
+  InodeLayout;
+
+
+static void Append(const void *field, const unsigned size, string *buffer) {
+  buffer->append(reinterpret_cast<const char *>(field), size);
+}
+
+
+/**
+ * Appends the visited cache entries to the snapshot buffer.
+ */
+struct SnapshotWriter {
+  explicit SnapshotWriter(string *b) : buffer(b), num_entries(0) { }
+
+  void AppendDirent(const catalog::PackedDirent &dirent) {
+    const unsigned size = dirent.GetSerialSize();
+    const size_t pos = buffer->size();
+    buffer->resize(pos + size);
+    dirent.Serialize(reinterpret_cast<unsigned char *>(&(*buffer)[pos]));
+  }
+
+  void operator()(const fuse_ino_t &inode,
+                  const catalog::PackedDirent &dirent)
+  {
+    const uint64_t ino = inode;
+    Append(&ino, sizeof(ino), buffer);
+    AppendDirent(dirent);
+    num_entries++;
+  }
+
+  void operator()(const fuse_ino_t &inode, const PathString &path) {
+    const uint64_t ino = inode;
+    const uint32_t length = path.GetLength();
+    Append(&ino, sizeof(ino), buffer);
+    Append(&length, sizeof(length), buffer);
+    Append(path.GetChars(), length, buffer);
+    num_entries++;
+  }
+
+  void operator()(const hash::Md5 &md5path,
+                  const catalog::PackedDirent &dirent)
+  {
+    Append(md5path.digest, sizeof(md5path.digest), buffer);
+    AppendDirent(dirent);
+    num_entries++;
+  }
+
+  string *buffer;
+  uint32_t num_entries;
+};
+
+
+/**
+ * Bounds checked reads from the mapped snapshot.
+ */
+class SnapshotReader {
+ public:
+  SnapshotReader(const unsigned char *data, const size_t size) :
+    pos_(data), end_(data + size) { }
+
+  bool Get(void *field, const unsigned size) {
+    if (static_cast<size_t>(end_ - pos_) < size)
+      return false;
+    memcpy(field, pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+  bool GetPath(const unsigned length, PathString *path) {
+    if (static_cast<size_t>(end_ - pos_) < length)
+      return false;
+    path->Assign(reinterpret_cast<const char *>(pos_), length);
+    pos_ += length;
+    return true;
+  }
+
+  bool GetDirent(catalog::PackedDirent *dirent) {
+    const size_t remaining = end_ - pos_;
+    const unsigned consumed = dirent->Deserialize(pos_,
+      (remaining > kMaxDirentSize) ? kMaxDirentSize : remaining);
+    pos_ += consumed;
+    return consumed > 0;
+  }
+
+ private:
+  const unsigned char *pos_;
+  const unsigned char *end_;
+};
+
+
+/**
+ * Inodes of the snapshot that still belong to the same catalog.
+ */
+class InodeFilter {
+ public:
+  InodeFilter(const InodeLayout &previous, const InodeLayout &current,
+              const bool stable_inodes) : stable_inodes_(stable_inodes)
+  {
+    for (InodeLayout::const_iterator i = previous.begin(),
+         iEnd = previous.end(); i != iEnd; ++i)
+    {
+      InodeLayout::const_iterator c = current.find(i->first);
+      if ((c != current.end()) && (c->second.hash == i->second.hash) &&
+          (c->second.inode_range.offset == i->second.inode_range.offset) &&
+          (c->second.inode_range.size == i->second.inode_range.size))
+      {
+        valid_ranges_.push_back(c->second.inode_range);
+      }
+    }
+  }
+
+  bool IsValid(const uint64_t inode) const {
+    if (stable_inodes_ || (inode == catalog::DirectoryEntry::kInvalidInode))
+      return true;
+    for (unsigned i = 0; i < valid_ranges_.size(); ++i) {
+      if (valid_ranges_[i].ContainsInode(inode))
+        return true;
+    }
+    return false;
+  }
+
+  bool IsValid(const catalog::PackedDirent &dirent) const {
+    if (dirent.GetSpecial() == catalog::kDirentNegative)
+      return true;
+    return IsValid(dirent.inode()) && IsValid(dirent.parent_inode());
+  }
+
+  unsigned num_valid_ranges() const { return valid_ranges_.size(); }
+
+ private:
+  bool stable_inodes_;  /**< NFS maps keep the inodes anyway */
+  vector<catalog::InodeRange> valid_ranges_;
+};
+
+
+bool Save(const string &path,
+          catalog::AbstractCatalogManager *catalog_manager,
+          lru::InodeCache *inode_cache, lru::PathCache *path_cache,
+          lru::Md5PathCache *md5path_cache)
+{
+  const uint64_t revision = catalog_manager->GetRevision();
+  InodeLayout layout;
+  catalog_manager->GetInodeLayout(&layout);
+
+  string buffer(kHeaderSize, '\0');
+  for (InodeLayout::const_iterator i = layout.begin(), iEnd = layout.end();
+       i != iEnd; ++i)
+  {
+    const uint64_t offset = i->second.inode_range.offset;
+    const uint64_t size = i->second.inode_range.size;
+    const uint8_t algorithm = i->second.hash.algorithm;
+    const uint16_t length = i->first.GetLength();
+    Append(&offset, sizeof(offset), &buffer);
+    Append(&size, sizeof(size), &buffer);
+    Append(&algorithm, sizeof(algorithm), &buffer);
+    Append(i->second.hash.digest, sizeof(i->second.hash.digest), &buffer);
+    Append(&length, sizeof(length), &buffer);
+    Append(i->first.GetChars(), length, &buffer);
+  }
+  SnapshotWriter inode_writer(&buffer);
+  inode_cache->Traverse(&inode_writer);
+  SnapshotWriter path_writer(&buffer);
+  path_cache->Traverse(&path_writer);
+  SnapshotWriter md5path_writer(&buffer);
+  md5path_cache->Traverse(&md5path_writer);
+
+  string header;
+  const uint32_t num_catalogs = layout.size();
+  Append(&kMagic, sizeof(kMagic), &header);
+  Append(&kVersion, sizeof(kVersion), &header);
+  Append(&revision, sizeof(revision), &header);
+  Append(&num_catalogs, sizeof(num_catalogs), &header);
+  Append(&inode_writer.num_entries, sizeof(uint32_t), &header);
+  Append(&path_writer.num_entries, sizeof(uint32_t), &header);
+  Append(&md5path_writer.num_entries, sizeof(uint32_t), &header);
+  buffer.replace(0, kHeaderSize, header);
+
+  const string path_tmp = path + ".tmp";
+  FILE *f = fopen(path_tmp.c_str(), "w");
+  if (!f) {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "failed to write cache snapshot %s (%d)", path.c_str(), errno);
+    return false;
+  }
+  const bool written =
+    (fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size());
+  if ((fclose(f) != 0) || !written ||
+      (rename(path_tmp.c_str(), path.c_str()) != 0))
+  {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "failed to write cache snapshot %s (%d)", path.c_str(), errno);
+    unlink(path_tmp.c_str());
+    return false;
+  }
+  LogCvmfs(kLogCvmfs, kLogDebug, "saved cache snapshot of revision %"PRIu64
+           ": %u catalogs, %u inodes, %u paths, %u md5paths (%u kB)",
+           revision, num_catalogs, inode_writer.num_entries,
+           path_writer.num_entries, md5path_writer.num_entries,
+           static_cast<unsigned>(buffer.size() / 1024));
+  return true;
+}
+
+
+/**
+ * Fills the empty caches from the snapshot.  Has to run before the file
+ * system is mounted, because it hands out the inodes of the previous run.
+ */
+bool Restore(const string &path, const bool stable_inodes,
+             catalog::AbstractCatalogManager *catalog_manager,
+             lru::InodeCache *inode_cache, lru::PathCache *path_cache,
+             lru::Md5PathCache *md5path_cache)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  platform_stat64 info;
+  if ((platform_fstat(fd, &info) != 0) ||
+      (static_cast<uint64_t>(info.st_size) < kHeaderSize))
+  {
+    close(fd);
+    return false;
+  }
+  const size_t size = info.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  bool result = false;
+  SnapshotReader reader(static_cast<const unsigned char *>(mapping), size);
+  uint32_t magic, version, num_catalogs, num_inodes, num_paths, num_md5paths;
+  uint64_t revision;
+  unsigned num_restored = 0;
+  unsigned num_skipped = 0;
+  InodeLayout previous;
+  InodeLayout current;
+  reader.Get(&magic, sizeof(magic));
+  reader.Get(&version, sizeof(version));
+  reader.Get(&revision, sizeof(revision));
+  reader.Get(&num_catalogs, sizeof(num_catalogs));
+  reader.Get(&num_inodes, sizeof(num_inodes));
+  reader.Get(&num_paths, sizeof(num_paths));
+  reader.Get(&num_md5paths, sizeof(num_md5paths));
+  if ((magic != kMagic) || (version != kVersion) ||
+      (revision != catalog_manager->GetRevision()))
+  {
+    LogCvmfs(kLogCvmfs, kLogDebug, "cache snapshot %s does not match",
+             path.c_str());
+    goto restore_final;
+  }
+
+  for (uint32_t i = 0; i < num_catalogs; ++i) {
+    catalog::AbstractCatalogManager::PreservedCatalog preserved;
+    uint8_t algorithm;
+    uint16_t length;
+    PathString mountpoint;
+    if (!reader.Get(&preserved.inode_range.offset, sizeof(uint64_t)) ||
+        !reader.Get(&preserved.inode_range.size, sizeof(uint64_t)) ||
+        !reader.Get(&algorithm, sizeof(algorithm)) ||
+        !reader.Get(preserved.hash.digest, sizeof(preserved.hash.digest)) ||
+        !reader.Get(&length, sizeof(length)) ||
+        !reader.GetPath(length, &mountpoint))
+    {
+      goto restore_corrupt;
+    }
+    preserved.hash.algorithm = static_cast<hash::Algorithms>(algorithm);
+    previous[mountpoint] = preserved;
+  }
+  catalog_manager->PreserveInodes(previous);
+  for (InodeLayout::const_iterator i = previous.begin(),
+       iEnd = previous.end(); i != iEnd; ++i)
+  {
+    if ((i->first.GetLength() > 0) && !catalog_manager->MountNested(i->first))
+    {
+      LogCvmfs(kLogCvmfs, kLogDebug, "failed to attach %s from cache snapshot",
+               i->first.c_str());
+    }
+  }
+  catalog_manager->GetInodeLayout(&current);
+
+  {
+    const InodeFilter filter(previous, current, stable_inodes);
+    catalog::PackedDirent packed;
+    catalog::DirectoryEntry dirent;
+    for (uint32_t i = 0; i < num_inodes; ++i) {
+      uint64_t inode;
+      if (!reader.Get(&inode, sizeof(inode)) || !reader.GetDirent(&packed))
+        goto restore_corrupt;
+      if (filter.IsValid(inode) && filter.IsValid(packed)) {
+        packed.Unpack(&dirent);
+        inode_cache->Insert(inode, dirent);
+        num_restored++;
+      } else {
+        num_skipped++;
+      }
+    }
+    for (uint32_t i = 0; i < num_paths; ++i) {
+      uint64_t inode;
+      uint32_t length;
+      PathString entry_path;
+      if (!reader.Get(&inode, sizeof(inode)) ||
+          !reader.Get(&length, sizeof(length)) ||
+          !reader.GetPath(length, &entry_path))
+      {
+        goto restore_corrupt;
+      }
+      if (filter.IsValid(inode)) {
+        path_cache->Insert(inode, entry_path);
+        num_restored++;
+      } else {
+        num_skipped++;
+      }
+    }
+    for (uint32_t i = 0; i < num_md5paths; ++i) {
+      hash::Md5 md5path;
+      if (!reader.Get(md5path.digest, sizeof(md5path.digest)) ||
+          !reader.GetDirent(&packed))
+      {
+        goto restore_corrupt;
+      }
+      if (!filter.IsValid(packed)) {
+        num_skipped++;
+        continue;
+      }
+      if (packed.GetSpecial() == catalog::kDirentNegative) {
+        md5path_cache->InsertNegative(md5path);
+      } else {
+        packed.Unpack(&dirent);
+        md5path_cache->Insert(md5path, dirent);
+      }
+      num_restored++;
+    }
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "restored %u cache entries of revision %"PRIu64" "
+             "(%u skipped, %u out of %u catalogs with the same inodes)",
+             num_restored, revision, num_skipped, filter.num_valid_ranges(),
+             previous.size());
+  }
+  result = true;
+  goto restore_final;
+
+ restore_corrupt:
+  LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+           "cache snapshot %s is corrupted", path.c_str());
+  inode_cache->Drop();
+  path_cache->Drop();
+  md5path_cache->Drop();
+
+ restore_final:
+  munmap(mapping, size);
+  return result;
+}
+
+}  // namespace memcache_snapshot
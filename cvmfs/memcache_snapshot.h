@@ -0,0 +1,33 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_MEMCACHE_SNAPSHOT_H_
+#define CVMFS_MEMCACHE_SNAPSHOT_H_
+
+#include <string>
+
+namespace catalog {
+class AbstractCatalogManager;
+}
+
+namespace lru {
+class InodeCache;
+class PathCache;
+class Md5PathCache;
+}
+
+namespace memcache_snapshot {
+
+bool Save(const std::string &path,
+          catalog::AbstractCatalogManager *catalog_manager,
+          lru::InodeCache *inode_cache, lru::PathCache *path_cache,
+          lru::Md5PathCache *md5path_cache);
+bool Restore(const std::string &path, const bool stable_inodes,
+             catalog::AbstractCatalogManager *catalog_manager,
+             lru::InodeCache *inode_cache, lru::PathCache *path_cache,
+             lru::Md5PathCache *md5path_cache);
+
+}  // namespace memcache_snapshot
+
+#endif  // CVMFS_MEMCACHE_SNAPSHOT_H_
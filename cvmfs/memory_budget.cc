@@ -0,0 +1,280 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The memory budget keeps the memory of the caches within a total that is
+ * given for the whole process.  Subsystems register their caches as
+ * consumers together with the limits between which the cache can be sized.
+ * Memory that cannot be given back, such as the preallocated metadata caches,
+ * is registered as fixed and only counted.
+ *
+ * Every kRebalanceInterval seconds, the budget left by the fixed consumers is
+ * handed out in order of priority.  A consumer is limited to what is left
+ * after the actual usage of all consumers of higher priority, so that caches
+ * of low priority shrink first.  A consumer that grows in between can exceed
+ * the budget until the next round.  A budget of 0 only records the usage.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "memory_budget.h"
+
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "logging.h"
+#include "metrics.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace memory_budget {
+
+const unsigned kRebalanceInterval = 5;  /**< seconds */
+
+struct Consumer {
+  string name;
+  Priorities priority;
+  uint64_t min_limit;
+  uint64_t max_limit;
+  uint64_t limit;
+  uint64_t usage;  /**< as of the last round */
+  UsageFn get_usage;
+  LimitFn set_limit;  /**< NULL for fixed consumers */
+  uint64_t num_shrinks;
+};
+
+uint64_t budget_ = 0;
+vector<Consumer> *consumers_ = NULL;
+pthread_mutex_t lock_consumers_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_t thread_rebalance_;
+bool spawned_ = false;
+int pipe_terminate_[2];
+atomic_int64 num_rebalances_;
+atomic_int64 num_overcommits_;
+
+
+static void *MainRebalance(void *data __attribute__((unused))) {
+  LogCvmfs(kLogCvmfs, kLogDebug, "memory budget thread started");
+  struct pollfd watch;
+  watch.fd = pipe_terminate_[0];
+  watch.events = POLLIN;
+  while (true) {
+    watch.revents = 0;
+    if (poll(&watch, 1, kRebalanceInterval*1000) != 0)
+      break;
+    Rebalance();
+  }
+  LogCvmfs(kLogCvmfs, kLogDebug, "memory budget thread stopped");
+  return NULL;
+}
+
+
+/**
+ * @param[in] budget Total bytes for all consumers, 0 for no limit
+ */
+void Init(const uint64_t budget) {
+  budget_ = budget;
+  consumers_ = new vector<Consumer>();
+  atomic_init64(&num_rebalances_);
+  atomic_init64(&num_overcommits_);
+}
+
+
+/**
+ * Registers a cache that is sized by set_limit between min_limit and
+ * max_limit bytes.  The cache starts with max_limit.  The callbacks are
+ * called from the budget thread and have to do their own locking.
+ */
+void Register(const string &name, const Priorities priority,
+              const uint64_t min_limit, const uint64_t max_limit,
+              UsageFn get_usage, LimitFn set_limit)
+{
+  assert(consumers_ && (min_limit <= max_limit));
+  Consumer consumer;
+  consumer.name = name;
+  consumer.priority = priority;
+  consumer.min_limit = min_limit;
+  consumer.max_limit = max_limit;
+  consumer.limit = max_limit;
+  consumer.usage = 0;
+  consumer.get_usage = get_usage;
+  consumer.set_limit = set_limit;
+  consumer.num_shrinks = 0;
+  // Keep the order of priorities, highest first
+  pthread_mutex_lock(&lock_consumers_);
+  vector<Consumer>::iterator i = consumers_->begin();
+  while ((i != consumers_->end()) && (i->priority >= priority))
+    ++i;
+  consumers_->insert(i, consumer);
+  pthread_mutex_unlock(&lock_consumers_);
+}
+
+
+void RegisterFixed(const string &name, UsageFn get_usage) {
+  assert(consumers_);
+  Consumer consumer;
+  consumer.name = name;
+  consumer.priority = kPriorityHigh;
+  consumer.min_limit = consumer.max_limit = consumer.limit = 0;
+  consumer.usage = 0;
+  consumer.get_usage = get_usage;
+  consumer.set_limit = NULL;
+  consumer.num_shrinks = 0;
+  pthread_mutex_lock(&lock_consumers_);
+  consumers_->insert(consumers_->begin(), consumer);
+  pthread_mutex_unlock(&lock_consumers_);
+}
+
+
+/**
+ * Starts the rebalance thread, has to run after fork().  Without a budget,
+ * usage is collected on demand.
+ */
+void Spawn() {
+  if (budget_ == 0)
+    return;
+  MakePipe(pipe_terminate_);
+  int retval = pthread_create(&thread_rebalance_, NULL, MainRebalance, NULL);
+  assert(retval == 0);
+  spawned_ = true;
+}
+
+
+void Fini() {
+  if (spawned_) {
+    char c = 'T';
+    WritePipe(pipe_terminate_[1], &c, 1);
+    pthread_join(thread_rebalance_, NULL);
+    ClosePipe(pipe_terminate_);
+    spawned_ = false;
+  }
+  pthread_mutex_lock(&lock_consumers_);
+  delete consumers_;
+  consumers_ = NULL;
+  budget_ = 0;
+  pthread_mutex_unlock(&lock_consumers_);
+}
+
+
+/**
+ * Collects the usage and, if there is a budget, sets new limits.
+ */
+void Rebalance() {
+  pthread_mutex_lock(&lock_consumers_);
+  if (!consumers_) {
+    pthread_mutex_unlock(&lock_consumers_);
+    return;
+  }
+  int64_t remaining = budget_;
+  for (unsigned i = 0; i < consumers_->size(); ++i) {
+    Consumer *consumer = &(*consumers_)[i];
+    if (consumer->set_limit == NULL) {
+      consumer->usage = consumer->get_usage();
+      remaining -= consumer->usage;
+    }
+  }
+
+  for (unsigned i = 0; i < consumers_->size(); ++i) {
+    Consumer *consumer = &(*consumers_)[i];
+    if (consumer->set_limit == NULL)
+      continue;
+    if (budget_ > 0) {
+      uint64_t limit = (remaining > 0) ? remaining : 0;
+      if (limit < consumer->min_limit)
+        limit = consumer->min_limit;
+      if (limit > consumer->max_limit)
+        limit = consumer->max_limit;
+      if (limit != consumer->limit) {
+        if (limit < consumer->limit) {
+          consumer->num_shrinks++;
+          LogCvmfs(kLogCvmfs, kLogDebug,
+                   "memory budget: shrink %s to %"PRIu64" kB",
+                   consumer->name.c_str(), limit / 1024);
+        }
+        consumer->set_limit(limit);
+        consumer->limit = limit;
+      }
+    }
+    consumer->usage = consumer->get_usage();
+    remaining -= consumer->usage;
+  }
+
+  atomic_inc64(&num_rebalances_);
+  if ((budget_ > 0) && (remaining < 0))
+    atomic_inc64(&num_overcommits_);
+  pthread_mutex_unlock(&lock_consumers_);
+}
+
+
+string GetStatistics() {
+  if (budget_ == 0)
+    Rebalance();
+  string result;
+  uint64_t total = 0;
+  pthread_mutex_lock(&lock_consumers_);
+  if (!consumers_) {
+    pthread_mutex_unlock(&lock_consumers_);
+    return "  off\n";
+  }
+  for (unsigned i = 0; i < consumers_->size(); ++i) {
+    const Consumer &consumer = (*consumers_)[i];
+    total += consumer.usage;
+    result += "  " + consumer.name + ": " +
+      StringifyInt(consumer.usage / 1024) + " kB";
+    if (consumer.set_limit) {
+      result += " / " + StringifyInt(consumer.limit / 1024) + " kB  " +
+        "(priority " + StringifyInt(consumer.priority) + ", shrunk " +
+        StringifyInt(consumer.num_shrinks) + " times)";
+    } else {
+      result += "  (fixed)";
+    }
+    result += "\n";
+  }
+  const uint64_t budget = budget_;
+  pthread_mutex_unlock(&lock_consumers_);
+  return "  total: " + StringifyInt(total / 1024) + " kB / " +
+    ((budget > 0) ? StringifyInt(budget / 1024) + " kB" : "unlimited") +
+    "  rebalances: " + StringifyInt(atomic_read64(&num_rebalances_)) +
+    "  overcommits: " + StringifyInt(atomic_read64(&num_overcommits_)) +
+    "\n" + result;
+}
+
+
+void GetMetrics(MetricsWriter *metrics) {
+  if (budget_ == 0)
+    Rebalance();
+  pthread_mutex_lock(&lock_consumers_);
+  if (!consumers_) {
+    pthread_mutex_unlock(&lock_consumers_);
+    return;
+  }
+  metrics->Gauge("memory_budget_bytes", "Memory budget of the caches, 0 is off",
+                 budget_);
+  metrics->Counter("memory_budget_overcommits_total",
+                   "Rebalance rounds that ended above the memory budget",
+                   atomic_read64(&num_overcommits_));
+  for (unsigned i = 0; i < consumers_->size(); ++i) {
+    const Consumer &consumer = (*consumers_)[i];
+    metrics->Gauge("memory_usage_bytes", "Memory used by a consumer",
+                   consumer.usage,
+                   MetricsWriter::Label("consumer", consumer.name));
+  }
+  for (unsigned i = 0; i < consumers_->size(); ++i) {
+    const Consumer &consumer = (*consumers_)[i];
+    if (consumer.set_limit == NULL)
+      continue;
+    metrics->Gauge("memory_limit_bytes", "Current memory limit of a consumer",
+                   consumer.limit,
+                   MetricsWriter::Label("consumer", consumer.name));
+  }
+  pthread_mutex_unlock(&lock_consumers_);
+}
+
+}  // namespace memory_budget
@@ -0,0 +1,42 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_MEMORY_BUDGET_H_
+#define CVMFS_MEMORY_BUDGET_H_
+
+#include <stdint.h>
+
+#include <string>
+
+class MetricsWriter;
+
+namespace memory_budget {
+
+/**
+ * Consumers of lower priority give up their memory first.
+ */
+enum Priorities {
+  kPriorityLow = 0,
+  kPriorityMedium,
+  kPriorityHigh,
+};
+
+typedef uint64_t (*UsageFn)();
+typedef void (*LimitFn)(const uint64_t limit);
+
+void Init(const uint64_t budget);
+void Register(const std::string &name, const Priorities priority,
+              const uint64_t min_limit, const uint64_t max_limit,
+              UsageFn get_usage, LimitFn set_limit);
+void RegisterFixed(const std::string &name, UsageFn get_usage);
+void Spawn();
+void Fini();
+
+void Rebalance();
+std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
+
+}  // namespace memory_budget
+
+#endif  // CVMFS_MEMORY_BUDGET_H_
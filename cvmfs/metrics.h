@@ -0,0 +1,117 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Writes counters, gauges and latency histograms in the Prometheus text
+ * exposition format, for the "metrics" talk command.  All metric names are
+ * prefixed by cvmfs_ and all samples carry the common labels, usually the
+ * repository name.  Samples of the same metric have to be written one after
+ * another.  Only atomic reads and string concatenation are involved, so that
+ * the metrics can be scraped every few seconds.
+ */
+
+#ifndef CVMFS_METRICS_H_
+#define CVMFS_METRICS_H_
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <string>
+
+#include "histogram.h"
+#include "util.h"
+
+class MetricsWriter {
+ public:
+  explicit MetricsWriter(const std::string &common_labels) :
+    common_labels_(common_labels) { }
+
+  /**
+   * Escapes a label value, labels are given as name="value" lists.
+   */
+  static std::string Label(const std::string &name, const std::string &value) {
+    std::string escaped;
+    for (unsigned i = 0; i < value.length(); ++i) {
+      if (value[i] == '\n') {
+        escaped += "\\n";
+        continue;
+      }
+      if ((value[i] == '\\') || (value[i] == '"'))
+        escaped.push_back('\\');
+      escaped.push_back(value[i]);
+    }
+    return name + "=\"" + escaped + "\"";
+  }
+
+  void Counter(const std::string &name, const std::string &help,
+               const int64_t value, const std::string &labels = "")
+  {
+    Header(name, help, "counter");
+    Sample(name, labels, StringifyInt(value));
+  }
+
+  void Gauge(const std::string &name, const std::string &help,
+             const int64_t value, const std::string &labels = "")
+  {
+    Header(name, help, "gauge");
+    Sample(name, labels, StringifyInt(value));
+  }
+
+  /**
+   * A Log2Histogram as a Prometheus histogram in seconds.  The bins become
+   * cumulative buckets, the last bin the +Inf bucket.
+   */
+  void Histogram(const std::string &name, const std::string &help,
+                 Log2Histogram *histogram, const std::string &labels = "")
+  {
+    uint64_t bins[Log2Histogram::kNumBins];
+    uint64_t sum_us;
+    histogram->Snapshot(bins, &sum_us);
+    Header(name, help, "histogram");
+    const std::string separator = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    char bound[32];
+    for (unsigned i = 0; i < Log2Histogram::kNumBins; ++i) {
+      cumulative += bins[i];
+      if (i + 1 < Log2Histogram::kNumBins)
+        snprintf(bound, sizeof(bound), "%g", double(uint64_t(2) << i) / 1e6);
+      else
+        snprintf(bound, sizeof(bound), "+Inf");
+      Sample(name + "_bucket", labels + separator + "le=\"" + bound + "\"",
+             StringifyInt(cumulative));
+    }
+    snprintf(bound, sizeof(bound), "%.6f", double(sum_us) / 1e6);
+    Sample(name + "_sum", labels, bound);
+    Sample(name + "_count", labels, StringifyInt(cumulative));
+  }
+
+  const std::string &output() const { return output_; }
+
+ private:
+  void Header(const std::string &name, const std::string &help,
+              const std::string &type)
+  {
+    if (name == last_name_)
+      return;
+    last_name_ = name;
+    output_ += "# HELP cvmfs_" + name + " " + help + "\n";
+    output_ += "# TYPE cvmfs_" + name + " " + type + "\n";
+  }
+
+  void Sample(const std::string &name, const std::string &labels,
+              const std::string &value)
+  {
+    std::string all_labels = common_labels_;
+    if (!labels.empty())
+      all_labels += (all_labels.empty() ? "" : ",") + labels;
+    output_ += "cvmfs_" + name;
+    if (!all_labels.empty())
+      output_ += "{" + all_labels + "}";
+    output_ += " " + value + "\n";
+  }
+
+  std::string common_labels_;
+  std::string last_name_;
+  std::string output_;
+};
+
+#endif  // CVMFS_METRICS_H_
@@ -6,6 +6,11 @@
  * fails.
  *
  * Also, it handles getting and setting the maximum number of file descriptors.
+ *
+ * On request, it samples the stacks of all threads of the running process
+ * (talk command "stacks sample").  If a stall threshold is set, a detector
+ * thread dumps the stacks of all threads into the stacktrace file when a Fuse
+ * request is outstanding for longer than the threshold.
  */
 
 #include "cvmfs_config.h"
@@ -26,8 +31,16 @@
 #include <sys/wait.h>
 #include <pthread.h>
 #include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#ifndef __APPLE__
+  #include <sys/syscall.h>
+#endif
 
 #include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
 
 #include <cstring>
 #include <cstdio>
@@ -37,6 +50,7 @@
 #include "platform.h"
 #include "util.h"
 #include "logging.h"
+#include "atomic.h"
 
 using namespace std;  // NOLINT
 
@@ -52,6 +66,49 @@ unsigned max_open_files_;
 int pipe_wd_[2];
 platform_spinlock lock_handler_;
 
+const unsigned kSampleRateHz = 50;  /**< stack samples per thread and second */
+const unsigned kMaxSampleSeconds = 60;
+const unsigned kSampleTimeoutMs = 100;  /**< threads might block signals */
+const unsigned kMaxRequestSlots = 512;  /**< more threads are not tracked */
+const unsigned kStallCheckIntervalMs = 1000;
+const unsigned kMinStallDumpInterval = 60;  /**< seconds between two dumps */
+
+/**
+ * One stack captured by the SIGPROF handler.  A sample is armed with the
+ * kernel thread id of the target.  The handler of that thread claims it by
+ * swapping the thread id with -1 and sets done after the frames are written.
+ * A sampler that gives up resets the armed thread id back to 0, so that late
+ * handlers cannot overwrite the next sample.
+ */
+struct StackSample {
+  atomic_int32 armed_tid;
+  atomic_int32 done;
+  int depth;
+  void *frames[kMaxBacktrace];
+};
+StackSample sample_;
+pthread_mutex_t lock_sample_ = PTHREAD_MUTEX_INITIALIZER;
+bool sample_handler_installed_ = false;
+
+/**
+ * The Fuse request a thread is currently working on.  Slots are bound to
+ * threads by a thread specific key and released when the thread exits.
+ */
+struct RequestSlot {
+  atomic_int32 in_use;
+  atomic_int64 start_us;  /**< 0 if the thread is idle */
+  int tid;
+  const char *call;
+  int64_t reported_us;  /**< start of the last stall that was dumped */
+};
+RequestSlot *request_slots_ = NULL;
+pthread_key_t key_request_slot_;
+uint64_t stall_threshold_us_ = 0;  /**< 0 switches off the stall detector */
+atomic_int64 num_stalls_;
+pthread_t thread_stall_detector_;
+int pipe_stall_detector_[2];
+bool spawned_stall_detector_ = false;
+
 
 /**
  * Get the instruction pointer in a platform independant fashion.
@@ -217,9 +274,334 @@ static void Watchdog() {
 }
 
 
+/**
+ * Kernel thread id, as listed in /proc/self/task.
+ */
+static int GetThreadId() {
+#ifdef __APPLE__
+  return 0;
+#else
+  return syscall(SYS_gettid);
+#endif
+}
+
+
+/**
+ * SIGPROF handler, captures the stack of the interrupted thread.
+ */
+static void SampleStack(int signal __attribute__((unused)),
+                        siginfo_t *siginfo __attribute__((unused)),
+                        void *context)
+{
+  const int save_errno = errno;
+  void *adr_buf[kMaxBacktrace];
+  const int stack_size = backtrace(adr_buf, kMaxBacktrace);
+  // Skip the handler and the signal trampoline.  If the unwinder did not
+  // make it through the trampoline, start with the interrupted instruction.
+  int skip = 2;
+  void *ip = GetInstructionPointer(reinterpret_cast<ucontext_t *>(context));
+  if ((stack_size > 1) && ((stack_size == 2) || (adr_buf[2] != ip))) {
+    adr_buf[1] = ip;
+    skip = 1;
+  }
+  if (atomic_cas32(&sample_.armed_tid, GetThreadId(), -1)) {
+    sample_.depth = (stack_size > skip) ? stack_size - skip : 0;
+    memcpy(sample_.frames, adr_buf + skip, sample_.depth * sizeof(void *));
+    atomic_write32(&sample_.done, 1);
+  }
+  errno = save_errno;
+}
+
+
+/**
+ * Lists the kernel thread ids of this process, except for the calling thread.
+ */
+static vector<int> ListThreads() {
+  vector<int> result;
+#ifndef __APPLE__
+  const int self = GetThreadId();
+  DIR *dirp = opendir("/proc/self/task");
+  if (!dirp)
+    return result;
+  platform_dirent64 *dirent;
+  while ((dirent = platform_readdir(dirp))) {
+    const int tid = atoi(dirent->d_name);
+    if ((tid > 0) && (tid != self))
+      result.push_back(tid);
+  }
+  closedir(dirp);
+  sort(result.begin(), result.end());
+#endif
+  return result;
+}
+
+
+/**
+ * Interrupts thread tid and captures its stack.  Has to be called with
+ * lock_sample_ held.
+ *
+ * \return false if the thread did not respond in time
+ */
+static bool CaptureStack(const int tid, vector<void *> *frames) {
+#ifdef __APPLE__
+  return false;
+#else
+  if (!sample_handler_installed_) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = SampleStack;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0)
+      return false;
+    sample_handler_installed_ = true;
+  }
+
+  atomic_write32(&sample_.done, 0);
+  atomic_write32(&sample_.armed_tid, tid);
+  if (syscall(SYS_tgkill, getpid(), tid, SIGPROF) != 0) {
+    atomic_write32(&sample_.armed_tid, 0);
+    return false;
+  }
+  for (unsigned waited_us = 0; !atomic_read32(&sample_.done);
+       waited_us += 100)
+  {
+    if ((waited_us >= kSampleTimeoutMs*1000) &&
+        atomic_cas32(&sample_.armed_tid, tid, 0))
+    {
+      return false;
+    }
+    usleep(100);
+  }
+  frames->assign(sample_.frames, sample_.frames + sample_.depth);
+  return true;
+#endif
+}
+
+
+/**
+ * Resolves a captured stack into one line per frame.
+ */
+static string SymbolizeStack(const vector<void *> &frames,
+                             const string &indent)
+{
+  string result;
+  if (frames.empty())
+    return indent + "(no frames)\n";
+  char **symbols = backtrace_symbols(const_cast<void **>(&frames[0]),
+                                     frames.size());
+  for (unsigned i = 0; i < frames.size(); ++i) {
+    result += indent;
+    if (symbols) {
+      result += symbols[i];
+    } else {
+      char address[32];
+      snprintf(address, sizeof(address), "%p", frames[i]);
+      result += address;
+    }
+    result += "\n";
+  }
+  free(symbols);
+  return result;
+}
+
+
+/**
+ * Captures one stack of every thread in the process.
+ */
+static string DumpAllStacks() {
+  string result;
+  pthread_mutex_lock(&lock_sample_);
+  const vector<int> threads = ListThreads();
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    vector<void *> frames;
+    result += "Thread " + StringifyInt(threads[i]) + ":\n";
+    if (CaptureStack(threads[i], &frames))
+      result += SymbolizeStack(frames, "  ");
+    else
+      result += "  (no response)\n";
+  }
+  pthread_mutex_unlock(&lock_sample_);
+  return result;
+}
+
+
+/**
+ * Samples the stacks of all threads kSampleRateHz times a second for
+ * duration_s seconds.  Identical stacks are aggregated and listed by their
+ * number of occurrences.  Idle threads typically show up with a stack that
+ * ends in a blocking system call.  Sleeps and polls that are interrupted by
+ * the sampling signal return early, the callers in cvmfs retry.
+ */
+string SampleStacks(const unsigned duration_s) {
+#ifdef __APPLE__
+  return "stack sampling is not supported on this platform\n";
+#else
+  const unsigned seconds = std::min(std::max(duration_s, 1U),
+                                    kMaxSampleSeconds);
+  map<vector<void *>, unsigned> stacks;
+  unsigned num_samples = 0;
+  unsigned num_failed = 0;
+  unsigned max_threads = 0;
+
+  pthread_mutex_lock(&lock_sample_);
+  for (unsigned round = 0; round < seconds * kSampleRateHz; ++round) {
+    const vector<int> threads = ListThreads();
+    max_threads = std::max(max_threads, unsigned(threads.size()));
+    for (unsigned i = 0; i < threads.size(); ++i) {
+      vector<void *> frames;
+      if (CaptureStack(threads[i], &frames)) {
+        stacks[frames]++;
+        num_samples++;
+      } else {
+        num_failed++;
+      }
+    }
+    usleep(1000000 / kSampleRateHz);
+  }
+  pthread_mutex_unlock(&lock_sample_);
+
+  vector< pair<unsigned, vector<void *> > > sorted;
+  for (map<vector<void *>, unsigned>::const_iterator i = stacks.begin(),
+       iEnd = stacks.end(); i != iEnd; ++i)
+  {
+    sorted.push_back(make_pair(i->second, i->first));
+  }
+  sort(sorted.rbegin(), sorted.rend());
+
+  string result = StringifyInt(num_samples) + " samples of " +
+    StringifyInt(max_threads) + " threads in " + StringifyInt(seconds) +
+    "s, " + StringifyInt(num_failed) + " failed, " +
+    StringifyInt(sorted.size()) + " distinct stacks\n";
+  for (unsigned i = 0; i < sorted.size(); ++i) {
+    result += "\n" + StringifyInt(sorted[i].first) + " samples (" +
+      StringifyInt(uint64_t(sorted[i].first) * 100 / num_samples) + "%)\n";
+    result += SymbolizeStack(sorted[i].second, "  ");
+  }
+  return result;
+#endif
+}
+
+
+static void ReleaseRequestSlot(void *data) {
+  RequestSlot *slot = reinterpret_cast<RequestSlot *>(data);
+  atomic_write64(&slot->start_us, 0);
+  atomic_write32(&slot->in_use, 0);
+}
+
+
+static RequestSlot *GetRequestSlot() {
+  RequestSlot *slot =
+    reinterpret_cast<RequestSlot *>(pthread_getspecific(key_request_slot_));
+  if (slot)
+    return slot;
+  for (unsigned i = 0; i < kMaxRequestSlots; ++i) {
+    if (atomic_cas32(&request_slots_[i].in_use, 0, 1)) {
+      slot = &request_slots_[i];
+      slot->tid = GetThreadId();
+      slot->reported_us = 0;
+      pthread_setspecific(key_request_slot_, slot);
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * Marks the calling thread as busy with a Fuse request.  Call has to be a
+ * string literal.
+ */
+void RequestStarted(const char *call, const uint64_t start_us) {
+  if (!spawned_stall_detector_)
+    return;
+  RequestSlot *slot = GetRequestSlot();
+  if (!slot)
+    return;
+  slot->call = call;
+  atomic_write64(&slot->start_us, start_us);
+}
+
+
+void RequestFinished() {
+  if (!spawned_stall_detector_)
+    return;
+  RequestSlot *slot =
+    reinterpret_cast<RequestSlot *>(pthread_getspecific(key_request_slot_));
+  if (slot)
+    atomic_write64(&slot->start_us, 0);
+}
+
+
+/**
+ * Checks once a second for requests that are outstanding for longer than the
+ * threshold.  Every stalled request triggers at most one dump and there is
+ * at most one dump per kMinStallDumpInterval.
+ */
+static void *MainStallDetector(void *data __attribute__((unused))) {
+  LogCvmfs(kLogMonitor, kLogDebug, "stall detector started");
+  uint64_t last_dump_us = 0;
+  struct pollfd watch_terminate;
+  watch_terminate.fd = pipe_stall_detector_[0];
+  watch_terminate.events = POLLIN;
+  while (true) {
+    watch_terminate.revents = 0;
+    if (poll(&watch_terminate, 1, kStallCheckIntervalMs) > 0)
+      break;
+
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    const uint64_t now_us = uint64_t(tv_now.tv_sec)*1000000 + tv_now.tv_usec;
+    string stalled;
+    for (unsigned i = 0; i < kMaxRequestSlots; ++i) {
+      RequestSlot *slot = &request_slots_[i];
+      if (!atomic_read32(&slot->in_use))
+        continue;
+      const int64_t start_us = atomic_read64(&slot->start_us);
+      if ((start_us == 0) || (start_us == slot->reported_us) ||
+          (now_us < uint64_t(start_us) + stall_threshold_us_))
+      {
+        continue;
+      }
+      slot->reported_us = start_us;
+      stalled += "Fuse request " + string(slot->call) + " on thread " +
+        StringifyInt(slot->tid) + " outstanding for " +
+        StringifyInt((now_us - start_us) / 1000) + "ms\n";
+      atomic_inc64(&num_stalls_);
+    }
+    if (stalled.empty() ||
+        (now_us < last_dump_us + uint64_t(kMinStallDumpInterval)*1000000))
+    {
+      continue;
+    }
+    last_dump_us = now_us;
+    LogEmergency("--\nStall detected, version: " + string(VERSION) + "\n" +
+                 stalled + DumpAllStacks());
+  }
+  LogCvmfs(kLogMonitor, kLogDebug, "stall detector stopped");
+  return NULL;
+}
+
+
+/**
+ * Has to be called before Spawn().  Zero switches off the stall detector.
+ */
+void SetStallThreshold(const unsigned threshold_s) {
+  stall_threshold_us_ = uint64_t(threshold_s) * 1000000;
+}
+
+
+int64_t GetNumStalls() {
+  return atomic_read64(&num_stalls_);
+}
+
+
 bool Init(const string cache_dir, const bool check_max_open_files) {
   monitor::cache_dir_ = new string(cache_dir);
   if (platform_spinlock_init(&lock_handler_, 0) != 0) return false;
+  atomic_init32(&sample_.armed_tid);
+  atomic_init32(&sample_.done);
+  atomic_init64(&num_stalls_);
 
   /* check number of open files */
   if (check_max_open_files) {
@@ -264,6 +646,16 @@ bool Init(const string cache_dir, const bool check_max_open_files) {
 
 
 void Fini() {
+  if (spawned_stall_detector_) {
+    char quit = 'Q';
+    WritePipe(pipe_stall_detector_[1], &quit, 1);
+    pthread_join(thread_stall_detector_, NULL);
+    ClosePipe(pipe_stall_detector_);
+    spawned_stall_detector_ = false;
+    pthread_key_delete(key_request_slot_);
+    delete[] request_slots_;
+    request_slots_ = NULL;
+  }
   delete cache_dir_;
   cache_dir_ = NULL;
   if (spawned_) {
@@ -321,6 +713,21 @@ void Spawn() {
     abort();
   }
   spawned_ = true;
+
+  if (stall_threshold_us_ > 0) {
+    request_slots_ = new RequestSlot[kMaxRequestSlots];
+    for (unsigned i = 0; i < kMaxRequestSlots; ++i) {
+      atomic_init32(&request_slots_[i].in_use);
+      atomic_init64(&request_slots_[i].start_us);
+    }
+    int retval = pthread_key_create(&key_request_slot_, ReleaseRequestSlot);
+    assert(retval == 0);
+    MakePipe(pipe_stall_detector_);
+    retval = pthread_create(&thread_stall_detector_, NULL, MainStallDetector,
+                            NULL);
+    assert(retval == 0);
+    spawned_stall_detector_ = true;
+  }
 }
 
 unsigned GetMaxOpenFiles() {
@@ -5,6 +5,8 @@
 #ifndef CVMFS_MONITOR_H_
 #define CVMFS_MONITOR_H_
 
+#include <stdint.h>
+
 #include <string>
 
 namespace monitor {
@@ -15,6 +17,12 @@ void Spawn();
 
 unsigned GetMaxOpenFiles();
 
+std::string SampleStacks(const unsigned duration_s);
+void SetStallThreshold(const unsigned threshold_s);
+void RequestStarted(const char *call, const uint64_t start_us);
+void RequestFinished();
+int64_t GetNumStalls();
+
 }  // namespace monitor
 
 #endif  // CVMFS_MONITOR_H_
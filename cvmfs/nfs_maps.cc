@@ -12,6 +12,13 @@
  * cvmfs restarts.  Also, leveldb allows for restricting the memory consumption.
  *
  * The maps are not accounted for by the cache quota.
+ *
+ * Small LRU caches in front of both maps answer repeated lookups without going
+ * to leveldb.  New inodes are written by group commit: the writer that finds
+ * no commit running writes the entries of all the writers that queued up in
+ * the meantime in one leveldb batch per map.  Writers return only after their
+ * entries are written, so that an inode is never handed out before it is
+ * stored.
  */
 
 #define __STDC_FORMAT_MACROS
@@ -25,13 +32,20 @@
 #include <cassert>
 #include <cstdlib>
 
+#include <map>
+#include <vector>
+
 #include "leveldb/db.h"
 #include "leveldb/cache.h"
 #include "leveldb/filter_policy.h"
 #include "leveldb/env.h"
+#include "leveldb/write_batch.h"
 
 #include "logging.h"
 #include "util.h"
+#include "lru.h"
+#include "atomic.h"
+#include "metrics.h"
 
 using namespace std;  // NOLINT
 
@@ -50,6 +64,31 @@ uint64_t seq_;
 pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
 bool spawned_ = false;  // Set to true after fork()
 
+// Tuning, set before Init()
+unsigned leveldb_cache_mb_ = 40;  /**< 4/5 for inode2path, 1/5 for path2inode */
+unsigned bloom_bits_ = 10;  /**< Per key, 0 switches the filters off */
+unsigned front_cache_size_ = 64*1024;  /**< Entries per map, 0 is off */
+
+typedef lru::ShardedLruCache<hash::Md5, uint64_t> InodeFrontCache;
+InodeFrontCache *front_path2inode_ = NULL;
+lru::PathCache *front_inode2path_ = NULL;
+
+// Group commit, protected by lock_
+/**
+ * New inodes that are not yet committed, i.e. they are in the open batch or
+ * in the batch that is currently written.
+ */
+map<hash::Md5, uint64_t> *pending_inodes_ = NULL;
+leveldb::WriteBatch *batch_path2inode_ = NULL;
+leveldb::WriteBatch *batch_inode2path_ = NULL;
+vector<hash::Md5> *batch_paths_ = NULL;  /**< Paths in the open batch */
+uint64_t batch_generation_ = 0;  /**< Generation of the open batch */
+uint64_t committed_generation_ = 0;
+bool committing_ = false;
+pthread_cond_t cond_committed_ = PTHREAD_COND_INITIALIZER;
+atomic_int64 num_commits_;
+atomic_int64 num_committed_inodes_;
+
 
 // Leveldb's background threads must not be started before cvmfs has forked.
 // Before forking, we run the processes in specially created threads.
@@ -133,20 +172,77 @@ static void PutPath2Inode(const hash::Md5 &path, const uint64_t inode) {
 }
 
 
-static void PutInode2Path(const uint64_t inode, const PathString &path) {
-  leveldb::Status status;
-  leveldb::Slice key(reinterpret_cast<const char *>(&inode), sizeof(inode));
-  leveldb::Slice value(path.GetChars(), path.GetLength());
+/**
+ * Writes the open batch and hands out the next one.  Caller holds lock_, which
+ * is released while leveldb writes.
+ */
+static void CommitBatch() {
+  committing_ = true;
+  leveldb::WriteBatch *batch_path2inode = batch_path2inode_;
+  leveldb::WriteBatch *batch_inode2path = batch_inode2path_;
+  vector<hash::Md5> *batch_paths = batch_paths_;
+  const uint64_t generation = batch_generation_;
+  batch_path2inode_ = new leveldb::WriteBatch();
+  batch_inode2path_ = new leveldb::WriteBatch();
+  batch_paths_ = new vector<hash::Md5>();
+  batch_generation_++;
+  pthread_mutex_unlock(&lock_);
 
-  status = db_inode2path_->Put(leveldb_write_options_, key, value);
+  // Inode --> path first, a path that has an inode can always be resolved
+  leveldb::Status status =
+    db_inode2path_->Write(leveldb_write_options_, batch_inode2path);
+  if (status.ok())
+    status = db_path2inode_->Write(leveldb_write_options_, batch_path2inode);
   if (!status.ok()) {
     LogCvmfs(kLogNfsMaps, kLogSyslog,
-             "failed to write inode2path entry (%"PRIu64" --> %s): %s",
-             inode, path.c_str(), status.ToString().c_str());
+             "failed to write batch of %u NFS map entries: %s",
+             batch_paths->size(), status.ToString().c_str());
     abort();
   }
-  LogCvmfs(kLogNfsMaps, kLogDebug, "stored inode %"PRIu64" --> path %s",
-           inode, path.c_str());
+  atomic_inc64(&num_commits_);
+  atomic_xadd64(&num_committed_inodes_, batch_paths->size());
+  LogCvmfs(kLogNfsMaps, kLogDebug, "committed %u new inodes",
+           batch_paths->size());
+
+  pthread_mutex_lock(&lock_);
+  for (unsigned i = 0; i < batch_paths->size(); ++i)
+    pending_inodes_->erase((*batch_paths)[i]);
+  committed_generation_ = generation;
+  committing_ = false;
+  pthread_cond_broadcast(&cond_committed_);
+  delete batch_path2inode;
+  delete batch_inode2path;
+  delete batch_paths;
+}
+
+
+/**
+ * Queues the new mappings into the open batch and waits until they are
+ * committed, committing the batch itself if nobody else does.  Caller holds
+ * lock_.
+ */
+static void StoreInode(const hash::Md5 &path_md5, const PathString &path,
+                       const uint64_t inode)
+{
+  batch_path2inode_->Put(
+    leveldb::Slice(reinterpret_cast<const char *>(path_md5.digest),
+                   path_md5.GetDigestSize()),
+    leveldb::Slice(reinterpret_cast<const char *>(&inode), sizeof(inode)));
+  batch_inode2path_->Put(
+    leveldb::Slice(reinterpret_cast<const char *>(&inode), sizeof(inode)),
+    leveldb::Slice(path.GetChars(), path.GetLength()));
+  batch_paths_->push_back(path_md5);
+  (*pending_inodes_)[path_md5] = inode;
+  LogCvmfs(kLogNfsMaps, kLogDebug, "queued path %s --> inode %"PRIu64,
+           path.c_str(), inode);
+
+  const uint64_t generation = batch_generation_;
+  while (committed_generation_ < generation) {
+    if (committing_)
+      pthread_cond_wait(&cond_committed_, &lock_);
+    else
+      CommitBatch();
+  }
 }
 
 
@@ -185,12 +281,31 @@ static uint64_t FindInode(const hash::Md5 &path) {
  */
 uint64_t GetInode(const PathString &path) {
   const hash::Md5 md5_path(path.GetChars(), path.GetLength());
-  uint64_t inode = FindInode(md5_path);
-  if (inode != 0)
+  uint64_t inode;
+  if (front_path2inode_ && front_path2inode_->Lookup(md5_path, &inode))
+    return inode;
+  inode = FindInode(md5_path);
+  if (inode != 0) {
+    if (front_path2inode_)
+      front_path2inode_->Insert(md5_path, inode);
     return inode;
+  }
 
   pthread_mutex_lock(&lock_);
-  // Search again to avoid race
+  // Search again to avoid race, the inode might wait for its commit
+  map<hash::Md5, uint64_t>::const_iterator iter =
+    pending_inodes_->find(md5_path);
+  if (iter != pending_inodes_->end()) {
+    inode = iter->second;
+    while (pending_inodes_->find(md5_path) != pending_inodes_->end()) {
+      if (committing_)
+        pthread_cond_wait(&cond_committed_, &lock_);
+      else
+        CommitBatch();
+    }
+    pthread_mutex_unlock(&lock_);
+    return inode;
+  }
   inode = FindInode(md5_path);
   if (inode != 0) {
     pthread_mutex_unlock(&lock_);
@@ -199,10 +314,13 @@ uint64_t GetInode(const PathString &path) {
 
   // Issue new inode
   inode = seq_++;
-  PutPath2Inode(md5_path, inode);
-  PutInode2Path(inode, path);
+  StoreInode(md5_path, path, inode);
   pthread_mutex_unlock(&lock_);
 
+  if (front_path2inode_) {
+    front_path2inode_->Insert(md5_path, inode);
+    front_inode2path_->Insert(inode, path);
+  }
   return inode;
 }
 
@@ -214,6 +332,9 @@ uint64_t GetInode(const PathString &path) {
  * \return false if not found
  */
 bool GetPath(const uint64_t inode, PathString *path) {
+  if (front_inode2path_ && front_inode2path_->Lookup(inode, path))
+    return true;
+
   leveldb::Status status;
   leveldb::Slice key(reinterpret_cast<const char *>(&inode), sizeof(inode));
   string result;
@@ -235,13 +356,49 @@ bool GetPath(const uint64_t inode, PathString *path) {
   path->Assign(result.data(), result.length());
   LogCvmfs(kLogNfsMaps, kLogDebug, "inode %"PRIu64" maps to path %s",
            inode, path->c_str());
+  if (front_inode2path_)
+    front_inode2path_->Insert(inode, *path);
   return true;
 }
 
 
+static string PrintHitRate(lru::Statistics statistics) {
+  const int64_t num_hits = statistics.num_hit.Get();
+  const int64_t num_lookups = num_hits + statistics.num_miss.Get();
+  return StringifyInt(num_hits) + "/" + StringifyInt(num_lookups) + " hits" +
+    (num_lookups ? " (" + StringifyInt(num_hits * 100 / num_lookups) + "%)" :
+     "");
+}
+
+
+/**
+ * Sets the leveldb block cache of both maps, leveldb's bloom filter bits per
+ * key, and the number of entries of the front caches.  Zero keeps the
+ * default.  Only effective before Init().
+ */
+void SetTuning(const unsigned leveldb_cache_mb, const unsigned bloom_bits,
+               const unsigned front_cache_size)
+{
+  if (leveldb_cache_mb > 0) leveldb_cache_mb_ = leveldb_cache_mb;
+  if (bloom_bits > 0) bloom_bits_ = bloom_bits;
+  if (front_cache_size > 0) front_cache_size_ = front_cache_size;
+}
+
+
 string GetStatistics() {
   string result = "Total number of issued inodes: " +
                   StringifyInt(seq_-root_inode_) + "\n";
+  result += "Group commits: " + StringifyInt(atomic_read64(&num_commits_)) +
+    " with " + StringifyInt(atomic_read64(&num_committed_inodes_)) +
+    " new inodes\n";
+  if (front_path2inode_) {
+    result += "Front cache path --> inode: " +
+      PrintHitRate(front_path2inode_->statistics()) + "\n";
+    result += "Front cache inode --> path: " +
+      PrintHitRate(front_inode2path_->statistics()) + "\n";
+  } else {
+    result += "Front caches: disabled\n";
+  }
 
   string stats;
   db_inode2path_->GetProperty(leveldb::Slice("leveldb.stats"), &stats);
@@ -254,6 +411,33 @@ string GetStatistics() {
 }
 
 
+void GetMetrics(MetricsWriter *metrics) {
+  metrics->Counter("nfs_maps_inodes_total", "Issued inodes",
+                   seq_ - root_inode_);
+  metrics->Counter("nfs_maps_commits_total", "Group commits",
+                   atomic_read64(&num_commits_));
+  metrics->Counter("nfs_maps_committed_inodes_total",
+                   "New inodes written by group commits",
+                   atomic_read64(&num_committed_inodes_));
+  if (!front_path2inode_)
+    return;
+  lru::Statistics stats[2] =
+    { front_path2inode_->statistics(), front_inode2path_->statistics() };
+  const char *names[2] = { "path2inode", "inode2path" };
+  for (unsigned i = 0; i < 2; ++i) {
+    metrics->Counter("nfs_maps_front_hits_total", "Hits of the front caches",
+                     stats[i].num_hit.Get(),
+                     MetricsWriter::Label("map", names[i]));
+  }
+  for (unsigned i = 0; i < 2; ++i) {
+    metrics->Counter("nfs_maps_front_misses_total",
+                     "Misses of the front caches",
+                     stats[i].num_miss.Get(),
+                     MetricsWriter::Label("map", names[i]));
+  }
+}
+
+
 bool Init(const string &leveldb_dir, const uint64_t root_inode,
           const bool rebuild)
 {
@@ -278,9 +462,11 @@ bool Init(const string &leveldb_dir, const uint64_t root_inode,
   }
 
   // Open databases
-  cache_inode2path_ = leveldb::NewLRUCache(32 * 1024*1024);
+  const uint64_t leveldb_cache_size = uint64_t(leveldb_cache_mb_)*1024*1024;
+  cache_inode2path_ = leveldb::NewLRUCache(leveldb_cache_size / 5 * 4);
   leveldb_options.block_cache = cache_inode2path_;
-  filter_inode2path_ = leveldb::NewBloomFilterPolicy(10);
+  if (bloom_bits_ > 0)
+    filter_inode2path_ = leveldb::NewBloomFilterPolicy(bloom_bits_);
   leveldb_options.filter_policy = filter_inode2path_;
   status = leveldb::DB::Open(leveldb_options, leveldb_dir + "/inode2path",
                              &db_inode2path_);
@@ -295,9 +481,10 @@ bool Init(const string &leveldb_dir, const uint64_t root_inode,
   leveldb_options.compression = leveldb::kNoCompression;
   // Random order, small block size to not trash caches
   leveldb_options.block_size = 512;
-  cache_path2inode_ = leveldb::NewLRUCache(8 * 1024*1024);
+  cache_path2inode_ = leveldb::NewLRUCache(leveldb_cache_size / 5);
   leveldb_options.block_cache = cache_path2inode_;
-  filter_path2inode_ = leveldb::NewBloomFilterPolicy(10);
+  if (bloom_bits_ > 0)
+    filter_path2inode_ = leveldb::NewBloomFilterPolicy(bloom_bits_);
   leveldb_options.filter_policy = filter_path2inode_;
   status = leveldb::DB::Open(leveldb_options, leveldb_dir + "/path2inode",
                              &db_path2inode_);
@@ -308,6 +495,20 @@ bool Init(const string &leveldb_dir, const uint64_t root_inode,
   }
   LogCvmfs(kLogNfsMaps, kLogDebug, "path2inode opened");
 
+  pending_inodes_ = new map<hash::Md5, uint64_t>();
+  batch_path2inode_ = new leveldb::WriteBatch();
+  batch_inode2path_ = new leveldb::WriteBatch();
+  batch_paths_ = new vector<hash::Md5>();
+  batch_generation_ = 1;
+  committed_generation_ = 0;
+  atomic_init64(&num_commits_);
+  atomic_init64(&num_committed_inodes_);
+  if (front_cache_size_ > 0) {
+    front_path2inode_ = new InodeFrontCache(front_cache_size_,
+      hash::Md5(hash::AsciiPtr("!")), lru::hasher_md5, lru::kReplaceLru);
+    front_inode2path_ = new lru::PathCache(front_cache_size_);
+  }
+
   // Fetch highest issued inode
   seq_ = FindInode(hash::Md5(hash::AsciiPtr("?seq")));
   LogCvmfs(kLogNfsMaps, kLogDebug, "Sequence number is %"PRIu64, seq_);
@@ -345,6 +546,18 @@ void Fini() {
   delete filter_inode2path_;
   LogCvmfs(kLogNfsMaps, kLogDebug, "inode2path closed");
   delete fork_aware_env_;
+  delete front_path2inode_;
+  delete front_inode2path_;
+  delete pending_inodes_;
+  delete batch_path2inode_;
+  delete batch_inode2path_;
+  delete batch_paths_;
+  front_path2inode_ = NULL;
+  front_inode2path_ = NULL;
+  pending_inodes_ = NULL;
+  batch_path2inode_ = NULL;
+  batch_inode2path_ = NULL;
+  batch_paths_ = NULL;
   db_inode2path_ = NULL;
   db_path2inode_ = NULL;
   cache_inode2path_ = NULL;
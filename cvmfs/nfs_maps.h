@@ -9,8 +9,12 @@
 #include "hash.h"
 #include "shortstring.h"
 
+class MetricsWriter;
+
 namespace nfs_maps {
 
+void SetTuning(const unsigned leveldb_cache_mb, const unsigned bloom_bits,
+               const unsigned front_cache_size);
 bool Init(const std::string &leveldb_dir, const uint64_t root_inode,
           const bool rebuild);
 void Fini();
@@ -20,6 +24,7 @@ uint64_t GetInode(const PathString &path);
 bool GetPath(const uint64_t inode, PathString *path);
 
 std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
 
 }  // namespace nfs_maps
 
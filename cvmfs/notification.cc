@@ -0,0 +1,260 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The notification module subscribes to an HTTP endpoint next to the
+ * Stratum 1 that announces new revisions, so that a remount follows a
+ * publish within seconds instead of after the catalog TTL.
+ *
+ * The endpoint keeps the GET request open and streams text lines.  Each line
+ * is the hex root catalog hash of the newest revision, optionally prefixed by
+ * the repository name and a space for endpoints that serve several
+ * repositories.  The current hash is sent first, so that publishes during a
+ * disconnect are not missed.  Empty lines are keep-alives, which have to be
+ * sent at least every kIdleTimeout seconds.  The URL can contain the @fqrn@
+ * and @org@ placeholders.
+ *
+ * The subscription bypasses the proxies, which would buffer or time out the
+ * stream.  A lost subscription is retried with exponential backoff.
+ */
+
+#include "cvmfs_config.h"
+#include "notification.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <string>
+
+#include "atomic.h"
+#include "duplex_curl.h"
+#include "logging.h"
+#include "metrics.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace notification {
+
+const unsigned kConnectTimeout = 10;
+const unsigned kIdleTimeout = 180;  /**< seconds without any byte */
+const unsigned kMinBackoff = 2;
+const unsigned kMaxBackoff = 300;
+const unsigned kMaxLineLength = 1024;
+
+string *url_ = NULL;
+string *repository_name_ = NULL;
+Callback callback_ = NULL;
+string *partial_line_ = NULL;  /**< used by the notification thread only */
+pthread_t thread_notification_;
+bool spawned_ = false;
+int pipe_terminate_[2];
+atomic_int32 terminate_;
+atomic_int32 subscribed_;
+atomic_int64 num_connects_;
+atomic_int64 num_notifications_;
+
+
+static void ProcessLine(string line) {
+  if (!line.empty() && (line[line.length()-1] == '\r'))
+    line.erase(line.length()-1);
+  if (line.empty())
+    return;
+
+  const size_t separator = line.find(' ');
+  if (separator != string::npos) {
+    if (line.substr(0, separator) != *repository_name_)
+      return;
+    line = line.substr(separator + 1);
+  }
+  if (line.length() != 40) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "invalid revision notification: %s",
+             line.c_str());
+    return;
+  }
+  for (unsigned i = 0; i < line.length(); ++i) {
+    const char c = line[i];
+    if (!(((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'f')))) {
+      LogCvmfs(kLogCvmfs, kLogDebug, "invalid revision notification: %s",
+               line.c_str());
+      return;
+    }
+  }
+
+  if (atomic_cas32(&subscribed_, 0, 1)) {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "subscribed to revision notifications from %s", url_->c_str());
+  }
+  atomic_inc64(&num_notifications_);
+  LogCvmfs(kLogCvmfs, kLogDebug, "revision notification %s", line.c_str());
+  callback_(kEventRevision, hash::Any(hash::kSha1, hash::HexPtr(line)));
+}
+
+
+static size_t CallbackData(void *ptr, size_t size, size_t nmemb,
+                           void *info __attribute__((unused)))
+{
+  const size_t num_bytes = size*nmemb;
+  const char *data = static_cast<const char *>(ptr);
+  for (size_t i = 0; i < num_bytes; ++i) {
+    if (data[i] == '\n') {
+      ProcessLine(*partial_line_);
+      partial_line_->clear();
+    } else if (partial_line_->length() < kMaxLineLength) {
+      partial_line_->push_back(data[i]);
+    }
+  }
+  return num_bytes;
+}
+
+
+/**
+ * Called about once per second also on an idle stream, aborts on Fini().
+ */
+static int CallbackProgress(void *clientp __attribute__((unused)),
+                            double dltotal __attribute__((unused)),
+                            double dlnow __attribute__((unused)),
+                            double ultotal __attribute__((unused)),
+                            double ulnow __attribute__((unused)))
+{
+  return atomic_read32(&terminate_);
+}
+
+
+static void Subscribe() {
+  CURL *handle = curl_easy_init();
+  assert(handle != NULL);
+  curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
+  curl_easy_setopt(handle, CURLOPT_PROXY, "");
+  curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1);
+  curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, kConnectTimeout);
+  curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 1);
+  curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, kIdleTimeout);
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, CallbackData);
+  curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0);
+  curl_easy_setopt(handle, CURLOPT_PROGRESSFUNCTION, CallbackProgress);
+  curl_easy_setopt(handle, CURLOPT_URL, url_->c_str());
+
+  atomic_inc64(&num_connects_);
+  partial_line_->clear();
+  const CURLcode result = curl_easy_perform(handle);
+  curl_easy_cleanup(handle);
+  LogCvmfs(kLogCvmfs, kLogDebug, "revision notification stream ended (%d)",
+           result);
+}
+
+
+static void *MainNotification(void *data __attribute__((unused))) {
+  LogCvmfs(kLogCvmfs, kLogDebug, "revision notification thread started");
+  unsigned backoff = kMinBackoff;
+  while (!atomic_read32(&terminate_)) {
+    Subscribe();
+    if (atomic_cas32(&subscribed_, 1, 0)) {
+      LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+               "lost subscription to revision notifications");
+      callback_(kEventLost, hash::Any());
+      backoff = kMinBackoff;
+    }
+    if (atomic_read32(&terminate_))
+      break;
+
+    struct pollfd watch;
+    watch.fd = pipe_terminate_[0];
+    watch.events = POLLIN;
+    watch.revents = 0;
+    if (poll(&watch, 1, backoff*1000) > 0)
+      break;
+    backoff = (2*backoff < kMaxBackoff) ? 2*backoff : kMaxBackoff;
+  }
+  LogCvmfs(kLogCvmfs, kLogDebug, "revision notification thread stopped");
+  return NULL;
+}
+
+
+bool Init(const string &url, const string &repository_name,
+          Callback callback)
+{
+  const string org = repository_name.substr(0, repository_name.find('.'));
+  string expanded_url = url;
+  size_t pos;
+  while ((pos = expanded_url.find("@fqrn@")) != string::npos)
+    expanded_url.replace(pos, 6, repository_name);
+  while ((pos = expanded_url.find("@org@")) != string::npos)
+    expanded_url.replace(pos, 5, org);
+  if (!HasPrefix(expanded_url, "http://", true) &&
+      !HasPrefix(expanded_url, "https://", true))
+  {
+    return false;
+  }
+
+  url_ = new string(expanded_url);
+  repository_name_ = new string(repository_name);
+  partial_line_ = new string();
+  callback_ = callback;
+  atomic_init32(&terminate_);
+  atomic_init32(&subscribed_);
+  atomic_init64(&num_connects_);
+  atomic_init64(&num_notifications_);
+  return true;
+}
+
+
+/**
+ * Starts the subscription thread, has to run after fork().
+ */
+void Spawn() {
+  MakePipe(pipe_terminate_);
+  int retval = pthread_create(&thread_notification_, NULL, MainNotification,
+                              NULL);
+  assert(retval == 0);
+  spawned_ = true;
+}
+
+
+void Fini() {
+  if (spawned_) {
+    atomic_cas32(&terminate_, 0, 1);
+    char c = 'T';
+    WritePipe(pipe_terminate_[1], &c, 1);
+    pthread_join(thread_notification_, NULL);
+    ClosePipe(pipe_terminate_);
+    spawned_ = false;
+  }
+  delete url_;
+  delete repository_name_;
+  delete partial_line_;
+  url_ = NULL;
+  repository_name_ = NULL;
+  partial_line_ = NULL;
+  callback_ = NULL;
+}
+
+
+bool IsSubscribed() {
+  return atomic_read32(&subscribed_);
+}
+
+
+string GetStatistics() {
+  if (!url_)
+    return "off\n";
+  return string(IsSubscribed() ? "subscribed" : "not subscribed") +
+    " to " + *url_ + "\n  connects: " +
+    StringifyInt(atomic_read64(&num_connects_)) + "    notifications: " +
+    StringifyInt(atomic_read64(&num_notifications_)) + "\n";
+}
+
+
+void GetMetrics(MetricsWriter *metrics) {
+  metrics->Gauge("notification_subscribed",
+                 "Subscribed to revision notifications", IsSubscribed());
+  metrics->Counter("notification_connects_total",
+                   "Connections to the revision notification endpoint",
+                   atomic_read64(&num_connects_));
+  metrics->Counter("notification_received_total",
+                   "Revision notifications received",
+                   atomic_read64(&num_notifications_));
+}
+
+}  // namespace notification
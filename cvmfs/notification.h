@@ -0,0 +1,34 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_NOTIFICATION_H_
+#define CVMFS_NOTIFICATION_H_
+
+#include <string>
+
+#include "hash.h"
+
+class MetricsWriter;
+
+namespace notification {
+
+enum Events {
+  kEventRevision = 0,  /**< the server announced a root catalog hash */
+  kEventLost,  /**< the subscription was interrupted */
+};
+
+typedef void (*Callback)(const Events event, const hash::Any &root_hash);
+
+bool Init(const std::string &url, const std::string &repository_name,
+          Callback callback);
+void Spawn();
+void Fini();
+
+bool IsSubscribed();
+std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
+
+}  // namespace notification
+
+#endif  // CVMFS_NOTIFICATION_H_
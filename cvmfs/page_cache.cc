@@ -0,0 +1,232 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Page cache hints for the cache files.  The kernel caches a file twice, the
+ * pages of the Fuse file and the pages of the file in the cache directory.
+ * A large file that is read once from start to end pushes the hot files,
+ * such as shared libraries, out of both.  Once the reads of such a file turn
+ * out to be sequential, its cache file gets the sequential hint, so that the
+ * kernel reads ahead further, and the pages the reader has left behind are
+ * dropped.  Large files that are read at random get the random hint instead,
+ * which stops the kernel read-ahead.  Small files are read into the page
+ * cache as a whole on open, saving the disk round trips of the single reads.
+ *
+ * Cache file descriptors are shared by the concurrent opens of a file, so is
+ * the observed read pattern.
+ */
+
+#include "cvmfs_config.h"
+#include "page_cache.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "logging.h"
+#include "metrics.h"
+#include "platform.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace page_cache {
+
+const unsigned kMaxFiles = 128*1024;  /**< Higher descriptors get no hints */
+const unsigned kNumLocks = 64;
+const unsigned kMinSequential = 4;  /**< reads in a row before the hint */
+const unsigned kMinRandom = 4;
+const off_t kTolerance = 256*1024;  /**< multi-threaded Fuse reorders reads */
+const off_t kDropBehindLag = 1024*1024;  /**< kept behind the reader */
+const off_t kDropBehindStep = 4*1024*1024;
+
+enum Pattern {
+  kPatternUnknown = 0,
+  kPatternSequential,
+  kPatternRandom,
+};
+
+struct FileState {
+  FileState() : size(0), next_offset(0), dropped(0), num_sequential(0),
+    num_random(0), pattern(kPatternUnknown) { }
+  uint64_t size;
+  off_t next_offset;  /**< end of the previous read */
+  off_t dropped;  /**< pages before are dropped from the page cache */
+  unsigned num_sequential;
+  unsigned num_random;
+  Pattern pattern;  /**< the last hint given */
+};
+
+uint64_t prefetch_size_ = 0;
+uint64_t dropbehind_size_ = 0;
+vector<FileState> *files_ = NULL;  /**< Indexed by file descriptor */
+pthread_mutex_t *locks_ = NULL;  /**< files_[fd] has locks_[fd % kNumLocks] */
+atomic_int64 num_prefetched_;
+atomic_int64 num_prefetched_bytes_;
+atomic_int64 num_sequential_;
+atomic_int64 num_random_;
+atomic_int64 num_dropped_bytes_;
+
+
+/**
+ * @param[in] prefetch_size Files up to this size are read into the page cache
+ *            on open, 0 is off
+ * @param[in] dropbehind_size Files of at least this size get access pattern
+ *            hints and sequentially read pages are dropped, 0 is off
+ */
+void Init(const uint64_t prefetch_size, const uint64_t dropbehind_size) {
+  prefetch_size_ = prefetch_size;
+  dropbehind_size_ = dropbehind_size;
+  struct rlimit rpl;
+  memset(&rpl, 0, sizeof(rpl));
+  getrlimit(RLIMIT_NOFILE, &rpl);
+  const unsigned num_files = (rpl.rlim_cur < kMaxFiles) ?
+                             static_cast<unsigned>(rpl.rlim_cur) : kMaxFiles;
+  files_ = new vector<FileState>(num_files);
+  locks_ = new pthread_mutex_t[kNumLocks];
+  for (unsigned i = 0; i < kNumLocks; ++i)
+    pthread_mutex_init(&locks_[i], NULL);
+  atomic_init64(&num_prefetched_);
+  atomic_init64(&num_prefetched_bytes_);
+  atomic_init64(&num_sequential_);
+  atomic_init64(&num_random_);
+  atomic_init64(&num_dropped_bytes_);
+}
+
+
+void Fini() {
+  if (locks_) {
+    for (unsigned i = 0; i < kNumLocks; ++i)
+      pthread_mutex_destroy(&locks_[i]);
+  }
+  delete[] locks_;
+  delete files_;
+  locks_ = NULL;
+  files_ = NULL;
+}
+
+
+/**
+ * A cache file descriptor is handed out for a file of the given size.
+ */
+void ObserveOpen(const int fd, const uint64_t size) {
+  if (!files_ || (fd < 0) || (unsigned(fd) >= files_->size()))
+    return;
+
+  pthread_mutex_t *lock = &locks_[fd % kNumLocks];
+  pthread_mutex_lock(lock);
+  FileState *state = &(*files_)[fd];
+  if (state->size != size) {
+    *state = FileState();
+    state->size = size;
+  }
+  pthread_mutex_unlock(lock);
+
+  if ((size > 0) && (size <= prefetch_size_) &&
+      (platform_advise_willneed(fd, 0, size) == 0))
+  {
+    atomic_inc64(&num_prefetched_);
+    atomic_xadd64(&num_prefetched_bytes_, size);
+  }
+}
+
+
+/**
+ * Follows the reads of large files and gives the hints once the pattern is
+ * clear.  Has to be called after the read.
+ */
+void ObserveRead(const int fd, const off_t offset, const size_t size) {
+  if (!files_ || (dropbehind_size_ == 0) || (fd < 0) ||
+      (unsigned(fd) >= files_->size()))
+  {
+    return;
+  }
+
+  Pattern advice = kPatternUnknown;
+  off_t drop_from = 0;
+  off_t drop_to = 0;
+  pthread_mutex_t *lock = &locks_[fd % kNumLocks];
+  pthread_mutex_lock(lock);
+  FileState *state = &(*files_)[fd];
+  if (state->size < dropbehind_size_) {
+    pthread_mutex_unlock(lock);
+    return;
+  }
+  const bool sequential = (offset + kTolerance >= state->next_offset) &&
+                          (offset <= state->next_offset + kTolerance);
+  if (sequential) {
+    state->num_random = 0;
+    state->next_offset = max(state->next_offset, off_t(offset + size));
+    if ((++state->num_sequential >= kMinSequential) &&
+        (state->pattern != kPatternSequential))
+    {
+      state->pattern = advice = kPatternSequential;
+    }
+    if ((state->pattern == kPatternSequential) &&
+        (state->next_offset - kDropBehindLag >=
+         state->dropped + kDropBehindStep))
+    {
+      drop_from = state->dropped;
+      drop_to = state->next_offset - kDropBehindLag;
+      state->dropped = drop_to;
+    }
+  } else {
+    state->num_sequential = 0;
+    state->next_offset = offset + size;
+    if ((++state->num_random >= kMinRandom) &&
+        (state->pattern != kPatternRandom))
+    {
+      state->pattern = advice = kPatternRandom;
+    }
+  }
+  pthread_mutex_unlock(lock);
+
+  if (advice != kPatternUnknown) {
+    LogCvmfs(kLogCvmfs, kLogDebug, "page cache hint for fd %d: %s", fd,
+             (advice == kPatternSequential) ? "sequential" : "random");
+    platform_advise_pattern(fd, advice == kPatternSequential);
+    atomic_inc64((advice == kPatternSequential) ?
+                 &num_sequential_ : &num_random_);
+  }
+  if ((drop_to > drop_from) &&
+      (platform_advise_dontneed(fd, drop_from, drop_to - drop_from) == 0))
+  {
+    atomic_xadd64(&num_dropped_bytes_, drop_to - drop_from);
+  }
+}
+
+
+string GetStatistics() {
+  return
+    "  prefetched files: " + StringifyInt(atomic_read64(&num_prefetched_)) +
+    " (" + StringifyInt(atomic_read64(&num_prefetched_bytes_) / 1024) +
+    " kB)  sequential: " + StringifyInt(atomic_read64(&num_sequential_)) +
+    "  random: " + StringifyInt(atomic_read64(&num_random_)) +
+    "  dropped behind: " +
+    StringifyInt(atomic_read64(&num_dropped_bytes_) / 1024) + " kB\n";
+}
+
+
+void GetMetrics(MetricsWriter *metrics) {
+  metrics->Counter("pagecache_prefetched_total",
+                   "Small files read into the page cache on open",
+                   atomic_read64(&num_prefetched_));
+  metrics->Counter("pagecache_prefetched_bytes_total",
+                   "Bytes read into the page cache on open",
+                   atomic_read64(&num_prefetched_bytes_));
+  metrics->Counter("pagecache_sequential_total",
+                   "Large files hinted as read sequentially",
+                   atomic_read64(&num_sequential_));
+  metrics->Counter("pagecache_random_total",
+                   "Large files hinted as read at random",
+                   atomic_read64(&num_random_));
+  metrics->Counter("pagecache_dropped_bytes_total",
+                   "Bytes dropped from the page cache behind readers",
+                   atomic_read64(&num_dropped_bytes_));
+}
+
+}  // namespace page_cache
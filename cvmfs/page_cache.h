@@ -0,0 +1,28 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_PAGE_CACHE_H_
+#define CVMFS_PAGE_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+class MetricsWriter;
+
+namespace page_cache {
+
+void Init(const uint64_t prefetch_size, const uint64_t dropbehind_size);
+void Fini();
+
+void ObserveOpen(const int fd, const uint64_t size);
+void ObserveRead(const int fd, const off_t offset, const size_t size);
+
+std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
+
+}  // namespace page_cache
+
+#endif  // CVMFS_PAGE_CACHE_H_
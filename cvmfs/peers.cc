@@ -11,6 +11,13 @@
  *
  * Cvmfs instances ask the peer server via sockets for a responsible peer
  * given a certain hash.  The peer server implements a distributed hash table.
+ * Peers are placed on a consistent hashing ring, so that only few objects
+ * change their owner when a peer comes or goes.  Every peer server serves the
+ * plain data objects of its cache directory by a minimal HTTP endpoint on the
+ * TCP port with the number of its UDP port.  Only the cache directories of
+ * connected instances, i.e. of repositories that enabled peers, are served,
+ * by at most kMaxDataConnections threads.  On a cache miss, instances first
+ * ask the owner of the object before they go through the proxies.
  *
  * This module contains both server and client code.
  */
@@ -22,13 +29,19 @@
 #include <sys/un.h>
 #include <sys/file.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
 
+#include <algorithm>
+#include <ctime>
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -38,40 +51,152 @@
 #include "atomic.h"
 #include "smalloc.h"
 #include "cvmfs.h"
+#include "hash.h"
 
 using namespace std;  // NOLINT
 
 namespace peers {
 
+const char kCmdLookup = 'H';  /**< Followed by a SHA-1 digest */
+/**
+ * Followed by the length (1 byte) and the name of the instance's cache
+ * directory, which is served to other peers for the lifetime of the connection
+ */
+const char kCmdServe = 'S';
+const unsigned kMaxDataConnections = 16;
+const unsigned kMaxRequest = 1024;  /**< HTTP request header of a peer */
+const unsigned kDataTimeout = 2;  /**< Seconds, peers are on the LAN */
+const unsigned kDataBlockSize = 64*1024;
+
 // Server variables
 std::string *cachedir_ = NULL;
 atomic_int32 num_connections_;
+atomic_int32 num_data_connections_;
+pthread_mutex_t lock_served_ = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Cache directories of the connected instances with their number of
+ * connections
+ */
+map<string, unsigned> *served_subdirs_;
 pthread_attr_t pthread_connection_attr_;
 Address *address_self_;
-Address watchee1_;
-Address watchee2_;
-pthread_mutex_t lock_watchees_ = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * SWIM membership state.  Dead peers are remembered, so that stale updates
+ * cannot revive them.  A restarted peer starts with a higher incarnation,
+ * which is initialized from the clock.
+ */
+struct MemberInfo {
+  MemberInfo() : incarnation(0), state(kMemberAlive), suspect_periods(0) { }
+  uint32_t incarnation;
+  MemberState state;
+  unsigned suspect_periods;
+};
+struct PendingUpdate {
+  Update update;
+  unsigned transmissions;  /**< Remaining number of times to piggyback */
+};
+pthread_mutex_t lock_members_ = PTHREAD_MUTEX_INITIALIZER;
+map<Address, MemberInfo> *members_;
+list<PendingUpdate> *pending_updates_;
+uint32_t incarnation_;
+Address probe_target_;  /**< Current target of the failure detector */
+bool probe_acked_;
 std::string *interface_;
 struct sockaddr_in mcast_addr_;
 int udp_send_;
 int unicast_receive_;
 int mcast_receive_;
+int data_receive_;
 pthread_t thread_receive_unicast_;
 pthread_t thread_receive_multicast_;
+pthread_t thread_receive_data_;
 pthread_t thread_watchdog_;
 Peers *peers_;
 
 // Client variables
 int socket_fd_ = -1;
+pthread_mutex_t lock_socket_ = PTHREAD_MUTEX_INITIALIZER;
+std::string *subdir_ = NULL;  /**< Name of the instance's cache directory */
+
+
+static bool SendAll(const int fd, const void *buf, const size_t size) {
+  size_t pos = 0;
+  while (pos < size) {
+    const ssize_t num_bytes =
+      send(fd, static_cast<const char *>(buf) + pos, size - pos, MSG_NOSIGNAL);
+    if (num_bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    pos += num_bytes;
+  }
+  return true;
+}
+
+
+static bool RecvAll(const int fd, void *buf, const size_t size) {
+  size_t pos = 0;
+  while (pos < size) {
+    const ssize_t num_bytes =
+      read(fd, static_cast<char *>(buf) + pos, size - pos);
+    if (num_bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (num_bytes == 0)
+      return false;
+    pos += num_bytes;
+  }
+  return true;
+}
+
+
+static void SetSocketTimeout(const int fd, const unsigned seconds) {
+  struct timeval timeout;
+  timeout.tv_sec = seconds;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+
+/**
+ * The socket is only visible to IsConnected() once the peer server is ready,
+ * so that Init() can run while the file system already serves requests.
+ */
+static void PublishSocket(const int fd) {
+  pthread_mutex_lock(&lock_socket_);
+  socket_fd_ = fd;
+  pthread_mutex_unlock(&lock_socket_);
+}
+
+
+/**
+ * Tells the peer server to serve the instance's cache directory.
+ */
+static bool RegisterSubdir(const int fd) {
+  if (subdir_->length() > 255)
+    return false;
+  string request(1, kCmdServe);
+  request.push_back(static_cast<char>(subdir_->length()));
+  request += *subdir_;
+  return SendAll(fd, request.data(), request.length());
+}
 
 
 /**
  * Connects to a running peer server.  Creates a peer server, if necessary.
+ * The peer server resides in the parent directory of the instance's cache
+ * directory, so that it can serve the objects of all the instances.
  */
 bool Init(const string &cachedir, const string &exe_path,
           const string &interface)
 {
-  cachedir_ = new string(cachedir);
+  const string path = MakeCanonicalPath(cachedir);
+  cachedir_ = new string(GetParentPath(path));
+  subdir_ = new string(GetFileName(path));
 
   // Create lock file
   const int fd_lockfile = LockFile(*cachedir_ + "/lock_peers");
@@ -83,22 +208,24 @@ bool Init(const string &cachedir, const string &exe_path,
 
   // Try to connect to socket
   LogCvmfs(kLogPeers, kLogDebug, "trying to connect to existing socket");
-  socket_fd_ = ConnectSocket(*cachedir_ + "/peers");
-  if (socket_fd_ != -1) {
+  int fd = ConnectSocket(*cachedir_ + "/peers");
+  if (fd != -1) {
     char buf = '\0';
-    read(socket_fd_, &buf, 1);
-    if (buf == 'C') {
+    read(fd, &buf, 1);
+    if ((buf == 'C') && RegisterSubdir(fd)) {
       LogCvmfs(kLogPeers, kLogDebug, "connected to existing socket");
       UnlockFile(fd_lockfile);
+      PublishSocket(fd);
       return true;
     }
+    close(fd);
   }
 
   // Opening new socket for peer server (to be created)
   int socket_pair[2];
   int retval = socketpair(AF_UNIX, SOCK_STREAM, 0, socket_pair);
   assert(retval == 0);
-  socket_fd_ = socket_pair[0];
+  fd = socket_pair[0];
   int pipe_boot[2];
   MakePipe(pipe_boot);
 
@@ -111,6 +238,7 @@ bool Init(const string &cachedir, const string &exe_path,
   command_line.push_back(StringifyInt(socket_pair[1]));
   command_line.push_back(StringifyInt(cvmfs::foreground_));
   command_line.push_back(GetLogDebugFile());
+  command_line.push_back(interface);
   
   vector<int> preserve_filedes;
   preserve_filedes.push_back(0);
@@ -141,6 +269,13 @@ bool Init(const string &cachedir, const string &exe_path,
   close(pipe_boot[0]);
 
   UnlockFile(fd_lockfile);
+  if (!RegisterSubdir(fd)) {
+    close(fd);
+    LogCvmfs(kLogPeers, kLogDebug, "failed to register %s at peer server",
+             subdir_->c_str());
+    return false;
+  }
+  PublishSocket(fd);
   return true;
 }
 
@@ -148,11 +283,156 @@ bool Init(const string &cachedir, const string &exe_path,
 void Fini() {
   delete cachedir_;
   cachedir_ = NULL;
+  delete subdir_;
+  subdir_ = NULL;
 
   LogCvmfs(kLogPeers, kLogDebug, "disconnecting from peer server");
   if (socket_fd_ >= 0) {
     close(socket_fd_);
+    socket_fd_ = -1;
+  }
+}
+
+
+bool IsConnected() {
+  return socket_fd_ >= 0;
+}
+
+
+/**
+ * Asks the peer server for the peer that is responsible for id.
+ * \return false if there is no such peer besides ourselves
+ */
+static bool LookupOwner(const hash::Any &id, Address *owner) {
+  unsigned char request[1 + hash::kMaxDigestSize];
+  request[0] = kCmdLookup;
+  memcpy(request + 1, id.digest, hash::kMaxDigestSize);
+  unsigned char reply[sizeof(owner->ip4_address) + sizeof(owner->port)];
+
+  pthread_mutex_lock(&lock_socket_);
+  const bool result = SendAll(socket_fd_, request, sizeof(request)) &&
+                      RecvAll(socket_fd_, reply, sizeof(reply));
+  pthread_mutex_unlock(&lock_socket_);
+  if (!result) {
+    LogCvmfs(kLogPeers, kLogDebug, "lost connection to peer server");
+    return false;
+  }
+
+  owner->version = kIPv4;
+  memcpy(&owner->ip4_address, reply, sizeof(owner->ip4_address));
+  memcpy(&owner->port, reply + sizeof(owner->ip4_address),
+         sizeof(owner->port));
+  return owner->ip4_address != 0;
+}
+
+
+/**
+ * Connects to the data endpoint of a peer, waits at most kDataTimeout seconds.
+ */
+static int ConnectPeer(const Address &peer) {
+  struct sockaddr_in sock_addr;
+  memset(&sock_addr, 0, sizeof(sock_addr));
+  sock_addr.sin_family = AF_INET;
+  sock_addr.sin_addr.s_addr = peer.ip4_address;
+  sock_addr.sin_port = htons(peer.port);
+
+  const int fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0)
+    return -1;
+  const int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int retval = connect(fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr));
+  if ((retval != 0) && (errno == EINPROGRESS)) {
+    struct pollfd poll_connect;
+    poll_connect.fd = fd;
+    poll_connect.events = POLLOUT;
+    poll_connect.revents = 0;
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    if ((poll(&poll_connect, 1, kDataTimeout*1000) == 1) &&
+        (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0) &&
+        (error == 0))
+    {
+      retval = 0;
+    }
+  }
+  if (retval != 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, flags);
+  SetSocketTimeout(fd, kDataTimeout);
+  return fd;
+}
+
+
+/**
+ * Fetches the plain data object id from the peer that is responsible for it
+ * and writes it to f.  The data are not verified, the caller has to compare
+ * them with the content hash.
+ *
+ * \return false if there is no other peer, if the peer does not have the
+ *         object, or on connection problems.  f might be partially written.
+ */
+bool Fetch(const hash::Any &id, FILE *f) {
+  if (!IsConnected())
+    return false;
+  Address owner;
+  if (!LookupOwner(id, &owner))
+    return false;
+
+  const int fd = ConnectPeer(owner);
+  if (fd < 0) {
+    LogCvmfs(kLogPeers, kLogDebug, "failed to connect to peer %s",
+             owner.ToString().c_str());
+    return false;
   }
+  const string request = "GET /" + *subdir_ + "/" + id.ToString() +
+                         " HTTP/1.0\r\n\r\n";
+  bool result = SendAll(fd, request.data(), request.length());
+
+  // Response header, possibly followed by the first part of the data
+  char *buffer = static_cast<char *>(smalloc(kDataBlockSize));
+  string header;
+  size_t header_end = string::npos;
+  while (result && (header_end == string::npos)) {
+    const ssize_t num_bytes = read(fd, buffer, kDataBlockSize);
+    if ((num_bytes <= 0) || (header.length() > kMaxRequest)) {
+      result = false;
+      break;
+    }
+    header.append(buffer, num_bytes);
+    header_end = header.find("\r\n\r\n");
+  }
+  int64_t remaining = -1;
+  if (result) {
+    const size_t pos_length = header.find("Content-Length: ");
+    result = (header.compare(0, 13, "HTTP/1.0 200 ") == 0) &&
+             (pos_length != string::npos) && (pos_length < header_end);
+    if (result) {
+      remaining = String2Int64(header.substr(pos_length + 16,
+        header.find("\r\n", pos_length) - pos_length - 16));
+      const size_t body = header.length() - header_end - 4;
+      result = (int64_t(body) <= remaining) &&
+        (fwrite(header.data() + header_end + 4, 1, body, f) == body);
+      remaining -= body;
+    }
+  }
+  while (result && (remaining > 0)) {
+    const ssize_t num_bytes =
+      read(fd, buffer, std::min(int64_t(kDataBlockSize), remaining));
+    result = (num_bytes > 0) &&
+             (fwrite(buffer, 1, num_bytes, f) == size_t(num_bytes));
+    remaining -= num_bytes;
+  }
+  free(buffer);
+  close(fd);
+  result = result && (fflush(f) == 0);
+
+  LogCvmfs(kLogPeers, kLogDebug, "fetching %s from peer %s %s",
+           id.ToString().c_str(), owner.ToString().c_str(),
+           result ? "succeeded" : "failed");
+  return result;
 }
 
 
@@ -237,7 +517,7 @@ static bool InitGossip() {
   if (retval != 0)
     return false;
 
-  // Probe for ports
+  // Probe for ports, the data endpoint uses the same port number with TCP
   bool bound = false;
   uint16_t port_base = 5001;
   uint16_t port_offset = 0;
@@ -256,6 +536,32 @@ static bool InitGossip() {
       }
       return false;
     }
+
+    // Set up data receiver
+    data_receive_ = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    assert(data_receive_ >= 0);
+    retval = setsockopt(data_receive_, SOL_SOCKET, SO_REUSEADDR, &on,
+                        sizeof(on));
+    if (retval == 0) {
+      retval = bind(data_receive_, (struct sockaddr *) &self_addr,
+                    sizeof(self_addr));
+    }
+    if (retval != 0) {
+      LogCvmfs(kLogPeers, kLogDebug, "binding data recv socket returned %d",
+               errno);
+      const bool in_use = (errno == EADDRINUSE);
+      close(data_receive_);
+      close(unicast_receive_);
+      if (!in_use)
+        return false;
+      // A bound socket cannot be unbound
+      unicast_receive_ = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      assert(unicast_receive_ >= 0);
+      port_offset++;
+      continue;
+    }
+    if (listen(data_receive_, 128) != 0)
+      return false;
     bound = true;
   }
   if (!bound) {
@@ -263,7 +569,8 @@ static bool InitGossip() {
     return false;
   }
   address_self_->port = port_base + port_offset;
-  LogCvmfs(kLogPeers, kLogDebug, "using UDP port %d", address_self_->port);
+  LogCvmfs(kLogPeers, kLogDebug, "using UDP and TCP port %d",
+           address_self_->port);
 
   return true;
 }
@@ -295,12 +602,189 @@ static void SendMulticast(const Message &message) {
 }
 
 
+/**
+ * Number of times an update is piggybacked, grows with the log of the size of
+ * the peer group.
+ */
+static unsigned GetNumTransmissions() {
+  unsigned log2 = 1;
+  for (unsigned n = peers_->GetNumPeers(); n > 1; n /= 2)
+    ++log2;
+  return kRetransmitMult * log2;
+}
+
+
+/**
+ * Queues an update for dissemination.  It replaces older updates for the same
+ * peer.  Caller holds lock_members_.
+ */
+static void QueueUpdate(const Update &update) {
+  for (list<PendingUpdate>::iterator i = pending_updates_->begin(),
+       iEnd = pending_updates_->end(); i != iEnd; ++i)
+  {
+    if (i->update.address == update.address) {
+      pending_updates_->erase(i);
+      break;
+    }
+  }
+  PendingUpdate pending;
+  pending.update = update;
+  pending.transmissions = GetNumTransmissions();
+  pending_updates_->push_front(pending);
+}
+
+
+/**
+ * Attaches the pending updates to an outgoing message, newest first.  Sent
+ * updates move to the end of the queue, so that all of them get their turn
+ * if there are more than kMaxPiggyback.
+ */
+static void Piggyback(MessageGossip *message) {
+  pthread_mutex_lock(&lock_members_);
+  const unsigned num_pending = pending_updates_->size();
+  for (unsigned i = 0; i < num_pending; ++i) {
+    PendingUpdate pending = pending_updates_->front();
+    if (!message->AddUpdate(pending.update))
+      break;
+    pending_updates_->pop_front();
+    if (--pending.transmissions > 0)
+      pending_updates_->push_back(pending);
+  }
+  pthread_mutex_unlock(&lock_members_);
+}
+
+
+static void SendGossip(const Address &address, MessageGossip *message) {
+  Piggyback(message);
+  SendTo(address, *message);
+}
+
+
+/**
+ * Merges a membership update according to the SWIM rules.  Suspicions and
+ * deaths of ourselves are refuted by a higher incarnation.  Caller holds
+ * lock_members_.
+ */
+static void ApplyUpdate(const Update &update) {
+  if (update.address.ip4_address == 0)
+    return;
+  if (update.address == *address_self_) {
+    if ((update.state != kMemberAlive) && (update.incarnation >= incarnation_))
+    {
+      LogCvmfs(kLogPeers, kLogDebug, "refuting suspicion in incarnation %u",
+               update.incarnation);
+      incarnation_ = update.incarnation + 1;
+      QueueUpdate(Update(*address_self_, incarnation_, kMemberAlive));
+    }
+    return;
+  }
+
+  map<Address, MemberInfo>::iterator iter = members_->find(update.address);
+  if (iter == members_->end()) {
+    MemberInfo info;
+    info.incarnation = update.incarnation;
+    info.state = update.state;
+    (*members_)[update.address] = info;
+    if (update.state != kMemberDead) {
+      peers_->Insert(update.address);
+      QueueUpdate(update);
+    }
+    return;
+  }
+
+  MemberInfo *info = &iter->second;
+  bool supersedes = false;
+  switch (update.state) {
+    case kMemberAlive:
+      supersedes = update.incarnation > info->incarnation;
+      break;
+    case kMemberSuspect:
+      supersedes = (update.incarnation > info->incarnation) ||
+        ((update.incarnation == info->incarnation) &&
+         (info->state == kMemberAlive));
+      break;
+    case kMemberDead:
+      supersedes = (update.incarnation >= info->incarnation) &&
+                   (info->state != kMemberDead);
+      break;
+  }
+  if (!supersedes)
+    return;
+
+  LogCvmfs(kLogPeers, kLogDebug, "peer %s is %s in incarnation %u",
+           update.address.ToString().c_str(),
+           (update.state == kMemberAlive) ? "alive" :
+           ((update.state == kMemberSuspect) ? "suspect" : "dead"),
+           update.incarnation);
+  if (update.state == kMemberDead)
+    peers_->Erase(update.address);
+  else if (info->state == kMemberDead)
+    peers_->Insert(update.address);
+  info->incarnation = update.incarnation;
+  info->state = update.state;
+  info->suspect_periods = 0;
+  QueueUpdate(update);
+}
+
+
+/**
+ * Merges the piggybacked updates.  The sender of a message is alive, even if
+ * we did not know about it yet.
+ */
+static void ApplyGossip(const Address &sender, const MessageGossip &message) {
+  pthread_mutex_lock(&lock_members_);
+  if (members_->find(sender) == members_->end())
+    ApplyUpdate(Update(sender, 0, kMemberAlive));
+  for (unsigned i = 0; i < message.updates().size(); ++i)
+    ApplyUpdate(message.updates()[i]);
+  pthread_mutex_unlock(&lock_members_);
+}
+
+
+static void ApplyCiao(const Address &leaving) {
+  pthread_mutex_lock(&lock_members_);
+  map<Address, MemberInfo>::const_iterator iter = members_->find(leaving);
+  if (iter != members_->end())
+    ApplyUpdate(Update(leaving, iter->second.incarnation, kMemberDead));
+  pthread_mutex_unlock(&lock_members_);
+}
+
+
+/**
+ * Sends the known peers to a new peer, as many updates per datagram as fit.
+ */
+static void SendMembership(const Address &address) {
+  vector<Update> updates;
+  pthread_mutex_lock(&lock_members_);
+  updates.push_back(Update(*address_self_, incarnation_, kMemberAlive));
+  for (map<Address, MemberInfo>::const_iterator i = members_->begin(),
+       iEnd = members_->end(); i != iEnd; ++i)
+  {
+    if (i->second.state != kMemberDead)
+      updates.push_back(Update(i->first, i->second.incarnation,
+                               i->second.state));
+  }
+  pthread_mutex_unlock(&lock_members_);
+
+  const Address none(0, 0);
+  for (unsigned i = 0; i < updates.size(); i += kMaxPiggyback) {
+    MessagePong pong(address_self_->port, *address_self_, none);
+    for (unsigned j = i; (j < i + kMaxPiggyback) && (j < updates.size()); ++j)
+      pong.AddUpdate(updates[j]);
+    SendTo(address, pong);
+  }
+  LogCvmfs(kLogPeers, kLogDebug, "sent %u peers to %s", updates.size(),
+           address.ToString().c_str());
+}
+
+
 static void *MainUnicast(void *data __attribute__((unused))) {
   LogCvmfs(kLogPeers, kLogDebug, "starting udp unicast listener");
   unsigned char message_buffer[kMaxMessage];
   int num_bytes;
   struct sockaddr_in addr_sender;
   socklen_t addr_sender_len = sizeof(addr_sender);
+  const Address none(0, 0);
   while (1) {
     num_bytes = recvfrom(unicast_receive_, message_buffer,
                          sizeof(message_buffer), 0,
@@ -312,26 +796,58 @@ static void *MainUnicast(void *data __attribute__((unused))) {
     switch (message_type) {
       case kMsgPing: {
         MessagePing ping(message_buffer, num_bytes);
-        Address remote_address(addr_sender.sin_addr.s_addr,
-                               ping.port());
+        if (ping.port() == 0)
+          break;
+        Address remote_address(addr_sender.sin_addr.s_addr, ping.port());
         LogCvmfs(kLogPeers, kLogDebug, "received ping from %s",
                  remote_address.ToString().c_str());
-        peers_->Insert(remote_address);
-        SendTo(remote_address, MessagePong(address_self_->port));
+        ApplyGossip(remote_address, ping);
+        MessagePong pong(address_self_->port, *address_self_, ping.origin());
+        SendGossip(remote_address, &pong);
         break;
       }
       case kMsgPong: {
-        MessagePing pong(message_buffer, num_bytes);
-        Address remote_address(addr_sender.sin_addr.s_addr,
-                               pong.port());
-        LogCvmfs(kLogPeers, kLogDebug, "received pong from %s",
-                 remote_address.ToString().c_str());
-        pthread_mutex_lock(&lock_watchees_);
-        if (remote_address == watchee1_)
-          watchee1_.ip4_address = 0;
-        if (remote_address == watchee2_)
-          watchee2_.ip4_address = 0;
-        pthread_mutex_unlock(&lock_watchees_);
+        MessagePong pong(message_buffer, num_bytes);
+        if (pong.port() == 0)
+          break;
+        Address remote_address(addr_sender.sin_addr.s_addr, pong.port());
+        LogCvmfs(kLogPeers, kLogDebug, "received pong from %s for %s",
+                 remote_address.ToString().c_str(),
+                 pong.target().ToString().c_str());
+        ApplyGossip(remote_address, pong);
+        if ((pong.origin().ip4_address != 0) &&
+            (pong.origin() != *address_self_))
+        {
+          // Answer to a ping on behalf of another peer
+          MessagePong forward(address_self_->port, pong.target(), none);
+          SendGossip(pong.origin(), &forward);
+          break;
+        }
+        pthread_mutex_lock(&lock_members_);
+        if (pong.target() == probe_target_)
+          probe_acked_ = true;
+        pthread_mutex_unlock(&lock_members_);
+        break;
+      }
+      case kMsgPingReq: {
+        MessagePingReq ping_req(message_buffer, num_bytes);
+        if (ping_req.port() == 0)
+          break;
+        Address remote_address(addr_sender.sin_addr.s_addr, ping_req.port());
+        LogCvmfs(kLogPeers, kLogDebug, "received ping request from %s for %s",
+                 remote_address.ToString().c_str(),
+                 ping_req.target().ToString().c_str());
+        ApplyGossip(remote_address, ping_req);
+        MessagePing ping(address_self_->port, remote_address);
+        SendGossip(ping_req.target(), &ping);
+        break;
+      }
+      case kMsgCiao: {
+        MessageCiao ciao(message_buffer, num_bytes);
+        LogCvmfs(kLogPeers, kLogDebug, "received ciao from %s for %s",
+                 StringifyIpv4(addr_sender.sin_addr.s_addr).c_str(),
+                 ciao.address().ToString().c_str());
+        ApplyCiao(ciao.address());
         break;
       }
       default:
@@ -347,6 +863,12 @@ static void *MainUnicast(void *data __attribute__((unused))) {
 }
 
 
+/**
+ * Multicast is only used by new peers to announce themselves.  Only the peer
+ * that will be the successor of the new peer on the ring sends the member
+ * list, everybody else learns about the new peer by gossip or on its own
+ * multicast.
+ */
 static void *MainMulticast(void *data __attribute__((unused))) {
   LogCvmfs(kLogPeers, kLogDebug, "starting udp multicast listener");
   unsigned char message_buffer[kMaxMessage];
@@ -366,21 +888,20 @@ static void *MainMulticast(void *data __attribute__((unused))) {
         MessageMoin moin(message_buffer, num_bytes);
         Address remote_address(addr_sender.sin_addr.s_addr,
                                moin.port());
+        if ((moin.port() == 0) || (remote_address == *address_self_))
+          break;
         LogCvmfs(kLogPeers, kLogDebug, "received moin from %s",
                  remote_address.ToString().c_str());
-        bool known = peers_->Insert(remote_address);
-        if (!known)
-          SendTo(remote_address, MessagePing(address_self_->port));
-        break;
-      }
-      case kMsgCiao: {
-        MessageCiao ciao(message_buffer, num_bytes);
-        LogCvmfs(kLogPeers, kLogDebug, "received moin from %s for %s",
-                 StringifyIpv4(addr_sender.sin_addr.s_addr).c_str(),
-                 ciao.address().ToString().c_str());
-        peers_->Erase(ciao.address());
-        if (ciao.address() == *address_self_)
-          SendMulticast(MessageMoin(address_self_->port));
+        const hash::Md5 position(hash::AsciiPtr(remote_address.ToString()));
+        Address successor;
+        const bool responsible = !peers_->GetOwner(
+          hash::Any(hash::kMd5, position.digest, sizeof(position.digest)),
+          &successor);
+        pthread_mutex_lock(&lock_members_);
+        ApplyUpdate(Update(remote_address, moin.incarnation(), kMemberAlive));
+        pthread_mutex_unlock(&lock_members_);
+        if (responsible)
+          SendMembership(remote_address);
         break;
       }
       default:
@@ -396,30 +917,81 @@ static void *MainMulticast(void *data __attribute__((unused))) {
 }
 
 
+/**
+ * The SWIM failure detector.  Every protocol period, a random peer is pinged.
+ * If it does not answer within kPingTimeout, kNumIndirectProbes other peers
+ * are asked to ping it.  Without any answer until the end of the period, the
+ * peer becomes suspect and is declared dead after kSuspectPeriods, unless it
+ * refutes the suspicion.  A peer that does not know anybody repeats its
+ * multicast announcement.
+ */
 static void *MainWatchdog(void *data __attribute__((unused))) {
   LogCvmfs(kLogPeers, kLogDebug, "starting watchdog");
-  pthread_mutex_lock(&lock_watchees_);
-  watchee1_.ip4_address = watchee2_.ip4_address = 0;
-  pthread_mutex_unlock(&lock_watchees_);
-
-  MessagePing ping(address_self_->port);
+  const Address none(0, 0);
+  vector<Address> targets;
+  vector<Address> helpers;
   while (1) {
-    sleep(kPingInterval);
-    pthread_mutex_lock(&lock_watchees_);
-    if (watchee1_.ip4_address != 0) {
-      LogCvmfs(kLogPeers, kLogDebug, "lost peer %s",
-               watchee1_.ToString().c_str());
-      SendMulticast(MessageCiao(watchee1_));
+    pthread_mutex_lock(&lock_members_);
+    for (map<Address, MemberInfo>::iterator i = members_->begin(),
+         iEnd = members_->end(); i != iEnd; ++i)
+    {
+      if ((i->second.state == kMemberSuspect) &&
+          (++i->second.suspect_periods >= kSuspectPeriods))
+      {
+        LogCvmfs(kLogPeers, kLogDebug, "lost peer %s",
+                 i->first.ToString().c_str());
+        ApplyUpdate(Update(i->first, i->second.incarnation, kMemberDead));
+      }
     }
-    if (watchee2_.ip4_address != 0) {
-      LogCvmfs(kLogPeers, kLogDebug, "lost peer %s",
-               watchee2_.ToString().c_str());
-      SendMulticast(MessageCiao(watchee2_));
+    pthread_mutex_unlock(&lock_members_);
+
+    peers_->GetRandomPeers(1, none, &targets);
+    if (targets.empty()) {
+      sleep(kPingInterval);
+      if (peers_->GetNumPeers() > 1)
+        continue;
+      pthread_mutex_lock(&lock_members_);
+      const uint32_t incarnation = incarnation_;
+      pthread_mutex_unlock(&lock_members_);
+      SendMulticast(MessageMoin(address_self_->port, incarnation));
+      continue;
+    }
+
+    pthread_mutex_lock(&lock_members_);
+    probe_target_ = targets[0];
+    probe_acked_ = false;
+    pthread_mutex_unlock(&lock_members_);
+    MessagePing ping(address_self_->port, none);
+    SendGossip(targets[0], &ping);
+    sleep(kPingTimeout);
+
+    pthread_mutex_lock(&lock_members_);
+    bool acked = probe_acked_;
+    pthread_mutex_unlock(&lock_members_);
+    if (!acked) {
+      peers_->GetRandomPeers(kNumIndirectProbes, targets[0], &helpers);
+      for (unsigned i = 0; i < helpers.size(); ++i) {
+        MessagePingReq ping_req(address_self_->port, targets[0]);
+        SendGossip(helpers[i], &ping_req);
+      }
     }
-    peers_->GetWatchees(&watchee1_, &watchee2_);
-    SendTo(watchee1_, ping);
-    SendTo(watchee2_, ping);
-    pthread_mutex_unlock(&lock_watchees_);
+    sleep(kPingInterval - kPingTimeout);
+
+    pthread_mutex_lock(&lock_members_);
+    if (!probe_acked_) {
+      map<Address, MemberInfo>::const_iterator iter =
+        members_->find(targets[0]);
+      if ((iter != members_->end()) &&
+          (iter->second.state == kMemberAlive))
+      {
+        LogCvmfs(kLogPeers, kLogDebug, "suspecting peer %s",
+                 targets[0].ToString().c_str());
+        ApplyUpdate(Update(targets[0], iter->second.incarnation,
+                           kMemberSuspect));
+      }
+    }
+    probe_target_ = none;
+    pthread_mutex_unlock(&lock_members_);
   }
 
   LogCvmfs(kLogPeers, kLogDebug, "stopping watchdog");
@@ -427,9 +999,170 @@ static void *MainWatchdog(void *data __attribute__((unused))) {
 }
 
 
+static bool IsServed(const string &subdir) {
+  pthread_mutex_lock(&lock_served_);
+  const bool result = served_subdirs_->find(subdir) != served_subdirs_->end();
+  pthread_mutex_unlock(&lock_served_);
+  return result;
+}
+
+
+static void ChangeServed(const string &subdir, const bool add) {
+  pthread_mutex_lock(&lock_served_);
+  if (add) {
+    (*served_subdirs_)[subdir]++;
+  } else {
+    map<string, unsigned>::iterator iter = served_subdirs_->find(subdir);
+    if ((iter != served_subdirs_->end()) && (--iter->second == 0))
+      served_subdirs_->erase(iter);
+  }
+  pthread_mutex_unlock(&lock_served_);
+}
+
+
+/**
+ * Opens a data object in the cache directory of an instance.  Objects of the
+ * shared cache are found for all instances, if the shared cache is served.
+ * Objects stored in the block format of a compressed cache have a different
+ * name and are not served.
+ */
+static int OpenObject(const string &subdir, const hash::Any &id) {
+  if (!IsServed(subdir))
+    return -1;
+  const string path = id.MakePath(1, 2);
+  int fd = open((*cachedir_ + "/" + subdir + path).c_str(), O_RDONLY);
+  if ((fd < 0) && (subdir != "shared") && IsServed("shared"))
+    fd = open((*cachedir_ + "/shared" + path).c_str(), O_RDONLY);
+  return fd;
+}
+
+
+/**
+ * Parses "GET /<cache directory>/<SHA-1> HTTP/1.x" and opens the object.
+ * \return file descriptor of the object or -1
+ */
+static int OpenRequest(const string &request) {
+  const size_t pos_subdir = request.find("GET /");
+  if (pos_subdir != 0)
+    return -1;
+  const size_t pos_hash = request.find('/', 5);
+  if (pos_hash == string::npos)
+    return -1;
+  const string subdir = request.substr(5, pos_hash - 5);
+  const string hex = request.substr(pos_hash + 1, 2*hash::kMaxDigestSize);
+  if (subdir.empty() || (subdir[0] == '.') ||
+      (hex.length() != 2*hash::kMaxDigestSize) ||
+      (request.compare(pos_hash + 1 + hex.length(), 6, " HTTP/") != 0))
+  {
+    return -1;
+  }
+  for (unsigned i = 0; i < hex.length(); ++i) {
+    if (!(((hex[i] >= '0') && (hex[i] <= '9')) ||
+          ((hex[i] >= 'a') && (hex[i] <= 'f'))))
+    {
+      return -1;
+    }
+  }
+  return OpenObject(subdir, hash::Any(hash::kSha1, hash::HexPtr(hex)));
+}
+
+
+/**
+ * Serves a single object to another peer, then closes the connection.
+ */
+static void ServeObject(const int connection_fd) {
+  SetSocketTimeout(connection_fd, kDataTimeout);
+
+  string request;
+  char buf[kMaxRequest];
+  while (request.find("\r\n\r\n") == string::npos) {
+    const ssize_t num_bytes = read(connection_fd, buf, sizeof(buf));
+    if ((num_bytes <= 0) || (request.length() > kMaxRequest)) {
+      close(connection_fd);
+      return;
+    }
+    request.append(buf, num_bytes);
+  }
+
+  const int fd = OpenRequest(request);
+  platform_stat64 info;
+  if ((fd < 0) || (platform_fstat(fd, &info) != 0)) {
+    LogCvmfs(kLogPeers, kLogDebug, "not serving %s",
+             request.substr(0, request.find("\r\n")).c_str());
+    const string reply = "HTTP/1.0 404 Not Found\r\n\r\n";
+    SendAll(connection_fd, reply.data(), reply.length());
+    if (fd >= 0) close(fd);
+    close(connection_fd);
+    return;
+  }
+
+  const string reply = "HTTP/1.0 200 OK\r\n"
+    "Content-Length: " + StringifyInt(info.st_size) + "\r\n\r\n";
+  bool result = SendAll(connection_fd, reply.data(), reply.length());
+  char *block = static_cast<char *>(smalloc(kDataBlockSize));
+  ssize_t num_bytes;
+  while (result && ((num_bytes = read(fd, block, kDataBlockSize)) > 0))
+    result = SendAll(connection_fd, block, num_bytes);
+  free(block);
+  close(fd);
+  close(connection_fd);
+}
+
+
+static void *MainDataConnection(void *data) {
+  const int connection_fd = *(reinterpret_cast<int *>(data));
+  free(data);
+  ServeObject(connection_fd);
+  atomic_dec32(&num_data_connections_);
+  return NULL;
+}
+
+
+/**
+ * Accepts TCP connections from other peers that fetch data objects.  Beyond
+ * kMaxDataConnections concurrent connections, peers are turned away and
+ * download the object through the proxies.
+ */
+static void *MainData(void *data __attribute__((unused))) {
+  LogCvmfs(kLogPeers, kLogDebug, "starting data listener");
+  while (true) {
+    const int connection_fd = accept(data_receive_, NULL, NULL);
+    if (connection_fd < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (atomic_xadd32(&num_data_connections_, 1) >=
+        static_cast<int32_t>(kMaxDataConnections))
+    {
+      atomic_dec32(&num_data_connections_);
+      LogCvmfs(kLogPeers, kLogDebug, "too many data connections, rejecting");
+      close(connection_fd);
+      continue;
+    }
+    int *connection_fd_ptr = reinterpret_cast<int *>(smalloc(sizeof(int)));
+    *connection_fd_ptr = connection_fd;
+    pthread_t pthread_connection;
+    int retval = pthread_create(&pthread_connection, &pthread_connection_attr_,
+                                MainDataConnection, connection_fd_ptr);
+    if (retval != 0) {
+      free(connection_fd_ptr);
+      close(connection_fd);
+      atomic_dec32(&num_data_connections_);
+    }
+  }
+
+  LogCvmfs(kLogPeers, kLogDebug, "stopping data listener");
+  return NULL;
+}
+
+
 /**
  * A connection to a mounted repository, receives hashes and returns the
- * repsonsible peer (redis) address.
+ * repsonsible peer address.  An address of 0 means that the instance has to
+ * download the object itself.  The instance registers its cache directory
+ * first, which is served while the connection lasts.  Any other message
+ * closes the connection.
  */
 static void *MainPeerConnection(void *data) {
   int connection_fd = *(reinterpret_cast<int *>(data));
@@ -437,18 +1170,58 @@ static void *MainPeerConnection(void *data) {
   LogCvmfs(kLogPeers, kLogDebug, "starting new peer connection on %d",
            connection_fd);
 
-  char buf;
-  read(connection_fd, &buf, 1);
+  string served_subdir;
+  unsigned char request[1 + hash::kMaxDigestSize];
+  while (RecvAll(connection_fd, request, 1)) {
+    if (request[0] == kCmdServe) {
+      unsigned char length;
+      char name[256];
+      if (!served_subdir.empty() || !RecvAll(connection_fd, &length, 1) ||
+          !RecvAll(connection_fd, name, length))
+      {
+        break;
+      }
+      const string subdir(name, length);
+      if (subdir.empty() || (subdir[0] == '.') ||
+          (subdir.find('/') != string::npos))
+      {
+        break;
+      }
+      served_subdir = subdir;
+      LogCvmfs(kLogPeers, kLogDebug, "serving %s", served_subdir.c_str());
+      ChangeServed(served_subdir, true);
+      continue;
+    }
+    if ((request[0] != kCmdLookup) ||
+        !RecvAll(connection_fd, request + 1, hash::kMaxDigestSize))
+    {
+      break;
+    }
+    const hash::Any id(hash::kSha1, request + 1, hash::kMaxDigestSize);
+    Address owner(0, 0);
+    if (!peers_->GetOwner(id, &owner))
+      owner = Address(0, 0);
+    unsigned char reply[sizeof(owner.ip4_address) + sizeof(owner.port)];
+    memcpy(reply, &owner.ip4_address, sizeof(owner.ip4_address));
+    memcpy(reply + sizeof(owner.ip4_address), &owner.port, sizeof(owner.port));
+    if (!SendAll(connection_fd, reply, sizeof(reply)))
+      break;
+  }
 
   LogCvmfs(kLogPeers, kLogDebug, "shutting down peer connection %d",
            connection_fd);
   close(connection_fd);
+  if (!served_subdir.empty())
+    ChangeServed(served_subdir, false);
 
   // Clean up after last instance
   int active_connections = atomic_xadd32(&num_connections_, -1);
   if (active_connections == 1) {
     LogCvmfs(kLogPeers, kLogDebug, "last connection, stopping peer server");
-    SendMulticast(MessageCiao(*address_self_));
+    vector<Address> notify;
+    peers_->GetRandomPeers(kNumLeaveNotify, Address(0, 0), &notify);
+    for (unsigned i = 0; i < notify.size(); ++i)
+      SendTo(notify[i], MessageCiao(*address_self_));
     exit(0);
   }
 
@@ -499,13 +1272,20 @@ int MainPeerServer(int argc, char **argv) {
   // Network initialization
   if (!InitGossip())
     return 1;
+  peers_ = new Peers(*address_self_);
+  served_subdirs_ = new map<string, unsigned>();
+  atomic_init32(&num_data_connections_);
+  members_ = new map<Address, MemberInfo>();
+  pending_updates_ = new list<PendingUpdate>();
+  incarnation_ = time(NULL);
+  probe_target_ = Address(0, 0);
   retval = pthread_create(&thread_receive_unicast_, NULL, MainUnicast, NULL);
   retval |= pthread_create(&thread_receive_multicast_, NULL, MainMulticast,
                            NULL);
   retval |= pthread_create(&thread_watchdog_, NULL, MainWatchdog, NULL);
+  retval |= pthread_create(&thread_receive_data_, NULL, MainData, NULL);
   assert(retval == 0);
-  peers_ = new Peers(*address_self_);
-  SendMulticast(MessageMoin(address_self_->port));
+  SendMulticast(MessageMoin(address_self_->port, incarnation_));
 
   if (!foreground)
     Daemonize();
@@ -10,18 +10,38 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
 
+#include <algorithm>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "util.h"
 #include "logging.h"
 #include "smalloc.h"
+#include "hash.h"
 
 namespace peers {
 
 const unsigned kMaxMessage = 512;
-const unsigned kPingInterval = 5;  // Seconds
+const unsigned kPingInterval = 5;  // Seconds, the SWIM protocol period
+const unsigned kPingTimeout = 1;  // Seconds until indirect probes are sent
+const unsigned kNumIndirectProbes = 3;
+const unsigned kSuspectPeriods = 3;  // Until a suspected peer is dead
+const unsigned kNumLeaveNotify = 3;  // Peers told about a shutdown
+/**
+ * Membership updates are disseminated kRetransmitMult * log2(peers) times.
+ * Together with kMaxPiggyback updates per datagram, that is the bandwidth
+ * budget of the gossip.
+ */
+const unsigned kRetransmitMult = 3;
+const unsigned kMaxPiggyback = 32;
+/**
+ * Positions of every peer on the consistent hashing ring.  More positions
+ * spread the objects more evenly, when peers come and go.
+ */
+const unsigned kNumRingPositions = 32;
 
 enum IPVersion {
   kIPv4 = 0,
@@ -33,6 +53,13 @@ enum MessageType {
   kMsgCiao,
   kMsgPing,
   kMsgPong,
+  kMsgPingReq,
+};
+
+enum MemberState {
+  kMemberAlive = 0,
+  kMemberSuspect,
+  kMemberDead,
 };
 
 
@@ -75,6 +102,24 @@ struct Address {
 };
 
 
+/**
+ * A membership change that is piggybacked on the failure detector messages
+ * (SWIM).  Higher incarnations of a peer supersede lower ones, only the peer
+ * itself increases its incarnation in order to refute a suspicion.
+ */
+struct Update {
+  Update() : incarnation(0), state(kMemberAlive) { }
+  Update(const Address &a, const uint32_t i, const MemberState s) :
+    address(a), incarnation(i), state(s) { }
+  Address address;
+  uint32_t incarnation;
+  MemberState state;
+};
+
+const unsigned kPackedAddressSize = sizeof(uint32_t) + sizeof(uint16_t);
+const unsigned kPackedUpdateSize = kPackedAddressSize + sizeof(uint32_t) + 1;
+
+
 class Message {
  public:
   virtual ~Message() { };
@@ -89,68 +134,215 @@ class Message {
   virtual void DoPack(uint16_t *size, unsigned char buffer[kMaxMessage])
     const = 0;
   virtual void DoUnpack(unsigned char *buffer, const uint16_t size) = 0;
+
+  static unsigned char *PackAddress(const Address &address,
+                                    unsigned char *buffer)
+  {
+    memcpy(buffer, &address.ip4_address, sizeof(address.ip4_address));
+    memcpy(buffer + sizeof(address.ip4_address), &address.port,
+           sizeof(address.port));
+    return buffer + kPackedAddressSize;
+  }
+  static unsigned char *UnpackAddress(unsigned char *buffer,
+                                      Address *address)
+  {
+    memcpy(&address->ip4_address, buffer, sizeof(address->ip4_address));
+    memcpy(&address->port, buffer + sizeof(address->ip4_address),
+           sizeof(address->port));
+    return buffer + kPackedAddressSize;
+  }
+};
+
+/**
+ * Carries up to kMaxPiggyback membership updates after the fixed part.
+ * Messages that are too short for their fixed part come out with port 0.
+ */
+class MessageGossip : public Message {
+ public:
+  const std::vector<Update> &updates() const { return updates_; }
+  bool AddUpdate(const Update &update) {
+    if (updates_.size() >= kMaxPiggyback)
+      return false;
+    updates_.push_back(update);
+    return true;
+  }
+ protected:
+  unsigned char *PackUpdates(unsigned char *buffer) const {
+    buffer[0] = updates_.size();
+    buffer++;
+    for (unsigned i = 0; i < updates_.size(); ++i) {
+      buffer = PackAddress(updates_[i].address, buffer);
+      memcpy(buffer, &updates_[i].incarnation, sizeof(uint32_t));
+      buffer[sizeof(uint32_t)] = updates_[i].state;
+      buffer += sizeof(uint32_t) + 1;
+    }
+    return buffer;
+  }
+  void UnpackUpdates(unsigned char *buffer, const unsigned char *end) {
+    updates_.clear();
+    if (buffer >= end)
+      return;
+    unsigned num_updates = std::min(unsigned(buffer[0]), kMaxPiggyback);
+    buffer++;
+    for (unsigned i = 0; (i < num_updates) &&
+         (buffer + kPackedUpdateSize <= end); ++i)
+    {
+      Update update;
+      buffer = UnpackAddress(buffer, &update.address);
+      memcpy(&update.incarnation, buffer, sizeof(uint32_t));
+      if (buffer[sizeof(uint32_t)] <= kMemberDead) {
+        update.state = static_cast<MemberState>(buffer[sizeof(uint32_t)]);
+        updates_.push_back(update);
+      }
+      buffer += sizeof(uint32_t) + 1;
+    }
+  }
+  std::vector<Update> updates_;
 };
 
+/**
+ * Announces a new peer by multicast.
+ */
 class MessageMoin : public Message {
  public:
   MessageMoin(unsigned char *buffer, uint16_t size) { Unpack(buffer, size); }
-  MessageMoin(const uint16_t port) : port_(port) { }
+  MessageMoin(const uint16_t port, const uint32_t incarnation) :
+    port_(port), incarnation_(incarnation) { }
   inline uint16_t port() const { return port_; }
+  inline uint32_t incarnation() const { return incarnation_; }
  protected:
   void DoPack(uint16_t *size, unsigned char buffer[kMaxMessage]) const {
-    *size = 1 + sizeof(port_);
+    *size = 1 + sizeof(port_) + sizeof(incarnation_);
     buffer[0] = kMsgMoin;
     buffer++;
     memcpy(buffer, &port_, sizeof(port_));
+    memcpy(buffer + sizeof(port_), &incarnation_, sizeof(incarnation_));
   }
   void DoUnpack(unsigned char *buffer, const uint16_t size) {
+    port_ = 0;
+    incarnation_ = 0;
+    if (size < 1 + sizeof(port_) + sizeof(incarnation_))
+      return;
     buffer++;
     memcpy(&port_, buffer, sizeof(port_));
+    memcpy(&incarnation_, buffer + sizeof(port_), sizeof(incarnation_));
   }
  private:
   uint16_t port_;
+  uint32_t incarnation_;
 };
 
-class MessagePing : public Message {
+/**
+ * Probes a peer.  If origin is set, the ping is sent on behalf of another
+ * peer that asked by a MessagePingReq.
+ */
+class MessagePing : public MessageGossip {
  public:
   MessagePing(unsigned char *buffer, uint16_t size) { Unpack(buffer, size); }
-  MessagePing(const uint16_t port) : port_(port) { }
+  MessagePing(const uint16_t port, const Address &origin) :
+    port_(port), origin_(origin) { }
   inline uint16_t port() const { return port_; }
+  inline Address origin() const { return origin_; }
  protected:
   void DoPack(uint16_t *size, unsigned char buffer[kMaxMessage]) const {
-    *size = 1 + sizeof(port_);
-    buffer[0] = kMsgPing;
-    buffer++;
-    memcpy(buffer, &port_, sizeof(port_));
+    unsigned char *pos = buffer;
+    pos[0] = kMsgPing;
+    pos++;
+    memcpy(pos, &port_, sizeof(port_));
+    pos = PackAddress(origin_, pos + sizeof(port_));
+    *size = PackUpdates(pos) - buffer;
   }
   void DoUnpack(unsigned char *buffer, const uint16_t size) {
-    buffer++;
-    memcpy(&port_, buffer, sizeof(port_));
+    port_ = 0;
+    if (size < 1 + sizeof(port_) + kPackedAddressSize)
+      return;
+    unsigned char *pos = buffer + 1;
+    memcpy(&port_, pos, sizeof(port_));
+    pos = UnpackAddress(pos + sizeof(port_), &origin_);
+    UnpackUpdates(pos, buffer + size);
   }
  private:
   uint16_t port_;
+  Address origin_;
 };
 
-class MessagePong : public Message {
+/**
+ * Answers a ping for target.  Pongs for an origin are forwarded to the
+ * origin by the peer that sent the ping.
+ */
+class MessagePong : public MessageGossip {
  public:
   MessagePong(unsigned char *buffer, uint16_t size) { Unpack(buffer, size); }
-  MessagePong(const uint16_t port) : port_(port) { }
+  MessagePong(const uint16_t port, const Address &target,
+              const Address &origin) :
+    port_(port), target_(target), origin_(origin) { }
   inline uint16_t port() const { return port_; }
+  inline Address target() const { return target_; }
+  inline Address origin() const { return origin_; }
  protected:
   void DoPack(uint16_t *size, unsigned char buffer[kMaxMessage]) const {
-    *size = 1 + sizeof(port_);
-    buffer[0] = kMsgPong;
-    buffer++;
-    memcpy(buffer, &port_, sizeof(port_));
+    unsigned char *pos = buffer;
+    pos[0] = kMsgPong;
+    pos++;
+    memcpy(pos, &port_, sizeof(port_));
+    pos = PackAddress(target_, pos + sizeof(port_));
+    pos = PackAddress(origin_, pos);
+    *size = PackUpdates(pos) - buffer;
   }
   void DoUnpack(unsigned char *buffer, const uint16_t size) {
-    buffer++;
-    memcpy(&port_, buffer, sizeof(port_));
+    port_ = 0;
+    if (size < 1 + sizeof(port_) + 2*kPackedAddressSize)
+      return;
+    unsigned char *pos = buffer + 1;
+    memcpy(&port_, pos, sizeof(port_));
+    pos = UnpackAddress(pos + sizeof(port_), &target_);
+    pos = UnpackAddress(pos, &origin_);
+    UnpackUpdates(pos, buffer + size);
   }
  private:
   uint16_t port_;
+  Address target_;
+  Address origin_;
 };
 
+/**
+ * Asks a peer to probe target, if target did not answer a ping in time.
+ */
+class MessagePingReq : public MessageGossip {
+ public:
+  MessagePingReq(unsigned char *buffer, uint16_t size) {
+    Unpack(buffer, size);
+  }
+  MessagePingReq(const uint16_t port, const Address &target) :
+    port_(port), target_(target) { }
+  inline uint16_t port() const { return port_; }
+  inline Address target() const { return target_; }
+ protected:
+  void DoPack(uint16_t *size, unsigned char buffer[kMaxMessage]) const {
+    unsigned char *pos = buffer;
+    pos[0] = kMsgPingReq;
+    pos++;
+    memcpy(pos, &port_, sizeof(port_));
+    pos = PackAddress(target_, pos + sizeof(port_));
+    *size = PackUpdates(pos) - buffer;
+  }
+  void DoUnpack(unsigned char *buffer, const uint16_t size) {
+    port_ = 0;
+    if (size < 1 + sizeof(port_) + kPackedAddressSize)
+      return;
+    unsigned char *pos = buffer + 1;
+    memcpy(&port_, pos, sizeof(port_));
+    pos = UnpackAddress(pos + sizeof(port_), &target_);
+    UnpackUpdates(pos, buffer + size);
+  }
+ private:
+  uint16_t port_;
+  Address target_;
+};
+
+/**
+ * A peer leaves, sent to a few other peers that disseminate the news.
+ */
 class MessageCiao : public Message {
  public:
   MessageCiao(unsigned char *buffer, uint16_t size) { Unpack(buffer, size); }
@@ -158,14 +350,15 @@ class MessageCiao : public Message {
   inline Address address() const { return address_; }
  protected:
   virtual void DoPack(uint16_t *size, unsigned char buffer[kMaxMessage]) const {
-    *size = 1 + sizeof(address_);
+    *size = 1 + kPackedAddressSize;
     buffer[0] = kMsgCiao;
-    buffer++;
-    memcpy(buffer, &address_, sizeof(address_));
+    PackAddress(address_, buffer + 1);
   }
   virtual void DoUnpack(unsigned char *buffer, const uint16_t size) {
-    buffer++;
-    memcpy(&address_, buffer, sizeof(address_));
+    address_ = Address(0, 0);
+    if (size < 1 + kPackedAddressSize)
+      return;
+    UnpackAddress(buffer + 1, &address_);
   }
  private:
   Address address_;
@@ -181,6 +374,7 @@ class Peers {
     assert(retval == 0);
     addresses_.push_back(me);
     index_me_ = 0;
+    InsertRing(me);
   }
 
   ~Peers() { free(lock_); }
@@ -200,17 +394,40 @@ class Peers {
     addresses_.insert(elem_addr, peer);
     if (position <= index_me_)
       ++index_me_;
+    InsertRing(peer);
     LogCvmfs(kLogPeers, kLogDebug, "inserted %s at position %d",
              peer.ToString().c_str(), position);
     pthread_mutex_unlock(lock_);
     return false;
   }
 
-  void GetWatchees(Address *watchee1, Address *watchee2) {
+  /**
+   * Picks up to num distinct random peers other than ourselves and exclude.
+   */
+  void GetRandomPeers(const unsigned num, const Address &exclude,
+                      std::vector<Address> *result) const
+  {
+    result->clear();
+    pthread_mutex_lock(lock_);
+    std::vector<Address> candidates;
+    candidates.reserve(addresses_.size());
+    for (unsigned i = 0; i < addresses_.size(); ++i) {
+      if ((int(i) != index_me_) && (addresses_[i] != exclude))
+        candidates.push_back(addresses_[i]);
+    }
+    pthread_mutex_unlock(lock_);
+    for (unsigned i = 0; (i < num) && (i < candidates.size()); ++i) {
+      const unsigned pick = i + random() % (candidates.size() - i);
+      std::swap(candidates[i], candidates[pick]);
+      result->push_back(candidates[i]);
+    }
+  }
+
+  unsigned GetNumPeers() const {
     pthread_mutex_lock(lock_);
-    *watchee1 = addresses_[random()%addresses_.size()];
-    *watchee2 = addresses_[random()%addresses_.size()];
+    const unsigned result = addresses_.size();
     pthread_mutex_unlock(lock_);
+    return result;
   }
 
   void Erase(const Address &peer) {
@@ -228,6 +445,7 @@ class Peers {
       if (position < index_me_)
         --index_me_;
       addresses_.erase(elem_addr);
+      EraseRing(peer);
       LogCvmfs(kLogPeers, kLogDebug, "erased %s at position %d",
                peer.ToString().c_str(), position);
     } else {
@@ -237,6 +455,25 @@ class Peers {
     pthread_mutex_unlock(lock_);
   }
 
+  /**
+   * The peer that stores an object is the first one on the ring at or after
+   * the position of the content hash.
+   * \return false if the owner is this peer
+   */
+  bool GetOwner(const hash::Any &id, Address *owner) const {
+    uint64_t position;
+    memcpy(&position, id.digest, sizeof(position));
+    pthread_mutex_lock(lock_);
+    std::map<uint64_t, Address>::const_iterator iter =
+      ring_.lower_bound(position);
+    if (iter == ring_.end())
+      iter = ring_.begin();
+    *owner = iter->second;
+    const bool result = (*owner != addresses_[index_me_]);
+    pthread_mutex_unlock(lock_);
+    return result;
+  }
+
   std::string Print() const {
     std::string result;
     pthread_mutex_lock(lock_);
@@ -251,6 +488,34 @@ class Peers {
   pthread_mutex_t *lock_;
   std::vector<Address> addresses_;
   int index_me_;
+  /**
+   * Consistent hashing ring, positions are taken from the MD5 of the address.
+   * Collisions are ignored, the position belongs to the first peer then.
+   */
+  std::map<uint64_t, Address> ring_;
+
+  uint64_t GetRingPosition(const Address &peer, const unsigned i) const {
+    const hash::Md5 md5(hash::AsciiPtr(peer.ToString() + "/" +
+                                       StringifyInt(i)));
+    uint64_t position;
+    memcpy(&position, md5.digest, sizeof(position));
+    return position;
+  }
+
+  void InsertRing(const Address &peer) {
+    for (unsigned i = 0; i < kNumRingPositions; ++i)
+      ring_.insert(std::make_pair(GetRingPosition(peer, i), peer));
+  }
+
+  void EraseRing(const Address &peer) {
+    for (unsigned i = 0; i < kNumRingPositions; ++i) {
+      std::map<uint64_t, Address>::iterator iter =
+        ring_.find(GetRingPosition(peer, i));
+      if ((iter != ring_.end()) && (iter->second == peer))
+        ring_.erase(iter);
+    }
+  }
+
   /**
    * Iterator to smallest element greater or equal to peer.
    * \return true if element exists
@@ -276,6 +541,8 @@ class Peers {
 bool Init(const std::string &cachedir, const std::string &exe_path,
           const std::string &interface);
 void Fini();
+bool IsConnected();
+bool Fetch(const hash::Any &id, FILE *f);
 int MainPeerServer(int argc, char **argv);
 
 }  // namespace peers
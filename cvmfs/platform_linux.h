@@ -41,6 +41,7 @@ inline unsigned long platform_gettid() {
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <cassert>
 
 typedef struct dirent64 platform_dirent64;
@@ -63,6 +64,11 @@ inline int platform_fstat(int filedes, platform_stat64 *buf) {
   return fstat64(filedes, buf);
 }
 
+inline uint64_t platform_mtime_ns(const platform_stat64 &info) {
+  return static_cast<uint64_t>(info.st_mtim.tv_sec) * 1000000000 +
+         info.st_mtim.tv_nsec;
+}
+
 inline void platform_disable_kcache(int filedes) {
   posix_fadvise(filedes, 0, 0, POSIX_FADV_RANDOM | POSIX_FADV_NOREUSE);
 }
@@ -71,4 +77,122 @@ inline int platform_readahead(int filedes) {
   return readahead(filedes, 0, static_cast<size_t>(-1));
 }
 
+/**
+ * Page cache hints for a range of a file and for its access pattern
+ */
+inline int platform_advise_willneed(int filedes, off_t offset, off_t length) {
+  return posix_fadvise(filedes, offset, length, POSIX_FADV_WILLNEED);
+}
+
+inline int platform_advise_dontneed(int filedes, off_t offset, off_t length) {
+  return posix_fadvise(filedes, offset, length, POSIX_FADV_DONTNEED);
+}
+
+inline int platform_advise_pattern(int filedes, bool sequential) {
+  return posix_fadvise(filedes, 0, 0,
+                       sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+}
+
+
+/**
+ * Pins the calling thread to a CPU
+ */
+#include <sched.h>
+
+inline int platform_pin_thread(const unsigned cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+
+/**
+ * In-kernel file copies
+ */
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/**
+ * Copies the content of fd_in into the empty file fd_out without passing the
+ * data through user space.  A reflink shares the blocks on file systems that
+ * support it (btrfs, xfs), otherwise copy_file_range() or sendfile() copy in
+ * the kernel.  Older kernels lack some of these calls.
+ * @return false if the kernel cannot copy, the caller has to fall back to
+ *         read/write.  fd_out might be partially written in this case.
+ */
+inline bool platform_copy_file(int fd_in, int fd_out) {
+  platform_stat64 info;
+  if (platform_fstat(fd_in, &info) != 0)
+    return false;
+  if (ioctl(fd_out, FICLONE, fd_in) == 0)
+    return true;
+
+  const uint64_t size = info.st_size;
+  uint64_t copied = 0;
+#ifdef __NR_copy_file_range
+  loff_t off_in = 0;
+  loff_t off_out = 0;
+  while (copied < size) {
+    const ssize_t retval = syscall(__NR_copy_file_range, fd_in, &off_in,
+                                   fd_out, &off_out, size - copied, 0);
+    if (retval <= 0)
+      break;
+    copied += retval;
+  }
+  if (copied == size)
+    return true;
+  if (copied > 0)
+    return false;
+#endif
+
+  off_t offset = 0;
+  if (lseek(fd_out, 0, SEEK_SET) != 0)
+    return false;
+  while (copied < size) {
+    const ssize_t retval = sendfile(fd_out, fd_in, &offset, size - copied);
+    if (retval <= 0) {
+      if ((retval < 0) && (errno == EINTR))
+        continue;
+      return false;
+    }
+    copied += retval;
+  }
+  return true;
+}
+
+
+/**
+ * Opens another file descriptor for the connection of a mounted Fuse file
+ * system (Linux >= 4.2).  Requests read from the clone have to be answered
+ * on the clone.
+ * @return the new file descriptor or -1
+ */
+#include <fcntl.h>
+#include <stdint.h>
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+inline int platform_clone_fuse_fd(int fuse_fd) {
+  const int fd = open("/dev/fuse", O_RDWR);
+  if (fd < 0)
+    return -1;
+  uint32_t master_fd = fuse_fd;
+  if (ioctl(fd, FUSE_DEV_IOC_CLONE, &master_fd) != 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
 #endif  // CVMFS_PLATFORM_LINUX_H_
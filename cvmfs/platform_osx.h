@@ -57,6 +57,7 @@ inline unsigned long platform_gettid() {
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <cassert>
 
 typedef struct dirent platform_dirent64;
@@ -77,6 +78,11 @@ inline int platform_fstat(int filedes, platform_stat64 *buf) {
   return fstat(filedes, buf);
 }
 
+inline uint64_t platform_mtime_ns(const platform_stat64 &info) {
+  return static_cast<uint64_t>(info.st_mtimespec.tv_sec) * 1000000000 +
+         info.st_mtimespec.tv_nsec;
+}
+
 inline void platform_disable_kcache(int filedes) {
   fcntl(filedes, F_RDAHEAD, 0);
   fcntl(filedes, F_NOCACHE, 1);
@@ -87,6 +93,46 @@ inline int platform_readahead(int filedes) {
   return 0;
 }
 
+/**
+ * Page cache hints for a range of a file and for its access pattern.  There
+ * is no way to drop pages of a file.
+ */
+inline int platform_advise_willneed(int filedes, off_t offset, off_t length) {
+  struct radvisory advice;
+  advice.ra_offset = offset;
+  advice.ra_count = static_cast<int>(length);
+  return fcntl(filedes, F_RDADVISE, &advice);
+}
+
+inline int platform_advise_dontneed(int filedes, off_t offset, off_t length) {
+  return 0;
+}
+
+inline int platform_advise_pattern(int filedes, bool sequential) {
+  return fcntl(filedes, F_RDAHEAD, sequential ? 1 : 0);
+}
+
+/**
+ * Threads cannot be pinned, Fuse connections cannot be cloned
+ */
+inline int platform_pin_thread(const unsigned cpu) {
+  return -1;
+}
+
+inline int platform_clone_fuse_fd(int fuse_fd) {
+  return -1;
+}
+
+/**
+ * Copies the content of fd_in into the empty file fd_out.
+ * @return false if the caller has to fall back to read/write
+ */
+#include <copyfile.h>
+
+inline bool platform_copy_file(int fd_in, int fd_out) {
+  return fcopyfile(fd_in, fd_out, NULL, COPYFILE_DATA) == 0;
+}
+
 /**
  * strdupa does not exist on OSX
  */
@@ -0,0 +1,372 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The prefetch module learns which files are usually opened after a given
+ * file and downloads them into the cache in the background.  Jobs of the
+ * same software release tend to open the same files in nearly the same
+ * order, so on a cold cache the round trips for the followers can overlap
+ * with the processing of the current file.
+ *
+ * The model is a table of successor counts per path.  Successors are learned
+ * per process: the previous open of the same pid points to the current open.
+ * Paths are resolved to content hashes only when the prefetch is carried out,
+ * so learned patterns carry over to new repository revisions and always
+ * download the objects of the currently loaded catalogs.
+ *
+ * Prefetching is carried out by a single thread, so that it does not compete
+ * for download slots with the Fuse callbacks.  The model is kept in a text
+ * file in the cache directory in the format "count\tfrom\tto".
+ */
+
+#include "cvmfs_config.h"
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "catalog_mgr.h"
+#include "dirent.h"
+#include "download.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace prefetch {
+
+const unsigned kMaxSuccessors = 4;  /**< per learned path */
+const unsigned kMaxPaths = 32768;  /**< stop learning new paths beyond */
+const unsigned kMaxProcesses = 1024;  /**< last opens that are tracked */
+const unsigned kMaxQueue = 256;  /**< pending prefetches, drop beyond */
+const unsigned kMaxDepth = 2;  /**< follow successors of successors */
+const uint32_t kMinCount = 2;  /**< a successor seen once is not prefetched */
+const uint32_t kMaxCount = 1 << 16;  /**< halve counts beyond */
+
+struct Successor {
+  Successor() : count(0) { }
+  Successor(const PathString &p, const uint32_t c) : path(p), count(c) { }
+  PathString path;
+  uint32_t count;
+};
+typedef vector<Successor> Successors;
+typedef map<PathString, Successors> Model;
+
+struct Job {
+  Job() : depth(0) { }
+  Job(const PathString &p, const unsigned d) : path(p), depth(d) { }
+  PathString path;
+  unsigned depth;
+};
+
+catalog::AbstractCatalogManager *catalog_manager_ = NULL;
+string *model_path_ = NULL;
+Model *model_ = NULL;
+map<pid_t, PathString> *last_open_ = NULL;
+vector<Job> *queue_ = NULL;
+set<PathString> *queued_ = NULL;  /**< Paths in queue_, for deduplication */
+bool stop_ = false;
+bool spawned_ = false;
+pthread_t thread_prefetch_;
+pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_queue_ = PTHREAD_COND_INITIALIZER;
+
+uint64_t num_learned_ = 0;
+uint64_t num_queued_ = 0;
+uint64_t num_dropped_ = 0;
+uint64_t num_fetched_ = 0;
+uint64_t num_cached_ = 0;
+uint64_t num_failed_ = 0;
+
+
+/**
+ * Counts from --> to.  Overwrites the weakest successor if full.
+ * Caller holds lock_.
+ */
+static void Learn(const PathString &from, const PathString &to,
+                  const uint32_t count)
+{
+  Model::iterator iter = model_->find(from);
+  if (iter == model_->end()) {
+    if (model_->size() >= kMaxPaths)
+      return;
+    iter = model_->insert(make_pair(from, Successors())).first;
+  }
+  Successors *successors = &iter->second;
+
+  unsigned weakest = 0;
+  for (unsigned i = 0; i < successors->size(); ++i) {
+    if ((*successors)[i].path == to) {
+      (*successors)[i].count += count;
+      if ((*successors)[i].count >= kMaxCount) {
+        for (unsigned j = 0; j < successors->size(); ++j)
+          (*successors)[j].count /= 2;
+      }
+      return;
+    }
+    if ((*successors)[i].count < (*successors)[weakest].count)
+      weakest = i;
+  }
+  num_learned_++;
+  if (successors->size() < kMaxSuccessors)
+    successors->push_back(Successor(to, count));
+  else
+    (*successors)[weakest] = Successor(to, count);
+}
+
+
+/**
+ * Queues the likely successors of path.  Caller holds lock_.
+ */
+static void Enqueue(const PathString &path, const unsigned depth) {
+  if (depth > kMaxDepth)
+    return;
+  Model::const_iterator iter = model_->find(path);
+  if (iter == model_->end())
+    return;
+
+  bool added = false;
+  for (unsigned i = 0; i < iter->second.size(); ++i) {
+    const Successor &successor = iter->second[i];
+    if (successor.count < kMinCount)
+      continue;
+    if (queued_->find(successor.path) != queued_->end())
+      continue;
+    if (queue_->size() >= kMaxQueue) {
+      num_dropped_++;
+      continue;
+    }
+    queue_->push_back(Job(successor.path, depth));
+    queued_->insert(successor.path);
+    num_queued_++;
+    added = true;
+  }
+  if (added)
+    pthread_cond_signal(&cond_queue_);
+}
+
+
+static void Prefetch(const Job &job) {
+  catalog::DirectoryEntry dirent;
+  // Chunked files without a bulk version are fetched piece by piece on read
+  if (!catalog_manager_->LookupPath(job.path, catalog::kLookupSole, &dirent) ||
+      !dirent.IsRegular() || dirent.checksum().IsNull())
+  {
+    return;
+  }
+
+  if (cache::Contains(dirent.checksum())) {
+    pthread_mutex_lock(&lock_);
+    num_cached_++;
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+
+  LogCvmfs(kLogPrefetch, kLogDebug, "prefetching %s", job.path.c_str());
+  const int fd = cache::Fetch(dirent, job.path.ToString());
+  pthread_mutex_lock(&lock_);
+  if (fd >= 0) {
+    close(fd);
+    num_fetched_++;
+    // Successors of an already cached file are likely cached, too, so only
+    // freshly downloaded files are followed further
+    Enqueue(job.path, job.depth + 1);
+  } else {
+    num_failed_++;
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+
+static void *MainPrefetch(void *data __attribute__((unused))) {
+  LogCvmfs(kLogPrefetch, kLogDebug, "starting prefetch thread");
+  cache::SetDownloadPriority(download::kPriorityBulk);
+  while (true) {
+    pthread_mutex_lock(&lock_);
+    while (queue_->empty() && !stop_)
+      pthread_cond_wait(&cond_queue_, &lock_);
+    if (stop_) {
+      pthread_mutex_unlock(&lock_);
+      break;
+    }
+    const Job job = queue_->front();
+    queue_->erase(queue_->begin());
+    queued_->erase(job.path);
+    pthread_mutex_unlock(&lock_);
+
+    Prefetch(job);
+  }
+  LogCvmfs(kLogPrefetch, kLogDebug, "stopping prefetch thread");
+  return NULL;
+}
+
+
+static void LoadModel() {
+  FILE *f = fopen(model_path_->c_str(), "r");
+  if (!f) {
+    LogCvmfs(kLogPrefetch, kLogDebug, "no prefetch model at %s",
+             model_path_->c_str());
+    return;
+  }
+
+  char buf[2*PATH_MAX + 32];
+  while (fgets(buf, sizeof(buf), f)) {
+    const unsigned length = strlen(buf);
+    if ((length == 0) || (buf[length-1] != '\n'))
+      continue;
+    const vector<string> tokens =
+      SplitString(string(buf, length - 1), '\t');
+    if ((tokens.size() != 3) || tokens[1].empty() || tokens[2].empty())
+      continue;
+    const uint32_t count = String2Uint64(tokens[0]);
+    if (count == 0)
+      continue;
+    Learn(PathString(tokens[1].data(), tokens[1].length()),
+          PathString(tokens[2].data(), tokens[2].length()), count);
+  }
+  fclose(f);
+  LogCvmfs(kLogPrefetch, kLogDebug, "loaded prefetch model for %u paths",
+           model_->size());
+}
+
+
+static void SaveModel() {
+  const string tmp_path = *model_path_ + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "w");
+  if (!f) {
+    LogCvmfs(kLogPrefetch, kLogDebug | kLogSyslog,
+             "failed to write prefetch model (%d)", errno);
+    return;
+  }
+
+  for (Model::const_iterator i = model_->begin(), iEnd = model_->end();
+       i != iEnd; ++i)
+  {
+    for (unsigned j = 0; j < i->second.size(); ++j) {
+      fprintf(f, "%u\t%s\t%s\n", i->second[j].count, i->first.c_str(),
+              i->second[j].path.c_str());
+    }
+  }
+  const bool written = (fclose(f) == 0);
+  if (!written || (rename(tmp_path.c_str(), model_path_->c_str()) != 0)) {
+    LogCvmfs(kLogPrefetch, kLogDebug | kLogSyslog,
+             "failed to write prefetch model (%d)", errno);
+    unlink(tmp_path.c_str());
+  }
+}
+
+
+/**
+ * Loads the learned model from model_path, if it exists.
+ */
+bool Init(catalog::AbstractCatalogManager *catalog_manager,
+          const string &model_path)
+{
+  catalog_manager_ = catalog_manager;
+  model_path_ = new string(model_path);
+  model_ = new Model();
+  last_open_ = new map<pid_t, PathString>();
+  queue_ = new vector<Job>();
+  queued_ = new set<PathString>();
+  stop_ = false;
+  spawned_ = false;
+
+  LoadModel();
+  return true;
+}
+
+
+/**
+ * Starts the prefetch thread, has to run after fork().
+ */
+void Spawn() {
+  int retval = pthread_create(&thread_prefetch_, NULL, MainPrefetch, NULL);
+  assert(retval == 0);
+  spawned_ = true;
+}
+
+
+/**
+ * Stops the prefetch thread and saves the model.  Has to run before the
+ * catalog manager is destroyed.
+ */
+void Fini() {
+  if (spawned_) {
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_signal(&cond_queue_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_prefetch_, NULL);
+    spawned_ = false;
+  }
+
+  SaveModel();
+
+  delete model_path_;
+  delete model_;
+  delete last_open_;
+  delete queue_;
+  delete queued_;
+  model_path_ = NULL;
+  model_ = NULL;
+  last_open_ = NULL;
+  queue_ = NULL;
+  queued_ = NULL;
+  catalog_manager_ = NULL;
+}
+
+
+/**
+ * Called for every successfully opened file.  Learns the transition from the
+ * previous open of the same process and queues the likely successors.
+ */
+void Observe(const pid_t pid, const PathString &path) {
+  // Tabs and line breaks would break the model file
+  const char *chars = path.GetChars();
+  for (unsigned i = 0; i < path.GetLength(); ++i) {
+    if ((chars[i] == '\t') || (chars[i] == '\n'))
+      return;
+  }
+
+  pthread_mutex_lock(&lock_);
+  map<pid_t, PathString>::iterator iter = last_open_->find(pid);
+  if (iter != last_open_->end()) {
+    if (iter->second != path)
+      Learn(iter->second, path, 1);
+    iter->second = path;
+  } else {
+    if (last_open_->size() >= kMaxProcesses)
+      last_open_->clear();
+    (*last_open_)[pid] = path;
+  }
+  Enqueue(path, 1);
+  pthread_mutex_unlock(&lock_);
+}
+
+
+string GetStatistics() {
+  pthread_mutex_lock(&lock_);
+  const string result =
+    "learned paths: " + StringifyInt(model_->size()) +
+    "  transitions: " + StringifyInt(num_learned_) + "\n" +
+    "queued: " + StringifyInt(num_queued_) +
+    "  dropped: " + StringifyInt(num_dropped_) +
+    "  fetched: " + StringifyInt(num_fetched_) +
+    "  already cached: " + StringifyInt(num_cached_) +
+    "  failed: " + StringifyInt(num_failed_) + "\n";
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+}  // namespace prefetch
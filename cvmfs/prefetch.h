@@ -0,0 +1,31 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_PREFETCH_H_
+#define CVMFS_PREFETCH_H_
+
+#include <unistd.h>
+
+#include <string>
+
+#include "shortstring.h"
+
+namespace catalog {
+class AbstractCatalogManager;
+}
+
+namespace prefetch {
+
+bool Init(catalog::AbstractCatalogManager *catalog_manager,
+          const std::string &model_path);
+void Fini();
+void Spawn();
+
+void Observe(const pid_t pid, const PathString &path);
+
+std::string GetStatistics();
+
+}  // namespace prefetch
+
+#endif  // CVMFS_PREFETCH_H_
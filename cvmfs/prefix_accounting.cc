@@ -0,0 +1,206 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Attributes cache hits, misses, downloaded bytes and download time to a
+ * fixed set of path prefixes, in order to see which parts of a repository
+ * make good use of the cache.  A path belongs to the longest prefix that
+ * matches it on a path component boundary, or to the "other" bucket.  The
+ * prefixes are set once at mount time, so that lookups need no locks.
+ *
+ * Objects fetched on behalf of several files, e.g. shared chunks, count for
+ * the file that triggered the fetch.  A request that waited for the download
+ * of another thread counts as a hit.
+ */
+
+#include "cvmfs_config.h"
+#include "prefix_accounting.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "logging.h"
+#include "metrics.h"
+#include "sharded_counter.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace prefix_accounting {
+
+const unsigned kMaxPrefixes = 32;
+
+struct Bucket {
+  explicit Bucket(const string &p) : prefix(p) { }
+
+  string prefix;  /**< Without trailing slash, empty for the other bucket */
+  ShardedCounter num_hits;
+  ShardedCounter num_misses;
+  ShardedCounter transferred_bytes;
+  ShardedCounter download_us;
+};
+
+/**
+ * Sorted by decreasing prefix length, the last bucket is the other bucket
+ */
+vector<Bucket *> *buckets_ = NULL;
+
+
+static bool LongerPrefix(const Bucket *a, const Bucket *b) {
+  return a->prefix.length() > b->prefix.length();
+}
+
+
+/**
+ * Takes a colon separated list of absolute paths below the repository root.
+ */
+bool Init(const string &prefixes) {
+  vector<string> paths = SplitString(prefixes, ':');
+  vector<Bucket *> *buckets = new vector<Bucket *>();
+  for (unsigned i = 0; i < paths.size(); ++i) {
+    string path = paths[i];
+    while ((path.length() > 1) && (path[path.length()-1] == '/'))
+      path.erase(path.length()-1);
+    if (path.empty())
+      continue;
+    if ((path[0] != '/') || (path == "/") ||
+        (path.find("//") != string::npos))
+    {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "invalid cache report prefix %s", path.c_str());
+      continue;
+    }
+    bool duplicate = false;
+    for (unsigned j = 0; j < buckets->size(); ++j)
+      duplicate |= ((*buckets)[j]->prefix == path);
+    if (duplicate)
+      continue;
+    if (buckets->size() == kMaxPrefixes) {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "more than %u cache report prefixes, ignoring %s",
+               kMaxPrefixes, path.c_str());
+      continue;
+    }
+    buckets->push_back(new Bucket(path));
+  }
+  if (buckets->empty()) {
+    delete buckets;
+    return false;
+  }
+  stable_sort(buckets->begin(), buckets->end(), LongerPrefix);
+  buckets->push_back(new Bucket(""));
+  buckets_ = buckets;
+  LogCvmfs(kLogCache, kLogDebug, "cache report on %u prefixes",
+           unsigned(buckets->size() - 1));
+  return true;
+}
+
+
+void Fini() {
+  if (!buckets_)
+    return;
+  for (unsigned i = 0; i < buckets_->size(); ++i)
+    delete (*buckets_)[i];
+  delete buckets_;
+  buckets_ = NULL;
+}
+
+
+bool IsEnabled() {
+  return buckets_ != NULL;
+}
+
+
+static Bucket *FindBucket(const string &cvmfs_path) {
+  const unsigned num_prefixes = buckets_->size() - 1;
+  for (unsigned i = 0; i < num_prefixes; ++i) {
+    const string &prefix = (*buckets_)[i]->prefix;
+    if ((cvmfs_path.length() >= prefix.length()) &&
+        (cvmfs_path.compare(0, prefix.length(), prefix) == 0) &&
+        ((cvmfs_path.length() == prefix.length()) ||
+         (cvmfs_path[prefix.length()] == '/')))
+    {
+      return (*buckets_)[i];
+    }
+  }
+  return (*buckets_)[num_prefixes];
+}
+
+
+void RecordHit(const string &cvmfs_path) {
+  if (!buckets_)
+    return;
+  FindBucket(cvmfs_path)->num_hits.Inc();
+}
+
+
+void RecordMiss(const string &cvmfs_path, const uint64_t bytes,
+                const uint64_t download_us)
+{
+  if (!buckets_)
+    return;
+  Bucket *bucket = FindBucket(cvmfs_path);
+  bucket->num_misses.Inc();
+  bucket->transferred_bytes.Xadd(bytes);
+  bucket->download_us.Xadd(download_us);
+}
+
+
+string GetStatistics() {
+  if (!buckets_)
+    return "";
+  string result;
+  for (unsigned i = 0; i < buckets_->size(); ++i) {
+    Bucket *bucket = (*buckets_)[i];
+    const int64_t num_hits = bucket->num_hits.Get();
+    const int64_t num_misses = bucket->num_misses.Get();
+    const int64_t num_requests = num_hits + num_misses;
+    result += "  " + (bucket->prefix.empty() ?
+                      string("(other)") : bucket->prefix) +
+      ": hits " + StringifyInt(num_hits) +
+      "  misses " + StringifyInt(num_misses) + " (" +
+      StringifyInt((num_requests == 0) ? 0 : num_misses*100 / num_requests) +
+      "%)  downloaded " +
+      StringifyInt(bucket->transferred_bytes.Get() / 1024) + " kB in " +
+      StringifyInt(bucket->download_us.Get() / 1000) + " ms\n";
+  }
+  return result;
+}
+
+
+static string PrefixLabel(const Bucket *bucket) {
+  return MetricsWriter::Label("prefix",
+    bucket->prefix.empty() ? string("other") : bucket->prefix);
+}
+
+
+void GetMetrics(MetricsWriter *metrics) {
+  if (!buckets_)
+    return;
+  for (unsigned i = 0; i < buckets_->size(); ++i) {
+    metrics->Counter("cache_prefix_hits_total",
+                     "Objects found in the cache, by path prefix",
+                     (*buckets_)[i]->num_hits.Get(),
+                     PrefixLabel((*buckets_)[i]));
+  }
+  for (unsigned i = 0; i < buckets_->size(); ++i) {
+    metrics->Counter("cache_prefix_misses_total",
+                     "Objects downloaded into the cache, by path prefix",
+                     (*buckets_)[i]->num_misses.Get(),
+                     PrefixLabel((*buckets_)[i]));
+  }
+  for (unsigned i = 0; i < buckets_->size(); ++i) {
+    metrics->Counter("cache_prefix_downloaded_bytes_total",
+                     "Bytes transferred on cache misses, by path prefix",
+                     (*buckets_)[i]->transferred_bytes.Get(),
+                     PrefixLabel((*buckets_)[i]));
+  }
+  for (unsigned i = 0; i < buckets_->size(); ++i) {
+    metrics->Counter("cache_prefix_download_us_total",
+                     "Time spent downloading cache misses, by path prefix",
+                     (*buckets_)[i]->download_us.Get(),
+                     PrefixLabel((*buckets_)[i]));
+  }
+}
+
+}  // namespace prefix_accounting
@@ -0,0 +1,29 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_PREFIX_ACCOUNTING_H_
+#define CVMFS_PREFIX_ACCOUNTING_H_
+
+#include <stdint.h>
+
+#include <string>
+
+class MetricsWriter;
+
+namespace prefix_accounting {
+
+bool Init(const std::string &prefixes);
+void Fini();
+bool IsEnabled();
+
+void RecordHit(const std::string &cvmfs_path);
+void RecordMiss(const std::string &cvmfs_path, const uint64_t bytes,
+                const uint64_t download_us);
+
+std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
+
+}  // namespace prefix_accounting
+
+#endif  // CVMFS_PREFIX_ACCOUNTING_H_
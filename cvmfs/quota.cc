@@ -5,11 +5,37 @@
  * This way, we are able to track access times of files in the cache
  * and remove files based on least recently used strategy.
  *
- * We setup another SQLite catalog, a "cache catalog", that helps us
- * in the bookkeeping of files, file sizes and access times.
+ * The bookkeeping of files, file sizes and access times is kept in memory,
+ * in a map of the cached objects and an index of their access sequence
+ * numbers.  Changes are appended to a journal, which is compacted into a
+ * snapshot from time to time.  The SQLite "cache catalog" is only written on
+ * shutdown for external tools and older versions of cvmfs; it is imported if
+ * it is newer than the snapshot.  Without either of them, the index is rebuilt
+ * from the cache directory in the background, cleanups are deferred until the
+ * rebuild is finished.
  *
  * We might choose to not manage the local cache.  This is indicated
  * by limit == 0 and everything succeeds in that case.
+ *
+ * Once the cache grows above a high watermark halfway between the cleanup
+ * threshold and the limit, the command server evicts a few objects at a time
+ * in between commands, until the cache is back at the cleanup threshold.  The
+ * evicted files are unlinked by the evictor thread.  A synchronous cleanup
+ * only happens if an insert does not fit at all.
+ *
+ * The eviction order is given by the policy: plain LRU, a scan resistant 2Q
+ * variant that evicts objects which were not accessed again since their
+ * insert first, or a GreedyDual-Size-Frequency variant that prefers to keep
+ * small and frequently used objects.
+ *
+ * In shared mode, a single cache manager process serves all the repositories
+ * that use the same cache directory.  A pinned catalog stays pinned until the
+ * last of the cvmfs processes that pinned it unpins it or terminates.
+ * Repositories can register a soft share of the cache, above which their
+ * objects are evicted first, and a guaranteed minimum.
+ * Touches, inserts, and unpins are queued in a ring buffer in shared memory,
+ * the pipe only wakes up an idle cache manager.  Commands that need an answer,
+ * and all commands if the ring is full or not available, go through the pipe.
  */
 
 #define __STDC_LIMIT_MACROS
@@ -21,37 +47,51 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/dir.h>
-#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
 
 #include <cassert>
+#include <climits>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
+#include <algorithm>
+#include <deque>
 #include <string>
 #include <vector>
 #include <map>
 #include <set>
 
 #include "platform.h"
+#include "atomic.h"
 #include "logging.h"
 #include "duplex_sqlite3.h"
 #include "hash.h"
 #include "util.h"
+#include "quota_ring.h"
 #include "smalloc.h"
 #include "cvmfs.h"
 #include "monitor.h"
+#include "cache.h"
 
 using namespace std;  // NOLINT
 
 namespace quota {
   
-static void GetLimits(uint64_t *limit, uint64_t *cleanup_threshold);
+static bool GetLimits(uint64_t *limit, uint64_t *cleanup_threshold);
+static void TrimCache();
+static void MergeRebuild(const bool force);
+static void CompleteCacheFilter();
 
 /**
  * Loaded catalogs are pinned in the LRU and have to be treated differently.
@@ -69,13 +109,24 @@ enum CommandType {
   kUnpin,
   kRemove,
   kCleanup,
-  kList,
-  kListPinned,
-  kListCatalogs,
+  kListPage,
   kStatus,
   kLimits,
+  kWakeup,
+  kStatistics,
+  kRegister,
+  kListRepos,
+};
+
+enum EvictionPolicy {
+  kPolicyLru = 0,
+  kPolicy2q,
+  kPolicySize,
+  kNumPolicies,
 };
 
+const char *kPolicyNames[] = {"lru", "2q", "size"};
+
 struct LruCommand {
   CommandType command_type;
   uint64_t size;
@@ -83,6 +134,15 @@ struct LruCommand {
   unsigned char digest[hash::kMaxDigestSize];
   uint16_t path_length;  // Maximum 512-sizeof(LruCommand) in order to guarantee
                          // atomic pipe operations
+  pid_t pid;  // Owner of a pin, for reservations and unpinning
+  uint64_t guarantee;  // Minimum share, for registering a repository
+  uint16_t repo;  // Repository of inserts and touches, see kRegister
+  // Listings return up to size entries matching the filter, see ListFilter
+  uint64_t min_size;
+  uint64_t max_size;
+  uint64_t min_idle;
+  ListSelection selection;
+  bool resume;  // Listing continues after the entry given by digest
 };
 
 /**
@@ -90,13 +150,58 @@ struct LruCommand {
  */
 const unsigned kSqliteMemPerThread = 2*1024*1024;
 const unsigned kCommandBufferSize = 32;
-const unsigned kMaxCvmfsPath = 512-sizeof(LruCommand);
+const unsigned kMaxCvmfsPath = kRingDataSize-sizeof(LruCommand);
+
+const uint32_t kRingMagic = 0x43524e47;
+const uint32_t kRingVersion = 4;
+/**
+ * Revision of the commands and of the LruCommand layout between clients and
+ * the shared cache manager.  Has to be increased on every change.  The
+ * cache manager publishes it in the cachemgr.protocol file of the cache
+ * directory; clients refuse to connect to a cache manager of another
+ * revision.
+ */
+const unsigned kProtocolRevision = 1;
+/**
+ * A client gives up on a reply after kReplyTimeoutMs or as soon as the cache
+ * manager is gone, whichever comes first.
+ */
+const int kReplyPollMs = 1000;
+const int kReplyTimeoutMs = 120000;
+const unsigned kRingSlots = 1024;
+/**
+ * A slot claimed but not published for this long is skipped, its producer
+ * presumably died.
+ */
+const int kRingTimeoutMs = 1000;
+/**
+ * Background trimming evicts at most kTrimBatch objects every kTrimIntervalMs.
+ */
+const unsigned kTrimBatch = 64;
+const int kTrimIntervalMs = 50;
+/**
+ * Touches of the same object within kTouchWindowMs are sent only once.
+ */
+const unsigned kTouchBufferSize = 128;
+const uint64_t kTouchWindowMs = 1000;
+/**
+ * A page of a listing has at most kListPageSize entries.  In order to not
+ * stall the command server on strict filters, it ends after kListScanLimit
+ * visited entries even if it is not full.
+ */
+const unsigned kListPageSize = 1024;
+const unsigned kListScanLimit = 32*1024;
 
 pthread_t thread_lru_;
 int pipe_lru_[2];
 bool shared_;
 bool spawned_;
 map<hash::Any, uint64_t> *pinned_chunks_ = NULL;
+/**
+ * Processes that hold a pin.  Pins taken before the command server is spawned
+ * have no owner.
+ */
+map<hash::Any, set<pid_t> > *pin_owners_ = NULL;
 int fd_lock_cachedb_;
 
 uint64_t limit_;  /**< If the cache grows above this size,
@@ -109,16 +214,209 @@ uint64_t seq_;  /**< Current access sequence number.  Gets increased on every
                      access/insert operation. */
 string *cache_dir_ = NULL;
 
-sqlite3 *db_ = NULL;
-sqlite3_stmt *stmt_touch_ = NULL;
-sqlite3_stmt *stmt_unpin_ = NULL;
-sqlite3_stmt *stmt_new_ = NULL;
-sqlite3_stmt *stmt_lru_ = NULL;
-sqlite3_stmt *stmt_size_ = NULL;
-sqlite3_stmt *stmt_rm_ = NULL;
-sqlite3_stmt *stmt_list_ = NULL;
-sqlite3_stmt *stmt_list_pinned_ = NULL;  /**< Loaded catalogs are pinned. */
-sqlite3_stmt *stmt_list_catalogs_ = NULL;
+RingHeader *ring_ = NULL;
+RingSlot *ring_slots_ = NULL;
+uint64_t ring_head_ = 0;  /**< Next position of the consumer */
+/**
+ * A pipe command that arrived while earlier commands were still in the ring
+ */
+bool has_pending_ = false;
+uint64_t pending_mark_ = 0;
+LruCommand pending_command_;
+char pending_path_[kMaxCvmfsPath];
+/**
+ * Reply FIFO of a shared cache client, created once and reused under
+ * lock_return_pipe_.
+ */
+int return_pipe_[2] = {-1, -1};
+/**
+ * The client keeps a writer of its own reply FIFO, so that reads block
+ * instead of returning end-of-file while the cache manager is not connected.
+ */
+int return_pipe_writer_ = -1;
+bool return_pipe_broken_ = false;  /**< A reply was abandoned */
+pthread_mutex_t lock_return_pipe_ = PTHREAD_MUTEX_INITIALIZER;
+uint64_t ring_stuck_since_ = 0;  /**< Head slot claimed but not published */
+
+vector<hash::Any> *touch_buffer_ = NULL;  /**< Touches not yet sent */
+set<hash::Any> *touch_set_ = NULL;
+uint64_t touch_window_start_ = 0;
+uint64_t num_touches_ = 0;
+uint64_t num_touches_sent_ = 0;
+pthread_mutex_t lock_touch_ = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Sends buffered touches once their window expired, even if no further
+ * commands follow.
+ */
+pthread_t thread_touch_;
+bool touch_flusher_running_ = false;
+bool touch_flusher_terminate_ = false;
+pthread_cond_t cond_touch_ = PTHREAD_COND_INITIALIZER;
+
+bool trimming_ = false;  /**< Above the high watermark, evicting */
+uint64_t last_trim_ = 0;
+/**
+ * Evicted objects whose files are not yet unlinked.  An object that is
+ * inserted again in the meantime is taken out.
+ */
+set<hash::Any> *trash_ = NULL;
+pthread_t thread_evictor_;
+bool evictor_running_ = false;
+bool evictor_terminate_ = false;
+pthread_mutex_t lock_evictor_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_evictor_ = PTHREAD_COND_INITIALIZER;
+
+/**
+ * An object in the cache.  entries_ and lru_order_ are the authoritative
+ * bookkeeping of the cache manager.
+ */
+struct LruEntry {
+  LruEntry()
+    : size(0), seq(0), priority(0), hits(0), type(kFileRegular), pinned(false),
+      repo(0)
+  { }
+  uint64_t size;
+  uint64_t seq;  /**< Access sequence number */
+  uint64_t priority;  /**< Given by the eviction policy, see GetPriority() */
+  uint32_t hits;  /**< Accesses since the insert */
+  FileTypes type;
+  bool pinned;
+  uint16_t repo;  /**< Index in repos_, 0 if not known */
+  string path;
+};
+
+/**
+ * A file found in the cache directory during a rebuild
+ */
+struct CachedFile {
+  CachedFile(const hash::Any &h, const uint64_t s, const time_t t)
+    : hash(h), size(s), atime(t) { }
+  hash::Any hash;
+  uint64_t size;
+  time_t atime;
+};
+
+/**
+ * Objects are evicted in the order of priority, then access sequence.
+ */
+typedef pair<uint64_t, uint64_t> EvictionKey;
+
+/**
+ * A repository using the cache.  Above its soft share, its objects are
+ * evicted first.  Below its guarantee, its objects are only evicted if an
+ * insert does not fit otherwise.  An object used by several repositories
+ * counts for the one that inserted it.
+ */
+struct RepoShare {
+  RepoShare() : share(0), guarantee(0), size(0) { }
+  string name;
+  uint64_t share;
+  uint64_t guarantee;
+  uint64_t size;
+  map<EvictionKey, hash::Any> order;  /**< Next victim first */
+};
+
+enum JournalOp {
+  kJournalInsert = 0,
+  kJournalTouch,
+  kJournalRemove,
+};
+
+/**
+ * A change in the journal or an entry in the snapshot.  Inserts are followed
+ * by path_length bytes of path.  Both files are in host byte order, they
+ * belong to the local cache.
+ */
+struct JournalRecord {
+  uint64_t size;
+  uint64_t seq;
+  uint32_t hits;
+  unsigned char digest[hash::kMaxDigestSize];
+  uint16_t path_length;
+  unsigned char op;
+  unsigned char type;
+};
+
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;  /**< Next sequence number, set in the snapshot */
+  uint64_t num_entries;  /**< Number of records in the snapshot */
+};
+
+const uint32_t kJournalMagic = 0x4c52554a;
+const uint32_t kSnapshotMagic = 0x4c525553;
+const uint32_t kJournalVersion = 2;
+/**
+ * The journal is compacted once it has more records than the index has
+ * entries, but not before it reaches this number of records.
+ */
+const uint64_t kMinJournalRecords = 16384;
+const unsigned kSnapshotBufferSize = 1024*1024;
+
+/**
+ * 2Q evicts from the objects that were not accessed again since their insert
+ * as long as they take more than 1/kProbationShare of the cache.
+ */
+const unsigned kProbationShare = 4;
+const uint64_t kSizeScale = 1024*1024;
+const uint32_t kMaxHits = 1024*1024;
+/**
+ * Recently evicted objects, used to count objects that are fetched again
+ */
+const unsigned kMaxGhosts = 16384;
+
+map<hash::Any, LruEntry> *entries_ = NULL;
+map<EvictionKey, hash::Any> *lru_order_ = NULL;  /**< Next victim first */
+/**
+ * Known repositories of the cache manager, the first one collects the objects
+ * of unknown origin, e.g. after a restart.
+ */
+deque<RepoShare> *repos_ = NULL;
+uint16_t repo_id_ = 0;  /**< Of this cvmfs process */
+EvictionPolicy policy_ = kPolicyLru;
+uint64_t probation_size_ = 0;  /**< 2Q: objects not accessed since insert */
+uint64_t size_clock_ = 0;  /**< Size policy: priority of the last victim */
+set<hash::Any> *ghosts_ = NULL;
+deque<hash::Any> *ghost_order_ = NULL;
+uint64_t num_hits_ = 0;
+uint64_t num_misses_ = 0;
+uint64_t num_evictions_ = 0;
+uint64_t num_refetches_ = 0;  /**< Misses of recently evicted objects */
+/**
+ * The rebuild of the index from the cache directory runs in the background.
+ * Scanner threads stat the sub-directories in parallel, the command server
+ * merges the files they found in between commands.
+ */
+const unsigned kRebuildThreads = 8;
+const int kRebuildIntervalMs = 100;
+/**
+ * Rebuilt entries get their sequence numbers from the access time, so that
+ * they come before the accesses made during the rebuild.
+ */
+const unsigned kRebuildSeqShift = 24;
+
+bool rebuilding_ = false;  /**< Index incomplete, eviction deferred */
+vector<pthread_t> *rebuild_threads_ = NULL;
+vector<CachedFile> *rebuild_files_ = NULL;  /**< Scanned but not merged */
+set<string> *rebuild_catalogs_ = NULL;
+unsigned rebuild_next_dir_ = 0;
+unsigned rebuild_num_running_ = 0;
+bool rebuild_abort_ = false;
+uint64_t rebuild_start_ = 0;  /**< In seconds */
+uint64_t rebuild_counter_ = 0;
+uint64_t last_merge_ = 0;
+pthread_mutex_t lock_rebuild_ = PTHREAD_MUTEX_INITIALIZER;
+int fd_journal_ = -1;
+string *journal_buffer_ = NULL;  /**< Records of the current command bunch */
+uint64_t num_journal_records_ = 0;  /**< Since the last snapshot */
+
+
+static uint64_t GetTimeMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return static_cast<uint64_t>(now.tv_sec)*1000 + now.tv_usec/1000;
+}
 
  
 static void MakeReturnPipe(int pipe[2]) {
@@ -126,26 +424,39 @@ static void MakeReturnPipe(int pipe[2]) {
     MakePipe(pipe);
     return;
   }
-  
-  // Create FIFO in cache directory, store path name (number) in pipe write end
-  int i = 0;
-  int retval;
-  do {
-    retval = mkfifo((*cache_dir_ + "/pipe" + StringifyInt(i)).c_str(), 0600);
-    pipe[1] = i;
-    i++;
-  } while ((retval == -1) && (errno == EEXIST));
-  assert(retval == 0);
-  
-  // Connect reader's end
-  pipe[0] = open((*cache_dir_ + "/pipe" + StringifyInt(pipe[1])).c_str(), 
-                 O_RDONLY | O_NONBLOCK);
-  assert(pipe[0] >= 0);
-  Nonblock2Block(pipe[0]);
+
+  pthread_mutex_lock(&lock_return_pipe_);
+  if (return_pipe_[0] < 0) {
+    // Create FIFO in cache directory, store path name (number) in write end
+    int i = 0;
+    int retval;
+    do {
+      retval = mkfifo((*cache_dir_ + "/pipe" + StringifyInt(i)).c_str(), 0600);
+      return_pipe_[1] = i;
+      i++;
+    } while ((retval == -1) && (errno == EEXIST));
+    assert(retval == 0);
+
+    // Connect reader's end
+    return_pipe_[0] =
+      open((*cache_dir_ + "/pipe" + StringifyInt(return_pipe_[1])).c_str(),
+           O_RDONLY | O_NONBLOCK);
+    assert(return_pipe_[0] >= 0);
+    Nonblock2Block(return_pipe_[0]);
+    return_pipe_writer_ =
+      open((*cache_dir_ + "/pipe" + StringifyInt(return_pipe_[1])).c_str(),
+           O_WRONLY);
+    assert(return_pipe_writer_ >= 0);
+  }
+  pipe[0] = return_pipe_[0];
+  pipe[1] = return_pipe_[1];
 }
   
   
-// TODO: make sure that a broken return pipe does not kill the cache manager
+/**
+ * If the client abandoned its reply FIFO in the meantime, the reply goes to
+ * /dev/null instead.
+ */
 static int BindReturnPipe(int pipe_wronly) {
   if (!shared_)
     return pipe_wronly;
@@ -153,7 +464,13 @@ static int BindReturnPipe(int pipe_wronly) {
   // Connect writer's end
   int result = open((*cache_dir_ + "/pipe" + StringifyInt(pipe_wronly)).c_str(), 
                     O_WRONLY | O_NONBLOCK);
-  assert(result >= 0);
+  if (result < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "reply FIFO %d is gone (%d)",
+             pipe_wronly, errno);
+    result = open("/dev/null", O_WRONLY);
+    assert(result >= 0);
+    return result;
+  }
   Nonblock2Block(result);
   return result;
 }
@@ -165,327 +482,1550 @@ static void UnbindReturnPipe(int pipe_wronly) {
 }
   
   
+/**
+ * In shared mode, the reply FIFO stays open for the next request.
+ */
+static void DestroyReturnPipe() {
+  if (return_pipe_[0] < 0)
+    return;
+  close(return_pipe_[0]);
+  close(return_pipe_writer_);
+  unlink((*cache_dir_ + "/pipe" + StringifyInt(return_pipe_[1])).c_str());
+  return_pipe_[0] = return_pipe_[1] = return_pipe_writer_ = -1;
+}
+
+
+/**
+ * A late reply must not end up as the answer to the next request, so an
+ * abandoned reply FIFO is replaced.
+ */
 static void CloseReturnPipe(int pipe[2]) {
   if (shared_) {
-    close(pipe[0]);
-    unlink((*cache_dir_ + "/pipe" + StringifyInt(pipe[1])).c_str());
+    if (return_pipe_broken_) {
+      DestroyReturnPipe();
+      return_pipe_broken_ = false;
+    }
+    pthread_mutex_unlock(&lock_return_pipe_);
+  } else if (return_pipe_broken_) {
+    // The command server thread may still write to it
+    return_pipe_broken_ = false;
   } else {
     ClosePipe(pipe);
   }
 }
-  
-  
-static bool DoCleanup(const uint64_t leave_size) {
-  if ((limit_ == 0) || (gauge_ <= leave_size))
-    return true;
 
-  // TODO transaction
-  LogCvmfs(kLogQuota, kLogSyslog,
-           "cleanup cache until %lu KB are free", leave_size/1024);
-  LogCvmfs(kLogQuota, kLogDebug, "gauge %"PRIu64, gauge_);
 
-  bool result;
-  string hash_str;
-  vector<string> trash;
+/**
+ * The read end of the command pipe is closed if the cache manager died.
+ */
+static bool IsManagerAlive() {
+  struct pollfd watch_pipe;
+  watch_pipe.fd = pipe_lru_[1];
+  watch_pipe.events = POLLOUT;
+  watch_pipe.revents = 0;
+  if (poll(&watch_pipe, 1, 0) < 0)
+    return true;
+  return (watch_pipe.revents & (POLLERR | POLLHUP | POLLNVAL)) == 0;
+}
 
-  do {
-    sqlite3_reset(stmt_lru_);
-    if (sqlite3_step(stmt_lru_) != SQLITE_ROW) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not get lru-entry");
-      break;
-    }
 
-    hash_str = string(reinterpret_cast<const char *>(
-                      sqlite3_column_text(stmt_lru_, 0)));
-    LogCvmfs(kLogQuota, kLogDebug, "removing %s", hash_str.c_str());
-    hash::Any hash(hash::kSha1, hash::HexPtr(
-      hash_str.substr(0, 2*hash::kDigestSizes[hash::kSha1])));
-    if (pinned_chunks_->find(hash) != pinned_chunks_->end())
+/**
+ * Reads nbyte bytes of a reply of the cache manager.  Unlike ReadPipe(), it
+ * does not block forever if the cache manager died or does not answer.
+ *
+ * \return false if the reply did not arrive, the reply pipe is abandoned then
+ */
+static bool ReadReply(int fd, void *buf, size_t nbyte) {
+  size_t num_read = 0;
+  int waited_ms = 0;
+  while (num_read < nbyte) {
+    struct pollfd watch_reply;
+    watch_reply.fd = fd;
+    watch_reply.events = POLLIN;
+    watch_reply.revents = 0;
+    const int retval = poll(&watch_reply, 1, kReplyPollMs);
+    if ((retval < 0) && (errno == EINTR))
       continue;
-
-    trash.push_back((*cache_dir_) + hash.MakePath(1, 2));
-    gauge_ -= sqlite3_column_int64(stmt_lru_, 1);
-    LogCvmfs(kLogQuota, kLogDebug, "lru cleanup %s, new gauge %"PRIu64,
-             hash_str.c_str(), gauge_);
-
-    sqlite3_bind_text(stmt_rm_, 1, &hash_str[0], hash_str.length(),
-                      SQLITE_STATIC);
-    result = (sqlite3_step(stmt_rm_) == SQLITE_DONE);
-    sqlite3_reset(stmt_rm_);
-
-    if (!result) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not remove lru-entry");
-      return false;
+    if (retval == 0) {
+      waited_ms += kReplyPollMs;
+      if (IsManagerAlive() && (waited_ms < kReplyTimeoutMs))
+        continue;
     }
-  } while (gauge_ > leave_size);
-
-  // Double fork avoids zombie, forked removal process must not flush file
-  // buffers
-  if (!trash.empty()) {
-    pid_t pid;
-    int statloc;
-    if ((pid = fork()) == 0) {
-      if (fork() == 0) {
-        for (unsigned i = 0, iEnd = trash.size(); i < iEnd; ++i) {
-          LogCvmfs(kLogQuota, kLogDebug, "unlink %s", trash[i].c_str());
-          unlink(trash[i].c_str());
-        }
-        _exit(0);
+    if (retval > 0) {
+      const ssize_t num_bytes =
+        read(fd, static_cast<char *>(buf) + num_read, nbyte - num_read);
+      if ((num_bytes < 0) && (errno == EINTR))
+        continue;
+      if (num_bytes > 0) {
+        num_read += num_bytes;
+        continue;
       }
-      _exit(0);
-    } else {
-      if (pid > 0)
-        waitpid(pid, &statloc, 0);
-      else
-        return false;
     }
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "no reply from the cache manager in %s", cache_dir_->c_str());
+    return_pipe_broken_ = true;
+    return false;
   }
-
-  return gauge_ <= leave_size;
+  return true;
 }
 
 
-static bool Contains(const string &hash_str) {
-  bool result = false;
+static string GetProtocolPath() {
+  return *cache_dir_ + "/cachemgr.protocol";
+}
 
-  sqlite3_bind_text(stmt_size_, 1, &hash_str[0], hash_str.length(),
-                    SQLITE_STATIC);
-  if (sqlite3_step(stmt_size_) == SQLITE_ROW)
-    result = true;
-  sqlite3_reset(stmt_size_);
-  LogCvmfs(kLogQuota, kLogDebug, "contains %s returns %d",
-           hash_str.c_str(), result);
 
-  return result;
+/**
+ * Published by the shared cache manager before it listens on its FIFO.
+ */
+static void WriteProtocolRevision() {
+  const string path = GetProtocolPath();
+  const string tmp_path = path + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "w");
+  if (f == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to write %s (%d)",
+             tmp_path.c_str(), errno);
+    return;
+  }
+  fprintf(f, "%u %d\n", kProtocolRevision, getpid());
+  fclose(f);
+  rename(tmp_path.c_str(), path.c_str());
 }
 
 
-static void ProcessCommandBunch(const unsigned num,
-                                const LruCommand *commands, const char *paths)
-{
-  int retval = sqlite3_exec(db_, "BEGIN", NULL, NULL, NULL);
-  assert(retval == SQLITE_OK);
+/**
+ * A cache manager that predates the protocol file or that runs another
+ * revision does not understand our commands.  A left-over file of a dead
+ * cache manager does not count.
+ */
+static bool CheckProtocolRevision() {
+  FILE *f = fopen(GetProtocolPath().c_str(), "r");
+  unsigned revision = 0;
+  int pid = 0;
+  bool found = false;
+  if (f != NULL) {
+    found = (fscanf(f, "%u %d", &revision, &pid) == 2);
+    fclose(f);
+  }
+  if (found && (pid > 0) && ((kill(pid, 0) == 0) || (errno == EPERM)) &&
+      (revision == kProtocolRevision))
+  {
+    return true;
+  }
+  LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+           "cache manager in %s speaks protocol revision %u, "
+           "revision %u is required; restart it", cache_dir_->c_str(),
+           found ? revision : 0, kProtocolRevision);
+  return false;
+}
 
-  for (unsigned i = 0; i < num; ++i) {
-    const hash::Any hash(hash::kSha1, commands[i].digest,
-                         sizeof(commands[i].digest));
-    const string hash_str = hash.ToString();
-    const unsigned size = commands[i].size;
-    LogCvmfs(kLogQuota, kLogDebug, "processing %s (%d)",
-             hash_str.c_str(), commands[i].command_type);
 
-    bool exists;
-    switch (commands[i].command_type) {
-      case kTouch:
-        sqlite3_bind_int64(stmt_touch_, 1, seq_++);
-        sqlite3_bind_text(stmt_touch_, 2, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        retval = sqlite3_step(stmt_touch_);
-        LogCvmfs(kLogQuota, kLogDebug, "touching %s (%ld): %d",
-                 hash_str.c_str(), seq_-1, retval);
-        errno = retval;
-        assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-        sqlite3_reset(stmt_touch_);
-        break;
-      case kUnpin:
-        sqlite3_bind_text(stmt_unpin_, 1, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        retval = sqlite3_step(stmt_unpin_);
-        LogCvmfs(kLogQuota, kLogDebug, "unpinning %s: %d",
-                 hash_str.c_str(), retval);
-        errno = retval;
-        assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-        sqlite3_reset(stmt_unpin_);
-        break;
-      case kPin:
-      case kInsert:
-        // It could already be in, check
-        exists = Contains(hash_str);
-
-        // Cleanup, move to trash and unlink
-        if (!exists && (gauge_ + size > limit_)) {
-          LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
-                   gauge_, size);
-          retval = DoCleanup(cleanup_threshold_);
-          assert(retval != 0);
-        }
+/**
+ * The ring is named after the cache directory, which is the rendezvous point
+ * of the shared cache manager.
+ */
+static string GetRingName() {
+  platform_stat64 info;
+  if (platform_stat(cache_dir_->c_str(), &info) != 0)
+    return "";
+  return "/cvmfs.cachemgr." + StringifyInt(info.st_dev) + "." +
+         StringifyInt(info.st_ino);
+}
 
-        // Insert or replace
-        sqlite3_bind_text(stmt_new_, 1, &hash_str[0], hash_str.length(),
-                          SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_new_, 2, size);
-        sqlite3_bind_int64(stmt_new_, 3, seq_++);
-        sqlite3_bind_text(stmt_new_, 4, &paths[i*kMaxCvmfsPath],
-                          commands[i].path_length, SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_new_, 5, (commands[i].command_type == kPin) ?
-                           kFileCatalog : kFileRegular);
-        sqlite3_bind_int64(stmt_new_, 6, (commands[i].command_type == kPin) ?
-                           1 : 0);
-        retval = sqlite3_step(stmt_new_);
-        LogCvmfs(kLogQuota, kLogDebug, "insert or replace %s, pin %d: %d",
-                 hash_str.c_str(), commands[i].command_type, retval);
-        assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-        sqlite3_reset(stmt_new_);
-
-        if (!exists) gauge_ += size;
-        break;
-      default:
-        abort();  // other types should have been taken care of by event loop
-    }
-  }
 
-  retval = sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
-  assert(retval == SQLITE_OK);
+static size_t GetRingSize(const unsigned num_slots) {
+  return sizeof(RingHeader) + num_slots*sizeof(RingSlot);
 }
 
 
 /**
- * Event loop for processing commands.  Most of them are queued, some have
- * to be executed immediately.
+ * Creates the ring of a new shared cache manager.  Without a ring, all
+ * commands go through the pipe.
  */
-static void *MainCommandServer(void *data __attribute__((unused))) {
-  LogCvmfs(kLogQuota, kLogDebug, "starting cache manager");
-  sqlite3_soft_heap_limit(kSqliteMemPerThread);
+static void CreateRing() {
+  const string name = GetRingName();
+  if (name.empty())
+    return;
+  shm_unlink(name.c_str());
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to create command ring (%d)", errno);
+    return;
+  }
+  const size_t size = GetRingSize(kRingSlots);
+  void *area = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (area == MAP_FAILED) {
+    LogCvmfs(kLogQuota, kLogDebug, "failed to map command ring (%d)", errno);
+    shm_unlink(name.c_str());
+    return;
+  }
 
-  LruCommand command_buffer[kCommandBufferSize];
-  char path_buffer[kCommandBufferSize*kMaxCvmfsPath];
-  unsigned num_commands = 0;
+  ring_ = reinterpret_cast<RingHeader *>(area);
+  ring_slots_ = reinterpret_cast<RingSlot *>(ring_ + 1);
+  memset(ring_, 0, sizeof(RingHeader));
+  ring_->version = kRingVersion;
+  ring_->num_slots = kRingSlots;
+  for (unsigned i = 0; i < kRingSlots; ++i)
+    atomic_write64(&ring_slots_[i].seq, i);
+  ring_head_ = 0;
+  // Producers check the magic number last
+  atomic_write32(reinterpret_cast<atomic_int32 *>(&ring_->magic), kRingMagic);
+  LogCvmfs(kLogQuota, kLogDebug, "created command ring %s", name.c_str());
+}
+
+
+static void AttachRing() {
+  const string name = GetRingName();
+  if (name.empty())
+    return;
+  const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "no command ring, using pipe only");
+    return;
+  }
+  const size_t size = GetRingSize(kRingSlots);
+  platform_stat64 info;
+  void *area = MAP_FAILED;
+  if ((platform_fstat(fd, &info) == 0) && (uint64_t(info.st_size) == size))
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (area == MAP_FAILED)
+    return;
 
-  while (read(pipe_lru_[0], &command_buffer[num_commands],
-              sizeof(command_buffer[0])) == sizeof(command_buffer[0]))
+  RingHeader *ring = reinterpret_cast<RingHeader *>(area);
+  if ((atomic_read32(reinterpret_cast<atomic_int32 *>(&ring->magic)) !=
+       int32_t(kRingMagic)) ||
+      (ring->version != kRingVersion) || (ring->num_slots != kRingSlots))
   {
-    const CommandType command_type = command_buffer[num_commands].command_type;
-    LogCvmfs(kLogQuota, kLogDebug, "received command %d", command_type);
-    const uint64_t size = command_buffer[num_commands].size;
+    LogCvmfs(kLogQuota, kLogDebug, "incompatible command ring, using pipe");
+    munmap(area, size);
+    return;
+  }
+  ring_ = ring;
+  ring_slots_ = reinterpret_cast<RingSlot *>(ring_ + 1);
+  LogCvmfs(kLogQuota, kLogDebug, "attached to command ring %s", name.c_str());
+}
 
-    // Inserts and pins come with a cvmfs path
-    if ((command_type == kInsert) || (command_type == kPin)) {
-      const int path_length = command_buffer[num_commands].path_length;
-      ReadPipe(pipe_lru_[0], &path_buffer[kMaxCvmfsPath*num_commands],
-               path_length);
-    }
 
-    // Reservations are handled immediately and "out of band"
-    if (command_type == kReserve) {
-      bool success = true;
-      int return_pipe = 
-        BindReturnPipe(command_buffer[num_commands].return_pipe);
-      const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
-                           sizeof(command_buffer[num_commands].digest));
-      const string hash_str(hash.ToString());
-      LogCvmfs(kLogQuota, kLogDebug, "reserve %d bytes for %s",
-               size, hash_str.c_str());
+static void DetachRing(const bool destroy) {
+  if (ring_ == NULL)
+    return;
+  munmap(ring_, GetRingSize(ring_->num_slots));
+  ring_ = NULL;
+  ring_slots_ = NULL;
+  if (destroy)
+    shm_unlink(GetRingName().c_str());
+}
 
-      if (pinned_chunks_->find(hash) == pinned_chunks_->end()) {
-        if ((cleanup_threshold_ > 0) && (pinned_ + size > cleanup_threshold_)) {
-          LogCvmfs(kLogQuota, kLogDebug,
-                   "failed to insert %s (pinned), no space", hash_str.c_str());
-          success = false;
-        } else {
-          (*pinned_chunks_)[hash] = size;
-          pinned_ += size;
-        }
-      }
 
-      WritePipe(return_pipe, &success, sizeof(success));
-      UnbindReturnPipe(return_pipe);
-      continue;
-    }
+/**
+ * Queues a command of length bytes, the path following the LruCommand.
+ *
+ * \return false if the ring is full or the slot was skipped because the
+ *         caller was stalled for too long
+ */
+static bool PushRing(const void *data, const unsigned length) {
+  int64_t pos;
+  if (!ClaimRingSlot(ring_, ring_slots_, &pos))
+    return false;
+  return PublishRingSlot(ring_, ring_slots_, pos, data, length);
+}
 
-    // Unpinnings are also handled immediately with respect to the pinned gauge
-    if (command_type == kUnpin) {
-      const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
-                           sizeof(command_buffer[num_commands].digest));
-      const string hash_str(hash.ToString());
 
-      map<hash::Any, uint64_t>::iterator iter = pinned_chunks_->find(hash);
-      if (iter != pinned_chunks_->end()) {
-        pinned_ -= iter->second;
-        pinned_chunks_->erase(iter);
-      } else {
-        LogCvmfs(kLogQuota, kLogDebug, "this chunk was not pinned");
-      }
-    }
+/**
+ * Sends a wake-up through the pipe if the cache manager waits for it.
+ */
+static void WakeConsumer() {
+  if (atomic_cas32(&ring_->consumer_waiting, 1, 0)) {
+    LruCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command_type = kWakeup;
+    WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  }
+}
 
-    // Immediate commands trigger flushing of the buffer
-    bool immediate_command = (command_type == kCleanup) ||
-      (command_type == kList) || (command_type == kListPinned) ||
-      (command_type == kListCatalogs) || (command_type == kRemove) ||
-      (command_type == kStatus) || (command_type == kLimits);
-    if (!immediate_command) num_commands++;
 
-    if ((num_commands == kCommandBufferSize) || immediate_command)
-    {
-      ProcessCommandBunch(num_commands, command_buffer, path_buffer);
-      if (!immediate_command) num_commands = 0;
-    }
+/**
+ * Fire-and-forget commands use the ring if possible.
+ */
+static void SendCommand(const LruCommand *cmd, const unsigned length) {
+  if ((ring_ != NULL) && PushRing(cmd, length)) {
+    WakeConsumer();
+    return;
+  }
+  WritePipe(pipe_lru_[1], cmd, length);
+}
 
-    if (immediate_command) {
-      // Process cleanup, listings
-      int return_pipe = 
-        BindReturnPipe(command_buffer[num_commands].return_pipe);
+
+static void InitTouchBuffer() {
+  touch_buffer_ = new vector<hash::Any>();
+  touch_set_ = new set<hash::Any>();
+  touch_window_start_ = 0;
+  num_touches_ = 0;
+  num_touches_sent_ = 0;
+}
+
+
+/**
+ * Sends the buffered touches in as few pipe writes as possible.  Caller holds
+ * lock_touch_.
+ */
+static void FlushTouches() {
+  if (touch_buffer_->empty())
+    return;
+
+  char buffer[PIPE_BUF];
+  unsigned pos = 0;
+  LruCommand cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.command_type = kTouch;
+  cmd.repo = repo_id_;
+  for (unsigned i = 0; i < touch_buffer_->size(); ++i) {
+    memcpy(cmd.digest, (*touch_buffer_)[i].digest,
+           (*touch_buffer_)[i].GetDigestSize());
+    if ((ring_ != NULL) && PushRing(&cmd, sizeof(cmd)))
+      continue;
+    if (pos + sizeof(cmd) > sizeof(buffer)) {
+      WritePipe(pipe_lru_[1], buffer, pos);
+      pos = 0;
+    }
+    memcpy(buffer + pos, &cmd, sizeof(cmd));
+    pos += sizeof(cmd);
+  }
+  if (ring_ != NULL)
+    WakeConsumer();
+  if (pos > 0)
+    WritePipe(pipe_lru_[1], buffer, pos);
+
+  num_touches_sent_ += touch_buffer_->size();
+  touch_buffer_->clear();
+  touch_set_->clear();
+  touch_window_start_ = 0;
+}
+
+
+/**
+ * Commands that depend on the access order flush the touches first.  Inserts
+ * flush them only once the window expired.
+ */
+static void SyncTouches(const bool force) {
+  if (touch_buffer_ == NULL)
+    return;
+  pthread_mutex_lock(&lock_touch_);
+  if (force || (!touch_buffer_->empty() &&
+                (GetTimeMs() >= touch_window_start_ + kTouchWindowMs)))
+  {
+    FlushTouches();
+  }
+  pthread_mutex_unlock(&lock_touch_);
+}
+
+
+static void *MainTouchFlusher(void *data __attribute__((unused))) {
+  LogCvmfs(kLogQuota, kLogDebug, "starting touch flusher");
+  pthread_mutex_lock(&lock_touch_);
+  while (!touch_flusher_terminate_) {
+    const uint64_t deadline_ms = GetTimeMs() + kTouchWindowMs;
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ms / 1000;
+    deadline.tv_nsec = (deadline_ms % 1000) * 1000 * 1000;
+    pthread_cond_timedwait(&cond_touch_, &lock_touch_, &deadline);
+    if (!touch_buffer_->empty() &&
+        (GetTimeMs() >= touch_window_start_ + kTouchWindowMs))
+    {
+      FlushTouches();
+    }
+  }
+  pthread_mutex_unlock(&lock_touch_);
+  LogCvmfs(kLogQuota, kLogDebug, "stopping touch flusher");
+  return NULL;
+}
+
+
+static void StartTouchFlusher() {
+  if (touch_flusher_running_)
+    return;
+  touch_flusher_terminate_ = false;
+  if (pthread_create(&thread_touch_, NULL, MainTouchFlusher, NULL) != 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not create touch flusher thread");
+    return;
+  }
+  touch_flusher_running_ = true;
+}
+
+
+static void StopTouchFlusher() {
+  if (!touch_flusher_running_)
+    return;
+  pthread_mutex_lock(&lock_touch_);
+  touch_flusher_terminate_ = true;
+  pthread_cond_signal(&cond_touch_);
+  pthread_mutex_unlock(&lock_touch_);
+  pthread_join(thread_touch_, NULL);
+  touch_flusher_running_ = false;
+}
+
+
+static bool PopRing(LruCommand *command, char *path) {
+  const RingSlot *slot = PeekRingSlot(ring_, ring_slots_, ring_head_);
+  if (slot == NULL)
+    return false;
+  memcpy(command, slot->data, sizeof(*command));
+  if ((command->command_type == kInsert) || (command->command_type == kPin)) {
+    if (command->path_length > kMaxCvmfsPath)
+      command->path_length = kMaxCvmfsPath;
+    memcpy(path, slot->data + sizeof(*command), command->path_length);
+  }
+  ReleaseRingSlot(ring_, ring_slots_, ring_head_);
+  ring_head_++;
+  ring_stuck_since_ = 0;
+  return true;
+}
+
+
+static bool IsRingEmpty() {
+  return atomic_read64(&ring_->tail) <= int64_t(ring_head_);
+}
+
+
+/**
+ * Skips a slot that was claimed but never published.  If the producer
+ * publishes it after all, nothing is skipped and the next PopRing() gets it.
+ */
+static void SkipRingSlot() {
+  ring_stuck_since_ = 0;
+  if (!AbandonRingSlot(ring_, ring_slots_, ring_head_))
+    return;
+  LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+           "skipping abandoned command ring slot %"PRIu64, ring_head_);
+  ring_head_++;
+}
+
+
+/**
+ * \return false on timeout
+ */
+static bool WaitPipe(const int timeout_ms) {
+  struct pollfd watch_pipe;
+  watch_pipe.fd = pipe_lru_[0];
+  watch_pipe.events = POLLIN;
+  watch_pipe.revents = 0;
+  return poll(&watch_pipe, 1, timeout_ms) != 0;
+}
+
+
+/**
+ * Returns the next command for the command server from the ring or from the
+ * pipe.  Commands that were queued in the ring before a pipe command are
+ * processed first, so that listings and cleanups see the previous inserts.
+ *
+ * \return false if the pipe was closed
+ */
+static bool ReadCommand(LruCommand *command, char *path) {
+  while (true) {
+    TrimCache();
+    MergeRebuild(false);
+    if ((ring_ != NULL) && (!has_pending_ || (ring_head_ < pending_mark_)) &&
+        PopRing(command, path))
+    {
+      return true;
+    }
+    if (has_pending_) {
+      has_pending_ = false;
+      *command = pending_command_;
+      memcpy(path, pending_path_, kMaxCvmfsPath);
+      return true;
+    }
+
+    // Don't block in the pipe while trimming, rebuilding, or while the ring
+    // is stuck
+    int timeout_ms = -1;
+    if (trimming_)
+      timeout_ms = kTrimIntervalMs;
+    else if (rebuilding_)
+      timeout_ms = kRebuildIntervalMs;
+    if (ring_ != NULL) {
+      atomic_write32(&ring_->consumer_waiting, 1);
+      if (PopRing(command, path)) {
+        atomic_write32(&ring_->consumer_waiting, 0);
+        return true;
+      }
+      if (!IsRingEmpty()) {
+        const uint64_t now = GetTimeMs();
+        if (ring_stuck_since_ == 0) {
+          ring_stuck_since_ = now;
+        } else if (now >= ring_stuck_since_ + kRingTimeoutMs) {
+          SkipRingSlot();
+          continue;
+        }
+        if (timeout_ms < 0)
+          timeout_ms = kRingTimeoutMs;
+      }
+    }
+    if ((timeout_ms >= 0) && !WaitPipe(timeout_ms))
+      continue;
+
+    if (read(pipe_lru_[0], command, sizeof(*command)) != sizeof(*command))
+      return false;
+    if (ring_ != NULL)
+      atomic_write32(&ring_->consumer_waiting, 0);
+    // Inserts and pins come with a cvmfs path, registrations with a name
+    if ((command->command_type == kInsert) || (command->command_type == kPin) ||
+        (command->command_type == kRegister))
+      ReadPipe(pipe_lru_[0], path, command->path_length);
+    if (command->command_type == kWakeup)
+      continue;
+    if ((ring_ != NULL) && !IsRingEmpty()) {
+      has_pending_ = true;
+      pending_mark_ = atomic_read64(&ring_->tail);
+      pending_command_ = *command;
+      memcpy(pending_path_, path, kMaxCvmfsPath);
+      continue;
+    }
+    return true;
+  }
+}
+  
+  
+static string GetJournalPath() {
+  return *cache_dir_ + "/lrujournal";
+}
+
+
+static string GetSnapshotPath() {
+  return *cache_dir_ + "/lrusnapshot";
+}
+
+
+static uint64_t GetPriority(const LruEntry &entry) {
+  switch (policy_) {
+    case kPolicy2q:
+      return (entry.hits > 0) ? 1 : 0;
+    case kPolicySize:
+      return size_clock_ + (uint64_t(entry.hits) + 1) * kSizeScale /
+             max(entry.size / 1024, uint64_t(1));
+    default:
+      return 0;
+  }
+}
+
+
+static void LinkEntry(const hash::Any &hash, LruEntry *entry) {
+  entry->priority = GetPriority(*entry);
+  const EvictionKey key(entry->priority, entry->seq);
+  (*lru_order_)[key] = hash;
+  if ((policy_ == kPolicy2q) && (entry->priority == 0))
+    probation_size_ += entry->size;
+  RepoShare *repo = &(*repos_)[entry->repo];
+  repo->size += entry->size;
+  if (entry->repo > 0)
+    repo->order[key] = hash;
+}
+
+
+static void UnlinkEntry(const LruEntry &entry) {
+  const EvictionKey key(entry.priority, entry.seq);
+  lru_order_->erase(key);
+  if ((policy_ == kPolicy2q) && (entry.priority == 0))
+    probation_size_ -= entry.size;
+  RepoShare *repo = &(*repos_)[entry.repo];
+  repo->size -= entry.size;
+  if (entry.repo > 0)
+    repo->order.erase(key);
+}
+
+
+/**
+ * Adds or replaces an entry of the index and keeps the gauge up to date.
+ */
+static void PutEntry(const hash::Any &hash, const LruEntry &entry) {
+  map<hash::Any, LruEntry>::iterator iter = entries_->find(hash);
+  if (iter != entries_->end()) {
+    UnlinkEntry(iter->second);
+    gauge_ -= iter->second.size;
+    iter->second = entry;
+  } else {
+    iter = entries_->insert(make_pair(hash, entry)).first;
+  }
+  LinkEntry(hash, &iter->second);
+  gauge_ += entry.size;
+}
+
+
+static void DropEntry(map<hash::Any, LruEntry>::iterator iter) {
+  UnlinkEntry(iter->second);
+  gauge_ -= iter->second.size;
+  entries_->erase(iter);
+}
+
+
+/**
+ * An object of unknown origin is taken over by the repository that touches it.
+ */
+static void TouchEntry(map<hash::Any, LruEntry>::iterator iter,
+                       const uint64_t seq, const uint16_t repo)
+{
+  UnlinkEntry(iter->second);
+  iter->second.seq = seq;
+  if (iter->second.repo == 0)
+    iter->second.repo = repo;
+  if (iter->second.hits < kMaxHits)
+    iter->second.hits++;
+  LinkEntry(iter->first, &iter->second);
+}
+
+
+static void AppendRecord(const JournalOp op, const hash::Any &hash,
+                         const LruEntry &entry, string *buffer)
+{
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.size = entry.size;
+  record.seq = entry.seq;
+  record.hits = entry.hits;
+  memcpy(record.digest, hash.digest, hash.GetDigestSize());
+  record.op = op;
+  record.type = entry.type;
+  if (op == kJournalInsert)
+    record.path_length = entry.path.length();
+  buffer->append(reinterpret_cast<const char *>(&record), sizeof(record));
+  if (op == kJournalInsert)
+    buffer->append(entry.path);
+}
+
+
+static void AppendJournal(const JournalOp op, const hash::Any &hash,
+                          const LruEntry &entry)
+{
+  AppendRecord(op, hash, entry, journal_buffer_);
+  num_journal_records_++;
+}
+
+
+/**
+ * Reads a record and the path that follows inserts.
+ *
+ * \return false at the end of the file or on a truncated record
+ */
+static bool ReadRecord(FILE *f, JournalRecord *record, string *path) {
+  if (fread(record, sizeof(*record), 1, f) != 1)
+    return false;
+  // Not kMaxCvmfsPath: it depends on the command layout of the writer
+  if (record->path_length > sizeof(RingSlot))
+    return false;
+  path->resize(record->path_length);
+  if ((record->path_length > 0) &&
+      (fread(&(*path)[0], record->path_length, 1, f) != 1))
+  {
+    return false;
+  }
+  return true;
+}
+
+
+static bool WriteJournalHeader() {
+  JournalHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kJournalMagic;
+  header.version = kJournalVersion;
+  return write(fd_journal_, &header, sizeof(header)) == sizeof(header);
+}
+
+
+/**
+ * Writes the index in LRU order into a new snapshot and starts a new journal.
+ * The snapshot is replaced atomically, the journal records are idempotent.
+ * So a crash in between leaves a consistent state.
+ */
+static bool WriteSnapshot() {
+  const string snapshot_path = GetSnapshotPath();
+  const string temp_path = snapshot_path + ".tmp";
+  FILE *f = fopen(temp_path.c_str(), "w");
+  if (f == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to create LRU snapshot (%d)", errno);
+    return false;
+  }
+
+  JournalHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kSnapshotMagic;
+  header.version = kJournalVersion;
+  header.seq = seq_;
+  header.num_entries = entries_->size();
+  bool result = fwrite(&header, sizeof(header), 1, f) == 1;
+  string buffer;
+  for (map<EvictionKey, hash::Any>::const_iterator i = lru_order_->begin(),
+       iEnd = lru_order_->end(); result && (i != iEnd); ++i)
+  {
+    AppendRecord(kJournalInsert, i->second, (*entries_)[i->second], &buffer);
+    if (buffer.length() >= kSnapshotBufferSize) {
+      result = fwrite(buffer.data(), buffer.length(), 1, f) == 1;
+      buffer.clear();
+    }
+  }
+  if (result && !buffer.empty())
+    result = fwrite(buffer.data(), buffer.length(), 1, f) == 1;
+  result = (fclose(f) == 0) && result;
+  if (!result || (rename(temp_path.c_str(), snapshot_path.c_str()) != 0)) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to write LRU snapshot (%d)", errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // Everything in the journal is now part of the snapshot
+  journal_buffer_->clear();
+  num_journal_records_ = 0;
+  if ((ftruncate(fd_journal_, 0) != 0) || !WriteJournalHeader()) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to reset LRU journal (%d)", errno);
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "wrote LRU snapshot with %"PRIu64" entries",
+           uint64_t(entries_->size()));
+  return true;
+}
+
+
+/**
+ * Writes the records of a command bunch in one go.  Compacts the journal into
+ * a snapshot once it grew larger than the index.
+ */
+static void FlushJournal() {
+  if (journal_buffer_->empty())
+    return;
+
+  if (!rebuilding_ && (num_journal_records_ > kMinJournalRecords) &&
+      (num_journal_records_ > entries_->size()) && WriteSnapshot())
+  {
+    return;
+  }
+
+  const ssize_t length = journal_buffer_->length();
+  if (write(fd_journal_, journal_buffer_->data(), length) != length) {
+    // A torn record would hide all following ones
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to append to LRU journal (%d)", errno);
+    WriteSnapshot();
+  }
+  journal_buffer_->clear();
+}
+
+
+static void ClearIndex() {
+  entries_->clear();
+  lru_order_->clear();
+  for (unsigned i = 0; i < repos_->size(); ++i) {
+    (*repos_)[i].size = 0;
+    (*repos_)[i].order.clear();
+  }
+  gauge_ = 0;
+  seq_ = 0;
+  probation_size_ = 0;
+  size_clock_ = 0;
+}
+
+
+static bool LoadSnapshot() {
+  FILE *f = fopen(GetSnapshotPath().c_str(), "r");
+  if (f == NULL)
+    return false;
+
+  JournalHeader header;
+  bool result = (fread(&header, sizeof(header), 1, f) == 1) &&
+                (header.magic == kSnapshotMagic) &&
+                (header.version == kJournalVersion);
+  JournalRecord record;
+  LruEntry entry;
+  for (uint64_t i = 0; result && (i < header.num_entries); ++i) {
+    result = ReadRecord(f, &record, &entry.path);
+    if (!result)
+      break;
+    entry.size = record.size;
+    entry.seq = record.seq;
+    entry.hits = record.hits;
+    entry.type = static_cast<FileTypes>(record.type);
+    PutEntry(hash::Any(hash::kSha1, record.digest,
+                       hash::kDigestSizes[hash::kSha1]), entry);
+  }
+  fclose(f);
+
+  if (!result) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog, "LRU snapshot corrupted");
+    ClearIndex();
+    return false;
+  }
+  seq_ = header.seq;
+  return true;
+}
+
+
+/**
+ * Applies the journal to the index loaded from the snapshot.  A torn record
+ * at the end, left behind by a crash, ends the replay.
+ *
+ * \return true if the journal is empty and valid, i.e. it needs no compaction
+ */
+static bool ReplayJournal() {
+  FILE *f = fopen(GetJournalPath().c_str(), "r");
+  if (f == NULL)
+    return false;
+
+  JournalHeader header;
+  if ((fread(&header, sizeof(header), 1, f) != 1) ||
+      (header.magic != kJournalMagic) || (header.version != kJournalVersion))
+  {
+    fclose(f);
+    return false;
+  }
+
+  JournalRecord record;
+  LruEntry entry;
+  uint64_t num_records = 0;
+  long end_valid = ftell(f);
+  while (ReadRecord(f, &record, &entry.path)) {
+    const hash::Any hash(hash::kSha1, record.digest,
+                         hash::kDigestSizes[hash::kSha1]);
+    map<hash::Any, LruEntry>::iterator iter = entries_->find(hash);
+    switch (record.op) {
+      case kJournalInsert:
+        entry.size = record.size;
+        entry.seq = record.seq;
+        entry.hits = record.hits;
+        entry.type = static_cast<FileTypes>(record.type);
+        PutEntry(hash, entry);
+        break;
+      case kJournalTouch:
+        if (iter != entries_->end())
+          TouchEntry(iter, record.seq, 0);
+        break;
+      case kJournalRemove:
+        if (iter != entries_->end())
+          DropEntry(iter);
+        break;
+    }
+    if (record.seq >= seq_)
+      seq_ = record.seq + 1;
+    num_records++;
+    end_valid = ftell(f);
+  }
+  const bool torn = (fseek(f, 0, SEEK_END) != 0) || (ftell(f) != end_valid);
+  fclose(f);
+  LogCvmfs(kLogQuota, kLogDebug, "replayed %"PRIu64" LRU journal records",
+           num_records);
+  return (num_records == 0) && !torn;
+}
+
+
+/**
+ * Imports the cache catalog of an older version of cvmfs or of a previous
+ * run that crashed before writing a snapshot.  Access order is preserved,
+ * the sequence numbers are renumbered.
+ */
+static bool ImportDatabase() {
+  const string db_file = (*cache_dir_) + "/cachedb";
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_open(db_file.c_str(), &db) != SQLITE_OK) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not open cache database");
+    sqlite3_close(db);
+    return false;
+  }
+  // Very old cache catalogs have no type column
+  int err = sqlite3_prepare_v2(db,
+    "SELECT sha1, size, path, type FROM cache_catalog ORDER BY acseq;",
+    -1, &stmt, NULL);
+  if (err != SQLITE_OK) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not read cache database (%d)", err);
+    sqlite3_close(db);
+    return false;
+  }
+
+  LruEntry entry;
+  while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *sha1 =
+      reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    if ((sha1 == NULL) || (strlen(sha1) < 2*hash::kDigestSizes[hash::kSha1]))
+      continue;
+    const char *path =
+      reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+    entry.size = sqlite3_column_int64(stmt, 1);
+    entry.seq = seq_++;
+    entry.type = (sqlite3_column_int64(stmt, 3) == kFileCatalog) ?
+                 kFileCatalog : kFileRegular;
+    entry.path = (path == NULL) ? "" : string(path).substr(0, kMaxCvmfsPath);
+    PutEntry(hash::Any(hash::kSha1, hash::HexPtr(string(sha1).substr(
+               0, 2*hash::kDigestSizes[hash::kSha1]))), entry);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  if (err != SQLITE_DONE) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "LRU database corrupted (%d)", err);
+    ClearIndex();
+    return false;
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "imported %"PRIu64" entries from cache database",
+           uint64_t(entries_->size()));
+  return true;
+}
+
+
+/**
+ * Writes the index into the SQLite cache catalog.
+ */
+static void ExportDatabase() {
+  const string db_file = (*cache_dir_) + "/cachedb";
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+  bool retry = false;
+ export_recover:
+  int err = sqlite3_open(db_file.c_str(), &db);
+  if (err == SQLITE_OK) {
+    const string sql = "PRAGMA synchronous=0; PRAGMA locking_mode=EXCLUSIVE; "
+    "PRAGMA auto_vacuum=1; "
+    "CREATE TABLE IF NOT EXISTS cache_catalog (sha1 TEXT, size INTEGER, "
+    "  acseq INTEGER, path TEXT, type INTEGER, pinned INTEGER, "
+    "CONSTRAINT pk_cache_catalog PRIMARY KEY (sha1)); "
+    "CREATE UNIQUE INDEX IF NOT EXISTS idx_cache_catalog_acseq "
+    "  ON cache_catalog (acseq); "
+    "CREATE TABLE IF NOT EXISTS properties (key TEXT, value TEXT, "
+    "  CONSTRAINT pk_properties PRIMARY KEY(key)); "
+    "INSERT OR REPLACE INTO properties (key, value) VALUES ('schema', '1.0'); "
+    "BEGIN; DELETE FROM cache_catalog;";
+    err = sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL);
+  }
+  if (err == SQLITE_OK) {
+    err = sqlite3_prepare_v2(db,
+      "INSERT INTO cache_catalog (sha1, size, acseq, path, type, pinned) "
+      "VALUES (:sha1, :s, :seq, :p, :t, 0);", -1, &stmt, NULL);
+  }
+  if (err != SQLITE_OK) {
+    sqlite3_close(db);
+    unlink(db_file.c_str());
+    unlink((db_file + "-journal").c_str());
+    if (!retry) {
+      retry = true;
+      goto export_recover;
+    }
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "could not write cache database (%d)", err);
+    return;
+  }
+
+  for (map<EvictionKey, hash::Any>::const_iterator i = lru_order_->begin(),
+       iEnd = lru_order_->end(); i != iEnd; ++i)
+  {
+    const LruEntry &entry = (*entries_)[i->second];
+    const string hash_str = i->second.ToString();
+    sqlite3_bind_text(stmt, 1, &hash_str[0], hash_str.length(),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, entry.size);
+    sqlite3_bind_int64(stmt, 3, entry.seq);
+    sqlite3_bind_text(stmt, 4, entry.path.data(), entry.path.length(),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, entry.type);
+    err = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (err != SQLITE_DONE) {
+      LogCvmfs(kLogQuota, kLogDebug, "could not export %s (%d)",
+               hash_str.c_str(), err);
+    }
+  }
+  sqlite3_finalize(stmt);
+  err = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  sqlite3_close(db);
+  LogCvmfs(kLogQuota, kLogDebug, "exported %"PRIu64" entries to cache database (%d)",
+           uint64_t(entries_->size()), err);
+}
+
+
+/**
+ * Removes the plain and the compressed version of an object from the cache
+ * directory, see cache::OpenCompressed().
+ *
+ * \return True if a file was removed
+ */
+static bool UnlinkObject(const hash::Any &hash) {
+  const string path = (*cache_dir_) + hash.MakePath(1, 2);
+  const bool plain = (unlink(path.c_str()) == 0);
+  const bool compressed =
+    (unlink((path + cache::kCompressedSuffix).c_str()) == 0);
+  return plain || compressed;
+}
+
+
+static void *MainEvictor(void *data __attribute__((unused))) {
+  LogCvmfs(kLogQuota, kLogDebug, "starting evictor");
+  pthread_mutex_lock(&lock_evictor_);
+  while (true) {
+    while (trash_->empty() && !evictor_terminate_)
+      pthread_cond_wait(&cond_evictor_, &lock_evictor_);
+    if (trash_->empty())
+      break;
+    const hash::Any hash = *trash_->begin();
+    trash_->erase(trash_->begin());
+    pthread_mutex_unlock(&lock_evictor_);
+
+    LogCvmfs(kLogQuota, kLogDebug, "unlink %s", hash.ToString().c_str());
+    UnlinkObject(hash);
+    pthread_mutex_lock(&lock_evictor_);
+  }
+  pthread_mutex_unlock(&lock_evictor_);
+  LogCvmfs(kLogQuota, kLogDebug, "stopping evictor");
+  return NULL;
+}
+
+
+static void StartEvictor() {
+  trash_ = new set<hash::Any>();
+  evictor_terminate_ = false;
+  if (pthread_create(&thread_evictor_, NULL, MainEvictor, NULL) != 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not create evictor thread");
+    return;
+  }
+  evictor_running_ = true;
+}
+
+
+/**
+ * Unlinks the remaining trash before it returns.
+ */
+static void StopEvictor() {
+  if (!evictor_running_)
+    return;
+  pthread_mutex_lock(&lock_evictor_);
+  evictor_terminate_ = true;
+  pthread_cond_signal(&cond_evictor_);
+  pthread_mutex_unlock(&lock_evictor_);
+  pthread_join(thread_evictor_, NULL);
+  evictor_running_ = false;
+  delete trash_;
+  trash_ = NULL;
+}
+
+
+/**
+ * An object inserted again must not be unlinked by the evictor.
+ */
+static void RescueTrash(const hash::Any &hash) {
+  if (!evictor_running_)
+    return;
+  pthread_mutex_lock(&lock_evictor_);
+  trash_->erase(hash);
+  pthread_mutex_unlock(&lock_evictor_);
+}
+
+
+/**
+ * Takes an object out of the index, its file goes to the trash.
+ */
+static void EvictEntry(map<hash::Any, LruEntry>::iterator iter,
+                       vector<hash::Any> *trash)
+{
+  const hash::Any hash = iter->first;
+  trash->push_back(hash);
+  if (policy_ == kPolicySize)
+    size_clock_ = iter->second.priority;
+  if (ghosts_->insert(hash).second) {
+    ghost_order_->push_back(hash);
+    if (ghost_order_->size() > kMaxGhosts) {
+      ghosts_->erase(ghost_order_->front());
+      ghost_order_->pop_front();
+    }
+  }
+  num_evictions_++;
+  cache::FilterRemove(hash);
+  AppendJournal(kJournalRemove, hash, iter->second);
+  DropEntry(iter);
+  LogCvmfs(kLogQuota, kLogDebug, "lru cleanup %s, new gauge %"PRIu64,
+           hash.ToString().c_str(), gauge_);
+}
+
+
+/**
+ * Pinned objects are never evicted, guarded ones only if the repository
+ * stays above its guarantee.
+ */
+static bool IsEvictable(map<hash::Any, LruEntry>::const_iterator iter,
+                        const bool guarded)
+{
+  const LruEntry &entry = iter->second;
+  if (entry.pinned ||
+      (pinned_chunks_->find(iter->first) != pinned_chunks_->end()))
+  {
+    return false;
+  }
+  if (!guarded || (entry.repo == 0))
+    return true;
+  const RepoShare &repo = (*repos_)[entry.repo];
+  return repo.size >= repo.guarantee + entry.size;
+}
+
+
+/**
+ * Evicts from the repositories above their soft share, each in its own
+ * eviction order, until they are back at the share.
+ */
+static void EvictOverShare(const uint64_t leave_size,
+                           const unsigned max_entries,
+                           vector<hash::Any> *trash)
+{
+  for (unsigned r = 1; r < repos_->size(); ++r) {
+    RepoShare *repo = &(*repos_)[r];
+    if (repo->share == 0)
+      continue;
+    map<EvictionKey, hash::Any>::const_iterator i = repo->order.begin();
+    while ((repo->size > repo->share) && (gauge_ > leave_size) &&
+           (trash->size() < max_entries) && (i != repo->order.end()))
+    {
+      map<hash::Any, LruEntry>::iterator iter = entries_->find(i->second);
+      ++i;
+      if (IsEvictable(iter, true))
+        EvictEntry(iter, trash);
+    }
+  }
+}
+
+
+/**
+ * Evicts in the order of the eviction policy.
+ */
+static void EvictInOrder(const uint64_t leave_size,
+                         const unsigned max_entries, const bool guarded,
+                         vector<hash::Any> *trash)
+{
+  // 2Q has a probationary and a protected queue, the others only one
+  map<EvictionKey, hash::Any>::const_iterator i_probation = lru_order_->begin();
+  map<EvictionKey, hash::Any>::const_iterator i_protected =
+    (policy_ == kPolicy2q) ? lru_order_->lower_bound(EvictionKey(1, 0)) :
+                             lru_order_->end();
+  while ((gauge_ > leave_size) && (trash->size() < max_entries)) {
+    const bool has_probation = (i_probation != lru_order_->end()) &&
+      ((policy_ != kPolicy2q) || (i_probation->first.first == 0));
+    const bool has_protected = (i_protected != lru_order_->end());
+    if (!has_probation && !has_protected)
+      break;
+    const bool from_protected = !has_probation ||
+      (has_protected && (probation_size_ <= gauge_ / kProbationShare));
+    map<EvictionKey, hash::Any>::const_iterator &i =
+      from_protected ? i_protected : i_probation;
+    map<hash::Any, LruEntry>::iterator iter = entries_->find(i->second);
+    ++i;
+    if (IsEvictable(iter, guarded))
+      EvictEntry(iter, trash);
+  }
+}
+
+
+/**
+ * Removes up to max_entries least recently used objects from the index until
+ * the cache is below leave_size.  Repositories above their soft share go
+ * first.  Guarantees are only broken with force.  The files are handed to the
+ * evictor thread or, before it runs, unlinked right away.
+ *
+ * \return the number of evicted objects
+ */
+static unsigned EvictEntries(const uint64_t leave_size,
+                             const unsigned max_entries, const bool force)
+{
+  vector<hash::Any> trash;
+  EvictOverShare(leave_size, max_entries, &trash);
+  EvictInOrder(leave_size, max_entries, true, &trash);
+  if (force)
+    EvictInOrder(leave_size, max_entries, false, &trash);
+  FlushJournal();
+  if (trash.empty())
+    return 0;
+
+  if (evictor_running_) {
+    pthread_mutex_lock(&lock_evictor_);
+    trash_->insert(trash.begin(), trash.end());
+    pthread_cond_signal(&cond_evictor_);
+    pthread_mutex_unlock(&lock_evictor_);
+  } else {
+    for (unsigned i = 0, iEnd = trash.size(); i < iEnd; ++i)
+      UnlinkObject(trash[i]);
+  }
+  return trash.size();
+}
+
+
+static bool DoCleanup(const uint64_t leave_size) {
+  if ((limit_ == 0) || (gauge_ <= leave_size))
+    return true;
+  if (rebuilding_) {
+    LogCvmfs(kLogQuota, kLogDebug, "cleanup deferred until rebuild finished");
+    return false;
+  }
+
+  LogCvmfs(kLogQuota, kLogSyslog,
+           "cleanup cache until %lu KB are free", leave_size/1024);
+  LogCvmfs(kLogQuota, kLogDebug, "gauge %"PRIu64, gauge_);
+  EvictEntries(leave_size, UINT_MAX, true);
+  return gauge_ <= leave_size;
+}
+
+
+/**
+ * Evicts a batch of objects ahead of demand, at most every kTrimIntervalMs.
+ */
+static void TrimCache() {
+  if ((limit_ == 0) || rebuilding_)
+    return;
+  if (!trimming_) {
+    const uint64_t high_watermark =
+      cleanup_threshold_ + (limit_ - cleanup_threshold_) / 2;
+    if (gauge_ <= high_watermark)
+      return;
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "trimming cache to %"PRIu64" KB in the background",
+             cleanup_threshold_ / 1024);
+    trimming_ = true;
+  }
+
+  const uint64_t now = GetTimeMs();
+  if (now < last_trim_ + kTrimIntervalMs)
+    return;
+  last_trim_ = now;
+  if ((EvictEntries(cleanup_threshold_, kTrimBatch, false) == 0) ||
+      (gauge_ <= cleanup_threshold_))
+  {
+    trimming_ = false;
+  }
+}
+
+
+/**
+ * Inserts or replaces an object, cleans up first if it does not fit.
+ */
+static void InsertEntry(const hash::Any &hash, const uint64_t size,
+                        const FileTypes type, const char *path,
+                        const unsigned path_length, const uint16_t repo)
+{
+  map<hash::Any, LruEntry>::const_iterator iter = entries_->find(hash);
+  if (iter == entries_->end()) {
+    num_misses_++;
+    if (ghosts_->erase(hash) > 0)
+      num_refetches_++;
+  }
+  if ((iter == entries_->end()) && (gauge_ + size > limit_) && !rebuilding_) {
+    LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
+             gauge_, size);
+    int retval = DoCleanup(cleanup_threshold_);
+    assert(retval != 0);
+  }
+
+  RescueTrash(hash);
+  LruEntry entry;
+  entry.size = size;
+  entry.seq = seq_++;
+  entry.type = type;
+  entry.pinned = (type == kFileCatalog);
+  entry.repo = (repo < repos_->size()) ? repo : 0;
+  entry.path.assign(path, path_length);
+  PutEntry(hash, entry);
+  AppendJournal(kJournalInsert, hash, entry);
+}
+
+
+static void ProcessCommandBunch(const unsigned num,
+                                const LruCommand *commands, const char *paths)
+{
+  for (unsigned i = 0; i < num; ++i) {
+    const hash::Any hash(hash::kSha1, commands[i].digest,
+                         sizeof(commands[i].digest));
+    map<hash::Any, LruEntry>::iterator iter = entries_->find(hash);
+
+    switch (commands[i].command_type) {
+      case kTouch:
+        if (iter != entries_->end()) {
+          num_hits_++;
+          TouchEntry(iter, seq_++, (commands[i].repo < repos_->size()) ?
+                                   commands[i].repo : 0);
+          AppendJournal(kJournalTouch, hash, iter->second);
+        }
+        break;
+      case kUnpin:
+        if (iter != entries_->end())
+          iter->second.pinned = false;
+        break;
+      case kPin:
+      case kInsert:
+        InsertEntry(hash, commands[i].size,
+                    (commands[i].command_type == kPin) ?
+                    kFileCatalog : kFileRegular,
+                    &paths[i*kMaxCvmfsPath], commands[i].path_length,
+                    commands[i].repo);
+        break;
+      default:
+        abort();  // other types should have been taken care of by event loop
+    }
+  }
+
+  FlushJournal();
+}
+
+
+static bool IsListed(const LruEntry &entry, const LruCommand &filter) {
+  switch (filter.selection) {
+    case kSelectRegular:
+      if (entry.type != kFileRegular) return false;
+      break;
+    case kSelectPinned:
+      if (!entry.pinned) return false;
+      break;
+    case kSelectCatalogs:
+      if (entry.type != kFileCatalog) return false;
+      break;
+  }
+  if (entry.size < filter.min_size)
+    return false;
+  if ((filter.max_size > 0) && (entry.size > filter.max_size))
+    return false;
+  if ((filter.min_idle > 0) && (entry.seq + filter.min_idle > seq_))
+    return false;
+  return true;
+}
+
+
+/**
+ * Pipes back one page of a listing, one path by one, followed by -1, a flag
+ * telling whether the listing is finished, and the digest of the last visited
+ * entry as the cursor for the next page.
+ */
+static void DoListPage(const LruCommand &command, const int return_pipe) {
+  map<hash::Any, LruEntry>::const_iterator i = entries_->begin();
+  if (command.resume) {
+    const hash::Any cursor(hash::kSha1, command.digest,
+                           sizeof(command.digest));
+    i = entries_->upper_bound(cursor);
+  }
+  const map<hash::Any, LruEntry>::const_iterator iEnd = entries_->end();
+
+  unsigned char last[hash::kMaxDigestSize];
+  memcpy(last, command.digest, sizeof(last));
+  const uint64_t max_entries = (command.size > 0) ? command.size : 1;
+  uint64_t num_listed = 0;
+  unsigned num_visited = 0;
+  int length;
+  for (; (i != iEnd) && (num_listed < max_entries) &&
+         (num_visited < kListScanLimit); ++i, ++num_visited)
+  {
+    memcpy(last, i->first.digest, sizeof(last));
+    const LruEntry &entry = i->second;
+    if (!IsListed(entry, command))
+      continue;
+    length = entry.path.length();
+    WritePipe(return_pipe, &length, sizeof(length));
+    if (length > 0)
+      WritePipe(return_pipe, entry.path.data(), length);
+    num_listed++;
+  }
+  length = -1;
+  WritePipe(return_pipe, &length, sizeof(length));
+  const bool finished = (i == iEnd);
+  WritePipe(return_pipe, &finished, sizeof(finished));
+  WritePipe(return_pipe, last, sizeof(last));
+}
+
+
+/**
+ * Registers a repository or updates its share and guarantee.
+ *
+ * \return the repository index, 0 if there are too many repositories
+ */
+static uint16_t DoRegister(const string &name, const uint64_t share,
+                           const uint64_t guarantee)
+{
+  unsigned repo = 1;
+  while ((repo < repos_->size()) && ((*repos_)[repo].name != name))
+    repo++;
+  if (repo == repos_->size()) {
+    if (repo > UINT16_MAX)
+      return 0;
+    repos_->push_back(RepoShare());
+    (*repos_)[repo].name = name;
+  }
+  (*repos_)[repo].share = share;
+  (*repos_)[repo].guarantee = guarantee;
+  LogCvmfs(kLogQuota, kLogDebug, "registered repository %s as %u, "
+           "share %"PRIu64", guarantee %"PRIu64,
+           name.c_str(), repo, share, guarantee);
+  return repo;
+}
+
+
+/**
+ * Releases the pins of cvmfs processes that terminated without unpinning
+ * their catalogs, so that their space can be reused.
+ */
+static void UnpinDeadOwners() {
+  map<hash::Any, set<pid_t> >::iterator i = pin_owners_->begin();
+  while (i != pin_owners_->end()) {
+    set<pid_t> &owners = i->second;
+    for (set<pid_t>::iterator j = owners.begin(); j != owners.end(); ) {
+      if ((kill(*j, 0) != 0) && (errno == ESRCH))
+        owners.erase(j++);
+      else
+        ++j;
+    }
+    if (!owners.empty()) {
+      ++i;
+      continue;
+    }
+
+    const string hash_str = i->first.ToString();
+    LogCvmfs(kLogQuota, kLogDebug, "releasing orphaned pin of %s",
+             hash_str.c_str());
+    map<hash::Any, uint64_t>::iterator iter = pinned_chunks_->find(i->first);
+    if (iter != pinned_chunks_->end()) {
+      pinned_ -= iter->second;
+      pinned_chunks_->erase(iter);
+    }
+    map<hash::Any, LruEntry>::iterator entry = entries_->find(i->first);
+    if (entry != entries_->end())
+      entry->second.pinned = false;
+    pin_owners_->erase(i++);
+  }
+}
+
+
+/**
+ * Event loop for processing commands.  Most of them are queued, some have
+ * to be executed immediately.
+ */
+static void *MainCommandServer(void *data __attribute__((unused))) {
+  LogCvmfs(kLogQuota, kLogDebug, "starting cache manager");
+  sqlite3_soft_heap_limit(kSqliteMemPerThread);
+  StartEvictor();
+
+  LruCommand command_buffer[kCommandBufferSize];
+  char path_buffer[kCommandBufferSize*kMaxCvmfsPath];
+  unsigned num_commands = 0;
+
+  while (ReadCommand(&command_buffer[num_commands],
+                     &path_buffer[kMaxCvmfsPath*num_commands]))
+  {
+    const CommandType command_type = command_buffer[num_commands].command_type;
+    LogCvmfs(kLogQuota, kLogDebug, "received command %d", command_type);
+    const uint64_t size = command_buffer[num_commands].size;
+
+    // Reservations are handled immediately and "out of band"
+    if (command_type == kReserve) {
+      bool success = true;
+      int return_pipe = 
+        BindReturnPipe(command_buffer[num_commands].return_pipe);
+      const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
+                           sizeof(command_buffer[num_commands].digest));
+      const string hash_str(hash.ToString());
+      LogCvmfs(kLogQuota, kLogDebug, "reserve %d bytes for %s",
+               size, hash_str.c_str());
+
+      if (pinned_chunks_->find(hash) == pinned_chunks_->end()) {
+        if ((cleanup_threshold_ > 0) && (pinned_ + size > cleanup_threshold_))
+          UnpinDeadOwners();
+        if ((cleanup_threshold_ > 0) && (pinned_ + size > cleanup_threshold_)) {
+          LogCvmfs(kLogQuota, kLogDebug,
+                   "failed to insert %s (pinned), no space", hash_str.c_str());
+          success = false;
+        } else {
+          (*pinned_chunks_)[hash] = size;
+          pinned_ += size;
+        }
+      }
+      if (success)
+        (*pin_owners_)[hash].insert(command_buffer[num_commands].pid);
+
+      WritePipe(return_pipe, &success, sizeof(success));
+      UnbindReturnPipe(return_pipe);
+      continue;
+    }
+
+    if (command_type == kRegister) {
+      int return_pipe =
+        BindReturnPipe(command_buffer[num_commands].return_pipe);
+      const string name(&path_buffer[kMaxCvmfsPath*num_commands],
+                        command_buffer[num_commands].path_length);
+      const uint16_t repo =
+        DoRegister(name, size, command_buffer[num_commands].guarantee);
+      WritePipe(return_pipe, &repo, sizeof(repo));
+      UnbindReturnPipe(return_pipe);
+      continue;
+    }
+
+    // Unpinnings are also handled immediately with respect to the pinned gauge
+    if (command_type == kUnpin) {
+      const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
+                           sizeof(command_buffer[num_commands].digest));
+      const string hash_str(hash.ToString());
+
+      map<hash::Any, set<pid_t> >::iterator iter_owners =
+        pin_owners_->find(hash);
+      if (iter_owners != pin_owners_->end()) {
+        iter_owners->second.erase(command_buffer[num_commands].pid);
+        if (iter_owners->second.empty())
+          pin_owners_->erase(iter_owners);
+      }
+      map<hash::Any, uint64_t>::iterator iter = pinned_chunks_->find(hash);
+      if (pin_owners_->find(hash) != pin_owners_->end()) {
+        LogCvmfs(kLogQuota, kLogDebug, "%s is still pinned by another process",
+                 hash_str.c_str());
+        command_buffer[num_commands].command_type = kTouch;
+      } else if (iter != pinned_chunks_->end()) {
+        pinned_ -= iter->second;
+        pinned_chunks_->erase(iter);
+      } else {
+        LogCvmfs(kLogQuota, kLogDebug, "this chunk was not pinned");
+      }
+    }
+
+    // Immediate commands trigger flushing of the buffer
+    bool immediate_command = (command_type == kCleanup) ||
+      (command_type == kListPage) || (command_type == kRemove) ||
+      (command_type == kStatus) || (command_type == kLimits) ||
+      (command_type == kStatistics) || (command_type == kListRepos);
+    if (!immediate_command) num_commands++;
+
+    if ((num_commands == kCommandBufferSize) || immediate_command)
+    {
+      ProcessCommandBunch(num_commands, command_buffer, path_buffer);
+      if (!immediate_command) num_commands = 0;
+    }
+
+    if (immediate_command) {
+      // Process cleanup, listings
+      int return_pipe = 
+        BindReturnPipe(command_buffer[num_commands].return_pipe);
       int retval;
-      sqlite3_stmt *this_stmt_list = NULL;
       switch (command_type) {
         case kRemove: {
           const hash::Any hash(hash::kSha1, command_buffer[num_commands].digest,
                                sizeof(command_buffer[num_commands].digest));
-          const string hash_str = hash.ToString();
           LogCvmfs(kLogQuota, kLogDebug, "manually removing %s",
-                   hash_str.c_str());
-
-          sqlite3_bind_text(stmt_size_, 1, &hash_str[0], hash_str.length(),
-                            SQLITE_STATIC);
-          int retval;
-          if ((retval = sqlite3_step(stmt_size_)) == SQLITE_ROW) {
-            uint64_t size = sqlite3_column_int64(stmt_size_, 0);
-            uint64_t is_pinned = sqlite3_column_int64(stmt_size_, 1);
-
-            sqlite3_bind_text(stmt_rm_, 1, &(hash_str[0]), hash_str.length(),
-                              SQLITE_STATIC);
-            retval = sqlite3_step(stmt_rm_);
-            if ((retval == SQLITE_DONE) || (retval == SQLITE_OK)) {
-              gauge_ -= size;
-              if (is_pinned) {
-                pinned_chunks_->erase(hash);
-                pinned_ -= size;
-              }
-            } else {
-              LogCvmfs(kLogQuota, kLogDebug, "could not delete %s, error %d",
-                       hash_str.c_str(), retval);
+                   hash.ToString().c_str());
+
+          map<hash::Any, LruEntry>::iterator iter = entries_->find(hash);
+          if (iter != entries_->end()) {
+            if (iter->second.pinned) {
+              pinned_chunks_->erase(hash);
+              pin_owners_->erase(hash);
+              pinned_ -= iter->second.size;
             }
-            sqlite3_reset(stmt_rm_);
+            AppendJournal(kJournalRemove, hash, iter->second);
+            DropEntry(iter);
+            FlushJournal();
           }
-          sqlite3_reset(stmt_size_);
           break; }
         case kCleanup:
           retval = DoCleanup(size);
           WritePipe(return_pipe, &retval, sizeof(retval));
           break;
-        case kList:
-          if (!this_stmt_list) this_stmt_list = stmt_list_;
-        case kListPinned:
-          if (!this_stmt_list) this_stmt_list = stmt_list_pinned_;
-        case kListCatalogs:
-          if (!this_stmt_list) this_stmt_list = stmt_list_catalogs_;
-
-          // Pipe back the list, one by one
-          int length;
-          while (sqlite3_step(this_stmt_list) == SQLITE_ROW) {
-            string path = "(NULL)";
-            if (sqlite3_column_type(this_stmt_list, 0) != SQLITE_NULL) {
-              path = string(
-                reinterpret_cast<const char *>(
-                  sqlite3_column_text(this_stmt_list, 0)));
-            }
-            length = path.length();
-            WritePipe(return_pipe, &length, sizeof(length));
-            if (length > 0)
-              WritePipe(return_pipe, &path[0], length);
-          }
-          length = -1;
-          WritePipe(return_pipe, &length, sizeof(length));
-          sqlite3_reset(this_stmt_list);
+        case kListPage:
+          DoListPage(command_buffer[num_commands], return_pipe);
           break;
         case kStatus:
           WritePipe(return_pipe, &gauge_, sizeof(gauge_));
@@ -496,6 +2036,25 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
           WritePipe(return_pipe, &cleanup_threshold_, 
                     sizeof(cleanup_threshold_));
           break;
+        case kStatistics: {
+          const uint64_t statistics[5] = {policy_, num_hits_, num_misses_,
+                                          num_evictions_, num_refetches_};
+          WritePipe(return_pipe, statistics, sizeof(statistics));
+          break; }
+        case kListRepos: {
+          int length;
+          for (unsigned i = 0; i < repos_->size(); ++i) {
+            const RepoShare &repo = (*repos_)[i];
+            const uint64_t usage[3] = {repo.size, repo.share, repo.guarantee};
+            length = repo.name.length();
+            WritePipe(return_pipe, &length, sizeof(length));
+            if (length > 0)
+              WritePipe(return_pipe, repo.name.data(), length);
+            WritePipe(return_pipe, usage, sizeof(usage));
+          }
+          length = -1;
+          WritePipe(return_pipe, &length, sizeof(length));
+          break; }
         default:
           abort();  // other types are handled by the bunch processor
       }
@@ -504,60 +2063,179 @@ static void *MainCommandServer(void *data __attribute__((unused))) {
     }
   }
 
-  LogCvmfs(kLogQuota, kLogDebug, "stopping cache manager (%d)", errno);
-  close(pipe_lru_[0]);
-  ProcessCommandBunch(num_commands, command_buffer, path_buffer);
+  LogCvmfs(kLogQuota, kLogDebug, "stopping cache manager (%d)", errno);
+  close(pipe_lru_[0]);
+  ProcessCommandBunch(num_commands, command_buffer, path_buffer);
+
+  // Unpin
+  command_buffer[0].command_type = kTouch;
+  for (map<hash::Any, uint64_t>::const_iterator i = pinned_chunks_->begin(),
+       iEnd = pinned_chunks_->end(); i != iEnd; ++i)
+  {
+    memcpy(command_buffer[0].digest, i->first.digest, i->first.GetDigestSize());
+    ProcessCommandBunch(1, command_buffer, path_buffer);
+  }
+  StopEvictor();
+
+  return NULL;
+}
+
+
+/**
+ * Collects the files of the cache sub-directory dir (00 - ff).
+ */
+static void ScanCacheDir(const unsigned dir, vector<CachedFile> *files) {
+  char hex[3];
+  snprintf(hex, sizeof(hex), "%02x", dir);
+  const string path = (*cache_dir_) + "/" + string(hex);
+  DIR *dirp = opendir(path.c_str());
+  if (dirp == NULL) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "failed to open directory %s (tmpwatch interfering?)",
+             path.c_str());
+    return;
+  }
+  platform_dirent64 *d;
+  struct stat info;
+  while ((d = platform_readdir(dirp)) != NULL) {
+    if (d->d_type != DT_REG) continue;
+
+    const string sha1 = string(hex) + string(d->d_name);
+    if (sha1.length() < 2*hash::kDigestSizes[hash::kSha1])
+      continue;
+    if (stat((path + "/" + string(d->d_name)).c_str(), &info) == 0) {
+      files->push_back(CachedFile(hash::Any(hash::kSha1, hash::HexPtr(
+        sha1.substr(0, 2*hash::kDigestSizes[hash::kSha1]))),
+        info.st_size, info.st_atime));
+    } else {
+      LogCvmfs(kLogQuota, kLogDebug, "could not stat %s/%s",
+               path.c_str(), d->d_name);
+    }
+  }
+  closedir(dirp);
+}
+
 
-  // Unpin
-  command_buffer[0].command_type = kTouch;
-  for (map<hash::Any, uint64_t>::const_iterator i = pinned_chunks_->begin(),
-       iEnd = pinned_chunks_->end(); i != iEnd; ++i)
-  {
-    memcpy(command_buffer[0].digest, i->first.digest, i->first.GetDigestSize());
-    ProcessCommandBunch(1, command_buffer, path_buffer);
+/**
+ * Scans cache sub-directories until all are taken, hands over the files of
+ * every directory to the command server in one go.
+ */
+static void *MainRebuildScanner(void *data __attribute__((unused))) {
+  vector<CachedFile> files;
+  pthread_mutex_lock(&lock_rebuild_);
+  while (!rebuild_abort_ && (rebuild_next_dir_ <= 0xff)) {
+    const unsigned dir = rebuild_next_dir_++;
+    pthread_mutex_unlock(&lock_rebuild_);
+    ScanCacheDir(dir, &files);
+    pthread_mutex_lock(&lock_rebuild_);
+    rebuild_files_->insert(rebuild_files_->end(), files.begin(), files.end());
+    files.clear();
   }
-
+  rebuild_num_running_--;
+  pthread_mutex_unlock(&lock_rebuild_);
   return NULL;
 }
 
 
 /**
- * Rebuilds the SQLite cache catalog based on the stat-information of files
- * in the cache directory.
+ * Joins the scanner threads.  With abort, the remaining sub-directories are
+ * not scanned anymore.
+ */
+static void StopRebuild(const bool abort) {
+  pthread_mutex_lock(&lock_rebuild_);
+  rebuild_abort_ = abort;
+  pthread_mutex_unlock(&lock_rebuild_);
+  for (unsigned i = 0; i < rebuild_threads_->size(); ++i)
+    pthread_join((*rebuild_threads_)[i], NULL);
+  delete rebuild_threads_;
+  delete rebuild_files_;
+  delete rebuild_catalogs_;
+  rebuild_threads_ = NULL;
+  rebuild_files_ = NULL;
+  rebuild_catalogs_ = NULL;
+  rebuilding_ = false;
+}
+
+
+/**
+ * Merges the files found by the scanners into the index, at most every
+ * kRebuildIntervalMs unless forced.  Objects inserted during the rebuild are
+ * already in the index with a more recent sequence number.  Once all the
+ * scanners are done, the rebuild is finished with a snapshot.
+ */
+static void MergeRebuild(const bool force) {
+  if (!rebuilding_)
+    return;
+  const uint64_t now = GetTimeMs();
+  if (!force && (now < last_merge_ + kRebuildIntervalMs))
+    return;
+  last_merge_ = now;
+
+  vector<CachedFile> files;
+  pthread_mutex_lock(&lock_rebuild_);
+  files.swap(*rebuild_files_);
+  const bool finished = (rebuild_num_running_ == 0);
+  pthread_mutex_unlock(&lock_rebuild_);
+
+  const uint64_t counter_mask = (uint64_t(1) << kRebuildSeqShift) - 1;
+  for (unsigned i = 0; i < files.size(); ++i) {
+    if (entries_->find(files[i].hash) != entries_->end())
+      continue;
+    const uint64_t atime = (files[i].atime > 0) ?
+      min(uint64_t(files[i].atime), rebuild_start_) : 0;
+    LruEntry entry;
+    entry.size = files[i].size;
+    entry.seq = (atime << kRebuildSeqShift) +
+                (rebuild_counter_++ & counter_mask);
+    while (lru_order_->find(EvictionKey(GetPriority(entry), entry.seq)) !=
+           lru_order_->end())
+    {
+      entry.seq++;
+    }
+    entry.path = "unknown (automatic rebuild)";
+    if (rebuild_catalogs_->find(files[i].hash.ToString()) !=
+        rebuild_catalogs_->end())
+    {
+      entry.type = kFileCatalog;
+    }
+    PutEntry(files[i].hash, entry);
+  }
+
+  if (finished) {
+    StopRebuild(false);
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "rebuilding cache database finished, %"PRIu64" entries, "
+             "gauge %"PRIu64, uint64_t(entries_->size()), gauge_);
+    WriteSnapshot();
+    // The cache of a shared cache manager has no filter
+    if (!shared_)
+      CompleteCacheFilter();
+  }
+}
+
+
+/**
+ * Prepares rebuilding the LRU index based on the stat-information of files in
+ * the cache directory, the scan starts with StartRebuildScanners().  Until the
+ * rebuild is finished, the index is incomplete and cleanups are deferred.
  *
  * \return True on success, false otherwise
  */
 bool RebuildDatabase() {
-  bool result = false;
-  string sql;
-  sqlite3_stmt *stmt_select = NULL;
-  sqlite3_stmt *stmt_insert = NULL;
-  int sqlerr;
-  int seq = 0;
-  char hex[3];
-  struct stat info;
   platform_dirent64 *d;
   DIR *dirp = NULL;
-  string path;
-  set<string> catalogs;
+  set<string> *catalogs = new set<string>();
 
   LogCvmfs(kLogQuota, kLogDebug, "re-building cache-database");
-
-  // Empty cache catalog and fscache
-  sql = "DELETE FROM cache_catalog; DELETE FROM fscache;";
-  sqlerr = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (sqlerr != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not clear cache database");
-    goto build_return;
-  }
-
-  gauge_ = 0;
+  ClearIndex();
 
   // Gather file catalog hash values
   // TODO: distiction does not exist anymore
   if ((dirp = opendir(cache_dir_->c_str())) == NULL) {
-    LogCvmfs(kLogQuota, kLogDebug, "failed to open directory %s", path.c_str());
-    goto build_return;
+    LogCvmfs(kLogQuota, kLogDebug, "failed to open directory %s",
+             cache_dir_->c_str());
+    delete catalogs;
+    return false;
   }
   while ((d = platform_readdir(dirp)) != NULL) {
     if (d->d_type != DT_REG) continue;
@@ -570,7 +2248,7 @@ bool RebuildDatabase() {
         if (fread(sha1, 1, 40, f) == 40) {
           LogCvmfs(kLogQuota, kLogDebug, "added %s to catalog list",
                    string(sha1, 40).c_str());
-          catalogs.insert(string(sha1, 40).c_str());
+          catalogs->insert(string(sha1, 40).c_str());
         }
         fclose(f);
       }
@@ -578,282 +2256,280 @@ bool RebuildDatabase() {
   }
   closedir(dirp);
 
-  // Insert files from cache sub-directories 00 - ff
-  sqlite3_prepare_v2(db_, "INSERT INTO fscache (sha1, size, actime) "
-                     "VALUES (:sha1, :s, :t);", -1, &stmt_insert, NULL);
-
-  for (int i = 0; i <= 0xff; i++) {
-    snprintf(hex, sizeof(hex), "%02x", i);
-    path = (*cache_dir_) + "/" + string(hex);
-    if ((dirp = opendir(path.c_str())) == NULL) {
-      LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
-               "failed to open directory %s (tmpwatch interfering?)",
-               path.c_str());
-      goto build_return;
-    }
-    while ((d = platform_readdir(dirp)) != NULL) {
-      if (d->d_type != DT_REG) continue;
-
-      if (stat((path + "/" + string(d->d_name)).c_str(), &info) == 0) {
-        string sha1 = string(hex) + string(d->d_name);
-        sqlite3_bind_text(stmt_insert, 1, sha1.c_str(), sha1.length(),
-                          SQLITE_STATIC);
-        sqlite3_bind_int64(stmt_insert, 2, info.st_size);
-        sqlite3_bind_int64(stmt_insert, 3, info.st_atime);
-        if (sqlite3_step(stmt_insert) != SQLITE_DONE) {
-          LogCvmfs(kLogQuota, kLogDebug, "could not insert into temp table");
-          goto build_return;
-        }
-        sqlite3_reset(stmt_insert);
+  // An interrupted rebuild must not leave an index behind that looks valid
+  unlink(GetSnapshotPath().c_str());
+  unlink((*cache_dir_ + "/cachedb").c_str());
+
+  rebuild_start_ = time(NULL);
+  seq_ = (rebuild_start_ + 1) << kRebuildSeqShift;
+  rebuild_counter_ = 0;
+  last_merge_ = 0;
+  rebuild_catalogs_ = catalogs;
+  rebuild_files_ = new vector<CachedFile>();
+  rebuild_threads_ = new vector<pthread_t>();
+  pthread_mutex_lock(&lock_rebuild_);
+  rebuild_next_dir_ = 0;
+  rebuild_abort_ = false;
+  pthread_mutex_unlock(&lock_rebuild_);
+  rebuilding_ = true;
+  return true;
+}
 
-        gauge_ += info.st_size;
-      } else {
-        LogCvmfs(kLogQuota, kLogDebug, "could not stat %s/%s",
-                 path.c_str(), d->d_name);
-      }
-    }
-    closedir(dirp);
-    dirp = NULL;
-  }
-  sqlite3_finalize(stmt_insert);
-  stmt_insert = NULL;
-
-  // Transfer from temp table in cache catalog
-  sqlite3_prepare_v2(db_, "SELECT sha1, size FROM fscache ORDER BY actime;",
-                     -1, &stmt_select, NULL);
-  sqlite3_prepare_v2(db_,
-    "INSERT INTO cache_catalog (sha1, size, acseq, path, type, pinned) "
-    "VALUES (:sha1, :s, :seq, 'unknown (automatic rebuild)', :t, 0);",
-    -1, &stmt_insert, NULL);
-  while (sqlite3_step(stmt_select) == SQLITE_ROW) {
-    const string sha1 = string(
-      reinterpret_cast<const char *>(sqlite3_column_text(stmt_select, 0)));
-    sqlite3_bind_text(stmt_insert, 1, &sha1[0], sha1.length(), SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_insert, 2, sqlite3_column_int64(stmt_select, 1));
-    sqlite3_bind_int64(stmt_insert, 3, seq++);
-    if (catalogs.find(sha1) != catalogs.end())
-      sqlite3_bind_int64(stmt_insert, 4, kFileCatalog);
-    else
-      sqlite3_bind_int64(stmt_insert, 4, kFileRegular);
 
-    if (sqlite3_step(stmt_insert) != SQLITE_DONE) {
-      LogCvmfs(kLogQuota, kLogDebug, "could not insert into cache catalog");
-      goto build_return;
-    }
-    sqlite3_reset(stmt_insert);
+/**
+ * Starts the scanners of a rebuild prepared by RebuildDatabase().  Has to run
+ * after the fork() of the daemon, otherwise the scanners do not survive it.
+ * If no scanner thread can be created, the cache directory is scanned in the
+ * calling thread.
+ */
+static void StartRebuildScanners() {
+  if (!rebuilding_)
+    return;
+  pthread_mutex_lock(&lock_rebuild_);
+  for (unsigned i = 0; i < kRebuildThreads; ++i) {
+    pthread_t thread_scanner;
+    if (pthread_create(&thread_scanner, NULL, MainRebuildScanner, NULL) != 0)
+      break;
+    rebuild_threads_->push_back(thread_scanner);
+    rebuild_num_running_++;
   }
-
-  // Delete temporary table
-  sql = "DELETE FROM fscache;";
-  sqlerr = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (sqlerr != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not clear temporary table (%d)",
-             sqlerr);
-    goto build_return;
+  pthread_mutex_unlock(&lock_rebuild_);
+
+  if (rebuild_threads_->empty()) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "could not create rebuild threads, rebuilding in the foreground");
+    pthread_mutex_lock(&lock_rebuild_);
+    rebuild_num_running_++;
+    pthread_mutex_unlock(&lock_rebuild_);
+    MainRebuildScanner(NULL);
+    MergeRebuild(true);
+    return;
   }
-
-  seq_ = seq;
-  result = true;
-  LogCvmfs(kLogQuota, kLogDebug,
-           "rebuilding finished, seqence %"PRIu64 ", gauge %"PRIu64,
-           seq_, gauge_);
-
- build_return:
-  if (stmt_insert) sqlite3_finalize(stmt_insert);
-  if (stmt_select) sqlite3_finalize(stmt_select);
-  if (dirp) closedir(dirp);
-  return result;
+  LogCvmfs(kLogQuota, kLogDebug, "rebuilding with %u threads",
+           rebuild_threads_->size());
 }
   
   
+/**
+ * The cache catalog knows all the files in an exclusively used, managed cache.
+ * Feeds them into the cache's bloom filter.
+ */
+static void FillCacheFilter() {
+  cache::InitFilter(entries_->size());
+  for (map<hash::Any, LruEntry>::const_iterator i = entries_->begin(),
+       iEnd = entries_->end(); i != iEnd; ++i)
+  {
+    cache::FilterInsert(i->first);
+  }
+  LogCvmfs(kLogQuota, kLogDebug, "cache filter filled with %"PRIu64" objects",
+           uint64_t(entries_->size()));
+}
+
+
+/**
+ * Makes the pending filter of a rebuild authoritative.  Runs in the command
+ * server, so entries_ does not change meanwhile.
+ */
+static void CompleteCacheFilter() {
+  vector<hash::Any> objects;
+  objects.reserve(entries_->size());
+  for (map<hash::Any, LruEntry>::const_iterator i = entries_->begin(),
+       iEnd = entries_->end(); i != iEnd; ++i)
+  {
+    objects.push_back(i->first);
+  }
+  cache::CompleteFilter(objects);
+  LogCvmfs(kLogQuota, kLogDebug, "cache filter completed with %"PRIu64
+           " objects", uint64_t(objects.size()));
+}
+
+
+/**
+ * Loads the LRU index from the snapshot and the journal.  Falls back to the
+ * SQLite cache catalog if it is newer than the snapshot, i.e. if an older
+ * version of cvmfs used the cache in the meantime, and to the file system.
+ */
 static bool InitDatabase(const bool rebuild_database) {
-  string sql;
-  sqlite3_stmt *stmt;
-  
   fd_lock_cachedb_ = LockFile(*cache_dir_ + "/lock_cachedb");
   if (fd_lock_cachedb_ < 0) {
     LogCvmfs(kLogCvmfs, kLogDebug, "failed to create cachedb lock");
     return false;
   }
   
-  bool retry = false;
-init_recover:
-  const string db_file = (*cache_dir_) + "/cachedb";
-  int err = sqlite3_open(db_file.c_str(), &db_);
-  if (err != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not open cache database (%d)", err);
-    goto init_database_fail;
-  }
-  sql = "PRAGMA synchronous=0; PRAGMA locking_mode=EXCLUSIVE; "
-  "PRAGMA auto_vacuum=1; "
-  "CREATE TABLE IF NOT EXISTS cache_catalog (sha1 TEXT, size INTEGER, "
-  "  acseq INTEGER, path TEXT, type INTEGER, pinned INTEGER, "
-  "CONSTRAINT pk_cache_catalog PRIMARY KEY (sha1)); "
-  "CREATE UNIQUE INDEX IF NOT EXISTS idx_cache_catalog_acseq "
-  "  ON cache_catalog (acseq); "
-  "CREATE TEMP TABLE fscache (sha1 TEXT, size INTEGER, actime INTEGER, "
-  "CONSTRAINT pk_fscache PRIMARY KEY (sha1)); "
-  "CREATE INDEX idx_fscache_actime ON fscache (actime); "
-  "CREATE TABLE IF NOT EXISTS properties (key TEXT, value TEXT, "
-  "  CONSTRAINT pk_properties PRIMARY KEY(key));";
-  err = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (err != SQLITE_OK) {
-    if (!retry) {
-      retry = true;
-      sqlite3_close(db_);
-      unlink(db_file.c_str());
-      unlink((db_file + "-journal").c_str());
-      LogCvmfs(kLogQuota, kLogSyslog, "LRU database corrupted, re-building");
-      goto init_recover;
-    }
-    LogCvmfs(kLogQuota, kLogDebug, "could not init cache database (failed: %s)",
-             sql.c_str());
-    goto init_database_fail;
-  }
-  
-  // If this an old cache catalog,
-  // add and initialize new columns to cache_catalog
-  sql = "ALTER TABLE cache_catalog ADD type INTEGER; "
-  "ALTER TABLE cache_catalog ADD pinned INTEGER";
-  err = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (err == SQLITE_OK) {
-    sql = "UPDATE cache_catalog SET type=" + StringifyInt(kFileRegular) + ";";
-    err = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-    if (err != SQLITE_OK) {
-      LogCvmfs(kLogQuota, kLogDebug,
-               "could not init cache database (failed: %s)", sql.c_str());
-      UnlockFile(fd_lock_cachedb_);
-      return false;
-    }
-  }
-  
-  // Set pinned back
-  sql = "UPDATE cache_catalog SET pinned=0;";
-  err = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (err != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not init cache database (failed: %s)",
-             sql.c_str());
-    goto init_database_fail;
-  }
-  
-  // Set schema version
-  sql = "INSERT OR REPLACE INTO properties (key, value) "
-  "VALUES ('schema', '1.0')";
-  err = sqlite3_exec(db_, sql.c_str(), NULL, NULL, NULL);
-  if (err != SQLITE_OK) {
-    LogCvmfs(kLogQuota, kLogDebug, "could not init cache database (failed: %s)",
-             sql.c_str());
-    goto init_database_fail;
-  }
-  
   // Easy way out, no quota restrictions
   if (limit_ == 0) {
     gauge_ = 0;
     return true;
   }
-  
-  // If cache catalog is empty, recreate from file system
-  sql = "SELECT count(*) FROM cache_catalog;";
-  sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, NULL);
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    if ((sqlite3_column_int64(stmt, 0)) == 0 || rebuild_database) {
-      LogCvmfs(kLogCvmfs, kLogStdout,
-               "CernVM-FS: building lru cache database...");
-      if (!RebuildDatabase()) {
-        LogCvmfs(kLogQuota, kLogDebug,
-                 "could not build cache database from file system");
-        goto init_database_fail;
-      }
+
+  entries_ = new map<hash::Any, LruEntry>();
+  lru_order_ = new map<EvictionKey, hash::Any>();
+  repos_ = new deque<RepoShare>(1);
+  ghosts_ = new set<hash::Any>();
+  ghost_order_ = new deque<hash::Any>();
+  journal_buffer_ = new string();
+  num_journal_records_ = 0;
+  ClearIndex();
+
+  platform_stat64 info_db;
+  platform_stat64 info_snapshot;
+  const bool has_db =
+    platform_stat(((*cache_dir_) + "/cachedb").c_str(), &info_db) == 0;
+  const bool has_snapshot =
+    platform_stat(GetSnapshotPath().c_str(), &info_snapshot) == 0;
+  bool loaded = false;
+  bool compact = true;
+  if (!rebuild_database) {
+    if (has_snapshot &&
+        !(has_db && (info_db.st_mtime > info_snapshot.st_mtime)))
+    {
+      loaded = LoadSnapshot();
+      if (loaded)
+        compact = !ReplayJournal();
     }
-  } else {
-    LogCvmfs(kLogQuota, kLogDebug, "could not select on cache catalog");
-    sqlite3_finalize(stmt);
-    goto init_database_fail;
+    if (!loaded && has_db)
+      loaded = ImportDatabase();
   }
-  sqlite3_finalize(stmt);
-  
-  // How many bytes do we already have in cache?
-  sql = "SELECT sum(size) FROM cache_catalog;";
-  sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, NULL);
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    gauge_ = sqlite3_column_int64(stmt, 0);
-  } else {
-    LogCvmfs(kLogQuota, kLogDebug, "could not determine cache size");
-    sqlite3_finalize(stmt);
-    goto init_database_fail;
+
+  // If the index is empty, recreate from file system
+  if (!loaded || entries_->empty()) {
+    LogCvmfs(kLogCvmfs, kLogStdout,
+             "CernVM-FS: building lru cache database in the background...");
+    if (!RebuildDatabase()) {
+      LogCvmfs(kLogQuota, kLogDebug,
+               "could not build cache database from file system");
+      goto init_database_fail;
+    }
+    // The snapshot is written once the rebuild is finished
+    compact = false;
   }
-  sqlite3_finalize(stmt);
-  
-  // Highest seq-no?
-  sql = "SELECT coalesce(max(acseq), 0) FROM cache_catalog;";
-  sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, NULL);
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    seq_ = sqlite3_column_int64(stmt, 0)+1;
-  } else {
-    LogCvmfs(kLogQuota, kLogDebug, "could not determine highest seq-no");
-    sqlite3_finalize(stmt);
+
+  fd_journal_ = open(GetJournalPath().c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                     0600);
+  if (fd_journal_ < 0) {
+    LogCvmfs(kLogQuota, kLogDebug, "could not open LRU journal (%d)", errno);
     goto init_database_fail;
   }
-  sqlite3_finalize(stmt);
-  
-  // Prepare touch, new, remove statements
-  sqlite3_prepare_v2(db_, "UPDATE cache_catalog SET acseq=:seq "
-                     "WHERE sha1=:sha1;", -1, &stmt_touch_, NULL);
-  sqlite3_prepare_v2(db_, "UPDATE cache_catalog SET pinned=0 "
-                     "WHERE sha1=:sha1;", -1, &stmt_unpin_, NULL);
-  sqlite3_prepare_v2(db_,
-                     "INSERT OR REPLACE INTO cache_catalog "
-                     "(sha1, size, acseq, path, type, pinned) "
-                     "VALUES (:sha1, :s, :seq, :p, :t, :pin);", -1, &stmt_new_, NULL);
-  sqlite3_prepare_v2(db_,
-                     "SELECT size, pinned FROM cache_catalog WHERE sha1=:sha1;",
-                     -1, &stmt_size_, NULL);
-  sqlite3_prepare_v2(db_, "DELETE FROM cache_catalog WHERE sha1=:sha1;",
-                     -1, &stmt_rm_, NULL);
-  sqlite3_prepare_v2(db_,
-                     "SELECT sha1, size FROM cache_catalog WHERE acseq=(SELECT min(acseq) "
-                     "FROM cache_catalog WHERE pinned=0);", -1, &stmt_lru_, NULL);
-  sqlite3_prepare_v2(db_,
-                     ("SELECT path FROM cache_catalog WHERE type=" + StringifyInt(kFileRegular) +
-                      ";").c_str(), -1, &stmt_list_, NULL);
-  sqlite3_prepare_v2(db_, "SELECT path FROM cache_catalog WHERE pinned=1;",
-                     -1, &stmt_list_pinned_, NULL);
-  sqlite3_prepare_v2(db_,
-                     ("SELECT path FROM cache_catalog WHERE type=" + StringifyInt(kFileCatalog) +
-                      ";").c_str(), -1, &stmt_list_catalogs_, NULL);
+  if (compact && !WriteSnapshot())
+    goto init_database_fail;
+
+  LogCvmfs(kLogQuota, kLogDebug, "LRU index loaded, %"PRIu64" entries, "
+           "gauge %"PRIu64", sequence %"PRIu64, uint64_t(entries_->size()),
+           gauge_, seq_);
   return true;
   
  init_database_fail:
+  if (rebuilding_)
+    StopRebuild(true);
+  if (fd_journal_ >= 0)
+    close(fd_journal_);
+  fd_journal_ = -1;
+  delete entries_;
+  delete lru_order_;
+  delete repos_;
+  delete journal_buffer_;
+  delete ghosts_;
+  delete ghost_order_;
+  entries_ = NULL;
+  lru_order_ = NULL;
+  repos_ = NULL;
+  journal_buffer_ = NULL;
+  ghosts_ = NULL;
+  ghost_order_ = NULL;
   UnlockFile(fd_lock_cachedb_);
-  sqlite3_close(db_);
   return false;
 }
   
 
+/**
+ * Writes the cache catalog and a final snapshot.  The snapshot is written
+ * last, so that it is not taken for outdated on the next start.
+ */
 static void CloseDatabase() {
-  if (stmt_list_catalogs_) sqlite3_finalize(stmt_list_catalogs_);
-  if (stmt_list_pinned_) sqlite3_finalize(stmt_list_pinned_);
-  if (stmt_list_) sqlite3_finalize(stmt_list_);
-  if (stmt_lru_) sqlite3_finalize(stmt_lru_);
-  if (stmt_rm_) sqlite3_finalize(stmt_rm_);
-  if (stmt_size_) sqlite3_finalize(stmt_size_);
-  if (stmt_touch_) sqlite3_finalize(stmt_touch_);
-  if (stmt_unpin_) sqlite3_finalize(stmt_unpin_);
-  if (stmt_new_) sqlite3_finalize(stmt_new_);
-  if (db_) sqlite3_close(db_);
+  if (entries_) {
+    if (rebuilding_) {
+      // Nothing is written, the next start rebuilds again
+      LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+               "cache database rebuild interrupted");
+      StopRebuild(true);
+    } else {
+      FlushJournal();
+      ExportDatabase();
+      WriteSnapshot();
+    }
+    close(fd_journal_);
+    fd_journal_ = -1;
+    delete entries_;
+    delete lru_order_;
+    delete repos_;
+    delete journal_buffer_;
+    delete ghosts_;
+    delete ghost_order_;
+    entries_ = NULL;
+    lru_order_ = NULL;
+    repos_ = NULL;
+    journal_buffer_ = NULL;
+    ghosts_ = NULL;
+    ghost_order_ = NULL;
+  }
   UnlockFile(fd_lock_cachedb_);
   
-  stmt_list_catalogs_ = NULL;
-  stmt_list_pinned_ = NULL;
-  stmt_list_ = NULL;
-  stmt_rm_ = NULL;
-  stmt_size_ = NULL;
-  stmt_touch_ = NULL;
-  stmt_new_ = NULL;
-  db_ = NULL;
-  
   delete pinned_chunks_;
+  delete pin_owners_;
   pinned_chunks_ = NULL;
+  pin_owners_ = NULL;
+}
+
+
+/**
+ * Selects the eviction policy, has to be called before Init() or
+ * InitShared().  A running shared cache manager keeps its policy.
+ */
+bool SetEvictionPolicy(const string &name) {
+  for (unsigned i = 0; i < kNumPolicies; ++i) {
+    if (name == kPolicyNames[i]) {
+      policy_ = static_cast<EvictionPolicy>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/**
+ * Announces the repository of this cvmfs process to the cache manager, with
+ * its soft share and its guaranteed minimum of the cache in bytes (0 for
+ * none).  Has to be called after Init() or InitShared() and before the first
+ * insert.
+ */
+bool RegisterRepository(const string &name, const uint64_t share,
+                        const uint64_t guarantee)
+{
+  if (limit_ == 0)
+    return true;
+  if (!spawned_) {
+    repo_id_ = DoRegister(name, share, guarantee);
+    return repo_id_ > 0;
+  }
+
+  int pipe_register[2];
+  MakeReturnPipe(pipe_register);
+  const unsigned name_length = min(name.length(), size_t(kMaxCvmfsPath));
+  char buffer[sizeof(LruCommand) + kMaxCvmfsPath];
+  LruCommand cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.command_type = kRegister;
+  cmd.size = share;
+  cmd.guarantee = guarantee;
+  cmd.path_length = name_length;
+  cmd.return_pipe = pipe_register[1];
+  memcpy(buffer, &cmd, sizeof(cmd));
+  memcpy(buffer + sizeof(cmd), name.data(), name_length);
+  WritePipe(pipe_lru_[1], buffer, sizeof(cmd) + name_length);
+  if (!ReadReply(pipe_register[0], &repo_id_, sizeof(repo_id_)))
+    repo_id_ = 0;
+  CloseReturnPipe(pipe_register);
+  return repo_id_ > 0;
 }
 
 
@@ -866,6 +2542,7 @@ bool InitShared(const std::string &exe_path, const std::string &cache_dir,
   shared_ = true;
   spawned_ = true;
   cache_dir_ = new string(cache_dir);
+  InitTouchBuffer();
   
   // Create lock file
   const int fd_lockfile = LockFile(*cache_dir_ + "/lock_cachemgr");
@@ -881,9 +2558,16 @@ bool InitShared(const std::string &exe_path, const std::string &cache_dir,
   pipe_lru_[1] = open(fifo_path.c_str(), O_WRONLY | O_NONBLOCK);
   if (pipe_lru_[1] >= 0) {
     LogCvmfs(kLogQuota, kLogDebug, "connected to existing cache manager pipe");
+    if (!CheckProtocolRevision()) {
+      close(pipe_lru_[1]);
+      UnlockFile(fd_lockfile);
+      return false;
+    }
     Nonblock2Block(pipe_lru_[1]);
     UnlockFile(fd_lockfile);
-    GetLimits(&limit_, &cleanup_threshold_);
+    AttachRing();
+    if (!GetLimits(&limit_, &cleanup_threshold_))
+      return false;
     LogCvmfs(kLogQuota, kLogDebug, "received limit %"PRIu64", threshold %"PRIu64,
              limit_, cleanup_threshold_);
     return true;
@@ -918,6 +2602,7 @@ bool InitShared(const std::string &exe_path, const std::string &cache_dir,
   command_line.push_back(StringifyInt(cleanup_threshold));
   command_line.push_back(StringifyInt(cvmfs::foreground_));
   command_line.push_back(GetLogDebugFile());
+  command_line.push_back(kPolicyNames[policy_]);
   
   vector<int> preserve_filedes;
   preserve_filedes.push_back(0);
@@ -973,7 +2658,9 @@ bool InitShared(const std::string &exe_path, const std::string &cache_dir,
   
   UnlockFile(fd_lockfile);
   
-  GetLimits(&limit_, &cleanup_threshold_);
+  AttachRing();
+  if (!GetLimits(&limit_, &cleanup_threshold_))
+    return false;
   LogCvmfs(kLogQuota, kLogDebug, "received limit %"PRIu64", threshold %"PRIu64,
            limit_, cleanup_threshold_);
   return true;
@@ -995,6 +2682,7 @@ int MainCacheManager(int argc, char **argv) {
   spawned_ = true;
   pinned_ = 0;
   pinned_chunks_ = new map<hash::Any, uint64_t>();
+  pin_owners_ = new map<hash::Any, set<pid_t> >();
   
   // Process command line arguments
   cache_dir_ = new string(argv[2]);
@@ -1006,13 +2694,21 @@ int MainCacheManager(int argc, char **argv) {
   const string logfile = argv[8];
   if (logfile != "")
     SetLogDebugFile(logfile + ".cachemgr");
+  if ((argc > 9) && !SetEvictionPolicy(argv[9])) {
+    LogCvmfs(kLogQuota, kLogDebug | kLogSyslog,
+             "unknown eviction policy %s, using lru", argv[9]);
+  }
   
   if (!foreground)
     Daemonize();
   
   if (!InitDatabase(false))  // TODO: rebuild?
     return 1;
+  StartRebuildScanners();
+  CreateRing();
   
+  WriteProtocolRevision();
+
   // Initialize pipe, open non-blocking as cvmfs is not yet connected
   const string fifo_path = *cache_dir_ + "/cachemgr";
   pipe_lru_[0] = open(fifo_path.c_str(), O_RDONLY | O_NONBLOCK);
@@ -1033,6 +2729,8 @@ int MainCacheManager(int argc, char **argv) {
   
   MainCommandServer(NULL);
   unlink(fifo_path.c_str());
+  unlink(GetProtocolPath().c_str());
+  DetachRing(true);
   CloseDatabase();
   
   monitor::Fini();
@@ -1068,10 +2766,20 @@ bool Init(const string &cache_dir, const uint64_t limit,
   cleanup_threshold_ = cleanup_threshold;
   cache_dir_ = new string(cache_dir);
   pinned_chunks_ = new map<hash::Any, uint64_t>();
+  pin_owners_ = new map<hash::Any, set<pid_t> >();
+  InitTouchBuffer();
 
   // Initialize cache catalog
   if (!InitDatabase(rebuild_database))
     return false;
+  // The filter would have false negatives during a rebuild, it is completed
+  // when the rebuild finishes
+  if (limit_ > 0) {
+    if (rebuilding_)
+      cache::InitPendingFilter();
+    else
+      FillCacheFilter();
+  }
 
   MakePipe(pipe_lru_);
 
@@ -1080,12 +2788,17 @@ bool Init(const string &cache_dir, const uint64_t limit,
 
 
 /**
- * Spawns the LRU thread
+ * Spawns the LRU thread and the scanners of a pending rebuild.  Clients of a
+ * shared cache manager only get the thread that flushes buffered touches.
  */
 void Spawn() { 
-  if (spawned_ || (limit_ == 0))
+  if (limit_ == 0)
+    return;
+  StartTouchFlusher();
+  if (spawned_)
     return;
 
+  StartRebuildScanners();
   if (pthread_create(&thread_lru_, NULL, MainCommandServer, NULL) != 0) {
     LogCvmfs(kLogQuota, kLogDebug, "could not create lru thread");
     abort();
@@ -1099,12 +2812,20 @@ void Spawn() {
  * Cleanup, closes SQLite connections.
  */
 void Fini() {
-  delete cache_dir_;
-  cache_dir_ = NULL;
-  
+  StopTouchFlusher();
+  SyncTouches(true);
+  delete touch_buffer_;
+  delete touch_set_;
+  touch_buffer_ = NULL;
+  touch_set_ = NULL;
+
   if (shared_) {
     // Most of cleanup is done elsewhen by shared cache manager
+    DetachRing(false);
+    DestroyReturnPipe();
     close(pipe_lru_[1]);
+    delete cache_dir_;
+    cache_dir_ = NULL;
     return;
   }
 
@@ -1117,7 +2838,10 @@ void Fini() {
     ClosePipe(pipe_lru_);
   }
 
+  // Writing the snapshot and the cache database needs the cache directory
   CloseDatabase();
+  delete cache_dir_;
+  cache_dir_ = NULL;
 }
 
 
@@ -1133,6 +2857,7 @@ bool Cleanup(const uint64_t leave_size) {
   if (!spawned_) {
     return DoCleanup(leave_size);
   }
+  SyncTouches(true);
 
   int pipe_cleanup[2];
   MakeReturnPipe(pipe_cleanup);
@@ -1143,7 +2868,8 @@ bool Cleanup(const uint64_t leave_size) {
   cmd.return_pipe = pipe_cleanup[1];
 
   WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
-  ReadHalfPipe(pipe_cleanup[0], &result, sizeof(result));
+  if (!ReadReply(pipe_cleanup[0], &result, sizeof(result)))
+    result = false;
   CloseReturnPipe(pipe_cleanup);
 
   return result;
@@ -1158,16 +2884,18 @@ static void DoInsert(const hash::Any &hash, const uint64_t size,
            hash_str.c_str(), cvmfs_path.c_str());
   const unsigned path_length = (cvmfs_path.length() > kMaxCvmfsPath) ?
     kMaxCvmfsPath : cvmfs_path.length();
+  SyncTouches(false);
 
   LruCommand *cmd = reinterpret_cast<LruCommand *>(
                       alloca(sizeof(LruCommand) + path_length));
   cmd->command_type = pin ? kPin : kInsert;
   cmd->size = size;
+  cmd->repo = repo_id_;
   memcpy(cmd->digest, hash.digest, hash.GetDigestSize());
   cmd->path_length = path_length;
   memcpy(reinterpret_cast<char *>(cmd)+sizeof(LruCommand),
          &cvmfs_path[0], path_length);
-  WritePipe(pipe_lru_[1], cmd, sizeof(LruCommand) + path_length);
+  SendCommand(cmd, sizeof(LruCommand) + path_length);
 }
 
 
@@ -1183,6 +2911,49 @@ void Insert(const hash::Any &any_hash, const uint64_t size,
 }
 
 
+/**
+ * Inserts many files with as few pipe writes as possible.  Every write stays
+ * below PIPE_BUF, so that commands of different writers don't interleave.
+ * The command server stores up to kCommandBufferSize inserts in a single
+ * database transaction.  With a command ring, the pipe is only used once the
+ * ring is full.
+ */
+void InsertBatch(const vector<hash::Any> &hashes, const vector<uint64_t> &sizes,
+                 const vector<string> &cvmfs_paths)
+{
+  if ((limit_ == 0) || hashes.empty()) return;
+
+  char buffer[PIPE_BUF];
+  unsigned pos = 0;
+  for (unsigned i = 0; i < hashes.size(); ++i) {
+    const unsigned path_length = (cvmfs_paths[i].length() > kMaxCvmfsPath) ?
+      kMaxCvmfsPath : cvmfs_paths[i].length();
+    const unsigned length = sizeof(LruCommand) + path_length;
+    if (pos + length > sizeof(buffer)) {
+      WritePipe(pipe_lru_[1], buffer, pos);
+      pos = 0;
+    }
+
+    LruCommand cmd;
+    cmd.command_type = kInsert;
+    cmd.size = sizes[i];
+    cmd.repo = repo_id_;
+    memcpy(cmd.digest, hashes[i].digest, hashes[i].GetDigestSize());
+    cmd.path_length = path_length;
+    memcpy(buffer + pos, &cmd, sizeof(cmd));
+    memcpy(buffer + pos + sizeof(cmd), cvmfs_paths[i].data(), path_length);
+    if ((ring_ == NULL) || !PushRing(buffer + pos, length))
+      pos += length;
+  }
+  if (ring_ != NULL)
+    WakeConsumer();
+  if (pos > 0)
+    WritePipe(pipe_lru_[1], buffer, pos);
+  LogCvmfs(kLogQuota, kLogDebug, "inserted %"PRIu64" files into lru",
+           uint64_t(hashes.size()));
+}
+
+
 /**
  * Immediately inserts a new pinned catalog.
  * Does cache cleanup if necessary.
@@ -1211,25 +2982,9 @@ bool Pin(const hash::Any &hash, const uint64_t size,
         pinned_ += size;
       }
     }
-    bool exists = Contains(hash_str);
-    if (!exists && (gauge_ + size > limit_)) {
-      LogCvmfs(kLogQuota, kLogDebug, "over limit, gauge %lu, file size %lu",
-               gauge_, size);
-      int retval = DoCleanup(cleanup_threshold_);
-      assert(retval != 0);
-    }
-    sqlite3_bind_text(stmt_new_, 1, &hash_str[0], hash_str.length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_new_, 2, size);
-    sqlite3_bind_int64(stmt_new_, 3, seq_++);
-    sqlite3_bind_text(stmt_new_, 4, &cvmfs_path[0], cvmfs_path.length(),
-                      SQLITE_STATIC);
-    sqlite3_bind_int64(stmt_new_, 5, kFileCatalog);
-    sqlite3_bind_int64(stmt_new_, 6, 1);
-    int retval = sqlite3_step(stmt_new_);
-    assert((retval == SQLITE_DONE) || (retval == SQLITE_OK));
-    sqlite3_reset(stmt_new_);
-    if (!exists) gauge_ += size;
+    InsertEntry(hash, size, kFileCatalog, cvmfs_path.data(),
+                min(cvmfs_path.length(), size_t(kMaxCvmfsPath)), repo_id_);
+    FlushJournal();
     return true;
   }
 
@@ -1241,9 +2996,11 @@ bool Pin(const hash::Any &hash, const uint64_t size,
   cmd.size = size;
   memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
   cmd.return_pipe = pipe_reserve[1];
+  cmd.pid = getpid();
   WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
   bool result;
-  ReadHalfPipe(pipe_reserve[0], &result, sizeof(result));
+  if (!ReadReply(pipe_reserve[0], &result, sizeof(result)))
+    result = false;
   CloseReturnPipe(pipe_reserve);
 
   if (!result) return false;
@@ -1260,20 +3017,31 @@ void Unpin(const hash::Any &hash) {
   LruCommand cmd;
   cmd.command_type = kUnpin;
   memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  cmd.pid = getpid();
+  SendCommand(&cmd, sizeof(cmd));
 }
 
 
 /**
- * Updates the sequence number of the file specified by the hash.
+ * Updates the sequence number of the file specified by the hash.  Touches
+ * are buffered and deduplicated for up to kTouchWindowMs.
  */
 void Touch(const hash::Any &hash) {
   if (limit_ == 0) return;
 
-  LruCommand cmd;
-  cmd.command_type = kTouch;
-  memcpy(cmd.digest, hash.digest, hash.GetDigestSize());
-  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  pthread_mutex_lock(&lock_touch_);
+  num_touches_++;
+  if (touch_set_->insert(hash).second)
+    touch_buffer_->push_back(hash);
+  const uint64_t now = GetTimeMs();
+  if (touch_window_start_ == 0)
+    touch_window_start_ = now;
+  if ((touch_buffer_->size() >= kTouchBufferSize) ||
+      (now >= touch_window_start_ + kTouchWindowMs))
+  {
+    FlushTouches();
+  }
+  pthread_mutex_unlock(&lock_touch_);
 }
 
 
@@ -1290,31 +3058,78 @@ void Remove(const hash::Any &hash) {
     WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
   }
 
-  unlink(((*cache_dir_) + hash.MakePath(1, 2)).c_str());
+  if (UnlinkObject(hash))
+    cache::FilterRemove(hash);
 }
 
 
-static vector<string> DoList(const CommandType list_command) {
-  vector<string> result;
+/**
+ * Retrieves the next page of the listing into page.  A page can be empty
+ * if the filter skips all the entries visited by the cache manager.
+ *
+ * \return false if the listing is finished, page is empty then
+ */
+bool ListIterator::NextPage(vector<string> *page) {
+  page->clear();
+  if (finished_)
+    return false;
+
+  SyncTouches(true);
   int pipe_list[2];
   MakeReturnPipe(pipe_list);
   char path_buffer[kMaxCvmfsPath];
 
   LruCommand cmd;
-  cmd.command_type = list_command;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.command_type = kListPage;
   cmd.return_pipe = pipe_list[1];
+  cmd.size = kListPageSize;
+  cmd.min_size = filter_.min_size;
+  cmd.max_size = filter_.max_size;
+  cmd.min_idle = filter_.min_idle;
+  cmd.selection = filter_.selection;
+  cmd.resume = !cursor_.empty();
+  if (cmd.resume)
+    memcpy(cmd.digest, cursor_.data(), sizeof(cmd.digest));
   WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
 
   int length;
+  bool complete;
   do {
-    ReadHalfPipe(pipe_list[0], &length, sizeof(length));
-    if (length > 0) {
-      ReadPipe(pipe_list[0], path_buffer, length);
-      result.push_back(string(path_buffer, length));
+    complete = ReadReply(pipe_list[0], &length, sizeof(length));
+    if (complete && (length > 0)) {
+      complete = ReadReply(pipe_list[0], path_buffer, length);
+      page->push_back(string(path_buffer, length));
     }
-  } while (length >= 0);
-
+  } while (complete && (length >= 0));
+  bool finished = true;
+  unsigned char last[hash::kMaxDigestSize];
+  if (complete) {
+    complete = ReadReply(pipe_list[0], &finished, sizeof(finished)) &&
+               ReadReply(pipe_list[0], last, sizeof(last));
+  }
   CloseReturnPipe(pipe_list);
+  if (!complete) {
+    page->clear();
+    finished_ = true;
+    return false;
+  }
+
+  finished_ = finished;
+  cursor_ = string(reinterpret_cast<char *>(last), sizeof(last));
+  return !page->empty() || !finished_;
+}
+
+
+/**
+ * Collects all the pages of a listing.  Prefer ListIterator for large caches.
+ */
+vector<string> List(const ListFilter &filter) {
+  vector<string> result;
+  vector<string> page;
+  ListIterator iter(filter);
+  while (iter.NextPage(&page))
+    result.insert(result.end(), page.begin(), page.end());
   return result;
 }
 
@@ -1323,7 +3138,7 @@ static vector<string> DoList(const CommandType list_command) {
  * Lists all path names from the cache db.
  */
 vector<string> List() {
-  return DoList(kList);
+  return List(ListFilter());
 }
 
 
@@ -1331,7 +3146,9 @@ vector<string> List() {
  * Lists all pinned files from the cache db.
  */
 vector<string> ListPinned() {
-  return DoList(kListPinned);
+  ListFilter filter;
+  filter.selection = kSelectPinned;
+  return List(filter);
 }
 
 
@@ -1339,7 +3156,9 @@ vector<string> ListPinned() {
  * Lists all catalog files from the cache db.
  */
 vector<string> ListCatalogs() {
-  return DoList(kListCatalogs);
+  ListFilter filter;
+  filter.selection = kSelectCatalogs;
+  return List(filter);
 }
 
 
@@ -1366,8 +3185,11 @@ static void GetStatus(uint64_t *gauge, uint64_t *pinned) {
   cmd.command_type = kStatus;
   cmd.return_pipe = pipe_status[1];
   WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
-  ReadHalfPipe(pipe_status[0], gauge, sizeof(*gauge));
-  ReadPipe(pipe_status[0], pinned, sizeof(*pinned));
+  if (!ReadReply(pipe_status[0], gauge, sizeof(*gauge)) ||
+      !ReadReply(pipe_status[0], pinned, sizeof(*pinned)))
+  {
+    *gauge = *pinned = 0;
+  }
   CloseReturnPipe(pipe_status);
 }
 
@@ -1390,7 +3212,47 @@ uint64_t GetSizePinned() {
 }
   
 
-static void GetLimits(uint64_t *limit, uint64_t *cleanup_threshold) {
+/**
+ * Cache usage of the repositories known to the cache manager.  The first
+ * entry has no name, it collects the objects of unknown origin.
+ */
+vector<RepositoryUsage> GetRepositoryUsage() {
+  vector<RepositoryUsage> result;
+  int pipe_list[2];
+  MakeReturnPipe(pipe_list);
+  char name_buffer[kMaxCvmfsPath];
+
+  LruCommand cmd;
+  cmd.command_type = kListRepos;
+  cmd.return_pipe = pipe_list[1];
+  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+
+  int length;
+  do {
+    if (!ReadReply(pipe_list[0], &length, sizeof(length)))
+      break;
+    if (length >= 0) {
+      uint64_t usage[3];
+      if (((length > 0) && !ReadReply(pipe_list[0], name_buffer, length)) ||
+          !ReadReply(pipe_list[0], usage, sizeof(usage)))
+      {
+        break;
+      }
+      RepositoryUsage repo;
+      repo.name = string(name_buffer, length);
+      repo.size = usage[0];
+      repo.share = usage[1];
+      repo.guarantee = usage[2];
+      result.push_back(repo);
+    }
+  } while (length >= 0);
+
+  CloseReturnPipe(pipe_list);
+  return result;
+}
+
+
+static bool GetLimits(uint64_t *limit, uint64_t *cleanup_threshold) {
   int pipe_limits[2];
   MakeReturnPipe(pipe_limits);
   
@@ -1398,41 +3260,75 @@ static void GetLimits(uint64_t *limit, uint64_t *cleanup_threshold) {
   cmd.command_type = kLimits;
   cmd.return_pipe = pipe_limits[1];
   WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
-  ReadHalfPipe(pipe_limits[0], limit, sizeof(*limit));
-  ReadPipe(pipe_limits[0], cleanup_threshold, sizeof(*cleanup_threshold));
+  const bool result =
+    ReadReply(pipe_limits[0], limit, sizeof(*limit)) &&
+    ReadReply(pipe_limits[0], cleanup_threshold, sizeof(*cleanup_threshold));
   CloseReturnPipe(pipe_limits);
+  return result;
 }
 
 
-string GetMemoryUsage() {
-  return "TBD\n";
-/*  if (limit == 0)
-    return "LRU not active\n";
-
-  string result("LRU:\n");
-  int current = 0;
-  int highwater = 0;
-
-  pthread_mutex_lock(&mutex);
+/**
+ * Policy, hits, misses, evictions, and misses of recently evicted objects
+ */
+static void GetPolicyStatistics(uint64_t statistics[5]) {
+  if (!spawned_) {
+    statistics[0] = policy_;
+    statistics[1] = num_hits_;
+    statistics[2] = num_misses_;
+    statistics[3] = num_evictions_;
+    statistics[4] = num_refetches_;
+    return;
+  }
 
-  sqlite3_db_status(db, SQLITE_DBSTATUS_LOOKASIDE_USED,
-                    &current, &highwater, 0);
-  result += "  Number of lookaside slots used " + StringifyInt(current) +
-            " / " + StringifyInt(highwater) + "\n";
+  int pipe_statistics[2];
+  MakeReturnPipe(pipe_statistics);
 
-  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0);
-  result += "  Page cache used " + StringifyInt(current/1024) + " KB\n";
+  LruCommand cmd;
+  cmd.command_type = kStatistics;
+  cmd.return_pipe = pipe_statistics[1];
+  WritePipe(pipe_lru_[1], &cmd, sizeof(cmd));
+  if (!ReadReply(pipe_statistics[0], statistics, 5*sizeof(uint64_t)))
+    memset(statistics, 0, 5*sizeof(uint64_t));
+  CloseReturnPipe(pipe_statistics);
+}
 
-  sqlite3_db_status(db, SQLITE_DBSTATUS_SCHEMA_USED, &current, &highwater, 0);
-  result += "  Schema memory used " + StringifyInt(current/1024) + " KB\n";
 
-  sqlite3_db_status(db, SQLITE_DBSTATUS_STMT_USED, &current, &highwater, 0);
-  result += "  Prepared statements memory used " + StringifyInt(current/1024) +
-            " KB\n";
+/**
+ * Reports how well the touch buffer coalesces repeated cache hits and how
+ * well the eviction policy does.  Hits are counted after the coalescing.
+ */
+string GetMemoryUsage() {
+  if (touch_buffer_ == NULL)
+    return "LRU not active\n";
 
-  pthread_mutex_unlock(&mutex);
+  pthread_mutex_lock(&lock_touch_);
+  const uint64_t num_touches = num_touches_;
+  const uint64_t num_sent = num_touches_sent_;
+  const unsigned num_buffered = touch_buffer_->size();
+  pthread_mutex_unlock(&lock_touch_);
+
+  string result = "touches: " + StringifyInt(num_touches) +
+    "  sent: " + StringifyInt(num_sent) +
+    "  buffered: " + StringifyInt(num_buffered);
+  if (num_touches > num_buffered) {
+    result += "  coalesced: " + StringifyInt(
+      100 - (num_sent*100) / (num_touches - num_buffered)) + "%";
+  }
 
-  return result;*/
+  uint64_t statistics[5];
+  GetPolicyStatistics(statistics);
+  const uint64_t num_lookups = statistics[1] + statistics[2];
+  result += "\n  policy: " + string((statistics[0] < kNumPolicies) ?
+                                    kPolicyNames[statistics[0]] : "unknown") +
+    "  hits: " + StringifyInt(statistics[1]) +
+    "  misses: " + StringifyInt(statistics[2]);
+  if (num_lookups > 0)
+    result += "  hit rate: " +
+              StringifyInt(statistics[1]*100 / num_lookups) + "%";
+  result += "\n  evictions: " + StringifyInt(statistics[3]) +
+    "  fetched again: " + StringifyInt(statistics[4]);
+  return result + "\n";
 }
 
 }  // namespace quota
@@ -16,10 +16,55 @@ struct Any;
 
 namespace quota {
 
+struct RepositoryUsage {
+  std::string name;
+  uint64_t size;
+  uint64_t share;
+  uint64_t guarantee;
+};
+
+enum ListSelection {
+  kSelectRegular = 0,  /**< Regular files */
+  kSelectPinned,  /**< Pinned files, usually loaded catalogs */
+  kSelectCatalogs,  /**< All file catalogs */
+};
+
+/**
+ * Restricts a cache listing.  Bounds of 0 don't filter.  The idle time of an
+ * entry is the number of cache accesses since its last use.
+ */
+struct ListFilter {
+  ListFilter()
+    : selection(kSelectRegular), min_size(0), max_size(0), min_idle(0) { }
+  ListSelection selection;
+  uint64_t min_size;
+  uint64_t max_size;
+  uint64_t min_idle;
+};
+
+/**
+ * Walks through a cache listing page by page in the order of the content
+ * hashes.  The cache manager serves other commands in between two pages, so
+ * entries inserted or removed meanwhile may or may not show up.
+ */
+class ListIterator {
+ public:
+  explicit ListIterator(const ListFilter &filter)
+    : filter_(filter), finished_(false) { }
+  bool NextPage(std::vector<std::string> *page);
+ private:
+  ListFilter filter_;
+  std::string cursor_;  /**< Digest of the last visited entry */
+  bool finished_;
+};
+
+bool SetEvictionPolicy(const std::string &name);
 bool Init(const std::string &cache_dir, const uint64_t limit,
           const uint64_t cleanup_threshold, const bool rebuild_database);
 bool InitShared(const std::string &exe_path, const std::string &cache_dir, 
                 const uint64_t limit, const uint64_t cleanup_threshold);
+bool RegisterRepository(const std::string &name, const uint64_t share,
+                        const uint64_t guarantee);
 void Spawn();
 void Fini();
 int MainCacheManager(int argc, char **argv);
@@ -30,11 +75,15 @@ bool Cleanup(const uint64_t leave_size);
 
 void Insert(const hash::Any &hash, const uint64_t size,
             const std::string &cmvfs_path);
+void InsertBatch(const std::vector<hash::Any> &hashes,
+                 const std::vector<uint64_t> &sizes,
+                 const std::vector<std::string> &cvmfs_paths);
 bool Pin(const hash::Any &hash, const uint64_t size,
          const std::string &path_on_cvmfs);
 void Unpin(const hash::Any &hash);
 void Touch(const hash::Any &hash);
 void Remove(const hash::Any &file);
+std::vector<std::string> List(const ListFilter &filter);
 std::vector<std::string> List();
 std::vector<std::string> ListPinned();
 std::vector<std::string> ListCatalogs();
@@ -43,6 +92,7 @@ uint64_t GetMaxFileSize();
 uint64_t GetCapacity();
 uint64_t GetSize();
 uint64_t GetSizePinned();
+std::vector<RepositoryUsage> GetRepositoryUsage();
 std::string GetMemoryUsage();
 
 }  // namespace quota
@@ -0,0 +1,129 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The command ring of the shared cache manager, a bounded multi-producer,
+ * single-consumer queue in shared memory.  Clients push fire-and-forget
+ * commands, the cache manager pops them in order.
+ *
+ * A slot is free for the producer of position pos if its seq equals pos.  The
+ * producer claims pos by increasing the tail, marks the slot as being written
+ * (seq equals -pos-1), copies the command, and publishes it (seq equals
+ * pos+1).  The consumer hands the slot on to position pos+num_slots.  A slot
+ * that stays claimed for too long is skipped by the consumer, its producer
+ * presumably died.  Marking, publishing, and skipping are compare-and-swaps
+ * on seq, so a producer that was only slow loses against the skip and gives
+ * up instead of writing into a slot that is already handed on.  Only a
+ * producer stalled in the middle of copying its command can still garble the
+ * command of the next user of the slot.
+ */
+
+#ifndef CVMFS_QUOTA_RING_H_
+#define CVMFS_QUOTA_RING_H_
+
+#include <stdint.h>
+
+#include <cstring>
+
+#include "atomic.h"
+
+namespace quota {
+
+const unsigned kRingDataSize = 512;  /**< command and path */
+
+struct RingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots;
+  atomic_int32 consumer_waiting;  /**< cache manager sleeps in the pipe */
+  char padding[64];  /**< keeps tail in a cache line of its own */
+  atomic_int64 tail;  /**< next position for producers */
+};
+
+struct RingSlot {
+  atomic_int64 seq;
+  char data[kRingDataSize];
+};
+
+
+/**
+ * Reserves the next position of the ring for the calling producer.
+ *
+ * \return false if the ring is full
+ */
+inline bool ClaimRingSlot(RingHeader *ring, RingSlot *slots, int64_t *pos) {
+  const uint32_t num_slots = ring->num_slots;
+  int64_t claim = atomic_read64(&ring->tail);
+  while (true) {
+    const int64_t diff = atomic_read64(&slots[claim % num_slots].seq) - claim;
+    if ((diff == 0) && atomic_cas64(&ring->tail, claim, claim + 1))
+      break;
+    if (diff < 0)
+      return false;
+    claim = atomic_read64(&ring->tail);
+  }
+  *pos = claim;
+  return true;
+}
+
+
+/**
+ * Copies length bytes of data into the slot of a claimed position and hands
+ * it to the consumer.
+ *
+ * \return false if the consumer skipped the slot in the meantime
+ */
+inline bool PublishRingSlot(RingHeader *ring, RingSlot *slots,
+                            const int64_t pos,
+                            const void *data, const unsigned length)
+{
+  RingSlot *slot = &slots[pos % ring->num_slots];
+  if (!atomic_cas64(&slot->seq, pos, -pos - 1))
+    return false;
+  memcpy(slot->data, data, length);
+  return atomic_cas64(&slot->seq, -pos - 1, pos + 1);
+}
+
+
+/**
+ * \return the slot at the consumer position head if it is published, NULL
+ *         otherwise
+ */
+inline RingSlot *PeekRingSlot(RingHeader *ring, RingSlot *slots,
+                              const uint64_t head)
+{
+  RingSlot *slot = &slots[head % ring->num_slots];
+  if (atomic_read64(&slot->seq) != int64_t(head + 1))
+    return NULL;
+  return slot;
+}
+
+
+/**
+ * Hands a consumed slot on to the producers of the next round.
+ */
+inline void ReleaseRingSlot(RingHeader *ring, RingSlot *slots,
+                            const uint64_t head)
+{
+  const uint32_t num_slots = ring->num_slots;
+  atomic_write64(&slots[head % num_slots].seq, head + num_slots);
+}
+
+
+/**
+ * Hands a claimed but unpublished slot on to the producers of the next round.
+ *
+ * \return false if the slot got published in the meantime
+ */
+inline bool AbandonRingSlot(RingHeader *ring, RingSlot *slots,
+                            const uint64_t head)
+{
+  const uint32_t num_slots = ring->num_slots;
+  const int64_t pos = head;
+  RingSlot *slot = &slots[pos % num_slots];
+  return atomic_cas64(&slot->seq, pos, pos + num_slots) ||
+         atomic_cas64(&slot->seq, -pos - 1, pos + num_slots);
+}
+
+}  // namespace quota
+
+#endif  // CVMFS_QUOTA_RING_H_
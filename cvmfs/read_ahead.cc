@@ -0,0 +1,247 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Read-ahead for chunked files.  Chunks are fetched when a read touches them,
+ * so a sequential reader waits for a full download at every chunk boundary.
+ * The access pattern of every open chunked file is followed by an
+ * AccessPattern.  Sequential readers get a window of chunks beyond the
+ * current one that are downloaded in the background, so that the downloads
+ * overlap with the reader's processing of the current chunk.
+ *
+ * The chunks are fetched by a few threads at the bulk download priority, so
+ * that they do not take download slots from demanded files.  A reader that
+ * reaches a chunk whose read-ahead is still running waits for the download
+ * in flight instead of starting a second one.  Streamed files are downloaded
+ * as a whole from the start anyway and need no read-ahead.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "read_ahead.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "dirent.h"
+#include "download.h"
+#include "hash.h"
+#include "logging.h"
+#include "metrics.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace read_ahead {
+
+const unsigned kNumThreads = 2;
+const unsigned kMaxQueue = 256;  /**< pending chunks, drop beyond */
+const unsigned kMinSequential = 2;  /**< reads in a row before reading ahead */
+const off_t kTolerance = 256*1024;  /**< multi-threaded Fuse reorders reads */
+
+struct Job {
+  Job() { }
+  Job(const catalog::FileChunk &c, const PathString &p) : chunk(c), path(p) { }
+  catalog::FileChunk chunk;
+  PathString path;
+};
+
+unsigned max_window_ = 0;
+vector<Job> *queue_ = NULL;
+set<hash::Any> *queued_ = NULL;  /**< Chunks in queue_, for deduplication */
+bool stop_ = false;
+bool spawned_ = false;
+pthread_t threads_readahead_[kNumThreads];
+pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_queue_ = PTHREAD_COND_INITIALIZER;
+
+uint64_t num_queued_ = 0;
+uint64_t num_dropped_ = 0;
+uint64_t num_fetched_ = 0;
+uint64_t num_cached_ = 0;
+uint64_t num_failed_ = 0;
+
+
+/**
+ * Returns the number of chunks beyond the current read to fetch in advance.
+ */
+unsigned AccessPattern::Observe(const off_t offset, const size_t size) {
+  const off_t end = offset + size;
+  const bool sequential = (next_offset_ < 0) ?
+    (offset == 0) :
+    ((offset + kTolerance >= next_offset_) &&
+     (offset <= next_offset_ + kTolerance));
+  if (sequential) {
+    if (++num_sequential_ >= kMinSequential)
+      window_ = (window_ == 0) ? 1 : min(2*window_, max_window_);
+    next_offset_ = max(next_offset_, end);
+  } else {
+    num_sequential_ = 0;
+    window_ /= 2;
+    next_offset_ = end;
+  }
+  return window_;
+}
+
+
+static void ReadAhead(const Job &job) {
+  if (cache::Contains(job.chunk.content_hash)) {
+    pthread_mutex_lock(&lock_);
+    num_cached_++;
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+
+  LogCvmfs(kLogPrefetch, kLogDebug, "reading ahead chunk at %"PRId64" of %s",
+           int64_t(job.chunk.offset), job.path.c_str());
+  const int fd = cache::FetchChunk(job.chunk, job.path.ToString());
+  pthread_mutex_lock(&lock_);
+  if (fd >= 0) {
+    close(fd);
+    num_fetched_++;
+  } else {
+    num_failed_++;
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+
+static void *MainReadAhead(void *data __attribute__((unused))) {
+  LogCvmfs(kLogPrefetch, kLogDebug, "starting read-ahead thread");
+  cache::SetDownloadPriority(download::kPriorityBulk);
+  while (true) {
+    pthread_mutex_lock(&lock_);
+    while (queue_->empty() && !stop_)
+      pthread_cond_wait(&cond_queue_, &lock_);
+    if (stop_) {
+      pthread_mutex_unlock(&lock_);
+      break;
+    }
+    const Job job = queue_->front();
+    queue_->erase(queue_->begin());
+    queued_->erase(job.chunk.content_hash);
+    pthread_mutex_unlock(&lock_);
+
+    ReadAhead(job);
+  }
+  LogCvmfs(kLogPrefetch, kLogDebug, "stopping read-ahead thread");
+  return NULL;
+}
+
+
+/**
+ * @param[in] max_window Maximum number of chunks fetched ahead of a reader
+ */
+void Init(const unsigned max_window) {
+  assert(max_window > 0);
+  max_window_ = max_window;
+  queue_ = new vector<Job>();
+  queued_ = new set<hash::Any>();
+  stop_ = false;
+  spawned_ = false;
+}
+
+
+/**
+ * Starts the read-ahead threads, has to run after fork().
+ */
+void Spawn() {
+  for (unsigned i = 0; i < kNumThreads; ++i) {
+    int retval = pthread_create(&threads_readahead_[i], NULL, MainReadAhead,
+                                NULL);
+    assert(retval == 0);
+  }
+  spawned_ = true;
+}
+
+
+/**
+ * Drops pending chunks and waits for the running downloads.  Has to run
+ * before the cache is finalized.
+ */
+void Fini() {
+  if (spawned_) {
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_broadcast(&cond_queue_);
+    pthread_mutex_unlock(&lock_);
+    for (unsigned i = 0; i < kNumThreads; ++i)
+      pthread_join(threads_readahead_[i], NULL);
+    spawned_ = false;
+  }
+
+  delete queue_;
+  delete queued_;
+  queue_ = NULL;
+  queued_ = NULL;
+  max_window_ = 0;
+}
+
+
+/**
+ * Queues a chunk of the chunked file at path for reading ahead.
+ */
+void Enqueue(const catalog::FileChunk &chunk, const PathString &path) {
+  pthread_mutex_lock(&lock_);
+  if (queued_->find(chunk.content_hash) != queued_->end()) {
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+  if (queue_->size() >= kMaxQueue) {
+    num_dropped_++;
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+  queue_->push_back(Job(chunk, path));
+  queued_->insert(chunk.content_hash);
+  num_queued_++;
+  pthread_cond_signal(&cond_queue_);
+  pthread_mutex_unlock(&lock_);
+}
+
+
+string GetStatistics() {
+  pthread_mutex_lock(&lock_);
+  const string result =
+    "  window: " + StringifyInt(max_window_) + " chunks  queued: " +
+    StringifyInt(num_queued_) + "  dropped: " + StringifyInt(num_dropped_) +
+    "\n  fetched: " + StringifyInt(num_fetched_) + "  already cached: " +
+    StringifyInt(num_cached_) + "  failed: " + StringifyInt(num_failed_) +
+    "\n";
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+void GetMetrics(MetricsWriter *metrics) {
+  pthread_mutex_lock(&lock_);
+  const uint64_t num_queued = num_queued_;
+  const uint64_t num_dropped = num_dropped_;
+  const uint64_t num_fetched = num_fetched_;
+  const uint64_t num_cached = num_cached_;
+  const uint64_t num_failed = num_failed_;
+  pthread_mutex_unlock(&lock_);
+  metrics->Counter("readahead_queued_total",
+                   "Chunks queued for reading ahead", num_queued);
+  metrics->Counter("readahead_dropped_total",
+                   "Chunks not read ahead because the queue was full",
+                   num_dropped);
+  metrics->Counter("readahead_fetched_total",
+                   "Chunks downloaded ahead of the reader", num_fetched);
+  metrics->Counter("readahead_cached_total",
+                   "Chunks to read ahead that were already cached",
+                   num_cached);
+  metrics->Counter("readahead_failed_total",
+                   "Failed read-ahead downloads", num_failed);
+}
+
+}  // namespace read_ahead
@@ -0,0 +1,51 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_READ_AHEAD_H_
+#define CVMFS_READ_AHEAD_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "shortstring.h"
+
+class MetricsWriter;
+
+namespace catalog {
+struct FileChunk;
+}
+
+namespace read_ahead {
+
+/**
+ * Detects sequential reads of an open file from the read offsets and sizes
+ * and derives the number of chunks to read ahead.  The window doubles with
+ * every sequential read up to the maximum and is halved by a read elsewhere,
+ * so that random access quickly stops the read-ahead.  Not thread-safe, the
+ * owner of the open file has to do the locking.
+ */
+class AccessPattern {
+ public:
+  AccessPattern() : next_offset_(-1), window_(0), num_sequential_(0) { }
+  unsigned Observe(const off_t offset, const size_t size);
+
+ private:
+  off_t next_offset_;  /**< end of the previous read */
+  unsigned window_;
+  unsigned num_sequential_;
+};
+
+void Init(const unsigned max_window);
+void Spawn();
+void Fini();
+
+void Enqueue(const catalog::FileChunk &chunk, const PathString &path);
+
+std::string GetStatistics();
+void GetMetrics(MetricsWriter *metrics);
+
+}  // namespace read_ahead
+
+#endif  // CVMFS_READ_AHEAD_H_
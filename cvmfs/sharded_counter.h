@@ -0,0 +1,84 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A statistics counter that is cheap to increase from many threads.  A plain
+ * atomic counter is a single cache line that bounces between the cores on
+ * every increase.  Here, every thread increases a slot of its own cache line
+ * and reading adds up the slots.  Threads are assigned slots round-robin;
+ * with more threads than slots, some threads share a slot.
+ *
+ * Reading is not atomic with respect to concurrent increases, which is fine
+ * for statistics.
+ */
+
+#ifndef CVMFS_SHARDED_COUNTER_H_
+#define CVMFS_SHARDED_COUNTER_H_
+
+#include <stdint.h>
+
+#include "atomic.h"
+
+class ShardedCounter {
+ public:
+  ShardedCounter() { Reset(); }
+  ShardedCounter(const ShardedCounter &other) {
+    Reset();
+    Xadd(other.Get());
+  }
+  ShardedCounter &operator= (const ShardedCounter &other) {
+    if (&other != this) {
+      const int64_t value = other.Get();
+      Reset();
+      Xadd(value);
+    }
+    return *this;
+  }
+
+  void Inc() { atomic_inc64(GetSlot(GetSlotIndex())); }
+  void Dec() { atomic_dec64(GetSlot(GetSlotIndex())); }
+  void Xadd(const int64_t delta) {
+    atomic_xadd64(GetSlot(GetSlotIndex()), delta);
+  }
+
+  int64_t Get() const {
+    int64_t result = 0;
+    for (unsigned i = 0; i < kNumSlots; ++i)
+      result += atomic_read64(GetSlot(i));
+    return result;
+  }
+
+  void Reset() {
+    for (unsigned i = 0; i < kNumSlots; ++i)
+      atomic_init64(GetSlot(i));
+  }
+
+ private:
+  static const unsigned kCacheLineSize = 64;
+  static const unsigned kNumSlots = 16;  /**< power of 2 */
+
+  /**
+   * The slot of the calling thread, assigned on its first increase.
+   */
+  static unsigned GetSlotIndex() {
+    static __thread unsigned slot = 0;  // slot + 1, 0 if not yet assigned
+    if (slot == 0) {
+      static atomic_int32 next_slot = 0;
+      slot = (atomic_xadd32(&next_slot, 1) & (kNumSlots - 1)) + 1;
+    }
+    return slot - 1;
+  }
+
+  /**
+   * The slots start at the first cache line boundary within the buffer, the
+   * object itself might not be aligned.  Therefore copies go through Get().
+   */
+  atomic_int64 *GetSlot(const unsigned index) const {
+    const uintptr_t base = (reinterpret_cast<uintptr_t>(buffer_) +
+                            kCacheLineSize - 1) & ~uintptr_t(kCacheLineSize - 1);
+    return reinterpret_cast<atomic_int64 *>(base + index * kCacheLineSize);
+  }
+
+  mutable char buffer_[(kNumSlots + 1) * kCacheLineSize];
+};
+
+#endif  // CVMFS_SHARDED_COUNTER_H_
@@ -0,0 +1,139 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Heap buffers for long ShortStrings.  Buffers are rounded up to a power of
+ * two and released buffers are kept in per-thread free lists, bounded by
+ * kMaxCachedBytes.  A buffer released by another thread than the one that
+ * allocated it goes to the free list of the releasing thread.
+ */
+
+#include "shortstring.h"
+
+#include <pthread.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include "smalloc.h"
+
+using namespace std;  // NOLINT
+
+namespace shortstring {
+
+const unsigned kMinBlockSize = 64;
+const unsigned kNumClasses = 8;  /**< blocks of 64 bytes up to 8kB are cached */
+const unsigned kMaxCachedBytes = 256*1024;  /**< per thread */
+
+struct ThreadCache {
+  LongString *free_lists[kNumClasses];
+  unsigned cached_bytes;
+};
+
+pthread_once_t once_ = PTHREAD_ONCE_INIT;
+pthread_key_t thread_cache_key_;
+atomic_int64 num_allocations_ = 0;
+atomic_int64 num_reuses_ = 0;
+
+
+/**
+ * The free list link overwrites the header of a cached block.
+ */
+static inline LongString **NextFree(LongString *long_string) {
+  return reinterpret_cast<LongString **>(long_string);
+}
+
+
+static void FreeThreadCache(void *data) {
+  ThreadCache *cache = reinterpret_cast<ThreadCache *>(data);
+  for (unsigned i = 0; i < kNumClasses; ++i) {
+    while (cache->free_lists[i]) {
+      LongString *next = *NextFree(cache->free_lists[i]);
+      free(cache->free_lists[i]);
+      cache->free_lists[i] = next;
+    }
+  }
+  free(cache);
+}
+
+
+static void InitThreadCacheKey() {
+  int retval = pthread_key_create(&thread_cache_key_, FreeThreadCache);
+  assert(retval == 0);
+}
+
+
+static ThreadCache *GetThreadCache() {
+  pthread_once(&once_, InitThreadCacheKey);
+  ThreadCache *cache =
+    reinterpret_cast<ThreadCache *>(pthread_getspecific(thread_cache_key_));
+  if (cache == NULL) {
+    cache = reinterpret_cast<ThreadCache *>(smalloc(sizeof(ThreadCache)));
+    memset(cache, 0, sizeof(ThreadCache));
+    pthread_setspecific(thread_cache_key_, cache);
+  }
+  return cache;
+}
+
+
+/**
+ * Size class of a block, kNumClasses for blocks that are not cached.
+ */
+static unsigned GetClass(const unsigned block_size) {
+  unsigned size_class = 0;
+  for (unsigned size = kMinBlockSize; size < block_size; size *= 2) {
+    if (++size_class == kNumClasses)
+      break;
+  }
+  return size_class;
+}
+
+
+LongString *Allocate(const unsigned min_capacity) {
+  const unsigned min_block = sizeof(LongString) + min_capacity + 1;
+  const unsigned size_class = GetClass(min_block);
+  unsigned block_size = min_block;
+  LongString *result = NULL;
+  if (size_class < kNumClasses) {
+    block_size = kMinBlockSize << size_class;
+    ThreadCache *cache = GetThreadCache();
+    result = cache->free_lists[size_class];
+    if (result) {
+      cache->free_lists[size_class] = *NextFree(result);
+      cache->cached_bytes -= block_size;
+      atomic_inc64(&num_reuses_);
+    }
+  }
+  if (result == NULL) {
+    result = reinterpret_cast<LongString *>(smalloc(block_size));
+    atomic_inc64(&num_allocations_);
+  }
+
+  atomic_init32(&result->refcount);
+  atomic_inc32(&result->refcount);
+  result->length = 0;
+  result->capacity = block_size - sizeof(LongString) - 1;
+  result->chars()[0] = '\0';
+  return result;
+}
+
+
+void Free(LongString *long_string) {
+  const unsigned block_size = sizeof(LongString) + long_string->capacity + 1;
+  const unsigned size_class = GetClass(block_size);
+  if (size_class < kNumClasses) {
+    ThreadCache *cache = GetThreadCache();
+    if (cache->cached_bytes + block_size <= kMaxCachedBytes) {
+      *NextFree(long_string) = cache->free_lists[size_class];
+      cache->free_lists[size_class] = long_string;
+      cache->cached_bytes += block_size;
+      return;
+    }
+  }
+  free(long_string);
+}
+
+
+uint64_t num_allocations() { return atomic_read64(&num_allocations_); }
+uint64_t num_reuses() { return atomic_read64(&num_reuses_); }
+
+}  // namespace shortstring
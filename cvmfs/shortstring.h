@@ -2,37 +2,74 @@
  * This file is part of the CernVM File System.
  *
  * Implements a string class that stores short strings on the stack and
- * malloc's a std::string on the heap on overflow.  Used for file names and
- * path names that are usually small.
+ * moves to a heap buffer on overflow.  Used for file names and path names
+ * that are usually small.
+ *
+ * Heap buffers are reference counted and shared by copies of the string, so
+ * long names that are copied in and out of the caches are not duplicated.
+ * They are copied on write.  Released buffers go to a small per-thread cache
+ * and are reused by the next long strings of the same thread.  So requests
+ * of the Fuse threads with long path names usually do not call malloc.
  */
 
 #ifndef SHORTSTRING_H_
 #define SHORTSTRING_H_
 
+#include <stdint.h>
+
 #include <cstring>
 
 #include <string>
 #include <algorithm>
 
 #include "atomic.h"
+#include "sharded_counter.h"
 
 const unsigned char kDefaultMaxName = 25;
 const unsigned char kDefaultMaxLink = 25;
 const unsigned char kDefaultMaxPath = 200;
 
+namespace shortstring {
+
+/**
+ * Heap buffer of a ShortString that exceeds its stack space.  The characters
+ * follow the header and are always null-terminated.  Immutable while the
+ * reference counter is larger than 1.
+ */
+struct LongString {
+  char *chars() { return reinterpret_cast<char *>(this + 1); }
+
+  atomic_int32 refcount;
+  unsigned length;
+  unsigned capacity;  /**< without the final '\0' */
+};
+
+LongString *Allocate(const unsigned min_capacity);
+void Free(LongString *long_string);
+
+static inline void __attribute__((used)) Release(LongString *long_string) {
+  if (long_string && (atomic_xadd32(&long_string->refcount, -1) == 1))
+    Free(long_string);
+}
+
+uint64_t num_allocations();
+uint64_t num_reuses();
+
+}  // namespace shortstring
+
 template<unsigned char StackSize, char Type>
 class ShortString {
  public:
   ShortString() : long_string_(NULL), length_(0) {
-    atomic_inc64(&num_instances_);
+    num_instances_.Inc();
   }
   ShortString(const ShortString &other) {
-    atomic_inc64(&num_instances_);
+    num_instances_.Inc();
     long_string_ = NULL;
     Assign(other);
   }
   ShortString(const char *chars, const unsigned length) {
-    atomic_inc64(&num_instances_);
+    num_instances_.Inc();
     long_string_ = NULL;
     Assign(chars, length);
   }
@@ -43,59 +80,81 @@ class ShortString {
     return *this;
   }
 
-  ~ShortString() { delete long_string_; }
+  ~ShortString() { shortstring::Release(long_string_); }
 
   void Assign(const char *chars, const unsigned length) {
-    delete long_string_;
-    long_string_ = NULL;
     if (length > StackSize) {
       atomic_inc64(&num_overflows_);
-      long_string_ = new std::string(chars, length);
+      shortstring::LongString *target = long_string_;
+      if (!IsExclusive() || (target->capacity < length))
+        target = shortstring::Allocate(length);
+      memmove(target->chars(), chars, length);
+      target->chars()[length] = '\0';
+      target->length = length;
+      if (target != long_string_) {
+        shortstring::Release(long_string_);
+        long_string_ = target;
+      }
     } else {
       if (length)
-        memcpy(stack_, chars, length);
+        memmove(stack_, chars, length);
       this->length_ = length;
+      shortstring::Release(long_string_);
+      long_string_ = NULL;
     }
   }
 
   void Assign(const ShortString &other) {
-    Assign(other.GetChars(), other.GetLength());
+    if (other.long_string_) {
+      atomic_inc32(&other.long_string_->refcount);
+      shortstring::Release(long_string_);
+      long_string_ = other.long_string_;
+      return;
+    }
+    Assign(other.stack_, other.length_);
   }
 
   void Append(const ShortString &other) {
-    Append(other.stack_, other.length_);
+    Append(other.GetChars(), other.GetLength());
   }
 
   void Append(const char *chars, const unsigned length) {
-    if (long_string_) {
-      long_string_->append(chars, length);
+    const unsigned old_length = GetLength();
+    const unsigned new_length = old_length + length;
+    if (!long_string_ && (new_length <= StackSize)) {
+      if (length > 0)
+        memcpy(&stack_[this->length_], chars, length);
+      this->length_ = new_length;
       return;
     }
 
-    const unsigned new_length = this->length_ + length;
-    if (new_length > StackSize) {
+    if (!long_string_)
       atomic_inc64(&num_overflows_);
-      long_string_ = new std::string();
-      long_string_->reserve(new_length);
-      long_string_->assign(stack_, length_);
-      long_string_->append(chars, length);
-      return;
+    if (!IsExclusive() || (long_string_->capacity < new_length)) {
+      // Grow geometrically, paths are often built piece by piece
+      shortstring::LongString *target =
+        shortstring::Allocate(std::max(new_length, 2*old_length));
+      memcpy(target->chars(), GetChars(), old_length);
+      memcpy(target->chars() + old_length, chars, length);
+      shortstring::Release(long_string_);
+      long_string_ = target;
+    } else {
+      memmove(long_string_->chars() + old_length, chars, length);
     }
-    if (length > 0)
-      memcpy(&stack_[this->length_], chars, length);
-    this->length_ = new_length;
+    long_string_->chars()[new_length] = '\0';
+    long_string_->length = new_length;
   }
 
   const char *GetChars() const {
     if (long_string_)
-      return long_string_->data();
+      return long_string_->chars();
     else
       return stack_;
   }
 
   unsigned GetLength() const {
     if (long_string_)
-      return long_string_->length();
+      return long_string_->length;
     return length_;
   }
 
@@ -109,7 +168,7 @@ class ShortString {
 
   const char *c_str() const {
     if (long_string_)
-      return long_string_->c_str();
+      return long_string_->chars();
 
     char *c = (char *)stack_ + length_;
     *c = '\0';
@@ -168,15 +227,19 @@ class ShortString {
     return ShortString(this->GetChars() + start_at, length-start_at);
   }
 
-  static uint64_t num_instances() { return atomic_read64(&num_instances_); }
+  static uint64_t num_instances() { return num_instances_.Get(); }
   static uint64_t num_overflows() { return atomic_read64(&num_overflows_); }
 
  private:
-  std::string *long_string_;
+  bool IsExclusive() const {
+    return long_string_ && (atomic_read32(&long_string_->refcount) == 1);
+  }
+
+  shortstring::LongString *long_string_;
   char stack_[StackSize+1];  // +1 to add a final '\0' if necessary
   unsigned char length_;
   static atomic_int64 num_overflows_;
-  static atomic_int64 num_instances_;
+  static ShardedCounter num_instances_;
 };  // class ShortString
 
 typedef ShortString<kDefaultMaxPath, 0> PathString;
@@ -186,6 +249,6 @@ typedef ShortString<kDefaultMaxLink, 2> LinkString;
 template<unsigned char StackSize, char Type>
 atomic_int64 ShortString<StackSize, Type>::num_overflows_ = 0;
 template<unsigned char StackSize, char Type>
-atomic_int64 ShortString<StackSize, Type>::num_instances_ = 0;
+ShardedCounter ShortString<StackSize, Type>::num_instances_;
 
 #endif  // SHORTSTRING_H_
@@ -16,9 +16,12 @@
 #include "logging.h"
 #include "swissknife_zpipe.h"
 #include "swissknife_check.h"
+#include "swissknife_diff.h"
+#include "swissknife_index.h"
 #include "swissknife_pull.h"
 #include "swissknife_sign.h"
 #include "swissknife_sync.h"
+#include "swissknife_trace.h"
 
 using namespace std;  // NOLINT
 
@@ -65,8 +68,11 @@ int main(int argc, char **argv) {
   command_list.push_back(new swissknife::CommandSync());
   command_list.push_back(new swissknife::CommandSign());
   command_list.push_back(new swissknife::CommandCheck());
+  command_list.push_back(new swissknife::CommandDiff());
   command_list.push_back(new swissknife::CommandPull());
   command_list.push_back(new swissknife::CommandZpipe());
+  command_list.push_back(new swissknife::CommandIndex());
+  command_list.push_back(new swissknife::CommandTrace2Csv());
 
   if (argc < 2) {
     swissknife::Usage();
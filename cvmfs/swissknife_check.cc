@@ -11,8 +11,11 @@
 
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
 
+#include <cassert>
 #include <string>
+#include <deque>
 #include <queue>
 #include <vector>
 #include <map>
@@ -25,12 +28,46 @@
 #include "compression.h"
 #include "shortstring.h"
 #include "download.h"
+#include "atomic.h"
 
 using namespace std;  // NOLINT
 
 namespace {
+
+/**
+ * A catalog to inspect and the results needed to check the statistics
+ * counters of the tree.
+ */
+struct CatalogCheck {
+  CatalogCheck(const std::string &p, const hash::Any &h, CatalogCheck *c) :
+    path(p), hash(h), parent(c), ok(false), loaded(false),
+    has_stored_counters(false) { }
+  std::string path;
+  hash::Any hash;
+  CatalogCheck *parent;
+  catalog::DirectoryEntry transition_point;  ///< Unless the root catalog
+  bool ok;
+  bool loaded;
+  catalog::DeltaCounters self_counters;  ///< Of the catalog's own entries
+  bool has_stored_counters;
+  catalog::Counters stored_counters;
+  std::vector<CatalogCheck *> nested;  ///< In the order of the catalog
+};
+
 bool check_chunks;
+/**
+ * Percentage of data chunks that are checked.  The sample is picked by
+ * content hash, so that it does not change from run to run.
+ */
+unsigned chunk_sample = 100;
+unsigned num_workers = 1;
 std::string *remote_repository;
+atomic_int64 num_checked_chunks;
+
+pthread_mutex_t lock_checks = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_checks = PTHREAD_COND_INITIALIZER;
+std::deque<CatalogCheck *> check_queue;
+unsigned num_unfinished_checks = 0;  ///< Queued or being inspected
 }
 
 
@@ -149,6 +186,14 @@ static bool CompareCounters(const catalog::Counters &a,
 }
 
 
+static bool IsSampled(const hash::Any &chunk_hash) {
+  if (chunk_sample >= 100)
+    return true;
+  const unsigned bucket = (chunk_hash.digest[0] << 8) | chunk_hash.digest[1];
+  return (bucket % 100) < chunk_sample;
+}
+
+
 /**
  * Checks for existance of a file either locally or via HTTP head
  */
@@ -204,7 +249,10 @@ static bool Find(const catalog::Catalog *catalog,
     }
 
     // Check if the chunk is there
-    if (!entries[i].checksum().IsNull() && check_chunks) {
+    if (!entries[i].checksum().IsNull() && check_chunks &&
+        IsSampled(entries[i].checksum()))
+    {
+      atomic_inc64(&num_checked_chunks);
       string chunk_path = "data" + entries[i].checksum().MakePath(1, 2);
       if (entries[i].IsDirectory())
         chunk_path += "L";
@@ -215,6 +263,33 @@ static bool Find(const catalog::Catalog *catalog,
       }
     }
 
+    // Check if the pieces of a chunked file are there, files stored only as
+    // chunks have no bulk object
+    if (entries[i].IsChunkedFile() && check_chunks) {
+      catalog::FileChunkList file_chunks;
+      if (!catalog->ListPathChunks(full_path, &file_chunks) ||
+          file_chunks.empty())
+      {
+        LogCvmfs(kLogCvmfs, kLogStderr, "no chunks for chunked file %s",
+                 full_path.c_str());
+        retval = false;
+      }
+      for (unsigned j = 0; j < file_chunks.size(); ++j) {
+        const hash::Any &piece_hash = file_chunks[j].content_hash;
+        if (!IsSampled(piece_hash))
+          continue;
+        atomic_inc64(&num_checked_chunks);
+        const string piece_path = "data" + piece_hash.MakePath(1, 2) + "C";
+        if (!Exists(piece_path)) {
+          LogCvmfs(kLogCvmfs, kLogStderr,
+                   "file chunk %s (%s at offset %"PRIu64") missing",
+                   piece_hash.ToString().c_str(), full_path.c_str(),
+                   uint64_t(file_chunks[j].offset));
+          retval = false;
+        }
+      }
+    }
+
     // Add hardlinks to counting map
     if ((entries[i].linkcount() > 1) && !entries[i].IsDirectory()) {
       if (entries[i].hardlink_group() == 0) {
@@ -347,12 +422,14 @@ static std::string DecompressCatalog(const string &path,
 
 
 /**
- * Recursion on nested catalog level.  No ownership of computed_counters.
+ * Recursion on nested catalog level.  Catalogs are inspected in parallel, the
+ * statistics counters of a catalog include its nested catalogs and are
+ * compared once the entire tree is inspected, see AggregateCounters().
  */
-static bool InspectTree(const string &path, const hash::Any &catalog_hash,
-                        const catalog::DirectoryEntry *transition_point,
-                        catalog::DeltaCounters *computed_counters)
-{
+static bool InspectCatalog(CatalogCheck *check) {
+  const string &path = check->path;
+  const hash::Any &catalog_hash = check->hash;
+  catalog::DeltaCounters *computed_counters = &check->self_counters;
   LogCvmfs(kLogCvmfs, kLogStdout, "[inspecting catalog] %s at %s",
            catalog_hash.ToString().c_str(), path == "" ? "/" : path.c_str());
 
@@ -374,6 +451,7 @@ static bool InspectTree(const string &path, const hash::Any &catalog_hash,
              catalog_hash.ToString().c_str());
     return false;
   }
+  check->loaded = true;
 
   int retval = true;
 
@@ -396,8 +474,8 @@ static bool InspectTree(const string &path, const hash::Any &catalog_hash,
              path.c_str());
     retval = false;
   }
-  if (transition_point != NULL) {
-    if (!CompareEntries(*transition_point, root_entry, true)) {
+  if (check->parent != NULL) {
+    if (!CompareEntries(check->transition_point, root_entry, true)) {
       LogCvmfs(kLogCvmfs, kLogStderr,
                "transition point and root entry differ (%s)", path.c_str());
       retval = false;
@@ -429,7 +507,7 @@ static bool InspectTree(const string &path, const hash::Any &catalog_hash,
     retval = false;
   }
 
-  // Recurse into nested catalogs
+  // Queue the nested catalogs
   catalog::Catalog::NestedCatalogList *nested_catalogs =
     catalog->ListNestedCatalogs();
   if (nested_catalogs->size() !=
@@ -443,46 +521,129 @@ static bool InspectTree(const string &path, const hash::Any &catalog_hash,
   for (catalog::Catalog::NestedCatalogList::const_iterator i =
        nested_catalogs->begin(), iEnd = nested_catalogs->end(); i != iEnd; ++i)
   {
-    catalog::DirectoryEntry nested_transition_point;
-    if (!catalog->LookupPath(i->path, &nested_transition_point)) {
+    CatalogCheck *nested_check =
+      new CatalogCheck(i->path.ToString(), i->hash, check);
+    if (!catalog->LookupPath(i->path, &nested_check->transition_point)) {
       LogCvmfs(kLogCvmfs, kLogStderr, "failed to lookup transition point %s",
                i->path.c_str());
       retval = false;
+      delete nested_check;
     } else {
-      catalog::DeltaCounters nested_counters;
-      if (!InspectTree(i->path.ToString(), i->hash, &nested_transition_point,
-                       &nested_counters))
-        retval = false;
-      nested_counters.PopulateToParent(computed_counters);
+      check->nested.push_back(nested_check);
     }
   }
 
-  // Check statistics counters
-  computed_counters->d_self_dir++;  // Additionally account for root directory
-  catalog::Counters compare_counters;
-  compare_counters.ApplyDelta(*computed_counters);
-  catalog::Counters stored_counters;
-  if (!catalog->GetCounters(&stored_counters)) {
+  if (!catalog->GetCounters(&check->stored_counters)) {
     LogCvmfs(kLogCvmfs, kLogStderr, "failed to get counters (%s) [%s]",
              path.c_str(), catalog_hash.ToString().c_str());
     retval = false;
   } else {
-    if (!CompareCounters(compare_counters, stored_counters)) {
-      LogCvmfs(kLogCvmfs, kLogStderr, "statistics counter mismatch [%s]",
-               catalog_hash.ToString().c_str());
-      retval = false;
-    }
+    check->has_stored_counters = true;
   }
 
   delete catalog;
+
+  pthread_mutex_lock(&lock_checks);
+  for (unsigned i = 0; i < check->nested.size(); ++i)
+    check_queue.push_back(check->nested[i]);
+  num_unfinished_checks += check->nested.size();
+  pthread_cond_broadcast(&cond_checks);
+  pthread_mutex_unlock(&lock_checks);
+  return retval;
+}
+
+
+static void *MainInspect(void *data) {
+  pthread_mutex_lock(&lock_checks);
+  while (true) {
+    while (check_queue.empty() && (num_unfinished_checks > 0))
+      pthread_cond_wait(&cond_checks, &lock_checks);
+    if (num_unfinished_checks == 0)
+      break;
+    CatalogCheck *check = check_queue.front();
+    check_queue.pop_front();
+    pthread_mutex_unlock(&lock_checks);
+
+    check->ok = InspectCatalog(check);
+
+    pthread_mutex_lock(&lock_checks);
+    num_unfinished_checks--;
+    if (num_unfinished_checks == 0)
+      pthread_cond_broadcast(&cond_checks);
+  }
+  pthread_mutex_unlock(&lock_checks);
+  return NULL;
+}
+
+
+/**
+ * Sums up the counters of the inspected tree in catalog order and compares
+ * them to the stored ones, so that the result does not depend on the order
+ * in which the catalogs were inspected.  Frees the nested checks.
+ */
+static bool AggregateCounters(const CatalogCheck *check,
+                              catalog::DeltaCounters *computed_counters)
+{
+  bool retval = check->ok;
+  if (!check->loaded)
+    return retval;
+
+  *computed_counters = check->self_counters;
+  for (unsigned i = 0; i < check->nested.size(); ++i) {
+    catalog::DeltaCounters nested_counters;
+    if (!AggregateCounters(check->nested[i], &nested_counters))
+      retval = false;
+    nested_counters.PopulateToParent(computed_counters);
+    delete check->nested[i];
+  }
+
+  // Check statistics counters
+  computed_counters->d_self_dir++;  // Additionally account for root directory
+  catalog::Counters compare_counters;
+  compare_counters.ApplyDelta(*computed_counters);
+  if (check->has_stored_counters &&
+      !CompareCounters(compare_counters, check->stored_counters))
+  {
+    LogCvmfs(kLogCvmfs, kLogStderr, "statistics counter mismatch [%s]",
+             check->hash.ToString().c_str());
+    retval = false;
+  }
+
   return retval;
 }
 
 
+static bool InspectTree(const hash::Any &root_hash) {
+  CatalogCheck root_check("", root_hash, NULL);
+  check_queue.push_back(&root_check);
+  num_unfinished_checks = 1;
+
+  vector<pthread_t> workers(num_workers);
+  for (unsigned i = 0; i < num_workers; ++i) {
+    int retval = pthread_create(&workers[i], NULL, MainInspect, NULL);
+    assert(retval == 0);
+  }
+  for (unsigned i = 0; i < num_workers; ++i)
+    pthread_join(workers[i], NULL);
+
+  catalog::DeltaCounters computed_counters;
+  return AggregateCounters(&root_check, &computed_counters);
+}
+
+
 int swissknife::CommandCheck::Main(const swissknife::ArgumentList &args) {
   check_chunks = false;
   if (args.find('c') != args.end())
     check_chunks = true;
+  if (args.find('s') != args.end()) {
+    check_chunks = true;
+    chunk_sample = String2Uint64(*args.find('s')->second);
+  }
+  if (args.find('n') != args.end())
+    num_workers = String2Uint64(*args.find('n')->second);
+  if (num_workers == 0)
+    num_workers = 1;
+  atomic_init64(&num_checked_chunks);
   if (args.find('l') != args.end()) {
     unsigned log_level =
       1 << (kLogLevel0 + String2Uint64(*args.find('l')->second));
@@ -497,7 +658,8 @@ int swissknife::CommandCheck::Main(const swissknife::ArgumentList &args) {
   // Repository can be HTTP address or on local file system
   if (repository.substr(0, 7) == "http://") {
     remote_repository = new string(repository);
-    download::Init(1);
+    download::Init(num_workers);
+    download::Spawn();
   } else {
     remote_repository = NULL;
   }
@@ -524,7 +686,7 @@ int swissknife::CommandCheck::Main(const swissknife::ArgumentList &args) {
     const unsigned length = download_manifest.destination_mem.size;
     manifest = manifest::Manifest::LoadMem(
       reinterpret_cast<const unsigned char *>(buffer), length);
-    free(download_manifest.destination_mem.data);
+    download::ReleaseMemBuffer(&download_manifest);
   }
 
   if (!manifest) {
@@ -541,9 +703,11 @@ int swissknife::CommandCheck::Main(const swissknife::ArgumentList &args) {
     return 1;
   }
 
-  catalog::DeltaCounters computed_counters;
-  bool retval = InspectTree("", manifest->catalog_hash(), NULL,
-                            &computed_counters);
+  bool retval = InspectTree(manifest->catalog_hash());
+  if (check_chunks) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "checked %"PRId64" data chunks (%u%%)",
+             atomic_read64(&num_checked_chunks), chunk_sample);
+  }
 
   return retval ? 0 : 1;
 }
@@ -25,6 +25,10 @@ class CommandCheck : public Command {
     result.push_back(Parameter('l', "log level (0-4, default: 2)", true, false));
     result.push_back(Parameter('c', "check availability of data chunks",
                                true, true));
+    result.push_back(Parameter('s', "check only a sample of the data chunks "
+                               "(percent)", true, false));
+    result.push_back(Parameter('n', "number of catalogs inspected in parallel",
+                               true, false));
     return result;
   }
   int Main(const ArgumentList &args);
@@ -0,0 +1,203 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * This tool prints the changes between two revisions of a repository.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "swissknife_diff.h"
+
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <string>
+
+#include "logging.h"
+#include "manifest.h"
+#include "util.h"
+#include "hash.h"
+#include "catalog.h"
+#include "catalog_diff.h"
+#include "compression.h"
+#include "shortstring.h"
+#include "download.h"
+
+using namespace std;  // NOLINT
+
+namespace {
+
+std::string *remote_repository;
+
+/**
+ * Fetches catalogs from the repository for the diff engine and prints the
+ * changes it reports.
+ */
+class DiffPrinter {
+ public:
+  DiffPrinter() : num_added(0), num_removed(0), num_modified(0) { }
+
+  catalog::Catalog *LoadCatalog(const PathString &mountpoint,
+                                const hash::Any &catalog_hash);
+  void Add(const PathString &path, const catalog::DirectoryEntry &entry) {
+    Print('+', path);
+    num_added++;
+  }
+  void Remove(const PathString &path, const catalog::DirectoryEntry &entry) {
+    Print('-', path);
+    num_removed++;
+  }
+  void Modify(const PathString &path,
+              const catalog::DirectoryEntry &old_entry,
+              const catalog::DirectoryEntry &new_entry)
+  {
+    Print('M', path);
+    num_modified++;
+  }
+
+  uint64_t num_added;
+  uint64_t num_removed;
+  uint64_t num_modified;
+
+ private:
+  void Print(const char change, const PathString &path) {
+    LogCvmfs(kLogCvmfs, kLogStdout, "%c %s", change,
+             path.IsEmpty() ? "/" : path.c_str());
+  }
+};
+
+}
+
+
+static std::string FetchCatalog(const hash::Any &catalog_hash) {
+  const string source = "data" + catalog_hash.MakePath(1,2) + "C";
+  const string dest = "/tmp/" + catalog_hash.ToString();
+  if (remote_repository == NULL) {
+    if (!zlib::DecompressPath2Path(source, dest))
+      return "";
+    return dest;
+  }
+
+  const string url = *remote_repository + "/" + source;
+  download::JobInfo download_catalog(&url, true, false, &dest, &catalog_hash);
+  download::Failures retval = download::Fetch(&download_catalog);
+  if (retval != download::kFailOk) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to download catalog %s (%d)",
+             catalog_hash.ToString().c_str(), retval);
+    return "";
+  }
+  return dest;
+}
+
+
+catalog::Catalog *DiffPrinter::LoadCatalog(const PathString &mountpoint,
+                                           const hash::Any &catalog_hash)
+{
+  const string tmp_file = FetchCatalog(catalog_hash);
+  if (tmp_file == "") {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to load catalog %s",
+             catalog_hash.ToString().c_str());
+    return NULL;
+  }
+  catalog::Catalog *catalog =
+    catalog::AttachFreely(mountpoint.ToString(), tmp_file);
+  unlink(tmp_file.c_str());
+  if (catalog == NULL) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to open catalog %s",
+             catalog_hash.ToString().c_str());
+  }
+  return catalog;
+}
+
+
+static manifest::Manifest *LoadManifest(const string &repository) {
+  if (remote_repository == NULL) {
+    if (chdir(repository.c_str()) != 0) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to switch to directory %s",
+               repository.c_str());
+      return NULL;
+    }
+    return manifest::Manifest::LoadFile(".cvmfspublished");
+  }
+
+  const string url = repository + "/.cvmfspublished";
+  download::JobInfo download_manifest(&url, false, false, NULL);
+  download::Failures retval = download::Fetch(&download_manifest);
+  if (retval != download::kFailOk) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to download manifest (%d)",
+             retval);
+    return NULL;
+  }
+  char *buffer = download_manifest.destination_mem.data;
+  const unsigned length = download_manifest.destination_mem.size;
+  manifest::Manifest *manifest = manifest::Manifest::LoadMem(
+    reinterpret_cast<const unsigned char *>(buffer), length);
+  download::ReleaseMemBuffer(&download_manifest);
+  return manifest;
+}
+
+
+int swissknife::CommandDiff::Main(const swissknife::ArgumentList &args) {
+  const string repository = MakeCanonicalPath(*args.find('r')->second);
+
+  // Repository can be HTTP address or on local file system
+  if (repository.substr(0, 7) == "http://") {
+    remote_repository = new string(repository);
+    download::Init(1);
+    download::Spawn();
+  } else {
+    remote_repository = NULL;
+  }
+
+  DiffPrinter printer;
+  hash::Any new_hash;
+  if (args.find('n') != args.end()) {
+    new_hash = hash::Any(hash::kSha1, hash::HexPtr(*args.find('n')->second));
+    if ((remote_repository == NULL) && (chdir(repository.c_str()) != 0)) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to switch to directory %s",
+               repository.c_str());
+      return 1;
+    }
+  } else {
+    manifest::Manifest *manifest = LoadManifest(repository);
+    if (!manifest) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to load repository manifest");
+      return 1;
+    }
+    new_hash = manifest->catalog_hash();
+    delete manifest;
+  }
+
+  hash::Any old_hash;
+  if (args.find('o') != args.end()) {
+    old_hash = hash::Any(hash::kSha1, hash::HexPtr(*args.find('o')->second));
+  } else {
+    catalog::Catalog *new_root = printer.LoadCatalog(PathString("", 0),
+                                                     new_hash);
+    if (new_root == NULL)
+      return 1;
+    old_hash = new_root->GetPreviousRevision();
+    delete new_root;
+    if (old_hash.IsNull()) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "no previous revision of %s",
+               new_hash.ToString().c_str());
+      return 1;
+    }
+  }
+
+  catalog::CatalogDiff<DiffPrinter> diff(&printer);
+  diff.fn_load_catalog = &DiffPrinter::LoadCatalog;
+  diff.fn_add = &DiffPrinter::Add;
+  diff.fn_remove = &DiffPrinter::Remove;
+  diff.fn_modify = &DiffPrinter::Modify;
+  const bool retval = diff.Diff(old_hash, new_hash);
+
+  LogCvmfs(kLogCvmfs, kLogStderr, "%s -> %s: %"PRIu64" added, "
+           "%"PRIu64" removed, %"PRIu64" modified; "
+           "%"PRIu64" catalogs loaded, %"PRIu64" unchanged catalogs skipped",
+           old_hash.ToString().c_str(), new_hash.ToString().c_str(),
+           printer.num_added, printer.num_removed, printer.num_modified,
+           diff.num_catalogs_loaded(), diff.num_catalogs_skipped());
+  return retval ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_SWISSKNIFE_DIFF_H_
+#define CVMFS_SWISSKNIFE_DIFF_H_
+
+#include "swissknife.h"
+
+namespace swissknife {
+
+class CommandDiff : public Command {
+ public:
+  ~CommandDiff() { };
+  std::string GetName() { return "diff"; };
+  std::string GetDescription() {
+    return "Lists the entries that were added (+), removed (-) or modified (M) "
+      "between two revisions of a repository.  Nested catalogs that did not "
+      "change are not loaded.";
+  };
+  ParameterList GetParams() {
+    ParameterList result;
+    result.push_back(Parameter('r', "repository directory / url",
+                               false, false));
+    result.push_back(Parameter('o', "old root catalog hash "
+                               "(default: previous revision)", true, false));
+    result.push_back(Parameter('n', "new root catalog hash "
+                               "(default: current revision)", true, false));
+    return result;
+  }
+  int Main(const ArgumentList &args);
+};
+
+}
+
+#endif  // CVMFS_SWISSKNIFE_DIFF_H_
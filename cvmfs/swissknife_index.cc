@@ -0,0 +1,38 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Rebuilds the index of stored objects, e.g. after the storage was modified
+ * behind the back of swissknife pull.
+ */
+
+#include "cvmfs_config.h"
+#include "swissknife_index.h"
+
+#include <string>
+#include <vector>
+
+#include "logging.h"
+#include "upload_index.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+int swissknife::CommandIndex::Main(const swissknife::ArgumentList &args) {
+  const string spooler_definition = *args.find('r')->second;
+  const string index_path = *args.find('i')->second;
+
+  const vector<string> components = SplitString(spooler_definition, ',');
+  if (!HasPrefix(components[0], "local:", false)) {
+    LogCvmfs(kLogCvmfs, kLogStderr,
+             "only local upstream storage can be indexed");
+    return 1;
+  }
+  const string upstream_basedir = components[0].substr(6);
+
+  if (!upload::RebuildObjectIndex(upstream_basedir, index_path)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to rebuild object index %s",
+             index_path.c_str());
+    return 1;
+  }
+  return 0;
+}
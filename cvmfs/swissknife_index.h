@@ -0,0 +1,31 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_SWISSKNIFE_INDEX_H_
+#define CVMFS_SWISSKNIFE_INDEX_H_
+
+#include "swissknife.h"
+
+namespace swissknife {
+
+class CommandIndex : public Command {
+ public:
+  ~CommandIndex() { };
+  std::string GetName() { return "index"; };
+  std::string GetDescription() {
+    return "Rebuilds the index of stored objects used by pull from the "
+      "objects in a local upstream storage.";
+  };
+  ParameterList GetParams() {
+    ParameterList result;
+    result.push_back(Parameter('r', "spooler definition", false, false));
+    result.push_back(Parameter('i', "index of stored objects", false, false));
+    return result;
+  }
+  int Main(const ArgumentList &args);
+};
+
+}
+
+#endif  // CVMFS_SWISSKNIFE_INDEX_H_
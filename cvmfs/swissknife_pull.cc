@@ -3,6 +3,10 @@
  *
  * Replicates a cvmfs repository.  Uses the cvmfs intrinsic Merkle trees
  * to calculate the difference set.
+ *
+ * Incrementally, a catalog is compared to the revision of the same catalog
+ * that was replicated last.  Chunks referenced by the old revision are known
+ * to be present and are not checked again.
  */
 
 #define _FILE_OFFSET_BITS 64
@@ -12,17 +16,25 @@
 #include "swissknife_pull.h"
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <errno.h>
 
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
 
 #include "upload.h"
+#include "upload_index.h"
 #include "logging.h"
 #include "download.h"
 #include "util.h"
@@ -30,6 +42,7 @@
 #include "manifest_fetch.h"
 #include "signature.h"
 #include "catalog.h"
+#include "catalog_delta.h"
 #include "smalloc.h"
 #include "hash.h"
 #include "atomic.h"
@@ -38,26 +51,102 @@ using namespace std;  // NOLINT
 
 namespace {
 
+/**
+ * A catalog to replicate.  It is uploaded once all its missing chunks and all
+ * its nested (and historic) catalogs are stored, so that the replica never
+ * references objects it does not have.
+ */
+struct CatalogJob {
+  CatalogJob(const hash::Any &h, const string &p, const bool n,
+             CatalogJob *parent_job, const hash::Any &o) :
+    hash(h), path(p), with_nested(n), parent(parent_job), pending(1),
+    failed(false), old_hash(o) { }
+  hash::Any hash;
+  string path;
+  bool with_nested;
+  CatalogJob *parent;
+  string file_vanilla;  ///< The downloaded, compressed catalog
+  /**
+   * Missing chunks and child catalogs not yet stored, plus one for the
+   * enumeration of the catalog itself.  Protected by lock_catalogs.
+   */
+  unsigned pending;
+  bool failed;  ///< Set if the catalog or one of its children failed
+  hash::Any old_hash;  ///< Last replicated revision of the catalog, if known
+};
+
 struct ChunkJob {
   unsigned char type;
   unsigned char digest[hash::kMaxDigestSize];
+  unsigned deferrals;  ///< Failed rounds of download attempts
+  CatalogJob *catalog;
 };
 
+/**
+ * A chunk that failed to download, it is queued again once it is due.
+ */
+struct DeferredChunk {
+  DeferredChunk(const ChunkJob &c, const time_t d) : chunk(c), due(d) { }
+  ChunkJob chunk;
+  time_t due;
+};
 
-class AbortSpoolerOnError : public upload::SpoolerCallback {
- public:
-  void Callback(const string &path, int retval, const string &digest) {
-    if (retval != 0) {
-      LogCvmfs(kLogCvmfs, kLogStderr, "spooler failure %d (%s, hash: %s)",
-               retval, path.c_str(), digest.c_str());
-      abort();
-    }
+/**
+ * Identifies the chunks of an already replicated catalog revision.
+ */
+struct ChunkKey {
+  ChunkKey(const hash::Any &h, const unsigned char t) : hash(h), type(t) { }
+  bool operator <(const ChunkKey &other) const {
+    if (type != other.type)
+      return type < other.type;
+    return hash < other.hash;
   }
+  hash::Any hash;
+  unsigned char type;
 };
 
+/**
+ * A file handed over to the spooler, its completion finishes a chunk of the
+ * catalog or stores the catalog itself.
+ */
+struct PendingCopy {
+  PendingCopy() : catalog(NULL), is_catalog(false) { }
+  PendingCopy(CatalogJob *c, const bool i) : catalog(c), is_catalog(i) { }
+  CatalogJob *catalog;
+  bool is_catalog;
+};
+
+/**
+ * Chunks are checked against the upstream storage in batches, so that a
+ * remote backend can check them in parallel.  Only missing chunks are handed
+ * on to the workers.
+ */
+const unsigned kStatBatchSize = 256;
+
+/**
+ * Catalogs downloaded and enumerated at the same time
+ */
+const unsigned kNumCatalogWorkers = 4;
+
+/**
+ * Chunks that still fail after all retries are deferred with exponential
+ * backoff instead of failing the pull, so that transient outages of the
+ * stratum 0 are bridged.  Only after kMaxDeferrals rounds the catalog fails.
+ */
+const unsigned kMaxDeferrals = 20;
+const unsigned kMaxDeferralBackoff = 600;  // 10 minutes
+
+/**
+ * Seconds between updates of the status file and between progress messages
+ */
+const unsigned kStatusInterval = 5;
+const unsigned kProgressInterval = 60;
+
 
 string *stratum0_url = NULL;
 string *temp_dir = NULL;
+string *state_file = NULL;  ///< Root catalog hash of the last replication
+string *status_file = NULL;  ///< Throughput and queue depths, for monitoring
 unsigned num_parallel = 1;
 bool pull_history = false;
 upload::Spooler *spooler = NULL;
@@ -65,12 +154,167 @@ int pipe_chunks[2];
 // required for concurrent reading
 pthread_mutex_t lock_pipe = PTHREAD_MUTEX_INITIALIZER;
 upload::BackendStat *backend_stat = NULL;
+upload::ObjectIndex *object_index = NULL;
 unsigned retries = 3;
 atomic_int64 overall_retries;
 atomic_int64 overall_chunks;
 atomic_int64 overall_new;
-atomic_int64 chunk_queue;
+atomic_int64 overall_bytes;  ///< Of the new chunks
+atomic_int32 queued_chunks;  ///< Written to the pipe, not yet downloaded
+
+/**
+ * Catalogs to download, catalogs ready for upload, and the files in the
+ * spooler.  The root catalog job finishes the pull.
+ */
+pthread_mutex_t lock_catalogs = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_catalogs = PTHREAD_COND_INITIALIZER;
+deque<CatalogJob *> catalog_queue;
+vector<CatalogJob *> finished_catalogs;
+map<string, PendingCopy> pending_copies;
+bool terminate_catalog_workers = false;
+bool root_done = false;
+bool root_failed = false;
+deque<DeferredChunk> deferred_chunks;
+
+/**
+ * Catalogs stored by an interrupted pull, recorded next to the state file.
+ * A stored catalog implies its complete subtree, so a resumed pull skips
+ * them without asking the upstream storage.  The set is read-only during the
+ * pull, the file is appended to under lock_catalogs.
+ */
+set<hash::Any> checkpointed_catalogs;
+FILE *fcheckpoint = NULL;
+
+
+void FinishCatalogJobLocked(CatalogJob *job);
+
+/**
+ * The catalog is stored or skipped, its parent has one child less to wait for.
+ */
+void ReleaseCatalogJobLocked(CatalogJob *job) {
+  if (job->failed && !job->file_vanilla.empty())
+    unlink(job->file_vanilla.c_str());
+  CatalogJob *parent = job->parent;
+  if (parent == NULL) {
+    root_done = true;
+    root_failed = job->failed;
+    pthread_cond_broadcast(&cond_catalogs);
+  } else {
+    if (job->failed)
+      parent->failed = true;
+    FinishCatalogJobLocked(parent);
+  }
+  delete job;
+}
+
+
+void FinishCatalogJobLocked(CatalogJob *job) {
+  assert(job->pending > 0);
+  job->pending--;
+  if (job->pending > 0)
+    return;
+  if (job->failed || job->file_vanilla.empty()) {
+    ReleaseCatalogJobLocked(job);
+    return;
+  }
+  // Spooled by the main thread, not from within the spooler callback
+  finished_catalogs.push_back(job);
+  pthread_cond_broadcast(&cond_catalogs);
+}
+
+
+void FinishCatalogJob(CatalogJob *job) {
+  pthread_mutex_lock(&lock_catalogs);
+  FinishCatalogJobLocked(job);
+  pthread_mutex_unlock(&lock_catalogs);
+}
+
+
+void SpoolCopy(const string &local_path, const string &remote_path,
+               const PendingCopy &pending_copy)
+{
+  pthread_mutex_lock(&lock_catalogs);
+  pending_copies[local_path] = pending_copy;
+  pthread_mutex_unlock(&lock_catalogs);
+  spooler->SpoolCopy(local_path, remote_path);
+}
+
+
+void CheckpointCatalogLocked(const hash::Any &catalog_hash) {
+  if (fcheckpoint == NULL)
+    return;
+  fprintf(fcheckpoint, "%s\n", catalog_hash.ToString().c_str());
+  fflush(fcheckpoint);
+}
+
+
+/**
+ * Upload failures fail the catalog instead of the entire pull, the other
+ * catalogs can still be stored and picked up by the next run.
+ */
+class FinishOnCompletion : public upload::SpoolerCallback {
+ public:
+  void Callback(const string &path, int retval, const string &digest) {
+    if (retval != 0) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "spooler failure %d (%s, hash: %s)",
+               retval, path.c_str(), digest.c_str());
+    }
+    pthread_mutex_lock(&lock_catalogs);
+    map<string, PendingCopy>::iterator copy = pending_copies.find(path);
+    if (copy != pending_copies.end()) {
+      const PendingCopy pending_copy = copy->second;
+      pending_copies.erase(copy);
+      if (retval != 0)
+        pending_copy.catalog->failed = true;
+      if (pending_copy.is_catalog) {
+        if (retval == 0)
+          CheckpointCatalogLocked(pending_copy.catalog->hash);
+        ReleaseCatalogJobLocked(pending_copy.catalog);
+      } else {
+        FinishCatalogJobLocked(pending_copy.catalog);
+      }
+    }
+    pthread_mutex_unlock(&lock_catalogs);
+  }
+};
+
+}
+
+
+static string MakeChunkPath(const ChunkJob &chunk) {
+  hash::Any chunk_hash(hash::kSha1, chunk.digest,
+                       hash::kDigestSizes[hash::kSha1]);
+  string chunk_path = "data" + chunk_hash.MakePath(1, 2);
+  if (chunk.type != 0)
+    chunk_path.push_back(chunk.type);
+  return chunk_path;
+}
 
+
+/**
+ * Puts a chunk aside until its backoff is over, the main thread queues it
+ * again.
+ */
+static void DeferChunk(ChunkJob chunk, const string &url, const int error) {
+  chunk.deferrals++;
+  if (chunk.deferrals > kMaxDeferrals) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to download %s (%d), giving up",
+             url.c_str(), error);
+    pthread_mutex_lock(&lock_catalogs);
+    chunk.catalog->failed = true;
+    FinishCatalogJobLocked(chunk.catalog);
+    pthread_mutex_unlock(&lock_catalogs);
+    return;
+  }
+
+  unsigned backoff = kMaxDeferralBackoff;
+  if (chunk.deferrals < 10)
+    backoff = std::min(1U << chunk.deferrals, kMaxDeferralBackoff);
+  LogCvmfs(kLogCvmfs, kLogStderr, "failed to download %s (%d), "
+           "retrying in %u seconds", url.c_str(), error, backoff);
+  pthread_mutex_lock(&lock_catalogs);
+  deferred_chunks.push_back(DeferredChunk(chunk, time(NULL) + backoff));
+  pthread_mutex_unlock(&lock_catalogs);
 }
 
 
@@ -82,144 +326,319 @@ static void *MainWorker(void *data) {
     pthread_mutex_unlock(&lock_pipe);
     if (next_chunk.type == 255)
       break;
+    atomic_dec32(&queued_chunks);
 
     hash::Any chunk_hash(hash::kSha1, next_chunk.digest,
                          hash::kDigestSizes[hash::kSha1]);
     LogCvmfs(kLogCvmfs, kLogVerboseMsg, "processing chunk %s",
              chunk_hash.ToString().c_str());
-    string chunk_path = "data" + chunk_hash.MakePath(1, 2);
-    if (next_chunk.type != 0)
-      chunk_path.push_back(next_chunk.type);
-
-    if (!backend_stat->Stat(chunk_path)) {
-      string tmp_file;
-      FILE *fchunk = CreateTempFile(*temp_dir + "/cvmfs", 0600, "w",
-                                    &tmp_file);
-      assert(fchunk);
-      const string url_chunk = *stratum0_url + "/" + chunk_path;
-      download::JobInfo download_chunk(&url_chunk, false, false, fchunk,
-                                       &chunk_hash);
-
-      unsigned attempts = 0;
-      download::Failures retval;
-      do {
-        retval = download::Fetch(&download_chunk);
-        if (retval != download::kFailOk) {
-          if (attempts < retries) {
-            // Backoff
-            atomic_inc64(&overall_retries);
-            usleep((100 + random()%100) * 1000);
-            rewind(fchunk);
-            int retval = ftruncate(fileno(fchunk), 0);
-            assert(retval == 0);
-          } else {
-            LogCvmfs(kLogCvmfs, kLogStderr, "failed to download %s (%d), abort",
-                     url_chunk.c_str(), retval);
-            abort();
-          }
-        }
-        attempts++;
-      } while ((retval != download::kFailOk) && (attempts < retries));
-      fclose(fchunk);
-      spooler->SpoolCopy(tmp_file, chunk_path);
-      atomic_inc64(&overall_new);
+    const string chunk_path = MakeChunkPath(next_chunk);
+
+    // Known to be missing upstream, see EnqueueMissingChunks()
+    string tmp_file;
+    FILE *fchunk = CreateTempFile(*temp_dir + "/cvmfs", 0600, "w",
+                                  &tmp_file);
+    assert(fchunk);
+    const string url_chunk = *stratum0_url + "/" + chunk_path;
+    download::JobInfo download_chunk(&url_chunk, false, false, fchunk,
+                                     &chunk_hash);
+    download_chunk.priority = download::kPriorityBulk;
+
+    unsigned attempts = 0;
+    download::Failures retval;
+    do {
+      if (attempts > 0) {
+        // Backoff
+        atomic_inc64(&overall_retries);
+        usleep((100 + random()%100) * 1000);
+        rewind(fchunk);
+        int retval = ftruncate(fileno(fchunk), 0);
+        assert(retval == 0);
+      }
+      retval = download::Fetch(&download_chunk);
+      attempts++;
+    } while ((retval != download::kFailOk) && (attempts < retries));
+    fclose(fchunk);
+    if (retval != download::kFailOk) {
+      unlink(tmp_file.c_str());
+      DeferChunk(next_chunk, url_chunk, retval);
+      continue;
     }
-    if (atomic_xadd64(&overall_chunks, 1) % 1000 == 0)
-      LogCvmfs(kLogCvmfs, kLogStdout | kLogNoLinebreak, ".");
-    atomic_dec64(&chunk_queue);
+
+    atomic_xadd64(&overall_bytes, GetFileSize(tmp_file));
+    SpoolCopy(tmp_file, chunk_path, PendingCopy(next_chunk.catalog, false));
+    atomic_inc64(&overall_new);
+    atomic_inc64(&overall_chunks);
   }
   return NULL;
 }
 
 
-static bool Pull(const hash::Any &catalog_hash, const std::string &path,
-                 const bool with_nested)
+/**
+ * Checks a batch of chunks upstream and queues the missing ones for download.
+ * @return the number of missing chunks
+ */
+static unsigned EnqueueMissingChunks(vector<ChunkJob> *chunks) {
+  vector<string> chunk_paths;
+  for (unsigned i = 0; i < chunks->size(); ++i)
+    chunk_paths.push_back(MakeChunkPath((*chunks)[i]));
+  vector<bool> exists;
+  backend_stat->StatMany(chunk_paths, &exists);
+
+  unsigned num_missing = 0;
+  for (unsigned i = 0; i < chunks->size(); ++i) {
+    if (exists[i])
+      atomic_inc64(&overall_chunks);
+    else
+      num_missing++;
+  }
+  if (num_missing > 0) {
+    // Before the chunks are visible to the workers
+    pthread_mutex_lock(&lock_catalogs);
+    (*chunks)[0].catalog->pending += num_missing;
+    pthread_mutex_unlock(&lock_catalogs);
+  }
+  for (unsigned i = 0; i < chunks->size(); ++i) {
+    if (!exists[i]) {
+      atomic_inc32(&queued_chunks);
+      WritePipe(pipe_chunks[1], &(*chunks)[i], sizeof(ChunkJob));
+    }
+  }
+  chunks->clear();
+  return num_missing;
+}
+
+
+static void EnqueueCatalog(CatalogJob *parent, const hash::Any &hash,
+                           const string &path, const bool with_nested,
+                           const hash::Any &old_hash)
 {
-  int retval;
+  CatalogJob *job = new CatalogJob(hash, path, with_nested, parent, old_hash);
+  pthread_mutex_lock(&lock_catalogs);
+  if (parent)
+    parent->pending++;
+  catalog_queue.push_back(job);
+  pthread_cond_signal(&cond_catalogs);
+  pthread_mutex_unlock(&lock_catalogs);
+}
 
-  // Check if the catalog already exists
-  if (backend_stat->Stat("data" + catalog_hash.MakePath(1, 2) + "C")) {
-    LogCvmfs(kLogCvmfs, kLogStdout, "  Catalog up to date");
-    return true;
+
+static unsigned char GetChunkType(const catalog::ChunkTypes chunk_type) {
+  switch (chunk_type) {
+    case catalog::kChunkMicroCatalog:
+      return 'L';
+    case catalog::kChunkPiece:
+      return 'C';
+    case catalog::kChunkBundle:
+      return 'B';
+    default:
+      return '\0';
   }
+}
 
-  int64_t gauge_chunks = atomic_read64(&overall_chunks);
-  int64_t gauge_new = atomic_read64(&overall_new);
 
-  // Download and uncompress catalog
-  hash::Any chunk_hash;
-  catalog::ChunkTypes chunk_type;
+/**
+ * Downloads and attaches a catalog from the stratum 0.
+ * @param[out] file_catalog_vanilla the compressed catalog as downloaded
+ * @param[out] file_catalog the uncompressed catalog, opened by the result
+ * @return NULL on failure, the temporary files are removed in this case
+ */
+static catalog::Catalog *FetchCatalog(const hash::Any &catalog_hash,
+                                      const string &path,
+                                      string *file_catalog_vanilla,
+                                      string *file_catalog)
+{
+  int retval;
   catalog::Catalog *catalog = NULL;
-  string file_catalog;
-  string file_catalog_vanilla;
   FILE *fcatalog = CreateTempFile(*temp_dir + "/cvmfs", 0600, "w",
-                                  &file_catalog);
+                                  file_catalog);
   FILE *fcatalog_vanilla = CreateTempFile(*temp_dir + "/cvmfs", 0600, "w",
-                                          &file_catalog_vanilla);
+                                          file_catalog_vanilla);
   if (!fcatalog || !fcatalog_vanilla) {
     LogCvmfs(kLogCvmfs, kLogStderr, "I/O error");
-    return false;
+    if (fcatalog) {
+      fclose(fcatalog);
+      unlink(file_catalog->c_str());
+    }
+    if (fcatalog_vanilla) {
+      fclose(fcatalog_vanilla);
+      unlink(file_catalog_vanilla->c_str());
+    }
+    return NULL;
   }
   fclose(fcatalog);
   const string url_catalog = *stratum0_url + "/data" +
                              catalog_hash.MakePath(1, 2) + "C";
   download::JobInfo download_catalog(&url_catalog, false, false,
                                      fcatalog_vanilla, &catalog_hash);
-  retval = download::Fetch(&download_catalog);
+  download_catalog.priority = download::kPriorityMetadata;
+  unsigned attempts = 0;
+  do {
+    if (attempts > 0) {
+      atomic_inc64(&overall_retries);
+      usleep((100 + random()%100) * 1000);
+      rewind(fcatalog_vanilla);
+      retval = ftruncate(fileno(fcatalog_vanilla), 0);
+      assert(retval == 0);
+    }
+    retval = download::Fetch(&download_catalog);
+    attempts++;
+  } while ((retval != download::kFailOk) && (attempts < retries));
   fclose(fcatalog_vanilla);
   if (retval != download::kFailOk) {
     LogCvmfs(kLogCvmfs, kLogStderr, "failed to download catalog %s (%d)",
              catalog_hash.ToString().c_str(), retval);
-    goto pull_cleanup;
+    goto fetch_cleanup;
   }
-  retval = zlib::DecompressPath2Path(file_catalog_vanilla, file_catalog);
+  retval = zlib::DecompressPath2Path(*file_catalog_vanilla, *file_catalog);
   if (!retval) {
     LogCvmfs(kLogCvmfs, kLogStderr, "decompression failure (file %s, hash %s)",
-             file_catalog_vanilla.c_str(), catalog_hash.ToString().c_str());
-    goto pull_cleanup;
+             file_catalog_vanilla->c_str(), catalog_hash.ToString().c_str());
+    goto fetch_cleanup;
   }
 
-  catalog = catalog::AttachFreely(path, file_catalog);
+  catalog = catalog::AttachFreely(path, *file_catalog);
   if (catalog == NULL) {
     LogCvmfs(kLogCvmfs, kLogStderr, "failed to attach catalog %s",
              catalog_hash.ToString().c_str());
-    goto pull_cleanup;
+    goto fetch_cleanup;
   }
+  return catalog;
 
-  // Traverse the chunks
-  LogCvmfs(kLogCvmfs, kLogStdout | kLogNoLinebreak,
-           "  Processing chunks: ");
-  retval = catalog->AllChunksBegin();
-  if (!retval) {
-    LogCvmfs(kLogCvmfs, kLogStderr, "failed to gather chunks");
-    goto pull_cleanup;
-  }
-  while (catalog->AllChunksNext(&chunk_hash, &chunk_type)) {
-    ChunkJob next_chunk;
-    switch (chunk_type) {
-      case catalog::kChunkMicroCatalog:
-        next_chunk.type = 'L';
-        break;
-      case catalog::kChunkPiece:
-        next_chunk.type = 'C';
-        break;
-      default:
-        next_chunk.type = '\0';
+ fetch_cleanup:
+  unlink(file_catalog->c_str());
+  unlink(file_catalog_vanilla->c_str());
+  return NULL;
+}
+
+
+/**
+ * Collects the chunks and the nested catalogs of the last replicated revision
+ * of a catalog.  The old revision counts only if it is stored upstream; it is
+ * stored after its chunks, so all of them are present.
+ * @param[out] old_chunks sorted
+ * @return false if the chunks of the new revision have to be checked one by
+ *         one
+ */
+static bool LoadReplicatedCatalog(const hash::Any &old_hash,
+                                  const string &path,
+                                  vector<ChunkKey> *old_chunks,
+                                  map<string, hash::Any> *old_nested)
+{
+  if (!backend_stat->Stat("data" + old_hash.MakePath(1, 2) + "C"))
+    return false;
+
+  string file_catalog;
+  string file_catalog_vanilla;
+  catalog::Catalog *catalog =
+    FetchCatalog(old_hash, path, &file_catalog_vanilla, &file_catalog);
+  if (catalog == NULL)
+    return false;
+  unlink(file_catalog_vanilla.c_str());
+
+  hash::Any chunk_hash;
+  catalog::ChunkTypes chunk_type;
+  bool result = catalog->AllChunksBegin();
+  if (result) {
+    while (catalog->AllChunksNext(&chunk_hash, &chunk_type))
+      old_chunks->push_back(ChunkKey(chunk_hash, GetChunkType(chunk_type)));
+    catalog->AllChunksEnd();
+    sort(old_chunks->begin(), old_chunks->end());
+
+    catalog::Catalog::NestedCatalogList *nested_catalogs =
+      catalog->ListNestedCatalogs();
+    assert(nested_catalogs);
+    for (catalog::Catalog::NestedCatalogList::const_iterator i =
+         nested_catalogs->begin(), iEnd = nested_catalogs->end();
+         i != iEnd; ++i)
+    {
+      (*old_nested)[i->path.ToString()] = i->hash;
     }
-    memcpy(next_chunk.digest, chunk_hash.digest, sizeof(chunk_hash.digest));
-    WritePipe(pipe_chunks[1], &next_chunk, sizeof(next_chunk));
-    atomic_inc64(&chunk_queue);
   }
-  catalog->AllChunksEnd();
-  while (atomic_read64(&chunk_queue) != 0) {
-    usleep(100000);
+
+  delete catalog;
+  unlink(file_catalog.c_str());
+  if (!result)
+    old_chunks->clear();
+  return result;
+}
+
+
+/**
+ * Downloads a catalog, queues its nested and previous catalogs and the
+ * missing chunks.  Runs in parallel for several catalogs.
+ */
+/**
+ * Copies the delta of a catalog if the stratum 0 has one.  Like a missing
+ * chunk, it is stored before the catalog.
+ */
+static void PullDelta(CatalogJob *job) {
+  const string delta_path =
+    "data" + job->hash.MakePath(1, 2) + catalog::kDeltaSuffix;
+  string tmp_file;
+  FILE *fdelta = CreateTempFile(*temp_dir + "/cvmfs", 0600, "w", &tmp_file);
+  assert(fdelta);
+  const string url_delta = *stratum0_url + "/" + delta_path;
+  download::JobInfo download_delta(&url_delta, false, false, fdelta, NULL);
+  download_delta.priority = download::kPriorityBulk;
+  download::Failures retval = download::Fetch(&download_delta);
+  fclose(fdelta);
+  if (retval != download::kFailOk) {
+    unlink(tmp_file.c_str());
+    return;
+  }
+
+  atomic_xadd64(&overall_bytes, GetFileSize(tmp_file));
+  pthread_mutex_lock(&lock_catalogs);
+  job->pending++;
+  pthread_mutex_unlock(&lock_catalogs);
+  SpoolCopy(tmp_file, delta_path, PendingCopy(job, false));
+}
+
+
+static void PullCatalog(CatalogJob *job) {
+  int retval;
+
+  // Check if the catalog already exists
+  if ((checkpointed_catalogs.find(job->hash) != checkpointed_catalogs.end()) ||
+      backend_stat->Stat("data" + job->hash.MakePath(1, 2) + "C"))
+  {
+    LogCvmfs(kLogCvmfs, kLogStdout, "Catalog at %s up to date",
+             job->path.empty() ? "/" : job->path.c_str());
+    FinishCatalogJob(job);
+    return;
+  }
+
+  hash::Any chunk_hash;
+  catalog::ChunkTypes chunk_type;
+  vector<ChunkKey> old_chunks;
+  map<string, hash::Any> old_nested;
+  vector<ChunkJob> chunk_batch;
+  unsigned num_chunks = 0;
+  unsigned num_missing = 0;
+  unsigned num_unchanged = 0;
+  string file_catalog;
+  string file_catalog_vanilla;
+  catalog::Catalog *catalog =
+    FetchCatalog(job->hash, job->path, &file_catalog_vanilla, &file_catalog);
+  if (catalog == NULL) {
+    job->failed = true;
+    FinishCatalogJob(job);
+    return;
   }
-  LogCvmfs(kLogCvmfs, kLogStdout, " fetched %"PRId64" new chunks out of "
-           "%"PRId64" processed chunks",
-           atomic_read64(&overall_new)-gauge_new,
-           atomic_read64(&overall_chunks)-gauge_chunks);
 
-  // Previous catalogs
+  // Without a recorded revision, the previous revision is a good guess
+  hash::Any old_hash = job->old_hash;
+  if (old_hash.IsNull())
+    old_hash = catalog->GetPreviousRevision();
+  if (!old_hash.IsNull() && (old_hash != job->hash)) {
+    if (LoadReplicatedCatalog(old_hash, job->path, &old_chunks, &old_nested)) {
+      LogCvmfs(kLogCvmfs, kLogVerboseMsg, "comparing %s to replicated %s",
+               job->hash.ToString().c_str(), old_hash.ToString().c_str());
+    }
+  }
+
+  // Other catalog workers fetch these while the chunks are enumerated
   if (pull_history) {
     hash::Any previous_catalog = catalog->GetPreviousRevision();
     if (previous_catalog.IsNull()) {
@@ -227,15 +646,10 @@ static bool Pull(const hash::Any &catalog_hash, const std::string &path,
     } else {
       LogCvmfs(kLogCvmfs, kLogStdout, "Replicating from historic catalog %s",
                previous_catalog.ToString().c_str());
-      retval = Pull(previous_catalog, path, false);
-      if (!retval)
-        return false;
+      EnqueueCatalog(job, previous_catalog, job->path, false, hash::Any());
     }
   }
-
-
-  // Nested catalogs
-  if (with_nested) {
+  if (job->with_nested) {
     catalog::Catalog::NestedCatalogList *nested_catalogs =
       catalog->ListNestedCatalogs();
     assert(nested_catalogs);
@@ -243,26 +657,318 @@ static bool Pull(const hash::Any &catalog_hash, const std::string &path,
          nested_catalogs->begin(), iEnd = nested_catalogs->end();
          i != iEnd; ++i)
     {
-      LogCvmfs(kLogCvmfs, kLogStdout, "Replicating from catalog at %s",
-               i->path.c_str());
-      retval = Pull(i->hash, i->path.ToString(), true);
-      if (!retval)
-        return false;
+      const string nested_path = i->path.ToString();
+      map<string, hash::Any>::const_iterator old_nested_hash =
+        old_nested.find(nested_path);
+      EnqueueCatalog(job, i->hash, nested_path, true,
+                     (old_nested_hash == old_nested.end()) ?
+                     hash::Any() : old_nested_hash->second);
     }
   }
 
-  delete catalog;
-  unlink(file_catalog.c_str());
-  spooler->WaitFor();
-  spooler->SpoolCopy(file_catalog_vanilla,
-                     "data" + catalog_hash.MakePath(1, 2) + "C");
-  return true;
+  // Traverse the chunks
+  retval = catalog->AllChunksBegin();
+  if (!retval) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to gather chunks");
+    delete catalog;
+    unlink(file_catalog.c_str());
+    unlink(file_catalog_vanilla.c_str());
+    job->failed = true;
+    FinishCatalogJob(job);
+    return;
+  }
+  chunk_batch.reserve(kStatBatchSize);
+  while (catalog->AllChunksNext(&chunk_hash, &chunk_type)) {
+    num_chunks++;
+    const unsigned char type = GetChunkType(chunk_type);
+    if (binary_search(old_chunks.begin(), old_chunks.end(),
+                      ChunkKey(chunk_hash, type)))
+    {
+      num_unchanged++;
+      atomic_inc64(&overall_chunks);
+      continue;
+    }
+
+    ChunkJob next_chunk;
+    next_chunk.type = type;
+    memcpy(next_chunk.digest, chunk_hash.digest, sizeof(chunk_hash.digest));
+    next_chunk.deferrals = 0;
+    next_chunk.catalog = job;
+    chunk_batch.push_back(next_chunk);
+    if (chunk_batch.size() == kStatBatchSize)
+      num_missing += EnqueueMissingChunks(&chunk_batch);
+  }
+  if (!chunk_batch.empty())
+    num_missing += EnqueueMissingChunks(&chunk_batch);
+  catalog->AllChunksEnd();
+  LogCvmfs(kLogCvmfs, kLogStdout, "Replicating from catalog at %s: "
+           "%u new chunks out of %u chunks, %u unchanged",
+           job->path.empty() ? "/" : job->path.c_str(), num_missing,
+           num_chunks, num_unchanged);
+  PullDelta(job);
 
- pull_cleanup:
   delete catalog;
   unlink(file_catalog.c_str());
-  unlink(file_catalog_vanilla.c_str());
-  return false;
+  job->file_vanilla = file_catalog_vanilla;
+  FinishCatalogJob(job);
+}
+
+
+static void *MainCatalogWorker(void *data) {
+  while (true) {
+    pthread_mutex_lock(&lock_catalogs);
+    while (catalog_queue.empty() && !terminate_catalog_workers)
+      pthread_cond_wait(&cond_catalogs, &lock_catalogs);
+    if (catalog_queue.empty()) {
+      pthread_mutex_unlock(&lock_catalogs);
+      break;
+    }
+    CatalogJob *job = catalog_queue.front();
+    catalog_queue.pop_front();
+    pthread_mutex_unlock(&lock_catalogs);
+
+    PullCatalog(job);
+  }
+  return NULL;
+}
+
+
+/**
+ * Writes throughput and queue depths to the status file every
+ * kStatusInterval seconds and logs them every kProgressInterval seconds.
+ * Rates refer to the time since the previous status update.
+ */
+static void ReportStatus(const bool final) {
+  static struct timeval last_status = {0, 0};
+  static struct timeval last_progress = {0, 0};
+  static int64_t last_chunks = 0;
+  static int64_t last_bytes = 0;
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (last_status.tv_sec == 0) {
+    last_status = last_progress = now;
+    return;
+  }
+  const double elapsed = DiffTimeSeconds(last_status, now);
+  if (!final && (elapsed < kStatusInterval))
+    return;
+
+  const int64_t chunks = atomic_read64(&overall_chunks);
+  const int64_t chunks_new = atomic_read64(&overall_new);
+  const int64_t bytes = atomic_read64(&overall_bytes);
+  const double objects_per_second =
+    (elapsed > 0) ? (chunks - last_chunks) / elapsed : 0.0;
+  const double mb_per_second =
+    (elapsed > 0) ? (bytes - last_bytes) / (1024.0 * 1024.0) / elapsed : 0.0;
+  pthread_mutex_lock(&lock_catalogs);
+  const unsigned num_queued_catalogs = catalog_queue.size();
+  const unsigned num_deferred = deferred_chunks.size();
+  pthread_mutex_unlock(&lock_catalogs);
+  const unsigned num_queued_chunks = atomic_read32(&queued_chunks);
+  last_status = now;
+  last_chunks = chunks;
+  last_bytes = bytes;
+
+  if (status_file) {
+    const string tmp_path = *status_file + ".tmp";
+    FILE *fstatus = fopen(tmp_path.c_str(), "w");
+    if ((fstatus == NULL) ||
+        (fprintf(fstatus, "updated: %s\n", StringifyTime(now.tv_sec,
+                                                         true).c_str()) < 0) ||
+        (fprintf(fstatus, "chunks: %"PRId64"\nnew_chunks: %"PRId64"\n"
+                 "new_bytes: %"PRId64"\n", chunks, chunks_new, bytes) < 0) ||
+        (fprintf(fstatus, "objects_per_second: %.1f\n"
+                 "mb_per_second: %.2f\n", objects_per_second,
+                 mb_per_second) < 0) ||
+        (fprintf(fstatus, "queued_catalogs: %u\nqueued_chunks: %u\n"
+                 "deferred_chunks: %u\nretries: %"PRId64"\n",
+                 num_queued_catalogs, num_queued_chunks, num_deferred,
+                 atomic_read64(&overall_retries)) < 0) ||
+        (fclose(fstatus) != 0) ||
+        (rename(tmp_path.c_str(), status_file->c_str()) != 0))
+    {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to write status file %s",
+               status_file->c_str());
+    }
+  }
+
+  if (!final && (DiffTimeSeconds(last_progress, now) < kProgressInterval))
+    return;
+  last_progress = now;
+  LogCvmfs(kLogCvmfs, kLogStdout, "Processed %"PRId64" chunks, %"PRId64" new "
+           "(%.1f objects/s, %.2f MB/s), %u chunks and %u catalogs queued, "
+           "%u chunks deferred, %"PRId64" retries", chunks, chunks_new,
+           objects_per_second, mb_per_second, num_queued_chunks,
+           num_queued_catalogs, num_deferred, atomic_read64(&overall_retries));
+}
+
+
+/**
+ * Takes the deferred chunks whose backoff is over.
+ */
+static void TakeDueChunksLocked(vector<ChunkJob> *due_chunks) {
+  const time_t now = time(NULL);
+  deque<DeferredChunk> waiting;
+  for (unsigned i = 0; i < deferred_chunks.size(); ++i) {
+    if (deferred_chunks[i].due <= now)
+      due_chunks->push_back(deferred_chunks[i].chunk);
+    else
+      waiting.push_back(deferred_chunks[i]);
+  }
+  deferred_chunks.swap(waiting);
+}
+
+
+/**
+ * Replicates the catalog tree as a pipeline: catalog workers fetch catalogs
+ * and feed the missing chunks of all of them into one queue for the download
+ * workers.  Finished catalogs and deferred chunks are spooled from here.
+ */
+static bool Pull(const hash::Any &catalog_hash,
+                 const hash::Any &replicated_hash)
+{
+  root_done = false;
+  root_failed = false;
+  terminate_catalog_workers = false;
+  EnqueueCatalog(NULL, catalog_hash, "", true, replicated_hash);
+
+  pthread_t catalog_workers[kNumCatalogWorkers];
+  for (unsigned i = 0; i < kNumCatalogWorkers; ++i) {
+    int retval = pthread_create(&catalog_workers[i], NULL, MainCatalogWorker,
+                                NULL);
+    assert(retval == 0);
+  }
+
+  ReportStatus(false);
+  pthread_mutex_lock(&lock_catalogs);
+  while (!root_done) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + 1;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    while (finished_catalogs.empty() && !root_done) {
+      if (pthread_cond_timedwait(&cond_catalogs, &lock_catalogs,
+                                 &deadline) == ETIMEDOUT)
+      {
+        break;
+      }
+    }
+    vector<CatalogJob *> catalogs;
+    catalogs.swap(finished_catalogs);
+    vector<ChunkJob> due_chunks;
+    TakeDueChunksLocked(&due_chunks);
+    pthread_mutex_unlock(&lock_catalogs);
+    for (unsigned i = 0; i < catalogs.size(); ++i) {
+      SpoolCopy(catalogs[i]->file_vanilla,
+                "data" + catalogs[i]->hash.MakePath(1, 2) + "C",
+                PendingCopy(catalogs[i], true));
+    }
+    for (unsigned i = 0; i < due_chunks.size(); ++i) {
+      atomic_inc32(&queued_chunks);
+      WritePipe(pipe_chunks[1], &due_chunks[i], sizeof(ChunkJob));
+    }
+    ReportStatus(false);
+    pthread_mutex_lock(&lock_catalogs);
+  }
+  terminate_catalog_workers = true;
+  pthread_cond_broadcast(&cond_catalogs);
+  pthread_mutex_unlock(&lock_catalogs);
+
+  for (unsigned i = 0; i < kNumCatalogWorkers; ++i) {
+    int retval = pthread_join(catalog_workers[i], NULL);
+    assert(retval == 0);
+  }
+  return !root_failed;
+}
+
+
+/**
+ * @return the root catalog hash recorded by the last replication, a null hash
+ *         if there is none
+ */
+static hash::Any ReadReplicatedHash() {
+  if (state_file == NULL)
+    return hash::Any();
+  FILE *fstate = fopen(state_file->c_str(), "r");
+  if (fstate == NULL)
+    return hash::Any();
+  char buf[2*hash::kMaxDigestSize + 2];
+  string line = fgets(buf, sizeof(buf), fstate) ? buf : "";
+  fclose(fstate);
+  if (!line.empty() && (line[line.length() - 1] == '\n'))
+    line.erase(line.length() - 1);
+  if (line.length() != 2*hash::kDigestSizes[hash::kSha1]) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "ignoring invalid replication state %s",
+             state_file->c_str());
+    return hash::Any();
+  }
+  return hash::Any(hash::kSha1, hash::HexPtr(line));
+}
+
+
+static void WriteReplicatedHash(const hash::Any &catalog_hash) {
+  if (state_file == NULL)
+    return;
+  const string tmp_path = *state_file + ".tmp";
+  FILE *fstate = fopen(tmp_path.c_str(), "w");
+  if ((fstate == NULL) ||
+      (fprintf(fstate, "%s\n", catalog_hash.ToString().c_str()) < 0) ||
+      (fclose(fstate) != 0) ||
+      (rename(tmp_path.c_str(), state_file->c_str()) != 0))
+  {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to write replication state %s",
+             state_file->c_str());
+  }
+}
+
+
+static string GetCheckpointPath() {
+  return *state_file + ".checkpoint";
+}
+
+
+/**
+ * Loads the catalogs stored by an interrupted pull and opens the checkpoint
+ * for appending.  Requires a state file.
+ */
+static void OpenCheckpoint() {
+  if (state_file == NULL)
+    return;
+  FILE *f = fopen(GetCheckpointPath().c_str(), "r");
+  if (f != NULL) {
+    char buf[2*hash::kMaxDigestSize + 2];
+    while (fgets(buf, sizeof(buf), f)) {
+      string line = buf;
+      if (!line.empty() && (line[line.length() - 1] == '\n'))
+        line.erase(line.length() - 1);
+      if (line.length() == 2*hash::kDigestSizes[hash::kSha1])
+        checkpointed_catalogs.insert(hash::Any(hash::kSha1,
+                                               hash::HexPtr(line)));
+    }
+    fclose(f);
+    LogCvmfs(kLogCvmfs, kLogStdout, "Resuming pull, %u catalogs already "
+             "stored", static_cast<unsigned>(checkpointed_catalogs.size()));
+  }
+  fcheckpoint = fopen(GetCheckpointPath().c_str(), "a");
+  if (fcheckpoint == NULL) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to open checkpoint %s",
+             GetCheckpointPath().c_str());
+  }
+}
+
+
+/**
+ * A completed pull does not need the checkpoint anymore.
+ */
+static void CloseCheckpoint(const bool completed) {
+  if (fcheckpoint != NULL) {
+    fclose(fcheckpoint);
+    fcheckpoint = NULL;
+  }
+  if (completed && (state_file != NULL))
+    unlink(GetCheckpointPath().c_str());
 }
 
 
@@ -296,12 +1002,26 @@ int swissknife::CommandPull::Main(const swissknife::ArgumentList &args) {
   }
   stratum0_url = args.find('u')->second;
   temp_dir = args.find('x')->second;
+  if (args.find('s') != args.end())
+    state_file = args.find('s')->second;
+  if (args.find('w') != args.end())
+    status_file = args.find('w')->second;
   spooler = upload::MakeSpoolerEnsemble(*args.find('r')->second);
   assert(spooler);
   backend_stat = upload::GetBackendStat(*args.find('r')->second);
   assert(backend_stat);
+  if (args.find('i') != args.end()) {
+    object_index = upload::ObjectIndex::Open(*args.find('i')->second);
+    if (object_index == NULL) {
+      delete backend_stat;
+      delete spooler;
+      return 1;
+    }
+    backend_stat = new upload::IndexedStat(backend_stat, object_index);
+    spooler->SetObjectIndex(object_index);
+  }
   spooler->set_move_mode(true);
-  spooler->SetCallback(new AbortSpoolerOnError());
+  spooler->SetCallback(new FinishOnCompletion());
   const string master_keys = *args.find('k')->second;
   const string repository_name = *args.find('m')->second;
   if (args.find('n') != args.end())
@@ -326,9 +1046,12 @@ int swissknife::CommandPull::Main(const swissknife::ArgumentList &args) {
   // Initialization
   atomic_init64(&overall_chunks);
   atomic_init64(&overall_new);
-  atomic_init64(&chunk_queue);
-  download::Init(num_parallel+1);
+  atomic_init64(&overall_bytes);
+  atomic_init32(&queued_chunks);
+  download::Init(num_parallel + kNumCatalogWorkers);
   download::SetTimeout(timeout, timeout);
+  // Every worker is a bulk transfer
+  download::SetPrioritySlots(download::kPriorityBulk, num_parallel);
   download::Spawn();
   signature::Init();
   if (!signature::LoadPublicRsaKeys(master_keys)) {
@@ -356,6 +1079,7 @@ int swissknife::CommandPull::Main(const swissknife::ArgumentList &args) {
   }
 
   // Starting threads
+  OpenCheckpoint();
   MakePipe(pipe_chunks);
   LogCvmfs(kLogCvmfs, kLogStdout, "Starting %u workers", num_parallel);
   for (unsigned i = 0; i < num_parallel; ++i) {
@@ -363,8 +1087,7 @@ int swissknife::CommandPull::Main(const swissknife::ArgumentList &args) {
     assert(retval == 0);
   }
 
-  LogCvmfs(kLogCvmfs, kLogStdout, "Replicating from catalog at /");
-  retval = Pull(ensemble.manifest->catalog_hash(), "", true);
+  retval = Pull(ensemble.manifest->catalog_hash(), ReadReplicatedHash());
 
   // Stopping threads
   LogCvmfs(kLogCvmfs, kLogStdout, "Stopping %u workers", num_parallel);
@@ -379,8 +1102,11 @@ int swissknife::CommandPull::Main(const swissknife::ArgumentList &args) {
   }
   ClosePipe(pipe_chunks);
 
-  if (!retval)
+  if (!retval) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "replication incomplete, stored catalogs "
+             "are skipped by the next pull");
     goto fini;
+  }
 
   if (atomic_read64(&overall_retries) > 0) {
     LogCvmfs(kLogCvmfs, kLogStdout, "Overall number of retries: %"PRId64,
@@ -403,16 +1129,24 @@ int swissknife::CommandPull::Main(const swissknife::ArgumentList &args) {
   }
 
   spooler->WaitFor();
+  if (spooler->num_errors() > 0) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to upload manifest ensemble");
+    goto fini;
+  }
+  ReportStatus(true);
   LogCvmfs(kLogCvmfs, kLogStdout, "Fetched %"PRId64" new chunks out of %"
            PRId64" processed chunks",
            atomic_read64(&overall_new), atomic_read64(&overall_chunks));
+  WriteReplicatedHash(ensemble.manifest->catalog_hash());
   result = 0;
 
  fini:
+  CloseCheckpoint(result == 0);
   free(workers);
   signature::Fini();
   download::Fini();
   delete backend_stat;
   delete spooler;
+  delete object_index;
   return result;
 }
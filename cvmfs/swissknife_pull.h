@@ -29,6 +29,11 @@ class CommandPull : public Command {
     result.push_back(Parameter('t', "timeout (s)", true, false));
     result.push_back(Parameter('a', "number of retries", true, false));
     result.push_back(Parameter('p', "pull catalog history, too", true, true));
+    result.push_back(Parameter('s', "replication state file (incremental)",
+                               true, false));
+    result.push_back(Parameter('i', "index of stored objects", true, false));
+    result.push_back(Parameter('w', "status file (throughput and queues)",
+                               true, false));
     return result;
   }
   int Main(const ArgumentList &args);
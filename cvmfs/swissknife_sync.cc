@@ -36,6 +36,7 @@
 #include "logging.h"
 #include "download.h"
 #include "manifest.h"
+#include "compression.h"
 
 using namespace std;  // NOLINT
 
@@ -141,6 +142,26 @@ int swissknife::CommandSync::Main(const swissknife::ArgumentList &args) {
   if (args.find('x') != args.end()) params.print_changeset = true;
   if (args.find('y') != args.end()) params.dry_run = true;
   if (args.find('m') != args.end()) params.mucatalogs = true;
+  if (args.find('p') != args.end())
+    params.chunk_size = String2Uint64(*args.find('p')->second) * 1024*1024;
+  if (args.find('d') != args.end()) params.content_chunking = true;
+  if (args.find('L') != args.end()) params.legacy_bulk_chunks = true;
+  if (args.find('j') != args.end())
+    params.num_workers = String2Uint64(*args.find('j')->second);
+  if (args.find('k') != args.end())
+    params.hash_cache_path = MakeCanonicalPath(*args.find('k')->second);
+  if (args.find('A') != args.end())
+    params.autocatalog_max_entries = String2Uint64(*args.find('A')->second);
+  if (args.find('M') != args.end())
+    params.autocatalog_min_entries = String2Uint64(*args.find('M')->second);
+  else
+    params.autocatalog_min_entries = params.autocatalog_max_entries / 10;
+  if (args.find('B') != args.end()) {
+    params.autocatalog_max_bytes =
+      String2Uint64(*args.find('B')->second) * 1024*1024;
+  }
+  if (args.find('D') != args.end()) params.catalog_deltas = true;
+  if (args.find('F') != args.end()) params.file_bundles = true;
   if (args.find('z') != args.end()) {
     unsigned log_level =
     1 << (kLogLevel0 + String2Uint64(*args.find('z')->second));
@@ -150,16 +171,29 @@ int swissknife::CommandSync::Main(const swissknife::ArgumentList &args) {
     }
     SetLogVerbosity(static_cast<LogLevels>(log_level));
   }
+  zlib::Algorithms compression_algorithm = zlib::kZlibDefault;
+  if (args.find('Z') != args.end()) {
+    const string name = *args.find('Z')->second;
+    if (!zlib::ParseAlgorithm(name, &compression_algorithm) ||
+        !zlib::SetCompressAlgorithm(compression_algorithm))
+    {
+      PrintError("compression algorithm " + name + " not supported");
+      return 1;
+    }
+  }
 
 	if (!CheckParams(&params)) return 2;
 
   // Start spooler
-  params.spooler = upload::MakeSpoolerEnsemble(params.spooler_definition);
+  params.spooler = upload::MakeSpoolerEnsemble(params.spooler_definition,
+                                               params.num_workers);
   download::Init(1);
 
   catalog::WritableCatalogManager
     catalog_manager(hash::Any(hash::kSha1, hash::HexPtr(params.base_hash)),
                     params.stratum0, params.dir_temp, params.spooler);
+  catalog_manager.set_num_snapshot_workers(params.num_workers);
+  catalog_manager.set_emit_deltas(params.catalog_deltas);
   publish::SyncMediator mediator(&catalog_manager, &params);
   publish::SyncUnionAufs sync(&mediator, params.dir_rdonly, params.dir_union,
                               params.dir_scratch);
@@ -174,6 +208,8 @@ int swissknife::CommandSync::Main(const swissknife::ArgumentList &args) {
     PrintError("something went wrong during sync");
     return 4;
   }
+  manifest->set_compression_algorithm(
+    zlib::AlgorithmName(compression_algorithm));
 
   delete params.spooler;
 
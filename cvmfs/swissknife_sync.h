@@ -14,6 +14,15 @@ struct SyncParameters {
     print_changeset = false;
     dry_run = false;
     mucatalogs = false;
+    chunk_size = 0;
+    content_chunking = false;
+    legacy_bulk_chunks = false;
+    num_workers = 1;
+    autocatalog_max_entries = 0;
+    autocatalog_min_entries = 0;
+    autocatalog_max_bytes = 0;
+    catalog_deltas = false;
+    file_bundles = false;
     spooler = NULL;
   }
 
@@ -29,6 +38,17 @@ struct SyncParameters {
 	bool print_changeset;
 	bool dry_run;
 	bool mucatalogs;
+  uint64_t chunk_size;  /**< Files larger than that are split, 0 disables */
+  bool content_chunking;  /**< Chunk boundaries by a rolling hash */
+  bool legacy_bulk_chunks;  /**< Chunked files also as a whole, old clients */
+  unsigned num_workers;  /**< Spooler and catalog snapshot threads */
+  std::string hash_cache_path;  /**< Empty if there is no hash cache */
+  // Automatic catalog partitioning, disabled if both maxima are 0
+  uint64_t autocatalog_max_entries;
+  uint64_t autocatalog_min_entries;
+  uint64_t autocatalog_max_bytes;
+  bool catalog_deltas;  /**< Upload deltas against the previous catalogs */
+  bool file_bundles;  /**< Bundle the small files of a directory */
 };
 
 
@@ -97,8 +117,30 @@ class CommandSync : public Command {
     result.push_back(Parameter('x', "print change set", true, true));
     result.push_back(Parameter('y', "dry run", true, true));
     result.push_back(Parameter('m', "create micro catalogs", true, true));
+    result.push_back(Parameter('p', "chunk size in MB for large files "
+                               "(default: no chunking)", true, false));
+    result.push_back(Parameter('d', "content-defined chunk boundaries, "
+                               "chunks of 1/4 to 4 times -p", true, true));
+    result.push_back(Parameter('L', "publish chunked files also as a whole, "
+                               "for old clients", true, true));
+    result.push_back(Parameter('j', "number of compression and catalog "
+                               "snapshot workers (default: 1)", true, false));
+    result.push_back(Parameter('k', "hash cache file of unchanged files",
+                               true, false));
+    result.push_back(Parameter('A', "split catalogs with more entries "
+                               "(default: never)", true, false));
+    result.push_back(Parameter('M', "merge automatic catalogs with less "
+                               "entries (default: 1/10 of -A)", true, false));
+    result.push_back(Parameter('B', "split catalogs larger than this many MB "
+                               "(default: never)", true, false));
+    result.push_back(Parameter('D', "upload deltas of changed catalogs",
+                               true, true));
+    result.push_back(Parameter('F', "bundle the small files of directories",
+                               true, true));
     result.push_back(Parameter('z', "log level (0-4, default: 2)",
                                true, false));
+    result.push_back(Parameter('Z', "compression algorithm of new objects "
+                               "(zlib, lz4, default: zlib)", true, false));
     return result;
   }
   int Main(const ArgumentList &args);
@@ -0,0 +1,51 @@
+/**
+ * This file is part of the CernVM File System
+ *
+ * This tool converts binary client trace files into csv files.
+ */
+
+#include "cvmfs_config.h"
+#include "swissknife_trace.h"
+
+#include <cstdio>
+
+#include <string>
+
+#include "logging.h"
+#include "tracer.h"
+
+using namespace std;  // NOLINT
+
+
+int swissknife::CommandTrace2Csv::Main(const swissknife::ArgumentList &args) {
+  const string input_path = *args.find('i')->second;
+  string output_path = "";
+  if (args.find('o') != args.end()) output_path = *args.find('o')->second;
+
+  FILE *input = fopen(input_path.c_str(), "r");
+  if (!input) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to open %s", input_path.c_str());
+    return 1;
+  }
+  FILE *output = stdout;
+  if (output_path != "") {
+    output = fopen(output_path.c_str(), "w");
+    if (!output) {
+      LogCvmfs(kLogCvmfs, kLogStderr, "failed to open %s",
+               output_path.c_str());
+      fclose(input);
+      return 1;
+    }
+  }
+
+  int result = 0;
+  if (!tracer::ConvertToCsv(input, output)) {
+    LogCvmfs(kLogCvmfs, kLogStderr, "failed to convert %s, not a binary "
+             "trace file or i/o error", input_path.c_str());
+    result = 1;
+  }
+  fclose(input);
+  if ((output != stdout) && (fclose(output) != 0))
+    result = 1;
+  return result;
+}
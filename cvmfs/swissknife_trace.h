@@ -0,0 +1,32 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_SWISSKNIFE_TRACE_H_
+#define CVMFS_SWISSKNIFE_TRACE_H_
+
+#include "swissknife.h"
+
+namespace swissknife {
+
+class CommandTrace2Csv : public Command {
+ public:
+  ~CommandTrace2Csv() { };
+  std::string GetName() { return "trace2csv"; };
+  std::string GetDescription() {
+    return "Converts a binary trace file of the CernVM-FS client into the csv "
+      "format.";
+  };
+  ParameterList GetParams() {
+    ParameterList result;
+    result.push_back(Parameter('i', "binary trace file", false, false));
+    result.push_back(Parameter('o', "csv output file (default: stdout)",
+                               true, false));
+    return result;
+  }
+  int Main(const ArgumentList &args);
+};
+
+}
+
+#endif  // CVMFS_SWISSKNIFE_TRACE_H_
@@ -0,0 +1,85 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#include "sync_chunking.h"
+
+#include <pthread.h>
+
+#include <cassert>
+
+namespace publish {
+
+static uint64_t gear_table_[256];
+static pthread_once_t gear_once_ = PTHREAD_ONCE_INIT;
+
+/**
+ * Fills the gear table by splitmix64 from a fixed seed.
+ */
+static void InitGearTable() {
+  uint64_t state = 0x63766d66734344ULL;  // "cvmfsCD"
+  for (unsigned i = 0; i < 256; ++i) {
+    state += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    gear_table_[i] = z ^ (z >> 31);
+  }
+}
+
+
+const uint64_t *ChunkDetector::GetGearTable() {
+  pthread_once(&gear_once_, InitGearTable);
+  return gear_table_;
+}
+
+
+/**
+ * The expected chunk size is min_size plus the expected distance between two
+ * hash matches, which is 2^bits for a mask of the upper bits.
+ */
+ChunkDetector::ChunkDetector(const uint64_t min_size, const uint64_t avg_size,
+                             const uint64_t max_size)
+{
+  assert((min_size > 0) && (min_size <= avg_size) && (avg_size <= max_size));
+  min_size_ = min_size;
+  max_size_ = max_size;
+  unsigned bits = 1;
+  while ((bits < 63) && ((uint64_t(1) << (bits + 1)) <= avg_size - min_size))
+    bits++;
+  mask_ = ~uint64_t(0) << (64 - bits);
+  position_ = 0;
+  hash_ = 0;
+}
+
+
+size_t ChunkDetector::FindBoundary(const unsigned char *buffer,
+                                   const size_t size, bool *found)
+{
+  const uint64_t *gear = GetGearTable();
+  *found = false;
+  size_t i = 0;
+
+  // Nothing can end before min_size, the hash needs only the last 64 bytes
+  if (position_ + 64 < min_size_) {
+    const uint64_t skip = min_size_ - 64 - position_;
+    i = (skip < size) ? skip : size;
+    position_ += i;
+  }
+
+  for (; i < size; ++i) {
+    hash_ = (hash_ << 1) + gear[buffer[i]];
+    position_++;
+    if (((position_ >= min_size_) && ((hash_ & mask_) == 0)) ||
+        (position_ >= max_size_))
+    {
+      *found = true;
+      position_ = 0;
+      hash_ = 0;
+      return i + 1;
+    }
+  }
+  return size;
+}
+
+}  // namespace publish
@@ -0,0 +1,51 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Finds the boundaries at which large files are cut into chunks.
+ */
+
+#ifndef CVMFS_SYNC_CHUNKING_H_
+#define CVMFS_SYNC_CHUNKING_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+namespace publish {
+
+/**
+ * Chunk boundaries are either fixed or content-defined.  Content-defined
+ * boundaries are found by a rolling gear hash over the last 64 bytes: a chunk
+ * ends where the hash has its upper bits unset, but not before min_size and
+ * not after max_size bytes.  Because the boundaries depend on the content
+ * only, an insertion or deletion changes only the chunks around it and all
+ * other chunks keep their content hashes.
+ *
+ * With min_size == max_size the chunks have a fixed size.  The gear table is
+ * part of the chunk format; changing it moves all boundaries.
+ */
+class ChunkDetector {
+ public:
+  ChunkDetector(const uint64_t min_size, const uint64_t avg_size,
+                const uint64_t max_size);
+
+  /**
+   * Scans the next bytes of the file.
+   * @param[out] found true if the current chunk ends within buffer
+   * @return the number of bytes of buffer that belong to the current chunk
+   */
+  size_t FindBoundary(const unsigned char *buffer, const size_t size,
+                      bool *found);
+
+ private:
+  static const uint64_t *GetGearTable();
+
+  uint64_t min_size_;
+  uint64_t max_size_;
+  uint64_t mask_;
+  uint64_t position_;  ///< Bytes in the current chunk
+  uint64_t hash_;
+};
+
+}  // namespace publish
+
+#endif  // CVMFS_SYNC_CHUNKING_H_
@@ -0,0 +1,157 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "sync_hash_cache.h"
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include <vector>
+
+#include "logging.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace publish {
+
+HashCache::StatKey::StatKey(const platform_stat64 &info) {
+  device = info.st_dev;
+  inode = info.st_ino;
+  size = info.st_size;
+  mtime_ns = platform_mtime_ns(info);
+}
+
+
+bool HashCache::StatKey::operator <(const StatKey &other) const {
+  if (device != other.device)
+    return device < other.device;
+  if (inode != other.inode)
+    return inode < other.inode;
+  if (size != other.size)
+    return size < other.size;
+  return mtime_ns < other.mtime_ns;
+}
+
+
+/**
+ * Reads the cache file, a missing file is an empty cache.  Lines are either
+ * "s <device> <inode> <size> <mtime_ns> <hash>" or "c <content> <hash>".
+ */
+bool HashCache::Load() {
+  by_stat_.clear();
+  by_content_.clear();
+  FILE *f = fopen(path_.c_str(), "r");
+  if (f == NULL)
+    return !FileExists(path_);
+
+  char buf[256];
+  unsigned num_invalid = 0;
+  while (fgets(buf, sizeof(buf), f)) {
+    string line(buf);
+    if (!line.empty() && (line[line.length()-1] == '\n'))
+      line.erase(line.length()-1);
+    vector<string> fields = SplitString(line, ' ');
+    if ((fields.size() == 6) && (fields[0] == "s") &&
+        (fields[5].length() == 2*hash::kDigestSizes[hash::kSha1]))
+    {
+      StatKey key;
+      key.device = String2Uint64(fields[1]);
+      key.inode = String2Uint64(fields[2]);
+      key.size = String2Uint64(fields[3]);
+      key.mtime_ns = String2Uint64(fields[4]);
+      by_stat_[key] = hash::Any(hash::kSha1, hash::HexPtr(fields[5]));
+    } else if ((fields.size() == 3) && (fields[0] == "c") &&
+               (fields[1].length() == 2*hash::kDigestSizes[hash::kSha1]) &&
+               (fields[2].length() == 2*hash::kDigestSizes[hash::kSha1]))
+    {
+      by_content_[hash::Any(hash::kSha1, hash::HexPtr(fields[1]))] =
+        hash::Any(hash::kSha1, hash::HexPtr(fields[2]));
+    } else {
+      num_invalid++;
+    }
+  }
+  fclose(f);
+  LogCvmfs(kLogPublish, kLogVerboseMsg,
+           "loaded hash cache %s (%u stat entries, %u content entries, "
+           "%u invalid lines)", path_.c_str(),
+           static_cast<unsigned>(by_stat_.size()),
+           static_cast<unsigned>(by_content_.size()), num_invalid);
+  return true;
+}
+
+
+/**
+ * Writes the cache into a temporary file and renames it, so that an aborted
+ * publish leaves the previous cache intact.
+ */
+bool HashCache::Store() const {
+  string tmp_path;
+  FILE *f = CreateTempFile(path_, 0600, "w", &tmp_path);
+  if (f == NULL)
+    return false;
+
+  bool retval = true;
+  if (by_stat_.size() + by_content_.size() <= kMaxEntries) {
+    for (map<StatKey, hash::Any>::const_iterator i = by_stat_.begin(),
+         iEnd = by_stat_.end(); retval && (i != iEnd); ++i)
+    {
+      retval = fprintf(f, "s %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %s\n",
+                       i->first.device, i->first.inode, i->first.size,
+                       i->first.mtime_ns, i->second.ToString().c_str()) > 0;
+    }
+  }
+  unsigned num_content = 0;
+  for (map<hash::Any, hash::Any>::const_iterator i = by_content_.begin(),
+       iEnd = by_content_.end();
+       retval && (i != iEnd) && (num_content < kMaxEntries); ++i)
+  {
+    retval = fprintf(f, "c %s %s\n", i->first.ToString().c_str(),
+                     i->second.ToString().c_str()) > 0;
+    num_content++;
+  }
+  retval = (fclose(f) == 0) && retval;
+  if (!retval || (rename(tmp_path.c_str(), path_.c_str()) != 0)) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+bool HashCache::LookupStat(const platform_stat64 &info,
+                           hash::Any *compressed_hash) const
+{
+  map<StatKey, hash::Any>::const_iterator i = by_stat_.find(StatKey(info));
+  if (i == by_stat_.end())
+    return false;
+  *compressed_hash = i->second;
+  return true;
+}
+
+
+bool HashCache::LookupContent(const hash::Any &content_hash,
+                              hash::Any *compressed_hash) const
+{
+  map<hash::Any, hash::Any>::const_iterator i = by_content_.find(content_hash);
+  if (i == by_content_.end())
+    return false;
+  *compressed_hash = i->second;
+  return true;
+}
+
+
+void HashCache::Insert(const platform_stat64 &info,
+                       const hash::Any &content_hash,
+                       const hash::Any &compressed_hash)
+{
+  by_stat_[StatKey(info)] = compressed_hash;
+  by_content_[content_hash] = compressed_hash;
+}
+
+}  // namespace publish
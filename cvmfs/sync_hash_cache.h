@@ -0,0 +1,70 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A persistent cache of compressed content hashes on the publisher side.
+ * Files that did not change since the last publish, or that were reverted to
+ * a previously published content, are not compressed and uploaded again.
+ */
+
+#ifndef CVMFS_SYNC_HASH_CACHE_H_
+#define CVMFS_SYNC_HASH_CACHE_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include "hash.h"
+#include "platform.h"
+
+namespace publish {
+
+/**
+ * Maps files to the content hash of their compressed object.  Files are
+ * identified either by their stat information (device, inode, size, mtime in
+ * nanoseconds), which costs nothing to look up, or by the SHA-1 of their
+ * uncompressed content, which is much cheaper to compute than the
+ * compression.
+ *
+ * The cache is kept as a text file.  It is not thread-safe.
+ */
+class HashCache {
+ public:
+  explicit HashCache(const std::string &path) : path_(path) { }
+  bool Load();
+  bool Store() const;
+
+  bool LookupStat(const platform_stat64 &info, hash::Any *compressed_hash)
+    const;
+  bool LookupContent(const hash::Any &content_hash,
+                     hash::Any *compressed_hash) const;
+  void Insert(const platform_stat64 &info, const hash::Any &content_hash,
+              const hash::Any &compressed_hash);
+
+  unsigned size() const { return by_content_.size(); }
+
+ private:
+  /**
+   * Limits the size of the cache file, the stat entries are dropped first
+   * since they are likely stale after a publish anyway.
+   */
+  static const unsigned kMaxEntries = 4000000;
+
+  struct StatKey {
+    StatKey() : device(0), inode(0), size(0), mtime_ns(0) { }
+    explicit StatKey(const platform_stat64 &info);
+    bool operator <(const StatKey &other) const;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime_ns;
+  };
+
+  std::string path_;
+  std::map<StatKey, hash::Any> by_stat_;
+  std::map<hash::Any, hash::Any> by_content_;
+};
+
+}  // namespace publish
+
+#endif  // CVMFS_SYNC_HASH_CACHE_H_
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cassert>
 
@@ -17,6 +18,7 @@
 #include "smalloc.h"
 #include "hash.h"
 #include "fs_traversal.h"
+#include "sync_chunking.h"
 #include "util.h"
 
 using namespace std;  // NOLINT
@@ -44,12 +46,41 @@ void PublishFilesCallback::Callback(const std::string &path, int retval,
   hash::Any hash(hash::kSha1, hash::HexPtr(digest));
 
   pthread_mutex_lock(&mediator_->lock_file_queue_);
+  map<string, hash::Any>::iterator iter_content =
+    mediator_->content_hashes_.find(path);
+  map<string, PendingChunk>::iterator iter_chunk =
+    mediator_->chunk_queue_.find(path);
+  if (iter_chunk != mediator_->chunk_queue_.end()) {
+    const PendingChunk &chunk = iter_chunk->second;
+    // Pieces of a file that could not be cut completely are dropped
+    map<string, catalog::FileChunkList>::iterator iter_file =
+      mediator_->chunked_files_.find(chunk.union_path);
+    if (iter_file != mediator_->chunked_files_.end()) {
+      iter_file->second.push_back(
+        catalog::FileChunk(hash, chunk.offset, chunk.size));
+    }
+    mediator_->chunk_queue_.erase(iter_chunk);
+    pthread_mutex_unlock(&mediator_->lock_file_queue_);
+    unlink(path.c_str());
+    return;
+  }
+
   SyncItemList::iterator itr = mediator_->file_queue_.find(path);
   assert(itr != mediator_->file_queue_.end());
   itr->second.SetContentHash(hash);
+  if (iter_content != mediator_->content_hashes_.end()) {
+    mediator_->hash_cache_->Insert(itr->second.GetUnionStat(),
+                                   iter_content->second, hash);
+    mediator_->content_hashes_.erase(iter_content);
+  }
+  const bool is_chunked = (mediator_->chunked_files_.find(path) !=
+                           mediator_->chunked_files_.end());
   pthread_mutex_unlock(&mediator_->lock_file_queue_);
-  mediator_->catalog_manager_->AddFile(itr->second.CreateCatalogDirent(),
-                                       itr->second.relative_parent_path());
+  // Chunked files are added once all their pieces are processed
+  if (!is_chunked) {
+    mediator_->catalog_manager_->AddFile(itr->second.CreateCatalogDirent(),
+                                         itr->second.relative_parent_path());
+  }
 }
 
 
@@ -72,22 +103,16 @@ void PublishHardlinksCallback::Callback(const std::string &path, int retval,
   }
   hash::Any hash(hash::kSha1, hash::HexPtr(digest));
 
-  bool found = false;
-  for (unsigned i = 0; i < mediator_->hardlink_queue_.size(); ++i) {
-    if (mediator_->hardlink_queue_[i].master.GetUnionPath() == path) {
-      found = true;
-      mediator_->hardlink_queue_[i].master.SetContentHash(hash);
-      SyncItemList::iterator j;
-      j = mediator_->hardlink_queue_[i].hardlinks.begin();
-      for (j = mediator_->hardlink_queue_[i].hardlinks.begin();
-           j != mediator_->hardlink_queue_[i].hardlinks.end(); ++j)
-      {
-        j->second.SetContentHash(hash);
-      }
-      break;
-    }
+  map<string, unsigned>::const_iterator index =
+    mediator_->hardlink_index_.find(path);
+  assert(index != mediator_->hardlink_index_.end());
+  HardlinkGroup &group = mediator_->hardlink_queue_[index->second];
+  group.master.SetContentHash(hash);
+  for (SyncItemList::iterator j = group.hardlinks.begin(),
+       jEnd = group.hardlinks.end(); j != jEnd; ++j)
+  {
+    j->second.SetContentHash(hash);
   }
-  assert(found);
 }
 
 
@@ -99,11 +124,33 @@ SyncMediator::SyncMediator(catalog::WritableCatalogManager *catalog_manager,
   int retval = pthread_mutex_init(&lock_file_queue_, NULL);
   assert(retval == 0);
 
+  hash_cache_ = NULL;
+  backend_stat_ = NULL;
+  num_cache_lookups_ = num_cache_hits_ = 0;
+  if (!params->hash_cache_path.empty()) {
+    // Cached objects are only used if they still exist on the backend
+    backend_stat_ = upload::GetBackendStat(params->spooler_definition);
+    hash_cache_ = new HashCache(params->hash_cache_path);
+    if ((backend_stat_ == NULL) || !hash_cache_->Load()) {
+      LogCvmfs(kLogPublish, kLogStderr, "failed to load hash cache %s, "
+               "processing all files", params->hash_cache_path.c_str());
+      delete hash_cache_;
+      hash_cache_ = NULL;
+    }
+  }
+
   params->spooler->SetCallback(new PublishFilesCallback(this));
   LogCvmfs(kLogPublish, kLogStdout, "Processing changes...");
 }
 
 
+SyncMediator::~SyncMediator() {
+  delete hash_cache_;
+  delete backend_stat_;
+  pthread_mutex_destroy(&lock_file_queue_);
+}
+
+
 /**
  * Add an entry to the repository.
  * Added directories will be traversed in order to add the complete subtree.
@@ -208,11 +255,25 @@ manifest::Manifest *SyncMediator::Commit() {
   LogCvmfs(kLogPublish, kLogStdout,
            "Waiting for upload of files before committing...");
   params_->spooler->WaitFor();
+  AddChunkedFiles();
+
+  if (hash_cache_) {
+    LogCvmfs(kLogPublish, kLogStdout, "Hash cache: %"PRIu64" of %"PRIu64
+             " files unchanged (%.1f%%)", num_cache_hits_, num_cache_lookups_,
+             (num_cache_lookups_ == 0) ? 0.0 :
+             100.0 * num_cache_hits_ / num_cache_lookups_);
+    if (!hash_cache_->Store()) {
+      LogCvmfs(kLogPublish, kLogStderr, "failed to store hash cache %s",
+               params_->hash_cache_path.c_str());
+    }
+  }
 
   if (!hardlink_queue_.empty()) {
     LogCvmfs(kLogPublish, kLogStdout, "Processing hardlinks...");
     params_->spooler->UnsetCallback();
     params_->spooler->SetCallback(new PublishHardlinksCallback(this));
+    for (unsigned i = 0; i < hardlink_queue_.size(); ++i)
+      hardlink_index_[hardlink_queue_[i].master.GetUnionPath()] = i;
     for (HardlinkGroupList::const_iterator i = hardlink_queue_.begin(),
          iEnd = hardlink_queue_.end(); i != iEnd; ++i)
     {
@@ -222,14 +283,7 @@ manifest::Manifest *SyncMediator::Commit() {
     }
 
     params_->spooler->WaitFor();
-
-    for (HardlinkGroupList::const_iterator i = hardlink_queue_.begin(),
-         iEnd = hardlink_queue_.end(); i != iEnd; ++i)
-    {
-      LogCvmfs(kLogPublish, kLogVerboseMsg, "Processing hardlink group %s",
-               i->master.GetUnionPath().c_str());
-      AddHardlinkGroup(*i);
-    }
+    AddHardlinkGroups(hardlink_queue_);
   }
 
   params_->spooler->UnsetCallback();
@@ -240,6 +294,19 @@ manifest::Manifest *SyncMediator::Commit() {
     return NULL;
   }
 
+  if (((params_->autocatalog_max_entries > 0) ||
+       (params_->autocatalog_max_bytes > 0)) && !params_->dry_run)
+  {
+    LogCvmfs(kLogPublish, kLogStdout, "Balancing file catalogs...");
+    catalog_manager_->BalanceCatalogs(params_->autocatalog_max_entries,
+                                      params_->autocatalog_min_entries,
+                                      params_->autocatalog_max_bytes);
+  }
+
+  if (params_->file_bundles && !params_->dry_run) {
+    LogCvmfs(kLogPublish, kLogStdout, "Bundling small files...");
+    catalog_manager_->BundleSmallFiles();
+  }
 	catalog_manager_->PrecalculateListings();
 	return catalog_manager_->Commit();
 }
@@ -358,6 +425,7 @@ void SyncMediator::AddDirectoryRecursively(SyncItem &entry) {
 	traversal.fn_new_file = &SyncMediator::AddFileCallback;
 	traversal.fn_new_symlink = &SyncMediator::AddSymlinkCallback;
 	traversal.fn_new_dir_prefix = &SyncMediator::AddDirectoryCallback;
+  traversal.set_num_workers(num_traversal_workers());
 	traversal.Recurse(entry.GetScratchPath());
 }
 
@@ -475,16 +543,222 @@ void SyncMediator::AddFile(SyncItem &entry) {
     catalog_manager_->AddFile(entry.CreateCatalogDirent(),
                               entry.relative_parent_path());
 	} else {
+    if (hash_cache_ && AddFileFromHashCache(entry))
+      return;
+
 	  // Push the file to the spooler, remember the entry for the path
     pthread_mutex_lock(&lock_file_queue_);
     file_queue_[entry.GetUnionPath()] = entry;
     pthread_mutex_unlock(&lock_file_queue_);
-    // Spool the file
+    // Large files are spooled as pieces only, unless old clients need the
+    // whole file, too.  If cutting fails, the file is published as a whole.
+    if (params_->chunk_size > 0 && entry.IsRegularFile() &&
+        (uint64_t(entry.GetUnionStat().st_size) > params_->chunk_size))
+    {
+      if (SpoolChunks(entry)) {
+        if (!params_->legacy_bulk_chunks)
+          return;
+      } else {
+        LogCvmfs(kLogPublish, kLogStderr, "failed to cut %s into chunks, "
+                 "publishing it as a whole", entry.GetUnionPath().c_str());
+      }
+    }
     params_->spooler->SpoolProcess(entry.GetUnionPath(), "data", "");
   }
 }
 
 
+/**
+ * Adds a file straight to the catalogs if the hash cache knows its compressed
+ * object and that object is still stored.  On a miss, the content hash is
+ * remembered so that the spooler callback can fill the cache.
+ * @return true if the file was added, false if it needs to be spooled
+ */
+bool SyncMediator::AddFileFromHashCache(SyncItem &entry) {
+  // Chunked files need the hashes of their pieces, too
+  if (!entry.IsRegularFile() || ((params_->chunk_size > 0) &&
+      (uint64_t(entry.GetUnionStat().st_size) > params_->chunk_size)))
+  {
+    return false;
+  }
+
+  num_cache_lookups_++;
+  const string union_path = entry.GetUnionPath();
+  hash::Any compressed_hash(hash::kSha1);
+  pthread_mutex_lock(&lock_file_queue_);
+  bool found = hash_cache_->LookupStat(entry.GetUnionStat(), &compressed_hash);
+  pthread_mutex_unlock(&lock_file_queue_);
+
+  hash::Any content_hash(hash::kSha1);
+  if (!found) {
+    if (!hash::HashFile(union_path, &content_hash))
+      return false;
+    pthread_mutex_lock(&lock_file_queue_);
+    found = hash_cache_->LookupContent(content_hash, &compressed_hash);
+    pthread_mutex_unlock(&lock_file_queue_);
+  }
+  if (found &&
+      !backend_stat_->Stat("data" + compressed_hash.MakePath(1, 2)))
+  {
+    LogCvmfs(kLogPublish, kLogVerboseMsg, "cached object %s of %s is gone",
+             compressed_hash.ToString().c_str(), union_path.c_str());
+    found = false;
+  }
+
+  if (!found) {
+    if (!content_hash.IsNull()) {
+      pthread_mutex_lock(&lock_file_queue_);
+      content_hashes_[union_path] = content_hash;
+      pthread_mutex_unlock(&lock_file_queue_);
+    }
+    return false;
+  }
+
+  LogCvmfs(kLogPublish, kLogVerboseMsg, "hash cache hit for %s (%s)",
+           union_path.c_str(), compressed_hash.ToString().c_str());
+  num_cache_hits_++;
+  entry.SetContentHash(compressed_hash);
+  catalog_manager_->AddFile(entry.CreateCatalogDirent(),
+                            entry.relative_parent_path());
+  return true;
+}
+
+
+/**
+ * Cuts a large file into pieces in the temporary directory and sends them to
+ * the spooler.  The pieces have chunk_size bytes or, with content-defined
+ * chunking, a quarter to four times chunk_size bytes.  The spooler callback
+ * collects the content hashes of the pieces and removes the temporary files.
+ * With either kind of boundaries, only the pieces are stored; the caller
+ * spools the whole file in addition only for legacy_bulk_chunks.
+ * On failure, the file is no longer considered chunked.
+ */
+bool SyncMediator::SpoolChunks(const SyncItem &entry) {
+  if (SpoolChunkPieces(entry))
+    return true;
+  pthread_mutex_lock(&lock_file_queue_);
+  chunked_files_.erase(entry.GetUnionPath());
+  pthread_mutex_unlock(&lock_file_queue_);
+  return false;
+}
+
+
+bool SyncMediator::SpoolChunkPieces(const SyncItem &entry) {
+  const string union_path = entry.GetUnionPath();
+  LogCvmfs(kLogPublish, kLogVerboseMsg, "cutting %s into %schunks of %"PRIu64
+           " bytes", union_path.c_str(),
+           params_->content_chunking ? "content-defined " : "",
+           params_->chunk_size);
+
+  FILE *fsrc = fopen(union_path.c_str(), "r");
+  if (!fsrc)
+    return false;
+
+  pthread_mutex_lock(&lock_file_queue_);
+  chunked_files_[union_path] = catalog::FileChunkList();
+  pthread_mutex_unlock(&lock_file_queue_);
+
+  const uint64_t avg_size = params_->chunk_size;
+  ChunkDetector detector =
+    params_->content_chunking ?
+    ChunkDetector(std::max(avg_size / 4, uint64_t(1)), avg_size, avg_size * 4) :
+    ChunkDetector(avg_size, avg_size, avg_size);
+  const unsigned kBufferSize = 64*1024;
+  unsigned char buffer[kBufferSize];
+  off_t offset = 0;
+  FILE *fchunk = NULL;
+  string chunk_path;
+  size_t chunk_size = 0;
+  size_t nbytes;
+  while ((nbytes = fread(buffer, 1, kBufferSize, fsrc)) > 0) {
+    size_t pos = 0;
+    while (pos < nbytes) {
+      if (!fchunk) {
+        fchunk = CreateTempFile(params_->dir_temp + "/chunk", 0600, "w",
+                                &chunk_path);
+        if (!fchunk) {
+          fclose(fsrc);
+          return false;
+        }
+        chunk_size = 0;
+      }
+      bool found;
+      const size_t length =
+        detector.FindBoundary(buffer + pos, nbytes - pos, &found);
+      if (fwrite(buffer + pos, 1, length, fchunk) != length) {
+        fclose(fchunk);
+        fclose(fsrc);
+        unlink(chunk_path.c_str());
+        return false;
+      }
+      chunk_size += length;
+      pos += length;
+      if (found) {
+        fclose(fchunk);
+        fchunk = NULL;
+        SpoolChunk(union_path, chunk_path, offset, chunk_size);
+        offset += chunk_size;
+      }
+    }
+  }
+  if (ferror(fsrc)) {
+    if (fchunk) {
+      fclose(fchunk);
+      unlink(chunk_path.c_str());
+    }
+    fclose(fsrc);
+    return false;
+  }
+  if (fchunk) {
+    fclose(fchunk);
+    SpoolChunk(union_path, chunk_path, offset, chunk_size);
+  }
+
+  fclose(fsrc);
+  return true;
+}
+
+
+void SyncMediator::SpoolChunk(const string &union_path,
+                              const string &chunk_path,
+                              const off_t offset, const size_t size)
+{
+  pthread_mutex_lock(&lock_file_queue_);
+  chunk_queue_[chunk_path] = PendingChunk(union_path, offset, size);
+  pthread_mutex_unlock(&lock_file_queue_);
+  params_->spooler->SpoolProcess(chunk_path, "data", "C");
+}
+
+
+static bool ChunkOffsetOrder(const catalog::FileChunk &a,
+                             const catalog::FileChunk &b)
+{
+  return a.offset < b.offset;
+}
+
+
+/**
+ * Adds the chunked files to the catalogs.  All files and pieces have to be
+ * processed by the spooler.  The spooler returns the pieces in any order.
+ */
+void SyncMediator::AddChunkedFiles() {
+  assert(chunk_queue_.empty());
+  for (map<string, catalog::FileChunkList>::iterator i =
+       chunked_files_.begin(), iEnd = chunked_files_.end(); i != iEnd; ++i)
+  {
+    sort(i->second.begin(), i->second.end(), ChunkOffsetOrder);
+    SyncItemList::const_iterator item = file_queue_.find(i->first);
+    assert(item != file_queue_.end());
+    LogCvmfs(kLogPublish, kLogVerboseMsg, "adding %s in %u chunks",
+             i->first.c_str(), i->second.size());
+    catalog_manager_->AddChunkedFile(item->second.CreateCatalogDirent(),
+                                     item->second.relative_parent_path(),
+                                     i->second);
+  }
+  chunked_files_.clear();
+}
+
+
 void SyncMediator::RemoveFile(SyncItem &entry) {
 	if (params_->print_changeset)
     LogCvmfs(kLogPublish, kLogStdout, "[rem] %s", entry.GetUnionPath().c_str());
@@ -541,6 +815,8 @@ void SyncMediator::TouchDirectory(SyncItem &entry) {
  * added to the catalogs.
  */
 void SyncMediator::AddLocalHardlinkGroups(const HardlinkGroupMap &hardlinks) {
+  // Symlinks need no spooling, they are added right away
+  HardlinkGroupList symlink_groups;
 	for (HardlinkGroupMap::const_iterator i = hardlinks.begin(),
        iEnd = hardlinks.end(); i != iEnd; ++i)
   {
@@ -567,23 +843,41 @@ void SyncMediator::AddLocalHardlinkGroups(const HardlinkGroupMap &hardlinks) {
       continue;
 
     if (i->second.master.IsSymlink())
-      AddHardlinkGroup(i->second);
+      symlink_groups.push_back(i->second);
     else
       hardlink_queue_.push_back(i->second);
   }
+  AddHardlinkGroups(symlink_groups);
 }
 
 
-void SyncMediator::AddHardlinkGroup(const HardlinkGroup &group) {
-  // Create a DirectoryEntry list out of the hardlinks
-  catalog::DirectoryEntryList hardlinks;
-  for (SyncItemList::const_iterator i = group.hardlinks.begin(),
-       iEnd = group.hardlinks.end(); i != iEnd; ++i)
-  {
-    hardlinks.push_back(i->second.CreateCatalogDirent());
+/**
+ * Hands the groups over to the catalog manager, consecutive groups of the same
+ * directory in one batch.
+ */
+void SyncMediator::AddHardlinkGroups(const HardlinkGroupList &groups) {
+  vector<catalog::DirectoryEntryList> batch;
+  for (unsigned i = 0; i < groups.size(); ++i) {
+    const HardlinkGroup &group = groups[i];
+    LogCvmfs(kLogPublish, kLogVerboseMsg, "Processing hardlink group %s",
+             group.master.GetUnionPath().c_str());
+
+    // Create a DirectoryEntry list out of the hardlinks
+    batch.push_back(catalog::DirectoryEntryList());
+    for (SyncItemList::const_iterator j = group.hardlinks.begin(),
+         jEnd = group.hardlinks.end(); j != jEnd; ++j)
+    {
+      batch.back().push_back(j->second.CreateCatalogDirent());
+    }
+
+    const string &parent_path = group.master.relative_parent_path();
+    if ((i + 1 == groups.size()) ||
+        (groups[i + 1].master.relative_parent_path() != parent_path))
+    {
+      catalog_manager_->AddHardlinkGroups(&batch, parent_path);
+      batch.clear();
+    }
   }
-  catalog_manager_->AddHardlinkGroup(hardlinks,
-                                     group.master.relative_parent_path());
 }
 
 }  // namespace publish
@@ -18,7 +18,11 @@
  * either on delete or add, it will be treated as nested catalog change.
  *
  * New and modified files are piped to external processes for hashing and
- * compression.  Results come back in a pipe.
+ * compression.  Results come back in a pipe.  Files larger than the chunk size
+ * are cut into pieces that are processed the same way.  The pieces allow
+ * clients to fetch only the parts of a file that are read.
+ * Optionally, a hash cache remembers the compressed content hash of files, so
+ * that unchanged files are not processed again.
  */
 
 #ifndef CVMFS_SYNC_MEDIATOR_H_
@@ -36,6 +40,7 @@
 #include "catalog_mgr_rw.h"
 #include "swissknife_sync.h"
 #include "sync_item.h"
+#include "sync_hash_cache.h"
 
 namespace manifest {
 class Manifest;
@@ -68,6 +73,19 @@ struct HardlinkGroup {
 typedef std::map<uint64_t, HardlinkGroup> HardlinkGroupMap;
 
 
+/**
+ * A piece of a large file that is currently processed by the spooler.
+ */
+struct PendingChunk {
+  PendingChunk() : offset(0), size(0) { }
+  PendingChunk(const std::string &p, const off_t o, const size_t s) :
+    union_path(p), offset(o), size(s) { }
+  std::string union_path;  /**< of the file the piece was cut from */
+  off_t offset;
+  size_t size;
+};
+
+
 /**
  * Callback object for newly added files.  The callback sets the hash.
  */
@@ -106,6 +124,7 @@ class SyncMediator {
  public:
   SyncMediator(catalog::WritableCatalogManager *catalog_manager,
                const SyncParameters *params);
+  ~SyncMediator();
 
   void Add(SyncItem &entry);
   void Touch(SyncItem &entry);
@@ -117,6 +136,11 @@ class SyncMediator {
 
   manifest::Manifest *Commit();
 
+  /**
+   * Threads reading ahead directories while the union file system is traversed
+   */
+  unsigned num_traversal_workers() const { return params_->num_workers; }
+
  private:
   typedef std::stack<HardlinkGroupMap> HardlinkGroupMapStack;
   typedef std::vector<HardlinkGroup> HardlinkGroupList;
@@ -171,7 +195,16 @@ class SyncMediator {
   void InsertHardlink(SyncItem &entry);
 
   void AddLocalHardlinkGroups(const HardlinkGroupMap &hardlinks);
-  void AddHardlinkGroup(const HardlinkGroup &group);
+  void AddHardlinkGroups(const HardlinkGroupList &groups);
+
+  // Large files
+  bool SpoolChunks(const SyncItem &entry);
+  bool SpoolChunkPieces(const SyncItem &entry);
+  void SpoolChunk(const std::string &union_path, const std::string &chunk_path,
+                  const off_t offset, const size_t size);
+  void AddChunkedFiles();
+
+  bool AddFileFromHashCache(SyncItem &entry);
 
   catalog::WritableCatalogManager *catalog_manager_;
   SyncUnion *union_engine_;
@@ -192,6 +225,27 @@ class SyncMediator {
   pthread_mutex_t lock_file_queue_;
 	SyncItemList file_queue_;
 	HardlinkGroupList hardlink_queue_;
+  /**
+   * Position in hardlink_queue_ by union path of the group's master
+   */
+  std::map<std::string, unsigned> hardlink_index_;
+  /**
+   * Pieces of chunked files by the path of their temporary file, and the
+   * processed pieces by union path of the chunked file.  Chunked files are
+   * added to the catalogs in Commit(), once all pieces are processed.
+   */
+  std::map<std::string, PendingChunk> chunk_queue_;
+  std::map<std::string, catalog::FileChunkList> chunked_files_;
+
+  /**
+   * Content hashes of the spooled files by union path, to be entered into the
+   * hash cache together with the compressed hash.  Uses lock_file_queue_.
+   */
+  HashCache *hash_cache_;
+  upload::BackendStat *backend_stat_;
+  std::map<std::string, hash::Any> content_hashes_;
+  uint64_t num_cache_lookups_;
+  uint64_t num_cache_hits_;
 
 	const SyncParameters *params_;
 };  // class SyncMediator
@@ -126,6 +126,7 @@ void SyncUnionAufs::Traverse() {
 	traversal.fn_new_file = &SyncUnionAufs::ProcessRegularFile;
 	traversal.fn_new_dir_prefix = &SyncUnionAufs::ProcessDirectory;
 	traversal.fn_new_symlink = &SyncUnionAufs::ProcessSymlink;
+  traversal.set_num_workers(mediator_->num_traversal_workers());
 
 	traversal.Recurse(scratch_path());
 }
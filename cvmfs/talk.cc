@@ -41,6 +41,17 @@
 #include "shortstring.h"
 #include "lru.h"
 #include "nfs_maps.h"
+#include "prefetch.h"
+#include "page_cache.h"
+#include "prefix_accounting.h"
+#include "fuse_workers.h"
+#include "read_ahead.h"
+#include "warmup.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "manifest_fetch.h"
+#include "notification.h"
+#include "memory_budget.h"
 
 using namespace std;  // NOLINT
 
@@ -70,6 +81,42 @@ static void AnswerStringList(const int con_fd, const vector<string> &list) {
 }
 
 
+/**
+ * Sends a cache listing page by page.  Arguments are "pinned" or "catalogs"
+ * and restrictions of the form min-size=<bytes>, max-size=<bytes>, and
+ * idle=<accesses>.
+ */
+static void AnswerListing(const int con_fd, const string &args) {
+  quota::ListFilter filter;
+  const vector<string> tokens = SplitString(args, ' ');
+  for (unsigned i = 0; i < tokens.size(); ++i) {
+    const string &token = tokens[i];
+    if (token.empty()) {
+      continue;
+    } else if (token == "pinned") {
+      filter.selection = quota::kSelectPinned;
+    } else if (token == "catalogs") {
+      filter.selection = quota::kSelectCatalogs;
+    } else if (token.substr(0, 9) == "min-size=") {
+      filter.min_size = String2Uint64(token.substr(9));
+    } else if (token.substr(0, 9) == "max-size=") {
+      filter.max_size = String2Uint64(token.substr(9));
+    } else if (token.substr(0, 5) == "idle=") {
+      filter.min_idle = String2Uint64(token.substr(5));
+    } else {
+      Answer(con_fd, "Usage: cache list [pinned | catalogs] "
+             "[min-size=<bytes>] [max-size=<bytes>] [idle=<accesses>]\n");
+      return;
+    }
+  }
+
+  quota::ListIterator iter(filter);
+  vector<string> page;
+  while (iter.NextPage(&page))
+    AnswerStringList(con_fd, page);
+}
+
+
 static void *MainTalk(void *data __attribute__((unused))) {
   LogCvmfs(kLogTalk, kLogDebug, "talk thread started");
 
@@ -110,28 +157,32 @@ static void *MainTalk(void *data __attribute__((unused))) {
             StringifyInt(size_unpinned) + " Bytes), pinned: " +
             StringifyInt(size_pinned / (1024*1024)) + "MB (" +
             StringifyInt(size_pinned) + " Bytes)\n";
-          Answer(con_fd, size_str);
-        }
-      } else if (line == "cache list") {
-        if (quota::GetCapacity() == 0) {
-          Answer(con_fd, "Cache is unmanaged\n");
-        } else {
-          vector<string> ls = quota::List();
-          AnswerStringList(con_fd, ls);
-        }
-      } else if (line == "cache list pinned") {
-        if (quota::GetCapacity() == 0) {
-          Answer(con_fd, "Cache is unmanaged\n");
-        } else {
-          vector<string> ls_pinned = quota::ListPinned();
-          AnswerStringList(con_fd, ls_pinned);
+          string repos_str;
+          const vector<quota::RepositoryUsage> repos =
+            quota::GetRepositoryUsage();
+          for (unsigned i = 0; i < repos.size(); ++i) {
+            if (repos[i].name.empty() && (repos[i].size == 0))
+              continue;
+            repos_str += "  " + (repos[i].name.empty() ?
+                                 string("(unknown origin)") : repos[i].name) +
+              ": " + StringifyInt(repos[i].size / (1024*1024)) + "MB";
+            if (repos[i].share > 0)
+              repos_str += ", share " +
+                StringifyInt(repos[i].share / (1024*1024)) + "MB";
+            if (repos[i].guarantee > 0)
+              repos_str += ", guaranteed " +
+                StringifyInt(repos[i].guarantee / (1024*1024)) + "MB";
+            repos_str += "\n";
+          }
+          if (!repos_str.empty())
+            repos_str = "By repository:\n" + repos_str;
+          Answer(con_fd, size_str + repos_str);
         }
-      } else if (line == "cache list catalogs") {
+      } else if (line.substr(0, 10) == "cache list") {
         if (quota::GetCapacity() == 0) {
           Answer(con_fd, "Cache is unmanaged\n");
         } else {
-          vector<string> ls_catalogs = quota::ListCatalogs();
-          AnswerStringList(con_fd, ls_catalogs);
+          AnswerListing(con_fd, (line.length() > 11) ? line.substr(11) : "");
         }
       } else if (line.substr(0, 7) == "cleanup") {
         if (quota::GetCapacity() == 0) {
@@ -176,6 +227,33 @@ static void *MainTalk(void *data __attribute__((unused))) {
             }
           }
         }
+      } else if (line == "cache warmup status") {
+        Answer(con_fd, warmup::GetStatistics());
+      } else if (line == "cache warmup stop") {
+        warmup::Stop();
+        Answer(con_fd, "OK\n");
+      } else if (line.substr(0, 12) == "cache warmup") {
+        const vector<string> args = (line.length() > 13) ?
+          SplitString(line.substr(13), ' ') : vector<string>();
+        vector<string> list_files;
+        for (unsigned i = 1; i < args.size(); ++i) {
+          if (!args[i].empty())
+            list_files.push_back(args[i]);
+        }
+        string error;
+        if (list_files.empty()) {
+          Answer(con_fd, "Usage: cache warmup <threads> <file> [<file> ...]\n");
+        } else if (!warmup::Start(list_files, String2Uint64(args[0]), &error)) {
+          Answer(con_fd, "Failed: " + error + "\n");
+        } else {
+          Answer(con_fd, "OK\n");
+        }
+      } else if (line == "cache report") {
+        if (!prefix_accounting::IsEnabled())
+          Answer(con_fd, "Cache report is disabled\n");
+        else
+          Answer(con_fd, "Cache efficiency by path prefix:\n" +
+                 prefix_accounting::GetStatistics());
       } else if (line == "mountpoint") {
         Answer(con_fd, *cvmfs::mountpoint_ + "\n");
       } else if (line == "remount") {
@@ -220,6 +298,8 @@ static void *MainTalk(void *data __attribute__((unused))) {
         unsigned active_host;
 
         download::GetHostInfo(&host_chain, &rtt, &active_host);
+        vector<int> throughput;
+        download::GetHostThroughput(&throughput);
         string host_str;
         for (unsigned i = 0; i < host_chain.size(); ++i) {
           host_str += "  [" + StringifyInt(i) + "] " + host_chain[i] + " (";
@@ -229,10 +309,18 @@ static void *MainTalk(void *data __attribute__((unused))) {
             host_str += "host down";
           else
             host_str += StringifyInt(rtt[i]) + " ms";
+          if ((i < throughput.size()) && (throughput[i] >= 0))
+            host_str += ", " + StringifyInt(throughput[i]) + " kB/s";
           host_str += ")\n";
         }
         host_str += "Active host " + StringifyInt(active_host) + ": " +
                     host_chain[active_host] + "\n";
+        const unsigned probe_interval = download::GetHostProbeInterval();
+        if (probe_interval > 0) {
+          host_str += "Hosts are probed every " +
+                      StringifyInt(probe_interval) + " seconds\n";
+        }
+        host_str += "Transfers by host:\n" + download::GetHostStatistics();
         Answer(con_fd, host_str);
       } else if (line == "host probe") {
         download::ProbeHosts();
@@ -265,6 +353,10 @@ static void *MainTalk(void *data __attribute__((unused))) {
         } else {
           proxy_str = "No proxies defined\n";
         }
+        const string blocked = download::GetBlockedProxies();
+        if (blocked != "")
+          proxy_str += "Skipped proxies:\n" + blocked;
+        proxy_str += "Transfers by proxy:\n" + download::GetProxyStatistics();
 
         Answer(con_fd, proxy_str);
       } else if (line == "proxy rebalance") {
@@ -306,6 +398,8 @@ static void *MainTalk(void *data __attribute__((unused))) {
           download::SetTimeout(timeout, timeout_direct);
           Answer(con_fd, "OK\n");
         }
+      } else if (line == "memory budget") {
+        Answer(con_fd, memory_budget::GetStatistics());
       } else if (line == "open catalogs") {
         Answer(con_fd, cvmfs::GetOpenCatalogs());
       } else if (line == "internal affairs") {
@@ -317,7 +411,10 @@ static void *MainTalk(void *data __attribute__((unused))) {
         catalog::Statistics catalog_stats;
         string result;
 
+        result += "Startup:\n  " + cvmfs::GetStartupStats();
         result += "File System Call Statistics:\n  " + cvmfs::GetFsStats();
+        result += "Directory Handles:\n  " +
+                  cvmfs::GetDirectoryHandleStats();
 
         cvmfs::GetLruStatistics(&inode_stats, &path_stats, &md5path_stats);
         result += "File Catalog Memory Cache:\n" +
@@ -327,6 +424,17 @@ static void *MainTalk(void *data __attribute__((unused))) {
 
         result += "File Catalogs:\n  " + cvmfs::GetCatalogStatistics().Print();
         result += "Certificate cache:\n  " + cvmfs::GetCertificateStats();
+        result += "Revision notifications:\n  " +
+                  notification::GetStatistics();
+        const manifest::FetchStatistics manifest_stats =
+          manifest::GetFetchStatistics();
+        result += "Manifest:\n  not modified: " +
+          StringifyInt(manifest_stats.num_not_modified) + "    verified: " +
+          StringifyInt(manifest_stats.num_verified) + "    cached: " +
+          StringifyInt(manifest_stats.num_verify_cached) + "\n";
+        if (quota::GetCapacity() > 0)
+          result += "Cache Manager:\n  " + quota::GetMemoryUsage();
+        result += "Memory Budget:\n" + memory_budget::GetStatistics();
 
         result += "Path Strings:\n  instances: " +
           StringifyInt(PathString::num_instances()) + "  overflows: " +
@@ -337,11 +445,30 @@ static void *MainTalk(void *data __attribute__((unused))) {
         result += "Symlink Strings:\n  instances: " +
           StringifyInt(LinkString::num_instances()) + "  overflows: " +
           StringifyInt(LinkString::num_overflows()) + "\n";
+        result += "Long string buffers:\n  allocated: " +
+          StringifyInt(shortstring::num_allocations()) + "  reused: " +
+          StringifyInt(shortstring::num_reuses()) + "\n";
 
         if (cvmfs::nfs_maps_) {
           result += "\nLEVELDB Statistics:\n";
           result += nfs_maps::GetStatistics();
         }
+        if (cvmfs::prefetch_) {
+          result += "Prefetch:\n";
+          result += prefetch::GetStatistics();
+        }
+        if (cvmfs::readahead_) {
+          result += "Read-ahead:\n";
+          result += read_ahead::GetStatistics();
+        }
+        if (cvmfs::pagecache_hints_) {
+          result += "Page cache hints:\n";
+          result += page_cache::GetStatistics();
+        }
+        if (cvmfs::fuse_workers_ > 0) {
+          result += "Fuse workers:\n";
+          result += fuse_workers::GetStatistics();
+        }
 
         result += "SQlite Statistics:\n";
         sqlite3_status(SQLITE_STATUS_MALLOC_COUNT, &current, &highwater, 0);
@@ -380,6 +507,62 @@ static void *MainTalk(void *data __attribute__((unused))) {
                   + " KB\n";
 
         Answer(con_fd, result);
+      } else if (line == "metrics") {
+        MetricsWriter metrics(
+          MetricsWriter::Label("repository", *cvmfs::repository_name_));
+        cvmfs::GetMetrics(&metrics);
+        download::GetMetrics(&metrics);
+        if (quota::GetCapacity() > 0) {
+          metrics.Gauge("quota_capacity_bytes", "Soft limit of the cache",
+                        quota::GetCapacity());
+          metrics.Gauge("quota_size_bytes", "Size of the managed cache",
+                        quota::GetSize());
+          metrics.Gauge("quota_pinned_bytes", "Pinned part of the cache",
+                        quota::GetSizePinned());
+        }
+        if (cvmfs::nfs_maps_)
+          nfs_maps::GetMetrics(&metrics);
+        if (cvmfs::readahead_)
+          read_ahead::GetMetrics(&metrics);
+        if (cvmfs::pagecache_hints_)
+          page_cache::GetMetrics(&metrics);
+        if (cvmfs::fuse_workers_ > 0)
+          fuse_workers::GetMetrics(&metrics);
+        prefix_accounting::GetMetrics(&metrics);
+        tracer::GetMetrics(&metrics);
+        notification::GetMetrics(&metrics);
+        memory_budget::GetMetrics(&metrics);
+        int current;
+        int highwater;
+        sqlite3_status(SQLITE_STATUS_MEMORY_USED, &current, &highwater, 0);
+        metrics.Gauge("sqlite_memory_bytes", "Memory used by SQlite", current);
+        metrics.Counter("monitor_stalls_total",
+                        "Fuse requests outstanding beyond the stall threshold",
+                        monitor::GetNumStalls());
+        const manifest::FetchStatistics manifest_stats =
+          manifest::GetFetchStatistics();
+        metrics.Counter("manifest_not_modified_total",
+                        "Manifest and whitelist requests answered by 304",
+                        manifest_stats.num_not_modified);
+        metrics.Counter("manifest_verifications_total",
+                        "Signature verifications of the manifest ensemble",
+                        manifest_stats.num_verified);
+        metrics.Counter("manifest_verifications_cached_total",
+                        "Verifications skipped for known manifest ensembles",
+                        manifest_stats.num_verify_cached);
+        metrics.Counter("log_async_lost_total",
+                        "Log messages dropped because the log ring was full",
+                        GetLogAsyncLost());
+        Answer(con_fd, metrics.output());
+      } else if (line.substr(0, 13) == "stacks sample") {
+        const unsigned seconds = (line.length() > 14) ?
+          String2Uint64(line.substr(14)) : 5;
+        Answer(con_fd, monitor::SampleStacks(seconds));
+      } else if (line == "latency histograms") {
+        Answer(con_fd, "Fuse Call Latencies:\n" + cvmfs::GetLatencyStats());
+      } else if (line == "reset latency histograms") {
+        cvmfs::ResetLatencyStats();
+        Answer(con_fd, "OK\n");
       } else if (line == "reset error counters") {
         cvmfs::ResetErrorCounters();
         Answer(con_fd, "OK\n");
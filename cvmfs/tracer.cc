@@ -1,17 +1,23 @@
 /**
  * This file is part of the CernVM File System.
  *
- * Tracer is a thread-safe tracing module.  It uses a ring buffer
- * and spawns a helper thread, that flushes the messages onto the disk
- * when necessary.  The output file is in csv format.  Usually tracing
- * a message is a lock-free process, which therefore should have minimal
- * overhead.
+ * Tracer is a thread-safe tracing module.  Every tracing thread gets its own
+ * ring buffer with exactly one writer (the thread) and one reader (the flush
+ * thread), so that tracing a message is a lock-free process with minimal
+ * overhead.  The flush thread collects the pending messages of all buffers,
+ * merges them by time stamp and writes them onto the disk.  The output file is
+ * either in csv format or in a compact binary format, which can be converted
+ * to csv afterwards (cvmfs_swissknife trace2csv).
+ *
+ * If a thread's buffer is full, the thread either waits for the flush thread
+ * or, in drop mode, discards the message.  The number of dropped messages is
+ * recorded in the trace file by an internal message.
  *
  * This is _not_ supposed to be a debugging system.  It is optimized for
  * speed and does not try to gather any additional information (like
  * threadid, status of variables, etc.) and it's in no way "intelligent".
  * But -- most importantly -- if the thing crashes, all messages in the
- * ring buffer go to hell as well.
+ * ring buffers go to hell as well.
  *
  * Csv output is adapted from libcsv.
  *
@@ -23,28 +29,43 @@
 #include "tracer.h"
 
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <cerrno>
 
 #include <string>
+#include <vector>
 
 #include "util.h"
 #include "atomic.h"
+#include "logging.h"
+#include "metrics.h"
 
 using namespace std;  // NOLINT
 
 namespace tracer {
 
+/**
+ * Binary trace files start with this magic string.  It is followed by the
+ * records in native byte order: 64bit seconds, 32bit microseconds, 32bit
+ * code, 16bit path length, 16bit message length, path, message.
+ */
+const char kBinaryMagic[] = "CVMFSTR1";
+const unsigned kBinaryMagicSize = 8;
+const unsigned kBinaryRecordHeaderSize = 8 + 4 + 4 + 2 + 2;
+
 /**
  * Contents of a trace line.
  * \todo memory alignment
  */
 struct BufferEntry {
-  timeval time_stamp;  /**< This is currently with milliseconds precision
+  timeval time_stamp;  /**< This is currently with microseconds precision
                             (using gettimeofday). */
   int code;  /*< arbitrary code, negative codes are reserved for internal
                  use. */
@@ -52,38 +73,36 @@ struct BufferEntry {
   std::string msg;
 };
 
-struct FlushThreadStartData {
-  pthread_cond_t *sig_flush;
-  pthread_cond_t *sig_continue_trace;
-  BufferEntry *ring_buffer;
-  atomic_int32 *commit_buffer;
-  atomic_int32 *seq_no;
-  atomic_int32 *flushed;
-  atomic_int32 *terminate;
-  atomic_int32 *flush_immediately;
-  int size;
-  int threshold;
-  string filename;
+/**
+ * Ring buffer of a single tracing thread.  head and tail only grow, the
+ * position in the ring is taken modulo the buffer size.  Buffers of
+ * terminated threads are handed over to new threads.
+ */
+struct ThreadBuffer {
+  BufferEntry *entries;
+  atomic_int64 head;  /**< Next free slot, written by the owning thread */
+  atomic_int64 tail;  /**< Next unflushed slot, written by the flush thread */
+  atomic_int64 num_dropped;
+  atomic_int32 in_use;
 };
 
 bool active_ = false;
+bool binary_ = false;
+bool drop_on_full_ = false;
 std::string filename_;
 int buffer_size_;
 int flush_threshold_;
-atomic_int32 seq_no_;  /**< Starts with 0 and gets incremented by each call to
-                        trace. Contains the first non-used sequence number. */
-atomic_int32 flushed_;  /**< Starts with 0 and gets incremented by the flush
-                         thread.  Points to the first non-flushed message.
-                         flushed <= seq_no holds. */
+pthread_key_t thread_buffer_key_;
+pthread_mutex_t lock_buffers_;
+vector<ThreadBuffer *> *buffers_;  /**< Protected by lock_buffers_ */
 atomic_int32 terminate_flush_thread_;
 atomic_int32 flush_immediately_;
-BufferEntry *ring_buffer_;
-atomic_int32 *commit_buffer_;  /**< Has the same size as the ring buffer.  If a
-                                message is actually copied to the ring buffer
-                                memory, the respective flag is set to 1.
-                                Flags are reset to 0 by the flush thread. */
+atomic_int64 num_flush_rounds_;  /**< Incremented after each round */
+atomic_int64 num_written_;
+atomic_int64 num_dropped_;
 pthread_t thread_flush_;
 pthread_cond_t sig_flush_;
+pthread_mutex_t sig_flush_mutex_;
 pthread_cond_t sig_continue_trace_;
 pthread_mutex_t sig_continue_trace_mutex_;
 
@@ -105,104 +124,369 @@ static void GetTimespecRel(const int64_t ms, timespec *ts) {
 }
 
 
-static int WriteCsvFile(FILE *fp, const string &field) {
-  if (fp == NULL)
-    return 0;
+static void AppendCsvField(const string &field, string *line) {
+  line->push_back('"');
+  for (unsigned i = 0, l = field.length(); i < l; ++i) {
+    if (field[i] == '"')
+      line->push_back('"');
+    line->push_back(field[i]);
+  }
+  line->push_back('"');
+}
 
-  int retval;
 
-  if ((retval = fputc('"', fp)) != '"')
-    return retval;
+/**
+ * Formats a record as a line of the csv trace file, including the line break.
+ */
+string FormatCsv(const Record &record) {
+  string line;
+  AppendCsvField(StringifyTimeval(record.time_stamp), &line);
+  line.push_back(',');
+  AppendCsvField(StringifyInt(record.code), &line);
+  line.push_back(',');
+  AppendCsvField(record.path, &line);
+  line.push_back(',');
+  AppendCsvField(record.msg, &line);
+  line.append("\r\n");
+  return line;
+}
 
-  for (unsigned i = 0, l = field.length(); i < l; ++i) {
-    if (field[i] == '"') {
-      if ((retval = fputc('"', fp)) != '"')
-        return retval;
+
+/**
+ * Parses a line of a csv trace file, the inverse of FormatCsv().  Lines with
+ * less than three fields are rejected, a missing message is left empty.
+ */
+bool ParseCsv(const string &line, Record *record) {
+  vector<string> fields;
+  string field;
+  bool quoted = false;
+  for (unsigned i = 0; i < line.length(); ++i) {
+    const char c = line[i];
+    if (quoted) {
+      if (c != '"') {
+        field.push_back(c);
+      } else if ((i + 1 < line.length()) && (line[i+1] == '"')) {
+        field.push_back('"');
+        ++i;
+      } else {
+        quoted = false;
+      }
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      fields.push_back(field);
+      field.clear();
+    } else if ((c != '\r') && (c != '\n')) {
+      field.push_back(c);
     }
-    if ((retval = fputc(field[i], fp)) != field[i])
-      return retval;
   }
+  fields.push_back(field);
+  if (fields.size() < 3)
+    return false;
+
+  // Milliseconds with three decimal places
+  const size_t dot = fields[0].find('.');
+  const uint64_t msec = String2Uint64(fields[0].substr(0, dot));
+  const uint64_t usec = (dot == string::npos) ? 0 :
+                        String2Uint64(fields[0].substr(dot + 1));
+  record->time_stamp.tv_sec = msec / 1000;
+  record->time_stamp.tv_usec = (msec % 1000) * 1000 + usec;
+  record->code = String2Int64(fields[1]);
+  record->path = fields[2];
+  record->msg = (fields.size() > 3) ? fields[3] : "";
+  return true;
+}
 
-  if ((retval = fputc('"', fp)) != '"')
-    return retval;
 
-  return 0;
+static void AppendBinary(const Record &record, string *out) {
+  const int64_t sec = record.time_stamp.tv_sec;
+  const int32_t usec = record.time_stamp.tv_usec;
+  const int32_t code = record.code;
+  const uint16_t path_length = std::min(record.path.length(), size_t(0xFFFF));
+  const uint16_t msg_length = std::min(record.msg.length(), size_t(0xFFFF));
+  char header[kBinaryRecordHeaderSize];
+  memcpy(header, &sec, 8);
+  memcpy(header + 8, &usec, 4);
+  memcpy(header + 12, &code, 4);
+  memcpy(header + 16, &path_length, 2);
+  memcpy(header + 18, &msg_length, 2);
+  out->append(header, kBinaryRecordHeaderSize);
+  out->append(record.path.data(), path_length);
+  out->append(record.msg.data(), msg_length);
 }
 
 
-static void *MainFlush(void *data) {
-  FlushThreadStartData *start_data =
-    reinterpret_cast<FlushThreadStartData *>(data);
-  pthread_mutex_t sig_flush_mutex;
-  int retval;
-  retval = pthread_mutex_init(&sig_flush_mutex, NULL);
-  assert(retval == 0 && "Could not initialize mutex for flush signal");
-  retval = pthread_mutex_lock(&sig_flush_mutex);
-  assert(retval == 0 && "Could not lock mutex for flush signal");
-  FILE *f = fopen(start_data->filename.c_str(), "a");
+/**
+ * Consumes the magic string at the beginning of a binary trace file.
+ * @return false if f is not a binary trace file
+ */
+bool ReadBinaryHeader(FILE *f) {
+  char magic[kBinaryMagicSize];
+  return (fread(magic, 1, kBinaryMagicSize, f) == kBinaryMagicSize) &&
+         (memcmp(magic, kBinaryMagic, kBinaryMagicSize) == 0);
+}
+
+
+/**
+ * Reads the next record of a binary trace file.
+ * @return false at the end of the file or on a truncated record
+ */
+bool ReadBinaryRecord(FILE *f, Record *record) {
+  char header[kBinaryRecordHeaderSize];
+  if (fread(header, 1, kBinaryRecordHeaderSize, f) != kBinaryRecordHeaderSize)
+    return false;
+  int64_t sec;
+  int32_t usec;
+  int32_t code;
+  uint16_t path_length;
+  uint16_t msg_length;
+  memcpy(&sec, header, 8);
+  memcpy(&usec, header + 8, 4);
+  memcpy(&code, header + 12, 4);
+  memcpy(&path_length, header + 16, 2);
+  memcpy(&msg_length, header + 18, 2);
+  record->time_stamp.tv_sec = sec;
+  record->time_stamp.tv_usec = usec;
+  record->code = code;
+
+  const unsigned length = path_length + msg_length;
+  if (length == 0) {
+    record->path.clear();
+    record->msg.clear();
+    return true;
+  }
+  vector<char> buf(length);
+  if (fread(&buf[0], 1, length, f) != length)
+    return false;
+  record->path.assign(&buf[0], path_length);
+  record->msg.assign(&buf[0] + path_length, msg_length);
+  return true;
+}
+
+
+/**
+ * Writes the records of a binary trace file as csv lines.  A truncated
+ * last record, e.g. from a crash, is ignored.
+ */
+bool ConvertToCsv(FILE *binary, FILE *csv) {
+  if (!ReadBinaryHeader(binary))
+    return false;
+  Record record;
+  while (ReadBinaryRecord(binary, &record)) {
+    const string line = FormatCsv(record);
+    if (fwrite(line.data(), 1, line.length(), csv) != line.length())
+      return false;
+  }
+  return !ferror(binary);
+}
+
+
+static bool CompareTimeStamp(const Record &a, const Record &b) {
+  if (a.time_stamp.tv_sec != b.time_stamp.tv_sec)
+    return a.time_stamp.tv_sec < b.time_stamp.tv_sec;
+  return a.time_stamp.tv_usec < b.time_stamp.tv_usec;
+}
+
+
+/**
+ * Number of messages in the fullest thread buffer.
+ */
+static int64_t GetMaxPending() {
+  int64_t result = 0;
+  pthread_mutex_lock(&lock_buffers_);
+  for (unsigned i = 0; i < buffers_->size(); ++i) {
+    ThreadBuffer *buffer = (*buffers_)[i];
+    result = std::max(result, atomic_read64(&buffer->head) -
+                              atomic_read64(&buffer->tail));
+  }
+  pthread_mutex_unlock(&lock_buffers_);
+  return result;
+}
+
+
+/**
+ * Opens the trace file in append mode.  An existing trace file keeps its
+ * format.
+ */
+static FILE *OpenTraceFile(bool *binary) {
+  FILE *f = fopen(filename_.c_str(), "a+");
   assert(f != NULL && "Could not open trace file");
+  int retval = fseek(f, 0, SEEK_END);
+  assert(retval == 0 && "Could not seek in trace file");
+  *binary = binary_;
+  if (ftell(f) == 0) {
+    if (binary_) {
+      retval = (fwrite(kBinaryMagic, 1, kBinaryMagicSize, f) !=
+                kBinaryMagicSize);
+      assert(retval == 0 && "Error while writing into trace file");
+    }
+    return f;
+  }
+
+  rewind(f);
+  *binary = ReadBinaryHeader(f);
+  if (*binary != binary_) {
+    LogCvmfs(kLogCvmfs, kLogDebug | kLogSyslog,
+             "existing trace file %s is in %s format, appending in that format",
+             filename_.c_str(), *binary ? "binary" : "csv");
+  }
+  retval = fseek(f, 0, SEEK_END);
+  assert(retval == 0 && "Could not seek in trace file");
+  return f;
+}
+
+
+static void *MainFlush(void *data __attribute__((unused))) {
+  int retval;
+  bool binary;
+  FILE *f = OpenTraceFile(&binary);
   struct timespec timeout;
+  vector<ThreadBuffer *> buffers;
+  vector<Record> records;
+  string out;
 
+  bool terminate;
   do {
-    while ((atomic_read32(start_data->terminate) == 0) &&
-           (atomic_read32(start_data->flush_immediately) == 0) &&
-           (atomic_read32(start_data->seq_no) - atomic_read32(start_data->flushed)
-             <= start_data->threshold))
+    retval = pthread_mutex_lock(&sig_flush_mutex_);
+    assert(retval == 0 && "Could not lock mutex for flush signal");
+    while ((atomic_read32(&terminate_flush_thread_) == 0) &&
+           (atomic_read32(&flush_immediately_) == 0) &&
+           (GetMaxPending() <= flush_threshold_))
     {
       GetTimespecRel(2000, &timeout);
-      retval = pthread_cond_timedwait(start_data->sig_flush,
-                                      &sig_flush_mutex, &timeout);
+      retval = pthread_cond_timedwait(&sig_flush_, &sig_flush_mutex_,
+                                      &timeout);
       assert(retval != EINVAL && "Error while waiting on flush signal");
     }
+    pthread_mutex_unlock(&sig_flush_mutex_);
+    // The last round starts after all messages have been traced
+    terminate = atomic_read32(&terminate_flush_thread_) != 0;
+
+    pthread_mutex_lock(&lock_buffers_);
+    buffers = *buffers_;
+    pthread_mutex_unlock(&lock_buffers_);
+
+    // Collect, thread buffers can be reused right after copying
+    int64_t num_dropped = 0;
+    records.clear();
+    for (unsigned i = 0; i < buffers.size(); ++i) {
+      ThreadBuffer *buffer = buffers[i];
+      const int64_t head = atomic_read64(&buffer->head);
+      for (int64_t seq = atomic_read64(&buffer->tail); seq < head; ++seq) {
+        const BufferEntry &entry = buffer->entries[seq % buffer_size_];
+        Record record;
+        record.time_stamp = entry.time_stamp;
+        record.code = entry.code;
+        record.path = entry.path.ToString();
+        record.msg = entry.msg;
+        records.push_back(record);
+      }
+      atomic_write64(&buffer->tail, head);
+      const int64_t dropped = atomic_read64(&buffer->num_dropped);
+      atomic_xadd64(&buffer->num_dropped, -dropped);
+      num_dropped += dropped;
+    }
+    retval = pthread_cond_broadcast(&sig_continue_trace_);
+    assert(retval == 0 && "Could not signal trace threads");
 
-    int base = atomic_read32(start_data->flushed) % start_data->size;
-    int pos, i = 0;
-    while ((i <= start_data->threshold) &&
-           (atomic_read32(&start_data->commit_buffer[
-             pos = ((base + i) % start_data->size)]) == 1))
-    {
-      string tmp;
-      tmp = StringifyTimeval(start_data->ring_buffer[pos].time_stamp);
-      retval = WriteCsvFile(f, tmp);
-      retval |= fputc(',', f) - ',';
-      tmp = StringifyInt(start_data->ring_buffer[pos].code);
-      retval = WriteCsvFile(f, tmp);
-      retval |= fputc(',', f) - ',';
-      retval |= WriteCsvFile(f, start_data->ring_buffer[pos].path.ToString());
-      retval |= fputc(',', f) - ',';
-      retval |= WriteCsvFile(f, start_data->ring_buffer[pos].msg);
-      retval |= (fputc(13, f) - 13) | (fputc(10, f) - 10);
+    // Merge, every thread buffer by itself is already ordered
+    std::stable_sort(records.begin(), records.end(), CompareTimeStamp);
+    if (num_dropped > 0) {
+      Record record;
+      gettimeofday(&record.time_stamp, NULL);
+      record.code = -4;
+      record.path = "Tracer";
+      record.msg = "dropped " + StringifyInt(num_dropped) + " messages";
+      records.push_back(record);
+    }
+
+    atomic_xadd64(&num_written_, records.size());
+    atomic_xadd64(&num_dropped_, num_dropped);
+    out.clear();
+    for (unsigned i = 0; i < records.size(); ++i) {
+      if (binary)
+        AppendBinary(records[i], &out);
+      else
+        out.append(FormatCsv(records[i]));
+    }
+    if (!out.empty()) {
+      retval = (fwrite(out.data(), 1, out.length(), f) != out.length());
       retval |= fflush(f);
       assert(retval == 0 && "Error while writing into trace file");
-
-      atomic_dec32(&start_data->commit_buffer[pos]);
-      ++i;
     }
-    atomic_xadd32(start_data->flushed, i);
-    atomic_cas32(start_data->flush_immediately, 1, 0);
 
-    retval = pthread_cond_broadcast(start_data->sig_continue_trace);
+    atomic_inc64(&num_flush_rounds_);
+    atomic_cas32(&flush_immediately_, 1, 0);
+    retval = pthread_cond_broadcast(&sig_continue_trace_);
     assert(retval == 0 && "Could not signal trace threads");
-  } while ((atomic_read32(start_data->terminate) == 0) ||
-           (atomic_read32(start_data->flushed) <
-             atomic_read32(start_data->seq_no)));
+  } while (!terminate);
 
   retval = fclose(f);
   assert(retval == 0 && "Could not gracefully close trace file");
-  pthread_mutex_unlock(&sig_flush_mutex);
-  retval = pthread_mutex_destroy(&sig_flush_mutex);
-  assert(retval == 0 && "Could not gracefully destroy mutex for flush signal");
-  delete start_data;
   return NULL;
 }
 
+
+/**
+ * Hands the buffer of a terminating thread over to the next new thread.
+ */
+static void ReleaseThreadBuffer(void *data) {
+  ThreadBuffer *buffer = reinterpret_cast<ThreadBuffer *>(data);
+  atomic_cas32(&buffer->in_use, 1, 0);
+}
+
+
+static ThreadBuffer *GetThreadBuffer() {
+  ThreadBuffer *buffer =
+    reinterpret_cast<ThreadBuffer *>(pthread_getspecific(thread_buffer_key_));
+  if (buffer != NULL)
+    return buffer;
+
+  pthread_mutex_lock(&lock_buffers_);
+  for (unsigned i = 0; i < buffers_->size(); ++i) {
+    if (atomic_cas32(&(*buffers_)[i]->in_use, 0, 1)) {
+      buffer = (*buffers_)[i];
+      break;
+    }
+  }
+  if (buffer == NULL) {
+    buffer = new ThreadBuffer();
+    buffer->entries = new BufferEntry[buffer_size_];
+    atomic_init64(&buffer->head);
+    atomic_init64(&buffer->tail);
+    atomic_init64(&buffer->num_dropped);
+    atomic_init32(&buffer->in_use);
+    atomic_inc32(&buffer->in_use);
+    buffers_->push_back(buffer);
+  }
+  pthread_mutex_unlock(&lock_buffers_);
+
+  int retval = pthread_setspecific(thread_buffer_key_, buffer);
+  assert(retval == 0 && "Could not register trace buffer");
+  return buffer;
+}
+
+
+/**
+ * Selects the output format and the behavior on full buffers.  Only
+ * effective before Init().
+ * @param[in] binary Write the compact binary format instead of csv
+ * @param[in] drop_on_full Discard and count messages of a thread whose buffer
+ *            is full instead of waiting for the flush thread
+ */
+void SetMode(const bool binary, const bool drop_on_full) {
+  binary_ = binary;
+  drop_on_full_ = drop_on_full;
+}
+
+
 /**
  * Initialize module and spawns the helper thread for flushing.
  * @param[in] buffer_size The number of messages that are kept at maximum in the
- *            internal ring buffer.
+ *            ring buffer of every tracing thread.
  * @param[in] flush_threshold Threshold for the flushing thread.  Messages are
- *            flushed when more then t+1 messages are pending in the ring
- *            buffer. 0 <= flush_threshold < buffer_size must hold.
+ *            flushed when more then t+1 messages are pending in any thread's
+ *            ring buffer. 0 <= flush_threshold < buffer_size must hold.
  * @param[in] filename File name of the trace log on the disk.  The file will
  *            be opened in 'a' mode, i.e. messages are appended.
  */
@@ -217,37 +501,28 @@ void Init(const int buffer_size, const int flush_threshold,
   assert(0 <= flush_threshold_ && flush_threshold_ < buffer_size_ &&
          "Invalid threshold");
 
-  atomic_init32(&seq_no_);
-  atomic_init32(&flushed_);
   atomic_init32(&terminate_flush_thread_);
   atomic_init32(&flush_immediately_);
-  ring_buffer_ = new BufferEntry[buffer_size_];
-  commit_buffer_ = new atomic_int32[buffer_size_];
-  for (int i = 0; i < buffer_size_; i++)
-    atomic_init32(&commit_buffer_[i]);
+  atomic_init64(&num_flush_rounds_);
+  atomic_init64(&num_written_);
+  atomic_init64(&num_dropped_);
+  buffers_ = new vector<ThreadBuffer *>();
 
   int retval;
+  retval = pthread_key_create(&thread_buffer_key_, ReleaseThreadBuffer);
+  assert(retval == 0 && "Could not create thread buffer key");
+  retval = pthread_mutex_init(&lock_buffers_, NULL);
+  assert(retval == 0 && "Could not create mutex for thread buffers");
   retval = pthread_cond_init(&sig_continue_trace_, NULL);
   assert(retval == 0 && "Could not create continue-trace signal");
   retval = pthread_mutex_init(&sig_continue_trace_mutex_, NULL);
   assert(retval == 0 && "Could not create mutex for continue-trace signal");
   retval = pthread_cond_init(&sig_flush_, NULL);
   assert(retval == 0 && "Could not create flush signal");
+  retval = pthread_mutex_init(&sig_flush_mutex_, NULL);
+  assert(retval == 0 && "Could not create mutex for flush signal");
 
-  FlushThreadStartData *start_data = new FlushThreadStartData;
-  start_data->sig_flush = &sig_flush_;
-  start_data->sig_continue_trace = &sig_continue_trace_;
-  start_data->ring_buffer = ring_buffer_;
-  start_data->commit_buffer = commit_buffer_;
-  start_data->seq_no = &seq_no_;
-  start_data->flushed = &flushed_;
-  start_data->terminate = &terminate_flush_thread_;
-  start_data->flush_immediately = &flush_immediately_;
-  start_data->size = buffer_size_;
-  start_data->threshold = flush_threshold_;
-  start_data->filename = filename_;
-  retval = pthread_create(&thread_flush_, NULL, MainFlush,
-                          reinterpret_cast<void *> (start_data));
+  retval = pthread_create(&thread_flush_, NULL, MainFlush, NULL);
   assert(retval == 0 && "Could not create flush thread");
 
   TraceInternal(-1, PathString("Tracer", 6), "Trace buffer created");
@@ -264,7 +539,7 @@ void InitNull() {
 
 /**
  * Destroys everything and terminates the flush thread.  Flushes
- * all pending messages from the ring buffer.  Be sure that all trace
+ * all pending messages from the ring buffers.  Be sure that all trace
  * functions have returned before destroying.
  */
 void Fini() {
@@ -287,19 +562,30 @@ void Fini() {
          "Mutex for continue-trace signal could not be destroyed");
   retval = pthread_cond_destroy(&sig_flush_);
   assert(retval == 0 && "Flush signal could not be destroyed");
-
-  delete[] ring_buffer_;
-  delete[] commit_buffer_;
+  retval = pthread_mutex_destroy(&sig_flush_mutex_);
+  assert(retval == 0 && "Mutex for flush signal could not be destroyed");
+  retval = pthread_key_delete(thread_buffer_key_);
+  assert(retval == 0 && "Thread buffer key could not be destroyed");
+  pthread_mutex_destroy(&lock_buffers_);
+
+  for (unsigned i = 0; i < buffers_->size(); ++i) {
+    delete[] (*buffers_)[i]->entries;
+    delete (*buffers_)[i];
+  }
+  delete buffers_;
+  buffers_ = NULL;
+  active_ = false;
 }
 
 
 /**
  * Trace a message.  This is usually a lock-free procedure that just
- * requires two fetch_and_add operations and a gettimeofday syscall.
- * There are two exceptions:
- *   -# If the ring buffer is full, the function blocks until the flush
- *      thread made some space.  Avoid that by carefully choosing size
- *      and threshold.
+ * requires an atomic increment and a gettimeofday syscall.
+ * There are three exceptions:
+ *   -# The first message of a thread registers the thread's buffer.
+ *   -# If the thread's buffer is full, the function blocks until the flush
+ *      thread made some space or, in drop mode, discards the message.  Avoid
+ *      that by carefully choosing size and threshold.
  *   -# If this message reaches the threshold, the flush thread gets
  *      signaled.
  *
@@ -308,19 +594,22 @@ void Fini() {
  *            for internal use.
  * \param[in] id Arbitrary id, for example file name or module name which is
  *            doing the trace.
- * \return The sequence number which was used to trace the record
  */
-int32_t TraceInternal(const int event, const PathString &path,
-                      const string &msg)
+void TraceInternal(const int event, const PathString &path, const char *msg)
 {
-  int32_t my_seq_no = atomic_xadd32(&seq_no_, 1);
+  ThreadBuffer *buffer = GetThreadBuffer();
   timeval now;
   gettimeofday(&now, NULL);
-  int pos = my_seq_no % buffer_size_;
+  const int64_t head = atomic_read64(&buffer->head);
 
-  while (my_seq_no - atomic_read32(&flushed_) >= buffer_size_) {
+  while (head - atomic_read64(&buffer->tail) >= buffer_size_) {
+    int retval = pthread_cond_signal(&sig_flush_);
+    assert(retval == 0 && "Could not signal flush thread");
+    if (drop_on_full_) {
+      atomic_inc64(&buffer->num_dropped);
+      return;
+    }
     timespec timeout;
-    int retval;
     GetTimespecRel(25, &timeout);
     retval = pthread_mutex_lock(&sig_continue_trace_mutex_);
     retval |= pthread_cond_timedwait(&sig_continue_trace_,
@@ -330,32 +619,46 @@ int32_t TraceInternal(const int event, const PathString &path,
            "Error while waiting to continue tracing");
   }
 
-  ring_buffer_[pos].time_stamp = now;
-  ring_buffer_[pos].code = event;
-  ring_buffer_[pos].path = path;
-  ring_buffer_[pos].msg = msg;
-  atomic_inc32(&commit_buffer_[pos]);
+  BufferEntry *entry = &buffer->entries[head % buffer_size_];
+  entry->time_stamp = now;
+  entry->code = event;
+  entry->path = path;
+  entry->msg = msg;
+  atomic_inc64(&buffer->head);
 
-  if (my_seq_no - atomic_read32(&flushed_) == flush_threshold_) {
+  if (head - atomic_read64(&buffer->tail) == flush_threshold_) {
     int err_code __attribute__((unused)) = pthread_cond_signal(&sig_flush_);
     assert(err_code == 0 && "Could not signal flush thread");
   }
+}
 
-  return my_seq_no;
+
+void GetMetrics(MetricsWriter *metrics) {
+  if (!active_) return;
+  metrics->Counter("tracer_written_total", "Messages written to the trace file",
+                   atomic_read64(&num_written_));
+  metrics->Counter("tracer_dropped_total",
+                   "Messages dropped because of full buffers",
+                   atomic_read64(&num_dropped_));
+  pthread_mutex_lock(&lock_buffers_);
+  const int64_t num_buffers = buffers_->size();
+  pthread_mutex_unlock(&lock_buffers_);
+  metrics->Gauge("tracer_buffers", "Per-thread trace buffers", num_buffers);
 }
 
 
 /**
- * Flushes the ring buffer immediately at least up to the current seq_no.
+ * Flushes the ring buffers immediately at least up to the current message.
  * It blocks until the flush thread finished the work.  It does not
  * affect further tracing during its execution.
  */
 void Flush() {
   if (!active_) return;
 
-  int32_t save_seq_no = TraceInternal(-3, PathString("Tracer", 6),
-                                      "flushed ring buffer");
-  while (atomic_read32(&flushed_) <= save_seq_no) {
+  TraceInternal(-3, PathString("Tracer", 6), "flushed ring buffer");
+  // A round in progress might have missed the message, wait for the next one
+  const int64_t target = atomic_read64(&num_flush_rounds_) + 2;
+  while (atomic_read64(&num_flush_rounds_) < target) {
     timespec timeout;
     int retval;
 
@@ -5,10 +5,16 @@
 #ifndef CVMFS_TRACER_H_
 #define CVMFS_TRACER_H_ 1
 
+#include <sys/time.h>
+
+#include <cstdio>
 #include <string>
+
 #include "atomic.h"
 #include "shortstring.h"
 
+class MetricsWriter;
+
 namespace tracer {
 
 extern bool active_;
@@ -24,23 +30,40 @@ enum TraceEvents {
   kFuseCrowd,
 };
 
+/**
+ * A trace line as it is read back from a binary trace file.
+ */
+struct Record {
+  timeval time_stamp;
+  int code;
+  std::string path;
+  std::string msg;
+};
+
 
+void SetMode(const bool binary, const bool drop_on_full);
 void Init(const int buffer_size, const int flush_threshold,
           const std::string &tracefile);
 void InitNull();
 void Fini();
 
-int32_t TraceInternal(const int event, const PathString &path,
-                      const std::string &msg);
+void TraceInternal(const int event, const PathString &path, const char *msg);
 void Flush();
+void GetMetrics(MetricsWriter *metrics);
 void inline __attribute__((used)) Trace(const int event, const PathString &path,
-                                        const std::string &msg)
+                                        const char *msg)
 {
   // TODO: could be done more elegantly by templates
   // (only 1 if when initialized)
   if (active_) TraceInternal(event, path, msg);
 }
 
+bool ReadBinaryHeader(FILE *f);
+bool ReadBinaryRecord(FILE *f, Record *record);
+std::string FormatCsv(const Record &record);
+bool ParseCsv(const std::string &line, Record *record);
+bool ConvertToCsv(FILE *binary, FILE *csv);
+
 }  // namespace tracer
 
 #endif  // CVMFS_TRACER_H_
@@ -4,24 +4,44 @@
  * The Spooler class provides an interface to push files to a storage
  * component.  Copy/Move commands and paths are send via a pipe and the result
  * (e.g. the SHA-1 digest) is received from the spooler via another pipe.
+ *
+ * Requests and replies are binary frames that carry a request id, so that
+ * many requests can be outstanding and the spooler can answer in any order.
+ * A spooler definition can run several spooler processes, requests are
+ * distributed among them by the hash of the local path.
+ *
+ * The upstream storage is either a local directory or an HTTP server that
+ * accepts PUT requests.  In the latter case, the spooler workers keep their
+ * connections open and upload in parallel.
  */
 
+#define __STDC_FORMAT_MACROS
+
 #include "upload.h"
 
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include <cstdio>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 
+#include <map>
+#include <queue>
 #include <vector>
 #include <string>
 
 #include "compression.h"
+#include "hash.h"
 #include "util.h"
 #include "logging.h"
+#include "upload_http.h"
+#include "upload_index.h"
 
 using namespace std;  // NOLINT
 
@@ -37,18 +57,87 @@ enum Commands {
   kCmdMoveFlag = 128,
 };
 
+/**
+ * Bounds the queue of the local spooler workers, so that the spooler does not
+ * read the entire change set ahead.
+ */
+const unsigned kJobsPerWorker = 16;
+
+/**
+ * Requests sent to a spooler process without a reply yet.  Keeps the pipes
+ * from filling up in both directions.
+ */
+const unsigned kMaxOutstanding = 128;
+
+/**
+ * The end of transaction request, all other requests have larger ids.
+ */
+const uint32_t kEndOfTransactionId = 0;
+
+
+/**
+ * Every request and every reply is a frame: the header followed by the
+ * payload fields, each of them a 32bit length and the bytes.  A reply has the
+ * request id and the command of its request.  Both ends run on the same host,
+ * integers are in host byte order.
+ */
+struct FrameHeader {
+  uint32_t payload_size;
+  uint32_t request_id;
+  int32_t result;  ///< 0 on success, only used by replies
+  unsigned char command;
+  unsigned char padding[3];
+};
+
+
+static void WriteFrame(const int fd, const uint32_t request_id,
+                       const unsigned char command, const int32_t result,
+                       const vector<string> &fields)
+{
+  FrameHeader header;
+  memset(&header, 0, sizeof(header));
+  header.request_id = request_id;
+  header.command = command;
+  header.result = result;
+  string payload;
+  for (unsigned i = 0; i < fields.size(); ++i) {
+    const uint32_t length = fields[i].length();
+    payload.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    payload.append(fields[i]);
+  }
+  header.payload_size = payload.length();
+  string frame(reinterpret_cast<const char *>(&header), sizeof(header));
+  frame.append(payload);
+  WritePipe(fd, frame.data(), frame.length());
+}
 
-static bool GetString(FILE *f, std::string *str) {
-  str->clear();
-  do {
-    int retval = getc_unlocked(f);
-    if (retval == EOF)
+
+/**
+ * @return false on end of file or on a malformed frame
+ */
+static bool ReadFrame(FILE *f, FrameHeader *header, vector<string> *fields) {
+  fields->clear();
+  if (fread(header, sizeof(*header), 1, f) != 1)
+    return false;
+  string payload(header->payload_size, '\0');
+  if ((header->payload_size > 0) &&
+      (fread(&payload[0], header->payload_size, 1, f) != 1))
+  {
+    return false;
+  }
+  uint32_t pos = 0;
+  while (pos < payload.length()) {
+    uint32_t length;
+    if (payload.length() - pos < sizeof(length))
       return false;
-    char c = retval;
-    if (c == '\0')
-      return true;
-    str->push_back(c);
-  } while (true);
+    memcpy(&length, payload.data() + pos, sizeof(length));
+    pos += sizeof(length);
+    if (payload.length() - pos < length)
+      return false;
+    fields->push_back(payload.substr(pos, length));
+    pos += length;
+  }
+  return true;
 }
 
 
@@ -58,131 +147,473 @@ bool LocalStat::Stat(const string &path) {
 
 
 /**
- * A simple spooler in case upstream storage is local.
- * Compresses and hashes files and stores them on the upstream path.
+ * Splits the first component of a spooler definition into the driver and the
+ * upstream location, "local:<path>" or an http:// or https:// URL.
+ */
+static bool ParseUpstream(const string &upstream, string *driver,
+                          string *location)
+{
+  const size_t separator = upstream.find(':');
+  if (separator == string::npos)
+    return false;
+  *driver = upstream.substr(0, separator);
+  if (*driver == "local") {
+    *location = upstream.substr(separator + 1);
+    return true;
+  }
+  if ((*driver == "http") || (*driver == "https")) {
+    *location = upstream;
+    return true;
+  }
+  return false;
+}
+
+
+static bool IsHttpUpstream(const string &upstream) {
+  return HasPrefix(upstream, "http://", true) ||
+         HasPrefix(upstream, "https://", true);
+}
+
+
+/**
+ * A command read from the paths pipe, processed by one of the workers of the
+ * local spooler.
+ */
+struct LocalSpoolerJob {
+  uint32_t request_id;
+  unsigned char command;
+  bool move_file;
+  string local_path;
+  string remote_path;  ///< destination directory for kCmdProcess
+  string file_suffix;
+};
+
+
+/**
+ * State shared by the main loop of the local spooler and its workers.  Jobs
+ * are taken from the queue in order but they can finish in any order.  Every
+ * reply carries the request id it belongs to, so that the receiver can match
+ * it.
+ */
+struct LocalSpoolerPool {
+  string upstream_basedir;
+  string upstream_url;  ///< Empty for a local upstream directory
+  HttpStatistics http_statistics;
+  int fd_digests;
+  std::queue<LocalSpoolerJob> jobs;
+  unsigned max_jobs;  ///< Limits the number of queued jobs
+  bool terminate;
+  std::vector<pthread_t> workers;
+  pthread_mutex_t lock_jobs;
+  pthread_cond_t cond_jobs;  ///< Signaled when there is a new job
+  pthread_cond_t cond_space;  ///< Signaled when a job was taken from the queue
+  pthread_mutex_t lock_digests;  ///< Replies must not be interleaved
+  atomic_int64 num_processed;  ///< Files compressed and stored
+  atomic_int64 num_stored;  ///< Thereof incompressible, stored as they are
+};
+
+
+/**
+ * Like ProcessLocalJob but the objects are sent to the HTTP upstream.
+ * Compressed objects are staged in an anonymous temporary file.
+ */
+static int32_t ProcessHttpJob(const LocalSpoolerJob &job,
+                              HttpUploader *uploader,
+                              vector<string> *fields,
+                              zlib::Algorithms *algorithm)
+{
+  int32_t result = 0;
+  switch (job.command) {
+    case kCmdCopy: {
+      LogCvmfs(kLogSpooler, kLogVerboseMsg,
+               "HTTP spooler received 'copy': source %s, dest %s move %d",
+               job.local_path.c_str(), job.remote_path.c_str(),
+               job.move_file);
+      FILE *fsrc = fopen(job.local_path.c_str(), "r");
+      if (fsrc == NULL) {
+        result = 100;
+        break;
+      }
+      result = uploader->Upload(fsrc, job.remote_path);
+      fclose(fsrc);
+      if ((result == 0) && job.move_file)
+        unlink(job.local_path.c_str());
+      break;
+    }
+    case kCmdProcess: {
+      LogCvmfs(kLogSpooler, kLogVerboseMsg,
+               "HTTP spooler received 'process': source %s, dest %s, "
+               "postfix %s, move %d", job.local_path.c_str(),
+               job.remote_path.c_str(), job.file_suffix.c_str(),
+               job.move_file);
+
+      hash::Any compressed_hash(hash::kSha1);
+      FILE *fcas = tmpfile();
+      if (fcas == NULL) {
+        result = 103;
+      } else {
+        int retval = zlib::CompressPath2File(job.local_path, fcas,
+                                             &compressed_hash, algorithm);
+        result = retval ? 0 : 103;
+        if (retval) {
+          result = uploader->Upload(fcas, job.remote_path +
+            compressed_hash.MakePath(1, 2) + job.file_suffix);
+        }
+        fclose(fcas);
+      }
+      if (job.move_file) {
+        if (unlink(job.local_path.c_str()) != 0)
+          result = 105;
+      }
+      fields->push_back(string(reinterpret_cast<const char *>(
+        compressed_hash.digest), compressed_hash.GetDigestSize()));
+      break;
+    }
+    default:
+      LogCvmfs(kLogSpooler, kLogVerboseMsg, "unknown command %d",
+               job.command);
+      result = 1;
+      break;
+  }
+  return result;
+}
+
+
+/**
+ * Compresses and hashes or copies a file.
+ * @param[out] fields the payload of the reply, the raw compressed digest for
+ *             kCmdProcess
+ * @return the result code of the reply
+ */
+static int32_t ProcessLocalJob(const LocalSpoolerJob &job,
+                               const string &upstream_basedir,
+                               HttpUploader *uploader,
+                               vector<string> *fields,
+                               zlib::Algorithms *algorithm)
+{
+  if (uploader)
+    return ProcessHttpJob(job, uploader, fields, algorithm);
+
+  string remote_path;
+  int32_t result = 0;
+  switch (job.command) {
+    case kCmdCopy: {
+      remote_path = upstream_basedir + "/" + job.remote_path;
+      LogCvmfs(kLogSpooler, kLogVerboseMsg,
+               "Default spooler received 'copy': source %s, dest %s move %d",
+               job.local_path.c_str(), remote_path.c_str(), job.move_file);
+      if (job.move_file) {
+        int retval = rename(job.local_path.c_str(), remote_path.c_str());
+        result = (retval == 0) ? 0 : errno;
+      } else {
+        int retval = CopyPath2Path(job.local_path, remote_path);
+        result = retval ? 0 : 100;
+      }
+      break;
+    }
+    case kCmdProcess: {
+      LogCvmfs(kLogSpooler, kLogVerboseMsg,
+               "Default spooler received 'process': source %s, dest %s, "
+               "postfix %s, move %d", job.local_path.c_str(),
+               job.remote_path.c_str(), job.file_suffix.c_str(),
+               job.move_file);
+
+      hash::Any compressed_hash(hash::kSha1);
+      remote_path = upstream_basedir + "/" + job.remote_path;
+      string tmp_path;
+      FILE *fcas = CreateTempFile(remote_path + "/cvmfs", 0777, "w",
+                                  &tmp_path);
+      if (fcas == NULL) {
+        result = 103;
+      } else {
+        int retval = zlib::CompressPath2File(job.local_path, fcas,
+                                             &compressed_hash, algorithm);
+        result = retval ? 0 : 103;
+        fclose(fcas);
+        if (retval) {
+          const string cas_path = remote_path + compressed_hash.MakePath(1, 2)
+                                  + job.file_suffix;
+          retval = rename(tmp_path.c_str(), cas_path.c_str());
+          if (retval != 0) {
+            unlink(tmp_path.c_str());
+            result = 104;
+          }
+        }
+      }
+      if (job.move_file) {
+        if (unlink(job.local_path.c_str()) != 0)
+          result = 105;
+      }
+      fields->push_back(string(reinterpret_cast<const char *>(
+        compressed_hash.digest), compressed_hash.GetDigestSize()));
+      break;
+    }
+    default:
+      LogCvmfs(kLogSpooler, kLogVerboseMsg, "unknown command %d",
+               job.command);
+      result = 1;
+      break;
+  }
+  return result;
+}
+
+
+static void SendLocalResult(LocalSpoolerPool *pool, const LocalSpoolerJob &job,
+                            HttpUploader *uploader)
+{
+  vector<string> fields;
+  zlib::Algorithms algorithm = zlib::kZlibDefault;
+  const int32_t result = ProcessLocalJob(job, pool->upstream_basedir, uploader,
+                                         &fields, &algorithm);
+  if ((result == 0) && (job.command == kCmdProcess)) {
+    atomic_inc64(&pool->num_processed);
+    if (algorithm == zlib::kZlibStored)
+      atomic_inc64(&pool->num_stored);
+  }
+  LogCvmfs(kLogSpooler, kLogVerboseMsg,
+           "Default spooler sends back result %d for request %u (%s)",
+           result, job.request_id, job.local_path.c_str());
+  pthread_mutex_lock(&pool->lock_digests);
+  WriteFrame(pool->fd_digests, job.request_id, job.command, result, fields);
+  pthread_mutex_unlock(&pool->lock_digests);
+}
+
+
+static HttpUploader *MakeUploader(LocalSpoolerPool *pool) {
+  if (pool->upstream_url.empty())
+    return NULL;
+  return new HttpUploader(pool->upstream_url, &pool->http_statistics);
+}
+
+
+static void *MainLocalWorker(void *data) {
+  LocalSpoolerPool *pool = reinterpret_cast<LocalSpoolerPool *>(data);
+  LogCvmfs(kLogSpooler, kLogVerboseMsg, "spooler worker started");
+  HttpUploader *uploader = MakeUploader(pool);
+
+  while (true) {
+    pthread_mutex_lock(&pool->lock_jobs);
+    while (pool->jobs.empty() && !pool->terminate)
+      pthread_cond_wait(&pool->cond_jobs, &pool->lock_jobs);
+    if (pool->jobs.empty()) {
+      pthread_mutex_unlock(&pool->lock_jobs);
+      break;
+    }
+    const LocalSpoolerJob job = pool->jobs.front();
+    pool->jobs.pop();
+    pthread_cond_signal(&pool->cond_space);
+    pthread_mutex_unlock(&pool->lock_jobs);
+
+    SendLocalResult(pool, job, uploader);
+  }
+
+  delete uploader;
+  LogCvmfs(kLogSpooler, kLogVerboseMsg, "spooler worker stopped");
+  return NULL;
+}
+
+
+/**
+ * Without workers, the job is processed right away by the main loop.
+ */
+static void DispatchLocalJob(LocalSpoolerPool *pool,
+                             const LocalSpoolerJob &job,
+                             HttpUploader *uploader)
+{
+  if (pool->workers.empty()) {
+    SendLocalResult(pool, job, uploader);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock_jobs);
+  while (pool->jobs.size() >= pool->max_jobs)
+    pthread_cond_wait(&pool->cond_space, &pool->lock_jobs);
+  pool->jobs.push(job);
+  pthread_cond_signal(&pool->cond_jobs);
+  pthread_mutex_unlock(&pool->lock_jobs);
+}
+
+
+/**
+ * Waits until the workers have drained the queue.
+ */
+static void StopLocalWorkers(LocalSpoolerPool *pool) {
+  pthread_mutex_lock(&pool->lock_jobs);
+  pool->terminate = true;
+  pthread_cond_broadcast(&pool->cond_jobs);
+  pthread_mutex_unlock(&pool->lock_jobs);
+  for (unsigned i = 0; i < pool->workers.size(); ++i)
+    pthread_join(pool->workers[i], NULL);
+  pool->workers.clear();
+}
+
+
+static void PrintProcessStatistics(LocalSpoolerPool *pool) {
+  const int64_t num_processed = atomic_read64(&pool->num_processed);
+  if (num_processed == 0)
+    return;
+  const int64_t num_stored = atomic_read64(&pool->num_stored);
+  LogCvmfs(kLogSpooler, kLogStdout,
+           "Processed %"PRId64" files, %"PRId64" (%.1f%%) stored uncompressed",
+           num_processed, num_stored, 100.0 * num_stored / num_processed);
+}
+
+
+static void PrintHttpStatistics(LocalSpoolerPool *pool,
+                                const struct timeval &start)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  const double elapsed = DiffTimeSeconds(start, now);
+  const double megabytes =
+    double(atomic_read64(&pool->http_statistics.num_bytes)) / (1024 * 1024);
+  LogCvmfs(kLogSpooler, kLogStdout,
+           "Uploaded %"PRId64" objects (%.1f MB, %.1f MB/s), "
+           "%"PRId64" retries, %"PRId64" failures",
+           atomic_read64(&pool->http_statistics.num_uploads), megabytes,
+           (elapsed > 0) ? megabytes / elapsed : 0.0,
+           atomic_read64(&pool->http_statistics.num_retries),
+           atomic_read64(&pool->http_statistics.num_failures));
+}
+
+
+/**
+ * A simple spooler in case upstream storage is local or an HTTP server.
+ * Compresses and hashes files and stores them on the upstream path, or
+ * uploads them to the upstream URL.
+ * With more than one worker, files are processed in parallel and the results
+ * are sent back in the order of completion.  The transaction ack is sent only
+ * after all results.  Large files are compressed with num_workers threads.
  * Meant to be forked.
  */
 int MainLocalSpooler(const string &fifo_paths,
                      const string &fifo_digests,
-                     const string &upstream_basedir)
+                     const string &upstream_basedir,
+                     const unsigned num_workers)
 {
-  FILE *fpaths = fopen(fifo_paths.c_str(), "r");
-  if (!fpaths)
+  int fd_paths = open(fifo_paths.c_str(), O_RDONLY);
+  if (fd_paths < 0)
     return 1;
   LogCvmfs(kLogSpooler, kLogVerboseMsg,
            "Default spooler connected to paths pipe");
   int fd_digests = open(fifo_digests.c_str(), O_WRONLY);
   if (fd_digests < 0) {
-    fclose(fpaths);
+    close(fd_paths);
     return 1;
   }
   LogCvmfs(kLogSpooler, kLogVerboseMsg,
            "Default spooler connected to digests pipe");
+  return MainLocalSpooler(fd_paths, fd_digests, upstream_basedir, num_workers);
+}
+
+
+/**
+ * Runs the local spooler on already connected pipes, takes over the file
+ * descriptors.
+ */
+int MainLocalSpooler(const int fd_paths, const int fd_digests,
+                     const string &upstream_basedir,
+                     const unsigned num_workers)
+{
+  FILE *fpaths = fdopen(fd_paths, "r");
+  if (!fpaths) {
+    close(fd_paths);
+    close(fd_digests);
+    return 1;
+  }
 
-  int retval;
-  while ((retval = getc_unlocked(fpaths)) != EOF) {
-    bool move_file = false;
-    if (retval & kCmdMoveFlag) {
-      retval -= kCmdMoveFlag;
-      move_file = true;
+  zlib::SetCompressThreads(num_workers);
+  LocalSpoolerPool pool;
+  if (IsHttpUpstream(upstream_basedir)) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    pool.upstream_url = upstream_basedir;
+  } else {
+    pool.upstream_basedir = upstream_basedir;
+  }
+  pool.fd_digests = fd_digests;
+  pool.max_jobs = num_workers * kJobsPerWorker;
+  pool.terminate = false;
+  atomic_init64(&pool.num_processed);
+  atomic_init64(&pool.num_stored);
+  int retval = pthread_mutex_init(&pool.lock_jobs, NULL);
+  assert(retval == 0);
+  retval = pthread_mutex_init(&pool.lock_digests, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&pool.cond_jobs, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&pool.cond_space, NULL);
+  assert(retval == 0);
+  for (unsigned i = 0; (num_workers > 1) && (i < num_workers); ++i) {
+    pthread_t worker;
+    retval = pthread_create(&worker, NULL, MainLocalWorker, &pool);
+    assert(retval == 0);
+    pool.workers.push_back(worker);
+  }
+  LogCvmfs(kLogSpooler, kLogVerboseMsg, "Default spooler uses %u workers",
+           static_cast<unsigned>(pool.workers.size()));
+  // For jobs processed by the main loop
+  HttpUploader *uploader = MakeUploader(&pool);
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  bool end_of_transaction = false;
+  FrameHeader header;
+  vector<string> fields;
+  while (ReadFrame(fpaths, &header, &fields)) {
+    LocalSpoolerJob job;
+    job.request_id = header.request_id;
+    job.move_file = false;
+    job.command = header.command;
+    if (job.command & kCmdMoveFlag) {
+      job.command -= kCmdMoveFlag;
+      job.move_file = true;
+    }
+
+    if (job.command == kCmdEndOfTransaction) {
+      end_of_transaction = true;
+      break;
     }
-    unsigned char command = retval;
-
-    string local_path;
-    string remote_path;
-    string remote_dir;
-    string file_suffix;
-    string return_line = "";
-    switch (command) {
-      case kCmdEndOfTransaction:
-        LogCvmfs(kLogSpooler, kLogVerboseMsg,
-                 "Default spooler sends transaction ack back");
-        return_line = "0";
-        return_line.push_back('\0');
-        return_line.push_back('\0');
-        return_line.push_back('\n');
-        WritePipe(fd_digests, return_line.data(), return_line.length());
-        goto tear_down;
+    switch (job.command) {
       case kCmdCopy:
-        GetString(fpaths, &local_path);
-        GetString(fpaths, &remote_path);
-        remote_path = upstream_basedir + "/" + remote_path;
-        LogCvmfs(kLogSpooler, kLogVerboseMsg,
-                 "Default spooler received 'copy': source %s, dest %s move %d",
-                 local_path.c_str(), remote_path.c_str(), move_file);
-        if (move_file) {
-          int retval = rename(local_path.c_str(), remote_path.c_str());
-          return_line = (retval == 0) ? "0" : StringifyInt(errno);
-        } else {
-          int retval = CopyPath2Path(local_path, remote_path);
-          return_line = retval ? "0" : "100";
+        if (fields.size() == 2) {
+          job.local_path = fields[0];
+          job.remote_path = fields[1];
         }
-        return_line.push_back('\0');
-        return_line.append(local_path);
-        return_line.push_back('\0');
-        return_line.push_back('\n');
         break;
-      case kCmdProcess: {
-        GetString(fpaths, &local_path);
-        GetString(fpaths, &remote_dir);
-        GetString(fpaths, &file_suffix);
-        LogCvmfs(kLogSpooler, kLogVerboseMsg,
-                 "Default spooler received 'process': source %s, dest %s, "
-                 "postfix %s, move %d", local_path.c_str(),
-                 remote_dir.c_str(), file_suffix.c_str(), move_file);
-
-        hash::Any compressed_hash(hash::kSha1);
-        remote_path = upstream_basedir + "/" + remote_dir;
-        string tmp_path;
-        FILE *fcas = CreateTempFile(remote_path + "/cvmfs", 0777, "w",
-                                    &tmp_path);
-        if (fcas == NULL) {
-          return_line = "103";
-        } else {
-          int retval = zlib::CompressPath2File(local_path, fcas,
-                                               &compressed_hash);
-          return_line = retval ? "0" : "103";
-          fclose(fcas);
-          if (retval) {
-            const string cas_path = remote_path + compressed_hash.MakePath(1, 2)
-                                    + file_suffix;
-            retval = rename(tmp_path.c_str(), cas_path.c_str());
-            if (retval != 0) {
-              unlink(tmp_path.c_str());
-              return_line = "104";
-            }
-          }
-        }
-        if (move_file) {
-          if (unlink(local_path.c_str()) != 0)
-            return_line = "105";
+      case kCmdProcess:
+        if (fields.size() == 3) {
+          job.local_path = fields[0];
+          job.remote_path = fields[1];
+          job.file_suffix = fields[2];
         }
-        return_line.push_back('\0');
-        return_line.append(local_path);
-        return_line.push_back('\0');
-        return_line.append(compressed_hash.ToString());
-        return_line.push_back('\n');
         break;
-      }
       default:
-        LogCvmfs(kLogSpooler, kLogVerboseMsg, "unknown command %d",
-                 command);
-        return_line = "1";
-        return_line.push_back('\0');
-        return_line.push_back('\0');
-        return_line.push_back('\n');
         break;
     }
+    DispatchLocalJob(&pool, job, uploader);
+  }
+
+  StopLocalWorkers(&pool);
+  delete uploader;
+  PrintProcessStatistics(&pool);
+  if (!pool.upstream_url.empty())
+    PrintHttpStatistics(&pool, start);
+  if (end_of_transaction) {
     LogCvmfs(kLogSpooler, kLogVerboseMsg,
-             "Default spooler sends back result %s",
-             return_line.c_str());
-    WritePipe(fd_digests, return_line.data(), return_line.length());
+             "Default spooler sends transaction ack back");
+    WriteFrame(fd_digests, kEndOfTransactionId, kCmdEndOfTransaction, 0,
+               vector<string>());
   }
 
- tear_down:
   LogCvmfs(kLogSpooler, kLogVerboseMsg, "Default spooler terminates");
+  pthread_cond_destroy(&pool.cond_space);
+  pthread_cond_destroy(&pool.cond_jobs);
+  pthread_mutex_destroy(&pool.lock_digests);
+  pthread_mutex_destroy(&pool.lock_jobs);
   fclose(fpaths);
   close(fd_digests);
+  if (!pool.upstream_url.empty())
+    curl_global_cleanup();
   return 0;
 }
 
@@ -193,58 +624,81 @@ Spooler::Spooler(const string &fifo_paths, const string &fifo_digests) {
   fifo_paths_ = fifo_paths;
   fifo_digests_ = fifo_digests;
   spooler_callback_ = NULL;
-  connected_ = false;
   move_mode_ = false;
-  fd_digests_ = fd_paths_ = -1;
-  fdigests_ = NULL;
+  object_index_ = NULL;
+  next_request_id_ = kEndOfTransactionId + 1;
+  int retval = pthread_mutex_init(&lock_requests_, NULL);
+  assert(retval == 0);
+  retval = pthread_mutex_init(&lock_callback_, NULL);
+  assert(retval == 0);
+  retval = pthread_cond_init(&cond_window_, NULL);
+  assert(retval == 0);
 }
 
 
+/**
+ * Closing the request pipes makes the spooler processes terminate.
+ */
 Spooler::~Spooler() {
-  if (connected_) {
-    close(fd_paths_);
-    fclose(fdigests_);
-    pthread_join(thread_receive_, NULL);
+  for (unsigned i = 0; i < shards_.size(); ++i)
+    close(shards_[i]->fd_requests);
+  for (unsigned i = 0; i < shards_.size(); ++i) {
+    pthread_join(shards_[i]->thread_receive, NULL);
+    fclose(shards_[i]->freplies);
+    pthread_mutex_destroy(&shards_[i]->lock_write);
+    delete shards_[i];
   }
+  pthread_cond_destroy(&cond_window_);
+  pthread_mutex_destroy(&lock_callback_);
+  pthread_mutex_destroy(&lock_requests_);
 }
 
 
-void *Spooler::MainReceive(void *caller) {
-  Spooler *spooler = reinterpret_cast<Spooler *>(caller);
+void *Spooler::MainReceive(void *data) {
+  Shard *shard = reinterpret_cast<Shard *>(data);
+  Spooler *spooler = shard->spooler;
 
   LogCvmfs(kLogSpooler, kLogVerboseMsg, "receiver thread started");
-  string line;
-  string local_path;
-  int result = -1;
-  int retval;
-  while ((retval = getc(spooler->fdigests_)) != EOF) {
-    char next_char = retval;
-
-    if (next_char == '\0') {
-      if (result == -1)
-        result = String2Uint64(line);
-      else
-        local_path = line;
-      line.clear();
-    } else if (next_char == '\n') {
-      LogCvmfs(kLogSpooler, kLogVerboseMsg, "received: %s %d %s",
-               local_path.c_str(), result, line.c_str());
-      if (result != 0)
-        atomic_inc64(&spooler->num_errors_);
-      if (spooler->spooler_callback())
-        spooler->spooler_callback()->Callback(local_path, result, line);
-      atomic_dec64(&(spooler->num_pending_));
-
-      // End of transaction
-      if (local_path.empty())
-        break;
-
-      result = -1;
-      local_path.clear();
-      line.clear();
-    } else {
-      line.push_back(next_char);
+  FrameHeader header;
+  vector<string> fields;
+  while (ReadFrame(shard->freplies, &header, &fields)) {
+    Request request;
+    request.command = kCmdEndOfTransaction;
+    pthread_mutex_lock(&spooler->lock_requests_);
+    map<uint32_t, Request>::iterator iter =
+      spooler->requests_.find(header.request_id);
+    if (iter != spooler->requests_.end()) {
+      request = iter->second;
+      spooler->requests_.erase(iter);
+    }
+    shard->num_outstanding--;
+    pthread_cond_broadcast(&spooler->cond_window_);
+    pthread_mutex_unlock(&spooler->lock_requests_);
+
+    string digest;
+    if ((fields.size() == 1) &&
+        (fields[0].length() == hash::kDigestSizes[hash::kSha1]))
+    {
+      digest = hash::Any(hash::kSha1,
+        reinterpret_cast<const unsigned char *>(fields[0].data()),
+        fields[0].length()).ToString();
     }
+    const string local_path =
+      request.fields.empty() ? "" : request.fields[0];
+    if ((header.result == 0) && spooler->object_index_)
+      spooler->IndexObject(request, digest);
+    LogCvmfs(kLogSpooler, kLogVerboseMsg, "received: %s %d %s",
+             local_path.c_str(), header.result, digest.c_str());
+    if (header.result != 0)
+      atomic_inc64(&spooler->num_errors_);
+    pthread_mutex_lock(&spooler->lock_callback_);
+    if (spooler->spooler_callback())
+      spooler->spooler_callback()->Callback(local_path, header.result, digest);
+    pthread_mutex_unlock(&spooler->lock_callback_);
+    atomic_dec64(&(spooler->num_pending_));
+
+    if (header.request_id == kEndOfTransactionId)
+      break;
   }
   LogCvmfs(kLogSpooler, kLogVerboseMsg, "receiver thread stopped");
 
@@ -252,67 +706,133 @@ void *Spooler::MainReceive(void *caller) {
 }
 
 
+/**
+ * Connects to the spooler process listening on the named pipes.
+ */
 bool Spooler::Connect() {
-  fd_paths_ = open(fifo_paths_.c_str(), O_WRONLY);
-  if (fd_paths_ < 0)
+  int fd_requests = open(fifo_paths_.c_str(), O_WRONLY);
+  if (fd_requests < 0)
     return false;
   LogCvmfs(kLogSpooler, kLogVerboseMsg, "connected to paths pipe (write)");
 
-  fd_digests_ = open(fifo_digests_.c_str(), O_RDONLY);
-  if (fd_digests_ < 0) {
-    close(fd_paths_);
-    fd_paths_ = -1;
+  int fd_replies = open(fifo_digests_.c_str(), O_RDONLY);
+  if (fd_replies < 0) {
+    close(fd_requests);
     return false;
   }
-  fdigests_ = fdopen(fd_digests_, "r");
-  assert(fdigests_);
   LogCvmfs(kLogSpooler, kLogVerboseMsg, "connected to digests pipe (read)");
+  return Connect(fd_requests, fd_replies);
+}
 
-  // Start reveiver thread
-  int retval = pthread_create(&thread_receive_, NULL, MainReceive, this);
+
+/**
+ * Adds another spooler process, takes over the file descriptors.
+ */
+bool Spooler::Connect(const int fd_requests, const int fd_replies) {
+  Shard *shard = new Shard();
+  shard->spooler = this;
+  shard->fd_requests = fd_requests;
+  shard->freplies = fdopen(fd_replies, "r");
+  assert(shard->freplies);
+  shard->num_outstanding = 0;
+  int retval = pthread_mutex_init(&shard->lock_write, NULL);
   assert(retval == 0);
 
-  connected_ = true;
+  // Start reveiver thread
+  retval = pthread_create(&shard->thread_receive, NULL, MainReceive, shard);
+  assert(retval == 0);
+  shards_.push_back(shard);
   return true;
 }
 
 
+/**
+ * Picks the spooler process by the hash of the local path and waits for its
+ * window of outstanding requests to open.
+ */
+void Spooler::SendRequest(const unsigned char command,
+                          const vector<string> &fields)
+{
+  assert(!shards_.empty() && !fields.empty());
+  uint64_t high, low;
+  hash::Md5(hash::AsciiPtr(fields[0])).ToIntPair(&high, &low);
+  Shard *shard = shards_[low % shards_.size()];
+
+  pthread_mutex_lock(&lock_requests_);
+  while (shard->num_outstanding >= kMaxOutstanding)
+    pthread_cond_wait(&cond_window_, &lock_requests_);
+  const uint32_t request_id = next_request_id_++;
+  if (next_request_id_ == kEndOfTransactionId)
+    next_request_id_++;
+  Request &request = requests_[request_id];
+  request.command = command & ~kCmdMoveFlag;
+  request.fields = fields;
+  shard->num_outstanding++;
+  atomic_inc64(&num_pending_);
+  pthread_mutex_unlock(&lock_requests_);
+
+  // Not under lock_requests_ because the pipe can block until the spooler
+  // catches up, which requires the receiver threads
+  pthread_mutex_lock(&shard->lock_write);
+  WriteFrame(shard->fd_requests, request_id, command, 0, fields);
+  pthread_mutex_unlock(&shard->lock_write);
+}
+
+
+/**
+ * Enters the remote path of a stored object into the object index.
+ */
+void Spooler::IndexObject(const Request &request, const string &digest) {
+  if ((request.command == kCmdCopy) && (request.fields.size() == 2)) {
+    object_index_->Insert(request.fields[1]);
+  } else if ((request.command == kCmdProcess) &&
+             (request.fields.size() == 3) && !digest.empty())
+  {
+    const hash::Any compressed_hash(hash::kSha1, hash::HexPtr(digest));
+    object_index_->Insert(request.fields[1] + compressed_hash.MakePath(1, 2) +
+                          request.fields[2]);
+  }
+}
+
+
 void Spooler::SpoolProcess(const string &local_path, const string &remote_dir,
                            const string &file_postfix)
 {
-  string line = "";
   unsigned char command = kCmdProcess;
   if (move_mode_) command |= kCmdMoveFlag;
-  line.push_back(command);
-  line.append(local_path);
-  line.push_back('\0');
-  line.append(remote_dir);
-  line.push_back('\0');
-  line.append(file_postfix);
-  line.push_back('\0');
-  WritePipe(fd_paths_, line.data(), line.size());
-  atomic_inc64(&num_pending_);
+  vector<string> fields;
+  fields.push_back(local_path);
+  fields.push_back(remote_dir);
+  fields.push_back(file_postfix);
+  SendRequest(command, fields);
 }
 
 
 void Spooler::SpoolCopy(const string &local_path, const string &remote_path) {
-  string line = "";
   unsigned char command = kCmdCopy;
   if (move_mode_) command |= kCmdMoveFlag;
-  line.push_back(command);
-  line.append(local_path);
-  line.push_back('\0');
-  line.append(remote_path);
-  line.push_back('\0');
-  WritePipe(fd_paths_, line.data(), line.size());
-  atomic_inc64(&num_pending_);
+  vector<string> fields;
+  fields.push_back(local_path);
+  fields.push_back(remote_path);
+  SendRequest(command, fields);
 }
 
 
+/**
+ * Every spooler process acknowledges the end of the transaction once its
+ * requests are processed.
+ */
 void Spooler::EndOfTransaction() {
-  char command = kCmdEndOfTransaction;
-  WritePipe(fd_paths_, &command, 1);
-  atomic_inc64(&num_pending_);
+  for (unsigned i = 0; i < shards_.size(); ++i) {
+    pthread_mutex_lock(&lock_requests_);
+    shards_[i]->num_outstanding++;
+    atomic_inc64(&num_pending_);
+    pthread_mutex_unlock(&lock_requests_);
+    pthread_mutex_lock(&shards_[i]->lock_write);
+    WriteFrame(shards_[i]->fd_requests, kEndOfTransactionId,
+               kCmdEndOfTransaction, 0, vector<string>());
+    pthread_mutex_unlock(&shards_[i]->lock_write);
+  }
 }
 
 
@@ -322,42 +842,83 @@ void Spooler::WaitFor() {
 }
 
 
-Spooler *MakeSpoolerEnsemble(const std::string &spooler_definition) {
+/**
+ * The first spooler process uses the named pipes of the definition, the
+ * others are connected by anonymous pipes.
+ */
+Spooler *MakeSpoolerEnsemble(const std::string &spooler_definition,
+                             const unsigned num_workers)
+{
   string upstream_driver;
   string upstream_path;
   string paths_out;
   string digests_in;
+  unsigned num_processes = 1;
 
   vector<string> components = SplitString(spooler_definition, ',');
-  if (components.size() != 3) {
+  if ((components.size() != 3) && (components.size() != 4)) {
     PrintError("Invalid spooler definition");
     return NULL;
   }
-  vector<string> upstream = SplitString(components[0], ':');
-  if ((upstream.size() != 2) || (upstream[0] != "local")) {
+  if (!ParseUpstream(components[0], &upstream_driver, &upstream_path)) {
     PrintError("Invalid spooler driver");
     return NULL;
   }
-  upstream_driver = upstream[0];
-  upstream_path = upstream[1];
   paths_out = components[1];
   digests_in = components[2];
+  if (components.size() == 4) {
+    num_processes = String2Uint64(components[3]);
+    if (num_processes == 0) {
+      PrintError("Invalid number of spooler processes");
+      return NULL;
+    }
+  }
 
   int pid = fork();
   assert(pid >= 0);
   if (pid == 0) {
-    int retval = 1;
-    if (upstream_driver == "local")
-      retval = upload::MainLocalSpooler(paths_out, digests_in, upstream_path);
+    int retval = upload::MainLocalSpooler(paths_out, digests_in,
+                                          upstream_path, num_workers);
     exit(retval);
   }
 
+  // The parent's ends of the anonymous pipes, children must not keep them
+  vector<int> fd_requests;
+  vector<int> fd_replies;
+  for (unsigned i = 1; i < num_processes; ++i) {
+    int pipe_requests[2];
+    int pipe_replies[2];
+    MakePipe(pipe_requests);
+    MakePipe(pipe_replies);
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      for (unsigned j = 0; j < fd_requests.size(); ++j) {
+        close(fd_requests[j]);
+        close(fd_replies[j]);
+      }
+      close(pipe_requests[1]);
+      close(pipe_replies[0]);
+      int retval = upload::MainLocalSpooler(pipe_requests[0], pipe_replies[1],
+                                            upstream_path, num_workers);
+      exit(retval);
+    }
+    close(pipe_requests[0]);
+    close(pipe_replies[1]);
+    fd_requests.push_back(pipe_requests[1]);
+    fd_replies.push_back(pipe_replies[0]);
+  }
+
   Spooler *spooler = new Spooler(paths_out, digests_in);
   bool retval = spooler->Connect();
   if (!retval) {
     PrintError("Failed to connect to spooler");
     return NULL;
   }
+  for (unsigned i = 0; i < fd_requests.size(); ++i)
+    spooler->Connect(fd_requests[i], fd_replies[i]);
+  LogCvmfs(kLogSpooler, kLogVerboseMsg, "started %u spooler processes",
+           num_processes);
 
   return spooler;
 }
@@ -365,12 +926,16 @@ Spooler *MakeSpoolerEnsemble(const std::string &spooler_definition) {
 
 BackendStat *GetBackendStat(const string &spooler_definition) {
   vector<string> components = SplitString(spooler_definition, ',');
-  vector<string> upstream = SplitString(components[0], ':');
-  if ((upstream.size() != 2) || (upstream[0] != "local")) {
+  string driver;
+  string location;
+  if (!ParseUpstream(components[0], &driver, &location)) {
     PrintError("Invalid upstream");
     return NULL;
   }
-  return new LocalStat(upstream[1]);
+  if (driver == "local")
+    return new LocalStat(location);
+  curl_global_init(CURL_GLOBAL_ALL);
+  return new HttpStat(location);
 }
 
 }  // namespace upload
@@ -10,7 +10,9 @@
 #include <unistd.h>
 
 #include <cstdio>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "atomic.h"
 
@@ -22,6 +24,17 @@ class BackendStat {
   BackendStat(const std::string &base_path) { base_path_ = base_path; }
   virtual ~BackendStat() { }
   virtual bool Stat(const std::string &path) = 0;
+  /**
+   * Checks a batch of paths, backends with a high latency overwrite it to
+   * check in parallel.
+   */
+  virtual void StatMany(const std::vector<std::string> &paths,
+                        std::vector<bool> *results)
+  {
+    results->resize(paths.size());
+    for (unsigned i = 0; i < paths.size(); ++i)
+      (*results)[i] = Stat(paths[i]);
+  }
  protected:
   std::string base_path_;
 };
@@ -38,6 +51,7 @@ class LocalStat : public BackendStat {
  * Encapsulates the callback function that handles responses from the external
  * Spooler.
  */
+class ObjectIndex;
 class SpoolerCallback {
  public:
   virtual void Callback(const std::string &path, int retval,
@@ -49,16 +63,19 @@ class SpoolerCallback {
 /**
  * Notifies the external spooler about files that are supposed to be uploaded to
  * the upstream storage.
- * Collects the results.  Files should only be sent once to the spooler,
- * otherwise there is no way to distinguish the results.
- * Internally, input and output work with two named pipes.
- * The callback function is called from a parallel thread.
+ * Collects the results.  Requests carry an id, so that up to kMaxOutstanding
+ * of them can be in flight per spooler process and answered in any order.
+ * Internally, input and output of every spooler process work with two pipes,
+ * named pipes for the first one.  Requests are distributed among the spooler
+ * processes by the hash of the local path.
+ * The callback function is called from parallel threads, one at a time.
  */
 class Spooler {
  public:
   Spooler(const std::string &fifo_paths, const std::string &fifo_digests);
   ~Spooler();
   bool Connect();
+  bool Connect(const int fd_requests, const int fd_replies);
   void SetCallback(SpoolerCallback *value) { spooler_callback_ = value; }
   void UnsetCallback() { delete spooler_callback_; spooler_callback_ = NULL; }
   SpoolerCallback *spooler_callback() { return spooler_callback_; }
@@ -69,37 +86,73 @@ class Spooler {
   void EndOfTransaction();
 
   void set_move_mode(const bool mode) { move_mode_ = mode; }
+  /**
+   * Successfully stored objects are entered into the index (not owned).
+   */
+  void SetObjectIndex(ObjectIndex *value) { object_index_ = value; }
 
   bool IsIdle() { return atomic_read64(&num_pending_) == 0; }
   void WaitFor();
   uint64_t num_errors() { return atomic_read64(&num_errors_); }
 
  private:
-  static void *MainReceive(void *caller);
+  /**
+   * Connection to one spooler process
+   */
+  struct Shard {
+    Spooler *spooler;
+    int fd_requests;
+    FILE *freplies;
+    unsigned num_outstanding;  ///< Protected by lock_requests_
+    pthread_mutex_t lock_write;  ///< Frames must not be interleaved
+    pthread_t thread_receive;
+  };
+
+  /**
+   * An outstanding request
+   */
+  struct Request {
+    unsigned char command;
+    std::vector<std::string> fields;  ///< The first one is the local path
+  };
+
+  static void *MainReceive(void *data);
+  void IndexObject(const Request &request, const std::string &digest);
+  void SendRequest(const unsigned char command,
+                   const std::vector<std::string> &fields);
 
   atomic_int64 num_pending_;
   atomic_int64 num_errors_;
   std::string fifo_paths_;
   std::string fifo_digests_;
   SpoolerCallback *spooler_callback_;
-  bool connected_;
   bool move_mode_;
-  int fd_paths_;
-  int fd_digests_;
-  FILE *fdigests_;
-  pthread_t thread_receive_;
+  std::vector<Shard *> shards_;
+  ObjectIndex *object_index_;
+  std::map<uint32_t, Request> requests_;
+  uint32_t next_request_id_;
+  pthread_mutex_t lock_requests_;
+  pthread_cond_t cond_window_;  ///< Signaled when a reply arrives
+  pthread_mutex_t lock_callback_;
 };
 
 
 int MainLocalSpooler(const std::string &fifo_paths,
                      const std::string &fifo_digests,
-                     const std::string &upstream_basedir);
+                     const std::string &upstream_basedir,
+                     const unsigned num_workers);
+int MainLocalSpooler(const int fd_paths, const int fd_digests,
+                     const std::string &upstream_basedir,
+                     const unsigned num_workers);
 
 /**
- * Starts a spooler process and the creates the corresponding object
+ * Starts spooler processes and the creates the corresponding object
  * from a definition string like "local:/dir/to/repo,/path/pipe,/digest/pipe"
+ * An optional fourth component sets the number of spooler processes.
+ * Every spooler process compresses files with num_workers threads.
  */
-Spooler *MakeSpoolerEnsemble(const std::string &spooler_definition);
+Spooler *MakeSpoolerEnsemble(const std::string &spooler_definition,
+                             const unsigned num_workers = 1);
 BackendStat *GetBackendStat(const std::string &spooler_definition);
 
 }  // namespace upload
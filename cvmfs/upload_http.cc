@@ -0,0 +1,187 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "upload_http.h"
+
+#include <inttypes.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdlib>
+
+#include "logging.h"
+
+using namespace std;  // NOLINT
+
+namespace upload {
+
+HttpUploader::HttpUploader(const string &base_url,
+                           HttpStatistics *statistics)
+{
+  base_url_ = base_url;
+  statistics_ = statistics;
+  curl_ = curl_easy_init();
+  assert(curl_);
+  // Saves a round trip per object
+  headers_ = curl_slist_append(NULL, "Expect:");
+  curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1);
+  curl_easy_setopt(curl_, CURLOPT_UPLOAD, 1);
+  curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers_);
+  curl_easy_setopt(curl_, CURLOPT_FAILONERROR, 1);
+}
+
+
+HttpUploader::~HttpUploader() {
+  curl_easy_cleanup(curl_);
+  curl_slist_free_all(headers_);
+}
+
+
+/**
+ * Sends the file to base_url/remote_path, retries with a growing back-off.
+ * The connection stays open for the next object.
+ * @return 0 on success, 106 if all attempts failed
+ */
+int32_t HttpUploader::Upload(FILE *f, const string &remote_path) {
+  const string url = base_url_ + "/" + remote_path;
+  if (fseeko(f, 0, SEEK_END) != 0)
+    return 106;
+  const off_t size = ftello(f);
+  curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl_, CURLOPT_READDATA, f);
+  curl_easy_setopt(curl_, CURLOPT_INFILESIZE_LARGE, curl_off_t(size));
+
+  for (unsigned attempt = 0; attempt <= kMaxRetries; ++attempt) {
+    if (attempt > 0) {
+      atomic_inc64(&statistics_->num_retries);
+      usleep(((100 + random() % 100) << (attempt - 1)) * 1000);
+    }
+    rewind(f);
+    const CURLcode retval = curl_easy_perform(curl_);
+    if (retval == CURLE_OK) {
+      LogCvmfs(kLogSpooler, kLogVerboseMsg, "uploaded %s (%"PRId64" bytes)",
+               url.c_str(), int64_t(size));
+      atomic_inc64(&statistics_->num_uploads);
+      atomic_xadd64(&statistics_->num_bytes, size);
+      return 0;
+    }
+    long status = 0;
+    curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &status);
+    LogCvmfs(kLogSpooler, kLogVerboseMsg, "failed to upload %s "
+             "(attempt %u, curl error %d, http status %ld)",
+             url.c_str(), attempt + 1, retval, status);
+  }
+  atomic_inc64(&statistics_->num_failures);
+  return 106;
+}
+
+
+HttpStat::HttpStat(const string &base_url) : BackendStat(base_url) {
+  multi_ = curl_multi_init();
+  assert(multi_);
+  for (unsigned i = 0; i < kMaxParallel; ++i) {
+    CURL *handle = curl_easy_init();
+    assert(handle);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 1);
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1);
+    handles_.push_back(handle);
+  }
+  int retval = pthread_mutex_init(&lock_, NULL);
+  assert(retval == 0);
+}
+
+
+HttpStat::~HttpStat() {
+  for (unsigned i = 0; i < handles_.size(); ++i)
+    curl_easy_cleanup(handles_[i]);
+  curl_multi_cleanup(multi_);
+  pthread_mutex_destroy(&lock_);
+}
+
+
+CURL *HttpStat::PrepareHandle(CURL *handle, const string &path) {
+  const string url = base_path_ + "/" + path;
+  // Copies the string
+  curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+  return handle;
+}
+
+
+bool HttpStat::Exists(CURL *handle, const CURLcode result) {
+  long status = 0;
+  curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+  return (result == CURLE_OK) && (status >= 200) && (status < 300);
+}
+
+
+bool HttpStat::Stat(const string &path) {
+  pthread_mutex_lock(&lock_);
+  CURL *handle = PrepareHandle(handles_[0], path);
+  const bool result = Exists(handle, curl_easy_perform(handle));
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+/**
+ * Keeps up to kMaxParallel HEAD requests in flight.
+ */
+void HttpStat::StatMany(const vector<string> &paths, vector<bool> *results) {
+  results->assign(paths.size(), false);
+  pthread_mutex_lock(&lock_);
+  vector<CURL *> idle(handles_.rbegin(), handles_.rend());
+  vector<unsigned> position(handles_.size());
+  unsigned next = 0;
+  int num_running = 0;
+  do {
+    while ((next < paths.size()) && !idle.empty()) {
+      CURL *handle = PrepareHandle(idle.back(), paths[next]);
+      idle.pop_back();
+      for (unsigned i = 0; i < handles_.size(); ++i) {
+        if (handles_[i] == handle)
+          position[i] = next;
+      }
+      curl_multi_add_handle(multi_, handle);
+      next++;
+    }
+
+    while (curl_multi_perform(multi_, &num_running) ==
+           CURLM_CALL_MULTI_PERFORM) { }
+    CURLMsg *msg;
+    int num_msgs;
+    while ((msg = curl_multi_info_read(multi_, &num_msgs)) != NULL) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+      CURL *handle = msg->easy_handle;
+      const CURLcode result = msg->data.result;
+      for (unsigned i = 0; i < handles_.size(); ++i) {
+        if (handles_[i] == handle)
+          (*results)[position[i]] = Exists(handle, result);
+      }
+      curl_multi_remove_handle(multi_, handle);
+      idle.push_back(handle);
+    }
+
+    if ((num_running > 0) && (idle.empty() || (next == paths.size()))) {
+      fd_set read_fds, write_fds, except_fds;
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      FD_ZERO(&except_fds);
+      int max_fd = -1;
+      curl_multi_fdset(multi_, &read_fds, &write_fds, &except_fds, &max_fd);
+      struct timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 100000;
+      select(max_fd + 1, &read_fds, &write_fds, &except_fds, &timeout);
+    }
+  } while ((num_running > 0) || (next < paths.size()) ||
+           (idle.size() < handles_.size()));
+  pthread_mutex_unlock(&lock_);
+}
+
+}  // namespace upload
@@ -0,0 +1,86 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * Stores objects on an HTTP server by PUT requests, for instance a WebDAV
+ * server or an S3 bucket that accepts uploads from the publisher.
+ */
+
+#ifndef CVMFS_UPLOAD_HTTP_H_
+#define CVMFS_UPLOAD_HTTP_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "atomic.h"
+#include "duplex_curl.h"
+#include "upload.h"
+
+namespace upload {
+
+/**
+ * Transfer counters of a spooler process, shared by its workers.
+ */
+struct HttpStatistics {
+  HttpStatistics() {
+    atomic_init64(&num_uploads);
+    atomic_init64(&num_bytes);
+    atomic_init64(&num_retries);
+    atomic_init64(&num_failures);
+  }
+  atomic_int64 num_uploads;
+  atomic_int64 num_bytes;
+  atomic_int64 num_retries;
+  atomic_int64 num_failures;
+};
+
+
+/**
+ * A persistent connection to the upstream server.  Not thread-safe, every
+ * spooler worker has its own.
+ */
+class HttpUploader {
+ public:
+  HttpUploader(const std::string &base_url, HttpStatistics *statistics);
+  ~HttpUploader();
+  int32_t Upload(FILE *f, const std::string &remote_path);
+
+ private:
+  static const unsigned kMaxRetries = 3;
+
+  std::string base_url_;
+  HttpStatistics *statistics_;
+  CURL *curl_;
+  struct curl_slist *headers_;
+};
+
+
+/**
+ * Checks for objects by HEAD requests.  Batches of paths are checked over
+ * parallel connections.
+ */
+class HttpStat : public BackendStat {
+ public:
+  explicit HttpStat(const std::string &base_url);
+  ~HttpStat();
+  bool Stat(const std::string &path);
+  void StatMany(const std::vector<std::string> &paths,
+                std::vector<bool> *results);
+
+ private:
+  static const unsigned kMaxParallel = 16;
+
+  CURL *PrepareHandle(CURL *handle, const std::string &path);
+  static bool Exists(CURL *handle, const CURLcode result);
+
+  std::vector<CURL *> handles_;
+  CURLM *multi_;
+  pthread_mutex_t lock_;
+};
+
+}  // namespace upload
+
+#endif  // CVMFS_UPLOAD_HTTP_H_
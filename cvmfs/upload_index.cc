@@ -0,0 +1,341 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "upload_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+
+#include "logging.h"
+#include "platform.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace upload {
+
+ObjectIndex::ObjectIndex(const string &path) {
+  path_ = path;
+  fd_ = -1;
+  header_ = NULL;
+  int retval = pthread_mutex_init(&lock_, NULL);
+  assert(retval == 0);
+}
+
+
+ObjectIndex::~ObjectIndex() {
+  Unmap();
+  pthread_mutex_destroy(&lock_);
+}
+
+
+/**
+ * Opens the index file, an invalid or missing file starts an empty index.
+ * @return NULL if the file cannot be created
+ */
+ObjectIndex *ObjectIndex::Open(const string &path) {
+  ObjectIndex *index = new ObjectIndex(path);
+  if (!Map(path, 0, false, &index->fd_, &index->header_)) {
+    LogCvmfs(kLogSpooler, kLogVerboseMsg, "starting new object index %s",
+             path.c_str());
+    if (!Map(path, kMinBuckets, true, &index->fd_, &index->header_)) {
+      LogCvmfs(kLogSpooler, kLogStderr, "failed to create object index %s",
+               path.c_str());
+      delete index;
+      return NULL;
+    }
+  }
+  LogCvmfs(kLogSpooler, kLogVerboseMsg,
+           "opened object index %s (%"PRIu64" objects)", path.c_str(),
+           index->header_->num_entries);
+  return index;
+}
+
+
+/**
+ * Maps an existing index file or creates an empty one with num_buckets.  A
+ * created file replaces the existing one only once it is completely set up.
+ */
+bool ObjectIndex::Map(const string &path, const uint64_t num_buckets,
+                      const bool create, int *fd, Header **header)
+{
+  const string tmp_path = path + ".tmp";
+  const int new_fd = create ?
+    open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) :
+    open(path.c_str(), O_RDWR);
+  if (new_fd < 0)
+    return false;
+
+  uint64_t size;
+  if (create) {
+    size = MappedSize(num_buckets);
+    if (ftruncate(new_fd, size) != 0) {
+      close(new_fd);
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  } else {
+    platform_stat64 info;
+    if ((platform_fstat(new_fd, &info) != 0) ||
+        (static_cast<uint64_t>(info.st_size) < sizeof(Header)))
+    {
+      close(new_fd);
+      return false;
+    }
+    size = info.st_size;
+  }
+
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       new_fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(new_fd);
+    if (create)
+      unlink(tmp_path.c_str());
+    return false;
+  }
+  Header *new_header = reinterpret_cast<Header *>(mapping);
+
+  if (create) {
+    // The rest of the file reads as zeros, i.e. empty buckets
+    new_header->magic = kMagic;
+    new_header->version = kVersion;
+    new_header->num_buckets = num_buckets;
+    new_header->num_entries = 0;
+  } else if ((new_header->magic != kMagic) ||
+             (new_header->version != kVersion) ||
+             (new_header->num_buckets == 0) ||
+             ((new_header->num_buckets & (new_header->num_buckets - 1)) != 0) ||
+             (MappedSize(new_header->num_buckets) != size))
+  {
+    LogCvmfs(kLogSpooler, kLogStderr, "ignoring invalid object index %s",
+             path.c_str());
+    munmap(mapping, size);
+    close(new_fd);
+    return false;
+  }
+
+  if (create && (rename(tmp_path.c_str(), path.c_str()) != 0)) {
+    munmap(mapping, size);
+    close(new_fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  *fd = new_fd;
+  *header = new_header;
+  return true;
+}
+
+
+void ObjectIndex::Unmap() {
+  if (header_ == NULL)
+    return;
+  const uint64_t size = MappedSize(header_->num_buckets);
+  msync(header_, size, MS_SYNC);
+  munmap(header_, size);
+  close(fd_);
+  header_ = NULL;
+  fd_ = -1;
+}
+
+
+/**
+ * @return false for paths that are not content-addressed objects
+ */
+bool ObjectIndex::ParsePath(const string &object_path, Bucket *key) {
+  const unsigned digest_size = hash::kDigestSizes[hash::kSha1];
+  // data/xx/yyyy..., possibly with a one-letter suffix
+  const unsigned length = 5 + 2 + 1 + 2*digest_size - 2;
+  if (((object_path.length() != length) &&
+       (object_path.length() != length + 1)) ||
+      (object_path.compare(0, 5, "data/") != 0) || (object_path[7] != '/'))
+  {
+    return false;
+  }
+  const string hex = object_path.substr(5, 2) +
+                     object_path.substr(8, 2*digest_size - 2);
+  for (unsigned i = 0; i < hex.length(); ++i) {
+    if (!isxdigit(hex[i]))
+      return false;
+  }
+
+  memset(key, 0, sizeof(*key));
+  hash::Any digest(hash::kSha1, hash::HexPtr(hex));
+  memcpy(key->digest, digest.digest, digest_size);
+  key->suffix = (object_path.length() == length + 1) ?
+                object_path[length] : '\0';
+  key->used = 1;
+  return true;
+}
+
+
+/**
+ * Linear probing, starting at the first bytes of the digest.
+ * @return the bucket of the key or the empty bucket where it belongs
+ */
+ObjectIndex::Bucket *ObjectIndex::Probe(Header *header, const Bucket &key) {
+  Bucket *buckets = reinterpret_cast<Bucket *>(header + 1);
+  const uint64_t mask = header->num_buckets - 1;
+  uint64_t start;
+  memcpy(&start, key.digest, sizeof(start));
+  for (uint64_t i = start & mask; ; i = (i + 1) & mask) {
+    if (!buckets[i].used)
+      return &buckets[i];
+    if ((buckets[i].suffix == key.suffix) &&
+        (memcmp(buckets[i].digest, key.digest, sizeof(key.digest)) == 0))
+    {
+      return &buckets[i];
+    }
+  }
+}
+
+
+/**
+ * Doubles the table, at most half of the buckets are used.
+ */
+bool ObjectIndex::Grow() {
+  int new_fd;
+  Header *new_header;
+  if (!Map(path_, 2 * header_->num_buckets, true, &new_fd, &new_header))
+    return false;
+  const Bucket *buckets = reinterpret_cast<const Bucket *>(header_ + 1);
+  for (uint64_t i = 0; i < header_->num_buckets; ++i) {
+    if (buckets[i].used)
+      *Probe(new_header, buckets[i]) = buckets[i];
+  }
+  new_header->num_entries = header_->num_entries;
+  LogCvmfs(kLogSpooler, kLogVerboseMsg,
+           "grew object index to %"PRIu64" buckets", new_header->num_buckets);
+  Unmap();
+  fd_ = new_fd;
+  header_ = new_header;
+  return true;
+}
+
+
+bool ObjectIndex::Contains(const string &object_path) {
+  Bucket key;
+  if (!ParsePath(object_path, &key))
+    return false;
+  pthread_mutex_lock(&lock_);
+  const bool result = Probe(header_, key)->used;
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+void ObjectIndex::Insert(const string &object_path) {
+  Bucket key;
+  if (!ParsePath(object_path, &key))
+    return;
+  pthread_mutex_lock(&lock_);
+  if ((2 * (header_->num_entries + 1) > header_->num_buckets) && !Grow()) {
+    pthread_mutex_unlock(&lock_);
+    LogCvmfs(kLogSpooler, kLogStderr, "failed to grow object index %s",
+             path_.c_str());
+    return;
+  }
+  Bucket *bucket = Probe(header_, key);
+  if (!bucket->used) {
+    memcpy(bucket->digest, key.digest, sizeof(key.digest));
+    bucket->suffix = key.suffix;
+    bucket->used = 1;
+    header_->num_entries++;
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+
+uint64_t ObjectIndex::size() {
+  pthread_mutex_lock(&lock_);
+  const uint64_t result = header_->num_entries;
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+
+bool IndexedStat::Stat(const string &path) {
+  if (index_->Contains(path))
+    return true;
+  const bool result = backend_->Stat(path);
+  if (result)
+    index_->Insert(path);
+  return result;
+}
+
+
+/**
+ * Only the objects missing in the index are checked in the storage.
+ */
+void IndexedStat::StatMany(const vector<string> &paths,
+                           vector<bool> *results)
+{
+  results->assign(paths.size(), true);
+  vector<string> unknown_paths;
+  vector<unsigned> positions;
+  for (unsigned i = 0; i < paths.size(); ++i) {
+    if (!index_->Contains(paths[i])) {
+      unknown_paths.push_back(paths[i]);
+      positions.push_back(i);
+    }
+  }
+  if (unknown_paths.empty())
+    return;
+
+  vector<bool> exists;
+  backend_->StatMany(unknown_paths, &exists);
+  for (unsigned i = 0; i < unknown_paths.size(); ++i) {
+    (*results)[positions[i]] = exists[i];
+    if (exists[i])
+      index_->Insert(unknown_paths[i]);
+  }
+}
+
+
+/**
+ * Creates the index from the objects in a local upstream storage.  The index
+ * file is replaced once it is complete.
+ */
+bool RebuildObjectIndex(const string &upstream_basedir,
+                        const string &index_path)
+{
+  const string tmp_index_path = index_path + ".rebuild";
+  unlink(tmp_index_path.c_str());
+  ObjectIndex *index = ObjectIndex::Open(tmp_index_path);
+  if (index == NULL)
+    return false;
+
+  for (unsigned i = 0; i < 256; ++i) {
+    char prefix[3];
+    snprintf(prefix, sizeof(prefix), "%02x", i);
+    const string dir_path = upstream_basedir + "/data/" + prefix;
+    DIR *dir = opendir(dir_path.c_str());
+    if (dir == NULL) {
+      LogCvmfs(kLogSpooler, kLogStderr, "failed to open %s (%d)",
+               dir_path.c_str(), errno);
+      delete index;
+      unlink(tmp_index_path.c_str());
+      return false;
+    }
+    platform_dirent64 *entry;
+    while ((entry = platform_readdir(dir)) != NULL)
+      index->Insert(string("data/") + prefix + "/" + entry->d_name);
+    closedir(dir);
+  }
+
+  LogCvmfs(kLogSpooler, kLogStdout, "indexed %"PRIu64" objects",
+           index->size());
+  delete index;
+  return rename(tmp_index_path.c_str(), index_path.c_str()) == 0;
+}
+
+}  // namespace upload
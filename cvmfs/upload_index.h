@@ -0,0 +1,100 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * A persistent index of the objects known to be stored in the upstream
+ * storage.  Presence checks of a replica become lookups in a memory mapped
+ * hash table instead of metadata requests to the storage.
+ */
+
+#ifndef CVMFS_UPLOAD_INDEX_H_
+#define CVMFS_UPLOAD_INDEX_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "upload.h"
+
+namespace upload {
+
+/**
+ * Open addressing hash table of content-addressed objects ("data/xx/yyy..."
+ * and an optional suffix) in a memory mapped file.  Other paths are never
+ * part of the index.  Objects in the storage are not removed, so the index
+ * only has to grow.  Thread-safe.  The file is meant to be used by one
+ * process at a time.
+ */
+class ObjectIndex {
+ public:
+  static ObjectIndex *Open(const std::string &path);
+  ~ObjectIndex();
+
+  bool Contains(const std::string &object_path);
+  void Insert(const std::string &object_path);
+  uint64_t size();
+
+ private:
+  static const uint32_t kMagic = 0x58444f43;  // "CODX"
+  static const uint32_t kVersion = 1;
+  static const uint64_t kMinBuckets = 1 << 16;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_buckets;  ///< A power of two
+    uint64_t num_entries;
+  };
+
+  struct Bucket {
+    unsigned char digest[hash::kMaxDigestSize];
+    unsigned char suffix;
+    unsigned char used;
+    unsigned char padding[2];
+  };
+
+  ObjectIndex(const std::string &path);
+  static bool ParsePath(const std::string &object_path, Bucket *key);
+  static bool Map(const std::string &path, const uint64_t num_buckets,
+                  const bool create, int *fd, Header **header);
+  static Bucket *Probe(Header *header, const Bucket &key);
+  static uint64_t MappedSize(const uint64_t num_buckets) {
+    return sizeof(Header) + num_buckets * sizeof(Bucket);
+  }
+  void Unmap();
+  bool Grow();
+
+  std::string path_;
+  int fd_;
+  Header *header_;
+  pthread_mutex_t lock_;
+};
+
+
+/**
+ * Checks the index before the storage, objects found in the storage are added
+ * to the index.  Takes ownership of the backend but not of the index.
+ */
+class IndexedStat : public BackendStat {
+ public:
+  IndexedStat(BackendStat *backend, ObjectIndex *index) :
+    BackendStat(""), backend_(backend), index_(index) { }
+  ~IndexedStat() { delete backend_; }
+  bool Stat(const std::string &path);
+  void StatMany(const std::vector<std::string> &paths,
+                std::vector<bool> *results);
+
+ private:
+  BackendStat *backend_;
+  ObjectIndex *index_;
+};
+
+
+bool RebuildObjectIndex(const std::string &upstream_basedir,
+                        const std::string &index_path);
+
+}  // namespace upload
+
+#endif  // CVMFS_UPLOAD_INDEX_H_
@@ -0,0 +1,394 @@
+/**
+ * This file is part of the CernVM File System.
+ *
+ * The warm-up module pre-stages files into the cache before jobs need them,
+ * triggered by the "cache warmup" talk command.  The input files are either
+ * trace files written by the tracer (csv or binary), of which the open()
+ * events are used, or plain lists with one repository path per line.
+ *
+ * The files are downloaded by a configurable number of threads through the
+ * regular cache path, so they are verified and accounted for by the quota
+ * manager.  Warm-up stops before it would trigger a cache cleanup, so that it
+ * does not evict the working set of the node.  Small files are committed in
+ * batches, which saves most of the per-file quota manager round trips.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include "cvmfs_config.h"
+#include "warmup.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "catalog_mgr.h"
+#include "dirent.h"
+#include "download.h"
+#include "logging.h"
+#include "quota.h"
+#include "shortstring.h"
+#include "tracer.h"
+#include "util.h"
+
+using namespace std;  // NOLINT
+
+namespace warmup {
+
+const unsigned kMaxThreads = 64;
+const unsigned kBatchSize = 32;  /**< matches the quota command buffer */
+const uint64_t kMaxBatchObject = 256*1024;  /**< larger files are committed */
+
+/**
+ * Downloaded small files of a warm-up thread that are not yet committed
+ */
+struct Batch {
+  Batch() : size(0) { }
+  vector<cache::Transaction> txns;
+  uint64_t size;
+};
+
+catalog::AbstractCatalogManager *catalog_manager_ = NULL;
+vector<PathString> *paths_ = NULL;  /**< Files of the current warm-up */
+unsigned next_path_ = 0;
+vector<pthread_t> *threads_ = NULL;
+unsigned num_running_ = 0;
+bool stop_ = false;
+bool quota_reached_ = false;
+pthread_mutex_t lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t num_fetched_ = 0;
+uint64_t num_cached_ = 0;
+uint64_t num_skipped_ = 0;
+uint64_t num_failed_ = 0;
+uint64_t num_bytes_ = 0;
+time_t time_start_ = 0;
+time_t time_end_ = 0;
+
+
+static void AddPath(const string &path, set<string> *seen,
+                    vector<PathString> *paths)
+{
+  if (path.empty() || (path[0] != '/') || (seen->find(path) != seen->end()))
+    return;
+  seen->insert(path);
+  paths->push_back(PathString(path.data(), path.length()));
+}
+
+
+static bool ReadList(const string &list_file, set<string> *seen,
+                     vector<PathString> *paths)
+{
+  FILE *f = fopen(list_file.c_str(), "r");
+  if (!f)
+    return false;
+
+  if (tracer::ReadBinaryHeader(f)) {
+    tracer::Record record;
+    while (tracer::ReadBinaryRecord(f, &record)) {
+      if (record.code == tracer::kFuseOpen)
+        AddPath(record.path, seen, paths);
+    }
+    fclose(f);
+    return true;
+  }
+  rewind(f);
+
+  char buf[2*PATH_MAX + 64];
+  while (fgets(buf, sizeof(buf), f)) {
+    unsigned length = strlen(buf);
+    if ((length > 0) && (buf[length-1] == '\n'))
+      length--;
+    else if (!feof(f))
+      continue;  // overlong line
+    const string line(buf, length);
+    string path;
+    if (!line.empty() && (line[0] == '"')) {
+      tracer::Record record;
+      if (!tracer::ParseCsv(line, &record) ||
+          (record.code != tracer::kFuseOpen))
+      {
+        continue;
+      }
+      path = record.path;
+    } else {
+      path = line;
+      if (!path.empty() && (path[path.length()-1] == '\r'))
+        path.erase(path.length()-1);
+    }
+    AddPath(path, seen, paths);
+  }
+  fclose(f);
+  return true;
+}
+
+
+/**
+ * Returns false if the cache has no space left for size bytes without a
+ * cleanup.
+ */
+static bool HasSpace(const uint64_t size) {
+  const uint64_t capacity = quota::GetCapacity();
+  if (capacity == 0)
+    return true;
+  return quota::GetSize() + size <= capacity;
+}
+
+
+static void CommitBatch(Batch *batch) {
+  if (batch->txns.empty())
+    return;
+  const unsigned num_committed = cache::CommitTransactions(batch->txns);
+  pthread_mutex_lock(&lock_);
+  num_failed_ += batch->txns.size() - num_committed;
+  pthread_mutex_unlock(&lock_);
+  batch->txns.clear();
+  batch->size = 0;
+}
+
+
+/**
+ * Fetches a regular file or all the chunks of a chunked file.
+ */
+static void WarmFile(const PathString &path, Batch *batch) {
+  catalog::DirectoryEntry dirent;
+  if (!catalog_manager_->LookupPath(path, catalog::kLookupSole, &dirent) ||
+      !dirent.IsRegular())
+  {
+    pthread_mutex_lock(&lock_);
+    num_skipped_++;
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+
+  catalog::FileChunkList chunks;
+  if (dirent.IsChunkedFile() &&
+      !catalog_manager_->ListFileChunks(path, &chunks))
+  {
+    chunks.clear();
+  }
+  const bool whole_file = chunks.empty();
+  if (whole_file && dirent.checksum().IsNull()) {
+    pthread_mutex_lock(&lock_);
+    num_skipped_++;
+    pthread_mutex_unlock(&lock_);
+    return;
+  }
+  if (whole_file)
+    chunks.push_back(catalog::FileChunk(dirent.checksum(), 0, dirent.size()));
+
+  for (unsigned i = 0; i < chunks.size(); ++i) {
+    if (cache::Contains(chunks[i].content_hash)) {
+      pthread_mutex_lock(&lock_);
+      num_cached_++;
+      pthread_mutex_unlock(&lock_);
+      continue;
+    }
+    if (!HasSpace(batch->size + chunks[i].size)) {
+      LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+               "cache warm-up stopped, quota limit reached");
+      pthread_mutex_lock(&lock_);
+      quota_reached_ = true;
+      stop_ = true;
+      pthread_mutex_unlock(&lock_);
+      return;
+    }
+
+    int fd;
+    if (whole_file && (dirent.size() <= kMaxBatchObject)) {
+      cache::Transaction txn;
+      fd = cache::FetchDeferred(dirent, path.ToString(), &txn);
+      if ((fd >= 0) && !txn.temp_path.empty()) {
+        batch->txns.push_back(txn);
+        batch->size += txn.size;
+      }
+    } else if (whole_file) {
+      fd = cache::Fetch(dirent, path.ToString());
+    } else {
+      fd = cache::FetchChunk(chunks[i], path.ToString());
+    }
+    pthread_mutex_lock(&lock_);
+    if (fd >= 0) {
+      num_fetched_++;
+      num_bytes_ += chunks[i].size;
+    } else {
+      num_failed_++;
+    }
+    pthread_mutex_unlock(&lock_);
+    if (fd >= 0)
+      close(fd);
+    if (batch->txns.size() >= kBatchSize)
+      CommitBatch(batch);
+  }
+}
+
+
+static void *MainWarmup(void *data __attribute__((unused))) {
+  LogCvmfs(kLogCache, kLogDebug, "starting cache warm-up thread");
+  cache::SetDownloadPriority(download::kPriorityBulk);
+  Batch batch;
+  while (true) {
+    pthread_mutex_lock(&lock_);
+    if (stop_ || (next_path_ >= paths_->size())) {
+      pthread_mutex_unlock(&lock_);
+      CommitBatch(&batch);
+      pthread_mutex_lock(&lock_);
+      num_running_--;
+      if (num_running_ == 0) {
+        time_end_ = time(NULL);
+        LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+                 "cache warm-up finished, fetched %"PRIu64" files "
+                 "(%"PRIu64" bytes)", num_fetched_, num_bytes_);
+      }
+      pthread_mutex_unlock(&lock_);
+      break;
+    }
+    const PathString path = (*paths_)[next_path_++];
+    pthread_mutex_unlock(&lock_);
+
+    WarmFile(path, &batch);
+  }
+  return NULL;
+}
+
+
+/**
+ * Joins the threads of a previous warm-up.  Caller holds lock_.
+ */
+static void JoinThreads() {
+  vector<pthread_t> threads;
+  threads.swap(*threads_);
+  pthread_mutex_unlock(&lock_);
+  for (unsigned i = 0; i < threads.size(); ++i)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_lock(&lock_);
+}
+
+
+void Init(catalog::AbstractCatalogManager *catalog_manager) {
+  catalog_manager_ = catalog_manager;
+  paths_ = new vector<PathString>();
+  threads_ = new vector<pthread_t>();
+  next_path_ = 0;
+  num_running_ = 0;
+  stop_ = false;
+  quota_reached_ = false;
+}
+
+
+/**
+ * Stops a running warm-up.  Has to run before the catalog manager is
+ * destroyed.
+ */
+void Fini() {
+  Stop();
+  delete paths_;
+  delete threads_;
+  paths_ = NULL;
+  threads_ = NULL;
+  catalog_manager_ = NULL;
+}
+
+
+/**
+ * Starts downloading the files referenced by list_files with num_threads
+ * threads.  Only one warm-up runs at a time.
+ */
+bool Start(const vector<string> &list_files, const unsigned num_threads,
+           string *error)
+{
+  if ((num_threads == 0) || (num_threads > kMaxThreads)) {
+    *error = "number of threads must be between 1 and " +
+             StringifyInt(kMaxThreads);
+    return false;
+  }
+
+  vector<PathString> paths;
+  set<string> seen;
+  for (unsigned i = 0; i < list_files.size(); ++i) {
+    if (!ReadList(list_files[i], &seen, &paths)) {
+      *error = "failed to read " + list_files[i];
+      return false;
+    }
+  }
+
+  pthread_mutex_lock(&lock_);
+  if (num_running_ > 0) {
+    pthread_mutex_unlock(&lock_);
+    *error = "warm-up already running";
+    return false;
+  }
+  JoinThreads();
+  paths_->swap(paths);
+  next_path_ = 0;
+  stop_ = false;
+  quota_reached_ = false;
+  num_fetched_ = num_cached_ = num_skipped_ = num_failed_ = num_bytes_ = 0;
+  time_start_ = time(NULL);
+  time_end_ = 0;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    pthread_t thread_warmup;
+    if (pthread_create(&thread_warmup, NULL, MainWarmup, NULL) != 0)
+      break;
+    threads_->push_back(thread_warmup);
+    num_running_++;
+  }
+  const bool result = !threads_->empty();
+  const uint64_t num_paths = paths_->size();
+  const unsigned num_started = threads_->size();
+  pthread_mutex_unlock(&lock_);
+
+  if (!result)
+    *error = "failed to start threads";
+  LogCvmfs(kLogCache, kLogDebug | kLogSyslog,
+           "cache warm-up of %"PRIu64" files with %u threads", num_paths,
+           num_started);
+  return result;
+}
+
+
+/**
+ * Cancels a running warm-up.  Files in transfer are completed.
+ */
+void Stop() {
+  pthread_mutex_lock(&lock_);
+  stop_ = true;
+  JoinThreads();
+  pthread_mutex_unlock(&lock_);
+}
+
+
+string GetStatistics() {
+  pthread_mutex_lock(&lock_);
+  const string state = (num_running_ > 0) ? "running" :
+    (quota_reached_ ? "stopped (quota limit reached)" : "idle");
+  const time_t elapsed = ((num_running_ > 0) ? time(NULL) : time_end_) -
+                         time_start_;
+  const string result =
+    "state: " + state + "  " +
+    "progress: " + StringifyInt(next_path_) + "/" +
+      StringifyInt(paths_->size()) + "\n" +
+    "fetched: " + StringifyInt(num_fetched_) + " (" +
+      StringifyInt(num_bytes_ / 1024) + " kB)  " +
+    "already cached: " + StringifyInt(num_cached_) + "  " +
+    "skipped: " + StringifyInt(num_skipped_) + "  " +
+    "failed: " + StringifyInt(num_failed_) + "\n" +
+    "elapsed: " + StringifyInt(elapsed) + "s  " +
+    "files per second: " +
+      (elapsed > 0 ? StringifyInt(num_fetched_ / elapsed) : "n/a") + "\n" +
+    "commits: " + cache::GetBatchStatistics();
+  pthread_mutex_unlock(&lock_);
+  return result;
+}
+
+}  // namespace warmup
@@ -0,0 +1,28 @@
+/**
+ * This file is part of the CernVM File System.
+ */
+
+#ifndef CVMFS_WARMUP_H_
+#define CVMFS_WARMUP_H_
+
+#include <string>
+#include <vector>
+
+namespace catalog {
+class AbstractCatalogManager;
+}
+
+namespace warmup {
+
+void Init(catalog::AbstractCatalogManager *catalog_manager);
+void Fini();
+
+bool Start(const std::vector<std::string> &list_files,
+           const unsigned num_threads, std::string *error);
+void Stop();
+
+std::string GetStatistics();
+
+}  // namespace warmup
+
+#endif  // CVMFS_WARMUP_H_
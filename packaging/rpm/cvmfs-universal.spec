@@ -235,6 +235,7 @@ fi
 %{_bindir}/cvmfs2_debug
 %{_bindir}/cvmfs_talk
 %{_bindir}/cvmfs_fsck
+%{_bindir}/cvmfs_replay
 %{_bindir}/cvmfs_config
 %{_sysconfdir}/auto.cvmfs
 %{_sysconfdir}/cvmfs/config.sh
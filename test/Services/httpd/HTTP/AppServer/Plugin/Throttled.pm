@@ -0,0 +1,141 @@
+package HTTP::AppServer::Plugin::Throttled;
+# Plugin for HTTP::AppServer that serves any file of the document root
+# like a slow or unreliable Stratum 1: every reply is delayed, the body is
+# sent at a limited rate and a share of the requests fails.
+
+#use 5.010000;
+use strict;
+use warnings;
+use IO::File;
+use JSON;
+use Path::Trim;
+use Time::HiRes qw(usleep);
+use HTTP::AppServer::Plugin;
+use base qw(HTTP::AppServer::Plugin);
+use File::MimeInfo;
+
+our $VERSION = '0.01';
+
+# document root for file retrieval
+my $DocRoot = '/tmp';
+
+# Milliseconds before the reply, KB per second, percentage of failed requests.
+# 0 disables each of them.
+my $Latency = 0;
+my $Bandwidth = 0;
+my $ErrorRate = 0;
+
+# Size of the pieces in which a throttled body is sent
+my $ChunkSize = 4096;
+
+my $PathTrimmer = Path::Trim->new();
+
+# called by the server when the plugin is installed
+# to determine which routes are handled by the plugin
+sub init
+{
+	my ($class, $server, %options) = @_;
+
+	$PathTrimmer->set_directory_separator('/');
+
+	# analyse options
+	$DocRoot = $options{'DocRoot'} if exists $options{'DocRoot'};
+	$Latency = $options{'Latency'} if exists $options{'Latency'};
+	$Bandwidth = $options{'Bandwidth'} if exists $options{'Bandwidth'};
+	$ErrorRate = $options{'ErrorRate'} if exists $options{'ErrorRate'};
+
+	# install properties in server
+	$server->set('docroot', $DocRoot);
+
+	return (
+		# handle file (and directory) requests
+		'^\/(.*)$' => \&_handle_file,
+	);
+}
+
+sub _handle_file
+{
+	my ($server, $cgi, $filename) = @_;
+
+	usleep($Latency * 1000) if $Latency > 0;
+
+	if ($ErrorRate > 0 and rand(100) < $ErrorRate) {
+		print "HTTP/1.0 503 Service Unavailable\r\n";
+		print $cgi->header(
+							-type => 'text/html',
+							-Content_length => 0
+						  );
+		return;
+	}
+
+	$filename = $server->docroot().'/'.$filename;
+	$filename = $PathTrimmer->trim_path($filename);
+
+	my $mimetype = 'text/html';
+	my $docroot_regex = quotemeta $server->docroot();
+	if (!-f $filename or $filename !~ /^$docroot_regex/) {
+		$server->errorpage(404);
+		return;
+	}
+
+	$mimetype = mimetype($filename);
+	my $fh = IO::File->new('< '.$filename);
+	binmode $fh;
+	print "HTTP/1.0 200 Ok\r\n";
+	print $cgi->header(
+						-type => $mimetype,
+						-Content_length => -s $filename
+					  );
+	if ($Bandwidth <= 0) {
+		print join '', <$fh>;
+		return;
+	}
+
+	# Sleeping after every chunk the time it takes at the given rate
+	my $chunk_us = $ChunkSize * 1000000 / ($Bandwidth * 1024);
+	my $chunk;
+	while (read($fh, $chunk, $ChunkSize)) {
+		print $chunk;
+		STDOUT->flush;
+		usleep($chunk_us * length($chunk) / $ChunkSize);
+	}
+}
+
+1;
+__END__
+=head1 NAME
+
+HTTP::AppServer::Plugin::Throttled - Plugin for HTTP::AppServer that serves files with injected latency, limited bandwidth and random errors.
+
+=head1 SYNOPSIS
+
+  use HTTP::AppServer;
+  my $server = HTTP::AppServer->new();
+  $server->plugin('Throttled', DocRoot => '/path/to/docroot',
+                  Latency => 50, Bandwidth => 1024, ErrorRate => 5);
+
+=head1 DESCRIPTION
+
+Works like AllRetriever.  Before every reply, Throttled waits Latency
+milliseconds.  ErrorRate percent of the requests are answered with a
+503 error.  File bodies are sent at Bandwidth KB per second.
+
+=head2 Plugin configuration
+
+=head3 DocRoot => I<dir>
+
+Defines the document root directory where the files are retrieved from.
+
+=head3 Latency => I<milliseconds>
+
+=head3 Bandwidth => I<KB per second>
+
+=head3 ErrorRate => I<percent>
+
+All of them default to 0, which disables the respective impairment.
+
+=head2 Installed URL handlers
+
+Throttled handles all URLs matching '^\/(.*)$'.
+
+=cut
@@ -12,6 +12,9 @@ my $serve_all = undef;
 my $index_of = undef;
 my $timeout = undef;
 my $deliver_crap = undef;
+my $latency = 0;
+my $bandwidth = 0;
+my $error_rate = 0;
 my $serve_error = 0;
 my $port = 8080;
 my $docroot = '/tmp';
@@ -28,7 +31,10 @@ my $ret = GetOptions ( "404" => \$not_found,
 					   "root=s" => \$docroot,
 					   "stdout=s" => \$outputfile,
 					   "stderr=s" => \$errorfile,
-					   "deliver-crap" => \$deliver_crap );
+					   "deliver-crap" => \$deliver_crap,
+					   "latency=i" => \$latency,
+					   "bandwidth=i" => \$bandwidth,
+					   "error-rate=f" => \$error_rate );
 
 if (defined ($serve_all)) {
 	$retriever = 'AllRetriever';
@@ -52,6 +58,13 @@ if (defined ($deliver_crap)) {
 	$retriever = 'CrapDeliver';
 }
 
+# Impairments apply to the whole document root like --all
+my %impairment = ();
+if ($latency > 0 or $bandwidth > 0 or $error_rate > 0) {
+	$retriever = 'Throttled';
+	%impairment = ( Latency => $latency, Bandwidth => $bandwidth, ErrorRate => $error_rate );
+}
+
 # Variable to handle the server
 my $server;
 
@@ -74,7 +87,7 @@ else {
 }
 
 # Loading requested plugin
-$server->plugin("$retriever", DocRoot => "$docroot");
+$server->plugin("$retriever", DocRoot => "$docroot", %impairment);
 
 # Loading plugin for error handling
 $server->plugin('CustomError');
@@ -11,6 +11,7 @@ use warnings;
 use Filters::Filter403;
 use Filters::FilterCrap;
 use Filters::RecordTransfer;
+use Filters::FilterRandom;
 
 # Request filter
 use Filters::ForceBackend;
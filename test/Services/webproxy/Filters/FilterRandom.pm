@@ -0,0 +1,25 @@
+package Filters::FilterRandom;
+
+######################################
+# This filter is intended to be used for response.
+# It turns a share of the responses into 502 errors, like an overloaded
+# or flaky proxy would do.
+######################################
+
+use strict;
+use warnings;
+use HTTP::Proxy::HeaderFilter::simple;
+
+# Percentage of failed responses, set by the webproxy options
+our $rate = 0;
+
+our $header = HTTP::Proxy::HeaderFilter::simple->new (
+	sub {
+		if (rand(100) < $rate) {
+			$_[2]->code( 502 );
+			$_[2]->message ( 'Bad Gateway' );
+		}
+	}
+);
+
+1;
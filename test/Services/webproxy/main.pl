@@ -12,6 +12,7 @@ my $forbidden = undef;
 my $deliver_crap = undef;
 my $fail_at;
 my $record_transfer = undef;
+my $fail_rate = 0;
 our $backend = undef;
 my $outputfile = '/var/log/cvmfs-test/webproxy.out';
 my $errorfile = '/var/log/cvmfs-test/webproxy.err';
@@ -26,7 +27,8 @@ my $ret = GetOptions ( "port=i" => \$port,
 					   "403" => \$forbidden,
 					   "deliver-crap" => \$deliver_crap,
 					   "backend=s" => \$backend,
-					   "record-transfer" => \$record_transfer );
+					   "record-transfer" => \$record_transfer,
+					   "fail-rate=f" => \$fail_rate );
 					   
 my @fail_at = split(/,/, $fail_at);
 
@@ -74,6 +76,14 @@ if (defined ($backend)) {
 	);
 }
 
+if ($fail_rate > 0) {
+	$Filters::FilterRandom::rate = $fail_rate;
+	$proxy->push_filter (
+		mime => '*/*',
+		response => $Filters::FilterRandom::header
+	);
+}
+
 if (defined ($record_transfer)) {
 	$proxy->push_filter (
 		mime => '*/*',
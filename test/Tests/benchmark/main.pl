@@ -0,0 +1,138 @@
+use strict;
+use warnings;
+use ZeroMQ qw/:all/;
+use Tests::Common qw(get_daemon_output killing_services check_repo setup_environment restart_cvmfs_services set_stdout_stderr open_test_socket close_test_socket open_shellout_socket);
+use Getopt::Long;
+use FindBin qw($RealBin);
+
+# Folders where to extract the repo and document root for httpd
+my $tmp_repo = '/tmp/server/repo/';
+my $repo_pub = $tmp_repo . 'pub';
+
+# Variables for GetOpt
+my $outputfile = '/var/log/cvmfs-test/benchmark.out';
+my $errorfile = '/var/log/cvmfs-test/benchmark.err';
+my $no_clean = undef;
+my $latency = 0;
+my $bandwidth = 0;
+my $error_rate = 0;
+my $proxy_fail_rate = 0;
+my $workers = 8;
+my $duration = 30;
+
+# Socket path and socket name. Socket name is set to let the server to select
+# the socket where to send its response.
+my $testname = 'BENCHMARK';
+
+# Name for the cvmfs repository
+my $repo_name = '127.0.0.1';
+
+# Array to store PID of services. Every service will be killed after every test.
+my @pids;
+
+# Retrieving command line options
+my $ret = GetOptions ( "stdout=s" => \$outputfile,
+					   "stderr=s" => \$errorfile,
+					   "no-clean" => \$no_clean,
+					   "latency=i" => \$latency,
+					   "bandwidth=i" => \$bandwidth,
+					   "error-rate=f" => \$error_rate,
+					   "proxy-fail-rate=f" => \$proxy_fail_rate,
+					   "workers=i" => \$workers,
+					   "duration=i" => \$duration );
+
+# Forking the process so the daemon can come back in listening mode.
+my $pid = fork();
+
+# This will be ran only by the forked process. Everything here will be logged in a file and
+# will not be sent back to the daemon.
+if (defined ($pid) and $pid == 0) {
+	# Setting STDOUT and STDERR to file in log folder.
+	set_stdout_stderr($outputfile, $errorfile);
+
+	# Opening the socket to communicate with the server and setting is identity.
+	my ($socket, $ctxt) = open_test_socket($testname);
+
+	# Opening the socket to send the output to the shell
+	my ($shell_socket, $shell_ctxt) = open_shellout_socket();
+
+	# Cleaning the environment if --no-clean is undef.
+	# See 'Tests/clean/main.pl' if you want to know what this command does.
+	if (!defined($no_clean)) {
+		print "\nCleaning the environment:\n";
+		$socket->send("clean");
+		get_daemon_output($socket);
+		sleep 5;
+	}
+	else {
+		print "\nSkipping cleaning.\n";
+	}
+
+	# Common environment setup
+	setup_environment($tmp_repo, $repo_name);
+
+	# Configuring cvmfs for sequent test
+	print 'Configuring cvmfs... ';
+	system("sudo $RealBin/config_cvmfs.sh");
+	print "Done.\n";
+
+	print "Starting services for benchmark test...\n";
+	my $impairment = '';
+	$impairment .= " --latency $latency" if $latency > 0;
+	$impairment .= " --bandwidth $bandwidth" if $bandwidth > 0;
+	$impairment .= " --error-rate $error_rate" if $error_rate > 0;
+	$socket->send("httpd --root $repo_pub --index-of --all --port 8080$impairment");
+	@pids = get_daemon_output($socket, @pids);
+	sleep 5;
+	# The first proxy fails on request, the second one is the fallback
+	my $proxy_failure = ($proxy_fail_rate > 0) ? " --fail-rate $proxy_fail_rate" : '';
+	$socket->send("webproxy --port 3128 --backend http://$repo_name:8080$proxy_failure");
+	@pids = get_daemon_output($socket, @pids);
+	sleep 5;
+	$socket->send("webproxy --port 3129 --backend http://$repo_name:8080");
+	@pids = get_daemon_output($socket, @pids);
+	sleep 5;
+	print "Services started.\n";
+
+	restart_cvmfs_services();
+
+	if (check_repo("/cvmfs/$repo_name")) {
+		$shell_socket->send("Server latency $latency ms, bandwidth " .
+		                    ($bandwidth > 0 ? "$bandwidth KB/s" : 'unlimited') .
+		                    ", error rate $error_rate%, proxy failure rate $proxy_fail_rate%.\n");
+		$shell_socket->send("$workers workers, $duration seconds per run.\n");
+		# The first run fills the cache, the second one is served from it
+		foreach my $run ('Cold cache', 'Warm cache') {
+			print "Running workload with $run...\n";
+			my $report = `perl $RealBin/workload.pl --root /cvmfs/$repo_name --workers $workers --duration $duration`;
+			print $report;
+			$shell_socket->send("$run:\n$report");
+		}
+	}
+	else {
+		$shell_socket->send("Unable to mount the repo... WRONG.\n");
+	}
+
+	@pids = killing_services($socket, @pids);
+
+	restart_cvmfs_services();
+
+	close_test_socket($socket, $ctxt);
+
+	$shell_socket->send("END\n");
+	close_test_socket($shell_socket, $shell_ctxt);
+}
+
+# This will be ran by the main script.
+# These lines will be sent back to the daemon and the damon will send them to the shell.
+if (defined ($pid) and $pid != 0) {
+	print "$testname test started.\n";
+	print "You can read its output in $outputfile.\n";
+	print "Errors are stored in $errorfile.\n";
+	print "PROCESSING:$testname\n";
+	# This is the line that makes the shell waiting for test output.
+	# Change whatever you want, but don't change this line or the shell will ignore exit status.
+	print "READ_RETURN_CODE\n";
+}
+
+exit 0;
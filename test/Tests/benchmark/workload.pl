@@ -0,0 +1,122 @@
+use strict;
+use warnings;
+use Getopt::Long;
+use File::Find;
+use POSIX qw(floor);
+use Time::HiRes qw(gettimeofday tv_interval);
+
+##############################
+# Workload driver for the benchmark test. Forks a number of workers that
+# stat, list and read random entries of a mounted repository for a given
+# time and prints throughput and latency percentiles per operation.
+# It works on any mounted repository, e.g.
+#   perl workload.pl --root /cvmfs/127.0.0.1 --workers 8 --duration 30
+##############################
+
+my $root = '/cvmfs/127.0.0.1';
+my $workers = 8;
+my $duration = 30;
+my $tmpdir = '/tmp';
+
+my $ret = GetOptions ( "root=s" => \$root,
+					   "workers=i" => \$workers,
+					   "duration=i" => \$duration,
+					   "tmpdir=s" => \$tmpdir );
+
+# The operations, each one getting a random path of the right kind
+my %operations = (
+	'stat' => sub {
+		my @info = lstat($_[0]);
+		return @info ? 1 : 0;
+	},
+	'list' => sub {
+		opendir(my $dirfh, $_[0]) or return 0;
+		my @entries = readdir $dirfh;
+		closedir($dirfh);
+		return 1;
+	},
+	'read' => sub {
+		open(my $filefh, '<', $_[0]) or return 0;
+		binmode $filefh;
+		my $buffer;
+		while (my $got = read($filefh, $buffer, 65536)) { }
+		close($filefh);
+		return 1;
+	},
+);
+
+# Collecting the namespace once, so that it doesn't count for the workers
+my (@files, @dirs, @all);
+my $select = sub {
+	push @all, $File::Find::name;
+	push @dirs, $File::Find::name if -d $File::Find::name;
+	push @files, $File::Find::name if -f $File::Find::name;
+};
+find( { wanted => $select }, $root );
+die "Nothing to read in $root\n" unless @files;
+
+my %targets = ( 'stat' => \@all, 'list' => \@dirs, 'read' => \@files );
+my @names = sort keys %operations;
+
+# Every worker writes a line "operation microseconds success" per operation
+my @children;
+my $start = [gettimeofday];
+for my $i (1 .. $workers) {
+	my $pid = fork();
+	die "Couldn't fork: $!\n" unless defined ($pid);
+	if ($pid == 0) {
+		srand($$ ^ time());
+		open (my $recordfh, '>', "$tmpdir/cvmfs-workload.$i") or die "Couldn't open record file: $!\n";
+		my $deadline = time() + $duration;
+		while (time() < $deadline) {
+			my $name = $names[rand @names];
+			my $list = $targets{$name};
+			my $path = $list->[rand @$list];
+			my $before = [gettimeofday];
+			my $ok = $operations{$name}->($path);
+			my $us = floor(tv_interval($before) * 1000000);
+			print $recordfh "$name $us $ok\n";
+		}
+		close($recordfh);
+		exit 0;
+	}
+	push @children, $pid;
+}
+waitpid($_, 0) foreach (@children);
+my $elapsed = tv_interval($start);
+
+# Merging the records of the workers
+my (%latencies, %errors);
+for my $i (1 .. $workers) {
+	my $record = "$tmpdir/cvmfs-workload.$i";
+	open (my $recordfh, '<', $record) or next;
+	while (my $line = <$recordfh>) {
+		chomp $line;
+		my ($name, $us, $ok) = split / /, $line;
+		push @{$latencies{$name}}, $us;
+		$errors{$name}++ unless $ok;
+	}
+	close($recordfh);
+	unlink $record;
+}
+
+# Nearest rank percentile of a sorted list
+sub percentile {
+	my ($sorted, $p) = @_;
+	my $rank = int($p / 100 * @$sorted + 0.999999);
+	$rank = 1 if $rank < 1;
+	return $sorted->[$rank - 1];
+}
+
+printf("%-6s %10s %10s %8s %10s %10s %10s\n",
+       'op', 'count', 'ops/s', 'errors', 'p50 us', 'p99 us', 'p999 us');
+foreach my $name (@names) {
+	next unless defined ($latencies{$name});
+	my @sorted = sort { $a <=> $b } @{$latencies{$name}};
+	printf("%-6s %10d %10.1f %8d %10d %10d %10d\n",
+	       $name, scalar @sorted, @sorted / $elapsed, $errors{$name} || 0,
+	       percentile(\@sorted, 50), percentile(\@sorted, 99),
+	       percentile(\@sorted, 99.9));
+}
+
+exit 0;
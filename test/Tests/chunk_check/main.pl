@@ -0,0 +1,134 @@
+use strict;
+use warnings;
+use ZeroMQ qw/:all/;
+use Tests::Common qw(get_daemon_output set_stdout_stderr open_test_socket close_test_socket open_shellout_socket);
+use Getopt::Long;
+use FindBin qw($RealBin);
+
+# Variables for GetOpt
+my $outputfile = '/var/log/cvmfs-test/chunk_check.out';
+my $errorfile = '/var/log/cvmfs-test/chunk_check.err';
+my $no_clean = undef;
+
+# Socket path and socket name. Socket name is set to let the server to select
+# the socket where to send its response.
+my $testname = 'CHUNK_CHECK';
+
+# Name for the cvmfs repository, created with cvmfs_server
+my $repo_name = 'chunked.cvmfs-test.org';
+
+# Local storage of the repository
+my $storage = "/srv/cvmfs/$repo_name";
+
+# Retrieving command line options
+my $ret = GetOptions ( "stdout=s" => \$outputfile,
+					   "stderr=s" => \$errorfile,
+					   "no-clean" => \$no_clean );
+
+# Forking the process so the daemon can come back in listening mode.
+my $pid = fork();
+
+# This will be ran only by the forked process. Everything here will be logged in a file and
+# will not be sent back to the daemon.
+if (defined ($pid) and $pid == 0) {
+	# Setting STDOUT and STDERR to file in log folder.
+	set_stdout_stderr($outputfile, $errorfile);
+
+	# Opening the socket to communicate with the server and setting is identity.
+	my ($socket, $ctxt) = open_test_socket($testname);
+
+	# Opening the socket to send the output to the shell
+	my ($shell_socket, $shell_ctxt) = open_shellout_socket();
+
+	# Cleaning the environment if --no-clean is undef.
+	# See 'Tests/clean/main.pl' if you want to know what this command does.
+	if (!defined($no_clean)) {
+		print "\nCleaning the environment:\n";
+		$socket->send("clean");
+		get_daemon_output($socket);
+		sleep 5;
+	}
+	else {
+		print "\nSkipping cleaning.\n";
+	}
+
+	# A chunk removed by an earlier run would break the new revision as well
+	print 'Creating the repository... ';
+	if (-d "/etc/cvmfs/repositories.d/$repo_name") {
+		system("echo y | sudo cvmfs_server rmfs $repo_name > /dev/null");
+	}
+	system("sudo cvmfs_server mkfs $repo_name");
+	system("echo CVMFS_CHUNK_SIZE=1 | sudo tee -a /etc/cvmfs/repositories.d/$repo_name/server.conf > /dev/null");
+	print "Done.\n";
+
+	# The objects with the C suffix that are new with the revision are the
+	# chunks of the large file and the new root catalog
+	my %before = map { $_ => 1 } split(/\n/, `find $storage/data -name '*C'`);
+	print 'Publishing a chunked file... ';
+	system("sudo $RealBin/publish.sh $repo_name");
+	print "Done.\n";
+	my $root_hash = `grep ^C $storage/.cvmfspublished`;
+	chomp($root_hash);
+	$root_hash = substr($root_hash, 1);
+	my $root_catalog = "$storage/data/" . substr($root_hash, 0, 2) . '/' .
+		substr($root_hash, 2) . 'C';
+	my @chunks = grep { !$before{$_} && $_ ne $root_catalog }
+		split(/\n/, `find $storage/data -name '*C'`);
+	print 'Chunk objects: ' . join(' ', @chunks) . "\n";
+
+	if (scalar(@chunks) >= 4) {
+		$shell_socket->send("Large file stored in chunks... OK.\n");
+	}
+	else {
+		$shell_socket->send("Large file stored in " . scalar(@chunks) . " chunks... WRONG.\n");
+	}
+
+	my $output = `sudo cvmfs_server check $repo_name 2>&1`;
+	my $status = $?;
+	print $output;
+	if ($status == 0) {
+		$shell_socket->send("Complete repository passes the check... OK.\n");
+	}
+	else {
+		$shell_socket->send("Complete repository fails the check... WRONG.\n");
+	}
+
+	if (scalar(@chunks) > 0) {
+		print "Removing $chunks[0]\n";
+		system("sudo rm -f $chunks[0]");
+		my $missing = substr($chunks[0], length("$storage/data/"), 2) .
+			substr($chunks[0], length("$storage/data/") + 3, 38);
+		$output = `sudo cvmfs_server check $repo_name 2>&1`;
+		$status = $?;
+		print $output;
+		if ($status != 0 and $output =~ /file chunk $missing .*missing/) {
+			$shell_socket->send("Missing chunk detected... OK.\n");
+		}
+		else {
+			$shell_socket->send("Missing chunk $missing not detected... WRONG.\n");
+		}
+	}
+
+	print 'Removing the repository... ';
+	system("echo y | sudo cvmfs_server rmfs $repo_name > /dev/null");
+	print "Done.\n";
+
+	close_test_socket($socket, $ctxt);
+
+	$shell_socket->send("END\n");
+	close_test_socket($shell_socket, $shell_ctxt);
+}
+
+# This will be ran by the main script.
+# These lines will be sent back to the daemon and the damon will send them to the shell.
+if (defined ($pid) and $pid != 0) {
+	print "$testname test started.\n";
+	print "You can read its output in $outputfile.\n";
+	print "Errors are stored in $errorfile.\n";
+	print "PROCESSING:$testname\n";
+	# This is the line that makes the shell waiting for test output.
+	# Change whatever you want, but don't change this line or the shell will ignore exit status.
+	print "READ_RETURN_CODE\n";
+}
+
+exit 0;
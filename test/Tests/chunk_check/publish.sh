@@ -0,0 +1,12 @@
+#!/bin/sh
+#
+# Publishes a file that is larger than the chunk size of the chunk_check test
+# repository.  Without CVMFS_LEGACY_BULK_CHUNKS, it is stored as chunks only.
+#
+
+name=$1
+
+cvmfs_server transaction $name || exit 1
+dd if=/dev/urandom of=/cvmfs/$name/large bs=1M count=4 2>/dev/null
+chown $(. /etc/cvmfs/repositories.d/$name/server.conf; echo $CVMFS_USER) /cvmfs/$name/large
+cvmfs_server publish $name || exit 1
@@ -0,0 +1,136 @@
+use strict;
+use warnings;
+use ZeroMQ qw/:all/;
+use Tests::Common qw(get_daemon_output set_stdout_stderr open_test_socket close_test_socket open_shellout_socket);
+use Getopt::Long;
+use FindBin qw($RealBin);
+
+# Mount point and cache directory of the client that is remounted
+my $mnt = '/tmp/nested_remount/mnt';
+my $cache = '/tmp/nested_remount/cache';
+
+# Variables for GetOpt
+my $outputfile = '/var/log/cvmfs-test/nested_remount.out';
+my $errorfile = '/var/log/cvmfs-test/nested_remount.err';
+my $no_clean = undef;
+
+# Socket path and socket name. Socket name is set to let the server to select
+# the socket where to send its response.
+my $testname = 'NESTED_REMOUNT';
+
+# Name for the cvmfs repository, created with cvmfs_server
+my $repo_name = 'nested.cvmfs-test.org';
+
+# Retrieving command line options
+my $ret = GetOptions ( "stdout=s" => \$outputfile,
+					   "stderr=s" => \$errorfile,
+					   "no-clean" => \$no_clean );
+
+# Forking the process so the daemon can come back in listening mode.
+my $pid = fork();
+
+# This will be ran only by the forked process. Everything here will be logged in a file and
+# will not be sent back to the daemon.
+if (defined ($pid) and $pid == 0) {
+	# Setting STDOUT and STDERR to file in log folder.
+	set_stdout_stderr($outputfile, $errorfile);
+
+	# Opening the socket to communicate with the server and setting is identity.
+	my ($socket, $ctxt) = open_test_socket($testname);
+
+	# Opening the socket to send the output to the shell
+	my ($shell_socket, $shell_ctxt) = open_shellout_socket();
+
+	# Cleaning the environment if --no-clean is undef.
+	# See 'Tests/clean/main.pl' if you want to know what this command does.
+	if (!defined($no_clean)) {
+		print "\nCleaning the environment:\n";
+		$socket->send("clean");
+		get_daemon_output($socket);
+		sleep 5;
+	}
+	else {
+		print "\nSkipping cleaning.\n";
+	}
+
+	print 'Creating the repository... ';
+	unless (-d "/etc/cvmfs/repositories.d/$repo_name") {
+		system("sudo cvmfs_server mkfs $repo_name");
+	}
+	system("sudo $RealBin/publish.sh $repo_name 1");
+	print "Done.\n";
+
+	# The kernel caches are drained out after one second
+	print 'Mounting the client... ';
+	system("sudo umount $mnt > /dev/null 2>&1");
+	system("sudo rm -rf $cache");
+	system("sudo mkdir -p $mnt $cache");
+	system("sudo cvmfs2 -o cachedir=$cache,pubkey=/etc/cvmfs/keys/$repo_name.pub," .
+	       "repo_name=$repo_name,kcache_timeout=1,allow_other $mnt http://localhost/cvmfs/$repo_name");
+	print "Done.\n";
+
+	my $content = `cat $mnt/changed/file`;
+	my $changed_inode = `stat -c %i $mnt/changed/file`;
+	my $unchanged_inode = `stat -c %i $mnt/unchanged/file`;
+	chomp($content);
+	chomp($changed_inode);
+	chomp($unchanged_inode);
+	print "Revision 1: '$content', inodes $changed_inode and $unchanged_inode.\n";
+
+	print '-'x30 . 'REMOUNT' . '-'x30 . "\n";
+	system("sudo $RealBin/publish.sh $repo_name 2");
+	my $reply = `sudo cvmfs_talk -p $cache/cvmfs_io.$repo_name remount`;
+	print "Remount: $reply";
+	# The new revision is applied by the first lookup after the drainout
+	sleep 3;
+	system("ls $mnt > /dev/null");
+	system("ls $mnt/changed $mnt/unchanged > /dev/null");
+
+	$content = `cat $mnt/changed/file`;
+	chomp($content);
+	if ($content eq 'revision 2') {
+		$shell_socket->send("Changed nested catalog shows the new contents... OK.\n");
+	}
+	else {
+		$shell_socket->send("Changed nested catalog shows '$content'... WRONG.\n");
+	}
+
+	if (-f "$mnt/changed/new_file") {
+		$shell_socket->send("New file in the changed nested catalog found... OK.\n");
+	}
+	else {
+		$shell_socket->send("New file in the changed nested catalog not found... WRONG.\n");
+	}
+
+	my $remounted_inode = `stat -c %i $mnt/unchanged/file`;
+	chomp($remounted_inode);
+	if ($remounted_inode eq $unchanged_inode) {
+		$shell_socket->send("Unchanged nested catalog kept its inodes... OK.\n");
+	}
+	else {
+		$shell_socket->send("Unchanged nested catalog changed inode $unchanged_inode to $remounted_inode... WRONG.\n");
+	}
+
+	print 'Unmounting the client... ';
+	system("sudo umount $mnt");
+	print "Done.\n";
+
+	close_test_socket($socket, $ctxt);
+
+	$shell_socket->send("END\n");
+	close_test_socket($shell_socket, $shell_ctxt);
+}
+
+# This will be ran by the main script.
+# These lines will be sent back to the daemon and the damon will send them to the shell.
+if (defined ($pid) and $pid != 0) {
+	print "$testname test started.\n";
+	print "You can read its output in $outputfile.\n";
+	print "Errors are stored in $errorfile.\n";
+	print "PROCESSING:$testname\n";
+	# This is the line that makes the shell waiting for test output.
+	# Change whatever you want, but don't change this line or the shell will ignore exit status.
+	print "READ_RETURN_CODE\n";
+}
+
+exit 0;
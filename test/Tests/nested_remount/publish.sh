@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+# Publishes a revision of the nested_remount test repository.  The nested
+# catalog "changed" gets new contents with every revision, the nested catalog
+# "unchanged" stays the same.
+#
+
+name=$1
+revision=$2
+
+cvmfs_server transaction $name || exit 1
+mkdir -p /cvmfs/$name/changed /cvmfs/$name/unchanged
+touch /cvmfs/$name/changed/.cvmfscatalog /cvmfs/$name/unchanged/.cvmfscatalog
+echo "unchanged" > /cvmfs/$name/unchanged/file
+echo "revision $revision" > /cvmfs/$name/changed/file
+[ $revision -gt 1 ] && echo "added with revision $revision" > /cvmfs/$name/changed/new_file
+chown -R $(. /etc/cvmfs/repositories.d/$name/server.conf; echo $CVMFS_USER) /cvmfs/$name/changed /cvmfs/$name/unchanged
+cvmfs_server publish $name || exit 1